@@ -0,0 +1,39 @@
+#!/bin/sh
+# Measure the time to first frame and time to interactive of chatty.
+#
+# Usage: startup-benchmark.sh BUILD_DIR PROFILE_DIR [RUNS]
+#
+# PROFILE_DIR is a prepared home directory with a .purple directory
+# (accounts, blist and chatty/db/*.db), eg: a copy of a real profile.
+# It is copied for every run, so that it is never modified.  Accounts
+# are not logged in, so no network access is done.
+
+set -e
+
+if [ $# -lt 2 ]; then
+  echo "Usage: $0 BUILD_DIR PROFILE_DIR [RUNS]" >&2
+  exit 1
+fi
+
+BUILD_DIR=$(realpath "$1")
+PROFILE_DIR=$(realpath "$2")
+RUNS=${3:-5}
+
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "${WORK_DIR}"' EXIT
+
+for i in $(seq "${RUNS}"); do
+  rm -rf "${WORK_DIR}/home"
+  cp -a "${PROFILE_DIR}" "${WORK_DIR}/home"
+
+  # A private session bus, so that a running chatty isn't activated
+  HOME="${WORK_DIR}/home" \
+  XDG_CACHE_HOME="${WORK_DIR}/home/.cache" \
+  XDG_CONFIG_HOME="${WORK_DIR}/home/.config" \
+  XDG_DATA_HOME="${WORK_DIR}/home/.local/share" \
+  GSETTINGS_SCHEMA_DIR="${BUILD_DIR}/data" \
+    dbus-run-session -- "${BUILD_DIR}/src/chatty" --nologin --exit-after-startup
+done | awk -F': ' '
+  /^(first-frame|interactive): / { v = $2 + 0; n[$1]++; sum[$1] += v
+    if (!($1 in min) || v < min[$1]) min[$1] = v }
+  END { for (k in n) printf "%s: min %.1f ms, mean %.1f ms (%d runs)\n", k, min[k], sum[k] / n[k], n[k] }'
@@ -37,6 +37,10 @@
 #include "chatty-application.h"
 #include "chatty-settings.h"
 #include "chatty-history.h"
+#include "chatty-db-backup.h"
+#include "chatty-media-store.h"
+#include "chatty-trace.h"
+#include "chatty-receipts.h"
 #include "chatty-log.h"
 
 #define LIBFEEDBACK_USE_UNSTABLE_API
@@ -60,12 +64,23 @@ struct _ChattyApplication
   char *uri;
   guint open_uri_id;
 
+  /* Trace is saved here on exit, if set */
+  char *trace_file;
+
   gulong   delete_id;
+  gulong   hide_id;
   gulong   open_chat_id;
+  gulong   draw_id;
+
+  /* Startup timings, in monotonic time */
+  gint64   start_time;
+  gint64   first_frame_time;
+  gint64   ready_time;
 
   gboolean daemon;
   gboolean show_window;
   gboolean enable_debug;
+  gboolean exit_after_startup;
 };
 
 G_DEFINE_TYPE (ChattyApplication, chatty_application, GTK_TYPE_APPLICATION)
@@ -82,6 +97,17 @@ static GOptionEntry cmd_options[] = {
   { "debug", 'd', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, NULL, N_("Enable libpurple debug messages"), NULL },
   { "verbose", 'v', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK, cmd_verbose_cb,
     N_("Enable verbose libpurple debug messages"), NULL },
+  /* Used to benchmark startup, see build-aux/startup-benchmark.sh */
+  { "exit-after-startup", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE, NULL,
+    "Print startup timings and quit once ready", NULL },
+  { "restore-backup", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, NULL,
+    N_("Restore a database backup and quit"), N_("FILE") },
+  { "export-history", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, NULL,
+    N_("Export message history to DIR and quit"), N_("DIR") },
+  { "import-history", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, NULL,
+    N_("Import message history from DIR and quit"), N_("DIR") },
+  { "trace", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, NULL,
+    N_("Record a trace and save it to FILE on exit"), N_("FILE") },
   { NULL }
 };
 
@@ -228,6 +254,60 @@ application_open_uri (ChattyApplication *self)
   return G_SOURCE_REMOVE;
 }
 
+static void
+application_startup_done (ChattyApplication *self)
+{
+  g_assert (CHATTY_IS_APPLICATION (self));
+
+  if (!self->exit_after_startup || !self->ready_time ||
+      (self->show_window && !self->first_frame_time))
+    return;
+
+  if (self->first_frame_time)
+    g_print ("first-frame: %.1f ms\n", (self->first_frame_time - self->start_time) / 1000.0);
+  g_print ("interactive: %.1f ms\n", (self->ready_time - self->start_time) / 1000.0);
+
+  g_application_quit (G_APPLICATION (self));
+}
+
+static gboolean
+application_first_frame_cb (ChattyApplication *self)
+{
+  g_assert (CHATTY_IS_APPLICATION (self));
+
+  g_clear_signal_handler (&self->draw_id, self->main_window);
+  self->first_frame_time = g_get_monotonic_time ();
+  g_info ("Startup: first frame in %.1f ms",
+          (self->first_frame_time - self->start_time) / 1000.0);
+  application_startup_done (self);
+
+  return FALSE;
+}
+
+static void
+application_manager_loaded_cb (GObject      *object,
+                               GAsyncResult *result,
+                               gpointer      user_data)
+{
+  g_autoptr(ChattyApplication) self = user_data;
+  g_autoptr(GError) error = NULL;
+
+  g_assert (CHATTY_IS_APPLICATION (self));
+
+  if (!chatty_manager_load_finish (CHATTY_MANAGER (object), result, &error))
+    g_warning ("Error loading: %s", error->message);
+
+  self->ready_time = g_get_monotonic_time ();
+
+  /* Open with some delay so that the modem is ready when not in daemon mode */
+  if (self->uri && !self->open_uri_id)
+    self->open_uri_id = g_timeout_add (100,
+                                       G_SOURCE_FUNC (application_open_uri),
+                                       self);
+
+  application_startup_done (self);
+}
+
 static void
 chatty_application_show_window (GSimpleAction *action,
                                 GVariant      *parameter,
@@ -241,6 +321,61 @@ chatty_application_show_window (GSimpleAction *action,
   gtk_window_present (GTK_WINDOW (self->main_window));
 }
 
+/*
+ * Save the trace recorded so far, eg:
+ * gapplication action sm.puri.Chatty export-trace "'/tmp/chatty-trace.json'"
+ */
+static void
+chatty_application_export_trace (GSimpleAction *action,
+                                 GVariant      *parameter,
+                                 gpointer       user_data)
+{
+  g_autoptr(GError) error = NULL;
+  const char *file_name;
+
+  g_assert (CHATTY_IS_APPLICATION (user_data));
+
+  file_name = g_variant_get_string (parameter, NULL);
+
+  if (chatty_trace_export (file_name, &error))
+    g_info ("Trace saved to %s", file_name);
+  else
+    g_warning ("Error saving trace to %s: %s", file_name, error->message);
+}
+
+/*
+ * Log the memory used by the messages of each chat, eg:
+ * gapplication action sm.puri.Chatty debug-info
+ */
+static void
+chatty_application_debug_info (GSimpleAction *action,
+                               GVariant      *parameter,
+                               gpointer       user_data)
+{
+  ChattyApplication *self = user_data;
+  g_autofree char *info = NULL;
+
+  g_assert (CHATTY_IS_APPLICATION (self));
+
+  info = chatty_eviction_manager_get_debug_info (chatty_manager_get_eviction_manager (self->manager));
+  g_message ("Message memory usage:\n%s", info);
+}
+
+static void
+application_window_hidden_cb (ChattyApplication *self)
+{
+  ChattyEvictionManager *eviction;
+  guint n_keep;
+
+  g_assert (CHATTY_IS_APPLICATION (self));
+
+  /* The messages of chats not shown are reloaded from history when required */
+  eviction = chatty_manager_get_eviction_manager (self->manager);
+  n_keep = chatty_settings_get_inactive_chat_messages (self->settings);
+  g_debug ("Window hidden, dropped %u messages",
+           chatty_eviction_manager_trim (eviction, n_keep));
+}
+
 static void
 chatty_application_finalize (GObject *object)
 {
@@ -248,22 +383,156 @@ chatty_application_finalize (GObject *object)
 
   g_clear_signal_handler (&self->open_chat_id, self->manager);
   g_clear_signal_handler (&self->delete_id, self->main_window);
+  g_clear_signal_handler (&self->hide_id, self->main_window);
+  g_clear_signal_handler (&self->draw_id, self->main_window);
 
   g_clear_handle_id (&self->open_uri_id, g_source_remove);
   g_clear_object (&self->manager);
+  g_free (self->trace_file);
 
   G_OBJECT_CLASS (chatty_application_parent_class)->finalize (object);
 }
 
+static int
+application_restore_backup (GApplication *application,
+                            const char   *backup_path)
+{
+  g_autofree char *db_name = NULL;
+  g_autofree char *db_dir = NULL;
+  g_autofree char *db_path = NULL;
+  g_autoptr(GError) error = NULL;
+
+  db_name = chatty_db_backup_get_db_name (backup_path);
+
+  if (g_strcmp0 (db_name, "chatty-history.db") != 0 &&
+      g_strcmp0 (db_name, "matrix.db") != 0) {
+    g_printerr ("%s is not a backup of a chatty database\n", backup_path);
+    return 1;
+  }
+
+  /* Don't replace the database under a running chatty */
+  if (!g_application_register (application, NULL, &error) ||
+      g_application_get_is_remote (application)) {
+    g_printerr ("Can't restore backup while chatty is running%s%s\n",
+                error ? ": " : "", error ? error->message : "");
+    return 1;
+  }
+
+  db_dir = g_build_filename (purple_user_dir (), "chatty", "db", NULL);
+  db_path = g_build_filename (db_dir, db_name, NULL);
+  g_mkdir_with_parents (db_dir, S_IRWXU);
+
+  if (!chatty_db_backup_restore (backup_path, db_path, &error)) {
+    g_printerr ("Error restoring %s: %s\n", backup_path, error->message);
+    return 1;
+  }
+
+  g_print ("Restored %s from %s\n", db_path, backup_path);
+
+  return 0;
+}
+
+static void
+application_history_result_cb (GObject      *object,
+                               GAsyncResult *result,
+                               gpointer      user_data)
+{
+  GAsyncResult **out = user_data;
+
+  *out = g_object_ref (result);
+}
+
+/* Export history to, or import history from, @dir */
+static int
+application_transfer_history (GApplication *application,
+                              const char   *dir,
+                              gboolean      import)
+{
+  g_autoptr(ChattyHistory) history = NULL;
+  g_autoptr(GAsyncResult) result = NULL;
+  g_autoptr(GTimer) timer = NULL;
+  g_autoptr(GError) error = NULL;
+  gint64 n_messages;
+  double elapsed;
+
+  /* The history is changed by a running chatty */
+  if (!g_application_register (application, NULL, &error) ||
+      g_application_get_is_remote (application)) {
+    g_printerr ("Can't %s history while chatty is running%s%s\n",
+                import ? "import" : "export",
+                error ? ": " : "", error ? error->message : "");
+    return 1;
+  }
+
+  history = chatty_history_new ();
+  chatty_history_open_async (history,
+                             g_build_filename (purple_user_dir (), "chatty", "db", NULL),
+                             "chatty-history.db", application_history_result_cb, &result);
+
+  while (!result)
+    g_main_context_iteration (NULL, TRUE);
+
+  if (!chatty_history_open_finish (history, result, &error)) {
+    g_printerr ("Error opening history: %s\n", error->message);
+    return 1;
+  }
+
+  g_clear_object (&result);
+  timer = g_timer_new ();
+
+  if (import)
+    chatty_history_import_async (history, dir, NULL, application_history_result_cb, &result);
+  else
+    chatty_history_export_async (history, dir, NULL, application_history_result_cb, &result);
+
+  while (!result)
+    g_main_context_iteration (NULL, TRUE);
+
+  if (import)
+    n_messages = chatty_history_import_finish (history, result, &error);
+  else
+    n_messages = chatty_history_export_finish (history, result, &error);
+
+  elapsed = g_timer_elapsed (timer, NULL);
+  chatty_history_close (history);
+
+  if (n_messages < 0) {
+    g_printerr ("Error %s history: %s\n", import ? "importing" : "exporting", error->message);
+    return 1;
+  }
+
+  g_print ("%s %" G_GINT64_FORMAT " messages in %.2f s (%.0f messages/s)\n",
+           import ? "Imported" : "Exported", n_messages, elapsed,
+           n_messages / MAX (elapsed, 0.001));
+
+  return 0;
+}
+
 static gint
 chatty_application_handle_local_options (GApplication *application,
                                          GVariantDict *options)
 {
+  ChattyApplication *self = (ChattyApplication *)application;
+  const char *backup_path, *history_dir;
+
   if (g_variant_dict_contains (options, "version")) {
     g_print ("%s %s\n", PACKAGE_NAME, GIT_VERSION);
     return 0;
   }
 
+  if (g_variant_dict_lookup (options, "restore-backup", "^&ay", &backup_path))
+    return application_restore_backup (application, backup_path);
+
+  if (g_variant_dict_lookup (options, "export-history", "^&ay", &history_dir))
+    return application_transfer_history (application, history_dir, FALSE);
+
+  if (g_variant_dict_lookup (options, "import-history", "^&ay", &history_dir))
+    return application_transfer_history (application, history_dir, TRUE);
+
+  /* Start tracing as early as possible */
+  if (g_variant_dict_lookup (options, "trace", "^ay", &self->trace_file))
+    chatty_trace_init ();
+
   return -1;
 }
 
@@ -296,6 +565,9 @@ chatty_application_command_line (GApplication            *application,
   if (g_variant_dict_contains (options, "debug"))
     self->enable_debug = TRUE;
 
+  if (g_variant_dict_contains (options, "exit-after-startup"))
+    self->exit_after_startup = TRUE;
+
   purple_debug_set_enabled (self->enable_debug);
   purple_debug_set_verbose (chatty_log_get_verbosity () > 0);
 
@@ -318,12 +590,14 @@ chatty_application_startup (GApplication *application)
 {
   ChattyApplication *self = (ChattyApplication *)application;
   g_autoptr(GtkCssProvider) provider = NULL;
-  g_autofree char *db_path = NULL;
   g_autofree char *dir = NULL;
   static const GActionEntry app_entries[] = {
     { "show-window", chatty_application_show_window },
+    { "export-trace", chatty_application_export_trace, "s" },
+    { "debug-info", chatty_application_debug_info },
   };
 
+  self->start_time = g_get_monotonic_time ();
   self->daemon = FALSE;
   self->manager = chatty_manager_get_default ();
 
@@ -335,13 +609,10 @@ chatty_application_startup (GApplication *application)
 
   g_set_application_name (_("Chats"));
 
-  dir = g_build_filename (g_get_user_cache_dir (), "chatty", "matrix", "files", "thumbnail", NULL);
+  dir = chatty_media_store_get_dir ();
   g_mkdir_with_parents (dir, S_IRWXU);
 
   lfb_init (CHATTY_APP_ID, NULL);
-  db_path =  g_build_filename (purple_user_dir(), "chatty", "db", NULL);
-  chatty_history_open (chatty_manager_get_history (self->manager),
-                       db_path, "chatty-history.db");
 
   self->settings = chatty_settings_get_default ();
   if (chatty_settings_get_experimental_features (self->settings))
@@ -379,9 +650,14 @@ chatty_application_activate (GApplication *application)
 
   if (!self->main_window) {
     self->main_window = chatty_window_new (app);
-
-    chatty_manager_purple (self->manager);
     g_object_add_weak_pointer (G_OBJECT (self->main_window), (gpointer *)&self->main_window);
+    self->draw_id = g_signal_connect_object (self->main_window, "draw",
+                                             G_CALLBACK (application_first_frame_cb),
+                                             self, G_CONNECT_SWAPPED | G_CONNECT_AFTER);
+
+    /* The window is shown with the chats as they are loaded */
+    chatty_manager_load_async (self->manager, application_manager_loaded_cb,
+                               g_object_ref (self));
   }
 
   if (self->daemon && !self->delete_id)
@@ -389,6 +665,11 @@ chatty_application_activate (GApplication *application)
                                         G_CALLBACK (gtk_widget_hide_on_delete),
                                         NULL);
 
+  if (self->daemon && !self->hide_id)
+    self->hide_id = g_signal_connect_swapped (self->main_window, "hide",
+                                              G_CALLBACK (application_window_hidden_cb),
+                                              self);
+
   if (!self->open_chat_id)
     self->open_chat_id = g_signal_connect_swapped (self->manager, "open-chat",
                                                    G_CALLBACK (application_open_chat),
@@ -398,7 +679,7 @@ chatty_application_activate (GApplication *application)
     gtk_window_present (GTK_WINDOW (self->main_window));
 
   /* Open with some delay so that the modem is ready when not in daemon mode */
-  if (self->uri)
+  if (self->uri && self->ready_time && !self->open_uri_id)
     self->open_uri_id = g_timeout_add (100,
                                        G_SOURCE_FUNC (application_open_uri),
                                        self);
@@ -410,9 +691,18 @@ chatty_application_shutdown (GApplication *application)
   ChattyApplication *self = (ChattyApplication *)application;
 
   g_object_unref (chatty_settings_get_default ());
+  /* Save pending message status before the history is closed */
+  chatty_receipts_save (chatty_receipts_get_default ());
   chatty_history_close (chatty_manager_get_history (self->manager));
   lfb_uninit ();
 
+  if (self->trace_file) {
+    g_autoptr(GError) error = NULL;
+
+    if (!chatty_trace_export (self->trace_file, &error))
+      g_warning ("Error saving trace to %s: %s", self->trace_file, error->message);
+  }
+
   G_APPLICATION_CLASS (chatty_application_parent_class)->shutdown (application);
 }
 
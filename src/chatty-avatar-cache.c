@@ -0,0 +1,633 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-avatar-cache.c
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "chatty-avatar-cache"
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <gdk/gdk.h>
+
+#include "chatty-avatar-cache.h"
+#include "chatty-log.h"
+
+/**
+ * SECTION: chatty-avatar-cache
+ * @title: ChattyAvatarCache
+ * @short_description: Application wide cache of decoded avatars
+ * @include: "chatty-avatar-cache.h"
+ *
+ * Avatars are keyed by the SHA-256 of the image data and the
+ * requested size, so that the same image used by different
+ * items (or loaded again) is decoded only once.  Images are
+ * decoded in a worker thread.  The circular variant used for
+ * notifications is created on demand and cached along with
+ * the avatar.  The least recently used avatars are dropped
+ * when the memory used exceeds the budget.
+ */
+
+#define DEFAULT_BUDGET (8 * 1024 * 1024)
+
+struct _ChattyAvatarCache
+{
+  GObject     parent_instance;
+
+  /* Protects all the members below */
+  GMutex      mutex;
+  GHashTable *entries;
+  /* Most recently used at head */
+  GQueue      lru;
+  gsize       used;
+  gsize       budget;
+  guint       hits;
+  guint       misses;
+};
+
+typedef struct {
+  char      *key;
+  GdkPixbuf *pixbuf;
+  GdkPixbuf *round;
+  gsize      size;
+  GList      link;
+} CacheEntry;
+
+typedef struct {
+  GBytes *data;
+  char   *path;
+  char   *key;
+  int     size;
+} LoadData;
+
+G_DEFINE_TYPE (ChattyAvatarCache, chatty_avatar_cache, G_TYPE_OBJECT)
+
+static void
+cache_entry_free (CacheEntry *entry)
+{
+  g_clear_object (&entry->pixbuf);
+  g_clear_object (&entry->round);
+  g_free (entry->key);
+  g_free (entry);
+}
+
+static void
+load_data_free (LoadData *data)
+{
+  g_clear_pointer (&data->data, g_bytes_unref);
+  g_free (data->path);
+  g_free (data->key);
+  g_free (data);
+}
+
+static char *
+avatar_cache_get_key (GBytes *data,
+                      int     size)
+{
+  g_autofree char *checksum = NULL;
+
+  checksum = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, data);
+
+  return g_strdup_printf ("%s:%d", checksum, size);
+}
+
+static void
+avatar_cache_log_stats (ChattyAvatarCache *self)
+{
+  guint total;
+
+  total = self->hits + self->misses;
+  CHATTY_TRACE_MSG ("%u hits, %u misses (%.1f%% hit rate), %u avatars, %" G_GSIZE_FORMAT " bytes",
+                    self->hits, self->misses, total ? self->hits * 100.0 / total : 0.0,
+                    g_hash_table_size (self->entries), self->used);
+}
+
+static void
+avatar_cache_trim_locked (ChattyAvatarCache *self)
+{
+  while (self->used > self->budget && self->lru.tail) {
+    CacheEntry *entry = self->lru.tail->data;
+
+    g_queue_unlink (&self->lru, &entry->link);
+    self->used -= entry->size;
+    g_hash_table_remove (self->entries, entry->key);
+  }
+}
+
+/* Returns a new reference to the cached pixbuf, if found */
+static GdkPixbuf *
+avatar_cache_lookup_locked (ChattyAvatarCache *self,
+                            const char        *key)
+{
+  CacheEntry *entry;
+
+  entry = g_hash_table_lookup (self->entries, key);
+
+  if (entry)
+    self->hits++;
+  else
+    self->misses++;
+
+  /* Log the stats only once in a while, misses are common on startup */
+  if ((self->hits + self->misses) % 100 == 0)
+    avatar_cache_log_stats (self);
+
+  if (!entry)
+    return NULL;
+
+  g_queue_unlink (&self->lru, &entry->link);
+  g_queue_push_head_link (&self->lru, &entry->link);
+
+  return g_object_ref (entry->pixbuf);
+}
+
+/* Returns a new reference to the cached pixbuf, which may
+ * be a different one if the key got inserted meanwhile */
+static GdkPixbuf *
+avatar_cache_insert (ChattyAvatarCache *self,
+                     const char        *key,
+                     GdkPixbuf         *pixbuf)
+{
+  CacheEntry *entry;
+  GdkPixbuf *cached;
+
+  g_mutex_lock (&self->mutex);
+
+  entry = g_hash_table_lookup (self->entries, key);
+
+  if (entry) {
+    cached = g_object_ref (entry->pixbuf);
+    g_mutex_unlock (&self->mutex);
+
+    return cached;
+  }
+
+  g_object_set_data_full (G_OBJECT (pixbuf), "chatty-avatar-cache-key",
+                          g_strdup (key), g_free);
+
+  entry = g_new0 (CacheEntry, 1);
+  entry->key = g_strdup (key);
+  entry->pixbuf = g_object_ref (pixbuf);
+  entry->size = gdk_pixbuf_get_byte_length (pixbuf);
+  entry->link.data = entry;
+
+  g_hash_table_insert (self->entries, entry->key, entry);
+  g_queue_push_head_link (&self->lru, &entry->link);
+  self->used += entry->size;
+  avatar_cache_trim_locked (self);
+
+  g_mutex_unlock (&self->mutex);
+
+  return g_object_ref (pixbuf);
+}
+
+static void
+avatar_size_prepared_cb (GdkPixbufLoader *loader,
+                         int              width,
+                         int              height,
+                         gpointer         user_data)
+{
+  int size = GPOINTER_TO_INT (user_data);
+
+  /* Only scale down, preserving the aspect ratio */
+  if (width <= size && height <= size)
+    return;
+
+  if (width > height)
+    gdk_pixbuf_loader_set_size (loader, size, MAX (1, (int)((double)height * size / width)));
+  else
+    gdk_pixbuf_loader_set_size (loader, MAX (1, (int)((double)width * size / height)), size);
+}
+
+static GdkPixbuf *
+avatar_decode (GBytes  *data,
+               int      size,
+               GError **error)
+{
+  g_autoptr(GdkPixbufLoader) loader = NULL;
+  GdkPixbuf *pixbuf;
+
+  loader = gdk_pixbuf_loader_new ();
+
+  if (size > 0)
+    g_signal_connect (loader, "size-prepared",
+                      G_CALLBACK (avatar_size_prepared_cb),
+                      GINT_TO_POINTER (size));
+
+  if (!gdk_pixbuf_loader_write_bytes (loader, data, error) ||
+      !gdk_pixbuf_loader_close (loader, error))
+    return NULL;
+
+  pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+
+  if (!pixbuf) {
+    g_set_error (error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+                 "Failed to create pixbuf");
+    return NULL;
+  }
+
+  return g_object_ref (pixbuf);
+}
+
+static void
+avatar_cache_load_thread (GTask        *task,
+                          gpointer      source_object,
+                          gpointer      task_data,
+                          GCancellable *cancellable)
+{
+  ChattyAvatarCache *self = source_object;
+  LoadData *data = task_data;
+  g_autoptr(GdkPixbuf) pixbuf = NULL;
+  GError *error = NULL;
+
+  if (data->path) {
+    g_autoptr(GFile) file = NULL;
+    char *contents;
+    gsize length;
+
+    file = g_file_new_for_path (data->path);
+
+    if (!g_file_load_contents (file, cancellable, &contents, &length, NULL, &error)) {
+      g_task_return_error (task, error);
+      return;
+    }
+
+    data->data = g_bytes_new_take (contents, length);
+    data->key = avatar_cache_get_key (data->data, data->size);
+
+    g_mutex_lock (&self->mutex);
+    pixbuf = avatar_cache_lookup_locked (self, data->key);
+    g_mutex_unlock (&self->mutex);
+
+    if (pixbuf) {
+      g_task_return_pointer (task, g_steal_pointer (&pixbuf), g_object_unref);
+      return;
+    }
+  }
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  pixbuf = avatar_decode (data->data, data->size, &error);
+
+  if (!pixbuf) {
+    g_task_return_error (task, error);
+    return;
+  }
+
+  g_task_return_pointer (task, avatar_cache_insert (self, data->key, pixbuf),
+                         g_object_unref);
+}
+
+static GdkPixbuf *
+avatar_create_round (GdkPixbuf *pixbuf)
+{
+  g_autoptr(GdkPixbuf) image = NULL;
+  cairo_surface_t *surface;
+  GdkPixbuf *round;
+  cairo_t *cr;
+  int width, height, size;
+
+  width  = gdk_pixbuf_get_width (pixbuf);
+  height = gdk_pixbuf_get_height (pixbuf);
+  size   = MIN (width, height);
+  image  = gdk_pixbuf_new (GDK_COLORSPACE_RGB, TRUE, 8, size, size);
+
+  gdk_pixbuf_scale (pixbuf, image, 0, 0,
+                    size, size,
+                    0, 0,
+                    (double)size / width,
+                    (double)size / height,
+                    GDK_INTERP_BILINEAR);
+
+  surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, size, size);
+  cr = cairo_create (surface);
+  gdk_cairo_set_source_pixbuf (cr, image, 0, 0);
+
+  cairo_arc (cr, size / 2.0, size / 2.0, size / 2.0, 0, 2 * G_PI);
+  cairo_clip (cr);
+  cairo_paint (cr);
+
+  round = gdk_pixbuf_get_from_surface (surface, 0, 0, size, size);
+
+  cairo_surface_destroy (surface);
+  cairo_destroy (cr);
+
+  return round;
+}
+
+static void
+chatty_avatar_cache_finalize (GObject *object)
+{
+  ChattyAvatarCache *self = (ChattyAvatarCache *)object;
+
+  g_queue_clear (&self->lru);
+  g_hash_table_unref (self->entries);
+  g_mutex_clear (&self->mutex);
+
+  G_OBJECT_CLASS (chatty_avatar_cache_parent_class)->finalize (object);
+}
+
+static void
+chatty_avatar_cache_class_init (ChattyAvatarCacheClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = chatty_avatar_cache_finalize;
+}
+
+static void
+chatty_avatar_cache_init (ChattyAvatarCache *self)
+{
+  g_mutex_init (&self->mutex);
+  self->entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         NULL, (GDestroyNotify)cache_entry_free);
+  self->budget = DEFAULT_BUDGET;
+}
+
+/**
+ * chatty_avatar_cache_get_default:
+ *
+ * Get the default avatar cache
+ *
+ * Returns: (transfer none): A #ChattyAvatarCache.
+ */
+ChattyAvatarCache *
+chatty_avatar_cache_get_default (void)
+{
+  static ChattyAvatarCache *self;
+
+  if (!self) {
+    self = g_object_new (CHATTY_TYPE_AVATAR_CACHE, NULL);
+    g_object_add_weak_pointer (G_OBJECT (self), (gpointer *)&self);
+  }
+
+  return self;
+}
+
+/**
+ * chatty_avatar_cache_set_budget:
+ * @self: A #ChattyAvatarCache
+ * @budget: The maximum memory in bytes
+ *
+ * Set the maximum memory used by the cached avatars,
+ * including their circular variants.
+ */
+void
+chatty_avatar_cache_set_budget (ChattyAvatarCache *self,
+                                gsize              budget)
+{
+  g_return_if_fail (CHATTY_IS_AVATAR_CACHE (self));
+
+  g_mutex_lock (&self->mutex);
+  self->budget = budget;
+  avatar_cache_trim_locked (self);
+  g_mutex_unlock (&self->mutex);
+}
+
+gsize
+chatty_avatar_cache_get_used (ChattyAvatarCache *self)
+{
+  gsize used;
+
+  g_return_val_if_fail (CHATTY_IS_AVATAR_CACHE (self), 0);
+
+  g_mutex_lock (&self->mutex);
+  used = self->used;
+  g_mutex_unlock (&self->mutex);
+
+  return used;
+}
+
+void
+chatty_avatar_cache_get_stats (ChattyAvatarCache *self,
+                               guint             *hits,
+                               guint             *misses)
+{
+  g_return_if_fail (CHATTY_IS_AVATAR_CACHE (self));
+
+  g_mutex_lock (&self->mutex);
+
+  if (hits)
+    *hits = self->hits;
+  if (misses)
+    *misses = self->misses;
+
+  g_mutex_unlock (&self->mutex);
+}
+
+/**
+ * chatty_avatar_cache_lookup:
+ * @self: A #ChattyAvatarCache
+ * @data: The image data
+ * @size: The maximum width and height of the avatar
+ *
+ * Get the avatar for @data from the cache, if it was
+ * already loaded with the same @size.
+ *
+ * Returns: (transfer full) (nullable): A #GdkPixbuf
+ * or %NULL if not in cache.
+ */
+GdkPixbuf *
+chatty_avatar_cache_lookup (ChattyAvatarCache *self,
+                            GBytes            *data,
+                            int                size)
+{
+  g_autofree char *key = NULL;
+  GdkPixbuf *pixbuf;
+
+  g_return_val_if_fail (CHATTY_IS_AVATAR_CACHE (self), NULL);
+  g_return_val_if_fail (data, NULL);
+
+  key = avatar_cache_get_key (data, size);
+
+  g_mutex_lock (&self->mutex);
+  pixbuf = avatar_cache_lookup_locked (self, key);
+  g_mutex_unlock (&self->mutex);
+
+  return pixbuf;
+}
+
+/**
+ * chatty_avatar_cache_load_async:
+ * @self: A #ChattyAvatarCache
+ * @data: The image data
+ * @size: The maximum width and height of the avatar, or 0
+ * @cancellable: (nullable): A #GCancellable
+ * @callback: The callback to run when loaded
+ * @user_data: user data for @callback
+ *
+ * Load the avatar from @data.  If the avatar is larger
+ * than @size pixels, it’s scaled down at load time,
+ * preserving the aspect ratio.  The image is decoded
+ * in a worker thread, unless it’s already in cache.
+ */
+void
+chatty_avatar_cache_load_async (ChattyAvatarCache   *self,
+                                GBytes              *data,
+                                int                  size,
+                                GCancellable        *cancellable,
+                                GAsyncReadyCallback  callback,
+                                gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  GdkPixbuf *pixbuf;
+  LoadData *load_data;
+  g_autofree char *key = NULL;
+
+  g_return_if_fail (CHATTY_IS_AVATAR_CACHE (self));
+  g_return_if_fail (data);
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, chatty_avatar_cache_load_async);
+
+  key = avatar_cache_get_key (data, size);
+
+  g_mutex_lock (&self->mutex);
+  pixbuf = avatar_cache_lookup_locked (self, key);
+  g_mutex_unlock (&self->mutex);
+
+  if (pixbuf) {
+    g_task_return_pointer (task, pixbuf, g_object_unref);
+    return;
+  }
+
+  load_data = g_new0 (LoadData, 1);
+  load_data->data = g_bytes_ref (data);
+  load_data->key = g_steal_pointer (&key);
+  load_data->size = size;
+  g_task_set_task_data (task, load_data, (GDestroyNotify)load_data_free);
+
+  g_task_run_in_thread (task, avatar_cache_load_thread);
+}
+
+/**
+ * chatty_avatar_cache_load_file_async:
+ * @self: A #ChattyAvatarCache
+ * @path: The path to image file
+ * @size: The maximum width and height of the avatar, or 0
+ * @cancellable: (nullable): A #GCancellable
+ * @callback: The callback to run when loaded
+ * @user_data: user data for @callback
+ *
+ * Same as chatty_avatar_cache_load_async(), but the
+ * data is read from @path in the worker thread.
+ */
+void
+chatty_avatar_cache_load_file_async (ChattyAvatarCache   *self,
+                                     const char          *path,
+                                     int                  size,
+                                     GCancellable        *cancellable,
+                                     GAsyncReadyCallback  callback,
+                                     gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  LoadData *load_data;
+
+  g_return_if_fail (CHATTY_IS_AVATAR_CACHE (self));
+  g_return_if_fail (path && *path);
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, chatty_avatar_cache_load_file_async);
+
+  load_data = g_new0 (LoadData, 1);
+  load_data->path = g_strdup (path);
+  load_data->size = size;
+  g_task_set_task_data (task, load_data, (GDestroyNotify)load_data_free);
+
+  g_task_run_in_thread (task, avatar_cache_load_thread);
+}
+
+/**
+ * chatty_avatar_cache_load_finish:
+ * @self: A #ChattyAvatarCache
+ * @result: A #GAsyncResult
+ * @error: return location for a #GError, or %NULL
+ *
+ * Finish the operation started with
+ * chatty_avatar_cache_load_async() or
+ * chatty_avatar_cache_load_file_async().
+ *
+ * Returns: (transfer full): The avatar, or %NULL on error.
+ */
+GdkPixbuf *
+chatty_avatar_cache_load_finish (ChattyAvatarCache  *self,
+                                 GAsyncResult       *result,
+                                 GError            **error)
+{
+  g_return_val_if_fail (CHATTY_IS_AVATAR_CACHE (self), NULL);
+  g_return_val_if_fail (G_IS_TASK (result), NULL);
+  g_return_val_if_fail (!error || !*error, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+/**
+ * chatty_avatar_cache_get_round:
+ * @self: A #ChattyAvatarCache
+ * @avatar: (nullable): A #GdkPixbuf
+ *
+ * Get a square crop of @avatar, clipped to a circle.
+ * The result is cached along with @avatar, so that
+ * it’s created only once.
+ *
+ * Returns: (transfer full) (nullable): The circular
+ * avatar, or %NULL if @avatar is %NULL.
+ */
+GdkPixbuf *
+chatty_avatar_cache_get_round (ChattyAvatarCache *self,
+                               GdkPixbuf         *avatar)
+{
+  CacheEntry *entry = NULL;
+  GdkPixbuf *round;
+  const char *key;
+
+  g_return_val_if_fail (CHATTY_IS_AVATAR_CACHE (self), NULL);
+  g_return_val_if_fail (!avatar || GDK_IS_PIXBUF (avatar), NULL);
+
+  if (!avatar)
+    return NULL;
+
+  key = g_object_get_data (G_OBJECT (avatar), "chatty-avatar-cache-key");
+
+  g_mutex_lock (&self->mutex);
+
+  if (key)
+    entry = g_hash_table_lookup (self->entries, key);
+
+  if (entry && entry->pixbuf == avatar) {
+    if (!entry->round) {
+      entry->round = avatar_create_round (avatar);
+      entry->size += gdk_pixbuf_get_byte_length (entry->round);
+      self->used += gdk_pixbuf_get_byte_length (entry->round);
+    }
+
+    round = g_object_ref (entry->round);
+    avatar_cache_trim_locked (self);
+    g_mutex_unlock (&self->mutex);
+
+    return round;
+  }
+
+  g_mutex_unlock (&self->mutex);
+
+  /* Not from cache, keep the circular variant with the avatar itself */
+  round = g_object_get_data (G_OBJECT (avatar), "chatty-avatar-round");
+
+  if (!round) {
+    round = avatar_create_round (avatar);
+    g_object_set_data_full (G_OBJECT (avatar), "chatty-avatar-round",
+                            round, g_object_unref);
+  }
+
+  return g_object_ref (round);
+}
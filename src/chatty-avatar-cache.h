@@ -0,0 +1,54 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-avatar-cache.h
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+G_BEGIN_DECLS
+
+/* Largest avatar shown (96px) at scale factor 2 */
+#define CHATTY_AVATAR_CACHE_SIZE 192
+
+#define CHATTY_TYPE_AVATAR_CACHE (chatty_avatar_cache_get_type ())
+
+G_DECLARE_FINAL_TYPE (ChattyAvatarCache, chatty_avatar_cache, CHATTY, AVATAR_CACHE, GObject)
+
+ChattyAvatarCache *chatty_avatar_cache_get_default     (void);
+void               chatty_avatar_cache_set_budget      (ChattyAvatarCache    *self,
+                                                        gsize                 budget);
+gsize              chatty_avatar_cache_get_used        (ChattyAvatarCache    *self);
+void               chatty_avatar_cache_get_stats       (ChattyAvatarCache    *self,
+                                                        guint                *hits,
+                                                        guint                *misses);
+GdkPixbuf         *chatty_avatar_cache_lookup          (ChattyAvatarCache    *self,
+                                                        GBytes               *data,
+                                                        int                   size);
+void               chatty_avatar_cache_load_async      (ChattyAvatarCache    *self,
+                                                        GBytes               *data,
+                                                        int                   size,
+                                                        GCancellable         *cancellable,
+                                                        GAsyncReadyCallback   callback,
+                                                        gpointer              user_data);
+void               chatty_avatar_cache_load_file_async (ChattyAvatarCache    *self,
+                                                        const char           *path,
+                                                        int                   size,
+                                                        GCancellable         *cancellable,
+                                                        GAsyncReadyCallback   callback,
+                                                        gpointer              user_data);
+GdkPixbuf         *chatty_avatar_cache_load_finish     (ChattyAvatarCache    *self,
+                                                        GAsyncResult         *result,
+                                                        GError              **error);
+GdkPixbuf         *chatty_avatar_cache_get_round       (ChattyAvatarCache    *self,
+                                                        GdkPixbuf            *avatar);
+
+G_END_DECLS
@@ -22,6 +22,8 @@
 #include "users/chatty-contact.h"
 #include "users/chatty-pp-buddy.h"
 #include "chatty-message-row.h"
+#include "chatty-trace.h"
+#include "contrib/gtk.h"
 #include "chatty-chat-view.h"
 
 struct _ChattyChatView
@@ -46,6 +48,11 @@ struct _ChattyChatView
   GtkTextBuffer *message_input_buffer;
   GtkAdjustment *vadjustment;
 
+  /* The window of messages from the chat that has rows created */
+  GtkSliceListModel *message_window;
+  GListModel        *message_model;
+  gboolean           window_at_end;
+
   /* Signal ids */
   GBinding   *history_binding;
 
@@ -62,6 +69,12 @@ static GHashTable *ht_sms_id = NULL;
 #define INDICATOR_MARGIN   2
 #define MSG_BUBBLE_MAX_RATIO .3
 
+/* Number of message rows created initially, the number of rows
+ * added when scrolled to an edge, and the maximum number of rows */
+#define MESSAGE_WINDOW_SIZE  50
+#define MESSAGE_WINDOW_STEP  25
+#define MESSAGE_WINDOW_MAX  150
+
 G_DEFINE_TYPE (ChattyChatView, chatty_chat_view, GTK_TYPE_BOX)
 
 
@@ -247,11 +260,79 @@ chatty_update_typing_status (ChattyChatView *self)
   chatty_chat_set_typing (self->chat, !empty);
 }
 
+/* Move the message window to show the latest messages */
+static void
+chat_view_window_reset (ChattyChatView *self)
+{
+  guint n_items = 0;
+
+  g_assert (CHATTY_IS_CHAT_VIEW (self));
+
+  if (self->message_model)
+    n_items = g_list_model_get_n_items (self->message_model);
+
+  gtk_slice_list_model_set_size (self->message_window, MESSAGE_WINDOW_SIZE);
+  gtk_slice_list_model_set_offset (self->message_window,
+                                   n_items > MESSAGE_WINDOW_SIZE ? n_items - MESSAGE_WINDOW_SIZE : 0);
+  self->window_at_end = TRUE;
+}
+
+static void
+chat_view_window_update_at_end (ChattyChatView *self)
+{
+  guint n_items, offset, size;
+
+  g_assert (CHATTY_IS_CHAT_VIEW (self));
+
+  n_items = g_list_model_get_n_items (self->message_model);
+  offset = gtk_slice_list_model_get_offset (self->message_window);
+  size = gtk_slice_list_model_get_size (self->message_window);
+
+  self->window_at_end = offset + size >= n_items;
+
+  g_debug ("Message window: offset %u, size %u of %u messages",
+           offset, size, n_items);
+}
+
+static void
+chat_view_messages_changed_cb (ChattyChatView *self,
+                               guint           position,
+                               guint           removed,
+                               guint           added)
+{
+  guint n_items, offset, size;
+
+  g_assert (CHATTY_IS_CHAT_VIEW (self));
+
+  n_items = g_list_model_get_n_items (self->message_model);
+  offset = gtk_slice_list_model_get_offset (self->message_window);
+  size = gtk_slice_list_model_get_size (self->message_window);
+
+  /* Past messages loaded while the window is at the top, grow the window upwards */
+  if (position == 0 && offset == 0 && added > removed) {
+    gtk_slice_list_model_set_size (self->message_window,
+                                   MIN (size + added - removed, MESSAGE_WINDOW_MAX));
+  } else if (self->window_at_end && offset + size < n_items) {
+    /* New messages, grow the window or slide it to show them */
+    if (n_items - offset <= MESSAGE_WINDOW_MAX) {
+      gtk_slice_list_model_set_size (self->message_window, n_items - offset);
+    } else {
+      gtk_slice_list_model_set_size (self->message_window, MESSAGE_WINDOW_MAX);
+      gtk_slice_list_model_set_offset (self->message_window, n_items - MESSAGE_WINDOW_MAX);
+    }
+  }
+
+  chat_view_window_update_at_end (self);
+}
+
 static void
 chat_view_scroll_down_clicked_cb (ChattyChatView *self)
 {
   g_assert (CHATTY_IS_CHAT_VIEW (self));
 
+  if (!self->window_at_end)
+    chat_view_window_reset (self);
+
   gtk_adjustment_set_value (self->vadjustment,
                             gtk_adjustment_get_upper (self->vadjustment));
 }
@@ -260,10 +341,36 @@ static void
 chat_view_edge_overshot_cb (ChattyChatView  *self,
                             GtkPositionType  pos)
 {
+  guint n_items, offset, size, new_offset;
+
   g_assert (CHATTY_IS_CHAT_VIEW (self));
 
-  if (pos == GTK_POS_TOP)
-    chatty_chat_load_past_messages (self->chat, -1);
+  if (!self->chat)
+    return;
+
+  n_items = g_list_model_get_n_items (self->message_model);
+  offset = gtk_slice_list_model_get_offset (self->message_window);
+  size = gtk_slice_list_model_get_size (self->message_window);
+
+  if (pos == GTK_POS_TOP) {
+    /* All loaded messages are shown, load more from history */
+    if (offset == 0) {
+      chatty_chat_load_past_messages (self->chat, -1);
+      return;
+    }
+
+    /* Slide the window up first, so that only rows at the top are
+     * added, then let it grow back at the bottom till it is full */
+    new_offset = offset > MESSAGE_WINDOW_STEP ? offset - MESSAGE_WINDOW_STEP : 0;
+    gtk_slice_list_model_set_offset (self->message_window, new_offset);
+    gtk_slice_list_model_set_size (self->message_window,
+                                   MIN (size + offset - new_offset, MESSAGE_WINDOW_MAX));
+  } else if (pos == GTK_POS_BOTTOM && !self->window_at_end) {
+    new_offset = MIN (offset + MESSAGE_WINDOW_STEP, n_items - size);
+    gtk_slice_list_model_set_offset (self->message_window, new_offset);
+  }
+
+  chat_view_window_update_at_end (self);
 }
 
 
@@ -273,6 +380,7 @@ chat_view_message_row_new (ChattyMessage  *message,
 {
   GtkWidget *row;
   ChattyProtocol protocol;
+  CHATTY_TRACE_SPAN (G_STRFUNC);
 
   g_assert (CHATTY_IS_MESSAGE (message));
   g_assert (CHATTY_IS_CHAT_VIEW (self));
@@ -631,7 +739,7 @@ chat_view_sms_sent_cb (const char *sms_id,
   time_now = time (NULL);
 
   if (message_id == NULL)
-    chatty_message_set_id (message, sms_id);
+    chatty_pp_chat_set_message_id (CHATTY_PP_CHAT (chat), message, sms_id);
 
   if (g_strcmp0 (message_id, sms_id) == 0) {
     chatty_message_set_status (message, sent_status, time_now);
@@ -664,6 +772,8 @@ chatty_chat_view_finalize (GObject *object)
                                chat_view_hash_table_match_item,
                                self);
   g_clear_object (&self->chat);
+  g_clear_object (&self->message_model);
+  g_clear_object (&self->message_window);
 
   G_OBJECT_CLASS (chatty_chat_view_parent_class)->finalize (object);
 }
@@ -736,6 +846,12 @@ chatty_chat_view_init (ChattyChatView *self)
   gtk_list_box_set_header_func (GTK_LIST_BOX (self->message_list),
                                 (GtkListBoxUpdateHeaderFunc)chat_view_update_header_func,
                                 NULL, NULL);
+
+  self->message_window = gtk_slice_list_model_new_for_type (CHATTY_TYPE_MESSAGE);
+  gtk_list_box_bind_model (GTK_LIST_BOX (self->message_list),
+                           G_LIST_MODEL (self->message_window),
+                           (GtkListBoxCreateWidgetFunc)chat_view_message_row_new,
+                           self, NULL);
 }
 
 GtkWidget *
@@ -793,10 +909,20 @@ chatty_chat_view_set_chat (ChattyChatView *self,
   if (g_list_model_get_n_items (messages) <= 3)
     chatty_chat_load_past_messages (chat, -1);
 
-  gtk_list_box_bind_model (GTK_LIST_BOX (self->message_list),
-                           chatty_chat_get_messages (self->chat),
-                           (GtkListBoxCreateWidgetFunc)chat_view_message_row_new,
-                           self, NULL);
+  /* Only a window of latest messages have rows created, which
+   * is moved as the user scrolls to the edges of the list */
+  if (self->message_model)
+    g_signal_handlers_disconnect_by_func (self->message_model,
+                                          chat_view_messages_changed_cb,
+                                          self);
+  g_set_object (&self->message_model, messages);
+  gtk_slice_list_model_set_model (self->message_window, NULL);
+  chat_view_window_reset (self);
+  gtk_slice_list_model_set_model (self->message_window, messages);
+  /* Should be run after the slice model has handled the change */
+  g_signal_connect_object (messages, "items-changed",
+                           G_CALLBACK (chat_view_messages_changed_cb), self,
+                           G_CONNECT_SWAPPED | G_CONNECT_AFTER);
   g_signal_connect_swapped (self->chat, "notify::encrypt",
                             G_CALLBACK (chat_encrypt_changed_cb),
                             self);
@@ -137,6 +137,13 @@ chatty_chat_real_is_loading_history (ChattyChat *self)
   return FALSE;
 }
 
+static guint
+chatty_chat_real_trim_messages (ChattyChat *self,
+                                guint       n_keep)
+{
+  return 0;
+}
+
 static GListModel *
 chatty_chat_real_get_messages (ChattyChat *self)
 {
@@ -385,6 +392,7 @@ chatty_chat_class_init (ChattyChatClass *klass)
   klass->get_account = chatty_chat_real_get_account;
   klass->load_past_messages = chatty_chat_real_load_past_messages;
   klass->is_loading_history = chatty_chat_real_is_loading_history;
+  klass->trim_messages = chatty_chat_real_trim_messages;
   klass->get_messages = chatty_chat_real_get_messages;
   klass->get_users = chatty_chat_real_get_users;
   klass->get_topic = chatty_chat_real_get_topic;
@@ -573,6 +581,65 @@ chatty_chat_is_loading_history (ChattyChat *self)
   return CHATTY_CHAT_GET_CLASS (self)->is_loading_history (self);
 }
 
+/**
+ * chatty_chat_trim_messages:
+ * @self: A #ChattyChat
+ * @n_keep: The number of latest messages to keep
+ *
+ * Drop the older messages in @self so that only @n_keep
+ * latest messages are kept in memory.  The dropped messages
+ * can be loaded back from history with
+ * chatty_chat_load_past_messages().
+ *
+ * Messages that are yet to be sent, and the ones after them
+ * are never dropped.
+ *
+ * Returns: The number of messages dropped
+ */
+guint
+chatty_chat_trim_messages (ChattyChat *self,
+                           guint       n_keep)
+{
+  g_return_val_if_fail (CHATTY_IS_CHAT (self), 0);
+
+  return CHATTY_CHAT_GET_CLASS (self)->trim_messages (self, n_keep);
+}
+
+/**
+ * chatty_chat_get_memory_size:
+ * @self: A #ChattyChat
+ *
+ * Get an approximate number of bytes used by
+ * the messages loaded in @self.
+ *
+ * Returns: The size in bytes
+ */
+gsize
+chatty_chat_get_memory_size (ChattyChat *self)
+{
+  GListModel *messages;
+  gsize size = 0;
+  guint n_items;
+
+  g_return_val_if_fail (CHATTY_IS_CHAT (self), 0);
+
+  messages = chatty_chat_get_messages (self);
+
+  if (!messages)
+    return 0;
+
+  n_items = g_list_model_get_n_items (messages);
+
+  for (guint i = 0; i < n_items; i++) {
+    g_autoptr(ChattyMessage) message = NULL;
+
+    message = g_list_model_get_item (messages, i);
+    size += chatty_message_get_memory_size (message);
+  }
+
+  return size;
+}
+
 GListModel *chatty_chat_get_users (ChattyChat *self)
 {
   g_return_val_if_fail (CHATTY_IS_CHAT (self), NULL);
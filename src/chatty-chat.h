@@ -45,6 +45,8 @@ struct _ChattyChatClass
   void              (*load_past_messages) (ChattyChat *self,
                                            int         limit);
   gboolean          (*is_loading_history) (ChattyChat *self);
+  guint             (*trim_messages)      (ChattyChat *self,
+                                           guint       n_keep);
   guint             (*get_unread_count)   (ChattyChat *self);
   void              (*set_unread_count)   (ChattyChat *self,
                                            guint       unread_count);
@@ -95,6 +97,9 @@ GListModel         *chatty_chat_get_messages       (ChattyChat *self);
 void                chatty_chat_load_past_messages (ChattyChat *self,
                                                     int         count);
 gboolean            chatty_chat_is_loading_history (ChattyChat *self);
+guint               chatty_chat_trim_messages      (ChattyChat *self,
+                                                    guint       n_keep);
+gsize               chatty_chat_get_memory_size    (ChattyChat *self);
 GListModel         *chatty_chat_get_users          (ChattyChat *self);
 const char         *chatty_chat_get_topic          (ChattyChat *self);
 void                chatty_chat_set_topic          (ChattyChat *self,
@@ -0,0 +1,19 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-contact-provider-private.h
+ *
+ * Copyright 2020 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "chatty-contact-provider.h"
+
+void chatty_eds_add_contacts    (ChattyEds    *self,
+                                 const GSList *contacts);
+void chatty_eds_remove_contacts (ChattyEds    *self,
+                                 const GSList *uids);
@@ -15,11 +15,14 @@
 # include "config.h"
 #endif
 
+#include <string.h>
 #include <libebook/libebook.h>
 
 #include "users/chatty-contact.h"
 #include "users/chatty-contact-private.h"
-#include "chatty-contact-provider.h"
+#include "chatty-settings.h"
+#include "chatty-phone-utils.h"
+#include "chatty-contact-provider-private.h"
 
 /**
  * SECTION: chatty-eds
@@ -43,6 +46,15 @@ struct _ChattyEds
   GPtrArray        *contacts_array;
   GListStore       *eds_view_list;
   GListStore       *contacts_list;
+
+  /* E.164 number (or raw value if not a number) to a GPtrArray
+   * of ChattyContact, in the order they were added */
+  GHashTable       *number_index;
+  /* National significant number to a GPtrArray of ChattyContact */
+  GHashTable       *national_index;
+  /* The region the numbers in the index were parsed for */
+  char             *index_region;
+
   guint             providers_to_load;
   ChattyProtocol    protocols;
   gboolean          is_ready;
@@ -114,31 +126,146 @@ chatty_eds_bus_got (GObject      *object,
                             g_steal_pointer (&task));
 }
 
-static ChattyContact *
-chatty_contact_provider_matches (ChattyEds      *self,
-                                 const char     *needle,
-                                 ChattyProtocol  protocols,
-                                 gboolean        match_name)
+static gboolean
+eds_str_is_number (const char *str)
+{
+  return strspn (str, "+()-. 0123456789") == strlen (str);
+}
+
+/*
+ * Get the index keys for @number, which is the number
+ * in E.164 format and the national significant number.
+ * If @number is not a valid number, @number is used as
+ * the key and @national is set to %NULL.
+ */
+static char *
+eds_get_number_key (ChattyEds   *self,
+                    const char  *number,
+                    char       **national)
+{
+  char *key = NULL;
+
+  g_assert (CHATTY_IS_EDS (self));
+  g_assert (national);
+
+  *national = NULL;
+
+  if (eds_str_is_number (number))
+    key = chatty_phone_utils_get_e164 (number, self->index_region, national);
+
+  if (!key)
+    key = g_strdup (number);
+
+  return key;
+}
+
+static gboolean
+eds_contact_is_number (ChattyContact *contact)
+{
+  /* Only SMS contacts are matched by number, see chatty_contact_matches() */
+  return chatty_item_get_protocols (CHATTY_ITEM (contact)) == CHATTY_PROTOCOL_SMS;
+}
+
+static void
+eds_index_add (GHashTable    *index,
+               char          *key,
+               ChattyContact *contact)
+{
+  GPtrArray *contacts;
+
+  contacts = g_hash_table_lookup (index, key);
+
+  if (contacts) {
+    g_free (key);
+  } else {
+    contacts = g_ptr_array_new_with_free_func (g_object_unref);
+    g_hash_table_insert (index, key, contacts);
+  }
+
+  g_ptr_array_add (contacts, g_object_ref (contact));
+}
+
+static void
+eds_index_remove (GHashTable    *index,
+                  const char    *key,
+                  ChattyContact *contact)
+{
+  GPtrArray *contacts;
+
+  contacts = g_hash_table_lookup (index, key);
+
+  /* Other contacts may have the same number */
+  if (contacts && g_ptr_array_remove (contacts, contact) && contacts->len == 0)
+    g_hash_table_remove (index, key);
+}
+
+static void
+eds_index_contact (ChattyEds     *self,
+                   ChattyContact *contact)
+{
+  g_autofree char *national = NULL;
+  char *key;
+
+  g_assert (CHATTY_IS_EDS (self));
+  g_assert (CHATTY_IS_CONTACT (contact));
+
+  if (!eds_contact_is_number (contact))
+    return;
+
+  key = eds_get_number_key (self, chatty_contact_get_value (contact), &national);
+  eds_index_add (self->number_index, key, contact);
+
+  if (national)
+    eds_index_add (self->national_index, g_steal_pointer (&national), contact);
+}
+
+static void
+eds_unindex_contact (ChattyEds     *self,
+                     ChattyContact *contact)
+{
+  g_autofree char *national = NULL;
+  g_autofree char *key = NULL;
+
+  g_assert (CHATTY_IS_EDS (self));
+  g_assert (CHATTY_IS_CONTACT (contact));
+
+  if (!eds_contact_is_number (contact))
+    return;
+
+  key = eds_get_number_key (self, chatty_contact_get_value (contact), &national);
+
+  eds_index_remove (self->number_index, key, contact);
+
+  if (national)
+    eds_index_remove (self->national_index, national, contact);
+}
+
+static void
+eds_rebuild_index (ChattyEds *self)
 {
   GListModel *model;
   guint n_items;
-  gboolean match;
+
+  g_assert (CHATTY_IS_EDS (self));
+
+  g_hash_table_remove_all (self->number_index);
+  g_hash_table_remove_all (self->national_index);
+
+  g_free (self->index_region);
+  self->index_region = g_strdup (chatty_settings_get_country_iso_code (chatty_settings_get_default ()));
 
   model = G_LIST_MODEL (self->contacts_list);
   n_items = g_list_model_get_n_items (model);
 
-  for (guint i = 0; i < n_items; i++)
-    {
-      g_autoptr(ChattyItem) item = NULL;
-
-      item = g_list_model_get_item (model, i);
-      match = chatty_item_matches (item, needle, protocols, match_name);
+  for (guint i = 0; i < n_items; i++) {
+    g_autoptr(ChattyContact) contact = NULL;
 
-      if (match)
-        return CHATTY_CONTACT (item);
-    }
+    contact = g_list_model_get_item (model, i);
+    eds_index_contact (self, contact);
+  }
 
-  return NULL;
+  for (guint i = 0; self->contacts_array && i < self->contacts_array->len; i++)
+    eds_index_contact (self, self->contacts_array->pdata[i]);
 }
 
 static void
@@ -206,11 +333,14 @@ chatty_eds_load_contact (ChattyEds     *self,
 
     value = e_vcard_attribute_get_value (l->data);
 
-    if (value && *value)
-      g_ptr_array_add (self->contacts_array,
-                       chatty_contact_new (contact, l->data, protocol));
+    if (value && *value) {
+      ChattyContact *item;
 
+      item = chatty_contact_new (contact, l->data, protocol);
+      g_ptr_array_add (self->contacts_array, item);
+      eds_index_contact (self, item);
     }
+  }
 }
 
 static void
@@ -223,22 +353,51 @@ chatty_eds_remove_contact (ChattyEds  *self,
 
   eds_find_contact_index (self, uid, &position, &count);
 
+  for (guint i = position; i < position + count; i++) {
+    g_autoptr(ChattyContact) contact = NULL;
+
+    contact = g_list_model_get_item (G_LIST_MODEL (self->contacts_list), i);
+    eds_unindex_contact (self, contact);
+  }
+
   if (count)
     g_list_store_splice (self->contacts_list, position, count, NULL, 0);
+
+  /* Contacts yet to be added to the list */
+  for (guint i = 0; self->contacts_array && i < self->contacts_array->len;) {
+    ChattyContact *contact = self->contacts_array->pdata[i];
+
+    if (g_strcmp0 (chatty_contact_get_uid (contact), uid) == 0) {
+      eds_unindex_contact (self, contact);
+      g_ptr_array_remove_index (self->contacts_array, i);
+    } else {
+      i++;
+    }
+  }
 }
 
-static void
-chatty_eds_objects_added_cb (ChattyEds       *self,
-                             const GSList    *objects,
-                             EBookClientView *view)
+/**
+ * chatty_eds_add_contacts:
+ * @self: A #ChattyEds
+ * @contacts: A #GSList of #EContact
+ *
+ * Load and index @contacts.  The contacts are added to
+ * the contact list once the current view load completes.
+ */
+void
+chatty_eds_add_contacts (ChattyEds    *self,
+                         const GSList *contacts)
 {
-  g_assert (CHATTY_IS_EDS (self));
-  g_assert (E_IS_BOOK_CLIENT_VIEW (view));
+  g_return_if_fail (CHATTY_IS_EDS (self));
+
+  if (g_strcmp0 (self->index_region,
+                 chatty_settings_get_country_iso_code (chatty_settings_get_default ())) != 0)
+    eds_rebuild_index (self);
 
   if (!self->contacts_array)
     self->contacts_array = g_ptr_array_new_full (100, g_object_unref);
 
-  for (GSList *l = (GSList *)objects; l != NULL; l = l->next)
+  for (GSList *l = (GSList *)contacts; l != NULL; l = l->next)
     {
       if (self->protocols & CHATTY_PROTOCOL_SMS ||
           self->protocols & CHATTY_PROTOCOL_CALL)
@@ -249,6 +408,35 @@ chatty_eds_objects_added_cb (ChattyEds       *self,
     }
 }
 
+/**
+ * chatty_eds_remove_contacts:
+ * @self: A #ChattyEds
+ * @uids: A #GSList of contact uids
+ *
+ * Remove the contacts with the given @uids
+ * from the contact list and index.
+ */
+void
+chatty_eds_remove_contacts (ChattyEds    *self,
+                            const GSList *uids)
+{
+  g_return_if_fail (CHATTY_IS_EDS (self));
+
+  for (GSList *node = (GSList *)uids; node; node = node->next)
+    chatty_eds_remove_contact (self, node->data);
+}
+
+static void
+chatty_eds_objects_added_cb (ChattyEds       *self,
+                             const GSList    *objects,
+                             EBookClientView *view)
+{
+  g_assert (CHATTY_IS_EDS (self));
+  g_assert (E_IS_BOOK_CLIENT_VIEW (view));
+
+  chatty_eds_add_contacts (self, objects);
+}
+
 static void
 chatty_eds_objects_modified_cb (ChattyEds       *self,
                                 const GSList    *objects,
@@ -260,7 +448,7 @@ chatty_eds_objects_modified_cb (ChattyEds       *self,
   for (GSList *l = (GSList *)objects; l != NULL; l = l->next)
     chatty_eds_remove_contact (self, e_contact_get_const (l->data, E_CONTACT_UID));
 
-  chatty_eds_objects_added_cb (self, objects, view);
+  chatty_eds_add_contacts (self, objects);
 }
 
 static void
@@ -271,8 +459,7 @@ chatty_eds_objects_removed_cb (ChattyEds       *self,
   g_assert (CHATTY_IS_EDS (self));
   g_assert (E_IS_BOOK_CLIENT_VIEW (view));
 
-  for (GSList *node = (GSList *)objects; node; node = node->next)
-    chatty_eds_remove_contact (self, node->data);
+  chatty_eds_remove_contacts (self, objects);
 }
 
 static void
@@ -500,6 +687,9 @@ chatty_eds_finalize (GObject *object)
   g_clear_object (&self->cancellable);
   g_clear_object (&self->eds_view_list);
   g_clear_object (&self->contacts_list);
+  g_clear_pointer (&self->number_index, g_hash_table_unref);
+  g_clear_pointer (&self->national_index, g_hash_table_unref);
+  g_free (self->index_region);
   if (self->contacts_array)
     g_ptr_array_free (self->contacts_array, TRUE);
 
@@ -555,6 +745,10 @@ chatty_eds_init (ChattyEds *self)
 {
   self->eds_view_list = g_list_store_new (E_TYPE_BOOK_CLIENT_VIEW);
   self->contacts_list = g_list_store_new (CHATTY_TYPE_CONTACT);
+  self->number_index = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, (GDestroyNotify)g_ptr_array_unref);
+  self->national_index = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, (GDestroyNotify)g_ptr_array_unref);
   self->cancellable = g_cancellable_new ();
 }
 
@@ -633,15 +827,56 @@ chatty_eds_get_model (ChattyEds *self)
  * A match can be either exact or one excluding the
  * country prefix (Eg: +1987654321 and 987654321 matches)
  *
+ * The contacts are indexed by their E.164 number, so
+ * this is a hash table lookup.
+ *
  * Returns: (transfer none) (nullable): A #ChattyContact.
  */
 ChattyContact *
 chatty_eds_find_by_number (ChattyEds  *self,
                            const char *phone_number)
 {
+  g_autofree char *national = NULL;
+  g_autofree char *key = NULL;
+  GPtrArray *contacts;
+  const char *region;
+
   g_return_val_if_fail (CHATTY_IS_EDS (self), NULL);
 
-  return chatty_contact_provider_matches (self, phone_number, CHATTY_PROTOCOL_ANY, FALSE);
+  if (!phone_number || !*phone_number)
+    return NULL;
+
+  region = chatty_settings_get_country_iso_code (chatty_settings_get_default ());
+
+  if (g_strcmp0 (self->index_region, region) != 0)
+    eds_rebuild_index (self);
+
+  key = eds_get_number_key (self, phone_number, &national);
+  contacts = g_hash_table_lookup (self->number_index, key);
+
+  /* The first contact added wins, as the first match was used before */
+  if (contacts)
+    return contacts->pdata[0];
+
+  if (!national)
+    return NULL;
+
+  /* Try to match numbers where either one doesn’t have the country prefix */
+  contacts = g_hash_table_lookup (self->national_index, national);
+
+  for (guint i = 0; contacts && i < contacts->len; i++) {
+    ChattyContact *contact = contacts->pdata[i];
+    EPhoneNumberMatch match;
+
+    match = e_phone_number_compare_strings_with_region (chatty_contact_get_value (contact),
+                                                        phone_number, region, NULL);
+
+    if (match == E_PHONE_NUMBER_MATCH_EXACT ||
+        match == E_PHONE_NUMBER_MATCH_NATIONAL)
+      return contact;
+  }
+
+  return NULL;
 }
 
 
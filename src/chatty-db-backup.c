@@ -0,0 +1,783 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-db-backup.c
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "chatty-db-backup"
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#ifdef HAVE_ZSTD
+# include <zstd.h>
+#endif
+
+#include "chatty-db-backup.h"
+
+/* The default SQLite page size, used to pace compression */
+#define BACKUP_COMPRESS_PAGE_SIZE 4096
+
+/**
+ * SECTION: chatty-db-backup
+ * @title: ChattyDbBackup
+ * @short_description: Online backups of SQLite databases
+ *
+ * Backups are taken with the SQLite online backup API, a few
+ * pages at a time, so that the database can still be used
+ * between the steps, and the backup is still a consistent
+ * snapshot of the database.
+ *
+ * Backups are saved next to the database as “<database>.<unix time>”,
+ * with “.zst” appended if compressed.  #ChattyDbBackup is not thread
+ * safe, and should be used only in the thread that uses the database.
+ */
+
+struct _ChattyDbBackup
+{
+  sqlite3        *dest;
+  sqlite3_backup *backup;
+  char           *db_path;
+  /* The uncompressed backup, until complete */
+  char           *part_path;
+  char           *backup_path;
+  guint           n_keep;
+  gboolean        compress;
+  gboolean        done;
+
+#ifdef HAVE_ZSTD
+  /* Set while the complete copy is being compressed */
+  ZSTD_CCtx      *cctx;
+  FILE           *in;
+  FILE           *out;
+  char           *in_buf;
+  char           *out_buf;
+  gsize           in_size;
+  gsize           out_size;
+  goffset         in_read;
+  goffset         in_total;
+#endif
+};
+
+typedef struct {
+  char   *path;
+  gint64  time;
+} BackupFile;
+
+static void
+backup_file_free (BackupFile *file)
+{
+  g_free (file->path);
+  g_free (file);
+}
+
+static int
+backup_file_compare (gconstpointer a,
+                     gconstpointer b)
+{
+  const BackupFile *file_a = *(BackupFile **)a;
+  const BackupFile *file_b = *(BackupFile **)b;
+
+  /* Newest first */
+  if (file_a->time == file_b->time)
+    return g_strcmp0 (file_b->path, file_a->path);
+
+  return file_a->time < file_b->time ? 1 : -1;
+}
+
+/* Parse “<database>.<unix time>[.zst]” */
+static gboolean
+backup_parse_name (const char  *name,
+                   char       **db_name,
+                   gint64      *timestamp)
+{
+  const char *dot;
+  gsize len;
+
+  len = strlen (name);
+
+  if (g_str_has_suffix (name, ".zst"))
+    len -= strlen (".zst");
+
+  dot = g_strrstr_len (name, len, ".");
+
+  if (!dot || dot == name || dot + 1 == name + len)
+    return FALSE;
+
+  for (const char *c = dot + 1; c < name + len; c++)
+    if (!g_ascii_isdigit (*c))
+      return FALSE;
+
+  if (db_name)
+    *db_name = g_strndup (name, dot - name);
+
+  if (timestamp)
+    *timestamp = g_ascii_strtoll (dot + 1, NULL, 10);
+
+  return TRUE;
+}
+
+/* Remove the oldest backups of the database, keeping only n_keep */
+static void
+backup_rotate (ChattyDbBackup *self)
+{
+  g_autoptr(GPtrArray) files = NULL;
+  g_autofree char *db_name = NULL;
+  g_autofree char *dir_path = NULL;
+  g_autoptr(GDir) dir = NULL;
+  const char *name;
+
+  if (!self->n_keep)
+    return;
+
+  dir_path = g_path_get_dirname (self->db_path);
+  db_name = g_path_get_basename (self->db_path);
+  dir = g_dir_open (dir_path, 0, NULL);
+
+  if (!dir)
+    return;
+
+  files = g_ptr_array_new_with_free_func ((GDestroyNotify)backup_file_free);
+
+  while ((name = g_dir_read_name (dir))) {
+    g_autofree char *name_prefix = NULL;
+    BackupFile *file;
+    gint64 timestamp;
+
+    if (!backup_parse_name (name, &name_prefix, &timestamp) ||
+        g_strcmp0 (name_prefix, db_name) != 0)
+      continue;
+
+    file = g_new (BackupFile, 1);
+    file->path = g_build_filename (dir_path, name, NULL);
+    file->time = timestamp;
+    g_ptr_array_add (files, file);
+  }
+
+  g_ptr_array_sort (files, backup_file_compare);
+
+  for (guint i = self->n_keep; i < files->len; i++) {
+    BackupFile *file = files->pdata[i];
+
+    g_debug ("Removing old backup %s", file->path);
+    if (g_unlink (file->path) != 0)
+      g_warning ("Couldn't remove old backup %s: %s", file->path, g_strerror (errno));
+  }
+}
+
+#ifdef HAVE_ZSTD
+static gboolean
+backup_compress_finish (ChattyDbBackup  *self,
+                        gboolean         success,
+                        GError         **error)
+{
+  g_clear_pointer (&self->cctx, ZSTD_freeCCtx);
+  g_clear_pointer (&self->in_buf, g_free);
+  g_clear_pointer (&self->out_buf, g_free);
+  g_clear_pointer (&self->in, fclose);
+
+  if (self->out && fclose (self->out) != 0 && success) {
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                 "Couldn't write backup: %s", g_strerror (errno));
+    success = FALSE;
+  }
+  self->out = NULL;
+
+  if (!success)
+    g_unlink (self->backup_path);
+
+  return success;
+}
+
+static gboolean
+backup_compress_start (ChattyDbBackup  *self,
+                       GError         **error)
+{
+  GStatBuf st;
+
+  self->in = g_fopen (self->part_path, "rb");
+  if (self->in)
+    self->out = g_fopen (self->backup_path, "wb");
+
+  if (!self->in || !self->out) {
+    int saved_errno = errno;
+
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                 "Couldn't open file for compression: %s", g_strerror (saved_errno));
+    g_clear_pointer (&self->in, fclose);
+
+    return FALSE;
+  }
+
+  if (g_stat (self->part_path, &st) == 0)
+    self->in_total = st.st_size;
+
+  self->cctx = ZSTD_createCCtx ();
+  ZSTD_CCtx_setParameter (self->cctx, ZSTD_c_compressionLevel, ZSTD_CLEVEL_DEFAULT);
+  self->in_size = ZSTD_CStreamInSize ();
+  self->out_size = ZSTD_CStreamOutSize ();
+  self->in_buf = g_malloc (self->in_size);
+  self->out_buf = g_malloc (self->out_size);
+
+  return TRUE;
+}
+
+/*
+ * Compress about as much data as @n_pages database pages, so
+ * that a big database doesn't block the thread for long.  The
+ * compression is complete when self->in is unset.
+ */
+static gboolean
+backup_compress_step (ChattyDbBackup  *self,
+                      int              n_pages,
+                      GError         **error)
+{
+  gsize max_bytes, n_bytes = 0;
+  gboolean success = TRUE, last;
+
+  g_assert (self->in);
+
+  if (n_pages < 0)
+    max_bytes = G_MAXSIZE;
+  else
+    max_bytes = (gsize)MAX (n_pages, 1) * BACKUP_COMPRESS_PAGE_SIZE;
+
+  do {
+    ZSTD_inBuffer input;
+    gboolean finished = FALSE;
+    gsize n_read;
+
+    n_read = fread (self->in_buf, 1, self->in_size, self->in);
+    last = n_read < self->in_size;
+    n_bytes += n_read;
+    self->in_read += n_read;
+    input.src = self->in_buf;
+    input.size = n_read;
+    input.pos = 0;
+
+    while (!finished) {
+      ZSTD_outBuffer output = { self->out_buf, self->out_size, 0 };
+      gsize remaining;
+
+      remaining = ZSTD_compressStream2 (self->cctx, &output, &input,
+                                        last ? ZSTD_e_end : ZSTD_e_continue);
+
+      if (ZSTD_isError (remaining)) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                     "Compression failed: %s", ZSTD_getErrorName (remaining));
+        success = FALSE;
+        break;
+      }
+
+      if (fwrite (self->out_buf, 1, output.pos, self->out) != output.pos) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "Couldn't write backup: %s", g_strerror (errno));
+        success = FALSE;
+        break;
+      }
+
+      finished = last ? remaining == 0 : input.pos == input.size;
+    }
+  } while (success && !last && n_bytes < max_bytes);
+
+  if (success && ferror (self->in)) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Couldn't read %s", self->part_path);
+    success = FALSE;
+  }
+
+  if (success && !last)
+    return TRUE;
+
+  return backup_compress_finish (self, success, error);
+}
+
+static gboolean
+backup_decompress (const char  *in_path,
+                   const char  *out_path,
+                   GError     **error)
+{
+  g_autofree char *in_buf = NULL;
+  g_autofree char *out_buf = NULL;
+  ZSTD_DCtx *dctx;
+  FILE *in, *out = NULL;
+  gsize in_size, out_size, n_read, ret = 0;
+  gboolean success = TRUE;
+
+  in = g_fopen (in_path, "rb");
+  if (in)
+    out = g_fopen (out_path, "wb");
+
+  if (!in || !out) {
+    int saved_errno = errno;
+
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                 "Couldn't open file for decompression: %s", g_strerror (saved_errno));
+    if (in)
+      fclose (in);
+
+    return FALSE;
+  }
+
+  dctx = ZSTD_createDCtx ();
+  in_size = ZSTD_DStreamInSize ();
+  out_size = ZSTD_DStreamOutSize ();
+  in_buf = g_malloc (in_size);
+  out_buf = g_malloc (out_size);
+
+  while (success && (n_read = fread (in_buf, 1, in_size, in)) > 0) {
+    ZSTD_inBuffer input = { in_buf, n_read, 0 };
+
+    while (success && input.pos < input.size) {
+      ZSTD_outBuffer output = { out_buf, out_size, 0 };
+
+      ret = ZSTD_decompressStream (dctx, &output, &input);
+
+      if (ZSTD_isError (ret)) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                     "Decompression failed: %s", ZSTD_getErrorName (ret));
+        success = FALSE;
+      } else if (fwrite (out_buf, 1, output.pos, out) != output.pos) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "Couldn't write database: %s", g_strerror (errno));
+        success = FALSE;
+      }
+    }
+  }
+
+  /* A complete frame ends with ret 0 */
+  if (success && (ferror (in) || ret != 0)) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                 "%s is truncated or couldn't be read", in_path);
+    success = FALSE;
+  }
+
+  ZSTD_freeDCtx (dctx);
+  fclose (in);
+
+  if (fclose (out) != 0 && success) {
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                 "Couldn't write database: %s", g_strerror (errno));
+    success = FALSE;
+  }
+
+  if (!success)
+    g_unlink (out_path);
+
+  return success;
+}
+#endif
+
+/**
+ * chatty_db_backup_new:
+ * @db: An open sqlite3 database
+ * @n_keep: The number of backups to keep, or 0 to keep all
+ * @compress: Whether to compress the backup with zstd
+ * @error: A location for a #GError, or %NULL
+ *
+ * Start a backup of the main database of @db.  The backup is
+ * copied with chatty_db_backup_step() and once complete, the
+ * oldest backups are removed so that only @n_keep are left.
+ *
+ * If chatty isn't compiled with zstd, @compress is ignored.
+ *
+ * Returns: (transfer full): A #ChattyDbBackup, or %NULL on error.
+ * Free with chatty_db_backup_free().
+ */
+ChattyDbBackup *
+chatty_db_backup_new (sqlite3   *db,
+                      guint      n_keep,
+                      gboolean   compress,
+                      GError   **error)
+{
+  g_autoptr(ChattyDbBackup) self = NULL;
+  const char *db_path;
+  long now;
+
+  g_return_val_if_fail (db, NULL);
+  g_return_val_if_fail (!error || !*error, NULL);
+
+  db_path = sqlite3_db_filename (db, "main");
+
+  if (!db_path || !*db_path) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                 "In-memory databases can't be backed up");
+    return NULL;
+  }
+
+#ifndef HAVE_ZSTD
+  if (compress)
+    g_debug ("Not compiled with zstd, backup won't be compressed");
+  compress = FALSE;
+#endif
+
+  now = (long)time (NULL);
+  self = g_new0 (ChattyDbBackup, 1);
+  self->db_path = g_strdup (db_path);
+  self->n_keep = n_keep;
+  self->compress = compress;
+  self->backup_path = g_strdup_printf ("%s.%ld%s", db_path, now, compress ? ".zst" : "");
+  self->part_path = g_strdup_printf ("%s.%ld.part", db_path, now);
+
+  if (g_file_test (self->backup_path, G_FILE_TEST_EXISTS)) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                 "Backup %s already exists", self->backup_path);
+    return NULL;
+  }
+
+  g_unlink (self->part_path);
+
+  if (sqlite3_open (self->part_path, &self->dest) == SQLITE_OK)
+    self->backup = sqlite3_backup_init (self->dest, "main", db, "main");
+
+  if (!self->backup) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Couldn't start backup. errno: %d, desc: %s",
+                 sqlite3_errcode (self->dest), sqlite3_errmsg (self->dest));
+    return NULL;
+  }
+
+  return g_steal_pointer (&self);
+}
+
+/**
+ * chatty_db_backup_step:
+ * @self: A #ChattyDbBackup
+ * @n_pages: The number of pages to copy, or -1 to copy all
+ * @error: A location for a #GError, or %NULL
+ *
+ * Copy up to @n_pages pages of the database to the backup.
+ * When the last page is copied, the backup is moved in place,
+ * or if compression is requested, compressed in the following
+ * steps, about @n_pages pages of data at a time.  If the database
+ * is changed while copying, the backup is updated too.
+ *
+ * Returns: %FALSE on error with @error set, %TRUE otherwise.
+ * Check chatty_db_backup_is_done() to know if the backup is
+ * complete.
+ */
+gboolean
+chatty_db_backup_step (ChattyDbBackup  *self,
+                       int              n_pages,
+                       GError         **error)
+{
+  int status;
+
+  g_return_val_if_fail (self, FALSE);
+  g_return_val_if_fail (!error || !*error, FALSE);
+
+  if (self->done)
+    return TRUE;
+
+  if (self->backup) {
+    status = sqlite3_backup_step (self->backup, n_pages);
+
+    /* The database is locked by some other connection, try again later */
+    if (status == SQLITE_OK || status == SQLITE_BUSY || status == SQLITE_LOCKED)
+      return TRUE;
+
+    if (status == SQLITE_DONE)
+      status = sqlite3_backup_finish (self->backup);
+    else
+      sqlite3_backup_finish (self->backup);
+    self->backup = NULL;
+
+    if (status == SQLITE_OK)
+      status = sqlite3_close (self->dest);
+    else
+      sqlite3_close (self->dest);
+    self->dest = NULL;
+
+    if (status != SQLITE_OK) {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Backup failed. errno: %d, desc: %s",
+                   status, sqlite3_errstr (status));
+      return FALSE;
+    }
+
+#ifdef HAVE_ZSTD
+    if (self->compress && !backup_compress_start (self, error))
+      return FALSE;
+#endif
+  }
+
+#ifdef HAVE_ZSTD
+  if (self->compress) {
+    g_return_val_if_fail (self->in, FALSE);
+
+    if (!backup_compress_step (self, n_pages, error))
+      return FALSE;
+
+    /* More to compress in the next steps */
+    if (self->in)
+      return TRUE;
+
+    g_unlink (self->part_path);
+  }
+#endif
+
+  if (!self->compress && g_rename (self->part_path, self->backup_path) != 0) {
+    int saved_errno = errno;
+
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                 "Couldn't move backup in place: %s", g_strerror (saved_errno));
+    return FALSE;
+  }
+
+  self->done = TRUE;
+  backup_rotate (self);
+
+  return TRUE;
+}
+
+gboolean
+chatty_db_backup_is_done (ChattyDbBackup *self)
+{
+  g_return_val_if_fail (self, FALSE);
+
+  return self->done;
+}
+
+/**
+ * chatty_db_backup_get_progress:
+ * @self: A #ChattyDbBackup
+ *
+ * Get the fraction of the backup done.  If the backup is
+ * compressed, copying and compressing are each half of it.
+ *
+ * Returns: A value between 0.0 and 1.0
+ */
+double
+chatty_db_backup_get_progress (ChattyDbBackup *self)
+{
+  double progress = 0.0;
+  int n_pages;
+
+  g_return_val_if_fail (self, 0.0);
+
+  if (self->done)
+    return 1.0;
+
+#ifdef HAVE_ZSTD
+  if (self->in) {
+    if (self->in_total > 0)
+      progress = (double)self->in_read / self->in_total;
+
+    return 0.5 + MIN (progress, 1.0) / 2.0;
+  }
+#endif
+
+  n_pages = self->backup ? sqlite3_backup_pagecount (self->backup) : 0;
+
+  /* Known only after the first step */
+  if (n_pages > 0)
+    progress = 1.0 - (double)sqlite3_backup_remaining (self->backup) / n_pages;
+
+  return self->compress ? progress / 2.0 : progress;
+}
+
+const char *
+chatty_db_backup_get_path (ChattyDbBackup *self)
+{
+  g_return_val_if_fail (self, NULL);
+
+  return self->backup_path;
+}
+
+void
+chatty_db_backup_free (ChattyDbBackup *self)
+{
+  if (!self)
+    return;
+
+  g_clear_pointer (&self->backup, sqlite3_backup_finish);
+  g_clear_pointer (&self->dest, sqlite3_close);
+
+#ifdef HAVE_ZSTD
+  /* Removes the incomplete compressed backup, if any */
+  if (self->in)
+    backup_compress_finish (self, FALSE, NULL);
+#endif
+
+  if (!self->done)
+    g_unlink (self->part_path);
+
+  g_free (self->db_path);
+  g_free (self->part_path);
+  g_free (self->backup_path);
+  g_free (self);
+}
+
+/**
+ * chatty_db_backup_get_db_name:
+ * @backup_path: The path of a backup
+ *
+ * Get the file name of the database @backup_path
+ * is a backup of, eg: “chatty-history.db” for
+ * “chatty-history.db.1617190000.zst”
+ *
+ * Returns: (transfer full) (nullable): The database
+ * file name, or %NULL if @backup_path isn't a backup.
+ */
+char *
+chatty_db_backup_get_db_name (const char *backup_path)
+{
+  g_autofree char *name = NULL;
+  char *db_name = NULL;
+
+  g_return_val_if_fail (backup_path, NULL);
+
+  name = g_path_get_basename (backup_path);
+  backup_parse_name (name, &db_name, NULL);
+
+  return db_name;
+}
+
+/**
+ * chatty_db_backup_get_last_time:
+ * @db_path: The path of a database
+ *
+ * Get the time the newest backup of @db_path was written,
+ * so that the next backup can be scheduled from it.
+ *
+ * Returns: The modification time of the newest backup in
+ * seconds since the epoch, or 0 if there is no backup.
+ */
+gint64
+chatty_db_backup_get_last_time (const char *db_path)
+{
+  g_autofree char *db_name = NULL;
+  g_autofree char *dir_path = NULL;
+  g_autoptr(GDir) dir = NULL;
+  const char *name;
+  gint64 last_time = 0;
+
+  g_return_val_if_fail (db_path && *db_path, 0);
+
+  dir_path = g_path_get_dirname (db_path);
+  db_name = g_path_get_basename (db_path);
+  dir = g_dir_open (dir_path, 0, NULL);
+
+  if (!dir)
+    return 0;
+
+  while ((name = g_dir_read_name (dir))) {
+    g_autofree char *name_prefix = NULL;
+    g_autofree char *path = NULL;
+    GStatBuf st;
+
+    if (!backup_parse_name (name, &name_prefix, NULL) ||
+        g_strcmp0 (name_prefix, db_name) != 0)
+      continue;
+
+    path = g_build_filename (dir_path, name, NULL);
+
+    if (g_stat (path, &st) == 0)
+      last_time = MAX (last_time, (gint64)st.st_mtime);
+  }
+
+  return last_time;
+}
+
+/**
+ * chatty_db_backup_restore:
+ * @backup_path: The path of a backup
+ * @db_path: The path of the database to restore to
+ * @error: A location for a #GError, or %NULL
+ *
+ * Replace the content of the database @db_path with the
+ * backup @backup_path, decompressing it if required.  The
+ * backup is checked for corruption before anything is
+ * replaced.  No one else should have @db_path open.
+ *
+ * Returns: %TRUE if the backup was restored, %FALSE
+ * otherwise with @error set.
+ */
+gboolean
+chatty_db_backup_restore (const char  *backup_path,
+                          const char  *db_path,
+                          GError     **error)
+{
+  g_autofree char *tmp_path = NULL;
+  const char *src_path = backup_path;
+  sqlite3_backup *backup;
+  sqlite3_stmt *stmt = NULL;
+  sqlite3 *src = NULL, *dest = NULL;
+  int status;
+
+  g_return_val_if_fail (backup_path && *backup_path, FALSE);
+  g_return_val_if_fail (db_path && *db_path, FALSE);
+  g_return_val_if_fail (!error || !*error, FALSE);
+
+  if (g_str_has_suffix (backup_path, ".zst")) {
+#ifdef HAVE_ZSTD
+    tmp_path = g_strconcat (db_path, ".restore", NULL);
+    if (!backup_decompress (backup_path, tmp_path, error))
+      return FALSE;
+    src_path = tmp_path;
+#else
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                 "Not compiled with zstd, can't restore %s", backup_path);
+    return FALSE;
+#endif
+  }
+
+  status = sqlite3_open_v2 (src_path, &src, SQLITE_OPEN_READONLY, NULL);
+
+  if (status == SQLITE_OK)
+    status = sqlite3_prepare_v2 (src, "PRAGMA quick_check;", -1, &stmt, NULL);
+
+  if (status == SQLITE_OK &&
+      (sqlite3_step (stmt) != SQLITE_ROW ||
+       g_strcmp0 ((const char *)sqlite3_column_text (stmt, 0), "ok") != 0))
+    status = SQLITE_CORRUPT;
+  g_clear_pointer (&stmt, sqlite3_finalize);
+
+  /* An empty file is a valid empty database, don't restore that */
+  if (status == SQLITE_OK)
+    status = sqlite3_prepare_v2 (src, "PRAGMA page_count;", -1, &stmt, NULL);
+
+  if (status == SQLITE_OK &&
+      (sqlite3_step (stmt) != SQLITE_ROW || sqlite3_column_int (stmt, 0) == 0))
+    status = SQLITE_NOTADB;
+  sqlite3_finalize (stmt);
+
+  if (status == SQLITE_OK)
+    status = sqlite3_open (db_path, &dest);
+
+  if (status == SQLITE_OK) {
+    backup = sqlite3_backup_init (dest, "main", src, "main");
+
+    if (backup) {
+      sqlite3_backup_step (backup, -1);
+      status = sqlite3_backup_finish (backup);
+    } else {
+      status = sqlite3_errcode (dest);
+    }
+  }
+
+  if (status != SQLITE_OK)
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Couldn't restore %s. errno: %d, desc: %s",
+                 backup_path, status, sqlite3_errstr (status));
+
+  sqlite3_close (src);
+  sqlite3_close (dest);
+
+  if (tmp_path)
+    g_unlink (tmp_path);
+
+  return status == SQLITE_OK;
+}
@@ -0,0 +1,44 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-db-backup.h
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+#include <sqlite3.h>
+
+G_BEGIN_DECLS
+
+/* Pages copied in one step of a background backup */
+#define CHATTY_DB_BACKUP_STEP_PAGES 64
+
+typedef struct _ChattyDbBackup ChattyDbBackup;
+
+ChattyDbBackup *chatty_db_backup_new         (sqlite3         *db,
+                                              guint            n_keep,
+                                              gboolean         compress,
+                                              GError         **error);
+gboolean        chatty_db_backup_step        (ChattyDbBackup  *self,
+                                              int              n_pages,
+                                              GError         **error);
+gboolean        chatty_db_backup_is_done     (ChattyDbBackup  *self);
+double          chatty_db_backup_get_progress (ChattyDbBackup *self);
+const char     *chatty_db_backup_get_path    (ChattyDbBackup  *self);
+void            chatty_db_backup_free        (ChattyDbBackup  *self);
+
+char           *chatty_db_backup_get_db_name (const char      *backup_path);
+gint64          chatty_db_backup_get_last_time (const char    *db_path);
+gboolean        chatty_db_backup_restore     (const char      *backup_path,
+                                              const char      *db_path,
+                                              GError         **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ChattyDbBackup, chatty_db_backup_free)
+
+G_END_DECLS
@@ -141,6 +141,27 @@ typedef enum
   CHATTY_FILE_ERROR,
 } ChattyFileStatus;
 
+/**
+ * ChattyPhoneType:
+ *
+ * The type of a phone number, as found by libphonenumber
+ */
+typedef enum
+{
+  CHATTY_PHONE_TYPE_UNKNOWN,
+  CHATTY_PHONE_TYPE_FIXED_LINE,
+  CHATTY_PHONE_TYPE_MOBILE,
+  CHATTY_PHONE_TYPE_FIXED_LINE_OR_MOBILE,
+  CHATTY_PHONE_TYPE_TOLL_FREE,
+  CHATTY_PHONE_TYPE_PREMIUM_RATE,
+  CHATTY_PHONE_TYPE_SHARED_COST,
+  CHATTY_PHONE_TYPE_VOIP,
+  CHATTY_PHONE_TYPE_PERSONAL_NUMBER,
+  CHATTY_PHONE_TYPE_PAGER,
+  CHATTY_PHONE_TYPE_UAN,
+  CHATTY_PHONE_TYPE_VOICEMAIL,
+} ChattyPhoneType;
+
 typedef enum
 {
   CHATTY_ITEM_VISIBLE,
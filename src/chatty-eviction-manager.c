@@ -0,0 +1,489 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-eviction-manager.c
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "chatty-eviction-manager"
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "chatty-eviction-manager.h"
+
+/**
+ * SECTION: chatty-eviction-manager
+ * @title: ChattyEvictionManager
+ * @short_description: Drop old messages of inactive chats
+ * @include: "chatty-eviction-manager.h"
+ *
+ * When running in background, chats loaded once keep all of their
+ * messages in memory.  #ChattyEvictionManager trims inactive chats
+ * to their latest #ChattyEvictionManager:inactive-messages messages
+ * on low memory warnings, and when the messages use more than
+ * #ChattyEvictionManager:memory-budget MiB.  The trimmed messages
+ * are loaded back from history when the chat is scrolled up.
+ *
+ * The active chat is never trimmed.
+ */
+
+#define DEFAULT_INACTIVE_MESSAGES 50
+#define DEFAULT_MEMORY_BUDGET     32  /* MiB */
+/* Seconds to wait after new messages before checking the budget */
+#define BUDGET_CHECK_DELAY        10
+
+struct _ChattyEvictionManager
+{
+  GObject         parent_instance;
+
+  /* Sorted with the latest chat first */
+  GListModel     *chat_list;
+  ChattyChat     *active_chat;
+  GMemoryMonitor *memory_monitor;
+
+  guint           inactive_messages;
+  guint           memory_budget;
+  guint           check_id;
+};
+
+G_DEFINE_TYPE (ChattyEvictionManager, chatty_eviction_manager, G_TYPE_OBJECT)
+
+enum {
+  PROP_0,
+  PROP_CHAT_LIST,
+  PROP_INACTIVE_MESSAGES,
+  PROP_MEMORY_BUDGET,
+  N_PROPS
+};
+
+static GParamSpec *properties[N_PROPS];
+
+static guint
+eviction_manager_trim_chat (ChattyEvictionManager *self,
+                            ChattyChat            *chat,
+                            guint                  n_keep)
+{
+  guint n_removed;
+
+  if (chat == self->active_chat)
+    return 0;
+
+  n_removed = chatty_chat_trim_messages (chat, n_keep);
+
+  if (n_removed)
+    g_debug ("Dropped %u messages from %s", n_removed,
+             chatty_chat_get_chat_name (chat));
+
+  return n_removed;
+}
+
+static gboolean
+eviction_manager_check_cb (gpointer user_data)
+{
+  ChattyEvictionManager *self = user_data;
+
+  g_assert (CHATTY_IS_EVICTION_MANAGER (self));
+
+  self->check_id = 0;
+  chatty_eviction_manager_check_budget (self);
+
+  return G_SOURCE_REMOVE;
+}
+
+#if GLIB_CHECK_VERSION (2, 64, 0)
+static void
+eviction_manager_low_memory_cb (ChattyEvictionManager      *self,
+                                GMemoryMonitorWarningLevel  level)
+{
+  guint n_keep;
+
+  g_assert (CHATTY_IS_EVICTION_MANAGER (self));
+
+  n_keep = self->inactive_messages;
+
+  /* The system is about to kill processes, drop as much as we can */
+  if (level >= G_MEMORY_MONITOR_WARNING_LEVEL_CRITICAL)
+    n_keep = MAX (n_keep / 4, 1);
+
+  g_info ("Low memory warning (level %d), trimming inactive chats to %u messages",
+          level, n_keep);
+  chatty_eviction_manager_trim (self, n_keep);
+}
+#endif
+
+static void
+chatty_eviction_manager_get_property (GObject    *object,
+                                      guint       prop_id,
+                                      GValue     *value,
+                                      GParamSpec *pspec)
+{
+  ChattyEvictionManager *self = (ChattyEvictionManager *)object;
+
+  switch (prop_id)
+    {
+    case PROP_INACTIVE_MESSAGES:
+      g_value_set_uint (value, self->inactive_messages);
+      break;
+
+    case PROP_MEMORY_BUDGET:
+      g_value_set_uint (value, self->memory_budget);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
+}
+
+static void
+chatty_eviction_manager_set_property (GObject      *object,
+                                      guint         prop_id,
+                                      const GValue *value,
+                                      GParamSpec   *pspec)
+{
+  ChattyEvictionManager *self = (ChattyEvictionManager *)object;
+
+  switch (prop_id)
+    {
+    case PROP_CHAT_LIST:
+      self->chat_list = g_value_dup_object (value);
+      break;
+
+    case PROP_INACTIVE_MESSAGES:
+      chatty_eviction_manager_set_inactive_messages (self, g_value_get_uint (value));
+      break;
+
+    case PROP_MEMORY_BUDGET:
+      chatty_eviction_manager_set_memory_budget (self, g_value_get_uint (value));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
+}
+
+static void
+chatty_eviction_manager_finalize (GObject *object)
+{
+  ChattyEvictionManager *self = (ChattyEvictionManager *)object;
+
+  if (self->memory_monitor)
+    g_signal_handlers_disconnect_by_data (self->memory_monitor, self);
+
+  g_clear_handle_id (&self->check_id, g_source_remove);
+  g_clear_object (&self->memory_monitor);
+  g_clear_object (&self->active_chat);
+  g_clear_object (&self->chat_list);
+
+  G_OBJECT_CLASS (chatty_eviction_manager_parent_class)->finalize (object);
+}
+
+static void
+chatty_eviction_manager_class_init (ChattyEvictionManagerClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->get_property = chatty_eviction_manager_get_property;
+  object_class->set_property = chatty_eviction_manager_set_property;
+  object_class->finalize = chatty_eviction_manager_finalize;
+
+  properties[PROP_CHAT_LIST] =
+    g_param_spec_object ("chat-list",
+                         "Chat List",
+                         "The list of chats, latest first",
+                         G_TYPE_LIST_MODEL,
+                         G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  properties[PROP_INACTIVE_MESSAGES] =
+    g_param_spec_uint ("inactive-messages",
+                       "Inactive Messages",
+                       "Number of messages kept in inactive chats when trimmed",
+                       1, G_MAXUINT, DEFAULT_INACTIVE_MESSAGES,
+                       G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS);
+
+  properties[PROP_MEMORY_BUDGET] =
+    g_param_spec_uint ("memory-budget",
+                       "Memory Budget",
+                       "Memory in MiB the messages of all chats may use",
+                       1, G_MAXUINT, DEFAULT_MEMORY_BUDGET,
+                       G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class, N_PROPS, properties);
+}
+
+static void
+chatty_eviction_manager_init (ChattyEvictionManager *self)
+{
+  self->inactive_messages = DEFAULT_INACTIVE_MESSAGES;
+  self->memory_budget = DEFAULT_MEMORY_BUDGET;
+
+#if GLIB_CHECK_VERSION (2, 64, 0)
+  self->memory_monitor = g_memory_monitor_dup_default ();
+  g_signal_connect_object (self->memory_monitor, "low-memory-warning",
+                           G_CALLBACK (eviction_manager_low_memory_cb),
+                           self, G_CONNECT_SWAPPED);
+#endif
+}
+
+/**
+ * chatty_eviction_manager_new:
+ * @chat_list: A #GListModel of #ChattyChat
+ *
+ * Create a new eviction manager for chats in
+ * @chat_list.  @chat_list should be sorted with
+ * the most recent chat first, so that the least
+ * recent chats are trimmed first.
+ *
+ * Returns: (transfer full): A #ChattyEvictionManager
+ */
+ChattyEvictionManager *
+chatty_eviction_manager_new (GListModel *chat_list)
+{
+  g_return_val_if_fail (G_IS_LIST_MODEL (chat_list), NULL);
+
+  return g_object_new (CHATTY_TYPE_EVICTION_MANAGER,
+                       "chat-list", chat_list,
+                       NULL);
+}
+
+/**
+ * chatty_eviction_manager_set_active_chat:
+ * @self: A #ChattyEvictionManager
+ * @chat: (nullable): The #ChattyChat shown to the user
+ *
+ * Set the currently shown chat.  The active
+ * chat is never trimmed.
+ */
+void
+chatty_eviction_manager_set_active_chat (ChattyEvictionManager *self,
+                                         ChattyChat            *chat)
+{
+  g_return_if_fail (CHATTY_IS_EVICTION_MANAGER (self));
+  g_return_if_fail (!chat || CHATTY_IS_CHAT (chat));
+
+  g_set_object (&self->active_chat, chat);
+}
+
+/**
+ * chatty_eviction_manager_set_inactive_messages:
+ * @self: A #ChattyEvictionManager
+ * @n_messages: The number of messages to keep
+ *
+ * Set the number of latest messages kept in
+ * inactive chats when they are trimmed.
+ */
+void
+chatty_eviction_manager_set_inactive_messages (ChattyEvictionManager *self,
+                                               guint                  n_messages)
+{
+  g_return_if_fail (CHATTY_IS_EVICTION_MANAGER (self));
+  g_return_if_fail (n_messages > 0);
+
+  if (self->inactive_messages == n_messages)
+    return;
+
+  self->inactive_messages = n_messages;
+  g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_INACTIVE_MESSAGES]);
+}
+
+/**
+ * chatty_eviction_manager_set_memory_budget:
+ * @self: A #ChattyEvictionManager
+ * @budget: The budget in MiB
+ *
+ * Set the memory messages of all chats may use
+ * before chatty_eviction_manager_check_budget()
+ * trims inactive chats.
+ */
+void
+chatty_eviction_manager_set_memory_budget (ChattyEvictionManager *self,
+                                           guint                  budget)
+{
+  g_return_if_fail (CHATTY_IS_EVICTION_MANAGER (self));
+  g_return_if_fail (budget > 0);
+
+  if (self->memory_budget == budget)
+    return;
+
+  self->memory_budget = budget;
+  g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_MEMORY_BUDGET]);
+}
+
+/**
+ * chatty_eviction_manager_get_memory_size:
+ * @self: A #ChattyEvictionManager
+ *
+ * Get the approximate memory used by the
+ * messages of all chats.
+ *
+ * Returns: The size in bytes
+ */
+gsize
+chatty_eviction_manager_get_memory_size (ChattyEvictionManager *self)
+{
+  gsize size = 0;
+  guint n_items;
+
+  g_return_val_if_fail (CHATTY_IS_EVICTION_MANAGER (self), 0);
+
+  n_items = g_list_model_get_n_items (self->chat_list);
+
+  for (guint i = 0; i < n_items; i++) {
+    g_autoptr(ChattyChat) chat = NULL;
+
+    chat = g_list_model_get_item (self->chat_list, i);
+    size += chatty_chat_get_memory_size (chat);
+  }
+
+  return size;
+}
+
+/**
+ * chatty_eviction_manager_trim:
+ * @self: A #ChattyEvictionManager
+ * @n_keep: The number of messages to keep
+ *
+ * Trim every inactive chat to its latest
+ * @n_keep messages.
+ *
+ * Returns: The number of messages dropped
+ */
+guint
+chatty_eviction_manager_trim (ChattyEvictionManager *self,
+                              guint                  n_keep)
+{
+  guint n_items, n_removed = 0;
+
+  g_return_val_if_fail (CHATTY_IS_EVICTION_MANAGER (self), 0);
+
+  n_items = g_list_model_get_n_items (self->chat_list);
+
+  for (guint i = 0; i < n_items; i++) {
+    g_autoptr(ChattyChat) chat = NULL;
+
+    chat = g_list_model_get_item (self->chat_list, i);
+    n_removed += eviction_manager_trim_chat (self, chat, n_keep);
+  }
+
+  return n_removed;
+}
+
+/**
+ * chatty_eviction_manager_check_budget:
+ * @self: A #ChattyEvictionManager
+ *
+ * If the messages use more memory than the budget,
+ * trim inactive chats, starting from the least recent
+ * one, until the memory use is within the budget.
+ *
+ * Returns: The number of messages dropped
+ */
+guint
+chatty_eviction_manager_check_budget (ChattyEvictionManager *self)
+{
+  gsize size, budget;
+  guint n_items, n_removed = 0;
+
+  g_return_val_if_fail (CHATTY_IS_EVICTION_MANAGER (self), 0);
+
+  size = chatty_eviction_manager_get_memory_size (self);
+  budget = (gsize)self->memory_budget * 1024 * 1024;
+
+  if (size <= budget)
+    return 0;
+
+  g_debug ("Messages use %" G_GSIZE_FORMAT " bytes, budget %" G_GSIZE_FORMAT,
+           size, budget);
+
+  n_items = g_list_model_get_n_items (self->chat_list);
+
+  for (guint i = n_items; i > 0 && size > budget; i--) {
+    g_autoptr(ChattyChat) chat = NULL;
+    gsize chat_size;
+    guint n_trimmed;
+
+    chat = g_list_model_get_item (self->chat_list, i - 1);
+    chat_size = chatty_chat_get_memory_size (chat);
+    n_trimmed = eviction_manager_trim_chat (self, chat, self->inactive_messages);
+
+    if (!n_trimmed)
+      continue;
+
+    n_removed += n_trimmed;
+    size -= chat_size - chatty_chat_get_memory_size (chat);
+  }
+
+  return n_removed;
+}
+
+/**
+ * chatty_eviction_manager_queue_check:
+ * @self: A #ChattyEvictionManager
+ *
+ * Check the budget with chatty_eviction_manager_check_budget()
+ * a few seconds later.  This should be called when messages
+ * are added, so that a burst of messages is checked only once.
+ */
+void
+chatty_eviction_manager_queue_check (ChattyEvictionManager *self)
+{
+  g_return_if_fail (CHATTY_IS_EVICTION_MANAGER (self));
+
+  if (!self->check_id)
+    self->check_id = g_timeout_add_seconds (BUDGET_CHECK_DELAY,
+                                            eviction_manager_check_cb,
+                                            self);
+}
+
+/**
+ * chatty_eviction_manager_get_debug_info:
+ * @self: A #ChattyEvictionManager
+ *
+ * Get the memory used by messages of each chat,
+ * in a human readable format.
+ *
+ * Returns: (transfer full): A string
+ */
+char *
+chatty_eviction_manager_get_debug_info (ChattyEvictionManager *self)
+{
+  GString *str;
+  gsize total = 0;
+  guint n_items;
+
+  g_return_val_if_fail (CHATTY_IS_EVICTION_MANAGER (self), NULL);
+
+  str = g_string_new (NULL);
+  n_items = g_list_model_get_n_items (self->chat_list);
+
+  for (guint i = 0; i < n_items; i++) {
+    g_autoptr(ChattyChat) chat = NULL;
+    GListModel *messages;
+    gsize size;
+
+    chat = g_list_model_get_item (self->chat_list, i);
+    messages = chatty_chat_get_messages (chat);
+    size = chatty_chat_get_memory_size (chat);
+    total += size;
+
+    if (!messages || !g_list_model_get_n_items (messages))
+      continue;
+
+    g_string_append_printf (str, "%s%s: %u messages, %" G_GSIZE_FORMAT " bytes\n",
+                            chatty_chat_get_chat_name (chat),
+                            chat == self->active_chat ? " (active)" : "",
+                            g_list_model_get_n_items (messages), size);
+  }
+
+  g_string_append_printf (str, "Total: %" G_GSIZE_FORMAT " bytes, budget: %u MiB\n",
+                          total, self->memory_budget);
+
+  return g_string_free (str, FALSE);
+}
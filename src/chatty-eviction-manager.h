@@ -0,0 +1,38 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-eviction-manager.h
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+#include "chatty-chat.h"
+
+G_BEGIN_DECLS
+
+#define CHATTY_TYPE_EVICTION_MANAGER (chatty_eviction_manager_get_type ())
+
+G_DECLARE_FINAL_TYPE (ChattyEvictionManager, chatty_eviction_manager, CHATTY, EVICTION_MANAGER, GObject)
+
+ChattyEvictionManager *chatty_eviction_manager_new                   (GListModel            *chat_list);
+void                   chatty_eviction_manager_set_active_chat       (ChattyEvictionManager *self,
+                                                                      ChattyChat            *chat);
+void                   chatty_eviction_manager_set_inactive_messages (ChattyEvictionManager *self,
+                                                                      guint                  n_messages);
+void                   chatty_eviction_manager_set_memory_budget     (ChattyEvictionManager *self,
+                                                                      guint                  budget);
+gsize                  chatty_eviction_manager_get_memory_size       (ChattyEvictionManager *self);
+guint                  chatty_eviction_manager_trim                  (ChattyEvictionManager *self,
+                                                                      guint                  n_keep);
+guint                  chatty_eviction_manager_check_budget          (ChattyEvictionManager *self);
+void                   chatty_eviction_manager_queue_check           (ChattyEvictionManager *self);
+char                  *chatty_eviction_manager_get_debug_info        (ChattyEvictionManager *self);
+
+G_END_DECLS
@@ -15,20 +15,128 @@
 # include "config.h"
 #endif
 
+#include <glib/gstdio.h>
+#include <json-glib/json-glib.h>
 #include <sqlite3.h>
+#include <string.h>
 
 #include "matrix/chatty-ma-account.h"
 #include "matrix/chatty-ma-chat.h"
+#include "matrix/matrix-utils.h"
 
 #include "chatty-utils.h"
 #include "chatty-settings.h"
-#include "chatty-history.h"
+#include "chatty-db-backup.h"
+#include "chatty-media-store.h"
+#include "chatty-trace.h"
+#include "chatty-history-private.h"
 
 #define STRING(arg) STRING_VALUE(arg)
 #define STRING_VALUE(arg) #arg
 
 /* increment when DB changes */
-#define HISTORY_VERSION 3
+#define HISTORY_VERSION 4
+
+/* Indexes introduced in version 4 */
+#define HISTORY_V4_INDEXES                                              \
+  /* Messages are looked up by uid to avoid duplicates */               \
+  "CREATE INDEX IF NOT EXISTS messages_uid_idx ON messages(uid);"       \
+  /* The last messages of threads are looked up by time */              \
+  "CREATE INDEX IF NOT EXISTS messages_thread_time_idx "                \
+  "ON messages(thread_id, time);"
+
+/* References to each file in the media store, introduced in version 4.
+ * Kept up to date by triggers, so that unused files can be removed */
+#define HISTORY_V4_MEDIA_REFS                                           \
+  "CREATE TABLE media_refs ("                                           \
+  "sha256 TEXT NOT NULL PRIMARY KEY, "                                  \
+  "ref_count INTEGER NOT NULL DEFAULT 0);"                              \
+                                                                        \
+  "CREATE TRIGGER files_media_insert "                                  \
+  "AFTER INSERT ON files "                                              \
+  "WHEN NEW.path GLOB '" CHATTY_MEDIA_STORE_GLOB "' "                   \
+  "BEGIN "                                                              \
+  "INSERT OR IGNORE INTO media_refs(sha256) "                           \
+  "VALUES(substr(NEW.path," STRING (CHATTY_MEDIA_STORE_HASH_START) "));"\
+  "UPDATE media_refs SET ref_count=ref_count+1 "                        \
+  "WHERE sha256=substr(NEW.path," STRING (CHATTY_MEDIA_STORE_HASH_START) ");"\
+  "END;"                                                                \
+                                                                        \
+  "CREATE TRIGGER files_media_update "                                  \
+  "AFTER UPDATE OF path ON files "                                      \
+  "WHEN OLD.path IS NOT NEW.path "                                      \
+  "BEGIN "                                                              \
+  "UPDATE media_refs SET ref_count=ref_count-1 "                        \
+  "WHERE OLD.path GLOB '" CHATTY_MEDIA_STORE_GLOB "' "                  \
+  "AND sha256=substr(OLD.path," STRING (CHATTY_MEDIA_STORE_HASH_START) ");"\
+  "INSERT OR IGNORE INTO media_refs(sha256) "                           \
+  "SELECT substr(NEW.path," STRING (CHATTY_MEDIA_STORE_HASH_START) ") " \
+  "WHERE NEW.path GLOB '" CHATTY_MEDIA_STORE_GLOB "';"                  \
+  "UPDATE media_refs SET ref_count=ref_count+1 "                        \
+  "WHERE NEW.path GLOB '" CHATTY_MEDIA_STORE_GLOB "' "                  \
+  "AND sha256=substr(NEW.path," STRING (CHATTY_MEDIA_STORE_HASH_START) ");"\
+  "END;"                                                                \
+                                                                        \
+  "CREATE TRIGGER files_media_delete "                                  \
+  "AFTER DELETE ON files "                                              \
+  "WHEN OLD.path GLOB '" CHATTY_MEDIA_STORE_GLOB "' "                   \
+  "BEGIN "                                                              \
+  "UPDATE media_refs SET ref_count=ref_count-1 "                        \
+  "WHERE sha256=substr(OLD.path," STRING (CHATTY_MEDIA_STORE_HASH_START) ");"\
+  "END;"
+
+/* Rows of the old tables migrated from version 0 in one transaction */
+#define MIGRATION_CHUNK_ROWS  1000
+/* Phone number chats migrated from version 0 in one transaction */
+#define MIGRATION_CHUNK_CHATS 20
+
+/* Steps of migrating from version 0, in order.  Saved in
+ * migration_progress, so shouldn't be modified */
+#define MIGRATION_STEP_IM            0
+#define MIGRATION_STEP_CHAT          1
+#define MIGRATION_STEP_TELEGRAM_IM   2
+#define MIGRATION_STEP_TELEGRAM_CHAT 3
+#define MIGRATION_STEP_SMS           4
+#define MIGRATION_STEP_FINISH        5
+#define N_MIGRATION_STEPS            6
+
+/* Steps of history maintenance, in order */
+#define MAINTENANCE_STEP_RETENTION 0
+#define MAINTENANCE_STEP_FILES     1
+#define MAINTENANCE_STEP_MEDIA     2
+#define MAINTENANCE_STEP_VACUUM    3
+#define MAINTENANCE_STEP_ANALYZE   4
+
+/* Rows deleted in one slice of maintenance */
+#define MAINTENANCE_CHUNK_ROWS  1000
+/* Free pages returned to the file system in one slice of maintenance */
+#define MAINTENANCE_CHUNK_PAGES 256
+/* Free pages, in percent of all pages, worth a VACUUM of the whole file */
+#define VACUUM_MIN_FREE_PERCENT 25
+/* Rows sampled per index by ANALYZE */
+#define MAINTENANCE_ANALYSIS_LIMIT 1000
+/* Unused files in media store younger than this, in seconds, are kept
+ * as their reference may not have been saved yet */
+#define MAINTENANCE_MEDIA_MIN_AGE (60 * 60)
+
+/* Messages written or read per slice of an export or import */
+#define EXPORT_CHUNK_ROWS 1000
+#define IMPORT_CHUNK_ROWS 1000
+
+/* Chats with phone numbers, migrated one by one */
+#define MIGRATION_TELEGRAM_IM_CHATS                             \
+  "SELECT DISTINCT account,who FROM chatty_im "                 \
+  "WHERE account GLOB '+[0-9]*[^@]*[0-9]' "                     \
+  "ORDER BY account,who"
+#define MIGRATION_TELEGRAM_CHAT_CHATS                           \
+  "SELECT DISTINCT account,who,room FROM chatty_chat "          \
+  "WHERE account GLOB '+[0-9]*[^@:.]*[0-9]' "                   \
+  "ORDER BY account,who,room"
+/* SMS users with phone numbers sorted */
+#define MIGRATION_SMS_CHATS                                     \
+  "SELECT DISTINCT generated.who FROM "                         \
+  "(SELECT who,id FROM chatty_im WHERE account='SMS' ORDER BY id ASC) " \
+  "AS generated ORDER BY generated.id"
 
 /* Shouldn't be modified, new values should be appended */
 #define CHATTY_ID_UNKNOWN_VALUE 0
@@ -87,6 +195,73 @@
 #define MESSAGE_STATUS_SENDING_FAILED   6
 #define MESSAGE_STATUS_DELIVERY_FAILED  7
 
+typedef struct {
+  int    step;
+  /* The last rowid, or the number of chats, migrated in @step */
+  gint64 position;
+  /* The @position at which @step is complete */
+  gint64 total;
+  char  *country_code;
+} HistoryMigration;
+
+typedef struct {
+  ChattyProtocol  protocols;
+  /* Set if the rule is for a single chat */
+  ChattyChat     *chat;
+  /* 0 if unlimited */
+  guint           max_days;
+  guint           max_messages;
+} RetentionRule;
+
+typedef struct {
+  int    thread_id;
+  /* Messages older than this are deleted */
+  gint64 before;
+} RetentionThread;
+
+typedef struct {
+  GTask  *task;
+  /* Threads to apply retention on, and the current one */
+  GArray *threads;
+  guint   thread_index;
+  char   *cache_dir;
+  int     step;
+  gboolean orphans_found;
+  /* The media store directory being checked, the last is "url" */
+  guint   media_index;
+  gint64  n_messages;
+  gint64  n_files;
+} HistoryMaintenance;
+
+typedef struct {
+  GTask         *task;
+  GOutputStream *stream;
+  JsonGenerator *generator;
+  sqlite3_stmt  *stmt;
+  char          *attachments_dir;
+  char          *cache_dir;
+  /* Cached files to copy once the messages are written */
+  GPtrArray     *files;
+  /* Messages are walked in the order of their id */
+  gint64         last_id;
+  gint64         n_messages;
+  gint64         n_files;
+} HistoryExport;
+
+typedef struct {
+  GTask            *task;
+  GDataInputStream *stream;
+  JsonParser       *parser;
+  sqlite3_stmt     *stmt;
+  char             *attachments_dir;
+  char             *cache_dir;
+  /* "u:type:username", "a:user_id:protocol" and "t:account_id:type:name" → id */
+  GHashTable       *ids;
+  gint64            n_lines;
+  gint64            n_messages;
+  gint64            n_skipped;
+} HistoryImport;
+
 struct _ChattyHistory
 {
   GObject      parent_instance;
@@ -95,8 +270,39 @@ struct _ChattyHistory
   GThread     *worker_thread;
   sqlite3     *db;
   char        *db_path;
+
+  /* Migration from version 0 in progress, accessed only in worker_thread */
+  HistoryMigration *migration;
+  /* Rows of old tables migrated at once, set only before opening */
+  guint             migration_chunk_rows;
+  /* Backup in progress and its task, accessed only in worker_thread */
+  ChattyDbBackup   *backup;
+  GTask            *backup_task;
+  /* Maintenance in progress, accessed only in worker_thread */
+  HistoryMaintenance *maintenance;
+  /* Export and import in progress, accessed only in worker_thread */
+  HistoryExport      *export;
+  HistoryImport      *import;
+
+  /* accessed only in main thread */
+  double       migration_progress;
+  /* account name → LastTimes, accessed only in main thread */
+  GHashTable  *last_times;
+  /* RetentionRule, accessed only in main thread */
+  GPtrArray   *retention_rules;
 };
 
+typedef struct {
+  ChattyHistory *history;
+  double         progress;
+} ProgressData;
+
+typedef struct {
+  /* thread name → last message time */
+  GHashTable *rooms;
+  gboolean    loaded;
+} LastTimes;
+
 /*
  * ChattyHistory->db should never be accessed nor modified in main thread
  * except for checking if it’s %NULL.  Any operation should be done only
@@ -110,6 +316,62 @@ static int     add_file_info   (ChattyHistory  *self,
 
 G_DEFINE_TYPE (ChattyHistory, chatty_history, G_TYPE_OBJECT)
 
+enum {
+  PROP_0,
+  PROP_MIGRATION_PROGRESS,
+  N_PROPS
+};
+
+static GParamSpec *properties[N_PROPS];
+
+static void
+last_times_free (LastTimes *last_times)
+{
+  g_hash_table_unref (last_times->rooms);
+  g_free (last_times);
+}
+
+static LastTimes *
+history_get_last_times (ChattyHistory *self,
+                        const char    *account,
+                        gboolean       create)
+{
+  LastTimes *last_times;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+
+  if (!account)
+    return NULL;
+
+  last_times = g_hash_table_lookup (self->last_times, account);
+
+  if (!last_times && create) {
+    last_times = g_new0 (LastTimes, 1);
+    last_times->rooms = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    g_hash_table_insert (self->last_times, g_strdup (account), last_times);
+  }
+
+  return last_times;
+}
+
+/* Keep the last message time of @room up to date, if tracked */
+static void
+history_set_last_time (ChattyHistory *self,
+                       const char    *account,
+                       const char    *room,
+                       int            time_stamp)
+{
+  LastTimes *last_times;
+
+  last_times = history_get_last_times (self, account, FALSE);
+
+  if (!last_times || !room)
+    return;
+
+  if (time_stamp > GPOINTER_TO_INT (g_hash_table_lookup (last_times->rooms, room)))
+    g_hash_table_insert (last_times->rooms, g_strdup (room), GINT_TO_POINTER (time_stamp));
+}
+
 static ChattyMsgDirection
 history_direction_from_value (int direction)
 {
@@ -462,7 +724,10 @@ chatty_history_create_schema (ChattyHistory *self,
   /* XXX: SELECT * FROM files sounds better, WHERE file.id != x feels better too.
    * So what to name? file or files?
    */
-  sql = "BEGIN TRANSACTION;"
+  /* Should be set before any table is created */
+  sql = "PRAGMA auto_vacuum = INCREMENTAL;"
+
+    "BEGIN TRANSACTION;"
 
     "CREATE TABLE IF NOT EXISTS mime_type ("
     "id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, "
@@ -575,6 +840,10 @@ chatty_history_create_schema (ChattyHistory *self,
     "ALTER TABLE threads ADD COLUMN visibility INT NOT NULL DEFAULT "
     STRING(THREAD_VISIBILITY_VISIBLE) ";"
 
+    /* Introduced in Version 4 */
+    HISTORY_V4_INDEXES
+    HISTORY_V4_MEDIA_REFS
+
     "COMMIT;";
 
   status = sqlite3_exec (self->db, sql, NULL, NULL, &error);
@@ -844,21 +1113,20 @@ insert_or_ignore_thread (ChattyHistory *self,
 static void
 chatty_history_backup (ChattyHistory *self)
 {
-  g_autoptr(GFile) backup_db = NULL;
-  g_autoptr(GFile) old_db = NULL;
-  g_autofree char *backup_name = NULL;
+  g_autoptr(ChattyDbBackup) backup = NULL;
   g_autoptr(GError) error = NULL;
 
-  backup_name = g_strdup_printf ("%s.%ld", self->db_path, time (NULL));
   g_info ("Copying database for backup");
 
-  old_db = g_file_new_for_path (self->db_path);
-  backup_db = g_file_new_for_path (backup_name);
-  g_file_copy (old_db, backup_db, G_FILE_COPY_NONE, NULL, NULL, NULL, &error);
+  /* The migration has to wait for the backup, so copy everything at once */
+  backup = chatty_db_backup_new (self->db, 0, FALSE, &error);
+
+  if (backup)
+    chatty_db_backup_step (backup, -1, &error);
+
   g_info ("Copying database complete");
 
   if (error &&
-      !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND) &&
       !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_EXISTS))
     g_critical ("Error creating DB backup: %s", error->message);
 }
@@ -952,1605 +1220,3897 @@ history_add_thread (ChattyHistory *self,
   return status == SQLITE_DONE;
 }
 
-/* TODO */
-/* this function works for migration from v0
- * to v1, v2, and v3 as the tables and columns
- * used in this function doesn't change in
- * v1, v2 or v3.
- */
 static gboolean
-chatty_history_migrate_db_to_v1_to_v3 (ChattyHistory *self,
-                                       GTask         *task)
+history_table_exists (ChattyHistory *self,
+                      const char    *name)
 {
-  char *error = NULL;
+  sqlite3_stmt *stmt;
   int status;
 
   g_assert (CHATTY_IS_HISTORY (self));
-  g_assert (G_IS_TASK (task));
   g_assert (g_thread_self () == self->worker_thread);
+  g_assert (self->db);
 
-  chatty_history_backup (self);
-
-  if (!chatty_history_create_schema (self, task))
-    return FALSE;
-
-  status = sqlite3_exec (self->db,
-                         "BEGIN TRANSACTION;"
-
-                         /*** Users ***/
-                         /* XMPP IM accounts */
-                         "INSERT OR IGNORE INTO users(username,type) "
-                         "SELECT DISTINCT account," STRING(CHATTY_ID_XMPP_VALUE) " FROM chatty_im "
-                         /* A Rough match for XMPP accounts */
-                         "WHERE chatty_im.account GLOB '[^@+]*' "
-                         "AND chatty_im.account!='SMS' "
-                         "AND chatty_im.who GLOB '[^@+]*@*';"
-
-                         /* XMPP MUC accounts */
-                         "INSERT OR IGNORE INTO users(username,type) "
-                         "SELECT DISTINCT account," STRING(CHATTY_ID_XMPP_VALUE) " FROM chatty_chat "
-                         /* A Rough match for XMPP accounts */
-                         "WHERE chatty_chat.account GLOB '[^@+]*' "
-                         "AND chatty_chat.room GLOB '[^@+]*@*';"
-
-                         /* SMS account */
-                         "INSERT OR IGNORE INTO users(username,type) "
-                         "SELECT DISTINCT account," STRING(CHATTY_ID_PHONE_VALUE) " FROM chatty_im "
-                         "WHERE account='SMS';"
-
-                         /* Matrix accounts */
-                         "INSERT OR IGNORE INTO users(username,type) "
-                         "SELECT DISTINCT account," STRING(CHATTY_ID_MATRIX_VALUE) " FROM chatty_chat "
-                         /* A Rough match for Matrix chat */
-                         "WHERE chatty_chat.room GLOB '!?*:?*' "
-                         "AND chatty_chat.account NOT GLOB '?*@?*' "
-                         "AND chatty_chat.account NOT GLOB '+?*' "
-                         "AND chatty_chat.account!='SMS';"
-
-                         /* XMPP IM users */
-                         "INSERT OR IGNORE INTO users(username,type) "
-                         "SELECT DISTINCT substr(who,0,"
-                         "CASE "
-                         "WHEN instr(who, '/') > 0 THEN instr(who, '/') "
-                         "ELSE length(who) + 1 "
-                         "END),"
-                         STRING(CHATTY_ID_XMPP_VALUE) " FROM chatty_im "
-                         /* A Rough match for XMPP users */
-                         "WHERE chatty_im.account GLOB '[^@+]*' "
-                         "AND chatty_im.account!='SMS' "
-                         "AND chatty_im.who GLOB '[^@]*@*';"
-
-                         /* XMPP MUC users */
-                         "INSERT OR IGNORE INTO users(username,type) "
-                         "SELECT DISTINCT "
-                         /* A Rough match for XMPP users */
-                         "CASE "
-                         "  WHEN chatty_chat.who LIKE chatty_chat.room || '/%' THEN chatty_chat.who "
-                         "  WHEN chatty_chat.who LIKE '%/%' THEN substr(who,0,instr(who, '/')) "
-                         "  ELSE chatty_chat.who "
-                         "END,"
-                         STRING(CHATTY_ID_XMPP_VALUE) " FROM chatty_chat "
-                         "WHERE chatty_chat.account GLOB '[^@+]*' "
-                         "AND chatty_chat.who GLOB '[^@]*@*' "
-                         "AND chatty_chat.room GLOB '[^@]*@*';"
-
-                         /* Matrix chat users */
-                         "INSERT OR IGNORE INTO users (username,type) "
-                         "SELECT DISTINCT who,"
-                         STRING(CHATTY_ID_MATRIX_VALUE) " FROM chatty_chat "
-                         /* A Rough match for users that are not regular phone numbers */
-                         "WHERE chatty_chat.room GLOB '!?*:?*' "
-                         "AND chatty_chat.who GLOB '@?*:?*' "
-                         /* Skip possible Telegram accounts */
-                         "AND chatty_chat.account NOT GLOB '+[0-9]*';"
-
-                         /*** Accounts ***/
-                         /* We have exactly one account for SMS */
-                         "INSERT OR IGNORE INTO accounts(user_id,protocol,enabled) "
-                         "SELECT DISTINCT users.id," STRING(PROTOCOL_SMS) ",1 FROM users "
-                         "WHERE users.username='SMS';"
-
-                         /* XMPP IM accounts */
-                         "INSERT OR IGNORE INTO accounts(user_id,protocol) "
-                         "SELECT DISTINCT users.id," STRING(PROTOCOL_XMPP) " FROM users "
-                         "INNER JOIN chatty_im "
-                         "ON chatty_im.account=users.username "
-                         "AND users.type='" STRING(CHATTY_ID_XMPP_VALUE) "';"
-
-                         /* XMPP MUC accounts */
-                         "INSERT OR IGNORE INTO accounts(user_id,protocol) "
-                         "SELECT DISTINCT users.id," STRING(PROTOCOL_XMPP) " FROM users "
-                         "INNER JOIN chatty_chat "
-                         "ON chatty_chat.account=users.username "
-                         "AND users.type=" STRING(CHATTY_ID_XMPP_VALUE) ";"
-
-                         /* XMPP MUC accounts */
-                         "INSERT OR IGNORE INTO accounts(user_id,protocol) "
-                         "SELECT DISTINCT users.id," STRING(PROTOCOL_MATRIX) " FROM users "
-                         "INNER JOIN chatty_chat "
-                         "ON chatty_chat.account=users.username "
-                         "AND users.type=" STRING(CHATTY_ID_MATRIX_VALUE) ";"
-
-                         /*** Threads ***/
-                         /* XMPP IM chats */
-                         "INSERT OR IGNORE INTO threads(name,account_id,type) "
-                         "SELECT DISTINCT substr(who,0,"
-                         "CASE "
-                         "WHEN instr(who, '/') > 0 THEN instr(who, '/') "
-                         "ELSE length(who) + 1 "
-                         "END),"
-                         "accounts.id," STRING(THREAD_DIRECT_CHAT) " "
-                         "FROM chatty_im "
-                         "INNER JOIN accounts "
-                         "  ON accounts.user_id=users.id "
-                         "INNER JOIN users "
-                         "  ON users.username=chatty_im.account "
-                         "WHERE users.type=" STRING(CHATTY_ID_XMPP_VALUE) ";"
-
-                         /* XMPP MUC chats */
-                         "INSERT OR IGNORE INTO threads(name,account_id,type) "
-                         "SELECT DISTINCT room,"
-                         "accounts.id," STRING(THREAD_GROUP_CHAT) " "
-                         "FROM chatty_chat "
-                         "INNER JOIN accounts "
-                         "  ON accounts.user_id=users.id "
-                         "INNER JOIN users "
-                         "  ON users.username=chatty_chat.account "
-                         "WHERE users.type=" STRING(CHATTY_ID_XMPP_VALUE) ";"
-
-                         /* Matrix chats */
-                         "INSERT OR IGNORE INTO threads(name,account_id,type) "
-                         "SELECT DISTINCT room,accounts.id," STRING(THREAD_GROUP_CHAT) " "
-                         "FROM chatty_chat "
-                         "INNER JOIN accounts "
-                         "  ON accounts.user_id=users.id "
-                         "INNER JOIN users "
-                         "  ON users.username=chatty_chat.account "
-                         "WHERE users.type=" STRING(CHATTY_ID_MATRIX_VALUE) ";"
-
-                         /* Telegram IM chats */
-                         "INSERT OR IGNORE INTO threads(name,account_id,type) "
-                         "SELECT DISTINCT who,accounts.id," STRING(THREAD_DIRECT_CHAT) " "
-                         "FROM chatty_im "
-                         "INNER JOIN accounts "
-                         "  ON accounts.user_id=users.id "
-                         "INNER JOIN users "
-                         "  ON users.username=chatty_im.account "
-                         "WHERE chatty_im.account!='SMS' AND users.type=" STRING(CHATTY_ID_PHONE_VALUE) ";"
-
-                         /* Telegram MUC chats */
-                         "INSERT OR IGNORE INTO threads(name,account_id,type) "
-                         "SELECT DISTINCT room,accounts.id," STRING(THREAD_GROUP_CHAT) " "
-                         "FROM chatty_chat "
-                         "INNER JOIN accounts "
-                         "  ON accounts.user_id=users.id "
-                         "INNER JOIN users "
-                         "  ON users.username=chatty_chat.account "
-                         "WHERE users.type=" STRING(CHATTY_ID_PHONE_VALUE) ";"
-
-                         /*** Thread Members ***/
-                         /* XMPP IM chat members */
-                         "INSERT OR IGNORE INTO thread_members(thread_id,user_id) "
-                         "SELECT DISTINCT threads.id,u.id FROM chatty_im "
-                         "INNER JOIN threads "
-                         "ON chatty_im.who LIKE threads.name || '%' "
-                         "INNER JOIN users As a "
-                         "ON threads.account_id=accounts.id "
-                         "INNER JOIN accounts "
-                         "ON accounts.user_id=a.id AND a.username=chatty_im.account "
-                         "AND a.type=" STRING(CHATTY_ID_XMPP_VALUE) " "
-                         "INNER JOIN users AS u "
-                         "ON chatty_im.who LIKE u.username || '%';"
-
-                         /* XMPP MUC members */
-                         "INSERT OR IGNORE INTO thread_members(thread_id,user_id) "
-                         "SELECT DISTINCT threads.id,u.id FROM chatty_chat "
-                         "INNER JOIN threads "
-                         "ON chatty_chat.room=threads.name "
-                         "INNER JOIN accounts "
-                         "ON threads.account_id=accounts.id "
-                         "INNER JOIN users AS a "
-                         "ON accounts.user_id=a.id AND a.username=chatty_chat.account "
-                         "AND a.type=" STRING(CHATTY_ID_XMPP_VALUE) " "
-                         "INNER JOIN users AS u "
-                         "ON chatty_chat.who=u.username "
-                         "OR chatty_chat.who LIKE u.username || '/%' "
-                         "OR chatty_chat.who LIKE chatty_chat.room || '/' || u.username "
-                         "WHERE chatty_chat.direction!=-1;"
-
-                         /* Matrix chat members */
-                         "INSERT OR IGNORE INTO thread_members(thread_id,user_id) "
-                         "SELECT DISTINCT threads.id,u.id FROM chatty_chat "
-                         "INNER JOIN threads "
-                         "ON chatty_chat.room=threads.name "
-                         "INNER JOIN users As a "
-                         "ON threads.account_id=accounts.id "
-                         "INNER JOIN accounts "
-                         "ON accounts.user_id=a.id AND a.username=chatty_chat.account "
-                         "AND a.type=" STRING(CHATTY_ID_MATRIX_VALUE) " "
-                         "INNER JOIN users AS u "
-                         "ON u.username NOT NULL AND chatty_chat.who=u.username;"
-
-                         /*** Messages ***/
-                         /* XMPP IM messages */
-                         "INSERT OR IGNORE INTO messages(uid,thread_id,sender_id,body,body_type,time,direction) "
-                         /* Always assume HTML */
-                         "SELECT DISTINCT uid,threads.id,u.id,message," STRING(MESSAGE_TYPE_HTML_ESCAPED) ",timestamp,direction "
-                         "FROM chatty_im "
-                         "INNER JOIN threads "
-                         "ON chatty_im.who LIKE threads.name || '%' "
-                         "INNER JOIN users As a "
-                         "ON threads.account_id=accounts.id "
-                         "INNER JOIN accounts "
-                         "ON accounts.user_id=a.id AND a.username=chatty_im.account "
-                         "INNER JOIN users AS u "
-                         "ON chatty_im.who LIKE u.username || '%' "
-                         "WHERE chatty_im.account GLOB '[^@]*@*' "
-                         "ORDER BY timestamp ASC, chatty_im.id ASC;"
-
-                         /* XMPP MUC chat messages */
-                         "INSERT OR IGNORE INTO messages(uid,thread_id,sender_id,body,body_type,time,direction) "
-                         /* Always assume HTML */
-                         "SELECT DISTINCT uid,threads.id,"
-                         "CASE "
-                         "WHEN chatty_chat.direction=-1 THEN a.id "
-                         "WHEN chatty_chat.who=NULL THEN NULL "
-                         "ELSE u.id "
-                         "END,"
-                         "message," STRING(MESSAGE_TYPE_HTML_ESCAPED) ",timestamp,direction "
-                         "FROM chatty_chat "
-                         "INNER JOIN threads "
-                         "ON chatty_chat.room LIKE threads.name || '%' "
-                         "INNER JOIN accounts "
-                         "ON threads.account_id=accounts.id "
-                         "INNER JOIN users As a "
-                         "ON accounts.user_id=a.id AND a.username=chatty_chat.account "
-                         "LEFT JOIN users AS u "
-                         "ON chatty_chat.who=u.username "
-                         "OR chatty_chat.who LIKE u.username || '/%' "
-                         "OR chatty_chat.who LIKE chatty_chat.room || '/' || u.username "
-                         "WHERE chatty_chat.account GLOB '[^@]*@*' "
-                         "ORDER BY timestamp ASC, chatty_chat.id ASC;"
-
-                         /* Matrix chat messages */
-                         "INSERT OR IGNORE INTO messages(uid,thread_id,sender_id,body,body_type,time,direction) "
-                         /* Always assume HTML */
-                         "SELECT DISTINCT uid,threads.id,"
-                         "CASE "
-                         "WHEN chatty_chat.direction=-1 AND chatty_chat.who=NULL THEN a.id "
-                         "WHEN chatty_chat.direction=-1 THEN u.id "
-                         "WHEN chatty_chat.who=NULL THEN NULL "
-                         "ELSE u.id "
-                         "END,"
-                         "message," STRING(MESSAGE_TYPE_HTML_ESCAPED) ",timestamp,direction "
-                         "FROM chatty_chat "
-                         "INNER JOIN threads "
-                         "ON chatty_chat.room=threads.name "
-                         "INNER JOIN accounts "
-                         "ON threads.account_id=accounts.id "
-                         "INNER JOIN users As a "
-                         "ON accounts.user_id=a.id AND a.username=chatty_chat.account "
-                         "LEFT JOIN users AS u "
-                         "ON chatty_chat.who=u.username "
-                         "WHERE chatty_chat.room GLOB '!?*:?*' "
-                         "AND chatty_chat.who IS NULL or chatty_chat.who GLOB '@?*:?*' "
-                         "ORDER BY timestamp ASC, chatty_chat.id ASC;"
+  sqlite3_prepare_v2 (self->db,
+                      "SELECT 1 FROM sqlite_master WHERE type='table' AND name=?;",
+                      -1, &stmt, NULL);
+  history_bind_text (stmt, 1, name, "binding when checking table");
+  status = sqlite3_step (stmt);
+  sqlite3_finalize (stmt);
 
-                         "COMMIT;",
-                         NULL, NULL, &error);
+  return status == SQLITE_ROW;
+}
 
-  if (!e_phone_number_is_supported ())
-    g_debug ("Not compiled with libphonenumber");
+static void
+history_migration_free (HistoryMigration *migration)
+{
+  g_free (migration->country_code);
+  g_free (migration);
+}
 
-  if (status == SQLITE_OK) {
-    sqlite3_stmt *stmt;
-
-    /* Get all numbers in international format */
-    status = sqlite3_prepare_v2 (self->db,
-                                 /* Telegram IM */
-                                 "SELECT DISTINCT account,who FROM chatty_im "
-                                 "WHERE account GLOB '+[0-9]*[^@]*[0-9]';",
-                                 -1, &stmt, NULL);
-    if (status == SQLITE_OK)
-      status = sqlite3_exec (self->db, "BEGIN TRANSACTION;", NULL, NULL, &error);
-
-    while (sqlite3_step (stmt) == SQLITE_ROW) {
-      g_autofree char *account_number = NULL;
-      g_autofree char *sender_number = NULL;
-      sqlite3_stmt *insert_stmt = NULL;
-      const char *account, *sender;
-
-      account = (gpointer)sqlite3_column_text (stmt, 0);
-      sender = (gpointer)sqlite3_column_text (stmt, 1);
-
-      account_number = chatty_utils_check_phonenumber (account, NULL);
-      sender_number  = chatty_utils_check_phonenumber (sender, NULL);
-
-      if (!history_add_phone_user (self, task,
-                                   account_number ? account_number : account,
-                                   !account_number ? account: NULL))
-        return FALSE;
-
-      /* Fill in accounts */
-      if (!history_add_phone_account (self, task,
-                                      account_number ? account_number : account,
-                                      g_strcmp0 (account, "SMS") == 0 ? PROTOCOL_SMS : PROTOCOL_TELEGRAM))
-        return FALSE;
-
-      if (!history_add_phone_user (self, task,
-                                   sender_number ? sender_number : sender,
-                                   !sender_number ? sender: NULL))
-        return FALSE;
-
-      if (!history_add_thread (self, task,
-                               account_number ? account_number : account,
-                               sender_number ? sender_number : sender,
-                               !sender_number ? sender: NULL,
-                               THREAD_DIRECT_CHAT))
-        return FALSE;
-
-      /* Fill in messages */
-      sqlite3_prepare_v2 (self->db,
-                          "INSERT OR IGNORE INTO messages(uid,thread_id,sender_id,body,body_type,time,direction) "
-                          "SELECT DISTINCT uid,threads.id,u.id,message," STRING(MESSAGE_TYPE_HTML_ESCAPED) ",timestamp,direction "
-                          "FROM chatty_im "
-                          "INNER JOIN threads "
-                          "ON threads.name=? AND chatty_im.who=? "
-                          "INNER JOIN accounts "
-                          "ON threads.account_id=accounts.id "
-                          "INNER JOIN users AS a "
-                          "ON accounts.user_id=a.id AND a.username=? AND chatty_im.account=? "
-                          "INNER JOIN users as u "
-                          "ON u.username=? "
-                          "ORDER BY timestamp ASC, chatty_im.id ASC;",
-                          -1, &insert_stmt, NULL);
-
-      history_bind_text (insert_stmt, 1, sender_number ? sender_number : sender, "binding when adding message");
-      history_bind_text (insert_stmt, 2, sender, "binding when adding message");
-      history_bind_text (insert_stmt, 3, account_number ? account_number : account, "binding when adding message");
-      history_bind_text (insert_stmt, 4, account, "binding when adding message");
-      history_bind_text (insert_stmt, 5, sender_number ? sender_number : sender, "binding when adding message");
-      status = sqlite3_step (insert_stmt);
-      sqlite3_finalize (insert_stmt);
-    }
+static void
+retention_rule_free (RetentionRule *rule)
+{
+  g_clear_object (&rule->chat);
+  g_free (rule);
+}
 
-    sqlite3_exec (self->db,
-                  "INSERT OR IGNORE INTO thread_members(thread_id,user_id) "
-                  "SELECT DISTINCT threads.id,u.id FROM threads "
-                  "INNER JOIN users AS u "
-                  "ON threads.name=u.username "
-                  "AND u.type="STRING(CHATTY_ID_PHONE_VALUE) ";",
-                  NULL, NULL, &error);
+static RetentionRule *
+retention_rule_copy (RetentionRule *rule)
+{
+  RetentionRule *copy;
 
-    if (status == SQLITE_DONE || status == SQLITE_OK)
-      status = sqlite3_exec (self->db, "COMMIT;", NULL, NULL, &error);
+  copy = g_new (RetentionRule, 1);
+  *copy = *rule;
 
-    sqlite3_finalize (stmt);
-  }
+  if (copy->chat)
+    g_object_ref (copy->chat);
 
-  if (status == SQLITE_OK) {
-    sqlite3_stmt *stmt;
-    status = sqlite3_prepare_v2 (self->db,
-                                 /* Telegram Chats */
-                                 "SELECT DISTINCT account,who,room FROM chatty_chat "
-                                 "WHERE account GLOB '+[0-9]*[^@:.]*[0-9]';",
-                                 -1, &stmt, NULL);
-
-    if (status == SQLITE_OK)
-      status = sqlite3_exec (self->db, "BEGIN TRANSACTION;", NULL, NULL, &error);
-
-    while (sqlite3_step (stmt) == SQLITE_ROW) {
-      g_autofree char *account_number = NULL;
-      g_autofree char *sender_number = NULL;
-      sqlite3_stmt *insert_stmt = NULL;
-      const char *account, *sender, *room;
-
-      account = (gpointer)sqlite3_column_text (stmt, 0);
-      sender = (gpointer)sqlite3_column_text (stmt, 1);
-      room = (gpointer)sqlite3_column_text (stmt, 2);
-
-      account_number = chatty_utils_check_phonenumber (account, NULL);
-      sender_number  = chatty_utils_check_phonenumber (sender, NULL);
-
-      if (!history_add_phone_user (self, task,
-                                   account_number ? account_number : account,
-                                   !account_number ? account: NULL))
-        return FALSE;
-
-      /* Fill in accounts */
-      if (!history_add_phone_account (self, task,
-                                      account_number ? account_number : account,
-                                      g_strcmp0 (account, "SMS") == 0 ? PROTOCOL_SMS : PROTOCOL_TELEGRAM))
-        return FALSE;
-
-      if (sender &&
-          !history_add_phone_user (self, task,
-                                   sender_number ? sender_number : sender,
-                                   !sender_number ? sender: NULL))
-        return FALSE;
-
-      if (!history_add_thread (self, task,
-                               account_number ? account_number : account,
-                               room, room, THREAD_GROUP_CHAT))
-        return FALSE;
-
-      /* Fill in messages with no author */
-      sqlite3_prepare_v2 (self->db,
-                          "INSERT OR IGNORE INTO messages(uid,thread_id,sender_id,body,body_type,time,direction) "
-                          "SELECT DISTINCT uid,threads.id,"
-                          "CASE "
-                          "WHEN chatty_chat.direction=-1 THEN a.id "
-                          "WHEN chatty_chat.who=NULL THEN NULL "
-                          "END,"
-                          "message," STRING(MESSAGE_TYPE_HTML_ESCAPED) ",timestamp,direction "
-                          "FROM chatty_chat "
-                          "INNER JOIN threads "
-                          "ON threads.name=chatty_chat.room AND threads.name=? "
-                          "INNER JOIN accounts "
-                          "ON threads.account_id=accounts.id "
-                          "INNER JOIN users AS a "
-                          "ON accounts.user_id=a.id AND a.username=? AND chatty_chat.account=? "
-                          "AND chatty_chat.who IS NULL "
-                          "ORDER BY timestamp ASC, chatty_chat.id ASC;",
-                          -1, &insert_stmt, NULL);
-
-      history_bind_text (insert_stmt, 1, room, "binding when adding message");
-      history_bind_text (insert_stmt, 2, account_number ? account_number : account, "binding when adding message");
-      history_bind_text (insert_stmt, 3, account, "binding when adding message");
-      status = sqlite3_step (insert_stmt);
-      sqlite3_finalize (insert_stmt);
-
-      /* Fill in messages with author */
-      sqlite3_prepare_v2 (self->db,
-                          "INSERT OR IGNORE INTO messages(uid,thread_id,sender_id,body,body_type,time,direction) "
-                          "SELECT DISTINCT uid,threads.id,u.id,"
-                          "message," STRING(MESSAGE_TYPE_HTML_ESCAPED) ",timestamp,direction "
-                          "FROM chatty_chat "
-                          "INNER JOIN threads "
-                          "ON threads.name=chatty_chat.room AND threads.name=? "
-                          "INNER JOIN accounts "
-                          "ON threads.account_id=accounts.id "
-                          "INNER JOIN users AS a "
-                          "ON accounts.user_id=a.id AND a.username=? AND chatty_chat.account=? "
-                          "INNER JOIN users as u "
-                          "ON u.username=? AND chatty_chat.who=? "
-                          "AND chatty_chat.who NOT NULL "
-                          "AND chatty_chat.direction!=-1 "
-                          "ORDER BY timestamp ASC, chatty_chat.id ASC;",
-                          -1, &insert_stmt, NULL);
-
-      history_bind_text (insert_stmt, 1, room, "binding when adding threads");
-      history_bind_text (insert_stmt, 2, account_number ? account_number : account, "binding when adding phone number");
-      history_bind_text (insert_stmt, 3, account, "binding when adding phone number");
-      history_bind_text (insert_stmt, 4, sender_number ? sender_number : sender, "binding when adding threads");
-      history_bind_text (insert_stmt, 5, sender, "binding when adding threads");
-      status = sqlite3_step (insert_stmt);
-      sqlite3_finalize (insert_stmt);
-
-      /* Fill in chat thread members */
-      sqlite3_prepare_v2 (self->db, "INSERT OR IGNORE INTO thread_members(thread_id,user_id) "
-                          "SELECT DISTINCT threads.id,u.id FROM threads "
-                          "INNER JOIN accounts "
-                          "ON threads.account_id=accounts.id "
-                          "INNER JOIN users AS a "
-                          "ON accounts.user_id=a.id AND a.username=? "
-                          "INNER JOIN chatty_chat "
-                          "ON chatty_chat.account=? "
-                          "AND threads.name=chatty_chat.room AND threads.name=? "
-                          "INNER JOIN users AS u "
-                          "ON u.type=" STRING(CHATTY_ID_PHONE_VALUE) " "
-                          "AND u.username=? AND chatty_chat.who=?;",
-                          -1, &insert_stmt, NULL);
-
-      history_bind_text (insert_stmt, 1, account_number ? account_number : account, "binding when adding thread member");
-      history_bind_text (insert_stmt, 2, account, "binding when adding thread member");
-      history_bind_text (insert_stmt, 3, room, "binding when adding thread member");
-      history_bind_text (insert_stmt, 4, sender_number ? sender_number : sender, "binding when adding thread member");
-      history_bind_text (insert_stmt, 5, sender, "binding when adding thread member");
-      status = sqlite3_step (insert_stmt);
-      sqlite3_finalize (insert_stmt);
-    }
+  return copy;
+}
 
-    sqlite3_exec (self->db,
-                  "INSERT OR IGNORE INTO thread_members(thread_id,user_id) "
-                  "SELECT DISTINCT threads.id,u.id FROM threads "
-                  "INNER JOIN users AS u "
-                  "ON threads.name=u.username "
-                  "AND u.type="STRING(CHATTY_ID_PHONE_VALUE) ";",
-                  NULL, NULL, &error);
+static void
+history_maintenance_free (HistoryMaintenance *maintenance)
+{
+  g_clear_object (&maintenance->task);
+  g_clear_pointer (&maintenance->threads, g_array_unref);
+  g_free (maintenance->cache_dir);
+  g_free (maintenance);
+}
 
-    if (status == SQLITE_DONE || status == SQLITE_OK)
-      status = sqlite3_exec (self->db, "COMMIT;", NULL, NULL, &error);
+static void
+history_export_free (HistoryExport *export)
+{
+  g_clear_object (&export->task);
+  g_clear_object (&export->stream);
+  g_clear_object (&export->generator);
+  g_clear_pointer (&export->stmt, sqlite3_finalize);
+  g_clear_pointer (&export->files, g_ptr_array_unref);
+  g_free (export->attachments_dir);
+  g_free (export->cache_dir);
+  g_free (export);
+}
 
-    sqlite3_finalize (stmt);
-  }
+static void
+history_import_free (HistoryImport *import)
+{
+  g_clear_object (&import->task);
+  g_clear_object (&import->stream);
+  g_clear_object (&import->parser);
+  g_clear_pointer (&import->stmt, sqlite3_finalize);
+  g_clear_pointer (&import->ids, g_hash_table_unref);
+  g_free (import->attachments_dir);
+  g_free (import->cache_dir);
+  g_free (import);
+}
 
-  if (status == SQLITE_OK) {
-    sqlite3_stmt *stmt;
-    status = sqlite3_prepare_v2 (self->db,
-                                 /* SMS users with phone numbers sorted */
-                                 "SELECT DISTINCT generated.who FROM "
-                                 "(SELECT who,id FROM chatty_im WHERE account='SMS' ORDER BY id ASC) "
-                                 "AS generated ORDER BY generated.id;",
-                                 -1, &stmt, NULL);
-
-    if (status == SQLITE_OK)
-      status = sqlite3_exec (self->db, "BEGIN TRANSACTION;", NULL, NULL, &error);
-
-    while (sqlite3_step (stmt) == SQLITE_ROW) {
-      g_autofree char *sender_number = NULL;
-      sqlite3_stmt *insert_stmt = NULL;
-      const char *sender, *country;
-
-      sender = (gpointer)sqlite3_column_text (stmt, 0);
-      country = g_object_get_data (G_OBJECT (task), "country-code");
-
-      sender_number  = chatty_utils_check_phonenumber (sender, country);
-
-      history_add_phone_user (self, task,
-                              sender_number ? sender_number : sender,
-                              NULL);
-
-      history_add_thread (self, task, "SMS",
-                          sender_number ? sender_number : sender,
-                          sender, THREAD_DIRECT_CHAT);
-
-      /* Fill in messages with no author */
-      sqlite3_prepare_v2 (self->db, "INSERT OR IGNORE INTO messages(uid,thread_id,sender_id,body,body_type,time,direction) "
-                          "SELECT DISTINCT uid,threads.id,u.id,message," STRING(MESSAGE_TYPE_TEXT) ",timestamp,direction "
-                          "FROM chatty_im "
-                          "INNER JOIN threads "
-                          "ON threads.name=? AND chatty_im.who=? "
-                          "INNER JOIN accounts "
-                          "ON threads.account_id=accounts.id "
-                          "INNER JOIN users AS a "
-                          "ON accounts.user_id=a.id AND a.username=chatty_im.account "
-                          "AND chatty_im.account='SMS' "
-                          "INNER JOIN users as u "
-                          "ON u.username=? "
-                          "ORDER BY timestamp ASC, chatty_im.id ASC;",
-                          -1, &insert_stmt, NULL);
-
-      history_bind_text (insert_stmt, 1, sender_number ? sender_number : sender, "binding when adding message");
-      history_bind_text (insert_stmt, 2, sender, "binding when adding message");
-      history_bind_text (insert_stmt, 3, sender_number ? sender_number : sender, "binding when adding message");
-      status = sqlite3_step (insert_stmt);
-      sqlite3_finalize (insert_stmt);
-    }
+static double
+history_migration_get_fraction (HistoryMigration *migration)
+{
+  double fraction = 1.0;
 
-    sqlite3_exec (self->db,
-                  "INSERT OR IGNORE INTO thread_members(thread_id,user_id) "
-                  "SELECT DISTINCT threads.id,u.id FROM threads "
-                  "INNER JOIN users AS u "
-                  "ON threads.name=u.username "
-                  "AND u.type="STRING(CHATTY_ID_PHONE_VALUE) ";",
-                  NULL, NULL, &error);
+  if (!migration)
+    return 1.0;
 
-    if (status == SQLITE_DONE || status == SQLITE_OK)
-      status = sqlite3_exec (self->db, "COMMIT;", NULL, NULL, &error);
+  if (migration->total > 0)
+    fraction = MIN (1.0, (double)migration->position / migration->total);
 
-    sqlite3_finalize (stmt);
-  }
+  return (migration->step + fraction) / N_MIGRATION_STEPS;
+}
 
-  /* Drop old tables */
-  if (status == SQLITE_OK)
-    status = sqlite3_exec (self->db,
-                           "BEGIN TRANSACTION;"
-                           "DROP TABLE chatty_chat;"
-                           "DROP TABLE chatty_im;"
-                           "COMMIT;", NULL, NULL, &error);
+static gboolean
+history_set_migration_progress_cb (gpointer user_data)
+{
+  ProgressData *data = user_data;
+  ChattyHistory *self = data->history;
 
-  if (status == SQLITE_OK || status == SQLITE_DONE) {
-    /* Update user_version pragma */
-    if (!chatty_history_update_version (self, task))
-      return FALSE;
-    return TRUE;
+  if (self->migration_progress != data->progress) {
+    self->migration_progress = data->progress;
+    g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_MIGRATION_PROGRESS]);
   }
 
-  g_task_return_new_error (task,
-                           G_IO_ERROR,
-                           G_IO_ERROR_FAILED,
-                           "Couldn't set db version. errno: %d, desc: %s. %s",
-                           status, sqlite3_errstr (status), error);
-  sqlite3_free (error);
+  return G_SOURCE_REMOVE;
+}
 
-  return FALSE;
+static void
+progress_data_free (ProgressData *data)
+{
+  g_object_unref (data->history);
+  g_free (data);
 }
 
-/* TODO */
-static gboolean
-chatty_history_migrate_db_to_v2 (ChattyHistory *self,
-                                 GTask         *task)
+static void
+history_migration_notify (ChattyHistory *self)
 {
-  char *error = NULL;
-  int status;
+  ProgressData *data;
 
   g_assert (CHATTY_IS_HISTORY (self));
-  g_assert (G_IS_TASK (task));
   g_assert (g_thread_self () == self->worker_thread);
 
-  chatty_history_backup (self);
+  data = g_new (ProgressData, 1);
+  data->history = g_object_ref (self);
+  data->progress = history_migration_get_fraction (self->migration);
 
-  status = sqlite3_exec (self->db,
-                         "BEGIN TRANSACTION;"
-                         "PRAGMA foreign_keys=OFF;"
+  /* Higher than the priority tasks return with, so that the progress
+   * is set before chatty_history_open_async() completes */
+  g_main_context_invoke_full (NULL, G_PRIORITY_HIGH,
+                              history_set_migration_progress_cb,
+                              data, (GDestroyNotify)progress_data_free);
+}
 
-                         "DROP TABLE IF EXISTS media;"
-                         "DROP TABLE IF EXISTS files;"
+/* Run each statement in @sql with ?1 and ?2 bound to @from and @to */
+static int
+history_exec_range (ChattyHistory *self,
+                    const char    *sql,
+                    gint64         from,
+                    gint64         to)
+{
+  int status = SQLITE_OK;
 
-                         "CREATE TABLE IF NOT EXISTS mime_type ("
-                         "id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, "
-                         "name TEXT NOT NULL UNIQUE);"
+  while (status == SQLITE_OK && sql && *sql) {
+    sqlite3_stmt *stmt = NULL;
 
-                         "CREATE TABLE IF NOT EXISTS files ("
-                         "id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, "
-                         "name TEXT, "
-                         "url TEXT NOT NULL UNIQUE, "
-                         "path TEXT, "
-                         "mime_type_id INTEGER REFERENCES mime_type(id), "
-                         "status INT, "
-                         "size INTEGER);"
+    status = sqlite3_prepare_v2 (self->db, sql, -1, &stmt, &sql);
 
-                         "CREATE TABLE IF NOT EXISTS video ("
-                         "id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, "
-                         "file_id INTEGER NOT NULL UNIQUE, "
-                         "width INTEGER, "
-                         "height INTEGER, "
-                         "duration INTEGER, "
-                         "FOREIGN KEY(file_id) REFERENCES files(id));"
+    /* Only white space or comments remaining */
+    if (!stmt)
+      break;
 
-                         "CREATE TABLE IF NOT EXISTS image ("
-                         "id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, "
-                         "file_id INTEGER NOT NULL UNIQUE, "
-                         "width INTEGER, "
-                         "height INTEGER, "
-                         "FOREIGN KEY(file_id) REFERENCES files(id));"
+    sqlite3_bind_int64 (stmt, 1, from);
+    sqlite3_bind_int64 (stmt, 2, to);
+    status = sqlite3_step (stmt);
+    sqlite3_finalize (stmt);
 
-                         "CREATE TABLE IF NOT EXISTS audio ("
-                         "id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, "
-                         "file_id INTEGER NOT NULL UNIQUE, "
-                         "duration INTEGER, "
-                         "FOREIGN KEY(file_id) REFERENCES files(id));"
+    if (status == SQLITE_DONE)
+      status = SQLITE_OK;
+  }
 
-                         "ALTER TABLE messages ADD COLUMN preview_id INTEGER REFERENCES files(id);"
+  return status;
+}
 
+static gint64
+history_migration_get_total (ChattyHistory    *self,
+                             HistoryMigration *migration)
+{
+  sqlite3_stmt *stmt;
+  const char *sql;
+  gint64 total = 0;
 
-                         "CREATE TABLE IF NOT EXISTS temp_users ("
-                         "id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, "
-                         "username TEXT NOT NULL, "
-                         "alias TEXT, "
-                         "avatar_id INTEGER REFERENCES files(id), "
-                         "type INTEGER NOT NULL, "
-                         "UNIQUE (username, type));"
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (g_thread_self () == self->worker_thread);
 
-                         "INSERT INTO temp_users SELECT * FROM users;"
-                         "DROP TABLE IF EXISTS users;"
-                         "ALTER TABLE temp_users RENAME TO users;"
+  switch (migration->step) {
+  case MIGRATION_STEP_IM:
+    sql = "SELECT max(id) FROM chatty_im;";
+    break;
 
+  case MIGRATION_STEP_CHAT:
+    sql = "SELECT max(id) FROM chatty_chat;";
+    break;
 
-                         "CREATE TABLE IF NOT EXISTS temp_threads ("
-                         "id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, "
-                         "name TEXT NOT NULL, "
-                         "alias TEXT, "
-                         "avatar_id INTEGER REFERENCES files(id), "
-                         "account_id INTEGER NOT NULL REFERENCES accounts(id) ON DELETE CASCADE, "
-                         "type INTEGER NOT NULL, "
-                         "encrypted INTEGER DEFAULT 0, "
-                         "last_read_id INTEGER REFERENCES messages(id), "
-                         "UNIQUE (name, account_id, type));"
+  case MIGRATION_STEP_TELEGRAM_IM:
+    sql = "SELECT count(*) FROM (" MIGRATION_TELEGRAM_IM_CHATS ");";
+    break;
 
-                         "INSERT INTO temp_threads SELECT * FROM threads;"
-                         "DROP TABLE IF EXISTS threads;"
-                         "ALTER TABLE temp_threads RENAME TO threads;"
+  case MIGRATION_STEP_TELEGRAM_CHAT:
+    sql = "SELECT count(*) FROM (" MIGRATION_TELEGRAM_CHAT_CHATS ");";
+    break;
 
-                         "COMMIT;",
-                         NULL, NULL, &error);
+  case MIGRATION_STEP_SMS:
+    sql = "SELECT count(*) FROM (" MIGRATION_SMS_CHATS ");";
+    break;
 
-  if (status == SQLITE_OK || status == SQLITE_DONE) {
-    /* Update user_version pragma */
-    if (!chatty_history_update_version (self, task))
-      return FALSE;
-    return TRUE;
+  default:
+    return 1;
   }
 
-  g_task_return_new_error (task,
-                           G_IO_ERROR,
-                           G_IO_ERROR_FAILED,
-                           "Couldn't set db version. errno: %d, desc: %s. %s",
-                           status, sqlite3_errstr (status), error);
-  sqlite3_free (error);
+  sqlite3_prepare_v2 (self->db, sql, -1, &stmt, NULL);
 
-  return FALSE;
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    total = sqlite3_column_int64 (stmt, 0);
+  sqlite3_finalize (stmt);
+
+  return total;
 }
 
-/* For migrating from v2 to v3 */
 static gboolean
-chatty_history_migrate_db_to_v3 (ChattyHistory *self,
-                                 GTask         *task)
+history_migration_save (ChattyHistory    *self,
+                        HistoryMigration *migration,
+                        GTask            *task)
 {
-  char *error = NULL;
+  sqlite3_stmt *stmt;
   int status;
 
-  g_assert (CHATTY_IS_HISTORY (self));
-  g_assert (G_IS_TASK (task));
-  g_assert (g_thread_self () == self->worker_thread);
-
-  chatty_history_backup (self);
+  sqlite3_prepare_v2 (self->db,
+                      "INSERT OR REPLACE INTO migration_progress(id,step,position) "
+                      "VALUES(1,?,?);",
+                      -1, &stmt, NULL);
+  history_bind_int (stmt, 1, migration->step, "binding when saving migration");
+  sqlite3_bind_int64 (stmt, 2, migration->position);
+  status = sqlite3_step (stmt);
+  sqlite3_finalize (stmt);
 
-  status = sqlite3_exec (self->db,
-                         "BEGIN TRANSACTION;"
-                         "PRAGMA foreign_keys=OFF;"
+  if (status != SQLITE_DONE)
+    g_task_return_new_error (task,
+                             G_IO_ERROR,
+                             G_IO_ERROR_FAILED,
+                             "Couldn't save migration progress. errno: %d, desc: %s",
+                             status, sqlite3_errmsg (self->db));
 
-                         "ALTER TABLE threads ADD COLUMN visibility INT NOT NULL DEFAULT "
-                         STRING(THREAD_VISIBILITY_VISIBLE) ";"
+  return status == SQLITE_DONE;
+}
 
-                         "COMMIT;",
-                         NULL, NULL, &error);
+/* Migrate the next migration_chunk_rows rowids of chatty_im or chatty_chat */
+static gboolean
+history_migrate_rows (ChattyHistory    *self,
+                      HistoryMigration *migration,
+                      GTask            *task)
+{
+  const char *sql;
+  gint64 from, to;
+  int status;
 
-  if (status == SQLITE_OK || status == SQLITE_DONE) {
-    /* Update user_version pragma */
-    if (!chatty_history_update_version (self, task))
-      return FALSE;
-    return TRUE;
+  if (migration->step == MIGRATION_STEP_IM)
+    /* XMPP IM chat members */
+    sql = "INSERT OR IGNORE INTO thread_members(thread_id,user_id) "
+          "SELECT DISTINCT threads.id,u.id FROM chatty_im "
+          "INNER JOIN threads "
+          "ON chatty_im.who LIKE threads.name || '%' "
+          "INNER JOIN users As a "
+          "ON threads.account_id=accounts.id "
+          "INNER JOIN accounts "
+          "ON accounts.user_id=a.id AND a.username=chatty_im.account "
+          "AND a.type=" STRING(CHATTY_ID_XMPP_VALUE) " "
+          "INNER JOIN users AS u "
+          "ON chatty_im.who LIKE u.username || '%' "
+          "WHERE chatty_im.id>?1 AND chatty_im.id<=?2;"
+
+          /* XMPP IM messages */
+          "INSERT OR IGNORE INTO messages(uid,thread_id,sender_id,body,body_type,time,direction) "
+          /* Always assume HTML */
+          "SELECT DISTINCT uid,threads.id,u.id,message," STRING(MESSAGE_TYPE_HTML_ESCAPED) ",timestamp,direction "
+          "FROM chatty_im "
+          "INNER JOIN threads "
+          "ON chatty_im.who LIKE threads.name || '%' "
+          "INNER JOIN users As a "
+          "ON threads.account_id=accounts.id "
+          "INNER JOIN accounts "
+          "ON accounts.user_id=a.id AND a.username=chatty_im.account "
+          "INNER JOIN users AS u "
+          "ON chatty_im.who LIKE u.username || '%' "
+          "WHERE chatty_im.account GLOB '[^@]*@*' "
+          "AND chatty_im.id>?1 AND chatty_im.id<=?2 "
+          "ORDER BY timestamp ASC, chatty_im.id ASC;";
+  else
+    /* XMPP MUC members */
+    sql = "INSERT OR IGNORE INTO thread_members(thread_id,user_id) "
+          "SELECT DISTINCT threads.id,u.id FROM chatty_chat "
+          "INNER JOIN threads "
+          "ON chatty_chat.room=threads.name "
+          "INNER JOIN accounts "
+          "ON threads.account_id=accounts.id "
+          "INNER JOIN users AS a "
+          "ON accounts.user_id=a.id AND a.username=chatty_chat.account "
+          "AND a.type=" STRING(CHATTY_ID_XMPP_VALUE) " "
+          "INNER JOIN users AS u "
+          "ON chatty_chat.who=u.username "
+          "OR chatty_chat.who LIKE u.username || '/%' "
+          "OR chatty_chat.who LIKE chatty_chat.room || '/' || u.username "
+          "WHERE chatty_chat.direction!=-1 "
+          "AND chatty_chat.id>?1 AND chatty_chat.id<=?2;"
+
+          /* Matrix chat members */
+          "INSERT OR IGNORE INTO thread_members(thread_id,user_id) "
+          "SELECT DISTINCT threads.id,u.id FROM chatty_chat "
+          "INNER JOIN threads "
+          "ON chatty_chat.room=threads.name "
+          "INNER JOIN users As a "
+          "ON threads.account_id=accounts.id "
+          "INNER JOIN accounts "
+          "ON accounts.user_id=a.id AND a.username=chatty_chat.account "
+          "AND a.type=" STRING(CHATTY_ID_MATRIX_VALUE) " "
+          "INNER JOIN users AS u "
+          "ON u.username NOT NULL AND chatty_chat.who=u.username "
+          "WHERE chatty_chat.id>?1 AND chatty_chat.id<=?2;"
+
+          /* XMPP MUC chat messages */
+          "INSERT OR IGNORE INTO messages(uid,thread_id,sender_id,body,body_type,time,direction) "
+          /* Always assume HTML */
+          "SELECT DISTINCT uid,threads.id,"
+          "CASE "
+          "WHEN chatty_chat.direction=-1 THEN a.id "
+          "WHEN chatty_chat.who=NULL THEN NULL "
+          "ELSE u.id "
+          "END,"
+          "message," STRING(MESSAGE_TYPE_HTML_ESCAPED) ",timestamp,direction "
+          "FROM chatty_chat "
+          "INNER JOIN threads "
+          "ON chatty_chat.room LIKE threads.name || '%' "
+          "INNER JOIN accounts "
+          "ON threads.account_id=accounts.id "
+          "INNER JOIN users As a "
+          "ON accounts.user_id=a.id AND a.username=chatty_chat.account "
+          "LEFT JOIN users AS u "
+          "ON chatty_chat.who=u.username "
+          "OR chatty_chat.who LIKE u.username || '/%' "
+          "OR chatty_chat.who LIKE chatty_chat.room || '/' || u.username "
+          "WHERE chatty_chat.account GLOB '[^@]*@*' "
+          "AND chatty_chat.id>?1 AND chatty_chat.id<=?2 "
+          "ORDER BY timestamp ASC, chatty_chat.id ASC;"
+
+          /* Matrix chat messages */
+          "INSERT OR IGNORE INTO messages(uid,thread_id,sender_id,body,body_type,time,direction) "
+          /* Always assume HTML */
+          "SELECT DISTINCT uid,threads.id,"
+          "CASE "
+          "WHEN chatty_chat.direction=-1 AND chatty_chat.who=NULL THEN a.id "
+          "WHEN chatty_chat.direction=-1 THEN u.id "
+          "WHEN chatty_chat.who=NULL THEN NULL "
+          "ELSE u.id "
+          "END,"
+          "message," STRING(MESSAGE_TYPE_HTML_ESCAPED) ",timestamp,direction "
+          "FROM chatty_chat "
+          "INNER JOIN threads "
+          "ON chatty_chat.room=threads.name "
+          "INNER JOIN accounts "
+          "ON threads.account_id=accounts.id "
+          "INNER JOIN users As a "
+          "ON accounts.user_id=a.id AND a.username=chatty_chat.account "
+          "LEFT JOIN users AS u "
+          "ON chatty_chat.who=u.username "
+          "WHERE (chatty_chat.room GLOB '!?*:?*' "
+          "AND chatty_chat.who IS NULL or chatty_chat.who GLOB '@?*:?*') "
+          "AND chatty_chat.id>?1 AND chatty_chat.id<=?2 "
+          "ORDER BY timestamp ASC, chatty_chat.id ASC;";
+
+  /*
+   * The database is already open for reads, so migrate the newest
+   * rows first, so that the chat list and the latest messages are
+   * right from the first chunk.  @position is the count of rowids
+   * migrated, counted down from @total, the largest rowid.
+   */
+  to = migration->total - migration->position;
+  from = MAX (to - self->migration_chunk_rows, 0);
+  status = history_exec_range (self, sql, from, to);
+
+  if (status != SQLITE_OK) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR,
+                             G_IO_ERROR_FAILED,
+                             "Couldn't migrate messages. errno: %d, desc: %s",
+                             status, sqlite3_errmsg (self->db));
+    return FALSE;
   }
 
-  g_task_return_new_error (task,
-                           G_IO_ERROR,
-                           G_IO_ERROR_FAILED,
-                           "Couldn't set db version. errno: %d, desc: %s. %s",
-                           status, sqlite3_errstr (status), error);
-  sqlite3_free (error);
+  migration->position += to - from;
 
-  return FALSE;
+  return TRUE;
+}
+
+static void
+history_add_phone_members (ChattyHistory *self)
+{
+  sqlite3_exec (self->db,
+                "INSERT OR IGNORE INTO thread_members(thread_id,user_id) "
+                "SELECT DISTINCT threads.id,u.id FROM threads "
+                "INNER JOIN users AS u "
+                "ON threads.name=u.username "
+                "AND u.type="STRING(CHATTY_ID_PHONE_VALUE) ";",
+                NULL, NULL, NULL);
 }
 
 static gboolean
-chatty_history_migrate (ChattyHistory *self,
-                        GTask         *task)
+history_migrate_telegram_im (ChattyHistory    *self,
+                             HistoryMigration *migration,
+                             GTask            *task)
 {
-  int version;
+  sqlite3_stmt *stmt;
+  gboolean success = TRUE;
+  int count = 0;
 
-  g_assert (CHATTY_IS_HISTORY (self));
-  g_assert (G_IS_TASK (task));
-  g_assert (g_thread_self () == self->worker_thread);
-  g_assert (self->db);
+  /* Get all numbers in international format */
+  sqlite3_prepare_v2 (self->db,
+                      MIGRATION_TELEGRAM_IM_CHATS " LIMIT ? OFFSET ?;",
+                      -1, &stmt, NULL);
+  history_bind_int (stmt, 1, MIGRATION_CHUNK_CHATS, "binding when migrating chats");
+  sqlite3_bind_int64 (stmt, 2, migration->position);
 
-  version = chatty_history_get_db_version (self, task);
+  while (sqlite3_step (stmt) == SQLITE_ROW) {
+    g_autofree char *account_number = NULL;
+    g_autofree char *sender_number = NULL;
+    sqlite3_stmt *insert_stmt = NULL;
+    const char *account, *sender;
+
+    count++;
+    account = (gpointer)sqlite3_column_text (stmt, 0);
+    sender = (gpointer)sqlite3_column_text (stmt, 1);
+
+    account_number = chatty_utils_check_phonenumber (account, NULL);
+    sender_number  = chatty_utils_check_phonenumber (sender, NULL);
+
+    if (!history_add_phone_user (self, task,
+                                 account_number ? account_number : account,
+                                 !account_number ? account: NULL) ||
+        /* Fill in accounts */
+        !history_add_phone_account (self, task,
+                                    account_number ? account_number : account,
+                                    g_strcmp0 (account, "SMS") == 0 ? PROTOCOL_SMS : PROTOCOL_TELEGRAM) ||
+        !history_add_phone_user (self, task,
+                                 sender_number ? sender_number : sender,
+                                 !sender_number ? sender: NULL) ||
+        !history_add_thread (self, task,
+                             account_number ? account_number : account,
+                             sender_number ? sender_number : sender,
+                             !sender_number ? sender: NULL,
+                             THREAD_DIRECT_CHAT)) {
+      success = FALSE;
+      break;
+    }
 
-  if (version == HISTORY_VERSION)
-    return TRUE;
+    /* Fill in messages */
+    sqlite3_prepare_v2 (self->db,
+                        "INSERT OR IGNORE INTO messages(uid,thread_id,sender_id,body,body_type,time,direction) "
+                        "SELECT DISTINCT uid,threads.id,u.id,message," STRING(MESSAGE_TYPE_HTML_ESCAPED) ",timestamp,direction "
+                        "FROM chatty_im "
+                        "INNER JOIN threads "
+                        "ON threads.name=? AND chatty_im.who=? "
+                        "INNER JOIN accounts "
+                        "ON threads.account_id=accounts.id "
+                        "INNER JOIN users AS a "
+                        "ON accounts.user_id=a.id AND a.username=? AND chatty_im.account=? "
+                        "INNER JOIN users as u "
+                        "ON u.username=? "
+                        "ORDER BY timestamp ASC, chatty_im.id ASC;",
+                        -1, &insert_stmt, NULL);
+
+    history_bind_text (insert_stmt, 1, sender_number ? sender_number : sender, "binding when adding message");
+    history_bind_text (insert_stmt, 2, sender, "binding when adding message");
+    history_bind_text (insert_stmt, 3, account_number ? account_number : account, "binding when adding message");
+    history_bind_text (insert_stmt, 4, account, "binding when adding message");
+    history_bind_text (insert_stmt, 5, sender_number ? sender_number : sender, "binding when adding message");
+    warn_if_sql_error (sqlite3_step (insert_stmt), "migrating telegram messages");
+    sqlite3_finalize (insert_stmt);
+  }
 
-  switch (version) {
-  case -1:  /* Error */
-    return FALSE;
+  sqlite3_finalize (stmt);
+  migration->position += count;
 
-  case 0:
-    if (!chatty_history_migrate_db_to_v1_to_v3 (self, task))
-      return FALSE;
-    break;
+  if (success && migration->position >= migration->total)
+    history_add_phone_members (self);
 
-  case 1:
-    if (!chatty_history_migrate_db_to_v2 (self, task))
-      return FALSE;
-    /* fallthrough */
+  return success;
+}
 
-  case 2:
-    if (!chatty_history_migrate_db_to_v3 (self, task))
-      return FALSE;
-    break;
+static gboolean
+history_migrate_telegram_chat (ChattyHistory    *self,
+                               HistoryMigration *migration,
+                               GTask            *task)
+{
+  sqlite3_stmt *stmt;
+  gboolean success = TRUE;
+  int count = 0;
 
-  default:
-    g_task_return_new_error (task,
-                             G_IO_ERROR,
-                             G_IO_ERROR_FAILED,
-                             "Failed to migrate from version %d, unknown version",
-                             version);
-    return FALSE;
+  sqlite3_prepare_v2 (self->db,
+                      MIGRATION_TELEGRAM_CHAT_CHATS " LIMIT ? OFFSET ?;",
+                      -1, &stmt, NULL);
+  history_bind_int (stmt, 1, MIGRATION_CHUNK_CHATS, "binding when migrating chats");
+  sqlite3_bind_int64 (stmt, 2, migration->position);
+
+  while (sqlite3_step (stmt) == SQLITE_ROW) {
+    g_autofree char *account_number = NULL;
+    g_autofree char *sender_number = NULL;
+    sqlite3_stmt *insert_stmt = NULL;
+    const char *account, *sender, *room;
+
+    count++;
+    account = (gpointer)sqlite3_column_text (stmt, 0);
+    sender = (gpointer)sqlite3_column_text (stmt, 1);
+    room = (gpointer)sqlite3_column_text (stmt, 2);
+
+    account_number = chatty_utils_check_phonenumber (account, NULL);
+    sender_number  = chatty_utils_check_phonenumber (sender, NULL);
+
+    if (!history_add_phone_user (self, task,
+                                 account_number ? account_number : account,
+                                 !account_number ? account: NULL) ||
+        /* Fill in accounts */
+        !history_add_phone_account (self, task,
+                                    account_number ? account_number : account,
+                                    g_strcmp0 (account, "SMS") == 0 ? PROTOCOL_SMS : PROTOCOL_TELEGRAM) ||
+        (sender &&
+         !history_add_phone_user (self, task,
+                                  sender_number ? sender_number : sender,
+                                  !sender_number ? sender: NULL)) ||
+        !history_add_thread (self, task,
+                             account_number ? account_number : account,
+                             room, room, THREAD_GROUP_CHAT)) {
+      success = FALSE;
+      break;
+    }
+
+    /* Fill in messages with no author */
+    sqlite3_prepare_v2 (self->db,
+                        "INSERT OR IGNORE INTO messages(uid,thread_id,sender_id,body,body_type,time,direction) "
+                        "SELECT DISTINCT uid,threads.id,"
+                        "CASE "
+                        "WHEN chatty_chat.direction=-1 THEN a.id "
+                        "WHEN chatty_chat.who=NULL THEN NULL "
+                        "END,"
+                        "message," STRING(MESSAGE_TYPE_HTML_ESCAPED) ",timestamp,direction "
+                        "FROM chatty_chat "
+                        "INNER JOIN threads "
+                        "ON threads.name=chatty_chat.room AND threads.name=? "
+                        "INNER JOIN accounts "
+                        "ON threads.account_id=accounts.id "
+                        "INNER JOIN users AS a "
+                        "ON accounts.user_id=a.id AND a.username=? AND chatty_chat.account=? "
+                        "AND chatty_chat.who IS NULL "
+                        "ORDER BY timestamp ASC, chatty_chat.id ASC;",
+                        -1, &insert_stmt, NULL);
+
+    history_bind_text (insert_stmt, 1, room, "binding when adding message");
+    history_bind_text (insert_stmt, 2, account_number ? account_number : account, "binding when adding message");
+    history_bind_text (insert_stmt, 3, account, "binding when adding message");
+    warn_if_sql_error (sqlite3_step (insert_stmt), "migrating telegram messages");
+    sqlite3_finalize (insert_stmt);
+
+    /* Fill in messages with author */
+    sqlite3_prepare_v2 (self->db,
+                        "INSERT OR IGNORE INTO messages(uid,thread_id,sender_id,body,body_type,time,direction) "
+                        "SELECT DISTINCT uid,threads.id,u.id,"
+                        "message," STRING(MESSAGE_TYPE_HTML_ESCAPED) ",timestamp,direction "
+                        "FROM chatty_chat "
+                        "INNER JOIN threads "
+                        "ON threads.name=chatty_chat.room AND threads.name=? "
+                        "INNER JOIN accounts "
+                        "ON threads.account_id=accounts.id "
+                        "INNER JOIN users AS a "
+                        "ON accounts.user_id=a.id AND a.username=? AND chatty_chat.account=? "
+                        "INNER JOIN users as u "
+                        "ON u.username=? AND chatty_chat.who=? "
+                        "AND chatty_chat.who NOT NULL "
+                        "AND chatty_chat.direction!=-1 "
+                        "ORDER BY timestamp ASC, chatty_chat.id ASC;",
+                        -1, &insert_stmt, NULL);
+
+    history_bind_text (insert_stmt, 1, room, "binding when adding threads");
+    history_bind_text (insert_stmt, 2, account_number ? account_number : account, "binding when adding phone number");
+    history_bind_text (insert_stmt, 3, account, "binding when adding phone number");
+    history_bind_text (insert_stmt, 4, sender_number ? sender_number : sender, "binding when adding threads");
+    history_bind_text (insert_stmt, 5, sender, "binding when adding threads");
+    warn_if_sql_error (sqlite3_step (insert_stmt), "migrating telegram messages");
+    sqlite3_finalize (insert_stmt);
+
+    /* Fill in chat thread members */
+    sqlite3_prepare_v2 (self->db, "INSERT OR IGNORE INTO thread_members(thread_id,user_id) "
+                        "SELECT DISTINCT threads.id,u.id FROM threads "
+                        "INNER JOIN accounts "
+                        "ON threads.account_id=accounts.id "
+                        "INNER JOIN users AS a "
+                        "ON accounts.user_id=a.id AND a.username=? "
+                        "INNER JOIN chatty_chat "
+                        "ON chatty_chat.account=? "
+                        "AND threads.name=chatty_chat.room AND threads.name=? "
+                        "INNER JOIN users AS u "
+                        "ON u.type=" STRING(CHATTY_ID_PHONE_VALUE) " "
+                        "AND u.username=? AND chatty_chat.who=?;",
+                        -1, &insert_stmt, NULL);
+
+    history_bind_text (insert_stmt, 1, account_number ? account_number : account, "binding when adding thread member");
+    history_bind_text (insert_stmt, 2, account, "binding when adding thread member");
+    history_bind_text (insert_stmt, 3, room, "binding when adding thread member");
+    history_bind_text (insert_stmt, 4, sender_number ? sender_number : sender, "binding when adding thread member");
+    history_bind_text (insert_stmt, 5, sender, "binding when adding thread member");
+    warn_if_sql_error (sqlite3_step (insert_stmt), "migrating telegram members");
+    sqlite3_finalize (insert_stmt);
+  }
+
+  sqlite3_finalize (stmt);
+  migration->position += count;
+
+  if (success && migration->position >= migration->total)
+    history_add_phone_members (self);
+
+  return success;
+}
+
+static gboolean
+history_migrate_sms (ChattyHistory    *self,
+                     HistoryMigration *migration,
+                     GTask            *task)
+{
+  sqlite3_stmt *stmt;
+  int count = 0;
+
+  sqlite3_prepare_v2 (self->db,
+                      MIGRATION_SMS_CHATS " LIMIT ? OFFSET ?;",
+                      -1, &stmt, NULL);
+  history_bind_int (stmt, 1, MIGRATION_CHUNK_CHATS, "binding when migrating chats");
+  sqlite3_bind_int64 (stmt, 2, migration->position);
+
+  while (sqlite3_step (stmt) == SQLITE_ROW) {
+    g_autofree char *sender_number = NULL;
+    sqlite3_stmt *insert_stmt = NULL;
+    const char *sender;
+
+    count++;
+    sender = (gpointer)sqlite3_column_text (stmt, 0);
+    sender_number  = chatty_utils_check_phonenumber (sender, migration->country_code);
+
+    history_add_phone_user (self, task,
+                            sender_number ? sender_number : sender,
+                            NULL);
+
+    history_add_thread (self, task, "SMS",
+                        sender_number ? sender_number : sender,
+                        sender, THREAD_DIRECT_CHAT);
+
+    /* Fill in messages with no author */
+    sqlite3_prepare_v2 (self->db, "INSERT OR IGNORE INTO messages(uid,thread_id,sender_id,body,body_type,time,direction) "
+                        "SELECT DISTINCT uid,threads.id,u.id,message," STRING(MESSAGE_TYPE_TEXT) ",timestamp,direction "
+                        "FROM chatty_im "
+                        "INNER JOIN threads "
+                        "ON threads.name=? AND chatty_im.who=? "
+                        "INNER JOIN accounts "
+                        "ON threads.account_id=accounts.id "
+                        "INNER JOIN users AS a "
+                        "ON accounts.user_id=a.id AND a.username=chatty_im.account "
+                        "AND chatty_im.account='SMS' "
+                        "INNER JOIN users as u "
+                        "ON u.username=? "
+                        "ORDER BY timestamp ASC, chatty_im.id ASC;",
+                        -1, &insert_stmt, NULL);
+
+    history_bind_text (insert_stmt, 1, sender_number ? sender_number : sender, "binding when adding message");
+    history_bind_text (insert_stmt, 2, sender, "binding when adding message");
+    history_bind_text (insert_stmt, 3, sender_number ? sender_number : sender, "binding when adding message");
+    warn_if_sql_error (sqlite3_step (insert_stmt), "migrating SMS messages");
+    sqlite3_finalize (insert_stmt);
   }
 
+  sqlite3_finalize (stmt);
+  migration->position += count;
+
+  if (migration->position >= migration->total)
+    history_add_phone_members (self);
+
   return TRUE;
 }
 
+static gboolean
+history_migrate_finish (ChattyHistory *self,
+                        GTask         *task)
+{
+  char *error = NULL;
+  int status;
+
+  /* Everything, including the version, is changed in the same transaction,
+   * so that a crash in between doesn't leave the old tables half dropped */
+  status = sqlite3_exec (self->db,
+                         "DROP TABLE chatty_chat;"
+                         "DROP TABLE chatty_im;"
+                         "DROP TABLE migration_progress;"
+                         "PRAGMA user_version = " STRING (HISTORY_VERSION) ";",
+                         NULL, NULL, &error);
+
+  if (status == SQLITE_OK)
+    return TRUE;
+
+  g_task_return_new_error (task,
+                           G_IO_ERROR,
+                           G_IO_ERROR_FAILED,
+                           "Couldn't drop old tables. errno: %d, desc: %s. %s",
+                           status, sqlite3_errstr (status), error);
+  sqlite3_free (error);
+
+  return FALSE;
+}
+
+/*
+ * Run the next chunk of the migration from version 0 in a
+ * transaction of its own, saving the position reached along
+ * with it, so that it can be resumed if chatty is closed or
+ * crashes in between.  Run only when the worker is idle, so
+ * that other queries aren't blocked until the migration is
+ * complete.
+ */
 static void
-history_open_db (ChattyHistory *self,
-                 GTask         *task)
+history_migrate_chunk (ChattyHistory *self)
 {
-  const char *dir, *file_name;
-  sqlite3 *db;
+  g_autoptr(GTask) task = NULL;
+  HistoryMigration *migration;
+  gboolean success = FALSE;
   int status;
-  gboolean db_exists;
 
   g_assert (CHATTY_IS_HISTORY (self));
-  g_assert (G_IS_TASK (task));
   g_assert (g_thread_self () == self->worker_thread);
-  g_assert (!self->db);
+  g_assert (self->migration);
+  g_assert (self->db);
 
-  dir = g_object_get_data (G_OBJECT (task), "dir");
-  file_name = g_object_get_data (G_OBJECT (task), "file-name");
-  g_assert (dir && *dir);
-  g_assert (file_name && *file_name);
+  migration = self->migration;
+  /* Errors are returned on @task, like other migrations do */
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  status = sqlite3_exec (self->db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
 
-  g_mkdir_with_parents (dir, S_IRWXU);
-  self->db_path = g_build_filename (dir, file_name, NULL);
+  if (status == SQLITE_OK) {
+    switch (migration->step) {
+    case MIGRATION_STEP_IM:
+    case MIGRATION_STEP_CHAT:
+      success = history_migrate_rows (self, migration, task);
+      break;
 
-  db_exists = g_file_test (self->db_path, G_FILE_TEST_EXISTS);
-  status = sqlite3_open (self->db_path, &db);
+    case MIGRATION_STEP_TELEGRAM_IM:
+      success = history_migrate_telegram_im (self, migration, task);
+      break;
 
-  if (status == SQLITE_OK) {
-    self->db = db;
+    case MIGRATION_STEP_TELEGRAM_CHAT:
+      success = history_migrate_telegram_chat (self, migration, task);
+      break;
 
-    if (db_exists) {
-      if (!chatty_history_migrate (self, task))
-        return;
-    } else {
-      if (!chatty_history_create_schema (self, task))
-        return;
+    case MIGRATION_STEP_SMS:
+      success = history_migrate_sms (self, migration, task);
+      break;
 
-      if (!chatty_history_update_version (self, task))
-        return;
+    case MIGRATION_STEP_FINISH:
+      success = history_migrate_finish (self, task);
+      break;
+
+    default:
+      g_return_if_reached ();
+    }
+  }
+
+  if (success && migration->step != MIGRATION_STEP_FINISH) {
+    if (migration->position >= migration->total) {
+      migration->step++;
+      migration->position = 0;
+      migration->total = history_migration_get_total (self, migration);
+    }
+
+    success = history_migration_save (self, migration, task);
+  }
+
+  if (success)
+    status = sqlite3_exec (self->db, "COMMIT;", NULL, NULL, NULL);
+
+  if (success && status == SQLITE_OK) {
+    if (migration->step == MIGRATION_STEP_FINISH) {
+      g_clear_pointer (&self->migration, history_migration_free);
+      g_info ("Migrating history complete");
     }
 
-    sqlite3_exec (self->db, "PRAGMA foreign_keys = ON;", NULL, NULL, NULL);
     g_task_return_boolean (task, TRUE);
   } else {
-    g_task_return_boolean (task, FALSE);
+    g_autoptr(GError) error = NULL;
+
+    if (!g_task_had_error (task))
+      g_task_return_new_error (task,
+                               G_IO_ERROR,
+                               G_IO_ERROR_FAILED,
+                               "errno: %d, desc: %s",
+                               status, sqlite3_errmsg (self->db));
+
+    sqlite3_exec (self->db, "ROLLBACK;", NULL, NULL, NULL);
+    g_task_propagate_boolean (task, &error);
+    g_warning ("Migrating history failed, will be retried on restart: %s",
+               error->message);
+    g_clear_pointer (&self->migration, history_migration_free);
   }
+
+  history_migration_notify (self);
 }
 
-static void
-history_close_db (ChattyHistory *self,
-                  GTask         *task)
+/* this function works for migration from v0
+ * to v1, v2, and v3 as the tables and columns
+ * used in this function doesn't change in
+ * v1, v2 or v3.
+ *
+ * Only users, accounts and threads are migrated here,
+ * messages are migrated later by history_migrate_chunk().
+ */
+static gboolean
+chatty_history_migrate_db_to_v1_to_v3 (ChattyHistory *self,
+                                       GTask         *task)
 {
-  sqlite3 *db;
-  int status;
+  HistoryMigration *migration;
+  sqlite3_stmt *stmt;
+  char *error = NULL;
+  int status = SQLITE_OK;
 
   g_assert (CHATTY_IS_HISTORY (self));
   g_assert (G_IS_TASK (task));
   g_assert (g_thread_self () == self->worker_thread);
-  g_assert (self->db);
 
-  db = self->db;
-  self->db = NULL;
-  status = sqlite3_close (db);
+  /* The schema is created in a single transaction, so it exists
+   * only if a previous migration got interrupted after that */
+  if (!history_table_exists (self, "threads")) {
+    chatty_history_backup (self);
 
-  if (status == SQLITE_OK) {
-    /*
-     * We can’t know when will @self associated with the task will
-     * be unref.  So chatty_history_get_default() called immediately
-     * after this may return the @self that is yet to be free.  But
-     * as the worker_thread is exited after closing the database, any
-     * actions with the same @self will not execute, and so the tasks
-     * will take ∞ time to complete.
-     *
-     * So Instead of relying on GObject to free the object, Let’s
-     * explicitly run dispose
-     */
-    g_object_run_dispose (G_OBJECT (self));
-    g_debug ("Database closed successfully");
-    g_task_return_boolean (task, TRUE);
-  } else {
+    if (!chatty_history_create_schema (self, task))
+      return FALSE;
+  }
+
+  if (!history_table_exists (self, "migration_progress"))
+    status = sqlite3_exec (self->db,
+                           "BEGIN TRANSACTION;"
+
+                           "CREATE TABLE migration_progress ("
+                           "id INTEGER NOT NULL PRIMARY KEY CHECK (id=1), "
+                           "step INTEGER NOT NULL, "
+                           "position INTEGER NOT NULL);"
+
+                           /*** Users ***/
+                           /* XMPP IM accounts */
+                           "INSERT OR IGNORE INTO users(username,type) "
+                           "SELECT DISTINCT account," STRING(CHATTY_ID_XMPP_VALUE) " FROM chatty_im "
+                           /* A Rough match for XMPP accounts */
+                           "WHERE chatty_im.account GLOB '[^@+]*' "
+                           "AND chatty_im.account!='SMS' "
+                           "AND chatty_im.who GLOB '[^@+]*@*';"
+
+                           /* XMPP MUC accounts */
+                           "INSERT OR IGNORE INTO users(username,type) "
+                           "SELECT DISTINCT account," STRING(CHATTY_ID_XMPP_VALUE) " FROM chatty_chat "
+                           /* A Rough match for XMPP accounts */
+                           "WHERE chatty_chat.account GLOB '[^@+]*' "
+                           "AND chatty_chat.room GLOB '[^@+]*@*';"
+
+                           /* SMS account */
+                           "INSERT OR IGNORE INTO users(username,type) "
+                           "SELECT DISTINCT account," STRING(CHATTY_ID_PHONE_VALUE) " FROM chatty_im "
+                           "WHERE account='SMS';"
+
+                           /* Matrix accounts */
+                           "INSERT OR IGNORE INTO users(username,type) "
+                           "SELECT DISTINCT account," STRING(CHATTY_ID_MATRIX_VALUE) " FROM chatty_chat "
+                           /* A Rough match for Matrix chat */
+                           "WHERE chatty_chat.room GLOB '!?*:?*' "
+                           "AND chatty_chat.account NOT GLOB '?*@?*' "
+                           "AND chatty_chat.account NOT GLOB '+?*' "
+                           "AND chatty_chat.account!='SMS';"
+
+                           /* XMPP IM users */
+                           "INSERT OR IGNORE INTO users(username,type) "
+                           "SELECT DISTINCT substr(who,0,"
+                           "CASE "
+                           "WHEN instr(who, '/') > 0 THEN instr(who, '/') "
+                           "ELSE length(who) + 1 "
+                           "END),"
+                           STRING(CHATTY_ID_XMPP_VALUE) " FROM chatty_im "
+                           /* A Rough match for XMPP users */
+                           "WHERE chatty_im.account GLOB '[^@+]*' "
+                           "AND chatty_im.account!='SMS' "
+                           "AND chatty_im.who GLOB '[^@]*@*';"
+
+                           /* XMPP MUC users */
+                           "INSERT OR IGNORE INTO users(username,type) "
+                           "SELECT DISTINCT "
+                           /* A Rough match for XMPP users */
+                           "CASE "
+                           "  WHEN chatty_chat.who LIKE chatty_chat.room || '/%' THEN chatty_chat.who "
+                           "  WHEN chatty_chat.who LIKE '%/%' THEN substr(who,0,instr(who, '/')) "
+                           "  ELSE chatty_chat.who "
+                           "END,"
+                           STRING(CHATTY_ID_XMPP_VALUE) " FROM chatty_chat "
+                           "WHERE chatty_chat.account GLOB '[^@+]*' "
+                           "AND chatty_chat.who GLOB '[^@]*@*' "
+                           "AND chatty_chat.room GLOB '[^@]*@*';"
+
+                           /* Matrix chat users */
+                           "INSERT OR IGNORE INTO users (username,type) "
+                           "SELECT DISTINCT who,"
+                           STRING(CHATTY_ID_MATRIX_VALUE) " FROM chatty_chat "
+                           /* A Rough match for users that are not regular phone numbers */
+                           "WHERE chatty_chat.room GLOB '!?*:?*' "
+                           "AND chatty_chat.who GLOB '@?*:?*' "
+                           /* Skip possible Telegram accounts */
+                           "AND chatty_chat.account NOT GLOB '+[0-9]*';"
+
+                           /*** Accounts ***/
+                           /* We have exactly one account for SMS */
+                           "INSERT OR IGNORE INTO accounts(user_id,protocol,enabled) "
+                           "SELECT DISTINCT users.id," STRING(PROTOCOL_SMS) ",1 FROM users "
+                           "WHERE users.username='SMS';"
+
+                           /* XMPP IM accounts */
+                           "INSERT OR IGNORE INTO accounts(user_id,protocol) "
+                           "SELECT DISTINCT users.id," STRING(PROTOCOL_XMPP) " FROM users "
+                           "INNER JOIN chatty_im "
+                           "ON chatty_im.account=users.username "
+                           "AND users.type='" STRING(CHATTY_ID_XMPP_VALUE) "';"
+
+                           /* XMPP MUC accounts */
+                           "INSERT OR IGNORE INTO accounts(user_id,protocol) "
+                           "SELECT DISTINCT users.id," STRING(PROTOCOL_XMPP) " FROM users "
+                           "INNER JOIN chatty_chat "
+                           "ON chatty_chat.account=users.username "
+                           "AND users.type=" STRING(CHATTY_ID_XMPP_VALUE) ";"
+
+                           /* XMPP MUC accounts */
+                           "INSERT OR IGNORE INTO accounts(user_id,protocol) "
+                           "SELECT DISTINCT users.id," STRING(PROTOCOL_MATRIX) " FROM users "
+                           "INNER JOIN chatty_chat "
+                           "ON chatty_chat.account=users.username "
+                           "AND users.type=" STRING(CHATTY_ID_MATRIX_VALUE) ";"
+
+                           /*** Threads ***/
+                           /* XMPP IM chats */
+                           "INSERT OR IGNORE INTO threads(name,account_id,type) "
+                           "SELECT DISTINCT substr(who,0,"
+                           "CASE "
+                           "WHEN instr(who, '/') > 0 THEN instr(who, '/') "
+                           "ELSE length(who) + 1 "
+                           "END),"
+                           "accounts.id," STRING(THREAD_DIRECT_CHAT) " "
+                           "FROM chatty_im "
+                           "INNER JOIN accounts "
+                           "  ON accounts.user_id=users.id "
+                           "INNER JOIN users "
+                           "  ON users.username=chatty_im.account "
+                           "WHERE users.type=" STRING(CHATTY_ID_XMPP_VALUE) ";"
+
+                           /* XMPP MUC chats */
+                           "INSERT OR IGNORE INTO threads(name,account_id,type) "
+                           "SELECT DISTINCT room,"
+                           "accounts.id," STRING(THREAD_GROUP_CHAT) " "
+                           "FROM chatty_chat "
+                           "INNER JOIN accounts "
+                           "  ON accounts.user_id=users.id "
+                           "INNER JOIN users "
+                           "  ON users.username=chatty_chat.account "
+                           "WHERE users.type=" STRING(CHATTY_ID_XMPP_VALUE) ";"
+
+                           /* Matrix chats */
+                           "INSERT OR IGNORE INTO threads(name,account_id,type) "
+                           "SELECT DISTINCT room,accounts.id," STRING(THREAD_GROUP_CHAT) " "
+                           "FROM chatty_chat "
+                           "INNER JOIN accounts "
+                           "  ON accounts.user_id=users.id "
+                           "INNER JOIN users "
+                           "  ON users.username=chatty_chat.account "
+                           "WHERE users.type=" STRING(CHATTY_ID_MATRIX_VALUE) ";"
+
+                           /* Telegram IM chats */
+                           "INSERT OR IGNORE INTO threads(name,account_id,type) "
+                           "SELECT DISTINCT who,accounts.id," STRING(THREAD_DIRECT_CHAT) " "
+                           "FROM chatty_im "
+                           "INNER JOIN accounts "
+                           "  ON accounts.user_id=users.id "
+                           "INNER JOIN users "
+                           "  ON users.username=chatty_im.account "
+                           "WHERE chatty_im.account!='SMS' AND users.type=" STRING(CHATTY_ID_PHONE_VALUE) ";"
+
+                           /* Telegram MUC chats */
+                           "INSERT OR IGNORE INTO threads(name,account_id,type) "
+                           "SELECT DISTINCT room,accounts.id," STRING(THREAD_GROUP_CHAT) " "
+                           "FROM chatty_chat "
+                           "INNER JOIN accounts "
+                           "  ON accounts.user_id=users.id "
+                           "INNER JOIN users "
+                           "  ON users.username=chatty_chat.account "
+                           "WHERE users.type=" STRING(CHATTY_ID_PHONE_VALUE) ";"
+
+                           "INSERT INTO migration_progress(id,step,position) "
+                           "VALUES(1," STRING(MIGRATION_STEP_IM) ",0);"
+
+                           "COMMIT;",
+                           NULL, NULL, &error);
+
+  if (status != SQLITE_OK) {
     g_task_return_new_error (task,
                              G_IO_ERROR,
                              G_IO_ERROR_FAILED,
-                             "Database could not be closed. errno: %d, desc: %s",
-                             status, sqlite3_errmsg (db));
+                             "Couldn't migrate users. errno: %d, desc: %s. %s",
+                             status, sqlite3_errstr (status), error);
+    sqlite3_free (error);
+
+    return FALSE;
+  }
+
+  if (!e_phone_number_is_supported ())
+    g_debug ("Not compiled with libphonenumber");
+
+  migration = g_new0 (HistoryMigration, 1);
+  migration->country_code = g_strdup (g_object_get_data (G_OBJECT (task), "country-code"));
+
+  sqlite3_prepare_v2 (self->db, "SELECT step,position FROM migration_progress;",
+                      -1, &stmt, NULL);
+
+  if (sqlite3_step (stmt) == SQLITE_ROW) {
+    migration->step = CLAMP (sqlite3_column_int (stmt, 0), 0, MIGRATION_STEP_FINISH);
+    migration->position = sqlite3_column_int64 (stmt, 1);
   }
+  sqlite3_finalize (stmt);
+
+  migration->total = history_migration_get_total (self, migration);
+  self->migration = migration;
+  g_info ("Migrating history from step %d, position %" G_GINT64_FORMAT,
+          migration->step, migration->position);
+  history_migration_notify (self);
+
+  return TRUE;
 }
 
-static GPtrArray *
-get_messages_before_time (ChattyHistory *self,
-                          ChattyChat    *chat,
-                          ChattyMessage *start,
-                          int            thread_id,
-                          guint          since_time,
-                          guint          limit)
+/* TODO */
+static gboolean
+chatty_history_migrate_db_to_v2 (ChattyHistory *self,
+                                 GTask         *task)
 {
-  GPtrArray *messages = NULL;
-  sqlite3_stmt *stmt;
+  char *error = NULL;
   int status;
-  gboolean skip = TRUE;
 
   g_assert (CHATTY_IS_HISTORY (self));
-  g_assert (CHATTY_IS_CHAT (chat));
+  g_assert (G_IS_TASK (task));
   g_assert (g_thread_self () == self->worker_thread);
-  g_assert (limit != 0);
 
-  if (!start)
-    skip = FALSE;
+  chatty_history_backup (self);
 
-  status = sqlite3_prepare_v2 (self->db,
-                                               /* 0      1      2    3                 4                         5 */
-                               "SELECT DISTINCT time,direction,body,uid,coalesce(users.alias,users.username),body_type,"
-                               /*    6         7          8           9            10          11 */
-                               "files.name,files.url,files.path,mime_type.name,files.size,files.status,"
-                               "coalesce(video.width,image.width)," /* 12 */
-                               "coalesce(video.height,image.height)," /* 13 */
-                               "coalesce(video.duration,audio.duration)," /* 14 */
-                               /*     15          16          17              18           19             20 */
-                               "p_files.name,p_files.url,p_files.path,p_mime_type.name,p_files.size,p_files.status,"
-                               "coalesce(p_video.width,p_image.width)," /* 21 */
-                               "coalesce(p_video.height,p_image.height)," /* 22 */
-                               "coalesce(p_video.duration,p_audio.duration)," /* 23 */
-                               /* 24 */
-                               "messages.status "
-                               "FROM messages "
-                               "LEFT JOIN files ON body_type>=8 AND body_type<=11 AND files.id=body "
-                               "LEFT JOIN mime_type ON body_type>=8 AND body_type<=11 AND files.mime_type_id=mime_type.id "
-                               "LEFT JOIN image ON body_type=9 AND files.id=image.file_id "
-                               "LEFT JOIN video ON body_type=10 AND files.id=video.file_id "
-                               "LEFT JOIN audio ON body_type=11 AND files.id=audio.file_id "
-
-                               "LEFT JOIN files AS p_files ON messages.preview_id=p_files.id "
-                               "LEFT JOIN mime_type AS p_mime_type ON p_files.mime_type_id=p_mime_type.id "
-                               "LEFT JOIN image AS p_image ON p_files.id=p_image.file_id "
-                               "LEFT JOIN video AS p_video ON p_files.id=p_video.file_id "
-                               "LEFT JOIN audio AS p_audio ON p_files.id=p_audio.file_id "
-                               "LEFT JOIN users "
-                               "ON messages.sender_id=users.id "
+  status = sqlite3_exec (self->db,
+                         "BEGIN TRANSACTION;"
+                         "PRAGMA foreign_keys=OFF;"
+
+                         "DROP TABLE IF EXISTS media;"
+                         "DROP TABLE IF EXISTS files;"
+
+                         "CREATE TABLE IF NOT EXISTS mime_type ("
+                         "id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, "
+                         "name TEXT NOT NULL UNIQUE);"
+
+                         "CREATE TABLE IF NOT EXISTS files ("
+                         "id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, "
+                         "name TEXT, "
+                         "url TEXT NOT NULL UNIQUE, "
+                         "path TEXT, "
+                         "mime_type_id INTEGER REFERENCES mime_type(id), "
+                         "status INT, "
+                         "size INTEGER);"
+
+                         "CREATE TABLE IF NOT EXISTS video ("
+                         "id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, "
+                         "file_id INTEGER NOT NULL UNIQUE, "
+                         "width INTEGER, "
+                         "height INTEGER, "
+                         "duration INTEGER, "
+                         "FOREIGN KEY(file_id) REFERENCES files(id));"
+
+                         "CREATE TABLE IF NOT EXISTS image ("
+                         "id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, "
+                         "file_id INTEGER NOT NULL UNIQUE, "
+                         "width INTEGER, "
+                         "height INTEGER, "
+                         "FOREIGN KEY(file_id) REFERENCES files(id));"
+
+                         "CREATE TABLE IF NOT EXISTS audio ("
+                         "id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, "
+                         "file_id INTEGER NOT NULL UNIQUE, "
+                         "duration INTEGER, "
+                         "FOREIGN KEY(file_id) REFERENCES files(id));"
+
+                         "ALTER TABLE messages ADD COLUMN preview_id INTEGER REFERENCES files(id);"
+
+
+                         "CREATE TABLE IF NOT EXISTS temp_users ("
+                         "id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, "
+                         "username TEXT NOT NULL, "
+                         "alias TEXT, "
+                         "avatar_id INTEGER REFERENCES files(id), "
+                         "type INTEGER NOT NULL, "
+                         "UNIQUE (username, type));"
+
+                         "INSERT INTO temp_users SELECT * FROM users;"
+                         "DROP TABLE IF EXISTS users;"
+                         "ALTER TABLE temp_users RENAME TO users;"
+
+
+                         "CREATE TABLE IF NOT EXISTS temp_threads ("
+                         "id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, "
+                         "name TEXT NOT NULL, "
+                         "alias TEXT, "
+                         "avatar_id INTEGER REFERENCES files(id), "
+                         "account_id INTEGER NOT NULL REFERENCES accounts(id) ON DELETE CASCADE, "
+                         "type INTEGER NOT NULL, "
+                         "encrypted INTEGER DEFAULT 0, "
+                         "last_read_id INTEGER REFERENCES messages(id), "
+                         "UNIQUE (name, account_id, type));"
+
+                         "INSERT INTO temp_threads SELECT * FROM threads;"
+                         "DROP TABLE IF EXISTS threads;"
+                         "ALTER TABLE temp_threads RENAME TO threads;"
+
+                         "COMMIT;",
+                         NULL, NULL, &error);
+
+  if (status == SQLITE_OK || status == SQLITE_DONE) {
+    /* Update user_version pragma */
+    if (!chatty_history_update_version (self, task))
+      return FALSE;
+    return TRUE;
+  }
+
+  g_task_return_new_error (task,
+                           G_IO_ERROR,
+                           G_IO_ERROR_FAILED,
+                           "Couldn't set db version. errno: %d, desc: %s. %s",
+                           status, sqlite3_errstr (status), error);
+  sqlite3_free (error);
+
+  return FALSE;
+}
+
+/* For migrating from v2 to v3 */
+static gboolean
+chatty_history_migrate_db_to_v3 (ChattyHistory *self,
+                                 GTask         *task)
+{
+  char *error = NULL;
+  int status;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  chatty_history_backup (self);
+
+  status = sqlite3_exec (self->db,
+                         "BEGIN TRANSACTION;"
+                         "PRAGMA foreign_keys=OFF;"
+
+                         "ALTER TABLE threads ADD COLUMN visibility INT NOT NULL DEFAULT "
+                         STRING(THREAD_VISIBILITY_VISIBLE) ";"
+
+                         "COMMIT;",
+                         NULL, NULL, &error);
+
+  if (status == SQLITE_OK || status == SQLITE_DONE) {
+    /* Update user_version pragma */
+    if (!chatty_history_update_version (self, task))
+      return FALSE;
+    return TRUE;
+  }
+
+  g_task_return_new_error (task,
+                           G_IO_ERROR,
+                           G_IO_ERROR_FAILED,
+                           "Couldn't set db version. errno: %d, desc: %s. %s",
+                           status, sqlite3_errstr (status), error);
+  sqlite3_free (error);
+
+  return FALSE;
+}
+
+/* For migrating from v3 to v4 */
+static gboolean
+chatty_history_migrate_db_to_v4 (ChattyHistory *self,
+                                 GTask         *task)
+{
+  char *error = NULL;
+  int status;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  chatty_history_backup (self);
+
+  status = sqlite3_exec (self->db,
+                         "BEGIN TRANSACTION;"
+
+                         HISTORY_V4_INDEXES
+
+                         /* Created on open by development versions */
+                         "DROP TRIGGER IF EXISTS files_media_insert;"
+                         "DROP TRIGGER IF EXISTS files_media_update;"
+                         "DROP TRIGGER IF EXISTS files_media_delete;"
+                         "DROP TABLE IF EXISTS media;"
+
+                         HISTORY_V4_MEDIA_REFS
+
+                         /* Count the references of the files already saved */
+                         "INSERT INTO media_refs(sha256,ref_count) "
+                         "SELECT substr(path," STRING (CHATTY_MEDIA_STORE_HASH_START) "),count(*) "
+                         "FROM files WHERE path GLOB '" CHATTY_MEDIA_STORE_GLOB "' "
+                         "GROUP BY 1;"
+
+                         "COMMIT;",
+                         NULL, NULL, &error);
+
+  if (status == SQLITE_OK || status == SQLITE_DONE) {
+    /* Update user_version pragma */
+    if (!chatty_history_update_version (self, task))
+      return FALSE;
+    return TRUE;
+  }
+
+  sqlite3_exec (self->db, "ROLLBACK;", NULL, NULL, NULL);
+  g_task_return_new_error (task,
+                           G_IO_ERROR,
+                           G_IO_ERROR_FAILED,
+                           "Couldn't migrate db to version 4. errno: %d, desc: %s. %s",
+                           status, sqlite3_errstr (status), error);
+  sqlite3_free (error);
+
+  return FALSE;
+}
+
+static gboolean
+chatty_history_migrate (ChattyHistory *self,
+                        GTask         *task)
+{
+  int version;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+  g_assert (self->db);
+
+  version = chatty_history_get_db_version (self, task);
+
+  if (version == HISTORY_VERSION)
+    return TRUE;
+
+  switch (version) {
+  case -1:  /* Error */
+    return FALSE;
+
+  case 0:
+    if (!chatty_history_migrate_db_to_v1_to_v3 (self, task))
+      return FALSE;
+    break;
+
+  case 1:
+    if (!chatty_history_migrate_db_to_v2 (self, task))
+      return FALSE;
+    /* fallthrough */
+
+  case 2:
+    if (!chatty_history_migrate_db_to_v3 (self, task))
+      return FALSE;
+    /* fallthrough */
+
+  case 3:
+    if (!chatty_history_migrate_db_to_v4 (self, task))
+      return FALSE;
+    break;
+
+  default:
+    g_task_return_new_error (task,
+                             G_IO_ERROR,
+                             G_IO_ERROR_FAILED,
+                             "Failed to migrate from version %d, unknown version",
+                             version);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static int
+history_get_pragma_int (ChattyHistory *self,
+                        const char    *pragma)
+{
+  sqlite3_stmt *stmt;
+  int value = -1;
+
+  sqlite3_prepare_v2 (self->db, pragma, -1, &stmt, NULL);
+
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    value = sqlite3_column_int (stmt, 0);
+  sqlite3_finalize (stmt);
+
+  return value;
+}
+
+/*
+ * Databases created before auto_vacuum was set have to be vacuumed
+ * once to enable it.  VACUUM rewrites the whole file and blocks
+ * every other query, so it's done only in maintenance, when there
+ * is nothing else to do, and only if enough space can be reclaimed.
+ * Until then, free pages are reused for new rows.
+ */
+static void
+history_enable_incremental_vacuum (ChattyHistory *self)
+{
+  int n_pages, n_free, status;
+
+  if (history_get_pragma_int (self, "PRAGMA auto_vacuum;") == 2)
+    return;
+
+  n_pages = history_get_pragma_int (self, "PRAGMA page_count;");
+  n_free = history_get_pragma_int (self, "PRAGMA freelist_count;");
+
+  if (n_pages <= 0 || (gint64)n_free * 100 / n_pages < VACUUM_MIN_FREE_PERCENT)
+    return;
+
+  g_info ("Enabling incremental vacuum on history db, %d of %d pages free",
+          n_free, n_pages);
+  status = sqlite3_exec (self->db, "PRAGMA auto_vacuum = INCREMENTAL; VACUUM;",
+                         NULL, NULL, NULL);
+  warn_if_sql_error (status, "enabling incremental vacuum");
+}
+
+static void
+history_open_db (ChattyHistory *self,
+                 GTask         *task)
+{
+  const char *dir, *file_name;
+  sqlite3 *db;
+  int status;
+  gboolean db_exists;
+  CHATTY_TRACE_SPAN (G_STRFUNC);
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+  g_assert (!self->db);
+
+  dir = g_object_get_data (G_OBJECT (task), "dir");
+  file_name = g_object_get_data (G_OBJECT (task), "file-name");
+  g_assert (dir && *dir);
+  g_assert (file_name && *file_name);
+
+  g_mkdir_with_parents (dir, S_IRWXU);
+  self->db_path = g_build_filename (dir, file_name, NULL);
+
+  db_exists = g_file_test (self->db_path, G_FILE_TEST_EXISTS);
+  status = sqlite3_open (self->db_path, &db);
+
+  if (status == SQLITE_OK) {
+    self->db = db;
+
+    if (db_exists) {
+      if (!chatty_history_migrate (self, task))
+        return;
+    } else {
+      if (!chatty_history_create_schema (self, task))
+        return;
+
+      if (!chatty_history_update_version (self, task))
+        return;
+    }
+
+    sqlite3_exec (self->db, "PRAGMA foreign_keys = ON;", NULL, NULL, NULL);
+    g_task_return_boolean (task, TRUE);
+  } else {
+    g_task_return_boolean (task, FALSE);
+  }
+}
+
+static void
+history_close_db (ChattyHistory *self,
+                  GTask         *task)
+{
+  sqlite3 *db;
+  int status;
+  CHATTY_TRACE_SPAN (G_STRFUNC);
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+  g_assert (self->db);
+
+  /* The migration is resumed when the database is opened again */
+  g_clear_pointer (&self->migration, history_migration_free);
+
+  if (self->backup_task)
+    g_task_return_new_error (self->backup_task, G_IO_ERROR, G_IO_ERROR_CLOSED,
+                             "Database closed before backup completed");
+  g_clear_pointer (&self->backup, chatty_db_backup_free);
+  g_clear_object (&self->backup_task);
+
+  if (self->maintenance)
+    g_task_return_new_error (self->maintenance->task, G_IO_ERROR, G_IO_ERROR_CLOSED,
+                             "Database closed before maintenance completed");
+  g_clear_pointer (&self->maintenance, history_maintenance_free);
+
+  if (self->export)
+    g_task_return_new_error (self->export->task, G_IO_ERROR, G_IO_ERROR_CLOSED,
+                             "Database closed before export completed");
+  g_clear_pointer (&self->export, history_export_free);
+
+  /* Messages imported so far are kept, each slice is committed */
+  if (self->import)
+    g_task_return_new_error (self->import->task, G_IO_ERROR, G_IO_ERROR_CLOSED,
+                             "Database closed before import completed");
+  g_clear_pointer (&self->import, history_import_free);
+
+  db = self->db;
+  self->db = NULL;
+  status = sqlite3_close (db);
+
+  if (status == SQLITE_OK) {
+    /*
+     * We can’t know when will @self associated with the task will
+     * be unref.  So chatty_history_get_default() called immediately
+     * after this may return the @self that is yet to be free.  But
+     * as the worker_thread is exited after closing the database, any
+     * actions with the same @self will not execute, and so the tasks
+     * will take ∞ time to complete.
+     *
+     * So Instead of relying on GObject to free the object, Let’s
+     * explicitly run dispose
+     */
+    g_object_run_dispose (G_OBJECT (self));
+    g_debug ("Database closed successfully");
+    g_task_return_boolean (task, TRUE);
+  } else {
+    g_task_return_new_error (task,
+                             G_IO_ERROR,
+                             G_IO_ERROR_FAILED,
+                             "Database could not be closed. errno: %d, desc: %s",
+                             status, sqlite3_errmsg (db));
+  }
+}
+
+/* Columns and joins to create a #ChattyMessage with
+ * history_message_from_stmt(), the message columns
+ * should be the first ones selected */
+#define HISTORY_MESSAGE_COLUMNS                                         \
+  /*          0             1               2          3                 4                         5 */ \
+  "messages.time,messages.direction,messages.body,messages.uid,coalesce(users.alias,users.username),messages.body_type," \
+  /*    6         7          8           9            10          11 */ \
+  "files.name,files.url,files.path,mime_type.name,files.size,files.status," \
+  "coalesce(video.width,image.width)," /* 12 */                        \
+  "coalesce(video.height,image.height)," /* 13 */                      \
+  "coalesce(video.duration,audio.duration)," /* 14 */                  \
+  /*     15          16          17              18           19             20 */ \
+  "p_files.name,p_files.url,p_files.path,p_mime_type.name,p_files.size,p_files.status," \
+  "coalesce(p_video.width,p_image.width)," /* 21 */                    \
+  "coalesce(p_video.height,p_image.height)," /* 22 */                  \
+  "coalesce(p_video.duration,p_audio.duration)," /* 23 */              \
+  /* 24 */                                                              \
+  "messages.status "
+
+#define HISTORY_MESSAGE_N_COLUMNS 25
+
+#define HISTORY_MESSAGE_JOINS                                           \
+  "LEFT JOIN files ON messages.body_type>=8 AND messages.body_type<=11 AND files.id=messages.body " \
+  "LEFT JOIN mime_type ON messages.body_type>=8 AND messages.body_type<=11 AND files.mime_type_id=mime_type.id " \
+  "LEFT JOIN image ON messages.body_type=9 AND files.id=image.file_id " \
+  "LEFT JOIN video ON messages.body_type=10 AND files.id=video.file_id " \
+  "LEFT JOIN audio ON messages.body_type=11 AND files.id=audio.file_id " \
+                                                                        \
+  "LEFT JOIN files AS p_files ON messages.preview_id=p_files.id "       \
+  "LEFT JOIN mime_type AS p_mime_type ON p_files.mime_type_id=p_mime_type.id " \
+  "LEFT JOIN image AS p_image ON p_files.id=p_image.file_id "           \
+  "LEFT JOIN video AS p_video ON p_files.id=p_video.file_id "           \
+  "LEFT JOIN audio AS p_audio ON p_files.id=p_audio.file_id "           \
+  "LEFT JOIN users "                                                    \
+  "ON messages.sender_id=users.id "
+
+static ChattyMessage *
+history_message_from_stmt (sqlite3_stmt *stmt,
+                           ChattyChat   *chat)
+{
+  g_autoptr(ChattyContact) contact = NULL;
+  ChattyFileInfo *file = NULL, *preview = NULL;
+  ChattyMessage *message;
+  const char *msg = NULL, *uid;
+  const char *who = NULL;
+  ChattyMsgType type;
+  guint time_stamp;
+  int direction, status;
+
+  uid = (const char *)sqlite3_column_text (stmt, 3);
+  time_stamp = sqlite3_column_int (stmt, 0);
+  direction = sqlite3_column_int (stmt, 1);
+  type = history_value_to_message_type (sqlite3_column_int (stmt, 5));
+
+  /* preview is not limitted to media messages */
+  if (sqlite3_column_text (stmt, 16)) {
+    preview = g_new0 (ChattyFileInfo, 1);
+    preview->file_name = g_strdup ((const char *)sqlite3_column_text (stmt, 15));
+    preview->url = g_strdup ((const char *)sqlite3_column_text (stmt, 16));
+    preview->path = g_strdup ((const char *)sqlite3_column_text (stmt, 17));
+    preview->mime_type = g_strdup ((const char *)sqlite3_column_text (stmt, 18));
+    preview->size = sqlite3_column_int (stmt, 19);
+    preview->status = sqlite3_column_int (stmt, 20);
+    preview->width = sqlite3_column_int (stmt, 21);
+    preview->height = sqlite3_column_int (stmt, 22);
+    preview->duration = sqlite3_column_int (stmt, 23);
+  }
+
+  if (sqlite3_column_text (stmt, 7)) {
+    file = g_new0 (ChattyFileInfo, 1);
+    file->file_name = g_strdup ((const char *)sqlite3_column_text (stmt, 6));
+    file->url = g_strdup ((const char *)sqlite3_column_text (stmt, 7));
+    file->path = g_strdup ((const char *)sqlite3_column_text (stmt, 8));
+    file->mime_type = g_strdup ((const char *)sqlite3_column_text (stmt, 9));
+    file->size = sqlite3_column_int (stmt, 10);
+    file->status = sqlite3_column_int (stmt, 11);
+    file->width = sqlite3_column_int (stmt, 12);
+    file->height = sqlite3_column_int (stmt, 13);
+    file->duration = sqlite3_column_int (stmt, 14);
+  }
+  else
+    msg = (const char *)sqlite3_column_text (stmt, 2);
+
+  if (!chatty_chat_is_im (chat) || CHATTY_IS_MA_CHAT (chat))
+    who = (const char *)sqlite3_column_text (stmt, 4);
+
+  status = sqlite3_column_int (stmt, 24);
+
+  contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
+  chatty_contact_set_name (contact, who);
+  chatty_contact_set_value (contact, who);
+  message = chatty_message_new (CHATTY_ITEM (contact), msg, uid, time_stamp, type,
+                                history_direction_from_value (direction),
+                                history_msg_status_from_value (status));
+
+  chatty_message_set_files (message, g_list_append (NULL, file));
+  chatty_message_set_preview (message, preview);
+
+  return message;
+}
+
+static GPtrArray *
+get_messages_before_time (ChattyHistory *self,
+                          ChattyChat    *chat,
+                          ChattyMessage *start,
+                          int            thread_id,
+                          guint          since_time,
+                          guint          limit)
+{
+  GPtrArray *messages = NULL;
+  sqlite3_stmt *stmt;
+  int status;
+  gboolean skip = TRUE;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (CHATTY_IS_CHAT (chat));
+  g_assert (g_thread_self () == self->worker_thread);
+  g_assert (limit != 0);
+
+  if (!start)
+    skip = FALSE;
+
+  status = sqlite3_prepare_v2 (self->db,
+                               "SELECT DISTINCT " HISTORY_MESSAGE_COLUMNS
+                               "FROM messages "
+                               HISTORY_MESSAGE_JOINS
                                "WHERE thread_id=? "
                                "AND messages.time <= ? "
                                "AND body NOT NULL AND body !='' "
                                "ORDER BY time DESC, messages.id DESC LIMIT ?;",
                                -1, &stmt, NULL);
-  history_bind_int (stmt, 1, thread_id, "binding when getting messages");
-  history_bind_int (stmt, 2, since_time, "binding when getting messages");
-  history_bind_int (stmt, 3, limit, "binding when getting messages");
+  history_bind_int (stmt, 1, thread_id, "binding when getting messages");
+  history_bind_int (stmt, 2, since_time, "binding when getting messages");
+  history_bind_int (stmt, 3, limit, "binding when getting messages");
+
+  while (sqlite3_step (stmt) == SQLITE_ROW) {
+    const char *uid;
+
+    uid = (const char *)sqlite3_column_text (stmt, 3);
+
+    /* Skip until we pass the last message already in chat.
+     * This can happen as we load all messages with time <= message,
+     * which is required as there can be multiple messages with
+     * same timestamp.
+     */
+    if (skip && start) {
+      if (g_strcmp0 (uid, chatty_message_get_uid (start)) == 0)
+        skip = FALSE;
+      continue;
+    }
+
+    if (!messages)
+      messages = g_ptr_array_new_full (30, g_object_unref);
+
+    g_ptr_array_insert (messages, 0, history_message_from_stmt (stmt, chat));
+  }
+
+  status = sqlite3_finalize (stmt);
+  warn_if_sql_error (status, "finalizing when getting messages");
+
+  return messages;
+}
+
+static void
+history_get_messages (ChattyHistory *self,
+                      GTask         *task)
+{
+  GPtrArray *messages;
+  ChattyMessage *start;
+  ChattyChat *chat;
+  guint limit;
+  int thread_id, since = INT_MAX;
+  CHATTY_TRACE_SPAN (G_STRFUNC);
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  if (!self->db) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Database not opened");
+    return;
+  }
+
+  limit = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (task), "limit"));
+  start = g_object_get_data (G_OBJECT (task), "message");
+  chat  = g_object_get_data (G_OBJECT (task), "chat");
+
+  g_assert (limit != 0);
+  g_assert (!start || CHATTY_IS_MESSAGE (start));
+  g_assert (CHATTY_IS_CHAT (chat));
+
+  if (start)
+    since = chatty_message_get_time (start);
+
+  thread_id = get_thread_id (self, chat);
+
+  if (!thread_id) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Couldn't find chat %s",
+                             chatty_chat_get_chat_name (chat));
+    return;
+  }
+
+  messages = get_messages_before_time (self, chat, start, thread_id, since, limit);
+  g_task_return_pointer (task, messages, (GDestroyNotify)g_ptr_array_unref);
+}
+
+static int
+add_file_info (ChattyHistory  *self,
+               ChattyFileInfo *file)
+{
+  sqlite3_stmt *stmt;
+  int file_id = 0, mime_id = 0;
+  int status;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+
+  if (!file)
+    return 0;
+
+  if (file->mime_type) {
+    sqlite3_prepare_v2 (self->db,
+                        "INSERT OR IGNORE INTO mime_type(name) VALUES(?)",
+                        -1, &stmt, NULL);
+    history_bind_text (stmt, 1, file->mime_type, "binding when getting timestamp");
+    sqlite3_step (stmt);
+    sqlite3_finalize (stmt);
+
+    sqlite3_prepare_v2 (self->db, "SELECT id FROM mime_type WHERE name=?" ,
+                        -1, &stmt, NULL);
+    history_bind_text (stmt, 1, file->mime_type, "binding when getting timestamp");
+    if (sqlite3_step (stmt) == SQLITE_ROW)
+      mime_id = sqlite3_column_int (stmt, 0);
+    sqlite3_finalize (stmt);
+  }
+
+  if (file->status == CHATTY_FILE_DOWNLOADED)
+    status = FILE_STATUS_DOWNLOADED;
+  else if (file->status == CHATTY_FILE_DECRYPT_FAILED)
+    status = FILE_STATUS_DECRYPT_FAILED;
+  else if (file->status == CHATTY_FILE_MISSING)
+    status = FILE_STATUS_MISSING;
+  else
+    status = 0;
+
+  sqlite3_prepare_v2 (self->db, "SELECT id FROM files WHERE url=?", -1, &stmt, NULL);
+  history_bind_text (stmt, 1, file->url, "binding when getting file");
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    file_id = sqlite3_column_int (stmt, 0);
+  sqlite3_finalize (stmt);
+
+  sqlite3_prepare_v2 (self->db,
+                      "INSERT INTO files(name,url,path,mime_type_id,size,status) "
+                      "VALUES(?1,?2,?3,?4,?5,?6) "
+                      "ON CONFLICT(url) DO UPDATE SET path=?3, size=?5, status=?6",
+                      -1, &stmt, NULL);
+  history_bind_text (stmt, 1, file->file_name, "binding when adding file");
+  history_bind_text (stmt, 2, file->url, "binding when adding file");
+  history_bind_text (stmt, 3, file->path, "binding when adding file");
+  if (mime_id)
+    history_bind_int (stmt, 4, mime_id, "binding when adding file");
+  if (file->size)
+    history_bind_int (stmt, 5, file->size, "binding when adding file");
+  if (status)
+    history_bind_int (stmt, 6, status, "binding when adding file");
+  sqlite3_step (stmt);
+  sqlite3_finalize (stmt);
+
+  if (file_id)
+    return file_id;
+
+  file_id = sqlite3_last_insert_rowid (self->db);
+
+  if (file->mime_type &&
+      ((file->width && file->height) || file->duration)) {
+    if (g_str_has_prefix (file->mime_type, "video/"))
+      sqlite3_prepare_v2 (self->db,
+                          "INSERT INTO video(file_id,width,height,duration) "
+                          "VALUES(?1,?2,?3,?4)",
+                          -1, &stmt, NULL);
+    else if (g_str_has_prefix (file->mime_type, "image/"))
+      sqlite3_prepare_v2 (self->db,
+                          "INSERT INTO image(file_id,width,height) "
+                          "VALUES(?1,?2,?3)",
+                          -1, &stmt, NULL);
+    else if (g_str_has_prefix (file->mime_type, "audio/"))
+      sqlite3_prepare_v2 (self->db,
+                          "INSERT INTO audio(file_id,duration) "
+                          "VALUES(?1,?4)",
+                          -1, &stmt, NULL);
+    else
+      return file_id;
+
+    history_bind_int (stmt, 1, file_id, "binding when adding media");
+    if (file->width && !g_str_has_prefix (file->mime_type, "audio/"))
+      history_bind_int (stmt, 2, file->width, "binding when adding media");
+    if (file->height && !g_str_has_prefix (file->mime_type, "audio/"))
+      history_bind_int (stmt, 3, file->height, "binding when adding media");
+    if (file->duration && !g_str_has_prefix (file->mime_type, "image/"))
+      history_bind_int (stmt, 4, file->duration, "binding when adding media");
+    sqlite3_step (stmt);
+    sqlite3_finalize (stmt);
+  }
+
+  return file_id;
+}
+
+/*
+ * Returns %TRUE if @message was saved, otherwise
+ * @task is returned with the error.
+ */
+static gboolean
+history_insert_message (ChattyHistory *self,
+                        ChattyChat    *chat,
+                        ChattyMessage *message,
+                        GTask         *task)
+{
+  sqlite3_stmt *stmt;
+  const char *who, *uid, *msg, *alias;
+  ChattyMsgDirection direction;
+  ChattyMsgType type;
+  int thread_id = 0, sender_id = 0, file_id = 0, preview_id = 0;
+  int status, dir;
+  time_t time_stamp;
+
+  g_assert (CHATTY_IS_CHAT (chat));
+  g_assert (CHATTY_IS_MESSAGE (message));
+
+  who = chatty_message_get_user_name (message);
+  uid = chatty_message_get_uid (message);
+  msg = chatty_message_get_text (message);
+  time_stamp = chatty_message_get_time (message);
+  direction = chatty_message_get_msg_direction (message);
+  dir = history_direction_to_value (direction);
+  type = chatty_message_get_msg_type (message);
+  alias = chatty_message_get_user_alias (message);
+
+  if (direction == CHATTY_DIRECTION_OUT)
+    who = chatty_chat_get_username (chat);
+
+  if ((!who || !*who) && direction == CHATTY_DIRECTION_IN && chatty_chat_is_im (chat))
+    who = chatty_chat_get_chat_name (chat);
+
+  thread_id = insert_or_ignore_thread (self, chat, task);
+  if (!thread_id)
+    return FALSE;
+
+  sender_id = insert_or_ignore_user (self, chatty_item_get_protocols (CHATTY_ITEM (chat)), who, alias, task);
+
+  if (sender_id && direction == CHATTY_DIRECTION_IN) {
+    sqlite3_prepare_v2 (self->db,
+                        "INSERT OR IGNORE INTO thread_members(thread_id,user_id) "
+                        "VALUES(?1,?2)",
+                        -1, &stmt, NULL);
+    history_bind_int (stmt, 1, thread_id, "binding when adding thread member");
+    history_bind_int (stmt, 2, sender_id, "binding when adding thread member");
+    sqlite3_step (stmt);
+    sqlite3_finalize (stmt);
+  }
+
+  if (type == CHATTY_MESSAGE_IMAGE ||
+      type == CHATTY_MESSAGE_AUDIO ||
+      type == CHATTY_MESSAGE_VIDEO ||
+      type == CHATTY_MESSAGE_FILE) {
+    GList *files = NULL;
+
+    files = chatty_message_get_files (message);
+    preview_id = add_file_info (self, chatty_message_get_preview (message));
+    file_id = add_file_info (self, files ? files->data : NULL);
+  }
+
+  sqlite3_prepare_v2 (self->db,
+                      "INSERT INTO messages(uid,thread_id,sender_id,body,body_type,direction,time,preview_id,encrypted,status) "
+                      "VALUES(?1,?2,?3,"
+                      "CASE "
+                      "  WHEN ?5>="STRING (MESSAGE_TYPE_FILE) " AND ?5<="STRING (MESSAGE_TYPE_AUDIO) " "
+                      "  THEN ?8 "
+                      "  ELSE ?4 "
+                      "END,"
+                      "?5,?6,?7,?9,?10,?11) "
+                      "ON CONFLICT (uid,thread_id,body,time) DO UPDATE "
+                      "SET status=?11",
+                      -1, &stmt, NULL);
+
+  history_bind_text (stmt, 1, uid, "binding when adding message");
+  history_bind_int (stmt, 2, thread_id, "binding when adding message");
+  if (sender_id)
+    history_bind_int (stmt, 3, sender_id, "binding when adding message");
+  history_bind_text (stmt, 4, msg, "binding when adding message");
+  history_bind_int (stmt, 5, history_message_type_to_value (type),
+                    "binding when adding message");
+  history_bind_int (stmt, 6, dir, "binding when adding message");
+  history_bind_int (stmt, 7, time_stamp, "binding when adding message");
+  if (file_id)
+    history_bind_int (stmt, 8, file_id, "binding when adding message");
+  if (preview_id)
+    history_bind_int (stmt, 9, preview_id, "binding when adding message");
+  history_bind_int (stmt, 10, chatty_message_get_encrypted (message),
+                    "binding when adding message");
+  status = history_msg_status_to_value (chatty_message_get_status (message));
+  if (status != MESSAGE_STATUS_UNKNOWN)
+    history_bind_int (stmt, 11, status, "binding when adding message");
+
+  status = sqlite3_step (stmt);
+  sqlite3_finalize (stmt);
+
+  if (status == SQLITE_DONE)
+    return TRUE;
+
+  g_task_return_new_error (task,
+                           G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Failed to save message. errno: %d, desc: %s",
+                           status, sqlite3_errmsg (self->db));
+  return FALSE;
+}
+
+static void
+history_add_message (ChattyHistory *self,
+                     GTask         *task)
+{
+  ChattyMessage *message;
+  ChattyChat *chat;
+  CHATTY_TRACE_SPAN (G_STRFUNC);
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  if (!self->db) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Database not opened");
+    return;
+  }
+
+  chat = g_object_get_data (G_OBJECT (task), "chat");
+  message = g_object_get_data (G_OBJECT (task), "message");
+
+  if (history_insert_message (self, chat, message, task))
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+history_add_messages (ChattyHistory *self,
+                      GTask         *task)
+{
+  GPtrArray *chats, *messages;
+  CHATTY_TRACE_SPAN (G_STRFUNC);
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  if (!self->db) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Database not opened");
+    return;
+  }
+
+  chats = g_object_get_data (G_OBJECT (task), "chats");
+  messages = g_object_get_data (G_OBJECT (task), "messages");
+  g_assert (chats && messages);
+  g_assert (chats->len == messages->len);
+
+  sqlite3_exec (self->db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+
+  for (guint i = 0; i < messages->len; i++) {
+    if (!history_insert_message (self, chats->pdata[i], messages->pdata[i], task)) {
+      sqlite3_exec (self->db, "ROLLBACK;", NULL, NULL, NULL);
+      return;
+    }
+  }
+
+  sqlite3_exec (self->db, "COMMIT;", NULL, NULL, NULL);
+  g_task_return_boolean (task, TRUE);
+}
+
+/*
+ * Prepare a statement that fetches every visible thread of
+ * @account along with its last message and unread count in
+ * a single query.  Threads are matched by the account username
+ * only, the same way get_thread_id() does, so that this works
+ * for every account type.  The last message is looked up with
+ * messages_thread_time_idx, so this doesn't scan every message,
+ * unlike a window function over the messages table.
+ */
+static sqlite3_stmt *
+history_prepare_chats_stmt (ChattyHistory *self,
+                            ChattyAccount *account)
+{
+  sqlite3_stmt *stmt;
+  int status;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (CHATTY_IS_ACCOUNT (account));
+
+  status = sqlite3_prepare_v2 (self->db,
+                               "SELECT " HISTORY_MESSAGE_COLUMNS ","
+                               /* HISTORY_MESSAGE_N_COLUMNS + */
+                               /*   0         1            2              3          4 */
+                               "threads.name,threads.alias,threads.encrypted,avatar.url,avatar.path,"
+                               /* 5 */
+                               "(SELECT count(*) FROM messages AS unread "
+                               "WHERE threads.last_read_id NOT NULL "
+                               "AND unread.thread_id=threads.id "
+                               "AND unread.id>threads.last_read_id "
+                               "AND unread.direction=1),"
+                               /* 6 */
+                               "threads.type "
+                               "FROM threads "
+                               "INNER JOIN accounts ON accounts.id=threads.account_id "
+                               "INNER JOIN users AS account_user ON account_user.id=accounts.user_id "
+                               "AND account_user.username=? "
+                               "LEFT JOIN files AS avatar ON threads.avatar_id=avatar.id "
+                               "LEFT JOIN messages ON messages.id=("
+                               "SELECT last.id FROM messages AS last "
+                               "WHERE last.thread_id=threads.id "
+                               "AND last.body NOT NULL AND last.body !='' "
+                               "ORDER BY last.time DESC, last.id DESC LIMIT 1) "
+                               HISTORY_MESSAGE_JOINS
+                               "WHERE threads.visibility=" STRING(THREAD_VISIBILITY_VISIBLE) ";",
+                               -1, &stmt, NULL);
+  warn_if_sql_error (status, "preparing when getting threads");
+  history_bind_text (stmt, 1, chatty_account_get_username (account),
+                     "binding when getting threads");
+
+  return stmt;
+}
+
+static void
+history_get_chats (ChattyHistory *self,
+                   GTask         *task)
+{
+  GPtrArray *threads = NULL;
+  ChattyAccount *account;
+  sqlite3_stmt *stmt;
+  CHATTY_TRACE_SPAN (G_STRFUNC);
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  if (!self->db) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Database not opened");
+    return;
+  }
+
+  account = g_object_get_data (G_OBJECT (task), "account");
+
+  /* Chats of other accounts are owned by libpurple, see history_get_last_messages() */
+  g_assert (CHATTY_IS_MA_ACCOUNT (account));
+
+  stmt = history_prepare_chats_stmt (self, account);
+
+  while (sqlite3_step (stmt) == SQLITE_ROW) {
+    ChattyFileInfo *file = NULL;
+    const char *name, *alias;
+    ChattyChat *chat;
+    guint unread_count;
+    int encrypted;
+
+    if (!threads)
+      threads = g_ptr_array_new_full (30, g_object_unref);
+
+    name = (const char *)sqlite3_column_text (stmt, HISTORY_MESSAGE_N_COLUMNS + 0);
+    alias = (const char *)sqlite3_column_text (stmt, HISTORY_MESSAGE_N_COLUMNS + 1);
+    encrypted = sqlite3_column_int (stmt, HISTORY_MESSAGE_N_COLUMNS + 2);
+    unread_count = sqlite3_column_int (stmt, HISTORY_MESSAGE_N_COLUMNS + 5);
+
+    if (sqlite3_column_text (stmt, HISTORY_MESSAGE_N_COLUMNS + 3)) {
+      file = g_new0 (ChattyFileInfo, 1);
+      file->url = g_strdup ((const char *)sqlite3_column_text (stmt, HISTORY_MESSAGE_N_COLUMNS + 3));
+      file->path = g_strdup ((const char *)sqlite3_column_text (stmt, HISTORY_MESSAGE_N_COLUMNS + 4));
+    }
+
+    chat = (gpointer)chatty_ma_chat_new (name, alias, file);
+    chatty_chat_set_encryption (chat, encrypted);
+
+    /* messages.uid is NULL if the thread has no messages */
+    if (sqlite3_column_text (stmt, 3)) {
+      g_autoptr(GPtrArray) messages = NULL;
+
+      messages = g_ptr_array_new_full (1, g_object_unref);
+      g_ptr_array_add (messages, history_message_from_stmt (stmt, chat));
+      chatty_ma_chat_add_messages (CHATTY_MA_CHAT (chat), messages);
+    }
+
+    if (unread_count)
+      chatty_chat_set_unread_count (chat, unread_count);
+
+    g_ptr_array_add (threads, chat);
+  }
+
+  sqlite3_finalize (stmt);
+  g_task_return_pointer (task, threads, (GDestroyNotify)g_ptr_array_unref);
+}
+
+static void
+history_get_last_messages (ChattyHistory *self,
+                           GTask         *task)
+{
+  GHashTable *chats, *messages;
+  ChattyAccount *account;
+  sqlite3_stmt *stmt;
+  CHATTY_TRACE_SPAN (G_STRFUNC);
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  if (!self->db) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Database not opened");
+    return;
+  }
+
+  account = g_object_get_data (G_OBJECT (task), "account");
+  /* chat name to ChattyChat, not modified until the task completes */
+  chats = g_object_get_data (G_OBJECT (task), "chats");
+  messages = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                    g_object_unref, (GDestroyNotify)g_ptr_array_unref);
+
+  stmt = history_prepare_chats_stmt (self, account);
+
+  while (sqlite3_step (stmt) == SQLITE_ROW) {
+    GPtrArray *chat_messages;
+    ChattyChat *chat;
+    const char *name;
+    int type;
+
+    /* messages.uid is NULL if the thread has no messages */
+    if (!sqlite3_column_text (stmt, 3))
+      continue;
+
+    name = (const char *)sqlite3_column_text (stmt, HISTORY_MESSAGE_N_COLUMNS + 0);
+    type = sqlite3_column_int (stmt, HISTORY_MESSAGE_N_COLUMNS + 6);
+    chat = g_hash_table_lookup (chats, name);
+
+    if (!chat ||
+        chatty_chat_is_im (chat) != (type == THREAD_DIRECT_CHAT))
+      continue;
+
+    chat_messages = g_ptr_array_new_full (1, g_object_unref);
+    g_ptr_array_add (chat_messages, history_message_from_stmt (stmt, chat));
+    g_hash_table_insert (messages, g_object_ref (chat), chat_messages);
+  }
+
+  sqlite3_finalize (stmt);
+  g_task_return_pointer (task, messages, (GDestroyNotify)g_hash_table_unref);
+}
+
+static void
+history_update_chat (ChattyHistory *self,
+                     GTask         *task)
+{
+  ChattyChat *chat;
+  CHATTY_TRACE_SPAN (G_STRFUNC);
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  if (!self->db) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Database not opened");
+    return;
+  }
+
+  chat = g_object_get_data (G_OBJECT (task), "chat");
+  g_assert (CHATTY_IS_CHAT (chat));
+
+  if (insert_or_ignore_thread (self, chat, task))
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+history_set_chat_read (ChattyHistory *self,
+                       GTask         *task)
+{
+  ChattyChat *chat;
+  sqlite3_stmt *stmt;
+  int status, thread_id;
+  CHATTY_TRACE_SPAN (G_STRFUNC);
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  if (!self->db) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Database not opened");
+    return;
+  }
+
+  chat = g_object_get_data (G_OBJECT (task), "chat");
+  g_assert (CHATTY_IS_CHAT (chat));
+
+  thread_id = get_thread_id (self, chat);
+
+  /* Nothing stored for @chat yet */
+  if (!thread_id) {
+    g_task_return_boolean (task, TRUE);
+    return;
+  }
+
+  sqlite3_prepare_v2 (self->db,
+                      "UPDATE threads SET last_read_id=("
+                      "SELECT max(id) FROM messages WHERE thread_id=?1) "
+                      "WHERE id=?1;",
+                      -1, &stmt, NULL);
+  history_bind_int (stmt, 1, thread_id, "binding when setting chat read");
+
+  status = sqlite3_step (stmt);
+  sqlite3_finalize (stmt);
+
+  if (status == SQLITE_DONE)
+    g_task_return_boolean (task, TRUE);
+  else
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Failed to set chat read. errno: %d, desc: %s",
+                             status, sqlite3_errmsg (self->db));
+}
+
+static void
+history_delete_chat (ChattyHistory *self,
+                     GTask         *task)
+{
+  ChattyChat *chat;
+  sqlite3_stmt *stmt;
+  const char *account, *chat_name;
+  int status;
+  CHATTY_TRACE_SPAN (G_STRFUNC);
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  if (!self->db) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Database not opened");
+    return;
+  }
+
+  chat = g_object_get_data (G_OBJECT (task), "chat");
+  g_assert (CHATTY_IS_CHAT (chat));
+
+  chat_name = chatty_chat_get_chat_name (chat);
+
+  if (!chat_name || !*chat_name) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Error: chat name is empty");
+    return;
+  }
+
+  account = chatty_chat_get_username (chat);
+
+  status = sqlite3_prepare_v2 (self->db,
+                               "DELETE FROM threads "
+                               "WHERE threads.type=? AND threads.name=? "
+                               "AND threads.account_id IN ("
+                               "SELECT accounts.id FROM accounts "
+                               "INNER JOIN users "
+                               "ON accounts.id=threads.account_id "
+                               "AND users.id=accounts.user_id AND users.username=?);",
+                               -1, &stmt, NULL);
+
+  history_bind_int (stmt, 1, chatty_chat_is_im (chat) ? THREAD_DIRECT_CHAT : THREAD_GROUP_CHAT,
+                    "binding when deleting thread");
+  history_bind_text (stmt, 2, chat_name, "binding when deleting thread");
+  history_bind_text (stmt, 3, account, "binding when deleting thread");
+
+  status = sqlite3_step (stmt);
+  sqlite3_finalize (stmt);
+
+  if (status == SQLITE_DONE)
+    g_task_return_boolean (task, TRUE);
+  else
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Failed to delete chat. errno: %d, desc: %s",
+                             status, sqlite3_errmsg (self->db));
+}
+
+static void
+history_update_status (ChattyHistory *self,
+                       GTask         *task)
+{
+  g_autoptr(GHashTable) thread_ids = NULL;
+  GPtrArray *chats, *messages;
+  sqlite3_stmt *stmt;
+  int status = SQLITE_DONE;
+  CHATTY_TRACE_SPAN (G_STRFUNC);
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  if (!self->db) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Database not opened");
+    return;
+  }
+
+  chats = g_object_get_data (G_OBJECT (task), "chats");
+  messages = g_object_get_data (G_OBJECT (task), "messages");
+  g_assert (chats && messages);
+  g_assert (chats->len == messages->len);
+
+  /* Chat to thread id, most messages are from a few chats */
+  thread_ids = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  /* uid is unique only within a thread.  Don't downgrade the
+   * status, receipts may arrive out of order */
+  sqlite3_prepare_v2 (self->db,
+                      "UPDATE messages SET status=?1 "
+                      "WHERE uid=?2 AND thread_id=?3 AND (status IS NULL OR status<?1 "
+                      "OR status>"STRING (MESSAGE_STATUS_READ)");",
+                      -1, &stmt, NULL);
+  sqlite3_exec (self->db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+
+  for (guint i = 0; i < messages->len; i++) {
+    ChattyMessage *message = messages->pdata[i];
+    ChattyChat *chat = chats->pdata[i];
+    const char *uid;
+    int thread_id;
+
+    uid = chatty_message_get_uid (message);
+
+    if (!uid || !*uid)
+      continue;
+
+    thread_id = GPOINTER_TO_INT (g_hash_table_lookup (thread_ids, chat));
+
+    if (!thread_id) {
+      thread_id = get_thread_id (self, chat);
+      g_hash_table_insert (thread_ids, chat, GINT_TO_POINTER (thread_id));
+    }
+
+    /* The message isn't saved in history */
+    if (!thread_id)
+      continue;
+
+    history_bind_int (stmt, 1, history_msg_status_to_value (chatty_message_get_status (message)),
+                      "binding when updating status");
+    history_bind_text (stmt, 2, uid, "binding when updating status");
+    history_bind_int (stmt, 3, thread_id, "binding when updating status");
+
+    status = sqlite3_step (stmt);
+    sqlite3_reset (stmt);
+
+    if (status != SQLITE_DONE)
+      break;
+  }
+
+  sqlite3_finalize (stmt);
+
+  if (status == SQLITE_DONE) {
+    sqlite3_exec (self->db, "COMMIT;", NULL, NULL, NULL);
+    g_task_return_boolean (task, TRUE);
+  } else {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Failed to update message status. errno: %d, desc: %s",
+                             status, sqlite3_errmsg (self->db));
+    sqlite3_exec (self->db, "ROLLBACK;", NULL, NULL, NULL);
+  }
+}
+
+static void
+history_get_chat_timestamp (ChattyHistory *self,
+                            GTask         *task)
+{
+  sqlite3_stmt *stmt;
+  const char *uuid, *room;
+  int status, timestamp = INT_MAX;
+  CHATTY_TRACE_SPAN (G_STRFUNC);
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+
+  uuid = g_object_get_data (G_OBJECT (task), "uuid");
+  room = g_object_get_data (G_OBJECT (task), "room");
+
+  g_assert (uuid);
+  g_assert (room);
+
+  sqlite3_prepare_v2 (self->db, "SELECT time FROM messages "
+                      "INNER JOIN threads "
+                      "ON threads.name=? "
+                      "WHERE uid=? LIMIT 1;", -1, &stmt, NULL);
+  history_bind_text (stmt, 1, room, "binding when getting timestamp");
+  history_bind_text (stmt, 2, uuid, "binding when getting timestamp");
+
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    timestamp = sqlite3_column_int (stmt, 0);
+
+  status = sqlite3_finalize (stmt);
+  warn_if_sql_error (status, "finalizing when getting timestamp");
+
+  g_task_return_int (task, timestamp);
+}
+
+static void
+history_get_im_timestamp (ChattyHistory *self,
+                          GTask         *task)
+{
+  sqlite3_stmt *stmt;
+  const char *uuid, *account;
+  int status, timestamp = INT_MAX;
+  CHATTY_TRACE_SPAN (G_STRFUNC);
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+
+  uuid = g_object_get_data (G_OBJECT (task), "uuid");
+  account = g_object_get_data (G_OBJECT (task), "account");
+
+  sqlite3_prepare_v2 (self->db, "SELECT time FROM messages "
+                      "INNER JOIN threads "
+                      "ON threads.account_id=accounts.id "
+                      "INNER JOIN accounts "
+                      "ON accounts.user_id=users.id "
+                      "INNER JOIN users "
+                      "ON users.id=accounts.user_id AND users.username=? "
+                      "WHERE messages.uid=? LIMIT 1",
+                      -1, &stmt, NULL);
+  history_bind_text (stmt, 1, account, "binding when getting timestamp");
+  history_bind_text (stmt, 2, uuid, "binding when getting timestamp");
+
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    timestamp = sqlite3_column_int (stmt, 0);
+
+  status = sqlite3_finalize (stmt);
+  warn_if_sql_error (status, "finalizing when getting timestamp");
+
+  g_task_return_int (task, timestamp);
+}
+
+static void
+history_get_uids (ChattyHistory *self,
+                  GTask         *task)
+{
+  GHashTable *uids;
+  sqlite3_stmt *stmt;
+  const char *account, *room;
+  gint64 since;
+  int status;
+  CHATTY_TRACE_SPAN (G_STRFUNC);
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  if (!self->db) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Database not opened");
+    return;
+  }
+
+  account = g_object_get_data (G_OBJECT (task), "account");
+  room = g_object_get_data (G_OBJECT (task), "room");
+  since = *(gint64 *)g_object_get_data (G_OBJECT (task), "since");
+  g_assert (account);
+
+  sqlite3_prepare_v2 (self->db,
+                      "SELECT messages.uid FROM messages "
+                      "INNER JOIN threads "
+                      "ON threads.id=messages.thread_id "
+                      "AND (?2 IS NULL OR threads.name=?2) "
+                      "INNER JOIN accounts "
+                      "ON accounts.id=threads.account_id "
+                      "INNER JOIN users "
+                      "ON users.id=accounts.user_id AND users.username=?1 "
+                      "WHERE messages.time>=?3",
+                      -1, &stmt, NULL);
+  history_bind_text (stmt, 1, account, "binding when getting uids");
+  history_bind_text (stmt, 2, room, "binding when getting uids");
+  sqlite3_bind_int64 (stmt, 3, since);
+
+  uids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  while ((status = sqlite3_step (stmt)) == SQLITE_ROW)
+    g_hash_table_add (uids, g_strdup ((const char *)sqlite3_column_text (stmt, 0)));
+
+  sqlite3_finalize (stmt);
+
+  if (status == SQLITE_DONE)
+    g_task_return_pointer (task, uids, (GDestroyNotify)g_hash_table_unref);
+  else {
+    g_hash_table_unref (uids);
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Failed to get message uids. errno: %d, desc: %s",
+                             status, sqlite3_errmsg (self->db));
+  }
+}
+
+static void
+history_get_last_message_time (ChattyHistory *self,
+                               GTask         *task)
+{
+  sqlite3_stmt *stmt;
+  const char *account, *room;
+  int status, timestamp = 0;
+  CHATTY_TRACE_SPAN (G_STRFUNC);
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+
+  account = g_object_get_data (G_OBJECT (task), "account");
+  room = g_object_get_data (G_OBJECT (task), "room");
+
+  status = sqlite3_prepare_v2 (self->db,
+                               "SELECT max(time),messages.id FROM messages "
+                               "INNER JOIN threads "
+                               "ON threads.name=? AND messages.thread_id=threads.id "
+                               "INNER JOIN accounts "
+                               "ON accounts.id=threads.account_id "
+                               "INNER JOIN users "
+                               "ON users.id=accounts.user_id AND users.username=? "
+                               "ORDER BY messages.id DESC LIMIT 1;",
+                               -1, &stmt, NULL);
+  history_bind_text (stmt, 1, room, "binding when getting timestamp");
+  history_bind_text (stmt, 2, account, "binding when getting timestamp");
+
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    timestamp = sqlite3_column_int (stmt, 0);
+
+  status = sqlite3_finalize (stmt);
+  warn_if_sql_error (status, "finalizing when getting timestamp");
+
+  g_task_return_int (task, timestamp);
+}
+
+static void
+history_get_last_message_times (ChattyHistory *self,
+                                GTask         *task)
+{
+  GHashTable *rooms;
+  sqlite3_stmt *stmt;
+  const char *account;
+  int status;
+  CHATTY_TRACE_SPAN (G_STRFUNC);
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  if (!self->db) {
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Database not opened");
+    return;
+  }
+
+  account = g_object_get_data (G_OBJECT (task), "account");
+  g_assert (account);
+
+  sqlite3_prepare_v2 (self->db,
+                      "SELECT threads.name,max(messages.time) FROM messages "
+                      "INNER JOIN threads "
+                      "ON messages.thread_id=threads.id "
+                      "INNER JOIN accounts "
+                      "ON accounts.id=threads.account_id "
+                      "INNER JOIN users "
+                      "ON users.id=accounts.user_id AND users.username=? "
+                      "GROUP BY threads.id;",
+                      -1, &stmt, NULL);
+  history_bind_text (stmt, 1, account, "binding when getting timestamps");
 
-  while (sqlite3_step (stmt) == SQLITE_ROW) {
-    ChattyFileInfo *file = NULL, *preview = NULL;
-    ChattyMessage *message;
-    const char *msg = NULL, *uid;
-    const char *who = NULL;
-    ChattyMsgType type;
-    guint time_stamp;
-    int direction;
+  rooms = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
-    uid = (const char *)sqlite3_column_text (stmt, 3);
+  while ((status = sqlite3_step (stmt)) == SQLITE_ROW) {
+    const char *name;
+    int time_stamp;
 
-    /* Skip until we pass the last message already in chat.
-     * This can happen as we load all messages with time <= message,
-     * which is required as there can be multiple messages with
-     * same timestamp.
-     */
-    if (skip && start) {
-      if (g_strcmp0 (uid, chatty_message_get_uid (start)) == 0)
-        skip = FALSE;
-      continue;
-    }
+    name = (const char *)sqlite3_column_text (stmt, 0);
+    time_stamp = sqlite3_column_int (stmt, 1);
 
-    if (!messages)
-      messages = g_ptr_array_new_full (30, g_object_unref);
+    /* The same name may be used as both IM and group chat */
+    if (name && time_stamp > GPOINTER_TO_INT (g_hash_table_lookup (rooms, name)))
+      g_hash_table_insert (rooms, g_strdup (name), GINT_TO_POINTER (time_stamp));
+  }
 
-    time_stamp = sqlite3_column_int (stmt, 0);
-    direction = sqlite3_column_int (stmt, 1);
-    type = history_value_to_message_type (sqlite3_column_int (stmt, 5));
-
-    /* preview is not limitted to media messages */
-    if (sqlite3_column_text (stmt, 16)) {
-      preview = g_new0 (ChattyFileInfo, 1);
-      preview->file_name = g_strdup ((const char *)sqlite3_column_text (stmt, 15));
-      preview->url = g_strdup ((const char *)sqlite3_column_text (stmt, 16));
-      preview->path = g_strdup ((const char *)sqlite3_column_text (stmt, 17));
-      preview->mime_type = g_strdup ((const char *)sqlite3_column_text (stmt, 18));
-      preview->size = sqlite3_column_int (stmt, 19);
-      preview->status = sqlite3_column_int (stmt, 20);
-      preview->width = sqlite3_column_int (stmt, 21);
-      preview->height = sqlite3_column_int (stmt, 22);
-      preview->duration = sqlite3_column_int (stmt, 23);
-    }
+  sqlite3_finalize (stmt);
 
-    if (sqlite3_column_text (stmt, 7)) {
-      file = g_new0 (ChattyFileInfo, 1);
-      file->file_name = g_strdup ((const char *)sqlite3_column_text (stmt, 6));
-      file->url = g_strdup ((const char *)sqlite3_column_text (stmt, 7));
-      file->path = g_strdup ((const char *)sqlite3_column_text (stmt, 8));
-      file->mime_type = g_strdup ((const char *)sqlite3_column_text (stmt, 9));
-      file->size = sqlite3_column_int (stmt, 10);
-      file->status = sqlite3_column_int (stmt, 11);
-      file->width = sqlite3_column_int (stmt, 12);
-      file->height = sqlite3_column_int (stmt, 13);
-      file->duration = sqlite3_column_int (stmt, 14);
-    }
-    else
-      msg = (const char *)sqlite3_column_text (stmt, 2);
+  if (status == SQLITE_DONE) {
+    g_task_return_pointer (task, rooms, (GDestroyNotify)g_hash_table_unref);
+  } else {
+    g_hash_table_unref (rooms);
+    g_task_return_new_error (task,
+                             G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Failed to get message times. errno: %d, desc: %s",
+                             status, sqlite3_errmsg (self->db));
+  }
+}
+
+static void
+history_exists (ChattyHistory *self,
+                GTask         *task)
+{
+  sqlite3_stmt *stmt;
+  const char *account, *who, *room;
+  int status;
+  gboolean found = FALSE;
+  CHATTY_TRACE_SPAN (G_STRFUNC);
 
-    if (!chatty_chat_is_im (chat) || CHATTY_IS_MA_CHAT (chat))
-      who = (const char *)sqlite3_column_text (stmt, 4);
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
 
-    status = sqlite3_column_int (stmt, 24);
+  account = g_object_get_data (G_OBJECT (task), "account");
+  room = g_object_get_data (G_OBJECT (task), "room");
+  who = g_object_get_data (G_OBJECT (task), "who");
 
-    {
-      g_autoptr(ChattyContact) contact = NULL;
-
-      contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
-      chatty_contact_set_name (contact, who);
-      chatty_contact_set_value (contact, who);
-      message = chatty_message_new (CHATTY_ITEM (contact), msg, uid, time_stamp, type,
-                                    history_direction_from_value (direction),
-                                    history_msg_status_from_value (status));
-    }
+  g_assert (account);
+  g_assert (room || who);
 
-    chatty_message_set_files (message, g_list_append (NULL, file));
-    chatty_message_set_preview (message, preview);
-    g_ptr_array_insert (messages, 0, message);
-  }
+  sqlite3_prepare_v2 (self->db,
+                      "SELECT time FROM messages "
+                      "INNER JOIN threads "
+                      "ON threads.name=? "
+                      "INNER JOIN accounts "
+                      "ON threads.account_id=accounts.id "
+                      "INNER JOIN users "
+                      "ON users.id=accounts.user_id AND users.username=? "
+                      "WHERE messages.thread_id=threads.id LIMIT 1;",
+                      -1, &stmt, NULL);
+
+  if (room)
+    history_bind_text (stmt, 1, room, "binding when getting timestamp");
+  else
+    history_bind_text (stmt, 1, who, "binding when getting timestamp");
+
+  history_bind_text (stmt, 2, account, "binding when getting timestamp");
+
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    found = TRUE;
 
   status = sqlite3_finalize (stmt);
-  warn_if_sql_error (status, "finalizing when getting messages");
+  warn_if_sql_error (status, "finalizing when getting timestamp");
 
-  return messages;
+  g_task_return_boolean (task, found);
 }
 
 static void
-history_get_messages (ChattyHistory *self,
-                      GTask         *task)
+history_backup_db (ChattyHistory *self,
+                   GTask         *task)
 {
-  GPtrArray *messages;
-  ChattyMessage *start;
-  ChattyChat *chat;
-  guint limit;
-  int thread_id, since = INT_MAX;
+  ChattyDbBackup *backup;
+  GError *error = NULL;
+  guint n_keep;
+  gboolean compress;
+  CHATTY_TRACE_SPAN (G_STRFUNC);
 
   g_assert (CHATTY_IS_HISTORY (self));
   g_assert (G_IS_TASK (task));
   g_assert (g_thread_self () == self->worker_thread);
 
   if (!self->db) {
-    g_task_return_new_error (task,
-                             G_IO_ERROR, G_IO_ERROR_FAILED,
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_INITIALIZED,
                              "Database not opened");
     return;
   }
 
-  limit = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (task), "limit"));
-  start = g_object_get_data (G_OBJECT (task), "message");
-  chat  = g_object_get_data (G_OBJECT (task), "chat");
+  if (self->backup) {
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_PENDING,
+                             "A backup is already in progress");
+    return;
+  }
 
-  g_assert (limit != 0);
-  g_assert (!start || CHATTY_IS_MESSAGE (start));
-  g_assert (CHATTY_IS_CHAT (chat));
+  n_keep = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (task), "n-keep"));
+  compress = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (task), "compress"));
+  backup = chatty_db_backup_new (self->db, n_keep, compress, &error);
 
-  if (start)
-    since = chatty_message_get_time (start);
+  if (!backup) {
+    g_task_return_error (task, error);
+    return;
+  }
 
-  thread_id = get_thread_id (self, chat);
+  /* The pages are copied by the worker when there is nothing else to do */
+  self->backup = backup;
+  self->backup_task = g_object_ref (task);
+}
 
-  if (!thread_id) {
-    g_task_return_new_error (task,
-                             G_IO_ERROR, G_IO_ERROR_FAILED,
-                             "Couldn't find chat %s",
-                             chatty_chat_get_chat_name (chat));
+static void
+history_backup_step (ChattyHistory *self)
+{
+  GError *error = NULL;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (g_thread_self () == self->worker_thread);
+  g_assert (self->backup);
+
+  if (chatty_db_backup_step (self->backup, CHATTY_DB_BACKUP_STEP_PAGES, &error) &&
+      !chatty_db_backup_is_done (self->backup))
     return;
-  }
 
-  messages = get_messages_before_time (self, chat, start, thread_id, since, limit);
-  g_task_return_pointer (task, messages, (GDestroyNotify)g_ptr_array_unref);
+  if (error)
+    g_task_return_error (self->backup_task, error);
+  else
+    g_task_return_pointer (self->backup_task,
+                           g_strdup (chatty_db_backup_get_path (self->backup)),
+                           g_free);
+
+  g_clear_pointer (&self->backup, chatty_db_backup_free);
+  g_clear_object (&self->backup_task);
 }
 
-static int
-add_file_info (ChattyHistory  *self,
-               ChattyFileInfo *file)
+/* Add @thread_id to be trimmed as per @rule */
+static void
+history_add_retention_thread (ChattyHistory      *self,
+                              HistoryMaintenance *maintenance,
+                              RetentionRule      *rule,
+                              int                 thread_id)
 {
+  RetentionThread thread = { thread_id, 0 };
   sqlite3_stmt *stmt;
-  int file_id = 0, mime_id = 0;
-  int status;
 
   g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (g_thread_self () == self->worker_thread);
 
-  if (!file)
-    return 0;
+  if (rule->max_days)
+    thread.before = time (NULL) - (gint64)rule->max_days * 24 * 60 * 60;
 
-  if (file->mime_type) {
+  if (rule->max_messages) {
+    /* The time of the oldest message to keep */
     sqlite3_prepare_v2 (self->db,
-                        "INSERT OR IGNORE INTO mime_type(name) VALUES(?)",
+                        "SELECT time FROM messages WHERE thread_id=? "
+                        "ORDER BY time DESC LIMIT 1 OFFSET ?;",
                         -1, &stmt, NULL);
-    history_bind_text (stmt, 1, file->mime_type, "binding when getting timestamp");
-    sqlite3_step (stmt);
-    sqlite3_finalize (stmt);
+    history_bind_int (stmt, 1, thread_id, "binding when getting retention time");
+    history_bind_int (stmt, 2, rule->max_messages - 1, "binding when getting retention time");
 
-    sqlite3_prepare_v2 (self->db, "SELECT id FROM mime_type WHERE name=?" ,
-                        -1, &stmt, NULL);
-    history_bind_text (stmt, 1, file->mime_type, "binding when getting timestamp");
     if (sqlite3_step (stmt) == SQLITE_ROW)
-      mime_id = sqlite3_column_int (stmt, 0);
+      thread.before = MAX (thread.before, sqlite3_column_int64 (stmt, 0));
     sqlite3_finalize (stmt);
   }
 
-  if (file->status == CHATTY_FILE_DOWNLOADED)
-    status = FILE_STATUS_DOWNLOADED;
-  else if (file->status == CHATTY_FILE_DECRYPT_FAILED)
-    status = FILE_STATUS_DECRYPT_FAILED;
-  else if (file->status == CHATTY_FILE_MISSING)
-    status = FILE_STATUS_MISSING;
+  if (thread.before > 0)
+    g_array_append_val (maintenance->threads, thread);
+}
+
+static void
+history_add_retention_rules (ChattyHistory      *self,
+                             HistoryMaintenance *maintenance,
+                             GPtrArray          *rules)
+{
+  const ChattyProtocol protocols[] = {
+    CHATTY_PROTOCOL_SMS, CHATTY_PROTOCOL_MMS, CHATTY_PROTOCOL_XMPP,
+    CHATTY_PROTOCOL_MATRIX, CHATTY_PROTOCOL_TELEGRAM,
+  };
+  g_autoptr(GHashTable) chat_threads = NULL;
+  sqlite3_stmt *stmt;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  chat_threads = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  /* Rules for chats override the ones for protocols */
+  for (guint i = 0; i < rules->len; i++) {
+    RetentionRule *rule = rules->pdata[i];
+    int thread_id;
+
+    if (!rule->chat)
+      continue;
+
+    thread_id = get_thread_id (self, rule->chat);
+
+    if (!thread_id)
+      continue;
+
+    g_hash_table_add (chat_threads, GINT_TO_POINTER (thread_id));
+    history_add_retention_thread (self, maintenance, rule, thread_id);
+  }
+
+  for (guint i = 0; i < rules->len; i++) {
+    RetentionRule *rule = rules->pdata[i];
+
+    if (rule->chat)
+      continue;
+
+    for (guint j = 0; j < G_N_ELEMENTS (protocols); j++) {
+      if (!(rule->protocols & protocols[j]))
+        continue;
+
+      sqlite3_prepare_v2 (self->db,
+                          "SELECT threads.id FROM threads "
+                          "INNER JOIN accounts "
+                          "ON accounts.id=threads.account_id AND accounts.protocol=?;",
+                          -1, &stmt, NULL);
+      history_bind_int (stmt, 1, history_protocol_to_value (protocols[j]),
+                        "binding when getting retention threads");
+
+      while (sqlite3_step (stmt) == SQLITE_ROW) {
+        int thread_id = sqlite3_column_int (stmt, 0);
+
+        if (!g_hash_table_contains (chat_threads, GINT_TO_POINTER (thread_id)))
+          history_add_retention_thread (self, maintenance, rule, thread_id);
+      }
+
+      sqlite3_finalize (stmt);
+    }
+  }
+}
+
+static void
+history_maintain (ChattyHistory *self,
+                  GTask         *task)
+{
+  HistoryMaintenance *maintenance;
+  GPtrArray *rules;
+  CHATTY_TRACE_SPAN (G_STRFUNC);
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  if (!self->db) {
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_INITIALIZED,
+                             "Database not opened");
+    return;
+  }
+
+  if (self->maintenance) {
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_PENDING,
+                             "Maintenance is already in progress");
+    return;
+  }
+
+  maintenance = g_new0 (HistoryMaintenance, 1);
+  maintenance->task = g_object_ref (task);
+  maintenance->threads = g_array_new (FALSE, FALSE, sizeof (RetentionThread));
+  maintenance->cache_dir = g_strdup (g_object_get_data (G_OBJECT (task), "cache-dir"));
+
+  rules = g_object_get_data (G_OBJECT (task), "rules");
+  history_add_retention_rules (self, maintenance, rules);
+
+  /* The rows are deleted by the worker when there is nothing else to do */
+  self->maintenance = maintenance;
+}
+
+/* Returns %TRUE if there are more messages to delete */
+static gboolean
+history_maintain_retention (ChattyHistory      *self,
+                            HistoryMaintenance *maintenance)
+{
+  RetentionThread *thread;
+  sqlite3_stmt *stmt;
+  int status, n_changes;
+
+  if (maintenance->thread_index >= maintenance->threads->len)
+    return FALSE;
+
+  thread = &g_array_index (maintenance->threads, RetentionThread, maintenance->thread_index);
+
+  /* The last read message is kept as it's referred from threads */
+  sqlite3_prepare_v2 (self->db,
+                      "DELETE FROM messages WHERE id IN ("
+                      "SELECT id FROM messages WHERE thread_id=?1 AND time<?2 "
+                      "AND id NOT IN (SELECT last_read_id FROM threads "
+                      "WHERE last_read_id NOT NULL) "
+                      "LIMIT ?3);",
+                      -1, &stmt, NULL);
+  history_bind_int (stmt, 1, thread->thread_id, "binding when deleting old messages");
+  sqlite3_bind_int64 (stmt, 2, thread->before);
+  history_bind_int (stmt, 3, MAINTENANCE_CHUNK_ROWS, "binding when deleting old messages");
+  status = sqlite3_step (stmt);
+  sqlite3_finalize (stmt);
+
+  n_changes = sqlite3_changes (self->db);
+
+  if (status != SQLITE_DONE) {
+    g_warning ("Error deleting old messages: %s", sqlite3_errmsg (self->db));
+    n_changes = 0;
+  }
+
+  maintenance->n_messages += n_changes;
+
+  if (n_changes < MAINTENANCE_CHUNK_ROWS)
+    maintenance->thread_index++;
+
+  return TRUE;
+}
+
+/* Returns %TRUE if there are more files to delete */
+static gboolean
+history_maintain_files (ChattyHistory      *self,
+                        HistoryMaintenance *maintenance)
+{
+  g_autoptr(GPtrArray) paths = NULL;
+  g_autoptr(GString) ids = NULL;
+  g_autofree char *sql = NULL;
+  sqlite3_stmt *stmt;
+  int status;
+
+  /* Files not referred from any row, found once */
+  if (!maintenance->orphans_found) {
+    status = sqlite3_exec (self->db,
+                           "CREATE TEMP TABLE orphan_files AS "
+                           "SELECT id,path FROM files WHERE "
+                           "id NOT IN (SELECT CAST(body AS INTEGER) FROM messages "
+                           "WHERE body_type>=" STRING (MESSAGE_TYPE_FILE) " "
+                           "AND body_type<=" STRING (MESSAGE_TYPE_AUDIO) " "
+                           "AND body NOT NULL) "
+                           "AND id NOT IN (SELECT preview_id FROM messages WHERE preview_id NOT NULL) "
+                           "AND id NOT IN (SELECT avatar_id FROM users WHERE avatar_id NOT NULL) "
+                           "AND id NOT IN (SELECT avatar_id FROM threads WHERE avatar_id NOT NULL);",
+                           NULL, NULL, NULL);
+
+    if (status != SQLITE_OK) {
+      g_warning ("Error finding unused files: %s", sqlite3_errmsg (self->db));
+      return FALSE;
+    }
+
+    maintenance->orphans_found = TRUE;
+  }
+
+  ids = g_string_new (NULL);
+  paths = g_ptr_array_new_with_free_func (g_free);
+
+  sqlite3_prepare_v2 (self->db, "SELECT id,path FROM temp.orphan_files LIMIT ?;",
+                      -1, &stmt, NULL);
+  history_bind_int (stmt, 1, MAINTENANCE_CHUNK_ROWS, "binding when getting unused files");
+
+  while (sqlite3_step (stmt) == SQLITE_ROW) {
+    const char *path = (const char *)sqlite3_column_text (stmt, 1);
+
+    g_string_append_printf (ids, "%s%d", ids->len ? "," : "", sqlite3_column_int (stmt, 0));
+
+    /* Only delete files within the cache.  Files in media store
+     * may be shared, and are removed once no longer referred */
+    if (path && *path && !g_path_is_absolute (path) && !strstr (path, "..") &&
+        !chatty_media_store_is_blob (path))
+      g_ptr_array_add (paths, g_build_filename (maintenance->cache_dir, path, NULL));
+  }
+  sqlite3_finalize (stmt);
+
+  if (!ids->len) {
+    sqlite3_exec (self->db,
+                  "DROP TABLE temp.orphan_files;"
+                  "DELETE FROM image WHERE file_id NOT IN (SELECT id FROM files);"
+                  "DELETE FROM video WHERE file_id NOT IN (SELECT id FROM files);"
+                  "DELETE FROM audio WHERE file_id NOT IN (SELECT id FROM files);",
+                  NULL, NULL, NULL);
+    return FALSE;
+  }
+
+  sql = g_strdup_printf ("BEGIN TRANSACTION;"
+                         "DELETE FROM image WHERE file_id IN (%1$s);"
+                         "DELETE FROM video WHERE file_id IN (%1$s);"
+                         "DELETE FROM audio WHERE file_id IN (%1$s);"
+                         "DELETE FROM files WHERE id IN (%1$s);"
+                         "DELETE FROM temp.orphan_files WHERE id IN (%1$s);"
+                         "COMMIT;", ids->str);
+  status = sqlite3_exec (self->db, sql, NULL, NULL, NULL);
+
+  if (status != SQLITE_OK) {
+    g_warning ("Error deleting unused files: %s", sqlite3_errmsg (self->db));
+    sqlite3_exec (self->db, "ROLLBACK; DROP TABLE temp.orphan_files;", NULL, NULL, NULL);
+    return FALSE;
+  }
+
+  for (guint i = 0; i < paths->len; i++)
+    if (g_remove (paths->pdata[i]) == 0)
+      maintenance->n_files++;
+
+  return TRUE;
+}
+
+/* Remove @hash from the media store, if it's no longer used */
+static void
+history_maintain_blob (ChattyHistory      *self,
+                       HistoryMaintenance *maintenance,
+                       sqlite3_stmt       *stmt,
+                       const char         *dir,
+                       const char         *hash)
+{
+  g_autofree char *path = NULL;
+  sqlite3_stmt *delete_stmt;
+  GStatBuf stat_buf;
+  gboolean used = FALSE;
+
+  path = g_build_filename (dir, hash, NULL);
+
+  if (g_lstat (path, &stat_buf) != 0 ||
+      g_get_real_time () / G_USEC_PER_SEC - stat_buf.st_mtime < MAINTENANCE_MEDIA_MIN_AGE)
+    return;
+
+  sqlite3_reset (stmt);
+  history_bind_text (stmt, 1, hash, "binding when checking media");
+
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    used = sqlite3_column_int (stmt, 0) > 0;
+
+  if (used || g_remove (path) != 0)
+    return;
+
+  maintenance->n_files++;
+  sqlite3_reset (stmt);
+  sqlite3_prepare_v2 (self->db, "DELETE FROM media_refs WHERE sha256=?;", -1, &delete_stmt, NULL);
+  history_bind_text (delete_stmt, 1, hash, "binding when removing media");
+  sqlite3_step (delete_stmt);
+  sqlite3_finalize (delete_stmt);
+}
+
+/* Returns %TRUE if there are more media store directories to check */
+static gboolean
+history_maintain_media (ChattyHistory      *self,
+                        HistoryMaintenance *maintenance)
+{
+  g_autoptr(GDir) dir = NULL;
+  g_autofree char *store_dir = NULL;
+  g_autofree char *path = NULL;
+  g_autofree char *name = NULL;
+  sqlite3_stmt *stmt;
+  const char *file_name;
+
+  /* 256 directories of files, the links from URLs, and partial files */
+  if (maintenance->media_index > 0xff + 2)
+    return FALSE;
+
+  if (maintenance->media_index <= 0xff)
+    name = g_strdup_printf ("%02x", maintenance->media_index);
+  else if (maintenance->media_index == 0xff + 1)
+    name = g_strdup ("url");
   else
-    status = 0;
+    name = g_strdup ("tmp");
 
-  sqlite3_prepare_v2 (self->db, "SELECT id FROM files WHERE url=?", -1, &stmt, NULL);
-  history_bind_text (stmt, 1, file->url, "binding when getting file");
-  if (sqlite3_step (stmt) == SQLITE_ROW)
-    file_id = sqlite3_column_int (stmt, 0);
-  sqlite3_finalize (stmt);
+  maintenance->media_index++;
+  store_dir = g_build_filename (maintenance->cache_dir, CHATTY_MEDIA_STORE_DIR, NULL);
+  path = g_build_filename (store_dir, name, NULL);
+  dir = g_dir_open (path, 0, NULL);
 
-  sqlite3_prepare_v2 (self->db,
-                      "INSERT INTO files(name,url,path,mime_type_id,size,status) "
-                      "VALUES(?1,?2,?3,?4,?5,?6) "
-                      "ON CONFLICT(url) DO UPDATE SET path=?3, size=?5, status=?6",
-                      -1, &stmt, NULL);
-  history_bind_text (stmt, 1, file->file_name, "binding when adding file");
-  history_bind_text (stmt, 2, file->url, "binding when adding file");
-  history_bind_text (stmt, 3, file->path, "binding when adding file");
-  if (mime_id)
-    history_bind_int (stmt, 4, mime_id, "binding when adding file");
-  if (file->size)
-    history_bind_int (stmt, 5, file->size, "binding when adding file");
-  if (status)
-    history_bind_int (stmt, 6, status, "binding when adding file");
-  sqlite3_step (stmt);
-  sqlite3_finalize (stmt);
+  if (!dir)
+    return TRUE;
 
-  if (file_id)
-    return file_id;
+  if (g_str_equal (name, "url")) {
+    /* Remove links to files that were removed */
+    while ((file_name = g_dir_read_name (dir))) {
+      g_autofree char *link_path = NULL;
 
-  file_id = sqlite3_last_insert_rowid (self->db);
+      link_path = g_build_filename (path, file_name, NULL);
 
-  if (file->mime_type &&
-      ((file->width && file->height) || file->duration)) {
-    if (g_str_has_prefix (file->mime_type, "video/"))
-      sqlite3_prepare_v2 (self->db,
-                          "INSERT INTO video(file_id,width,height,duration) "
-                          "VALUES(?1,?2,?3,?4)",
-                          -1, &stmt, NULL);
-    else if (g_str_has_prefix (file->mime_type, "image/"))
-      sqlite3_prepare_v2 (self->db,
-                          "INSERT INTO image(file_id,width,height) "
-                          "VALUES(?1,?2,?3)",
-                          -1, &stmt, NULL);
-    else if (g_str_has_prefix (file->mime_type, "audio/"))
-      sqlite3_prepare_v2 (self->db,
-                          "INSERT INTO audio(file_id,duration) "
-                          "VALUES(?1,?4)",
-                          -1, &stmt, NULL);
-    else
-      return file_id;
+      if (!g_file_test (link_path, G_FILE_TEST_EXISTS))
+        g_remove (link_path);
+    }
 
-    history_bind_int (stmt, 1, file_id, "binding when adding media");
-    if (file->width && !g_str_has_prefix (file->mime_type, "audio/"))
-      history_bind_int (stmt, 2, file->width, "binding when adding media");
-    if (file->height && !g_str_has_prefix (file->mime_type, "audio/"))
-      history_bind_int (stmt, 3, file->height, "binding when adding media");
-    if (file->duration && !g_str_has_prefix (file->mime_type, "image/"))
-      history_bind_int (stmt, 4, file->duration, "binding when adding media");
-    sqlite3_step (stmt);
-    sqlite3_finalize (stmt);
+    return TRUE;
   }
 
-  return file_id;
+  if (g_str_equal (name, "tmp")) {
+    /* Remove files left from interrupted downloads */
+    while ((file_name = g_dir_read_name (dir))) {
+      g_autofree char *tmp_path = NULL;
+      GStatBuf stat_buf;
+
+      tmp_path = g_build_filename (path, file_name, NULL);
+
+      if (g_lstat (tmp_path, &stat_buf) == 0 &&
+          g_get_real_time () / G_USEC_PER_SEC - stat_buf.st_mtime >= MAINTENANCE_MEDIA_MIN_AGE)
+        g_remove (tmp_path);
+    }
+
+    return TRUE;
+  }
+
+  sqlite3_prepare_v2 (self->db, "SELECT ref_count FROM media_refs WHERE sha256=?;",
+                      -1, &stmt, NULL);
+
+  while ((file_name = g_dir_read_name (dir)))
+    history_maintain_blob (self, maintenance, stmt, path, file_name);
+
+  sqlite3_finalize (stmt);
+
+  return TRUE;
 }
 
 static void
-history_add_message (ChattyHistory *self,
-                     GTask         *task)
+history_maintain_step (ChattyHistory *self)
 {
-  ChattyMessage *message;
-  ChattyChat *chat;
-  sqlite3_stmt *stmt;
-  const char *who, *uid, *msg, *alias;
-  ChattyMsgDirection direction;
-  ChattyMsgType type;
-  int thread_id = 0, sender_id = 0, file_id = 0, preview_id = 0;
-  int status, dir;
-  time_t time_stamp;
+  HistoryMaintenance *maintenance;
+  int status;
 
   g_assert (CHATTY_IS_HISTORY (self));
-  g_assert (G_IS_TASK (task));
   g_assert (g_thread_self () == self->worker_thread);
+  g_assert (self->maintenance);
 
-  if (!self->db) {
-    g_task_return_new_error (task,
-                             G_IO_ERROR, G_IO_ERROR_FAILED,
-                             "Database not opened");
+  maintenance = self->maintenance;
+
+  switch (maintenance->step) {
+  case MAINTENANCE_STEP_RETENTION:
+    if (!history_maintain_retention (self, maintenance))
+      maintenance->step++;
     return;
-  }
 
-  chat = g_object_get_data (G_OBJECT (task), "chat");
-  message = g_object_get_data (G_OBJECT (task), "message");
-  g_assert (CHATTY_IS_CHAT (chat));
-  g_assert (CHATTY_IS_MESSAGE (message));
+  case MAINTENANCE_STEP_FILES:
+    if (!history_maintain_files (self, maintenance))
+      maintenance->step++;
+    return;
 
-  who = chatty_message_get_user_name (message);
-  uid = chatty_message_get_uid (message);
-  msg = chatty_message_get_text (message);
-  time_stamp = chatty_message_get_time (message);
-  direction = chatty_message_get_msg_direction (message);
-  dir = history_direction_to_value (direction);
-  type = chatty_message_get_msg_type (message);
-  alias = chatty_message_get_user_alias (message);
+  case MAINTENANCE_STEP_MEDIA:
+    if (!history_maintain_media (self, maintenance))
+      maintenance->step++;
+    return;
 
-  if (direction == CHATTY_DIRECTION_OUT)
-    who = chatty_chat_get_username (chat);
+  case MAINTENANCE_STEP_VACUUM:
+    /* Free pages can be returned only with incremental vacuum */
+    if (history_get_pragma_int (self, "PRAGMA auto_vacuum;") != 2) {
+      history_enable_incremental_vacuum (self);
+      maintenance->step++;
+      return;
+    }
 
-  if ((!who || !*who) && direction == CHATTY_DIRECTION_IN && chatty_chat_is_im (chat))
-    who = chatty_chat_get_chat_name (chat);
+    status = sqlite3_exec (self->db,
+                           "PRAGMA incremental_vacuum(" STRING (MAINTENANCE_CHUNK_PAGES) ");",
+                           NULL, NULL, NULL);
+    warn_if_sql_error (status, "running incremental vacuum");
 
-  thread_id = insert_or_ignore_thread (self, chat, task);
-  if (!thread_id)
+    if (status != SQLITE_OK ||
+        history_get_pragma_int (self, "PRAGMA freelist_count;") == 0)
+      maintenance->step++;
     return;
 
-  sender_id = insert_or_ignore_user (self, chatty_item_get_protocols (CHATTY_ITEM (chat)), who, alias, task);
+  case MAINTENANCE_STEP_ANALYZE:
+    /* Sample only a few rows so that large databases are analyzed fast */
+    status = sqlite3_exec (self->db,
+                           "PRAGMA analysis_limit=" STRING (MAINTENANCE_ANALYSIS_LIMIT) ";"
+                           "ANALYZE;",
+                           NULL, NULL, NULL);
+    warn_if_sql_error (status, "analyzing database");
+    break;
 
-  if (sender_id && direction == CHATTY_DIRECTION_IN) {
-    sqlite3_prepare_v2 (self->db,
-                        "INSERT OR IGNORE INTO thread_members(thread_id,user_id) "
-                        "VALUES(?1,?2)",
-                        -1, &stmt, NULL);
-    history_bind_int (stmt, 1, thread_id, "binding when adding thread member");
-    history_bind_int (stmt, 2, sender_id, "binding when adding thread member");
-    sqlite3_step (stmt);
-    sqlite3_finalize (stmt);
+  default:
+    g_assert_not_reached ();
   }
 
-  if (type == CHATTY_MESSAGE_IMAGE ||
-      type == CHATTY_MESSAGE_AUDIO ||
-      type == CHATTY_MESSAGE_VIDEO ||
-      type == CHATTY_MESSAGE_FILE) {
-    GList *files = NULL;
+  g_debug ("Maintenance done, deleted %" G_GINT64_FORMAT " messages, %"
+           G_GINT64_FORMAT " cached files", maintenance->n_messages, maintenance->n_files);
+  g_task_return_boolean (maintenance->task, TRUE);
+  g_clear_pointer (&self->maintenance, history_maintenance_free);
+}
 
-    files = chatty_message_get_files (message);
-    preview_id = add_file_info (self, chatty_message_get_preview (message));
-    file_id = add_file_info (self, files ? files->data : NULL);
+/* Only files within the cache are copied */
+static void
+history_export_add_attachment (HistoryExport *export,
+                               const char    *path)
+{
+  if (!path || !*path || g_path_is_absolute (path) || strstr (path, ".."))
+    return;
+
+  g_ptr_array_add (export->files, g_strdup (path));
+}
+
+/*
+ * Copy the cached file at @path relative to @from into @to,
+ * unless it's already there.  Returns %TRUE if copied.
+ */
+static gboolean
+history_copy_attachment (const char   *from,
+                         const char   *to,
+                         const char   *path,
+                         GCancellable *cancellable)
+{
+  g_autoptr(GFile) source = NULL;
+  g_autoptr(GFile) target = NULL;
+  g_autoptr(GFile) parent = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *source_path = NULL;
+  g_autofree char *target_path = NULL;
+
+  source_path = g_build_filename (from, path, NULL);
+  target_path = g_build_filename (to, path, NULL);
+
+  if (!g_file_test (source_path, G_FILE_TEST_IS_REGULAR) ||
+      g_file_test (target_path, G_FILE_TEST_EXISTS))
+    return FALSE;
+
+  source = g_file_new_for_path (source_path);
+  target = g_file_new_for_path (target_path);
+  parent = g_file_get_parent (target);
+
+  if (!g_file_make_directory_with_parents (parent, NULL, &error) &&
+      !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_EXISTS)) {
+    g_warning ("Failed to create directory for %s: %s", path, error->message);
+    return FALSE;
   }
 
-  sqlite3_prepare_v2 (self->db,
-                      "INSERT INTO messages(uid,thread_id,sender_id,body,body_type,direction,time,preview_id,encrypted,status) "
-                      "VALUES(?1,?2,?3,"
-                      "CASE "
-                      "  WHEN ?5>="STRING (MESSAGE_TYPE_FILE) " AND ?5<="STRING (MESSAGE_TYPE_AUDIO) " "
-                      "  THEN ?8 "
-                      "  ELSE ?4 "
-                      "END,"
-                      "?5,?6,?7,?9,?10,?11) "
-                      "ON CONFLICT (uid,thread_id,body,time) DO UPDATE "
-                      "SET status=?11",
-                      -1, &stmt, NULL);
+  g_clear_error (&error);
 
-  history_bind_text (stmt, 1, uid, "binding when adding message");
-  history_bind_int (stmt, 2, thread_id, "binding when adding message");
-  if (sender_id)
-    history_bind_int (stmt, 3, sender_id, "binding when adding message");
-  history_bind_text (stmt, 4, msg, "binding when adding message");
-  history_bind_int (stmt, 5, history_message_type_to_value (type),
-                    "binding when adding message");
-  history_bind_int (stmt, 6, dir, "binding when adding message");
-  history_bind_int (stmt, 7, time_stamp, "binding when adding message");
-  if (file_id)
-    history_bind_int (stmt, 8, file_id, "binding when adding message");
-  if (preview_id)
-    history_bind_int (stmt, 9, preview_id, "binding when adding message");
-  history_bind_int (stmt, 10, chatty_message_get_encrypted (message),
-                    "binding when adding message");
-  status = history_msg_status_to_value (chatty_message_get_status (message));
-  if (status != MESSAGE_STATUS_UNKNOWN)
-    history_bind_int (stmt, 11, status, "binding when adding message");
+  if (!g_file_copy (source, target, G_FILE_COPY_NONE, cancellable, NULL, NULL, &error)) {
+    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      g_warning ("Failed to copy %s: %s", path, error->message);
+    return FALSE;
+  }
 
-  status = sqlite3_step (stmt);
-  sqlite3_finalize (stmt);
+  return TRUE;
+}
 
-  if (status == SQLITE_DONE)
-    g_task_return_boolean (task, TRUE);
-  else
-    g_task_return_new_error (task,
-                             G_IO_ERROR, G_IO_ERROR_FAILED,
-                             "Failed to save message. errno: %d, desc: %s",
-                             status, sqlite3_errmsg (self->db));
+static void
+history_export_add_string (JsonBuilder  *builder,
+                           const char   *member,
+                           sqlite3_stmt *stmt,
+                           int           column)
+{
+  if (sqlite3_column_type (stmt, column) == SQLITE_NULL)
+    return;
+
+  json_builder_set_member_name (builder, member);
+  json_builder_add_string_value (builder, (const char *)sqlite3_column_text (stmt, column));
 }
 
 static void
-history_get_chats (ChattyHistory *self,
-                   GTask         *task)
+history_export_add_int (JsonBuilder  *builder,
+                        const char   *member,
+                        sqlite3_stmt *stmt,
+                        int           column)
 {
-  GPtrArray *threads = NULL;
-  ChattyAccount *account;
+  if (sqlite3_column_type (stmt, column) == SQLITE_NULL)
+    return;
+
+  json_builder_set_member_name (builder, member);
+  json_builder_add_int_value (builder, sqlite3_column_int64 (stmt, column));
+}
+
+/* Add the file from the 9 columns starting at @column */
+static gboolean
+history_export_add_file (JsonBuilder  *builder,
+                         const char   *member,
+                         sqlite3_stmt *stmt,
+                         int           column)
+{
+  if (sqlite3_column_type (stmt, column + 1) == SQLITE_NULL)
+    return FALSE;
+
+  json_builder_set_member_name (builder, member);
+  json_builder_begin_object (builder);
+  history_export_add_string (builder, "name", stmt, column);
+  history_export_add_string (builder, "url", stmt, column + 1);
+  history_export_add_string (builder, "path", stmt, column + 2);
+  history_export_add_string (builder, "mime_type", stmt, column + 3);
+  history_export_add_int (builder, "size", stmt, column + 4);
+  history_export_add_int (builder, "status", stmt, column + 5);
+  history_export_add_int (builder, "width", stmt, column + 6);
+  history_export_add_int (builder, "height", stmt, column + 7);
+  history_export_add_int (builder, "duration", stmt, column + 8);
+  json_builder_end_object (builder);
+
+  return TRUE;
+}
+
+/* Write the current row of export->stmt as a line of JSON */
+static gboolean
+history_export_message (HistoryExport  *export,
+                        GError        **error)
+{
+  g_autoptr(JsonBuilder) builder = NULL;
+  g_autoptr(JsonNode) root = NULL;
+  g_autofree char *line = NULL;
+  GCancellable *cancellable;
   sqlite3_stmt *stmt;
-  const char *user_id;
-  int protocol, encrypted;
+  gsize length;
+  int body_type;
+
+  stmt = export->stmt;
+  body_type = sqlite3_column_int (stmt, 5);
+  builder = json_builder_new ();
+
+  /* The values are the ones saved in the database */
+  json_builder_begin_object (builder);
+  history_export_add_string (builder, "account", stmt, 35);
+  history_export_add_int (builder, "account_type", stmt, 36);
+  history_export_add_int (builder, "protocol", stmt, 37);
+  history_export_add_string (builder, "thread", stmt, 30);
+  history_export_add_string (builder, "thread_alias", stmt, 31);
+  history_export_add_int (builder, "thread_type", stmt, 32);
+  history_export_add_int (builder, "thread_encrypted", stmt, 33);
+  history_export_add_int (builder, "visibility", stmt, 34);
+  history_export_add_string (builder, "uid", stmt, 3);
+  history_export_add_string (builder, "sender", stmt, 26);
+  history_export_add_int (builder, "sender_type", stmt, 27);
+  history_export_add_string (builder, "alias", stmt, 28);
+  history_export_add_int (builder, "body_type", stmt, 5);
+  history_export_add_int (builder, "direction", stmt, 1);
+  history_export_add_int (builder, "time", stmt, 0);
+  history_export_add_int (builder, "status", stmt, 24);
+  history_export_add_int (builder, "encrypted", stmt, 29);
+
+  /* The body of media messages is the id of the file */
+  if (body_type < MESSAGE_TYPE_FILE || body_type > MESSAGE_TYPE_AUDIO)
+    history_export_add_string (builder, "body", stmt, 2);
+  else if (history_export_add_file (builder, "file", stmt, 6))
+    history_export_add_attachment (export, (const char *)sqlite3_column_text (stmt, 8));
+
+  if (history_export_add_file (builder, "preview", stmt, 15))
+    history_export_add_attachment (export, (const char *)sqlite3_column_text (stmt, 17));
+
+  json_builder_end_object (builder);
+
+  root = json_builder_get_root (builder);
+  json_generator_set_root (export->generator, root);
+  line = json_generator_to_data (export->generator, &length);
+  cancellable = g_task_get_cancellable (export->task);
+
+  if (!g_output_stream_write_all (export->stream, line, length, NULL, cancellable, error) ||
+      !g_output_stream_write_all (export->stream, "\n", 1, NULL, cancellable, error))
+    return FALSE;
+
+  export->n_messages++;
+
+  return TRUE;
+}
+
+static void
+history_export (ChattyHistory *self,
+                GTask         *task)
+{
+  g_autoptr(GFileOutputStream) stream = NULL;
+  g_autoptr(GFile) attachments = NULL;
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GError) error = NULL;
+  HistoryExport *export;
+  const char *dir;
+  int status;
+  CHATTY_TRACE_SPAN (G_STRFUNC);
 
   g_assert (CHATTY_IS_HISTORY (self));
   g_assert (G_IS_TASK (task));
   g_assert (g_thread_self () == self->worker_thread);
 
   if (!self->db) {
-    g_task_return_new_error (task,
-                             G_IO_ERROR, G_IO_ERROR_FAILED,
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_INITIALIZED,
                              "Database not opened");
     return;
   }
 
-  account = g_object_get_data (G_OBJECT (task), "account");
-  /* We currently handle only matrix accounts */
-  g_assert (CHATTY_IS_MA_ACCOUNT (account));
+  if (self->export) {
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_PENDING,
+                             "Export is already in progress");
+    return;
+  }
 
-  user_id = chatty_account_get_username (account);
-  protocol = PROTOCOL_MATRIX;
+  dir = g_object_get_data (G_OBJECT (task), "dir");
+  attachments = g_file_new_build_filename (dir, "attachments", NULL);
 
-  sqlite3_prepare_v2 (self->db,
-                      "SELECT threads.id,threads.name,threads.alias,threads.encrypted,"
-                      "files.url,files.path "
-                      "FROM threads "
-                      "INNER JOIN accounts ON accounts.id=threads.account_id "
-                      "INNER JOIN users ON users.id=accounts.user_id "
-                      "AND users.username=? AND accounts.protocol=? "
-                      "LEFT JOIN files ON threads.avatar_id=files.id "
-                      "WHERE visibility=" STRING(THREAD_VISIBILITY_VISIBLE),
-                      -1, &stmt, NULL);
-  history_bind_text (stmt, 1, user_id, "binding when getting threads");
-  history_bind_int (stmt, 2, protocol, "binding when getting threads");
+  if (!g_file_make_directory_with_parents (attachments, NULL, &error) &&
+      !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_EXISTS)) {
+    g_task_return_error (task, g_steal_pointer (&error));
+    return;
+  }
 
-  while (sqlite3_step (stmt) == SQLITE_ROW) {
-    g_autoptr(GPtrArray) messages = NULL;
-    ChattyFileInfo *file = NULL;
-    const char *name, *alias;
-    ChattyChat *chat;
-    int thread_id;
+  g_clear_error (&error);
+  file = g_file_new_build_filename (dir, "messages.jsonl", NULL);
+  stream = g_file_replace (file, NULL, FALSE, G_FILE_CREATE_PRIVATE,
+                           g_task_get_cancellable (task), &error);
 
-    if (!threads)
-      threads = g_ptr_array_new_full (30, g_object_unref);
+  if (!stream) {
+    g_task_return_error (task, g_steal_pointer (&error));
+    return;
+  }
 
-    thread_id = sqlite3_column_int (stmt, 0);
-    name = (const char *)sqlite3_column_text (stmt, 1);
-    alias = (const char *)sqlite3_column_text (stmt, 2);
-    encrypted = sqlite3_column_int (stmt, 3);
+  export = g_new0 (HistoryExport, 1);
+  export->task = g_object_ref (task);
+  export->stream = g_buffered_output_stream_new_sized (G_OUTPUT_STREAM (stream), 64 * 1024);
+  export->generator = json_generator_new ();
+  export->attachments_dir = g_file_get_path (attachments);
+  export->cache_dir = g_strdup (g_object_get_data (G_OBJECT (task), "cache-dir"));
+  export->files = g_ptr_array_new_with_free_func (g_free);
+
+  /* Paged by id so that the memory used doesn't depend on the history size */
+  status = sqlite3_prepare_v2 (self->db,
+                               "SELECT " HISTORY_MESSAGE_COLUMNS ","
+                               /*   25          26            27             28                 29 */
+                               "messages.id,users.username,users.type,messages.user_alias,messages.encrypted,"
+                               /*   30            31           32             33                 34 */
+                               "threads.name,threads.alias,threads.type,threads.encrypted,threads.visibility,"
+                               /*          35                      36                  37 */
+                               "account_users.username,account_users.type,accounts.protocol "
+                               "FROM messages "
+                               "INNER JOIN threads ON threads.id=messages.thread_id "
+                               "INNER JOIN accounts ON accounts.id=threads.account_id "
+                               "INNER JOIN users AS account_users ON account_users.id=accounts.user_id "
+                               HISTORY_MESSAGE_JOINS
+                               "WHERE messages.id>? "
+                               "ORDER BY messages.id LIMIT " STRING (EXPORT_CHUNK_ROWS) ";",
+                               -1, &export->stmt, NULL);
+
+  if (status != SQLITE_OK) {
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Failed to export messages. errno: %d, desc: %s",
+                             status, sqlite3_errmsg (self->db));
+    history_export_free (export);
+    return;
+  }
+
+  /* The messages are written by the worker when there is nothing else to do */
+  self->export = export;
+}
 
-    if (sqlite3_column_text (stmt, 4)) {
-      file = g_new0 (ChattyFileInfo, 1);
-      file->url = g_strdup ((const char *)sqlite3_column_text (stmt, 4));
-      file->path = g_strdup ((const char *)sqlite3_column_text (stmt, 5));
-    }
+/*
+ * Copying files can take long, so that's done in a thread
+ * of its own instead of blocking the history worker.
+ */
+static void
+history_export_copy_files (GTask        *task,
+                           gpointer      source_object,
+                           gpointer      task_data,
+                           GCancellable *cancellable)
+{
+  HistoryExport *export = task_data;
 
-    chat = (gpointer)chatty_ma_chat_new (name, alias, file);
-    chatty_chat_set_encryption (CHATTY_CHAT (chat), encrypted);
-    messages = get_messages_before_time (self, chat, NULL, thread_id, INT_MAX, 1);
-    chatty_ma_chat_add_messages (CHATTY_MA_CHAT (chat), messages);
+  for (guint i = 0; i < export->files->len; i++) {
+    if (g_task_return_error_if_cancelled (task))
+      return;
 
-    g_ptr_array_insert (threads, -1, chat);
+    if (history_copy_attachment (export->cache_dir, export->attachments_dir,
+                                 export->files->pdata[i], cancellable))
+      export->n_files++;
   }
 
-  sqlite3_finalize (stmt);
-  g_task_return_pointer (task, threads, (GDestroyNotify)g_ptr_array_unref);
+  g_debug ("Exported %" G_GINT64_FORMAT " messages, %" G_GINT64_FORMAT " files",
+           export->n_messages, export->n_files);
+  g_task_return_int (task, export->n_messages);
 }
 
 static void
-history_update_chat (ChattyHistory *self,
-                     GTask         *task)
+history_export_step (ChattyHistory *self)
 {
-  ChattyChat *chat;
+  g_autoptr(GError) error = NULL;
+  HistoryExport *export;
+  GTask *task;
+  int status = SQLITE_DONE;
+  guint n_rows = 0;
 
   g_assert (CHATTY_IS_HISTORY (self));
-  g_assert (G_IS_TASK (task));
   g_assert (g_thread_self () == self->worker_thread);
+  g_assert (self->export);
 
-  if (!self->db) {
-    g_task_return_new_error (task,
-                             G_IO_ERROR, G_IO_ERROR_FAILED,
-                             "Database not opened");
+  export = self->export;
+
+  if (g_task_return_error_if_cancelled (export->task)) {
+    g_clear_pointer (&self->export, history_export_free);
     return;
   }
 
-  chat = g_object_get_data (G_OBJECT (task), "chat");
-  g_assert (CHATTY_IS_CHAT (chat));
+  sqlite3_bind_int64 (export->stmt, 1, export->last_id);
 
-  if (insert_or_ignore_thread (self, chat, task))
-    g_task_return_boolean (task, TRUE);
+  while (!error && (status = sqlite3_step (export->stmt)) == SQLITE_ROW) {
+    export->last_id = sqlite3_column_int64 (export->stmt, 25);
+    history_export_message (export, &error);
+    n_rows++;
+  }
+
+  /* Don't keep the read transaction open between slices */
+  sqlite3_reset (export->stmt);
+
+  if (!error && status != SQLITE_DONE)
+    error = g_error_new (G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Failed to export messages. errno: %d, desc: %s",
+                         status, sqlite3_errmsg (self->db));
+
+  if (!error && n_rows == EXPORT_CHUNK_ROWS)
+    return;
+
+  if (!error)
+    g_output_stream_close (export->stream, g_task_get_cancellable (export->task), &error);
+
+  if (error) {
+    g_task_return_error (export->task, g_steal_pointer (&error));
+    g_clear_pointer (&self->export, history_export_free);
+    return;
+  }
+
+  /* The export is now owned by the task, which copies the files */
+  task = g_steal_pointer (&export->task);
+  g_clear_pointer (&export->stmt, sqlite3_finalize);
+  g_clear_object (&export->stream);
+  g_task_set_task_data (task, g_steal_pointer (&self->export),
+                        (GDestroyNotify)history_export_free);
+  g_task_run_in_thread (task, history_export_copy_files);
+  g_object_unref (task);
 }
 
-static void
-history_delete_chat (ChattyHistory *self,
-                     GTask         *task)
+/*
+ * Insert the row with @sql unless it exists and get its id with
+ * @select_sql.  ?1 is bound to @value, and ?2 to @text if set,
+ * @other_value otherwise.  @key is used to cache the id.
+ */
+static int
+history_import_get_id (ChattyHistory *self,
+                       HistoryImport *import,
+                       char          *key,
+                       const char    *sql,
+                       const char    *select_sql,
+                       int            value,
+                       int            other_value,
+                       const char    *text)
 {
-  ChattyChat *chat;
   sqlite3_stmt *stmt;
-  const char *account, *chat_name;
-  int status;
+  int id;
 
-  g_assert (CHATTY_IS_HISTORY (self));
-  g_assert (G_IS_TASK (task));
-  g_assert (g_thread_self () == self->worker_thread);
+  id = GPOINTER_TO_INT (g_hash_table_lookup (import->ids, key));
 
-  if (!self->db) {
-    g_task_return_new_error (task,
-                             G_IO_ERROR, G_IO_ERROR_FAILED,
-                             "Database not opened");
-    return;
+  if (id) {
+    g_free (key);
+    return id;
   }
 
-  chat = g_object_get_data (G_OBJECT (task), "chat");
-  g_assert (CHATTY_IS_CHAT (chat));
-
-  chat_name = chatty_chat_get_chat_name (chat);
+  for (guint i = 0; i < 2; i++) {
+    sqlite3_prepare_v2 (self->db, i == 0 ? sql : select_sql, -1, &stmt, NULL);
+    history_bind_int (stmt, 1, value, "binding when importing");
+    if (text)
+      history_bind_text (stmt, 2, text, "binding when importing");
+    else
+      history_bind_int (stmt, 2, other_value, "binding when importing");
 
-  if (!chat_name || !*chat_name) {
-    g_task_return_new_error (task,
-                             G_IO_ERROR, G_IO_ERROR_FAILED,
-                             "Error: chat name is empty");
-    return;
+    if (sqlite3_step (stmt) == SQLITE_ROW)
+      id = sqlite3_column_int (stmt, 0);
+    sqlite3_finalize (stmt);
   }
 
-  account = chatty_chat_get_username (chat);
+  if (id)
+    g_hash_table_insert (import->ids, key, GINT_TO_POINTER (id));
+  else
+    g_free (key);
 
-  status = sqlite3_prepare_v2 (self->db,
-                               "DELETE FROM threads "
-                               "WHERE threads.type=? AND threads.name=? "
-                               "AND threads.account_id IN ("
-                               "SELECT accounts.id FROM accounts "
-                               "INNER JOIN users "
-                               "ON accounts.id=threads.account_id "
-                               "AND users.id=accounts.user_id AND users.username=?);",
-                               -1, &stmt, NULL);
+  return id;
+}
 
-  history_bind_int (stmt, 1, chatty_chat_is_im (chat) ? THREAD_DIRECT_CHAT : THREAD_GROUP_CHAT,
-                    "binding when deleting thread");
-  history_bind_text (stmt, 2, chat_name, "binding when deleting thread");
-  history_bind_text (stmt, 3, account, "binding when deleting thread");
+static int
+history_import_user (ChattyHistory *self,
+                     HistoryImport *import,
+                     const char    *username,
+                     int            type)
+{
+  if (!username || !*username)
+    return 0;
 
-  status = sqlite3_step (stmt);
+  return history_import_get_id (self, import,
+                                g_strdup_printf ("u:%d:%s", type, username),
+                                "INSERT OR IGNORE INTO users(type,username) VALUES(?1,?2);",
+                                "SELECT id FROM users WHERE type=?1 AND username=?2;",
+                                type, 0, username);
+}
+
+static int
+history_import_thread (ChattyHistory *self,
+                       HistoryImport *import,
+                       JsonObject    *object)
+{
+  sqlite3_stmt *stmt;
+  const char *name;
+  int user_id, account_id, thread_id, type;
+  char *key;
+
+  name = matrix_utils_json_object_get_string (object, "thread");
+  user_id = history_import_user (self, import,
+                                 matrix_utils_json_object_get_string (object, "account"),
+                                 matrix_utils_json_object_get_int (object, "account_type"));
+
+  if (!user_id || !name || !*name)
+    return 0;
+
+  type = matrix_utils_json_object_get_int (object, "protocol");
+  account_id = history_import_get_id (self, import,
+                                      g_strdup_printf ("a:%d:%d", user_id, type),
+                                      "INSERT OR IGNORE INTO accounts(user_id,protocol) VALUES(?1,?2);",
+                                      "SELECT id FROM accounts WHERE user_id=?1 AND protocol=?2;",
+                                      user_id, type, NULL);
+  if (!account_id)
+    return 0;
+
+  type = matrix_utils_json_object_get_int (object, "thread_type");
+  key = g_strdup_printf ("t:%d:%d:%s", account_id, type, name);
+  thread_id = GPOINTER_TO_INT (g_hash_table_lookup (import->ids, key));
+
+  if (thread_id) {
+    g_free (key);
+    return thread_id;
+  }
+
+  /* Existing threads are left as is */
+  sqlite3_prepare_v2 (self->db,
+                      "INSERT OR IGNORE INTO threads(name,alias,account_id,type,encrypted,visibility) "
+                      "VALUES(?1,?2,?3,?4,?5,?6);",
+                      -1, &stmt, NULL);
+  history_bind_text (stmt, 1, name, "binding when importing thread");
+  history_bind_text (stmt, 2, matrix_utils_json_object_get_string (object, "thread_alias"),
+                     "binding when importing thread");
+  history_bind_int (stmt, 3, account_id, "binding when importing thread");
+  history_bind_int (stmt, 4, type, "binding when importing thread");
+  history_bind_int (stmt, 5, matrix_utils_json_object_get_int (object, "thread_encrypted"),
+                    "binding when importing thread");
+  history_bind_int (stmt, 6, matrix_utils_json_object_get_int (object, "visibility"),
+                    "binding when importing thread");
+  sqlite3_step (stmt);
   sqlite3_finalize (stmt);
 
-  if (status == SQLITE_DONE)
-    g_task_return_boolean (task, TRUE);
+  sqlite3_prepare_v2 (self->db,
+                      "SELECT id FROM threads WHERE name=?1 AND account_id=?2 AND type=?3;",
+                      -1, &stmt, NULL);
+  history_bind_text (stmt, 1, name, "binding when importing thread");
+  history_bind_int (stmt, 2, account_id, "binding when importing thread");
+  history_bind_int (stmt, 3, type, "binding when importing thread");
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    thread_id = sqlite3_column_int (stmt, 0);
+  sqlite3_finalize (stmt);
+
+  if (thread_id)
+    g_hash_table_insert (import->ids, key, GINT_TO_POINTER (thread_id));
   else
-    g_task_return_new_error (task,
-                             G_IO_ERROR, G_IO_ERROR_FAILED,
-                             "Failed to delete chat. errno: %d, desc: %s",
-                             status, sqlite3_errmsg (self->db));
+    g_free (key);
+
+  return thread_id;
 }
 
-static void
-history_get_chat_timestamp (ChattyHistory *self,
-                            GTask         *task)
+static int
+history_import_file (ChattyHistory *self,
+                     HistoryImport *import,
+                     JsonObject    *object)
 {
-  sqlite3_stmt *stmt;
-  const char *uuid, *room;
-  int status, timestamp = INT_MAX;
+  ChattyFileInfo file = { 0 };
+  g_autofree char *path = NULL;
 
-  g_assert (CHATTY_IS_HISTORY (self));
-  g_assert (G_IS_TASK (task));
+  if (!object)
+    return 0;
 
-  uuid = g_object_get_data (G_OBJECT (task), "uuid");
-  room = g_object_get_data (G_OBJECT (task), "room");
+  file.url = (char *)matrix_utils_json_object_get_string (object, "url");
 
-  g_assert (uuid);
-  g_assert (room);
+  if (!file.url || !*file.url)
+    return 0;
 
-  sqlite3_prepare_v2 (self->db, "SELECT time FROM messages "
-                      "INNER JOIN threads "
-                      "ON threads.name=? "
-                      "WHERE uid=? LIMIT 1;", -1, &stmt, NULL);
-  history_bind_text (stmt, 1, room, "binding when getting timestamp");
-  history_bind_text (stmt, 2, uuid, "binding when getting timestamp");
+  file.file_name = (char *)matrix_utils_json_object_get_string (object, "name");
+  file.path = (char *)matrix_utils_json_object_get_string (object, "path");
+  file.mime_type = (char *)matrix_utils_json_object_get_string (object, "mime_type");
+  file.size = matrix_utils_json_object_get_int (object, "size");
+  file.width = matrix_utils_json_object_get_int (object, "width");
+  file.height = matrix_utils_json_object_get_int (object, "height");
+  file.duration = matrix_utils_json_object_get_int (object, "duration");
+
+  switch (matrix_utils_json_object_get_int (object, "status")) {
+  case FILE_STATUS_DOWNLOADED:
+    file.status = CHATTY_FILE_DOWNLOADED;
+    break;
 
-  if (sqlite3_step (stmt) == SQLITE_ROW)
-    timestamp = sqlite3_column_int (stmt, 0);
+  case FILE_STATUS_MISSING:
+    file.status = CHATTY_FILE_MISSING;
+    break;
 
-  status = sqlite3_finalize (stmt);
-  warn_if_sql_error (status, "finalizing when getting timestamp");
+  case FILE_STATUS_DECRYPT_FAILED:
+    file.status = CHATTY_FILE_DECRYPT_FAILED;
+    break;
 
-  g_task_return_int (task, timestamp);
+  default:
+    file.status = CHATTY_FILE_UNKNOWN;
+  }
+
+  /* Attachments are added to the media store, so that files
+   * already saved aren't duplicated */
+  if (file.path && *file.path && !g_path_is_absolute (file.path) &&
+      !strstr (file.path, "..")) {
+    g_autoptr(GError) error = NULL;
+    g_autofree char *source_path = NULL;
+
+    source_path = g_build_filename (import->attachments_dir, file.path, NULL);
+
+    if (g_file_test (source_path, G_FILE_TEST_IS_REGULAR)) {
+      path = chatty_media_store_add_file (source_path, file.url, &error);
+
+      if (error)
+        g_warning ("Failed to add %s to media store: %s", file.path, error->message);
+      else
+        file.path = path;
+    }
+  }
+
+  return add_file_info (self, &file);
 }
 
-static void
-history_get_im_timestamp (ChattyHistory *self,
-                          GTask         *task)
+/* Returns %FALSE if @line is not a valid message */
+static gboolean
+history_import_message (ChattyHistory *self,
+                        HistoryImport *import,
+                        const char    *line,
+                        gsize          length)
 {
+  JsonObject *object;
+  JsonNode *root;
   sqlite3_stmt *stmt;
-  const char *uuid, *account;
-  int status, timestamp = INT_MAX;
+  const char *uid, *body;
+  int thread_id, sender_id, file_id = 0, preview_id, body_type, direction;
 
-  g_assert (CHATTY_IS_HISTORY (self));
-  g_assert (G_IS_TASK (task));
+  if (!json_parser_load_from_data (import->parser, line, length, NULL))
+    return FALSE;
 
-  uuid = g_object_get_data (G_OBJECT (task), "uuid");
-  account = g_object_get_data (G_OBJECT (task), "account");
+  root = json_parser_get_root (import->parser);
 
-  sqlite3_prepare_v2 (self->db, "SELECT time FROM messages "
-                      "INNER JOIN threads "
-                      "ON threads.account_id=accounts.id "
-                      "INNER JOIN accounts "
-                      "ON accounts.user_id=users.id "
-                      "INNER JOIN users "
-                      "ON users.id=accounts.user_id AND users.username=? "
-                      "WHERE messages.uid=? LIMIT 1",
-                      -1, &stmt, NULL);
-  history_bind_text (stmt, 1, account, "binding when getting timestamp");
-  history_bind_text (stmt, 2, uuid, "binding when getting timestamp");
+  if (!root || !JSON_NODE_HOLDS_OBJECT (root))
+    return FALSE;
 
-  if (sqlite3_step (stmt) == SQLITE_ROW)
-    timestamp = sqlite3_column_int (stmt, 0);
+  object = json_node_get_object (root);
+  uid = matrix_utils_json_object_get_string (object, "uid");
+  body = matrix_utils_json_object_get_string (object, "body");
+  body_type = matrix_utils_json_object_get_int (object, "body_type");
+  direction = matrix_utils_json_object_get_int (object, "direction");
 
-  status = sqlite3_finalize (stmt);
-  warn_if_sql_error (status, "finalizing when getting timestamp");
+  if (!uid || !*uid)
+    return FALSE;
 
-  g_task_return_int (task, timestamp);
+  if (body_type >= MESSAGE_TYPE_FILE && body_type <= MESSAGE_TYPE_AUDIO) {
+    file_id = history_import_file (self, import,
+                                   matrix_utils_json_object_get_object (object, "file"));
+    if (!file_id)
+      return FALSE;
+  } else if (!body) {
+    return FALSE;
+  }
+
+  thread_id = history_import_thread (self, import, object);
+
+  if (!thread_id)
+    return FALSE;
+
+  sender_id = history_import_user (self, import,
+                                   matrix_utils_json_object_get_string (object, "sender"),
+                                   matrix_utils_json_object_get_int (object, "sender_type"));
+  preview_id = history_import_file (self, import,
+                                    matrix_utils_json_object_get_object (object, "preview"));
+
+  /* See history_insert_message() */
+  if (sender_id && direction == history_direction_to_value (CHATTY_DIRECTION_IN)) {
+    char *key;
+
+    key = g_strdup_printf ("m:%d:%d", thread_id, sender_id);
+
+    if (!g_hash_table_contains (import->ids, key)) {
+      sqlite3_prepare_v2 (self->db,
+                          "INSERT OR IGNORE INTO thread_members(thread_id,user_id) "
+                          "VALUES(?1,?2)",
+                          -1, &stmt, NULL);
+      history_bind_int (stmt, 1, thread_id, "binding when importing thread member");
+      history_bind_int (stmt, 2, sender_id, "binding when importing thread member");
+      sqlite3_step (stmt);
+      sqlite3_finalize (stmt);
+      g_hash_table_insert (import->ids, key, GINT_TO_POINTER (1));
+    } else {
+      g_free (key);
+    }
+  }
+
+  stmt = import->stmt;
+  history_bind_text (stmt, 1, uid, "binding when importing message");
+  history_bind_int (stmt, 2, thread_id, "binding when importing message");
+  if (sender_id)
+    history_bind_int (stmt, 3, sender_id, "binding when importing message");
+  history_bind_text (stmt, 4, matrix_utils_json_object_get_string (object, "alias"),
+                     "binding when importing message");
+  if (file_id)
+    history_bind_int (stmt, 5, file_id, "binding when importing message");
+  else
+    history_bind_text (stmt, 5, body, "binding when importing message");
+  history_bind_int (stmt, 6, body_type, "binding when importing message");
+  history_bind_int (stmt, 7, direction, "binding when importing message");
+  sqlite3_bind_int64 (stmt, 8, matrix_utils_json_object_get_int (object, "time"));
+  if (json_object_has_member (object, "status"))
+    history_bind_int (stmt, 9, matrix_utils_json_object_get_int (object, "status"),
+                      "binding when importing message");
+  history_bind_int (stmt, 10, matrix_utils_json_object_get_int (object, "encrypted"),
+                    "binding when importing message");
+  if (preview_id)
+    history_bind_int (stmt, 11, preview_id, "binding when importing message");
+
+  if (sqlite3_step (stmt) == SQLITE_DONE)
+    import->n_messages += sqlite3_changes (self->db);
+  else
+    g_warning ("Failed to import message: %s", sqlite3_errmsg (self->db));
+
+  sqlite3_reset (stmt);
+  sqlite3_clear_bindings (stmt);
+
+  return TRUE;
 }
 
 static void
-history_get_last_message_time (ChattyHistory *self,
-                               GTask         *task)
+history_import (ChattyHistory *self,
+                GTask         *task)
 {
-  sqlite3_stmt *stmt;
-  const char *account, *room;
-  int status, timestamp = 0;
+  g_autoptr(GFileInputStream) stream = NULL;
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GError) error = NULL;
+  HistoryImport *import;
+  const char *dir;
+  int status;
+  CHATTY_TRACE_SPAN (G_STRFUNC);
 
   g_assert (CHATTY_IS_HISTORY (self));
   g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
 
-  account = g_object_get_data (G_OBJECT (task), "account");
-  room = g_object_get_data (G_OBJECT (task), "room");
+  if (!self->db) {
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_INITIALIZED,
+                             "Database not opened");
+    return;
+  }
 
-  status = sqlite3_prepare_v2 (self->db,
-                               "SELECT max(time),messages.id FROM messages "
-                               "INNER JOIN threads "
-                               "ON threads.name=? AND messages.thread_id=threads.id "
-                               "INNER JOIN accounts "
-                               "ON accounts.id=threads.account_id "
-                               "INNER JOIN users "
-                               "ON users.id=accounts.user_id AND users.username=? "
-                               "ORDER BY messages.id DESC LIMIT 1;",
-                               -1, &stmt, NULL);
-  history_bind_text (stmt, 1, room, "binding when getting timestamp");
-  history_bind_text (stmt, 2, account, "binding when getting timestamp");
+  if (self->import) {
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_PENDING,
+                             "Import is already in progress");
+    return;
+  }
 
-  if (sqlite3_step (stmt) == SQLITE_ROW)
-    timestamp = sqlite3_column_int (stmt, 0);
+  dir = g_object_get_data (G_OBJECT (task), "dir");
+  file = g_file_new_build_filename (dir, "messages.jsonl", NULL);
+  stream = g_file_read (file, g_task_get_cancellable (task), &error);
 
-  status = sqlite3_finalize (stmt);
-  warn_if_sql_error (status, "finalizing when getting timestamp");
+  if (!stream) {
+    g_task_return_error (task, g_steal_pointer (&error));
+    return;
+  }
 
-  g_task_return_int (task, timestamp);
+  import = g_new0 (HistoryImport, 1);
+  import->task = g_object_ref (task);
+  import->stream = g_data_input_stream_new (G_INPUT_STREAM (stream));
+  g_buffered_input_stream_set_buffer_size (G_BUFFERED_INPUT_STREAM (import->stream), 64 * 1024);
+  import->parser = json_parser_new ();
+  import->ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  import->attachments_dir = g_build_filename (dir, "attachments", NULL);
+  import->cache_dir = g_strdup (g_object_get_data (G_OBJECT (task), "cache-dir"));
+
+  /* Messages already in the thread are skipped, whatever their content */
+  status = sqlite3_prepare_v2 (self->db,
+                               "INSERT OR IGNORE INTO messages(uid,thread_id,sender_id,user_alias,body,"
+                               "body_type,direction,time,status,encrypted,preview_id) "
+                               "SELECT ?1,?2,?3,?4,?5,?6,?7,?8,?9,?10,?11 "
+                               "WHERE NOT EXISTS (SELECT 1 FROM messages WHERE uid=?1 AND thread_id=?2);",
+                               -1, &import->stmt, NULL);
+
+  if (status != SQLITE_OK) {
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Failed to import messages. errno: %d, desc: %s",
+                             status, sqlite3_errmsg (self->db));
+    history_import_free (import);
+    return;
+  }
+
+  /* The messages are read by the worker when there is nothing else to do */
+  self->import = import;
 }
 
 static void
-history_exists (ChattyHistory *self,
-                GTask         *task)
+history_import_step (ChattyHistory *self)
 {
-  sqlite3_stmt *stmt;
-  const char *account, *who, *room;
+  g_autoptr(GError) error = NULL;
+  HistoryImport *import;
+  gboolean done = FALSE;
   int status;
-  gboolean found = FALSE;
 
   g_assert (CHATTY_IS_HISTORY (self));
-  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+  g_assert (self->import);
 
-  account = g_object_get_data (G_OBJECT (task), "account");
-  room = g_object_get_data (G_OBJECT (task), "room");
-  who = g_object_get_data (G_OBJECT (task), "who");
+  import = self->import;
 
-  g_assert (account);
-  g_assert (room || who);
+  if (g_task_return_error_if_cancelled (import->task)) {
+    g_clear_pointer (&self->import, history_import_free);
+    return;
+  }
 
-  sqlite3_prepare_v2 (self->db,
-                      "SELECT time FROM messages "
-                      "INNER JOIN threads "
-                      "ON threads.name=? "
-                      "INNER JOIN accounts "
-                      "ON threads.account_id=accounts.id "
-                      "INNER JOIN users "
-                      "ON users.id=accounts.user_id AND users.username=? "
-                      "WHERE messages.thread_id=threads.id LIMIT 1;",
-                      -1, &stmt, NULL);
+  /* A transaction for each slice, as committing each row is slow */
+  sqlite3_exec (self->db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
 
-  if (room)
-    history_bind_text (stmt, 1, room, "binding when getting timestamp");
-  else
-    history_bind_text (stmt, 1, who, "binding when getting timestamp");
+  for (guint i = 0; i < IMPORT_CHUNK_ROWS; i++) {
+    g_autofree char *line = NULL;
+    gsize length;
 
-  history_bind_text (stmt, 2, account, "binding when getting timestamp");
+    line = g_data_input_stream_read_line (import->stream, &length,
+                                          g_task_get_cancellable (import->task),
+                                          &error);
+    if (!line) {
+      done = TRUE;
+      break;
+    }
 
-  if (sqlite3_step (stmt) == SQLITE_ROW)
-    found = TRUE;
+    import->n_lines++;
 
-  status = sqlite3_finalize (stmt);
-  warn_if_sql_error (status, "finalizing when getting timestamp");
+    if (length && !history_import_message (self, import, line, length))
+      import->n_skipped++;
+  }
 
-  g_task_return_boolean (task, found);
+  status = sqlite3_exec (self->db, "COMMIT;", NULL, NULL, NULL);
+
+  if (status != SQLITE_OK) {
+    if (!error)
+      error = g_error_new (G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Failed to import messages. errno: %d, desc: %s",
+                           status, sqlite3_errmsg (self->db));
+    sqlite3_exec (self->db, "ROLLBACK;", NULL, NULL, NULL);
+  }
+
+  if (!done && !error)
+    return;
+
+  if (error) {
+    g_task_return_error (import->task, g_steal_pointer (&error));
+  } else {
+    if (import->n_skipped)
+      g_warning ("Skipped %" G_GINT64_FORMAT " invalid lines on import", import->n_skipped);
+
+    g_debug ("Imported %" G_GINT64_FORMAT " new messages from %" G_GINT64_FORMAT " lines",
+             import->n_messages, import->n_lines);
+    g_task_return_int (import->task, import->n_messages);
+  }
+
+  g_clear_pointer (&self->import, history_import_free);
+}
+
+/* Run a slice of the background work, the most important first */
+static void
+history_run_idle_step (ChattyHistory *self)
+{
+  if (self->migration) {
+    CHATTY_TRACE_SPAN ("history_migrate_chunk");
+    history_migrate_chunk (self);
+  } else if (self->backup) {
+    CHATTY_TRACE_SPAN ("history_backup_step");
+    history_backup_step (self);
+  } else if (self->import) {
+    CHATTY_TRACE_SPAN ("history_import_step");
+    history_import_step (self);
+  } else if (self->export) {
+    CHATTY_TRACE_SPAN ("history_export_step");
+    history_export_step (self);
+  } else if (self->maintenance) {
+    CHATTY_TRACE_SPAN ("history_maintain_step");
+    history_maintain_step (self);
+  }
 }
 
 static gpointer
@@ -2561,10 +5121,24 @@ chatty_history_worker (gpointer user_data)
 
   g_assert (CHATTY_IS_HISTORY (self));
 
-  while ((task = g_async_queue_pop (self->queue))) {
+  while (TRUE) {
     ChattyCallback callback;
 
-    g_assert (task);
+    /* Old history is migrated, backups are copied, history is
+     * exported or imported and old data is cleaned up only when
+     * there is nothing else to do */
+    if (self->migration || self->backup || self->maintenance ||
+        self->export || self->import)
+      task = g_async_queue_try_pop (self->queue);
+    else
+      task = g_async_queue_pop (self->queue);
+
+    if (!task) {
+      history_run_idle_step (self);
+      continue;
+    }
+
+    chatty_trace_counter ("history-queue", g_async_queue_length (self->queue));
     callback = g_task_get_task_data (task);
     callback (self, task);
     g_object_unref (task);
@@ -2576,6 +5150,25 @@ chatty_history_worker (gpointer user_data)
   return NULL;
 }
 
+static void
+chatty_history_get_property (GObject    *object,
+                             guint       prop_id,
+                             GValue     *value,
+                             GParamSpec *pspec)
+{
+  ChattyHistory *self = (ChattyHistory *)object;
+
+  switch (prop_id)
+    {
+    case PROP_MIGRATION_PROGRESS:
+      g_value_set_double (value, self->migration_progress);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    }
+}
+
 static void
 chatty_history_dispose (GObject *object)
 {
@@ -2595,6 +5188,8 @@ chatty_history_finalize (GObject *object)
     g_warning ("Database not closed");
 
   g_clear_pointer (&self->queue, g_async_queue_unref);
+  g_hash_table_unref (self->last_times);
+  g_ptr_array_unref (self->retention_rules);
   g_free (self->db_path);
 
   G_OBJECT_CLASS (chatty_history_parent_class)->finalize (object);
@@ -2605,14 +5200,56 @@ chatty_history_class_init (ChattyHistoryClass *klass)
 {
   GObjectClass *object_class = G_OBJECT_CLASS (klass);
 
+  object_class->get_property = chatty_history_get_property;
   object_class->dispose  = chatty_history_dispose;
   object_class->finalize = chatty_history_finalize;
+
+  /**
+   * ChattyHistory:migration-progress:
+   *
+   * The fraction of old history migrated to the current
+   * database version, 1.0 if no migration is in progress.
+   */
+  properties[PROP_MIGRATION_PROGRESS] =
+    g_param_spec_double ("migration-progress",
+                         "Migration progress",
+                         "The fraction of old history migrated",
+                         0.0, 1.0, 1.0,
+                         G_PARAM_READABLE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class, N_PROPS, properties);
 }
 
 static void
 chatty_history_init (ChattyHistory *self)
 {
   self->queue = g_async_queue_new ();
+  self->migration_progress = 1.0;
+  self->migration_chunk_rows = MIGRATION_CHUNK_ROWS;
+  self->last_times = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                            (GDestroyNotify)last_times_free);
+  self->retention_rules = g_ptr_array_new_with_free_func ((GDestroyNotify)retention_rule_free);
+}
+
+/*
+ * chatty_history_set_migration_chunk_rows:
+ * @self: a #ChattyHistory
+ * @n_rows: The number of rows, at least 1
+ *
+ * Set the number of rows of old history tables migrated in
+ * each slice.  This is meant for tests, to migrate small
+ * databases in several slices.  Should be called before
+ * opening the database.
+ */
+void
+chatty_history_set_migration_chunk_rows (ChattyHistory *self,
+                                         guint          n_rows)
+{
+  g_return_if_fail (CHATTY_IS_HISTORY (self));
+  g_return_if_fail (n_rows > 0);
+  g_return_if_fail (!self->db);
+
+  self->migration_chunk_rows = n_rows;
 }
 
 /**
@@ -2711,12 +5348,378 @@ chatty_history_open_finish (ChattyHistory  *self,
  * Returns: %TRUE if a database is open.
  * %FALSE otherwise.
  */
-gboolean
-chatty_history_is_open (ChattyHistory *self)
+gboolean
+chatty_history_is_open (ChattyHistory *self)
+{
+  g_return_val_if_fail (CHATTY_IS_HISTORY (self), FALSE);
+
+  return !!self->db;
+}
+
+/**
+ * chatty_history_get_migration_progress:
+ * @self: a #ChattyHistory
+ *
+ * Get the fraction of old history migrated.  When
+ * opening a database from an old version, messages
+ * are migrated in background after the database is
+ * opened, which may take a while for large histories.
+ *
+ * Returns: A value between 0.0 and 1.0, 1.0 if no
+ * migration is in progress.
+ */
+double
+chatty_history_get_migration_progress (ChattyHistory *self)
+{
+  g_return_val_if_fail (CHATTY_IS_HISTORY (self), 1.0);
+
+  return self->migration_progress;
+}
+
+/**
+ * chatty_history_backup_async:
+ * @self: a #ChattyHistory
+ * @n_keep: The number of backups to keep, 0 to keep all
+ * @compress: Whether to compress the backup
+ * @callback: a #GAsyncReadyCallback, or %NULL
+ * @user_data: closure data for @callback
+ *
+ * Create a backup of the open database next to it.
+ * The database is copied a few pages at a time when
+ * there is nothing else to do, so that other queries
+ * are not blocked.  Only the newest @n_keep backups
+ * are kept.  @compress is ignored if chatty is built
+ * without zstd.
+ *
+ * Complete with chatty_history_backup_finish() to get
+ * the result.
+ */
+void
+chatty_history_backup_async (ChattyHistory       *self,
+                             guint                n_keep,
+                             gboolean             compress,
+                             GAsyncReadyCallback  callback,
+                             gpointer             user_data)
+{
+  GTask *task;
+
+  g_return_if_fail (CHATTY_IS_HISTORY (self));
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_backup_async);
+  g_task_set_task_data (task, history_backup_db, NULL);
+  g_object_set_data (G_OBJECT (task), "n-keep", GUINT_TO_POINTER (n_keep));
+  g_object_set_data (G_OBJECT (task), "compress", GINT_TO_POINTER (!!compress));
+
+  g_async_queue_push (self->queue, task);
+}
+
+/**
+ * chatty_history_backup_finish:
+ * @self: a #ChattyHistory
+ * @result: a #GAsyncResult provided to callback
+ * @error: a location for a #GError or %NULL
+ *
+ * Completes a backup started with
+ * chatty_history_backup_async().
+ *
+ * Returns: (transfer full): The path of the backup
+ * created, or %NULL on error with @error set.
+ */
+char *
+chatty_history_backup_finish (ChattyHistory  *self,
+                              GAsyncResult   *result,
+                              GError        **error)
+{
+  g_return_val_if_fail (CHATTY_IS_HISTORY (self), NULL);
+  g_return_val_if_fail (G_IS_TASK (result), NULL);
+  g_return_val_if_fail (!error || !*error, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+history_set_retention (ChattyHistory  *self,
+                       ChattyProtocol  protocols,
+                       ChattyChat     *chat,
+                       guint           max_days,
+                       guint           max_messages)
+{
+  RetentionRule *rule;
+
+  for (guint i = 0; i < self->retention_rules->len; i++) {
+    rule = self->retention_rules->pdata[i];
+
+    if (rule->chat == chat && (chat || rule->protocols == protocols)) {
+      g_ptr_array_remove_index (self->retention_rules, i);
+      break;
+    }
+  }
+
+  if (!max_days && !max_messages)
+    return;
+
+  rule = g_new0 (RetentionRule, 1);
+  rule->protocols = protocols;
+  g_set_object (&rule->chat, chat);
+  rule->max_days = max_days;
+  rule->max_messages = max_messages;
+  g_ptr_array_add (self->retention_rules, rule);
+}
+
+/**
+ * chatty_history_set_retention:
+ * @self: a #ChattyHistory
+ * @protocols: The #ChattyProtocol flags the rule applies to
+ * @max_days: The number of days to keep messages, or 0
+ * @max_messages: The number of messages to keep per chat, or 0
+ *
+ * Set how long messages of chats with @protocols are kept.
+ * Messages older than @max_days and the ones beyond the
+ * latest @max_messages in every chat are deleted on the
+ * next chatty_history_maintain_async().  Rules set with
+ * chatty_history_set_chat_retention() take precedence.
+ *
+ * If both @max_days and @max_messages are 0, the rule
+ * for @protocols is removed.
+ */
+void
+chatty_history_set_retention (ChattyHistory  *self,
+                              ChattyProtocol  protocols,
+                              guint           max_days,
+                              guint           max_messages)
+{
+  g_return_if_fail (CHATTY_IS_HISTORY (self));
+  g_return_if_fail (protocols != CHATTY_PROTOCOL_NONE);
+
+  history_set_retention (self, protocols, NULL, max_days, max_messages);
+}
+
+/**
+ * chatty_history_set_chat_retention:
+ * @self: a #ChattyHistory
+ * @chat: a #ChattyChat
+ * @max_days: The number of days to keep messages, or 0
+ * @max_messages: The number of messages to keep, or 0
+ *
+ * Same as chatty_history_set_retention(), but
+ * only for @chat.
+ */
+void
+chatty_history_set_chat_retention (ChattyHistory *self,
+                                   ChattyChat    *chat,
+                                   guint          max_days,
+                                   guint          max_messages)
+{
+  g_return_if_fail (CHATTY_IS_HISTORY (self));
+  g_return_if_fail (CHATTY_IS_CHAT (chat));
+
+  history_set_retention (self, CHATTY_PROTOCOL_NONE, chat, max_days, max_messages);
+}
+
+/**
+ * chatty_history_maintain_async:
+ * @self: a #ChattyHistory
+ * @callback: a #GAsyncReadyCallback, or %NULL
+ * @user_data: closure data for @callback
+ *
+ * Delete messages as per the retention rules set,
+ * delete files no longer referred and their cached
+ * copies, remove unused files from the media store,
+ * return the free space to the file system and update
+ * the statistics used by the query planner.
+ *
+ * The work is done in small slices when there is
+ * nothing else to do, so that other queries are not
+ * blocked.
+ *
+ * Complete with chatty_history_maintain_finish() to
+ * get the result.
+ */
+void
+chatty_history_maintain_async (ChattyHistory       *self,
+                               GAsyncReadyCallback  callback,
+                               gpointer             user_data)
+{
+  GPtrArray *rules;
+  GTask *task;
+
+  g_return_if_fail (CHATTY_IS_HISTORY (self));
+
+  /* The rules are copied so that they aren't modified in the worker */
+  rules = g_ptr_array_new_full (self->retention_rules->len,
+                                (GDestroyNotify)retention_rule_free);
+
+  for (guint i = 0; i < self->retention_rules->len; i++)
+    g_ptr_array_add (rules, retention_rule_copy (self->retention_rules->pdata[i]));
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_maintain_async);
+  g_task_set_task_data (task, history_maintain, NULL);
+  g_object_set_data_full (G_OBJECT (task), "rules", rules,
+                          (GDestroyNotify)g_ptr_array_unref);
+  g_object_set_data_full (G_OBJECT (task), "cache-dir",
+                          g_build_filename (g_get_user_cache_dir (), "chatty", NULL),
+                          g_free);
+
+  g_async_queue_push (self->queue, task);
+}
+
+/**
+ * chatty_history_maintain_finish:
+ * @self: a #ChattyHistory
+ * @result: a #GAsyncResult provided to callback
+ * @error: a location for a #GError or %NULL
+ *
+ * Completes a call to chatty_history_maintain_async().
+ *
+ * Returns: %TRUE if maintenance completed,
+ * %FALSE otherwise with @error set.
+ */
+gboolean
+chatty_history_maintain_finish (ChattyHistory  *self,
+                                GAsyncResult   *result,
+                                GError        **error)
+{
+  g_return_val_if_fail (CHATTY_IS_HISTORY (self), FALSE);
+  g_return_val_if_fail (G_IS_TASK (result), FALSE);
+  g_return_val_if_fail (!error || !*error, FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/**
+ * chatty_history_export_async:
+ * @self: a #ChattyHistory
+ * @dir: The directory to export to
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback, or %NULL
+ * @user_data: closure data for @callback
+ *
+ * Export all messages to @dir as `messages.jsonl`,
+ * with a JSON object per line.  The cached files
+ * of the messages are copied to `attachments`
+ * within @dir in a separate thread once all
+ * messages are written.
+ *
+ * The messages are written in small slices when
+ * there is nothing else to do, and the memory used
+ * doesn't depend on the number of messages.
+ *
+ * Complete with chatty_history_export_finish() to
+ * get the result.
+ */
+void
+chatty_history_export_async (ChattyHistory       *self,
+                             const char          *dir,
+                             GCancellable        *cancellable,
+                             GAsyncReadyCallback  callback,
+                             gpointer             user_data)
+{
+  GTask *task;
+
+  g_return_if_fail (CHATTY_IS_HISTORY (self));
+  g_return_if_fail (dir && *dir);
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_export_async);
+  g_task_set_task_data (task, history_export, NULL);
+  g_object_set_data_full (G_OBJECT (task), "dir", g_strdup (dir), g_free);
+  g_object_set_data_full (G_OBJECT (task), "cache-dir",
+                          g_build_filename (g_get_user_cache_dir (), "chatty", NULL),
+                          g_free);
+
+  g_async_queue_push (self->queue, task);
+}
+
+/**
+ * chatty_history_export_finish:
+ * @self: a #ChattyHistory
+ * @result: a #GAsyncResult provided to callback
+ * @error: a location for a #GError or %NULL
+ *
+ * Completes a call to chatty_history_export_async().
+ *
+ * Returns: The number of messages exported,
+ * or -1 with @error set.
+ */
+gint64
+chatty_history_export_finish (ChattyHistory  *self,
+                              GAsyncResult   *result,
+                              GError        **error)
+{
+  g_return_val_if_fail (CHATTY_IS_HISTORY (self), -1);
+  g_return_val_if_fail (G_IS_TASK (result), -1);
+  g_return_val_if_fail (!error || !*error, -1);
+
+  return g_task_propagate_int (G_TASK (result), error);
+}
+
+/**
+ * chatty_history_import_async:
+ * @self: a #ChattyHistory
+ * @dir: The directory to import from
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback, or %NULL
+ * @user_data: closure data for @callback
+ *
+ * Import messages from @dir, as exported with
+ * chatty_history_export_async().  Messages with
+ * the same uid already in the chat are skipped,
+ * so the same directory can be imported again.
+ *
+ * The messages are saved in batches when there
+ * is nothing else to do.
+ *
+ * Complete with chatty_history_import_finish() to
+ * get the result.
+ */
+void
+chatty_history_import_async (ChattyHistory       *self,
+                             const char          *dir,
+                             GCancellable        *cancellable,
+                             GAsyncReadyCallback  callback,
+                             gpointer             user_data)
+{
+  GTask *task;
+
+  g_return_if_fail (CHATTY_IS_HISTORY (self));
+  g_return_if_fail (dir && *dir);
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_import_async);
+  g_task_set_task_data (task, history_import, NULL);
+  g_object_set_data_full (G_OBJECT (task), "dir", g_strdup (dir), g_free);
+  g_object_set_data_full (G_OBJECT (task), "cache-dir",
+                          g_build_filename (g_get_user_cache_dir (), "chatty", NULL),
+                          g_free);
+
+  g_async_queue_push (self->queue, task);
+}
+
+/**
+ * chatty_history_import_finish:
+ * @self: a #ChattyHistory
+ * @result: a #GAsyncResult provided to callback
+ * @error: a location for a #GError or %NULL
+ *
+ * Completes a call to chatty_history_import_async().
+ *
+ * Returns: The number of new messages saved,
+ * or -1 with @error set.
+ */
+gint64
+chatty_history_import_finish (ChattyHistory  *self,
+                              GAsyncResult   *result,
+                              GError        **error)
 {
-  g_return_val_if_fail (CHATTY_IS_HISTORY (self), FALSE);
+  g_return_val_if_fail (CHATTY_IS_HISTORY (self), -1);
+  g_return_val_if_fail (G_IS_TASK (result), -1);
+  g_return_val_if_fail (!error || !*error, -1);
 
-  return !!self->db;
+  return g_task_propagate_int (G_TASK (result), error);
 }
 
 /**
@@ -2861,6 +5864,10 @@ chatty_history_add_message_async (ChattyHistory       *self,
   g_return_if_fail (CHATTY_IS_CHAT (chat));
   g_return_if_fail (CHATTY_IS_MESSAGE (message));
 
+  history_set_last_time (self, chatty_chat_get_username (chat),
+                         chatty_chat_get_chat_name (chat),
+                         chatty_message_get_time (message));
+
   task = g_task_new (self, NULL, callback, user_data);
   g_task_set_source_tag (task, chatty_history_add_message_async);
   g_task_set_task_data (task, history_add_message, NULL);
@@ -2893,6 +5900,253 @@ chatty_history_add_message_finish  (ChattyHistory  *self,
   return g_task_propagate_boolean (G_TASK (result), error);
 }
 
+/**
+ * chatty_history_add_messages_async:
+ * @self: a #ChattyHistory
+ * @chats: A #GPtrArray of #ChattyChat
+ * @messages: A #GPtrArray of #ChattyMessage
+ * @callback: a #GAsyncReadyCallback, or %NULL
+ * @user_data: closure data for @callback
+ *
+ * Store all @messages to database in a single
+ * transaction, the message at an index belongs
+ * to the chat at the same index in @chats.
+ * Either all or none of the messages are saved.
+ */
+void
+chatty_history_add_messages_async (ChattyHistory       *self,
+                                   GPtrArray           *chats,
+                                   GPtrArray           *messages,
+                                   GAsyncReadyCallback  callback,
+                                   gpointer             user_data)
+{
+  GTask *task;
+
+  g_return_if_fail (CHATTY_IS_HISTORY (self));
+  g_return_if_fail (chats && messages);
+  g_return_if_fail (chats->len == messages->len);
+
+  for (guint i = 0; i < messages->len; i++)
+    history_set_last_time (self, chatty_chat_get_username (chats->pdata[i]),
+                           chatty_chat_get_chat_name (chats->pdata[i]),
+                           chatty_message_get_time (messages->pdata[i]));
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_add_messages_async);
+  g_task_set_task_data (task, history_add_messages, NULL);
+  g_object_set_data_full (G_OBJECT (task), "chats",
+                          g_ptr_array_ref (chats),
+                          (GDestroyNotify)g_ptr_array_unref);
+  g_object_set_data_full (G_OBJECT (task), "messages",
+                          g_ptr_array_ref (messages),
+                          (GDestroyNotify)g_ptr_array_unref);
+
+  g_async_queue_push (self->queue, task);
+}
+
+/**
+ * chatty_history_add_messages_finish:
+ * @self: a #ChattyHistory
+ * @result: a #GAsyncResult provided to callback
+ * @error: a location for a #GError or %NULL
+ *
+ * Completes chatty_history_add_messages_async() call.
+ *
+ * Returns: %TRUE if saving messages succeeded.  %FALSE
+ * otherwise with @error set.
+ */
+gboolean
+chatty_history_add_messages_finish (ChattyHistory  *self,
+                                    GAsyncResult   *result,
+                                    GError        **error)
+{
+  g_return_val_if_fail (CHATTY_IS_HISTORY (self), FALSE);
+  g_return_val_if_fail (G_IS_TASK (result), FALSE);
+  g_return_val_if_fail (!error || !*error, FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+history_last_times_loaded_cb (GObject      *object,
+                              GAsyncResult *result,
+                              gpointer      user_data)
+{
+  ChattyHistory *self = (ChattyHistory *)object;
+  g_autoptr(GTask) task = user_data;
+  g_autoptr(GHashTable) rooms = NULL;
+  LastTimes *last_times;
+  GHashTableIter iter;
+  gpointer key, value;
+  GError *error = NULL;
+  const char *account;
+
+  g_assert (CHATTY_IS_HISTORY (self));
+  g_assert (G_IS_TASK (task));
+
+  account = g_task_get_task_data (task);
+  rooms = g_task_propagate_pointer (G_TASK (result), &error);
+
+  if (error) {
+    /* Let lookups fall back to the database */
+    g_hash_table_remove (self->last_times, account);
+    g_task_return_error (task, error);
+    return;
+  }
+
+  /* Messages added meanwhile are already tracked, keep the newer time */
+  g_hash_table_iter_init (&iter, rooms);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    history_set_last_time (self, account, key, GPOINTER_TO_INT (value));
+
+  last_times = history_get_last_times (self, account, FALSE);
+  last_times->loaded = TRUE;
+  g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * chatty_history_load_last_message_times_async:
+ * @self: a #ChattyHistory
+ * @account: The account name
+ * @callback: a #GAsyncReadyCallback, or %NULL
+ * @user_data: closure data for @callback
+ *
+ * Load the last message time of every chat of @account
+ * with a single query.  Once loaded, the times are kept
+ * up to date as messages are added, and
+ * chatty_history_get_last_message_time() no longer
+ * hits the database for @account.
+ */
+void
+chatty_history_load_last_message_times_async (ChattyHistory       *self,
+                                              const char          *account,
+                                              GAsyncReadyCallback  callback,
+                                              gpointer             user_data)
+{
+  GTask *task, *load_task;
+
+  g_return_if_fail (CHATTY_IS_HISTORY (self));
+  g_return_if_fail (account && *account);
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_load_last_message_times_async);
+  g_task_set_task_data (task, g_strdup (account), g_free);
+
+  /* Already loaded, or the pending load is queued before this */
+  if (history_get_last_times (self, account, FALSE)) {
+    g_task_return_boolean (task, TRUE);
+    g_object_unref (task);
+    return;
+  }
+
+  history_get_last_times (self, account, TRUE);
+
+  load_task = g_task_new (self, NULL, history_last_times_loaded_cb, task);
+  g_task_set_task_data (load_task, history_get_last_message_times, NULL);
+  g_object_set_data_full (G_OBJECT (load_task), "account", g_strdup (account), g_free);
+
+  g_async_queue_push (self->queue, load_task);
+}
+
+/**
+ * chatty_history_load_last_message_times_finish:
+ * @self: a #ChattyHistory
+ * @result: a #GAsyncResult provided to callback
+ * @error: a location for a #GError or %NULL
+ *
+ * Completes chatty_history_load_last_message_times_async() call.
+ *
+ * Returns: %TRUE if the times were loaded.  %FALSE
+ * otherwise with @error set.
+ */
+gboolean
+chatty_history_load_last_message_times_finish (ChattyHistory  *self,
+                                               GAsyncResult   *result,
+                                               GError        **error)
+{
+  g_return_val_if_fail (CHATTY_IS_HISTORY (self), FALSE);
+  g_return_val_if_fail (G_IS_TASK (result), FALSE);
+  g_return_val_if_fail (!error || !*error, FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/**
+ * chatty_history_get_uids_async:
+ * @self: a #ChattyHistory
+ * @account: The account name
+ * @room: (nullable): The chat name
+ * @since: A UNIX timestamp
+ * @callback: a #GAsyncReadyCallback, or %NULL
+ * @user_data: closure data for @callback
+ *
+ * Get the uids of all messages of @account since
+ * @since.  If @room is not %NULL, only the messages
+ * in the chat @room are considered.
+ */
+void
+chatty_history_get_uids_async (ChattyHistory       *self,
+                               const char          *account,
+                               const char          *room,
+                               gint64               since,
+                               GAsyncReadyCallback  callback,
+                               gpointer             user_data)
+{
+  GTask *task;
+  gint64 *time_stamp;
+
+  g_return_if_fail (CHATTY_IS_HISTORY (self));
+  g_return_if_fail (account && *account);
+
+  time_stamp = g_new (gint64, 1);
+  *time_stamp = since;
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_get_uids_async);
+  g_task_set_task_data (task, history_get_uids, NULL);
+  g_object_set_data_full (G_OBJECT (task), "account", g_strdup (account), g_free);
+  g_object_set_data_full (G_OBJECT (task), "room", g_strdup (room), g_free);
+  g_object_set_data_full (G_OBJECT (task), "since", time_stamp, g_free);
+
+  g_async_queue_push (self->queue, task);
+}
+
+/**
+ * chatty_history_get_uids_finish:
+ * @self: a #ChattyHistory
+ * @result: a #GAsyncResult provided to callback
+ * @error: a location for a #GError or %NULL
+ *
+ * Completes chatty_history_get_uids_async() call.
+ *
+ * Returns: (transfer full): A #GHashTable set of
+ * message uids or %NULL with @error set.
+ */
+GHashTable *
+chatty_history_get_uids_finish (ChattyHistory  *self,
+                                GAsyncResult   *result,
+                                GError        **error)
+{
+  g_return_val_if_fail (CHATTY_IS_HISTORY (self), NULL);
+  g_return_val_if_fail (G_IS_TASK (result), NULL);
+  g_return_val_if_fail (!error || !*error, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+/**
+ * chatty_history_get_chats_async:
+ * @self: a #ChattyHistory
+ * @account: a #ChattyAccount
+ * @callback: a #GAsyncReadyCallback, or %NULL
+ * @user_data: closure data for @callback
+ *
+ * Get all visible chats of @account with their last
+ * message, unread count and avatar.  @account should
+ * be a #ChattyMaAccount, chats of other accounts are
+ * owned by libpurple, use
+ * chatty_history_get_last_messages_async() for them.
+ */
 void
 chatty_history_get_chats_async (ChattyHistory       *self,
                                 ChattyAccount       *account,
@@ -2902,11 +6156,7 @@ chatty_history_get_chats_async (ChattyHistory       *self,
   GTask *task;
 
   g_return_if_fail (CHATTY_IS_HISTORY (self));
-  g_return_if_fail (CHATTY_IS_ACCOUNT (account));
-
-  /* Currently we handle only matrix accounts */
-  if (!g_str_equal (chatty_account_get_protocol_name (account), "Matrix"))
-    g_return_if_reached ();
+  g_return_if_fail (CHATTY_IS_MA_ACCOUNT (account));
 
   task = g_task_new (self, NULL, callback, user_data);
   g_task_set_source_tag (task, chatty_history_get_chats_async);
@@ -2928,6 +6178,131 @@ chatty_history_get_chats_finish (ChattyHistory  *self,
   return g_task_propagate_pointer (G_TASK (result), error);
 }
 
+/**
+ * chatty_history_get_last_messages_async:
+ * @self: a #ChattyHistory
+ * @account: a #ChattyAccount
+ * @chats: A #GPtrArray of #ChattyChat of @account
+ * @callback: a #GAsyncReadyCallback, or %NULL
+ * @user_data: closure data for @callback
+ *
+ * Get the last message of every chat in @chats with
+ * a single query, instead of loading them one chat at
+ * a time with chatty_history_get_messages_async().
+ * This is the same query chatty_history_get_chats_async()
+ * uses, but matches the existing @chats, which is useful
+ * for chats owned by libpurple.
+ */
+void
+chatty_history_get_last_messages_async (ChattyHistory       *self,
+                                        ChattyAccount       *account,
+                                        GPtrArray           *chats,
+                                        GAsyncReadyCallback  callback,
+                                        gpointer             user_data)
+{
+  GHashTable *chat_names;
+  GTask *task;
+
+  g_return_if_fail (CHATTY_IS_HISTORY (self));
+  g_return_if_fail (CHATTY_IS_ACCOUNT (account));
+  g_return_if_fail (chats);
+
+  chat_names = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_object_unref);
+
+  for (guint i = 0; i < chats->len; i++) {
+    ChattyChat *chat = chats->pdata[i];
+
+    g_hash_table_insert (chat_names, (gpointer)chatty_chat_get_chat_name (chat),
+                         g_object_ref (chat));
+  }
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_get_last_messages_async);
+  g_task_set_task_data (task, history_get_last_messages, NULL);
+  g_object_set_data_full (G_OBJECT (task), "account", g_object_ref (account), g_object_unref);
+  g_object_set_data_full (G_OBJECT (task), "chats", chat_names,
+                          (GDestroyNotify)g_hash_table_unref);
+
+  g_async_queue_push (self->queue, task);
+}
+
+/**
+ * chatty_history_get_last_messages_finish:
+ * @self: a #ChattyHistory
+ * @result: a #GAsyncResult provided to callback
+ * @error: a location for #GError or %NULL
+ *
+ * Completes chatty_history_get_last_messages_async() call.
+ *
+ * Returns: (transfer full): A #GHashTable of #ChattyChat
+ * to a #GPtrArray of its last messages.  Chats without
+ * messages are not in the table.
+ */
+GHashTable *
+chatty_history_get_last_messages_finish (ChattyHistory  *self,
+                                         GAsyncResult   *result,
+                                         GError        **error)
+{
+  g_return_val_if_fail (CHATTY_IS_HISTORY (self), NULL);
+  g_return_val_if_fail (G_IS_TASK (result), NULL);
+  g_return_val_if_fail (!error || !*error, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+/**
+ * chatty_history_set_chat_read_async:
+ * @self: a #ChattyHistory
+ * @chat: a #ChattyChat
+ * @callback: a #GAsyncReadyCallback, or %NULL
+ * @user_data: closure data for @callback
+ *
+ * Mark all the messages stored for @chat as read, so
+ * that only messages added later are counted as unread
+ * by chatty_history_get_chats_async().
+ */
+void
+chatty_history_set_chat_read_async (ChattyHistory       *self,
+                                    ChattyChat          *chat,
+                                    GAsyncReadyCallback  callback,
+                                    gpointer             user_data)
+{
+  GTask *task;
+
+  g_return_if_fail (CHATTY_IS_HISTORY (self));
+  g_return_if_fail (CHATTY_IS_CHAT (chat));
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_set_chat_read_async);
+  g_task_set_task_data (task, history_set_chat_read, NULL);
+  g_object_set_data_full (G_OBJECT (task), "chat", g_object_ref (chat), g_object_unref);
+
+  g_async_queue_push (self->queue, task);
+}
+
+/**
+ * chatty_history_set_chat_read_finish:
+ * @self: a #ChattyHistory
+ * @result: a #GAsyncResult provided to callback
+ * @error: a location for a #GError or %NULL
+ *
+ * Completes chatty_history_set_chat_read_async() call.
+ *
+ * Returns: %TRUE if the chat was marked as read.
+ * %FALSE otherwise with @error set.
+ */
+gboolean
+chatty_history_set_chat_read_finish (ChattyHistory  *self,
+                                     GAsyncResult   *result,
+                                     GError        **error)
+{
+  g_return_val_if_fail (CHATTY_IS_HISTORY (self), FALSE);
+  g_return_val_if_fail (G_IS_TASK (result), FALSE);
+  g_return_val_if_fail (!error || !*error, FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
 gboolean
 chatty_history_update_chat (ChattyHistory *self,
                             ChattyChat    *chat)
@@ -2976,11 +6351,16 @@ chatty_history_delete_chat_async (ChattyHistory       *self,
                                   GAsyncReadyCallback  callback,
                                   gpointer             user_data)
 {
+  LastTimes *last_times;
   GTask *task;
 
   g_return_if_fail (CHATTY_IS_HISTORY (self));
   g_return_if_fail (CHATTY_IS_CHAT (chat));
 
+  last_times = history_get_last_times (self, chatty_chat_get_username (chat), FALSE);
+  if (last_times)
+    g_hash_table_remove (last_times->rooms, chatty_chat_get_chat_name (chat));
+
   task = g_task_new (self, NULL, callback, user_data);
   g_task_set_source_tag (task, chatty_history_delete_chat_async);
   g_task_set_task_data (task, history_delete_chat, NULL);
@@ -3012,6 +6392,71 @@ chatty_history_delete_chat_finish (ChattyHistory  *self,
   return g_task_propagate_boolean (G_TASK (result), error);
 }
 
+/**
+ * chatty_history_update_status_async:
+ * @self: a #ChattyHistory
+ * @chats: A #GPtrArray of #ChattyChat
+ * @messages: A #GPtrArray of #ChattyMessage
+ * @callback: a #GAsyncReadyCallback, or %NULL
+ * @user_data: closure data for @callback
+ *
+ * Save the current status of all @messages to
+ * database in a single transaction.  Each message
+ * in @messages belongs to the chat at the same index
+ * in @chats.  Messages are matched by their uid in
+ * the thread of their chat, and the saved status is
+ * never downgraded.  To get the result, finish
+ * with chatty_history_update_status_finish()
+ */
+void
+chatty_history_update_status_async (ChattyHistory       *self,
+                                    GPtrArray           *chats,
+                                    GPtrArray           *messages,
+                                    GAsyncReadyCallback  callback,
+                                    gpointer             user_data)
+{
+  GTask *task;
+
+  g_return_if_fail (CHATTY_IS_HISTORY (self));
+  g_return_if_fail (chats && messages);
+  g_return_if_fail (chats->len == messages->len);
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_update_status_async);
+  g_task_set_task_data (task, history_update_status, NULL);
+  g_object_set_data_full (G_OBJECT (task), "chats",
+                          g_ptr_array_ref (chats),
+                          (GDestroyNotify)g_ptr_array_unref);
+  g_object_set_data_full (G_OBJECT (task), "messages",
+                          g_ptr_array_ref (messages),
+                          (GDestroyNotify)g_ptr_array_unref);
+
+  g_async_queue_push (self->queue, task);
+}
+
+/**
+ * chatty_history_update_status_finish:
+ * @self: a #ChattyHistory
+ * @result: a #GAsyncResult provided to callback
+ * @error: a location for a #GError or %NULL
+ *
+ * Completes chatty_history_update_status_async() call.
+ *
+ * Returns: %TRUE if updating status succeeded.  %FALSE
+ * otherwise with @error set.
+ */
+gboolean
+chatty_history_update_status_finish (ChattyHistory  *self,
+                                     GAsyncResult   *result,
+                                     GError        **error)
+{
+  g_return_val_if_fail (CHATTY_IS_HISTORY (self), FALSE);
+  g_return_val_if_fail (G_IS_TASK (result), FALSE);
+  g_return_val_if_fail (!error || !*error, FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
 static void
 finish_cb (GObject      *object,
            GAsyncResult *result,
@@ -3190,7 +6635,10 @@ chatty_history_get_im_timestamp (ChattyHistory *self,
  * Get the timestamp of the last message in @room
  * with the account @account.
  *
- * This method runs synchronously.
+ * If the times of @account are loaded with
+ * chatty_history_load_last_message_times_async(),
+ * the cached value is returned.  Otherwise this
+ * method runs synchronously.
  *
  * Returns: The timestamp of the last matching message
  * or 0 if no match found.
@@ -3202,12 +6650,18 @@ chatty_history_get_last_message_time (ChattyHistory *self,
 {
   g_autoptr(GError) error = NULL;
   g_autoptr(GTask) task = NULL;
+  LastTimes *last_times;
   int time_stamp;
 
   g_return_val_if_fail (account, 0);
   g_return_val_if_fail (room, 0);
   g_return_val_if_fail (self->db, 0);
 
+  last_times = history_get_last_times (self, account, FALSE);
+
+  if (last_times && last_times->loaded)
+    return GPOINTER_TO_INT (g_hash_table_lookup (last_times->rooms, room));
+
   task = g_task_new (NULL, NULL, NULL, NULL);
   g_object_ref (task);
   g_task_set_task_data (task, history_get_last_message_time, NULL);
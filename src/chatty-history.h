@@ -32,12 +32,51 @@ gboolean       chatty_history_open_finish         (ChattyHistory        *self,
                                                    GAsyncResult         *result,
                                                    GError              **error);
 gboolean       chatty_history_is_open             (ChattyHistory        *self);
+double         chatty_history_get_migration_progress (ChattyHistory   *self);
 void           chatty_history_close_async         (ChattyHistory        *self,
                                                    GAsyncReadyCallback   callback,
                                                    gpointer              user_data);
 gboolean       chatty_history_close_finish        (ChattyHistory        *self,
                                                    GAsyncResult         *result,
                                                    GError              **error);
+void           chatty_history_backup_async        (ChattyHistory        *self,
+                                                   guint                 n_keep,
+                                                   gboolean              compress,
+                                                   GAsyncReadyCallback   callback,
+                                                   gpointer              user_data);
+char          *chatty_history_backup_finish       (ChattyHistory        *self,
+                                                   GAsyncResult         *result,
+                                                   GError              **error);
+void           chatty_history_set_retention       (ChattyHistory        *self,
+                                                   ChattyProtocol        protocols,
+                                                   guint                 max_days,
+                                                   guint                 max_messages);
+void           chatty_history_set_chat_retention  (ChattyHistory        *self,
+                                                   ChattyChat           *chat,
+                                                   guint                 max_days,
+                                                   guint                 max_messages);
+void           chatty_history_maintain_async      (ChattyHistory        *self,
+                                                   GAsyncReadyCallback   callback,
+                                                   gpointer              user_data);
+gboolean       chatty_history_maintain_finish     (ChattyHistory        *self,
+                                                   GAsyncResult         *result,
+                                                   GError              **error);
+void           chatty_history_export_async        (ChattyHistory        *self,
+                                                   const char           *dir,
+                                                   GCancellable         *cancellable,
+                                                   GAsyncReadyCallback   callback,
+                                                   gpointer              user_data);
+gint64         chatty_history_export_finish       (ChattyHistory        *self,
+                                                   GAsyncResult         *result,
+                                                   GError              **error);
+void           chatty_history_import_async        (ChattyHistory        *self,
+                                                   const char           *dir,
+                                                   GCancellable         *cancellable,
+                                                   GAsyncReadyCallback   callback,
+                                                   gpointer              user_data);
+gint64         chatty_history_import_finish       (ChattyHistory        *self,
+                                                   GAsyncResult         *result,
+                                                   GError              **error);
 void           chatty_history_get_messages_async  (ChattyHistory        *self,
                                                    ChattyChat           *chat,
                                                    ChattyMessage        *start,
@@ -55,6 +94,30 @@ void           chatty_history_add_message_async   (ChattyHistory        *self,
 gboolean       chatty_history_add_message_finish  (ChattyHistory        *self,
                                                    GAsyncResult         *result,
                                                    GError              **error);
+void           chatty_history_add_messages_async  (ChattyHistory        *self,
+                                                   GPtrArray            *chats,
+                                                   GPtrArray            *messages,
+                                                   GAsyncReadyCallback   callback,
+                                                   gpointer              user_data);
+gboolean       chatty_history_add_messages_finish (ChattyHistory        *self,
+                                                   GAsyncResult         *result,
+                                                   GError              **error);
+void           chatty_history_load_last_message_times_async  (ChattyHistory       *self,
+                                                              const char          *account,
+                                                              GAsyncReadyCallback  callback,
+                                                              gpointer             user_data);
+gboolean       chatty_history_load_last_message_times_finish (ChattyHistory       *self,
+                                                              GAsyncResult        *result,
+                                                              GError             **error);
+void           chatty_history_get_uids_async      (ChattyHistory        *self,
+                                                   const char           *account,
+                                                   const char           *room,
+                                                   gint64                since,
+                                                   GAsyncReadyCallback   callback,
+                                                   gpointer              user_data);
+GHashTable    *chatty_history_get_uids_finish     (ChattyHistory        *self,
+                                                   GAsyncResult         *result,
+                                                   GError              **error);
 void           chatty_history_get_chats_async     (ChattyHistory       *self,
                                                    ChattyAccount       *account,
                                                    GAsyncReadyCallback  callback,
@@ -62,8 +125,23 @@ void           chatty_history_get_chats_async     (ChattyHistory       *self,
 GPtrArray     *chatty_history_get_chats_finish    (ChattyHistory        *self,
                                                    GAsyncResult         *result,
                                                    GError              **error);
+void           chatty_history_get_last_messages_async  (ChattyHistory       *self,
+                                                        ChattyAccount       *account,
+                                                        GPtrArray           *chats,
+                                                        GAsyncReadyCallback  callback,
+                                                        gpointer             user_data);
+GHashTable    *chatty_history_get_last_messages_finish (ChattyHistory        *self,
+                                                        GAsyncResult         *result,
+                                                        GError              **error);
 gboolean       chatty_history_update_chat         (ChattyHistory        *self,
                                                    ChattyChat           *chat);
+void           chatty_history_set_chat_read_async (ChattyHistory        *self,
+                                                   ChattyChat           *chat,
+                                                   GAsyncReadyCallback   callback,
+                                                   gpointer              user_data);
+gboolean       chatty_history_set_chat_read_finish (ChattyHistory       *self,
+                                                    GAsyncResult        *result,
+                                                    GError             **error);
 void           chatty_history_delete_chat_async   (ChattyHistory        *self,
                                                    ChattyChat           *chat,
                                                    GAsyncReadyCallback   callback,
@@ -71,6 +149,14 @@ void           chatty_history_delete_chat_async   (ChattyHistory        *self,
 gboolean       chatty_history_delete_chat_finish  (ChattyHistory        *self,
                                                    GAsyncResult         *result,
                                                    GError              **error);
+void           chatty_history_update_status_async (ChattyHistory        *self,
+                                                   GPtrArray            *chats,
+                                                   GPtrArray            *messages,
+                                                   GAsyncReadyCallback   callback,
+                                                   gpointer              user_data);
+gboolean       chatty_history_update_status_finish (ChattyHistory       *self,
+                                                    GAsyncResult        *result,
+                                                    GError             **error);
 
 /* old APIs */
 void           chatty_history_open                (ChattyHistory         *self,
@@ -16,10 +16,15 @@
 #include "chatty-avatar.h"
 #include "chatty-utils.h"
 #include "chatty-chat-view.h"
+#include "chatty-image-loader.h"
 #include "chatty-image-item.h"
+#include "chatty-log.h"
 
 
 #define MAX_GMT_ISO_SIZE 256
+#define IMAGE_WIDTH      240
+/* Warn about broken images at most once in this many seconds */
+#define LOAD_ERROR_WARN_INTERVAL 60
 
 struct _ChattyImageItem
 {
@@ -32,41 +37,24 @@ struct _ChattyImageItem
   GtkWidget     *image;
 
   ChattyMessage *message;
+  GCancellable  *cancellable;
+  /* Scale factor of the image being loaded */
+  int            load_scale;
   ChattyProtocol protocol;
 };
 
 G_DEFINE_TYPE (ChattyImageItem, chatty_image_item, GTK_TYPE_BIN)
 
 
-static gboolean
-item_set_image (gpointer user_data)
+static void
+item_set_surface (ChattyImageItem *self,
+                  cairo_surface_t *surface)
 {
-  ChattyImageItem *self = user_data;
-  g_autoptr(GdkPixbuf) pixbuf = NULL;
-  cairo_surface_t *surface = NULL;
-  g_autofree char *path = NULL;
-  ChattyFileInfo *file;
   GtkStyleContext *sc;
-  GList *files;
-  int scale_factor;
 
-  files = chatty_message_get_files (self->message);
-  g_return_val_if_fail (files && files->data, G_SOURCE_REMOVE);
-  file = files->data;
-  scale_factor = gtk_widget_get_scale_factor (GTK_WIDGET (self));
   sc = gtk_widget_get_style_context (self->image);
 
-  if (file->path)
-    path = g_build_filename (g_get_user_cache_dir (), "chatty", file->path, NULL);
-
-  if (path)
-    pixbuf = gdk_pixbuf_new_from_file_at_scale (path, 240 * scale_factor,
-                                                -1, TRUE, NULL);
-  if (pixbuf)
-    surface = gdk_cairo_surface_create_from_pixbuf (pixbuf, 0,
-                                                    gtk_widget_get_window (GTK_WIDGET (self)));
-
-  if (file->status == CHATTY_FILE_DOWNLOADED && pixbuf) {
+  if (surface) {
     gtk_style_context_remove_class (sc, "dim-label");
     gtk_image_set_from_surface (GTK_IMAGE (self->image), surface);
   } else {
@@ -75,10 +63,110 @@ item_set_image (gpointer user_data)
                                   "image-x-generic-symbolic",
                                   GTK_ICON_SIZE_BUTTON);
   }
+}
+
+/*
+ * Rows are recreated as the message window moves, so a broken
+ * image would be decoded and reported again and again.  Warn only
+ * once in a while and trace the rest.
+ */
+static void
+item_warn_load_error (const GError *error)
+{
+  static gint64 last_warned;
+  static guint n_suppressed;
+  gint64 now;
+
+  now = g_get_monotonic_time ();
+
+  if (last_warned && now - last_warned < LOAD_ERROR_WARN_INTERVAL * G_USEC_PER_SEC) {
+    n_suppressed++;
+    CHATTY_TRACE_MSG ("Error loading image: %s", error->message);
+
+    return;
+  }
+
+  if (n_suppressed)
+    g_warning ("Error loading image: %s (%u more errors suppressed)",
+               error->message, n_suppressed);
+  else
+    g_warning ("Error loading image: %s", error->message);
+
+  last_warned = now;
+  n_suppressed = 0;
+}
+
+static void
+image_load_cb (GObject      *object,
+               GAsyncResult *result,
+               gpointer      user_data)
+{
+  ChattyImageItem *self;
+  g_autoptr(GError) error = NULL;
+  cairo_surface_t *surface;
+
+  surface = chatty_image_loader_load_finish (CHATTY_IMAGE_LOADER (object), result, &error);
 
+  /* @self may have been destroyed if cancelled */
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    return;
+
+  self = user_data;
+  g_assert (CHATTY_IS_IMAGE_ITEM (self));
+
+  g_clear_object (&self->cancellable);
+
+  if (error)
+    item_warn_load_error (error);
+
+  item_set_surface (self, surface);
   g_clear_pointer (&surface, cairo_surface_destroy);
+}
+
+static void
+item_load_image (ChattyImageItem *self)
+{
+  ChattyImageLoader *loader;
+  cairo_surface_t *surface;
+  g_autofree char *path = NULL;
+  ChattyFileInfo *file;
+  GList *files;
+  int scale_factor;
+
+  files = chatty_message_get_files (self->message);
+  g_return_if_fail (files && files->data);
+  file = files->data;
+
+  if (file->path)
+    path = g_build_filename (g_get_user_cache_dir (), "chatty", file->path, NULL);
+
+  if (!path) {
+    item_set_surface (self, NULL);
+    return;
+  }
+
+  loader = chatty_image_loader_get_default ();
+  scale_factor = gtk_widget_get_scale_factor (GTK_WIDGET (self));
+
+  /* Already loading */
+  if (self->cancellable && self->load_scale == scale_factor)
+    return;
+
+  /* Cancel the previous load, which is of a different scale */
+  g_cancellable_cancel (self->cancellable);
+  g_clear_object (&self->cancellable);
+
+  surface = chatty_image_loader_lookup (loader, path, IMAGE_WIDTH, scale_factor);
+
+  if (surface) {
+    item_set_surface (self, surface);
+    return;
+  }
 
-  return G_SOURCE_REMOVE;
+  self->cancellable = g_cancellable_new ();
+  self->load_scale = scale_factor;
+  chatty_image_loader_load_async (loader, path, IMAGE_WIDTH, scale_factor,
+                                  self->cancellable, image_load_cb, self);
 }
 
 static void
@@ -109,9 +197,9 @@ image_item_update_message (ChattyImageItem *self)
   else
     gtk_widget_hide (self->overlay_stack);
 
-  /* Update in idle so that self is added to the parent container */
+  /* The placeholder icon is shown until the image is decoded */
   if (file->status == CHATTY_FILE_DOWNLOADED)
-    g_idle_add (item_set_image, self);
+    item_load_image (self);
 }
 
 static void
@@ -131,6 +219,8 @@ chatty_image_item_dispose (GObject *object)
 {
   ChattyImageItem *self = (ChattyImageItem *)object;
 
+  g_cancellable_cancel (self->cancellable);
+  g_clear_object (&self->cancellable);
   g_clear_object (&self->message);
 
   G_OBJECT_CLASS (chatty_image_item_parent_class)->dispose (object);
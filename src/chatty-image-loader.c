@@ -0,0 +1,463 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-image-loader.c
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "chatty-image-loader"
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <gdk/gdk.h>
+
+#include "chatty-image-loader.h"
+#include "chatty-log.h"
+
+/**
+ * SECTION: chatty-image-loader
+ * @title: ChattyImageLoader
+ * @short_description: Decode images in worker threads
+ * @include: "chatty-image-loader.h"
+ *
+ * #ChattyImageLoader decodes images at the requested size
+ * in a bounded pool of worker threads.  Concurrent requests
+ * for the same image share a single decode, and the decoded
+ * surfaces are kept in a cache limited by memory size, which
+ * is shared by all users of the default loader.
+ */
+
+#define MAX_DECODE_THREADS 2
+#define DEFAULT_CACHE_SIZE (32 * 1024 * 1024)
+
+struct _ChattyImageLoader
+{
+  GObject       parent_instance;
+
+  GThreadPool  *decode_pool;
+  GMainContext *main_context;
+
+  /* key -> LoadRequest, for requests being decoded */
+  GHashTable   *pending;
+
+  /* key -> CacheEntry, with the most recently used at head of @lru */
+  GHashTable   *cache;
+  GQueue        lru;
+  gsize         cache_used;
+  gsize         cache_size;
+};
+
+typedef struct {
+  ChattyImageLoader *self;
+  char              *key;
+  char              *path;
+  int                width;
+  int                scale_factor;
+
+  /* Cancelled when all @tasks are cancelled */
+  GCancellable      *cancellable;
+  GPtrArray         *tasks;
+  guint              n_active;
+
+  /* Set from the worker thread */
+  GdkPixbuf         *pixbuf;
+  GError            *error;
+} LoadRequest;
+
+typedef struct {
+  char            *key;
+  cairo_surface_t *surface;
+  gsize            size;
+  GList            link;
+} CacheEntry;
+
+G_DEFINE_TYPE (ChattyImageLoader, chatty_image_loader, G_TYPE_OBJECT)
+
+static char *
+loader_get_key (const char *path,
+                int         width,
+                int         scale_factor)
+{
+  return g_strdup_printf ("%d@%d:%s", width, scale_factor, path);
+}
+
+static void
+load_request_free (LoadRequest *request)
+{
+  g_clear_object (&request->self);
+  g_clear_object (&request->cancellable);
+  g_clear_object (&request->pixbuf);
+  g_clear_error (&request->error);
+  g_ptr_array_unref (request->tasks);
+  g_free (request->key);
+  g_free (request->path);
+  g_free (request);
+}
+
+static void
+cache_entry_free (CacheEntry *entry)
+{
+  cairo_surface_destroy (entry->surface);
+  g_free (entry->key);
+  g_free (entry);
+}
+
+static void
+loader_cache_trim (ChattyImageLoader *self)
+{
+  while (self->cache_used > self->cache_size && self->lru.tail) {
+    CacheEntry *entry = self->lru.tail->data;
+
+    g_queue_unlink (&self->lru, &entry->link);
+    self->cache_used -= entry->size;
+    CHATTY_TRACE_MSG ("Evicting %s, %" G_GSIZE_FORMAT " bytes used", entry->key, self->cache_used);
+    g_hash_table_remove (self->cache, entry->key);
+  }
+}
+
+static void
+loader_cache_insert (ChattyImageLoader *self,
+                     const char        *key,
+                     cairo_surface_t   *surface)
+{
+  CacheEntry *entry;
+  gsize size;
+
+  size = (gsize)cairo_image_surface_get_stride (surface) *
+    cairo_image_surface_get_height (surface);
+
+  /* Don’t let a huge image flush the whole cache */
+  if (size > self->cache_size / 2 ||
+      g_hash_table_contains (self->cache, key))
+    return;
+
+  entry = g_new0 (CacheEntry, 1);
+  entry->key = g_strdup (key);
+  entry->surface = cairo_surface_reference (surface);
+  entry->size = size;
+  entry->link.data = entry;
+
+  g_hash_table_insert (self->cache, entry->key, entry);
+  g_queue_push_head_link (&self->lru, &entry->link);
+  self->cache_used += size;
+
+  loader_cache_trim (self);
+}
+
+static gboolean
+loader_request_complete (gpointer user_data)
+{
+  LoadRequest *request = user_data;
+  ChattyImageLoader *self = request->self;
+  cairo_surface_t *surface = NULL;
+
+  g_assert (CHATTY_IS_IMAGE_LOADER (self));
+
+  /* The request may have been replaced if it was cancelled */
+  if (g_hash_table_lookup (self->pending, request->key) == request)
+    g_hash_table_remove (self->pending, request->key);
+
+  if (request->pixbuf) {
+    surface = gdk_cairo_surface_create_from_pixbuf (request->pixbuf,
+                                                    request->scale_factor, NULL);
+    loader_cache_insert (self, request->key, surface);
+  }
+
+  for (guint i = 0; i < request->tasks->len; i++) {
+    GTask *task = request->tasks->pdata[i];
+    GCancellable *cancellable;
+
+    cancellable = g_task_get_cancellable (task);
+
+    if (cancellable)
+      g_cancellable_disconnect (cancellable, GPOINTER_TO_SIZE (g_task_get_task_data (task)));
+
+    if (g_task_return_error_if_cancelled (task))
+      continue;
+
+    if (surface)
+      g_task_return_pointer (task, cairo_surface_reference (surface),
+                             (GDestroyNotify)cairo_surface_destroy);
+    else if (request->error)
+      g_task_return_error (task, g_error_copy (request->error));
+    else
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                               "Failed to load image");
+  }
+
+  g_clear_pointer (&surface, cairo_surface_destroy);
+  load_request_free (request);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+loader_decode_worker (gpointer data,
+                      gpointer user_data)
+{
+  LoadRequest *request = data;
+  g_autoptr(GFileInputStream) stream = NULL;
+  g_autoptr(GFile) file = NULL;
+
+  if (g_cancellable_set_error_if_cancelled (request->cancellable, &request->error))
+    goto end;
+
+  file = g_file_new_for_path (request->path);
+  stream = g_file_read (file, request->cancellable, &request->error);
+
+  /* Decode directly at the target size, instead of scaling the full image */
+  if (stream)
+    request->pixbuf = gdk_pixbuf_new_from_stream_at_scale (G_INPUT_STREAM (stream),
+                                                           request->width, -1, TRUE,
+                                                           request->cancellable,
+                                                           &request->error);
+
+ end:
+  g_main_context_invoke_full (request->self->main_context, G_PRIORITY_DEFAULT,
+                              loader_request_complete, request, NULL);
+}
+
+static void
+loader_task_cancelled_cb (GCancellable *cancellable,
+                          LoadRequest  *request)
+{
+  g_assert (request->n_active > 0);
+
+  /* Stop decoding if no one is waiting for the result */
+  if (--request->n_active == 0)
+    g_cancellable_cancel (request->cancellable);
+}
+
+static void
+chatty_image_loader_finalize (GObject *object)
+{
+  ChattyImageLoader *self = (ChattyImageLoader *)object;
+
+  /* Pending requests keep a reference, so there won’t be any at this point */
+  g_thread_pool_free (self->decode_pool, FALSE, TRUE);
+  g_hash_table_unref (self->pending);
+  g_queue_clear (&self->lru);
+  g_hash_table_unref (self->cache);
+  g_main_context_unref (self->main_context);
+
+  G_OBJECT_CLASS (chatty_image_loader_parent_class)->finalize (object);
+}
+
+static void
+chatty_image_loader_class_init (ChattyImageLoaderClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = chatty_image_loader_finalize;
+}
+
+static void
+chatty_image_loader_init (ChattyImageLoader *self)
+{
+  self->decode_pool = g_thread_pool_new (loader_decode_worker, self,
+                                         MAX_DECODE_THREADS, FALSE, NULL);
+  self->main_context = g_main_context_ref_thread_default ();
+  self->pending = g_hash_table_new (g_str_hash, g_str_equal);
+  self->cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                       NULL, (GDestroyNotify)cache_entry_free);
+  self->cache_size = DEFAULT_CACHE_SIZE;
+}
+
+/**
+ * chatty_image_loader_get_default:
+ *
+ * Get the default image loader
+ *
+ * Returns: (transfer none): A #ChattyImageLoader.
+ */
+ChattyImageLoader *
+chatty_image_loader_get_default (void)
+{
+  static ChattyImageLoader *self;
+
+  if (!self) {
+    self = g_object_new (CHATTY_TYPE_IMAGE_LOADER, NULL);
+    g_object_add_weak_pointer (G_OBJECT (self), (gpointer *)&self);
+  }
+
+  return self;
+}
+
+/**
+ * chatty_image_loader_set_cache_size:
+ * @self: A #ChattyImageLoader
+ * @cache_size: The cache size in bytes
+ *
+ * Set the maximum memory used by the decoded images
+ * kept in cache.  Least recently used images are
+ * dropped if the cache grows beyond @cache_size.
+ */
+void
+chatty_image_loader_set_cache_size (ChattyImageLoader *self,
+                                    gsize              cache_size)
+{
+  g_return_if_fail (CHATTY_IS_IMAGE_LOADER (self));
+
+  self->cache_size = cache_size;
+  loader_cache_trim (self);
+}
+
+gsize
+chatty_image_loader_get_cache_used (ChattyImageLoader *self)
+{
+  g_return_val_if_fail (CHATTY_IS_IMAGE_LOADER (self), 0);
+
+  return self->cache_used;
+}
+
+/**
+ * chatty_image_loader_lookup:
+ * @self: A #ChattyImageLoader
+ * @path: The image file path
+ * @width: The width to scale the image to
+ * @scale_factor: The scale factor of the widget
+ *
+ * Get the image from cache, if it was already loaded
+ * with the same @width and @scale_factor.
+ *
+ * Returns: (transfer none) (nullable): A #cairo_surface_t
+ * or %NULL if not in cache.  Take a reference if you
+ * want to keep it.
+ */
+cairo_surface_t *
+chatty_image_loader_lookup (ChattyImageLoader *self,
+                            const char        *path,
+                            int                width,
+                            int                scale_factor)
+{
+  g_autofree char *key = NULL;
+  CacheEntry *entry;
+
+  g_return_val_if_fail (CHATTY_IS_IMAGE_LOADER (self), NULL);
+  g_return_val_if_fail (path && *path, NULL);
+
+  key = loader_get_key (path, width, scale_factor);
+  entry = g_hash_table_lookup (self->cache, key);
+
+  if (!entry)
+    return NULL;
+
+  g_queue_unlink (&self->lru, &entry->link);
+  g_queue_push_head_link (&self->lru, &entry->link);
+
+  return entry->surface;
+}
+
+/**
+ * chatty_image_loader_load_async:
+ * @self: A #ChattyImageLoader
+ * @path: The image file path
+ * @width: The width in pixels to scale the image to
+ * @scale_factor: The scale factor of the widget
+ * @cancellable: (nullable): A #GCancellable
+ * @callback: The callback to run when loaded
+ * @user_data: user data for @callback
+ *
+ * Load the image at @path, scaled to @width times
+ * @scale_factor pixels wide, preserving the aspect
+ * ratio.  The image is decoded in a worker thread,
+ * unless it’s already in cache.
+ *
+ * Decoding is stopped when @cancellable and every other
+ * request for the same image are cancelled.
+ */
+void
+chatty_image_loader_load_async (ChattyImageLoader   *self,
+                                const char          *path,
+                                int                  width,
+                                int                  scale_factor,
+                                GCancellable        *cancellable,
+                                GAsyncReadyCallback  callback,
+                                gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  cairo_surface_t *surface;
+  LoadRequest *request;
+  g_autofree char *key = NULL;
+
+  g_return_if_fail (CHATTY_IS_IMAGE_LOADER (self));
+  g_return_if_fail (path && *path);
+  g_return_if_fail (width > 0);
+  g_return_if_fail (scale_factor > 0);
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, chatty_image_loader_load_async);
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  surface = chatty_image_loader_lookup (self, path, width, scale_factor);
+
+  if (surface) {
+    g_task_return_pointer (task, cairo_surface_reference (surface),
+                           (GDestroyNotify)cairo_surface_destroy);
+    return;
+  }
+
+  key = loader_get_key (path, width, scale_factor);
+  request = g_hash_table_lookup (self->pending, key);
+
+  /* Share the decode with the pending request, unless it’s being cancelled */
+  if (!request || g_cancellable_is_cancelled (request->cancellable)) {
+    request = g_new0 (LoadRequest, 1);
+    request->self = g_object_ref (self);
+    request->key = g_steal_pointer (&key);
+    request->path = g_strdup (path);
+    request->width = width * scale_factor;
+    request->scale_factor = scale_factor;
+    request->cancellable = g_cancellable_new ();
+    request->tasks = g_ptr_array_new_with_free_func (g_object_unref);
+
+    g_hash_table_replace (self->pending, request->key, request);
+    g_thread_pool_push (self->decode_pool, request, NULL);
+  }
+
+  request->n_active++;
+
+  if (cancellable) {
+    gulong id;
+
+    id = g_cancellable_connect (cancellable, G_CALLBACK (loader_task_cancelled_cb),
+                                request, NULL);
+    g_task_set_task_data (task, GSIZE_TO_POINTER (id), NULL);
+  }
+
+  g_ptr_array_add (request->tasks, g_steal_pointer (&task));
+}
+
+/**
+ * chatty_image_loader_load_finish:
+ * @self: A #ChattyImageLoader
+ * @result: A #GAsyncResult
+ * @error: return location for a #GError, or %NULL
+ *
+ * Finish the operation started with
+ * chatty_image_loader_load_async().
+ *
+ * Returns: (transfer full): The decoded image with
+ * the device scale set to the requested scale factor,
+ * or %NULL on error.  Free with cairo_surface_destroy().
+ */
+cairo_surface_t *
+chatty_image_loader_load_finish (ChattyImageLoader  *self,
+                                 GAsyncResult       *result,
+                                 GError            **error)
+{
+  g_return_val_if_fail (CHATTY_IS_IMAGE_LOADER (self), NULL);
+  g_return_val_if_fail (G_IS_TASK (result), NULL);
+  g_return_val_if_fail (!error || !*error, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
@@ -0,0 +1,42 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-image-loader.h
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <cairo.h>
+
+G_BEGIN_DECLS
+
+#define CHATTY_TYPE_IMAGE_LOADER (chatty_image_loader_get_type ())
+
+G_DECLARE_FINAL_TYPE (ChattyImageLoader, chatty_image_loader, CHATTY, IMAGE_LOADER, GObject)
+
+ChattyImageLoader *chatty_image_loader_get_default    (void);
+void               chatty_image_loader_set_cache_size (ChattyImageLoader    *self,
+                                                       gsize                 cache_size);
+gsize              chatty_image_loader_get_cache_used (ChattyImageLoader    *self);
+cairo_surface_t   *chatty_image_loader_lookup         (ChattyImageLoader    *self,
+                                                       const char           *path,
+                                                       int                   width,
+                                                       int                   scale_factor);
+void               chatty_image_loader_load_async     (ChattyImageLoader    *self,
+                                                       const char           *path,
+                                                       int                   width,
+                                                       int                   scale_factor,
+                                                       GCancellable         *cancellable,
+                                                       GAsyncReadyCallback   callback,
+                                                       gpointer              user_data);
+cairo_surface_t   *chatty_image_loader_load_finish    (ChattyImageLoader    *self,
+                                                       GAsyncResult         *result,
+                                                       GError              **error);
+
+G_END_DECLS
@@ -0,0 +1,607 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-indexed-store.c
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "chatty-indexed-store"
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "chatty-indexed-store.h"
+
+/**
+ * SECTION: chatty-indexed-store
+ * @title: ChattyIndexedStore
+ * @short_description: A list store with fast item and key lookups
+ * @include: "chatty-indexed-store.h"
+ *
+ * #ChattyIndexedStore is a #GListModel similar to #GListStore,
+ * with items saved in a #GSequence.  Additionally, the store
+ * keeps an index from each item, and optionally from a key of
+ * each item (eg: the message id), to the item’s place in the
+ * sequence.  So finding an item or a key doesn’t have to check
+ * every item in the list.
+ *
+ * Positions aren’t saved as they change on every insertion.
+ * Instead, they are found from the sequence in O(log n) time.
+ *
+ * An item can be added only once to a store.  If the key of
+ * an item changes after it’s added, chatty_indexed_store_update_key()
+ * should be called.  If more than one item has the same key,
+ * the key lookup returns the one indexed last, and once it’s
+ * removed, the one indexed before it.
+ */
+
+typedef struct {
+  GObject  *item;
+  gpointer  key;
+} StoreEntry;
+
+struct _ChattyIndexedStore
+{
+  GObject        parent_instance;
+
+  GType          item_type;
+  GSequence     *items;
+  /* item to GSequenceIter */
+  GHashTable    *item_index;
+  /* key to a GQueue of GSequenceIter, if there is a key_func.
+   * The key is owned by one of the entries in the queue */
+  GHashTable    *key_index;
+
+  ChattyIndexedStoreKeyFunc key_func;
+  GDestroyNotify key_free;
+
+  /* Cache the last accessed item for sequential access */
+  GSequenceIter *last_iter;
+  guint          last_position;
+  gboolean       last_position_valid;
+};
+
+static void chatty_indexed_store_list_model_iface_init (GListModelInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (ChattyIndexedStore, chatty_indexed_store, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (G_TYPE_LIST_MODEL,
+                                                chatty_indexed_store_list_model_iface_init))
+
+static void
+store_index_key (ChattyIndexedStore *self,
+                 GSequenceIter      *iter)
+{
+  StoreEntry *entry;
+
+  if (!self->key_func)
+    return;
+
+  GQueue *iters;
+
+  entry = g_sequence_get (iter);
+  entry->key = self->key_func (entry->item);
+
+  if (!entry->key)
+    return;
+
+  iters = g_hash_table_lookup (self->key_index, entry->key);
+
+  if (!iters) {
+    iters = g_queue_new ();
+    g_hash_table_insert (self->key_index, entry->key, iters);
+  }
+
+  g_queue_push_tail (iters, iter);
+}
+
+static void
+store_unindex_key (ChattyIndexedStore *self,
+                   GSequenceIter      *iter)
+{
+  StoreEntry *entry;
+  gpointer index_key;
+  GQueue *iters;
+
+  entry = g_sequence_get (iter);
+
+  if (!entry->key)
+    return;
+
+  if (g_hash_table_steal_extended (self->key_index, entry->key,
+                                   &index_key, (gpointer *)&iters)) {
+    g_queue_remove (iters, iter);
+
+    if (g_queue_is_empty (iters)) {
+      g_queue_free (iters);
+    } else {
+      StoreEntry *survivor;
+
+      /* Other items share the key.  Index it again with the key of
+       * one of them, as the key of @entry is freed below */
+      if (index_key == entry->key) {
+        survivor = g_sequence_get (g_queue_peek_tail (iters));
+        index_key = survivor->key;
+      }
+
+      g_hash_table_insert (self->key_index, index_key, iters);
+    }
+  }
+
+  if (self->key_free)
+    self->key_free (entry->key);
+  entry->key = NULL;
+}
+
+static void
+store_insert_before (ChattyIndexedStore *self,
+                     GSequenceIter      *before,
+                     gpointer            item)
+{
+  GSequenceIter *iter;
+  StoreEntry *entry;
+
+  entry = g_new0 (StoreEntry, 1);
+  entry->item = g_object_ref (item);
+  iter = g_sequence_insert_before (before, entry);
+
+  g_hash_table_insert (self->item_index, item, iter);
+  store_index_key (self, iter);
+}
+
+static void
+store_remove_iter (ChattyIndexedStore *self,
+                   GSequenceIter      *iter)
+{
+  StoreEntry *entry;
+
+  entry = g_sequence_get (iter);
+  store_unindex_key (self, iter);
+  g_hash_table_remove (self->item_index, entry->item);
+  g_sequence_remove (iter);
+
+  g_object_unref (entry->item);
+  g_free (entry);
+}
+
+static gboolean
+store_can_add (ChattyIndexedStore *self,
+               gpointer            item)
+{
+  g_return_val_if_fail (G_IS_OBJECT (item), FALSE);
+  g_return_val_if_fail (g_type_is_a (G_OBJECT_TYPE (item), self->item_type), FALSE);
+  g_return_val_if_fail (!g_hash_table_contains (self->item_index, item), FALSE);
+
+  return TRUE;
+}
+
+static void
+store_items_changed (ChattyIndexedStore *self,
+                     guint               position,
+                     guint               removed,
+                     guint               added)
+{
+  self->last_position_valid = FALSE;
+  self->last_iter = NULL;
+
+  if (removed || added)
+    g_list_model_items_changed (G_LIST_MODEL (self), position, removed, added);
+}
+
+static void
+store_clear (ChattyIndexedStore *self)
+{
+  GSequenceIter *iter;
+
+  g_hash_table_remove_all (self->item_index);
+  if (self->key_index) {
+    GHashTableIter key_iter;
+    gpointer iters;
+
+    g_hash_table_iter_init (&key_iter, self->key_index);
+    while (g_hash_table_iter_next (&key_iter, NULL, &iters))
+      g_queue_free (iters);
+    g_hash_table_remove_all (self->key_index);
+  }
+
+  iter = g_sequence_get_begin_iter (self->items);
+
+  while (!g_sequence_iter_is_end (iter)) {
+    StoreEntry *entry = g_sequence_get (iter);
+
+    if (entry->key && self->key_free)
+      self->key_free (entry->key);
+    g_object_unref (entry->item);
+    g_free (entry);
+
+    iter = g_sequence_iter_next (iter);
+  }
+
+  g_sequence_remove_range (g_sequence_get_begin_iter (self->items),
+                           g_sequence_get_end_iter (self->items));
+}
+
+static GType
+chatty_indexed_store_get_item_type (GListModel *list)
+{
+  ChattyIndexedStore *self = (ChattyIndexedStore *)list;
+
+  return self->item_type;
+}
+
+static guint
+chatty_indexed_store_get_n_items (GListModel *list)
+{
+  ChattyIndexedStore *self = (ChattyIndexedStore *)list;
+
+  return g_sequence_get_length (self->items);
+}
+
+static gpointer
+chatty_indexed_store_get_item (GListModel *list,
+                               guint       position)
+{
+  ChattyIndexedStore *self = (ChattyIndexedStore *)list;
+  GSequenceIter *iter = NULL;
+  StoreEntry *entry;
+
+  if (self->last_position_valid) {
+    if (position < G_MAXUINT && self->last_position == position + 1)
+      iter = g_sequence_iter_prev (self->last_iter);
+    else if (position > 0 && self->last_position == position - 1)
+      iter = g_sequence_iter_next (self->last_iter);
+    else if (self->last_position == position)
+      iter = self->last_iter;
+  }
+
+  if (!iter)
+    iter = g_sequence_get_iter_at_pos (self->items, position);
+
+  self->last_iter = iter;
+  self->last_position = position;
+  self->last_position_valid = TRUE;
+
+  if (g_sequence_iter_is_end (iter))
+    return NULL;
+
+  entry = g_sequence_get (iter);
+
+  return g_object_ref (entry->item);
+}
+
+static void
+chatty_indexed_store_list_model_iface_init (GListModelInterface *iface)
+{
+  iface->get_item_type = chatty_indexed_store_get_item_type;
+  iface->get_n_items = chatty_indexed_store_get_n_items;
+  iface->get_item = chatty_indexed_store_get_item;
+}
+
+static void
+chatty_indexed_store_finalize (GObject *object)
+{
+  ChattyIndexedStore *self = (ChattyIndexedStore *)object;
+
+  store_clear (self);
+  g_sequence_free (self->items);
+  g_hash_table_unref (self->item_index);
+  g_clear_pointer (&self->key_index, g_hash_table_unref);
+
+  G_OBJECT_CLASS (chatty_indexed_store_parent_class)->finalize (object);
+}
+
+static void
+chatty_indexed_store_class_init (ChattyIndexedStoreClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = chatty_indexed_store_finalize;
+}
+
+static void
+chatty_indexed_store_init (ChattyIndexedStore *self)
+{
+  self->items = g_sequence_new (NULL);
+  self->item_index = g_hash_table_new (g_direct_hash, g_direct_equal);
+}
+
+/**
+ * chatty_indexed_store_new:
+ * @item_type: The #GType of items in the store
+ *
+ * Create a new store which can find the position
+ * of an item without checking every item.
+ *
+ * Returns: (transfer full): A #ChattyIndexedStore
+ */
+ChattyIndexedStore *
+chatty_indexed_store_new (GType item_type)
+{
+  return chatty_indexed_store_new_full (item_type, NULL, NULL, NULL, NULL);
+}
+
+/**
+ * chatty_indexed_store_new_full:
+ * @item_type: The #GType of items in the store
+ * @key_func: (nullable): A function to get the key of an item
+ * @key_hash: (nullable): A function to hash keys
+ * @key_equal: (nullable): A function to check if two keys are equal
+ * @key_free: (nullable): A function to free keys returned by @key_func
+ *
+ * Same as chatty_indexed_store_new(), but the items can
+ * also be found with chatty_indexed_store_lookup() using
+ * the key returned by @key_func.  If @key_hash and @key_equal
+ * are %NULL, the key pointers are compared directly.
+ *
+ * Returns: (transfer full): A #ChattyIndexedStore
+ */
+ChattyIndexedStore *
+chatty_indexed_store_new_full (GType                     item_type,
+                               ChattyIndexedStoreKeyFunc key_func,
+                               GHashFunc                 key_hash,
+                               GEqualFunc                key_equal,
+                               GDestroyNotify            key_free)
+{
+  ChattyIndexedStore *self;
+
+  g_return_val_if_fail (g_type_is_a (item_type, G_TYPE_OBJECT), NULL);
+
+  self = g_object_new (CHATTY_TYPE_INDEXED_STORE, NULL);
+  self->item_type = item_type;
+  self->key_func = key_func;
+  self->key_free = key_free;
+
+  if (key_func)
+    self->key_index = g_hash_table_new (key_hash, key_equal);
+
+  return self;
+}
+
+/**
+ * chatty_indexed_store_append:
+ * @self: A #ChattyIndexedStore
+ * @item: (type GObject): The item to append
+ *
+ * Append @item to the end of @self.  @item should
+ * not be already in @self.
+ */
+void
+chatty_indexed_store_append (ChattyIndexedStore *self,
+                             gpointer            item)
+{
+  guint n_items;
+
+  g_return_if_fail (CHATTY_IS_INDEXED_STORE (self));
+
+  if (!store_can_add (self, item))
+    return;
+
+  n_items = g_sequence_get_length (self->items);
+  store_insert_before (self, g_sequence_get_end_iter (self->items), item);
+  store_items_changed (self, n_items, 0, 1);
+}
+
+void
+chatty_indexed_store_insert (ChattyIndexedStore *self,
+                             guint               position,
+                             gpointer            item)
+{
+  g_return_if_fail (CHATTY_IS_INDEXED_STORE (self));
+  g_return_if_fail (position <= g_sequence_get_length (self->items));
+
+  if (!store_can_add (self, item))
+    return;
+
+  store_insert_before (self, g_sequence_get_iter_at_pos (self->items, position), item);
+  store_items_changed (self, position, 0, 1);
+}
+
+/**
+ * chatty_indexed_store_splice:
+ * @self: A #ChattyIndexedStore
+ * @position: The position to change items at
+ * @n_removals: The number of items to remove
+ * @additions: (array length=n_additions): The items to add
+ * @n_additions: The number of items to add
+ *
+ * Remove @n_removals items from @position and add
+ * @additions in their place, emitting a single
+ * #GListModel::items-changed signal.
+ */
+void
+chatty_indexed_store_splice (ChattyIndexedStore *self,
+                             guint               position,
+                             guint               n_removals,
+                             gpointer           *additions,
+                             guint               n_additions)
+{
+  GSequenceIter *iter;
+  guint n_added = 0;
+
+  g_return_if_fail (CHATTY_IS_INDEXED_STORE (self));
+  g_return_if_fail (position + n_removals >= position);
+  g_return_if_fail (position + n_removals <= g_sequence_get_length (self->items));
+
+  iter = g_sequence_get_iter_at_pos (self->items, position);
+
+  for (guint i = 0; i < n_removals; i++) {
+    GSequenceIter *next;
+
+    next = g_sequence_iter_next (iter);
+    store_remove_iter (self, iter);
+    iter = next;
+  }
+
+  for (guint i = 0; i < n_additions; i++) {
+    if (!store_can_add (self, additions[i]))
+      continue;
+
+    store_insert_before (self, iter, additions[i]);
+    n_added++;
+  }
+
+  store_items_changed (self, position, n_removals, n_added);
+}
+
+void
+chatty_indexed_store_remove (ChattyIndexedStore *self,
+                             guint               position)
+{
+  GSequenceIter *iter;
+
+  g_return_if_fail (CHATTY_IS_INDEXED_STORE (self));
+
+  iter = g_sequence_get_iter_at_pos (self->items, position);
+  g_return_if_fail (!g_sequence_iter_is_end (iter));
+
+  store_remove_iter (self, iter);
+  store_items_changed (self, position, 1, 0);
+}
+
+/**
+ * chatty_indexed_store_remove_item:
+ * @self: A #ChattyIndexedStore
+ * @item: (type GObject): The item to remove
+ *
+ * Remove @item from @self.
+ *
+ * Returns: %TRUE if @item was found and removed,
+ * %FALSE otherwise.
+ */
+gboolean
+chatty_indexed_store_remove_item (ChattyIndexedStore *self,
+                                  gpointer            item)
+{
+  GSequenceIter *iter;
+  guint position;
+
+  g_return_val_if_fail (CHATTY_IS_INDEXED_STORE (self), FALSE);
+  g_return_val_if_fail (item, FALSE);
+
+  iter = g_hash_table_lookup (self->item_index, item);
+
+  if (!iter)
+    return FALSE;
+
+  position = g_sequence_iter_get_position (iter);
+  store_remove_iter (self, iter);
+  store_items_changed (self, position, 1, 0);
+
+  return TRUE;
+}
+
+void
+chatty_indexed_store_remove_all (ChattyIndexedStore *self)
+{
+  guint n_items;
+
+  g_return_if_fail (CHATTY_IS_INDEXED_STORE (self));
+
+  n_items = g_sequence_get_length (self->items);
+  store_clear (self);
+  store_items_changed (self, 0, n_items, 0);
+}
+
+/**
+ * chatty_indexed_store_find:
+ * @self: A #ChattyIndexedStore
+ * @item: (type GObject): The item to find
+ * @position: (out) (optional): The position of @item
+ *
+ * Find the position of @item in @self.
+ *
+ * Returns: %TRUE if @item was found, %FALSE otherwise.
+ */
+gboolean
+chatty_indexed_store_find (ChattyIndexedStore *self,
+                           gpointer            item,
+                           guint              *position)
+{
+  GSequenceIter *iter;
+
+  g_return_val_if_fail (CHATTY_IS_INDEXED_STORE (self), FALSE);
+  g_return_val_if_fail (item, FALSE);
+
+  iter = g_hash_table_lookup (self->item_index, item);
+
+  if (iter && position)
+    *position = g_sequence_iter_get_position (iter);
+
+  return iter != NULL;
+}
+
+/**
+ * chatty_indexed_store_lookup:
+ * @self: A #ChattyIndexedStore
+ * @key: The key to find
+ * @position: (out) (optional): The position of the item
+ *
+ * Find the item with @key as key.  @self should have
+ * been created with chatty_indexed_store_new_full().
+ *
+ * Returns: (transfer none) (nullable): The item
+ * with @key, or %NULL if not found.
+ */
+gpointer
+chatty_indexed_store_lookup (ChattyIndexedStore *self,
+                             gconstpointer       key,
+                             guint              *position)
+{
+  GSequenceIter *iter;
+  StoreEntry *entry;
+  GQueue *iters;
+
+  g_return_val_if_fail (CHATTY_IS_INDEXED_STORE (self), NULL);
+  g_return_val_if_fail (self->key_index, NULL);
+
+  if (!key)
+    return NULL;
+
+  iters = g_hash_table_lookup (self->key_index, key);
+
+  if (!iters)
+    return NULL;
+
+  iter = g_queue_peek_tail (iters);
+
+  if (position)
+    *position = g_sequence_iter_get_position (iter);
+
+  entry = g_sequence_get (iter);
+
+  return entry->item;
+}
+
+/**
+ * chatty_indexed_store_update_key:
+ * @self: A #ChattyIndexedStore
+ * @item: (type GObject): An item in @self
+ *
+ * Update the index after the key of @item has
+ * changed.  Nothing is done if @item is not in
+ * @self.
+ */
+void
+chatty_indexed_store_update_key (ChattyIndexedStore *self,
+                                 gpointer            item)
+{
+  GSequenceIter *iter;
+
+  g_return_if_fail (CHATTY_IS_INDEXED_STORE (self));
+  g_return_if_fail (item);
+
+  if (!self->key_func)
+    return;
+
+  iter = g_hash_table_lookup (self->item_index, item);
+
+  if (!iter)
+    return;
+
+  store_unindex_key (self, iter);
+  store_index_key (self, iter);
+}
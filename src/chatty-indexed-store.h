@@ -0,0 +1,61 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-indexed-store.h
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/**
+ * ChattyIndexedStoreKeyFunc:
+ * @item: The item to get the key of
+ *
+ * Returns: (transfer full) (nullable): The key of @item.
+ * Items without a key are not indexed.
+ */
+typedef gpointer (*ChattyIndexedStoreKeyFunc) (gpointer item);
+
+#define CHATTY_TYPE_INDEXED_STORE (chatty_indexed_store_get_type ())
+
+G_DECLARE_FINAL_TYPE (ChattyIndexedStore, chatty_indexed_store, CHATTY, INDEXED_STORE, GObject)
+
+ChattyIndexedStore *chatty_indexed_store_new         (GType                      item_type);
+ChattyIndexedStore *chatty_indexed_store_new_full    (GType                      item_type,
+                                                      ChattyIndexedStoreKeyFunc  key_func,
+                                                      GHashFunc                  key_hash,
+                                                      GEqualFunc                 key_equal,
+                                                      GDestroyNotify             key_free);
+void                chatty_indexed_store_append      (ChattyIndexedStore        *self,
+                                                      gpointer                   item);
+void                chatty_indexed_store_insert      (ChattyIndexedStore        *self,
+                                                      guint                      position,
+                                                      gpointer                   item);
+void                chatty_indexed_store_splice      (ChattyIndexedStore        *self,
+                                                      guint                      position,
+                                                      guint                      n_removals,
+                                                      gpointer                  *additions,
+                                                      guint                      n_additions);
+void                chatty_indexed_store_remove      (ChattyIndexedStore        *self,
+                                                      guint                      position);
+gboolean            chatty_indexed_store_remove_item (ChattyIndexedStore        *self,
+                                                      gpointer                   item);
+void                chatty_indexed_store_remove_all  (ChattyIndexedStore        *self);
+gboolean            chatty_indexed_store_find        (ChattyIndexedStore        *self,
+                                                      gpointer                   item,
+                                                      guint                     *position);
+gpointer            chatty_indexed_store_lookup      (ChattyIndexedStore        *self,
+                                                      gconstpointer              key,
+                                                      guint                     *position);
+void                chatty_indexed_store_update_key  (ChattyIndexedStore        *self,
+                                                      gpointer                   item);
+
+G_END_DECLS
@@ -16,6 +16,7 @@
 #include "users/chatty-contact.h"
 #include "chatty-chat.h"
 #include "chatty-avatar.h"
+#include "chatty-markup.h"
 #include "chatty-utils.h"
 #include "chatty-list-row.h"
 
@@ -36,6 +37,8 @@ struct _ChattyListRow
   GtkWidget     *unread_message_count;
 
   ChattyItem    *item;
+  /* The last message text shown in subtitle */
+  char          *last_message;
   gboolean       hide_chat_details;
 };
 
@@ -276,10 +279,15 @@ chatty_list_row_update (ChattyListRow *self)
     last_message = chatty_chat_get_last_message (item);
 
     gtk_widget_set_visible (self->subtitle, last_message && *last_message);
-    if (last_message && *last_message) {
+
+    /* Strip the message only if it has changed since the last refresh */
+    if (last_message && *last_message &&
+        g_strcmp0 (last_message, self->last_message) != 0) {
       g_autofree char *message_stripped = NULL;
 
-      message_stripped = purple_markup_strip_html (last_message);
+      g_free (self->last_message);
+      self->last_message = g_strdup (last_message);
+      message_stripped = chatty_markup_strip (last_message);
       g_strstrip (message_stripped);
 
       gtk_label_set_label (GTK_LABEL (self->subtitle), message_stripped);
@@ -316,6 +324,7 @@ chatty_list_row_finalize (GObject *object)
   ChattyListRow *self = (ChattyListRow *)object;
 
   g_clear_object (&self->item);
+  g_free (self->last_message);
 
   G_OBJECT_CLASS (chatty_list_row_parent_class)->finalize (object);
 }
@@ -403,6 +412,7 @@ chatty_list_row_set_item (ChattyListRow *self,
                     CHATTY_IS_CHAT (item));
 
   g_set_object (&self->item, item);
+  g_clear_pointer (&self->last_message, g_free);
   chatty_avatar_set_item (CHATTY_AVATAR (self->avatar), item);
   g_object_bind_property (item, "name",
                           self->title, "label",
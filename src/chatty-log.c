@@ -10,18 +10,78 @@
  */
 
 #include <glib.h>
+#include <glib-unix.h>
+#include <signal.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "chatty-log.h"
 
 #define DEFAULT_DOMAIN "chatty"
 
+/* Number of recent log records kept for the flight recorder */
+#define N_RECENT_RECORDS   512
+/* Number of recent log records printed on a critical */
+#define N_CRITICAL_RECORDS 64
+#define RECENT_DOMAIN_LEN  32
+#define RECENT_MESSAGE_LEN 224
+
+typedef struct _LogRecord LogRecord;
+
+struct _LogRecord
+{
+  LogRecord      *next;
+  GLogLevelFlags  log_level;
+  gint64          time;
+  char           *log_domain;
+  char           *message;
+};
+
+typedef struct {
+  gint64         time;
+  GLogLevelFlags log_level;
+  char           log_domain[RECENT_DOMAIN_LEN];
+  char           message[RECENT_MESSAGE_LEN];
+} RecentRecord;
+
 char *domains;
 static int verbosity;
 gboolean any_domain;
 gboolean stderr_is_journal;
 
+/*
+ * Log lines are formatted and written in writer_thread.  Records
+ * are pushed to pending_records (newest first) without any lock,
+ * and the writer takes the whole list at once.
+ */
+static LogRecord *pending_records;
+static GThread   *writer_thread;
+static int        writer_running;
+static GMutex     wakeup_lock;
+static GCond      wakeup_cond;
+
+/* Held while writing to the streams, so that lines are in order.
+ * The variables below are accessed only with write_lock held */
+static GMutex     write_lock;
+static gint64     cached_second = -1;
+static char       cached_time[16];
+static gboolean   stdout_color;
+static gboolean   stderr_color;
+static int        log_pid;
+
+/*
+ * Ring of the latest records, kept regardless of the verbosity.
+ * Hidden records use a coarse clock, and are only copied to the
+ * preallocated slots, so that they stay cheap.
+ */
+static RecentRecord recent_records[N_RECENT_RECORDS];
+static int          recent_head;
+/* The head when recent records were last printed on a critical,
+ * accessed only with write_lock held */
+static guint        recent_dumped;
+
 static void
 log_str_append_log_domain (GString    *log_str,
                            const char *log_domain,
@@ -87,68 +147,319 @@ get_log_level_prefix (GLogLevelFlags log_level,
     }
 }
 
-static GLogWriterOutput
-chatty_log_write (GLogLevelFlags   log_level,
-                  const char      *log_domain,
-                  const char      *log_message,
-                  const GLogField *fields,
-                  gsize            n_fields,
-                  gpointer         user_data)
+/* Should be called with write_lock held */
+static void
+log_str_append_time (GString *log_str,
+                     gint64   time)
+{
+  gint64 second;
+
+  second = time / G_USEC_PER_SEC;
+
+  /* Format the time only once a second */
+  if (second != cached_second) {
+    struct tm tm_now;
+    time_t sec_now;
+
+    sec_now = second;
+    localtime_r (&sec_now, &tm_now);
+    strftime (cached_time, sizeof (cached_time), "%H:%M:%S", &tm_now);
+    cached_second = second;
+  }
+
+  g_string_append_printf (log_str, "%s.%04d ", cached_time,
+                          (int)((time % G_USEC_PER_SEC) / 100));
+}
+
+static void
+log_record_free (LogRecord *record)
+{
+  g_free (record->log_domain);
+  g_free (record->message);
+  g_free (record);
+}
+
+/* Should be called with write_lock held */
+static void
+log_write_record (LogRecord *record,
+                  GString   *log_str)
 {
-  g_autoptr(GString) log_str = NULL;
   FILE *stream;
   gboolean can_color;
 
-  if (stderr_is_journal)
-    if (g_log_writer_journald (log_level, fields, n_fields, user_data) == G_LOG_WRITER_HANDLED)
-      return G_LOG_WRITER_HANDLED;
-
-  if (log_level & (G_LOG_LEVEL_ERROR |
-                   G_LOG_LEVEL_CRITICAL | G_LOG_LEVEL_WARNING))
+  if (record->log_level & (G_LOG_LEVEL_ERROR |
+                           G_LOG_LEVEL_CRITICAL | G_LOG_LEVEL_WARNING)) {
     stream = stderr;
-  else
+    can_color = stderr_color;
+  } else {
     stream = stdout;
+    can_color = stdout_color;
+  }
 
-  log_str = g_string_new (NULL);
+  g_string_truncate (log_str, 0);
+  log_str_append_time (log_str, record->time);
+  log_str_append_log_domain (log_str, record->log_domain, can_color);
+  g_string_append_printf (log_str, "[%5d]:", log_pid);
 
-  /* Add local time */
-  {
-    char buffer[32];
-    struct tm tm_now;
-    time_t sec_now;
-    gint64 now;
+  g_string_append_printf (log_str, "%s: ", get_log_level_prefix (record->log_level, can_color));
+  g_string_append (log_str, record->message);
+  g_string_append_c (log_str, '\n');
+
+  fputs (log_str->str, stream);
+}
+
+/* Take the pending records, oldest first */
+static LogRecord *
+log_take_pending (void)
+{
+  LogRecord *records, *reversed = NULL;
+
+  do
+    records = g_atomic_pointer_get (&pending_records);
+  while (!g_atomic_pointer_compare_and_exchange (&pending_records, records, NULL));
 
-    now = g_get_real_time ();
-    sec_now = now / G_USEC_PER_SEC;
-    tm_now = *localtime (&sec_now);
-    strftime (buffer, sizeof (buffer), "%H:%M:%S", &tm_now);
+  while (records) {
+    LogRecord *next = records->next;
 
-    g_string_append_printf (log_str, "%s.%04d ", buffer,
-                            (int)((now % G_USEC_PER_SEC) / 100));
+    records->next = reversed;
+    reversed = records;
+    records = next;
   }
 
-  can_color = g_log_writer_supports_color (fileno (stream));
-  log_str_append_log_domain (log_str, log_domain, can_color);
-  g_string_append_printf (log_str, "[%5d]:", getpid ());
+  return reversed;
+}
 
-  g_string_append_printf (log_str, "%s: ", get_log_level_prefix (log_level, can_color));
-  g_string_append (log_str, log_message);
+/* Should be called with write_lock held */
+static void
+log_write_pending (GString *log_str)
+{
+  LogRecord *records;
 
-  fprintf (stream, "%s\n", log_str->str);
-  fflush (stream);
+  records = log_take_pending ();
 
-  return G_LOG_WRITER_HANDLED;
+  if (!records)
+    return;
+
+  while (records) {
+    LogRecord *next = records->next;
+
+    log_write_record (records, log_str);
+    log_record_free (records);
+    records = next;
+  }
+
+  fflush (stdout);
+  fflush (stderr);
+}
+
+static void
+log_push_record (LogRecord *record)
+{
+  LogRecord *head;
+
+  do {
+    head = g_atomic_pointer_get (&pending_records);
+    record->next = head;
+  } while (!g_atomic_pointer_compare_and_exchange (&pending_records, head, record));
+
+  /* The writer may be waiting only if the list was empty */
+  if (!head) {
+    g_mutex_lock (&wakeup_lock);
+    g_cond_signal (&wakeup_cond);
+    g_mutex_unlock (&wakeup_lock);
+  }
+}
+
+static gpointer
+log_writer_thread (gpointer user_data)
+{
+  g_autoptr(GString) log_str = NULL;
+  gboolean running = TRUE;
+
+  log_str = g_string_sized_new (256);
+
+  while (running) {
+    g_mutex_lock (&wakeup_lock);
+    while (!g_atomic_pointer_get (&pending_records) &&
+           g_atomic_int_get (&writer_running))
+      g_cond_wait (&wakeup_cond, &wakeup_lock);
+    running = g_atomic_int_get (&writer_running);
+    g_mutex_unlock (&wakeup_lock);
+
+    g_mutex_lock (&write_lock);
+    log_write_pending (log_str);
+    g_mutex_unlock (&write_lock);
+  }
+
+  return NULL;
+}
+
+/* Copy @src to the fixed size @dest without reading past it */
+static void
+log_copy_to_slot (char       *dest,
+                  const char *src,
+                  gsize       size)
+{
+  gsize len;
+
+  len = strnlen (src, size - 1);
+  memcpy (dest, src, len);
+  dest[len] = '\0';
+}
+
+/* Time accurate to a few milliseconds, cheaper than g_get_real_time() */
+static gint64
+log_get_coarse_time (void)
+{
+#ifdef CLOCK_REALTIME_COARSE
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_REALTIME_COARSE, &ts) == 0)
+    return (gint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+#endif
+
+  return g_get_real_time ();
+}
+
+static void
+log_record_recent (GLogLevelFlags  log_level,
+                   gint64          time,
+                   const char     *log_domain,
+                   const char     *log_message)
+{
+  RecentRecord *record;
+  guint index;
+
+  index = (guint)g_atomic_int_add (&recent_head, 1);
+  record = &recent_records[index % N_RECENT_RECORDS];
+
+  record->time = time;
+  record->log_level = log_level;
+  log_copy_to_slot (record->log_domain, log_domain, sizeof (record->log_domain));
+  log_copy_to_slot (record->message, log_message, sizeof (record->message));
+}
+
+/*
+ * Append the records from @start to the latest one, at most @n_max.
+ * Should be called with write_lock held.  Returns the current head.
+ */
+static guint
+log_str_append_recent (GString *log_str,
+                       guint    start,
+                       guint    n_max)
+{
+  guint head;
+
+  head = (guint)g_atomic_int_get (&recent_head);
+  n_max = MIN (n_max, N_RECENT_RECORDS);
+
+  if (head - start > n_max)
+    start = head - n_max;
+
+  for (guint i = start; i < head; i++) {
+    RecentRecord *record = &recent_records[i % N_RECENT_RECORDS];
+
+    /* The record may be overwritten while we read it */
+    log_str_append_time (log_str, record->time);
+    g_string_append_len (log_str, record->log_domain,
+                         strnlen (record->log_domain, sizeof (record->log_domain) - 1));
+    g_string_append_printf (log_str, ":%s: ", get_log_level_prefix (record->log_level, FALSE));
+    g_string_append_len (log_str, record->message,
+                         strnlen (record->message, sizeof (record->message) - 1));
+    g_string_append_c (log_str, '\n');
+  }
+
+  return head;
+}
+
+/*
+ * Print the recent records from @start, at most @n_max.
+ * Should be called with write_lock held.
+ */
+static guint
+log_dump_recent (guint start,
+                 guint n_max)
+{
+  g_autoptr(GString) log_str = NULL;
+  guint head;
+
+  log_str = g_string_new ("-------- Recent log records --------\n");
+  head = log_str_append_recent (log_str, start, n_max);
+  g_string_append (log_str, "-------- End of recent log records --------\n");
+
+  fputs (log_str->str, stderr);
+  fflush (stderr);
+
+  return head;
+}
+
+static gboolean
+log_sigusr1_cb (gpointer user_data)
+{
+  g_mutex_lock (&write_lock);
+  log_dump_recent (0, N_RECENT_RECORDS);
+  g_mutex_unlock (&write_lock);
+
+  return G_SOURCE_CONTINUE;
 }
 
 static GLogWriterOutput
-chatty_log_handler (GLogLevelFlags   log_level,
-                    const GLogField *fields,
-                    gsize            n_fields,
-                    gpointer         user_data)
+chatty_log_write (GLogLevelFlags   log_level,
+                  gint64           time,
+                  const char      *log_domain,
+                  const char      *log_message,
+                  const GLogField *fields,
+                  gsize            n_fields,
+                  gpointer         user_data)
 {
-  const char *log_domain = NULL;
-  const char *log_message = NULL;
+  LogRecord *record;
+
+  if (stderr_is_journal)
+    if (g_log_writer_journald (log_level, fields, n_fields, user_data) == G_LOG_WRITER_HANDLED)
+      return G_LOG_WRITER_HANDLED;
 
+  record = g_new (LogRecord, 1);
+  record->log_level = log_level;
+  record->time = time;
+  record->log_domain = g_strdup (log_domain);
+  record->message = g_strdup (log_message);
+
+  /*
+   * Errors and criticals may abort, so write them right away, after
+   * the pending ones.  Also write everything synchronously if the
+   * writer isn't running, eg: when exiting.
+   */
+  if ((log_level & (G_LOG_LEVEL_ERROR | G_LOG_LEVEL_CRITICAL)) ||
+      !g_atomic_int_get (&writer_running)) {
+    g_autoptr(GString) log_str = NULL;
+
+    log_str = g_string_sized_new (256);
+
+    g_mutex_lock (&write_lock);
+    log_write_pending (log_str);
+
+    /* Print only what happened since the last critical, so
+     * that repeated criticals don't flood the output */
+    if (log_level & (G_LOG_LEVEL_ERROR | G_LOG_LEVEL_CRITICAL))
+      recent_dumped = log_dump_recent (recent_dumped, N_CRITICAL_RECORDS);
+
+    log_write_record (record, log_str);
+    fflush (stdout);
+    fflush (stderr);
+    g_mutex_unlock (&write_lock);
+
+    log_record_free (record);
+  } else {
+    log_push_record (record);
+  }
+
+  return G_LOG_WRITER_HANDLED;
+}
+
+static gboolean
+log_should_write (GLogLevelFlags  log_level,
+                  const char     *log_domain)
+{
   /* If domain is “all” show logs upto debug regardless of the verbosity */
   switch ((int)log_level)
     {
@@ -156,32 +467,61 @@ chatty_log_handler (GLogLevelFlags   log_level,
       if (any_domain && domains)
         break;
       if (verbosity < 1)
-        return G_LOG_WRITER_HANDLED;
+        return FALSE;
       break;
 
     case G_LOG_LEVEL_INFO:
       if (any_domain && domains)
         break;
       if (verbosity < 2)
-        return G_LOG_WRITER_HANDLED;
+        return FALSE;
       break;
 
     case G_LOG_LEVEL_DEBUG:
       if (any_domain && domains)
         break;
       if (verbosity < 3)
-        return G_LOG_WRITER_HANDLED;
+        return FALSE;
       break;
 
     case CHATTY_LOG_LEVEL_TRACE:
       if (verbosity < 4)
-      return G_LOG_WRITER_HANDLED;
+      return FALSE;
       break;
 
     default:
       break;
     }
 
+  /* Skip logs from other domains if verbosity level is low */
+  if (any_domain && !domains &&
+      verbosity < 5 &&
+      log_level > G_LOG_LEVEL_MESSAGE &&
+      !strstr (log_domain, DEFAULT_DOMAIN))
+    return FALSE;
+
+  /* GdkPixbuf logs are too much verbose, skip unless asked not to. */
+  if (g_strcmp0 (log_domain, "GdkPixbuf") == 0 &&
+      !strstr (domains, log_domain))
+    return FALSE;
+
+  if (any_domain)
+    return TRUE;
+
+  return !log_domain || strstr (domains, log_domain);
+}
+
+static GLogWriterOutput
+chatty_log_handler (GLogLevelFlags   log_level,
+                    const GLogField *fields,
+                    gsize            n_fields,
+                    gpointer         user_data)
+{
+  const char *log_domain = NULL;
+  const char *log_message = NULL;
+  gboolean should_write;
+  gint64 time;
+
   for (guint i = 0; (!log_domain || !log_message) && i < n_fields; i++)
     {
       const GLogField *field = &fields[i];
@@ -195,35 +535,41 @@ chatty_log_handler (GLogLevelFlags   log_level,
   if (!log_domain)
     log_domain = "**";
 
-  /* Skip logs from other domains if verbosity level is low */
-  if (any_domain && !domains &&
-      verbosity < 5 &&
-      log_level > G_LOG_LEVEL_MESSAGE &&
-      !strstr (log_domain, DEFAULT_DOMAIN))
-    return G_LOG_WRITER_HANDLED;
-
-  /* GdkPixbuf logs are too much verbose, skip unless asked not to. */
-  if (g_strcmp0 (log_domain, "GdkPixbuf") == 0 &&
-      !strstr (domains, log_domain))
-    return G_LOG_WRITER_HANDLED;
-
   if (!log_message)
     log_message = "(NULL) message";
 
-  if (any_domain)
-    return chatty_log_write (log_level, log_domain, log_message,
-                             fields, n_fields, user_data);
+  should_write = log_should_write (log_level, log_domain);
 
-  if (!log_domain || strstr (domains, log_domain))
-    return chatty_log_write (log_level, log_domain, log_message,
-                             fields, n_fields, user_data);
+  /* Hidden records are only kept in the ring, so a coarse time is enough */
+  if (!should_write) {
+    log_record_recent (log_level, log_get_coarse_time (), log_domain, log_message);
+    return G_LOG_WRITER_HANDLED;
+  }
 
-  return G_LOG_WRITER_HANDLED;
+  time = g_get_real_time ();
+  log_record_recent (log_level, time, log_domain, log_message);
+
+  return chatty_log_write (log_level, time, log_domain, log_message,
+                           fields, n_fields, user_data);
 }
 
 static void
 chatty_log_finalize (void)
 {
+  g_autoptr(GString) log_str = NULL;
+
+  /* Stop the writer, new records are written synchronously from now on */
+  g_mutex_lock (&wakeup_lock);
+  g_atomic_int_set (&writer_running, FALSE);
+  g_cond_signal (&wakeup_cond);
+  g_mutex_unlock (&wakeup_lock);
+  g_clear_pointer (&writer_thread, g_thread_join);
+
+  log_str = g_string_new (NULL);
+  g_mutex_lock (&write_lock);
+  log_write_pending (log_str);
+  g_mutex_unlock (&write_lock);
+
   g_clear_pointer (&domains, g_free);
 }
 
@@ -243,6 +589,13 @@ chatty_log_init (void)
         any_domain = TRUE;
 
       stderr_is_journal = g_log_writer_is_journald (fileno (stderr));
+      stdout_color = g_log_writer_supports_color (fileno (stdout));
+      stderr_color = g_log_writer_supports_color (fileno (stderr));
+      log_pid = getpid ();
+
+      g_atomic_int_set (&writer_running, TRUE);
+      writer_thread = g_thread_new ("chatty-log", log_writer_thread, NULL);
+      g_unix_signal_add (SIGUSR1, log_sigusr1_cb, NULL);
       g_log_set_writer_func (chatty_log_handler, NULL, NULL);
       g_once_init_leave (&initialized, 1);
       atexit (chatty_log_finalize);
@@ -260,3 +613,48 @@ chatty_log_get_verbosity (void)
 {
   return verbosity;
 }
+
+/**
+ * chatty_log_flush:
+ *
+ * Write the log records queued so far.  Log lines
+ * are written in a thread, so this may be required
+ * if the process is about to exit abnormally.
+ */
+void
+chatty_log_flush (void)
+{
+  g_autoptr(GString) log_str = NULL;
+
+  log_str = g_string_new (NULL);
+
+  g_mutex_lock (&write_lock);
+  log_write_pending (log_str);
+  g_mutex_unlock (&write_lock);
+}
+
+/**
+ * chatty_log_get_recent:
+ *
+ * Get the latest log records, including the messages,
+ * infos and warnings not shown due to low verbosity.
+ * Debug and trace records are included only if shown.
+ * The same is printed to stderr when chatty receives
+ * SIGUSR1.  On a critical, only the records since the
+ * previous critical are printed, at most 64.
+ *
+ * Returns: (transfer full): The recent log lines
+ */
+char *
+chatty_log_get_recent (void)
+{
+  GString *log_str;
+
+  log_str = g_string_new (NULL);
+
+  g_mutex_lock (&write_lock);
+  log_str_append_recent (log_str, 0, N_RECENT_RECORDS);
+  g_mutex_unlock (&write_lock);
+
+  return g_string_free (log_str, FALSE);
+}
@@ -11,6 +11,8 @@
 
 #pragma once
 
+#include "chatty-trace.h"
+
 #ifndef CHATTY_LOG_LEVEL_TRACE
 # define CHATTY_LOG_LEVEL_TRACE ((GLogLevelFlags)(1 << G_LOG_LEVEL_USER_SHIFT))
 #endif
@@ -32,15 +34,20 @@
   g_log_structured (G_LOG_DOMAIN, CHATTY_LOG_LEVEL_TRACE,       \
                     "MESSAGE", " TODO: %s():%d: %s",            \
                     G_STRFUNC, __LINE__, _msg)
+/* ENTRY and EXIT/RETURN also begin and end a trace span */
 #define CHATTY_ENTRY                                            \
-  g_log_structured (G_LOG_DOMAIN, CHATTY_LOG_LEVEL_TRACE,       \
-                    "MESSAGE", "ENTRY: %s():%d",                \
-                    G_STRFUNC, __LINE__)
+  G_STMT_START {                                                \
+    g_log_structured (G_LOG_DOMAIN, CHATTY_LOG_LEVEL_TRACE,     \
+                      "MESSAGE", "ENTRY: %s():%d",              \
+                      G_STRFUNC, __LINE__);                     \
+    chatty_trace_begin (G_LOG_DOMAIN, G_STRFUNC);               \
+  } G_STMT_END
 #define CHATTY_EXIT                                             \
   G_STMT_START {                                                \
     g_log_structured (G_LOG_DOMAIN, CHATTY_LOG_LEVEL_TRACE,     \
                       "MESSAGE", " EXIT: %s():%d",              \
                       G_STRFUNC, __LINE__);                     \
+    chatty_trace_end (G_LOG_DOMAIN, G_STRFUNC);                 \
     return;                                                     \
   } G_STMT_END
 #define CHATTY_GOTO(_l)                                         \
@@ -55,9 +62,12 @@
     g_log_structured (G_LOG_DOMAIN, CHATTY_LOG_LEVEL_TRACE,     \
                       "MESSAGE", " EXIT: %s():%d ",             \
                       G_STRFUNC, __LINE__);                     \
+    chatty_trace_end (G_LOG_DOMAIN, G_STRFUNC);                 \
     return _r;                                                  \
   } G_STMT_END
 
 void chatty_log_init               (void);
 void chatty_log_increase_verbosity (void);
 int  chatty_log_get_verbosity      (void);
+void chatty_log_flush              (void);
+char *chatty_log_get_recent        (void);
@@ -24,6 +24,8 @@
 #include "chatty-settings.h"
 #include "contrib/gtk.h"
 #include "chatty-contact-provider.h"
+#include "chatty-indexed-store.h"
+#include "chatty-eviction-manager.h"
 #include "chatty-utils.h"
 #include "chatty-application.h"
 #include "chatty-window.h"
@@ -36,9 +38,11 @@
 #include "chatty-chat.h"
 #include "chatty-pp-chat.h"
 #include "chatty-notification.h"
+#include "chatty-receipts.h"
 #include "chatty-purple-request.h"
 #include "chatty-purple-notify.h"
 #include "chatty-history.h"
+#include "chatty-db-backup.h"
 #include "chatty-manager.h"
 
 /**
@@ -54,6 +58,16 @@
 #define MAX_TIMESTAMP_SIZE 256
 #define CHATTY_UI          "chatty-ui"
 
+/* Databases are backed up once a day, keeping the last few */
+#define BACKUP_INTERVAL    (24 * 60 * 60)
+#define BACKUP_N_KEEP      3
+/*
+ * How often to check if a backup is due.  Timeouts don't run
+ * while the device is suspended, so a day long timeout may
+ * never fire on phones.
+ */
+#define BACKUP_CHECK_INTERVAL (15 * 60)
+
 struct _ChattyManager
 {
   GObject          parent_instance;
@@ -61,7 +75,7 @@ struct _ChattyManager
   ChattyHistory   *history;
   ChattyEds       *chatty_eds;
   GListStore      *account_list;
-  GListStore      *chat_list;
+  ChattyIndexedStore *chat_list;
   GListStore      *list_of_chat_list;
   GListStore      *list_of_user_list;
   GtkFlattenListModel *contact_list;
@@ -69,6 +83,7 @@ struct _ChattyManager
   GtkSorter           *chat_sorter;
 
   ChattyNotification  *notification;
+  ChattyEvictionManager *eviction;
 
   PurplePlugin    *sms_plugin;
   PurplePlugin    *lurch_plugin;
@@ -82,6 +97,19 @@ struct _ChattyManager
 
   gboolean         has_modem;
   ChattyProtocol   active_protocols;
+
+  /* Archived message sync, in number of archives */
+  guint            sync_done;
+  guint            sync_total;
+
+  guint            backup_timeout_id;
+  /* ChattyPpAccount to a GPtrArray of chats waiting for their last message */
+  GHashTable      *pending_chats;
+  guint            pending_chats_id;
+  /* Wall clock time of the last backup, in seconds */
+  gint64           last_backup_time;
+  /* Set once chatty_manager_load_async() is done */
+  gboolean         loaded;
 };
 
 G_DEFINE_TYPE (ChattyManager, chatty_manager, G_TYPE_OBJECT)
@@ -101,6 +129,8 @@ enum {
 enum {
   PROP_0,
   PROP_ACTIVE_PROTOCOLS,
+  PROP_SYNC_PROGRESS,
+  PROP_LOADED,
   N_PROPS
 };
 
@@ -162,47 +192,71 @@ chatty_conv_add_history_since_component (GHashTable *components,
 }
 
 static void
-manager_load_messages_cb (GObject      *object,
-                          GAsyncResult *result,
-                          gpointer      user_data)
+manager_last_messages_loaded_cb (GObject      *object,
+                                 GAsyncResult *result,
+                                 gpointer      user_data)
 {
   ChattyHistory *history = (ChattyHistory *)object;
-  g_autoptr(ChattyManager) self = user_data;
-  g_autoptr(GPtrArray) messages = NULL;
+  g_autoptr(GPtrArray) chats = user_data;
+  g_autoptr(GHashTable) messages = NULL;
   g_autoptr(GError) error = NULL;
-  ChattyPpChat *chat;
+  ChattyManager *self;
 
-  g_assert (CHATTY_IS_MANAGER (self));
   g_assert (CHATTY_IS_HISTORY (history));
 
-  messages = chatty_history_get_messages_finish (history, result, &error);
+  self = chatty_manager_get_default ();
+  messages = chatty_history_get_last_messages_finish (history, result, &error);
 
-  chat = g_object_get_data (G_OBJECT (result), "chat");
+  if (error && !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    g_warning ("Error fetching messages: %s,", error->message);
 
-  if (!CHATTY_IS_PP_CHAT (chat))
-    return;
+  for (guint i = 0; i < chats->len; i++) {
+    ChattyPpChat *chat = chats->pdata[i];
+    GPtrArray *chat_messages = NULL;
 
-  if (!messages)
-    chatty_pp_chat_set_show_notifications (chat, TRUE);
+    if (messages)
+      chat_messages = g_hash_table_lookup (messages, chat);
 
-  if (messages) {
-    if (chatty_pp_chat_get_auto_join (chat)) {
+    if (!chat_messages) {
+      chatty_pp_chat_set_show_notifications (chat, TRUE);
+    } else if (chatty_pp_chat_get_auto_join (chat)) {
       GListModel *model;
       ChattyChat *item;
 
-      item = chatty_manager_add_chat (chatty_manager_get_default (), CHATTY_CHAT (chat));
+      item = chatty_manager_add_chat (self, CHATTY_CHAT (chat));
       model = chatty_chat_get_messages (item);
 
       /* If at least one message is loaded, don’t add again. */
       if (g_list_model_get_n_items (model) == 0) {
-        chatty_pp_chat_prepend_messages (CHATTY_PP_CHAT (item), messages);
+        chatty_pp_chat_prepend_messages (CHATTY_PP_CHAT (item), chat_messages);
         manager_update_protocols (self);
       }
     }
+  }
+}
 
-  } else if (error && !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
-    g_warning ("Error fetching messages: %s,", error->message);
+static gboolean
+manager_load_pending_chats_cb (gpointer user_data)
+{
+  ChattyManager *self = user_data;
+  GHashTableIter iter;
+  gpointer account, chats;
+
+  g_assert (CHATTY_IS_MANAGER (self));
+
+  self->pending_chats_id = 0;
+
+  /* Load the last message of every chat added meanwhile with
+   * a single query per account, rather than one per buddy */
+  g_hash_table_iter_init (&iter, self->pending_chats);
+  while (g_hash_table_iter_next (&iter, &account, &chats)) {
+    chatty_history_get_last_messages_async (self->history, account, chats,
+                                            manager_last_messages_loaded_cb,
+                                            g_ptr_array_ref (chats));
+    g_hash_table_iter_remove (&iter);
   }
+
+  return G_SOURCE_REMOVE;
 }
 
 
@@ -220,7 +274,7 @@ manager_eds_is_ready (ChattyManager *self)
   accounts = chatty_manager_get_accounts (self);
   n_accounts = g_list_model_get_n_items (accounts);
 
-  /* TODO: Optimize */
+  /* Contacts are indexed by number, so this is linear in the number of buddies */
   for (guint i = 0; i < n_accounts; i++) {
     g_autoptr(ChattyAccount) account = NULL;
 
@@ -834,6 +888,8 @@ chatty_conv_write_conversation (PurpleConversation *conv,
       chat_message = chatty_message_new (NULL, message, uuid, 0, msg_type, CHATTY_DIRECTION_OUT, 0);
       chatty_message_set_status (chat_message, CHATTY_STATUS_SENT, 0);
       chatty_pp_chat_append_message (CHATTY_PP_CHAT (chat), chat_message);
+      /* The stanza requesting receipt is already sent, see chatty-xep-0184.c */
+      chatty_receipts_set_message (chatty_receipts_get_default (), chat, chat_message);
     } else if (pcm.flags & PURPLE_MESSAGE_SEND) {
       // offline send (from MAM)
       // FIXME: current list_box does not allow ordering rows by timestamp
@@ -854,7 +910,7 @@ chatty_conv_write_conversation (PurpleConversation *conv,
       chatty_history_add_message (self->history, chat, chat_message);
 
     chatty_chat_set_unread_count (chat, chatty_chat_get_unread_count (chat) + 1);
-    gtk_sorter_changed (self->chat_sorter, GTK_SORTER_CHANGE_DIFFERENT);
+    chatty_eviction_manager_queue_check (self->eviction);
   }
 
   if (chat) {
@@ -992,20 +1048,8 @@ static ChattyPpBuddy *
 manager_find_buddy (GListModel  *model,
                     PurpleBuddy *pp_buddy)
 {
-  guint n_items;
-
-  n_items = g_list_model_get_n_items (model);
-
-  for (guint i = 0; i < n_items; i++) {
-    g_autoptr(ChattyPpBuddy) buddy = NULL;
-
-    buddy = g_list_model_get_item (model, i);
-
-    if (chatty_pp_buddy_get_buddy (buddy) == pp_buddy)
-      return buddy;
-  }
-
-  return NULL;
+  /* Buddies of purple accounts are indexed by their PurpleBuddy */
+  return chatty_indexed_store_lookup (CHATTY_INDEXED_STORE (model), pp_buddy, NULL);
 }
 
 static void
@@ -1019,6 +1063,7 @@ manager_buddy_added_cb (PurpleBuddy   *pp_buddy,
   ChattyContact *contact;
   PurpleAccount *pp_account;
   GListModel *model;
+  GPtrArray *chats;
   const char *id;
 
   g_assert (CHATTY_IS_MANAGER (self));
@@ -1046,14 +1091,24 @@ manager_buddy_added_cb (PurpleBuddy   *pp_buddy,
   if (chat) {
     g_object_ref (chat);
     chatty_pp_chat_set_purple_conv (CHATTY_PP_CHAT (chat), conv);
+    /* The chat may now have a buddy node */
+    chatty_indexed_store_update_key (self->chat_list, chat);
   } else {
     chat = (ChattyChat *)chatty_pp_chat_new_im_chat (pp_account, pp_buddy,
                                                      !!self->lurch_plugin);
   }
 
-  chatty_history_get_messages_async (self->history, chat, NULL, 1,
-                                     manager_load_messages_cb,
-                                     g_object_ref (self));
+  chats = g_hash_table_lookup (self->pending_chats, account);
+
+  if (!chats) {
+    chats = g_ptr_array_new_with_free_func (g_object_unref);
+    g_hash_table_insert (self->pending_chats, g_object_ref (account), chats);
+  }
+
+  g_ptr_array_add (chats, g_steal_pointer (&chat));
+
+  if (!self->pending_chats_id)
+    self->pending_chats_id = g_idle_add (manager_load_pending_chats_cb, self);
 }
 
 static void
@@ -1083,7 +1138,7 @@ manager_buddy_removed_cb (PurpleBuddy   *pp_buddy,
   g_return_if_fail (buddy);
 
   g_signal_emit_by_name (buddy, "deleted");
-  chatty_utils_remove_list_item (G_LIST_STORE (model), buddy);
+  chatty_indexed_store_remove_item (CHATTY_INDEXED_STORE (model), buddy);
 }
 
 
@@ -1284,14 +1339,12 @@ manager_conversation_buddy_leaving_cb (PurpleConversation *conv,
   return TRUE;
 }
 
-static gboolean
-auto_join_chat_cb (gpointer data)
+static void
+manager_auto_join_chats (PurpleAccount *account)
 {
   PurpleBlistNode  *node;
-  PurpleConnection *pc = data;
   GHashTable               *components;
   PurplePluginProtocolInfo *prpl_info;
-  PurpleAccount    *account = purple_connection_get_account (pc);
 
   for (node = purple_blist_get_root (); node;
        node = purple_blist_node_next (node, FALSE)) {
@@ -1317,16 +1370,45 @@ auto_join_chat_cb (gpointer data)
       }
     }
   }
-
-  return FALSE;
 }
 
+static void
+manager_last_times_loaded_cb (GObject      *object,
+                              GAsyncResult *result,
+                              gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+  PurpleAccount *account = user_data;
+
+  if (!chatty_history_load_last_message_times_finish (CHATTY_HISTORY (object), result, &error))
+    g_warning ("Error loading message times: %s", error->message);
+
+  /* The account may have been removed or disconnected meanwhile */
+  if (!g_list_find (purple_accounts_get_all (), account) ||
+      !purple_account_is_connected (account))
+    return;
+
+  /* If loading failed, the times are fetched from the database per room */
+  manager_auto_join_chats (account);
+}
 
 static gboolean
 manager_connection_autojoin_cb (PurpleConnection *gc,
                                 gpointer          user_data)
 {
-  g_idle_add (auto_join_chat_cb, gc);
+  ChattyManager *self = user_data;
+  PurpleAccount *account;
+
+  g_assert (CHATTY_IS_MANAGER (self));
+
+  account = purple_connection_get_account (gc);
+
+  /* Load the last message time of all rooms at once, so that
+   * history_since of each room is computed without hitting
+   * the database */
+  chatty_history_load_last_message_times_async (chatty_manager_get_history (self),
+                                                purple_account_get_username (account),
+                                                manager_last_times_loaded_cb, account);
 
   return TRUE;
 }
@@ -1435,24 +1517,30 @@ manager_connection_signed_off_cb (PurpleConnection *gc,
   g_object_notify (G_OBJECT (account), "status");
 }
 
-static ChattyChat *
-manager_find_chat (GListModel *model,
-                   PurpleChat *pp_chat)
+/*
+ * Purple chats are indexed by their blist node,
+ * which is the PurpleChat for group chats and
+ * the PurpleBuddy for IMs
+ */
+static gpointer
+manager_chat_get_key (gpointer item)
 {
-  guint n_items;
+  ChattyPpChat *chat = item;
 
-  n_items = g_list_model_get_n_items (model);
-
-  for (guint i = 0; i < n_items; i++) {
-    g_autoptr(ChattyChat) chat = NULL;
+  if (!CHATTY_IS_PP_CHAT (chat))
+    return NULL;
 
-    chat = g_list_model_get_item (model, i);
+  if (chatty_pp_chat_get_purple_chat (chat))
+    return chatty_pp_chat_get_purple_chat (chat);
 
-    if (chatty_pp_chat_get_purple_chat (CHATTY_PP_CHAT (chat)) == pp_chat)
-      return chat;
-  }
+  return chatty_pp_chat_get_purple_buddy (chat);
+}
 
-  return NULL;
+static ChattyChat *
+manager_find_chat (ChattyIndexedStore *store,
+                   PurpleChat         *pp_chat)
+{
+  return chatty_indexed_store_lookup (store, pp_chat, NULL);
 }
 
 static void
@@ -1730,19 +1818,74 @@ chatty_manager_get_property (GObject    *object,
       g_value_set_int (value, chatty_manager_get_active_protocols (self));
       break;
 
+    case PROP_SYNC_PROGRESS:
+      g_value_set_double (value, chatty_manager_get_sync_progress (self));
+      break;
+
+    case PROP_LOADED:
+      g_value_set_boolean (value, self->loaded);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
 }
 
 
+static void
+manager_chat_sort_changed_cb (ChattyManager *self,
+                              ChattyChat    *chat)
+{
+  g_assert (CHATTY_IS_MANAGER (self));
+  g_assert (CHATTY_IS_CHAT (chat));
+
+  /* Only the last message of @chat may have changed, so move just @chat */
+  gtk_sort_list_model_item_changed (self->sorted_chat_list, chat);
+}
+
+static void
+manager_chat_list_changed_cb (ChattyManager *self,
+                              guint          position,
+                              guint          removed,
+                              guint          added,
+                              GListModel    *model)
+{
+  g_assert (CHATTY_IS_MANAGER (self));
+  g_assert (G_IS_LIST_MODEL (model));
+
+  /* Keep chats of every protocol sorted as their messages change */
+  for (guint i = position; i < position + added; i++) {
+    g_autoptr(ChattyChat) chat = NULL;
+
+    chat = g_list_model_get_item (model, i);
+
+    if (g_object_get_data (G_OBJECT (chat), "sort-changed-id"))
+      continue;
+
+    g_object_set_data (G_OBJECT (chat), "sort-changed-id",
+                       GUINT_TO_POINTER (g_signal_connect_object (chat, "changed",
+                                                                  G_CALLBACK (manager_chat_sort_changed_cb),
+                                                                  self, G_CONNECT_SWAPPED)));
+  }
+}
+
 static void
 chatty_manager_dispose (GObject *object)
 {
   ChattyManager *self = (ChattyManager *)object;
+  GApplication *app;
+
+  app = g_application_get_default ();
+
+  if (app)
+    g_action_map_remove_action (G_ACTION_MAP (app), "open-chat");
 
   purple_signals_disconnect_by_handle (self);
+  g_clear_handle_id (&self->backup_timeout_id, g_source_remove);
+  g_clear_handle_id (&self->pending_chats_id, g_source_remove);
+  g_clear_pointer (&self->pending_chats, g_hash_table_unref);
   g_clear_object (&self->notification);
+  g_clear_object (&self->eviction);
   g_clear_object (&self->chatty_eds);
   g_clear_object (&self->chat_list);
   g_clear_object (&self->list_of_chat_list);
@@ -1790,6 +1933,33 @@ chatty_manager_class_init (ChattyManagerClass *klass)
                       CHATTY_PROTOCOL_NONE,
                       G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
 
+  /**
+   * ChattyManager:sync-progress:
+   *
+   * The fraction of message archives synced, 1.0 if
+   * no archive is being synced.
+   */
+  properties[PROP_SYNC_PROGRESS] =
+    g_param_spec_double ("sync-progress",
+                         "Sync progress",
+                         "The fraction of message archives synced",
+                         0.0, 1.0, 1.0,
+                         G_PARAM_READABLE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * ChattyManager:loaded:
+   *
+   * Whether the databases and libpurple are loaded.
+   * Actions that need libpurple should be disabled
+   * till this is set.
+   */
+  properties[PROP_LOADED] =
+    g_param_spec_boolean ("loaded",
+                          "Loaded",
+                          "Whether the databases and libpurple are loaded",
+                          FALSE,
+                          G_PARAM_READABLE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS);
+
   g_object_class_install_properties (object_class, N_PROPS, properties);
 
 
@@ -1885,29 +2055,48 @@ chatty_manager_class_init (ChattyManagerClass *klass)
 }
 
 static void
-notification_open_chat_cb (ChattyManager *self,
-                           ChattyChat    *chat)
+manager_open_chat_action (GSimpleAction *action,
+                          GVariant      *parameter,
+                          gpointer       user_data)
 {
+  ChattyManager *self = user_data;
+  g_autoptr(ChattyChat) chat = NULL;
+
   g_assert (CHATTY_IS_MANAGER (self));
-  g_assert (CHATTY_IS_CHAT (chat));
 
-  g_signal_emit (self,  signals[OPEN_CHAT], 0, chat);
+  chat = chatty_notification_lookup_chat (g_variant_get_string (parameter, NULL));
+
+  if (chat)
+    g_signal_emit (self,  signals[OPEN_CHAT], 0, chat);
 }
 
+static const GActionEntry manager_actions[] = {
+  { "open-chat", manager_open_chat_action, "s" },
+};
+
 static void
 chatty_manager_init (ChattyManager *self)
 {
   g_autoptr(GtkFlattenListModel) flatten_list = NULL;
+  GApplication *app;
 
   self->notification = chatty_notification_new ();
-  g_signal_connect_object (self->notification, "open-chat",
-                           G_CALLBACK (notification_open_chat_cb),
-                           self, G_CONNECT_SWAPPED);
+  self->pending_chats = g_hash_table_new_full (g_direct_hash, g_direct_equal, g_object_unref,
+                                               (GDestroyNotify)g_ptr_array_unref);
+
+  /* The manager outlives every chat, so it owns the action
+   * used by the notifications of all chats */
+  app = g_application_get_default ();
+
+  if (app)
+    g_action_map_add_action_entries (G_ACTION_MAP (app), manager_actions,
+                                     G_N_ELEMENTS (manager_actions), self);
 
   self->chatty_eds = chatty_eds_new (CHATTY_PROTOCOL_SMS);
   self->account_list = g_list_store_new (CHATTY_TYPE_ACCOUNT);
 
-  self->chat_list = g_list_store_new (CHATTY_TYPE_CHAT);
+  self->chat_list = chatty_indexed_store_new_full (CHATTY_TYPE_CHAT, manager_chat_get_key,
+                                                   NULL, NULL, NULL);
   self->list_of_chat_list = g_list_store_new (G_TYPE_LIST_MODEL);
   self->list_of_user_list = g_list_store_new (G_TYPE_LIST_MODEL);
   g_list_store_append (self->list_of_chat_list, G_LIST_MODEL (self->chat_list));
@@ -1924,6 +2113,15 @@ chatty_manager_init (ChattyManager *self)
                                              G_LIST_MODEL (self->list_of_chat_list));
   self->sorted_chat_list = gtk_sort_list_model_new (G_LIST_MODEL (flatten_list),
                                                     self->chat_sorter);
+  g_signal_connect_object (flatten_list, "items-changed",
+                           G_CALLBACK (manager_chat_list_changed_cb), self,
+                           G_CONNECT_SWAPPED);
+
+  self->eviction = chatty_eviction_manager_new (G_LIST_MODEL (self->sorted_chat_list));
+  g_object_bind_property (chatty_settings_get_default (), "inactive-chat-messages",
+                          self->eviction, "inactive-messages", G_BINDING_SYNC_CREATE);
+  g_object_bind_property (chatty_settings_get_default (), "message-memory-budget",
+                          self->eviction, "memory-budget", G_BINDING_SYNC_CREATE);
 
   g_signal_connect_object (self->chatty_eds, "notify::is-ready",
                            G_CALLBACK (manager_eds_is_ready), self,
@@ -1982,6 +2180,9 @@ chat_changed_cb (ChattyManager *self,
 
   if (CHATTY_IS_MA_CHAT (chat))
     chatty_ma_chat_show_notification (CHATTY_MA_CHAT (chat));
+
+  /* New messages may have been added */
+  chatty_eviction_manager_queue_check (self->eviction);
 }
 
 static void
@@ -2051,45 +2252,221 @@ manager_secret_load_cb (GObject      *object,
   g_list_store_splice (self->account_list, 0, 0, accounts->pdata, accounts->len);
 }
 
+static void
+manager_history_backup_cb (GObject      *object,
+                           GAsyncResult *result,
+                           gpointer      user_data)
+{
+  g_autofree char *path = NULL;
+  g_autoptr(GError) error = NULL;
+
+  path = chatty_history_backup_finish (CHATTY_HISTORY (object), result, &error);
+
+  if (error)
+    g_warning ("Error backing up history DB: %s", error->message);
+  else
+    g_info ("History DB backed up to %s", path);
+}
+
+static void
+manager_history_maintain_cb (GObject      *object,
+                             GAsyncResult *result,
+                             gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (!chatty_history_maintain_finish (CHATTY_HISTORY (object), result, &error))
+    g_warning ("Error cleaning up history DB: %s", error->message);
+}
+
+static void
+manager_matrix_db_backup_cb (GObject      *object,
+                             GAsyncResult *result,
+                             gpointer      user_data)
+{
+  g_autofree char *path = NULL;
+  g_autoptr(GError) error = NULL;
+
+  path = matrix_db_backup_finish (MATRIX_DB (object), result, &error);
+
+  if (error)
+    g_warning ("Error backing up matrix DB: %s", error->message);
+  else
+    g_info ("Matrix DB backed up to %s", path);
+}
+
+static gboolean
+manager_backup_timeout_cb (gpointer user_data)
+{
+  ChattyManager *self = user_data;
+  gint64 now;
+
+  g_assert (CHATTY_IS_MANAGER (self));
+
+  now = g_get_real_time () / G_USEC_PER_SEC;
+
+  /* Also run if the clock was set back before the last backup */
+  if (now >= self->last_backup_time &&
+      now - self->last_backup_time < BACKUP_INTERVAL)
+    return G_SOURCE_CONTINUE;
+
+  self->last_backup_time = now;
+
+  /* Old data is cleaned up after the backup is taken */
+  if (chatty_history_is_open (self->history)) {
+    ChattySettings *settings = chatty_settings_get_default ();
+
+    chatty_history_backup_async (self->history, BACKUP_N_KEEP, TRUE,
+                                 manager_history_backup_cb, NULL);
+    chatty_history_set_retention (self->history, CHATTY_PROTOCOL_ANY,
+                                  chatty_settings_get_history_max_days (settings),
+                                  chatty_settings_get_history_max_messages (settings));
+    chatty_history_maintain_async (self->history, manager_history_maintain_cb, NULL);
+  }
+
+  if (self->matrix_db && matrix_db_is_open (self->matrix_db))
+    matrix_db_backup_async (self->matrix_db, BACKUP_N_KEEP, TRUE,
+                            manager_matrix_db_backup_cb, NULL);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Backups and history maintenance are run when a day has
+ * passed since the last backup was taken, so that they run
+ * even if chatty is never kept running for a whole day.
+ */
+static void
+manager_schedule_backup (ChattyManager *self)
+{
+  g_autofree char *db_dir = NULL;
+  g_autofree char *db_path = NULL;
+  gint64 last_time;
+
+  g_assert (CHATTY_IS_MANAGER (self));
+
+  if (self->backup_timeout_id)
+    return;
+
+  db_dir = g_build_filename (purple_user_dir (), "chatty", "db", NULL);
+  db_path = g_build_filename (db_dir, "chatty-history.db", NULL);
+  last_time = chatty_db_backup_get_last_time (db_path);
+
+  if (self->matrix_db) {
+    g_free (db_path);
+    db_path = g_build_filename (db_dir, "matrix.db", NULL);
+    last_time = MIN (last_time, chatty_db_backup_get_last_time (db_path));
+  }
+
+  self->last_backup_time = last_time;
+  g_debug ("Last backup at %" G_GINT64_FORMAT, last_time);
+
+  self->backup_timeout_id = g_timeout_add_seconds (BACKUP_CHECK_INTERVAL,
+                                                   manager_backup_timeout_cb,
+                                                   self);
+}
+
+/*
+ * Startup is split into stages so that the window can be shown
+ * while data is loaded.  The history and Matrix databases are
+ * opened in their worker threads while libpurple is initialized
+ * in the main thread.  Accounts are connected only after all of
+ * them are done, as incoming messages need the history.
+ */
+typedef struct {
+  gint64 start_time;
+  guint  n_pending;
+} LoadData;
+
+static void
+manager_load_stage_done (GTask      *task,
+                         const char *stage,
+                         gint64      stage_start)
+{
+  ChattyManager *self;
+  LoadData *data;
+  gint64 now;
+
+  g_assert (G_IS_TASK (task));
+
+  self = g_task_get_source_object (task);
+  data = g_task_get_task_data (task);
+  now = g_get_monotonic_time ();
+  g_assert (CHATTY_IS_MANAGER (self));
+
+  g_info ("Startup: %s took %.1f ms, %.1f ms since start", stage,
+          (now - stage_start) / 1000.0, (now - data->start_time) / 1000.0);
+
+  g_assert (data->n_pending > 0);
+  data->n_pending--;
+
+  if (data->n_pending)
+    return;
+
+  purple_savedstatus_activate (purple_savedstatus_get_startup ());
+  purple_accounts_restore_current_statuses ();
+
+  now = g_get_monotonic_time ();
+  g_info ("Startup: ready in %.1f ms", (now - data->start_time) / 1000.0);
+
+  manager_schedule_backup (self);
+
+  self->loaded = TRUE;
+  g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_LOADED]);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+manager_history_open_cb (GObject      *object,
+                         GAsyncResult *result,
+                         gpointer      user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  g_autoptr(GError) error = NULL;
+  LoadData *data;
+
+  data = g_task_get_task_data (task);
+
+  if (!chatty_history_open_finish (CHATTY_HISTORY (object), result, &error))
+    g_warning ("Failed to open history DB: %s", error ? error->message : "");
+
+  manager_load_stage_done (task, "history", data->start_time);
+}
+
 static void
 matrix_db_open_cb (GObject      *object,
                    GAsyncResult *result,
                    gpointer      user_data)
 {
-  ChattyManager *self = user_data;
+  g_autoptr(GTask) task = user_data;
   g_autoptr(GError) error = NULL;
+  ChattyManager *self;
+  LoadData *data;
 
+  self = g_task_get_source_object (task);
+  data = g_task_get_task_data (task);
   g_assert (CHATTY_IS_MANAGER (self));
 
   if (matrix_db_open_finish (self->matrix_db, result, &error))
     chatty_secret_load_async (NULL, manager_secret_load_cb, self);
   else if (error && !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
     g_warning ("Failed to open Matrix DB: %s", error->message);
+
+  manager_load_stage_done (task, "matrix-db", data->start_time);
 }
 
-void
-chatty_manager_purple (ChattyManager *self)
+static gboolean
+manager_purple_load_cb (gpointer user_data)
 {
-  g_autofree char *search_path = NULL;
-  char *db_path;
-
-  g_return_if_fail (CHATTY_IS_MANAGER (self));
-
-  signal (SIGCHLD, SIG_IGN);
-  signal (SIGPIPE, SIG_IGN);
-
-  purple_core_set_ui_ops (&core_ui_ops);
-  purple_eventloop_set_ui_ops (&eventloop_ui_ops);
+  GTask *task = user_data;
+  ChattyManager *self;
+  gint64 stage_start;
 
-  search_path = g_build_filename (purple_user_dir (), "plugins", NULL);
-  purple_plugins_add_search_path (search_path);
+  self = g_task_get_source_object (task);
+  g_assert (CHATTY_IS_MANAGER (self));
 
-  if (chatty_settings_get_experimental_features (chatty_settings_get_default ())) {
-    self->matrix_db = matrix_db_new ();
-    db_path =  g_build_filename (purple_user_dir(), "chatty", "db", NULL);
-    matrix_db_open_async (self->matrix_db, db_path, "matrix.db",
-                          matrix_db_open_cb, self);
-  }
+  stage_start = g_get_monotonic_time ();
 
   if (!purple_core_init (CHATTY_UI)) {
     g_printerr ("libpurple initialization failed\n");
@@ -2115,13 +2492,104 @@ chatty_manager_purple (ChattyManager *self)
 
   chatty_manager_load_buddies (self);
 
-  purple_savedstatus_activate (purple_savedstatus_get_startup());
-  purple_accounts_restore_current_statuses ();
-
   purple_blist_show ();
 
   g_debug ("libpurple initialized. Running version %s.",
            purple_core_get_version ());
+
+  manager_load_stage_done (task, "purple", stage_start);
+
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * chatty_manager_load_async:
+ * @self: A #ChattyManager
+ * @callback: a #GAsyncReadyCallback, or %NULL
+ * @user_data: closure data for @callback
+ *
+ * Open the databases and initialize libpurple.  The
+ * databases are opened in parallel in their worker
+ * threads, while libpurple is loaded from an idle
+ * callback, so that the UI can be drawn first.
+ * Accounts are connected once everything is loaded.
+ *
+ * The time taken for each stage is logged.
+ */
+void
+chatty_manager_load_async (ChattyManager       *self,
+                           GAsyncReadyCallback  callback,
+                           gpointer             user_data)
+{
+  g_autofree char *search_path = NULL;
+  GTask *task;
+  LoadData *data;
+  char *db_path;
+
+  g_return_if_fail (CHATTY_IS_MANAGER (self));
+
+  data = g_new0 (LoadData, 1);
+  data->start_time = g_get_monotonic_time ();
+  /* history and purple */
+  data->n_pending = 2;
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, chatty_manager_load_async);
+  g_task_set_task_data (task, data, g_free);
+
+  signal (SIGCHLD, SIG_IGN);
+  signal (SIGPIPE, SIG_IGN);
+
+  purple_core_set_ui_ops (&core_ui_ops);
+  purple_eventloop_set_ui_ops (&eventloop_ui_ops);
+
+  search_path = g_build_filename (purple_user_dir (), "plugins", NULL);
+  purple_plugins_add_search_path (search_path);
+
+  db_path = g_build_filename (purple_user_dir (), "chatty", "db", NULL);
+  chatty_history_open_async (chatty_manager_get_history (self), db_path,
+                             "chatty-history.db", manager_history_open_cb,
+                             g_object_ref (task));
+
+  if (chatty_settings_get_experimental_features (chatty_settings_get_default ())) {
+    data->n_pending++;
+    self->matrix_db = matrix_db_new ();
+    db_path = g_build_filename (purple_user_dir (), "chatty", "db", NULL);
+    matrix_db_open_async (self->matrix_db, db_path, "matrix.db",
+                          matrix_db_open_cb, g_object_ref (task));
+  }
+
+  /* Run after pending redraws, so that the window is shown first */
+  g_idle_add_full (G_PRIORITY_LOW, manager_purple_load_cb, task, g_object_unref);
+}
+
+/**
+ * chatty_manager_is_loaded:
+ * @self: A #ChattyManager
+ *
+ * Get if chatty_manager_load_async() is done.
+ *
+ * Returns: %TRUE if the databases and libpurple
+ * are loaded.  %FALSE otherwise.
+ */
+gboolean
+chatty_manager_is_loaded (ChattyManager *self)
+{
+  g_return_val_if_fail (CHATTY_IS_MANAGER (self), FALSE);
+
+  return self->loaded;
+}
+
+gboolean
+chatty_manager_load_finish (ChattyManager  *self,
+                            GAsyncResult   *result,
+                            GError        **error)
+{
+  g_return_val_if_fail (CHATTY_IS_MANAGER (self), FALSE);
+  g_return_val_if_fail (G_IS_TASK (result), FALSE);
+  g_return_val_if_fail (!error || !*error, FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
 }
 
 GListModel *
@@ -2296,6 +2764,50 @@ chatty_manager_get_active_protocols (ChattyManager *self)
   return self->active_protocols;
 }
 
+/**
+ * chatty_manager_get_sync_progress:
+ * @self: A #ChattyManager
+ *
+ * Get the fraction of message archives synced.
+ *
+ * Returns: A value between 0.0 and 1.0, 1.0
+ * if no archive is being synced.
+ */
+double
+chatty_manager_get_sync_progress (ChattyManager *self)
+{
+  g_return_val_if_fail (CHATTY_IS_MANAGER (self), 1.0);
+
+  if (!self->sync_total || self->sync_done >= self->sync_total)
+    return 1.0;
+
+  return (double)self->sync_done / self->sync_total;
+}
+
+/**
+ * chatty_manager_set_sync_progress:
+ * @self: A #ChattyManager
+ * @done: The number of archives synced
+ * @total: The total number of archives to sync
+ *
+ * Set the progress of syncing message archives,
+ * eg: XMPP MAM archives of the account and rooms.
+ */
+void
+chatty_manager_set_sync_progress (ChattyManager *self,
+                                  guint          done,
+                                  guint          total)
+{
+  g_return_if_fail (CHATTY_IS_MANAGER (self));
+
+  if (self->sync_done == done && self->sync_total == total)
+    return;
+
+  self->sync_done = done;
+  self->sync_total = total;
+  g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_SYNC_PROGRESS]);
+}
+
 
 ChattyEds *
 chatty_manager_get_eds (ChattyManager *self)
@@ -2323,7 +2835,7 @@ chatty_manager_update_node (ChattyManager   *self,
   if(!purple_account_is_connected (pp_chat->account))
     return;
 
-  chat = manager_find_chat (G_LIST_MODEL (self->chat_list), pp_chat);
+  chat = manager_find_chat (self->chat_list, pp_chat);
 
   if (chat) {
     g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_ACTIVE_PROTOCOLS]);
@@ -2335,7 +2847,7 @@ chatty_manager_update_node (ChattyManager   *self,
   chat = (ChattyChat *)chatty_pp_chat_new_purple_chat (pp_chat,
                                                        !!self->lurch_plugin);
 
-  g_list_store_append (self->chat_list, chat);
+  chatty_indexed_store_append (self->chat_list, chat);
   chatty_chat_set_data (chat, NULL, self->history);
 }
 
@@ -2370,28 +2882,40 @@ chatty_manager_delete_conversation (ChattyManager      *self,
     gboolean removed;
 
     g_signal_emit (self,  signals[CHAT_DELETED], 0, chat);
-    removed = chatty_utils_remove_list_item (self->chat_list, chat);
+    removed = chatty_indexed_store_remove_item (self->chat_list, chat);
     g_warn_if_fail (removed);
   }
 }
 
 
 static ChattyChat *
-chatty_manager_find_chat (GListModel *model,
-                          ChattyChat *item)
+chatty_manager_find_chat (ChattyIndexedStore *store,
+                          ChattyChat         *item)
 {
-  guint n_items;
+  PurpleConversation *conv;
+  ChattyChat *chat;
 
-  n_items = g_list_model_get_n_items (model);
+  chat = chatty_indexed_store_lookup (store, manager_chat_get_key (item), NULL);
 
-  for (guint i = 0; i < n_items; i++) {
-    g_autoptr(ChattyChat) chat = NULL;
+  if (chat)
+    return chat;
 
-    chat = g_list_model_get_item (model, i);
+  conv = chatty_pp_chat_get_purple_conv (CHATTY_PP_CHAT (item));
 
-    if (chatty_pp_chat_are_same (CHATTY_PP_CHAT (chat), CHATTY_PP_CHAT (item)))
-      return chat;
-  }
+  if (!conv)
+    return NULL;
+
+  /* The chat with the same conversation */
+  chat = conv->ui_data;
+
+  if (chat && chatty_indexed_store_find (store, chat, NULL))
+    return chat;
+
+  /* The chat with the same blist node as the conversation */
+  chat = chatty_indexed_store_lookup (store, chatty_utils_get_conv_blist_node (conv), NULL);
+
+  if (chat && chatty_pp_chat_are_same (CHATTY_PP_CHAT (chat), CHATTY_PP_CHAT (item)))
+    return chat;
 
   return NULL;
 }
@@ -2553,25 +3077,24 @@ chatty_manager_add_chat (ChattyManager *self,
                          ChattyChat    *chat)
 {
   ChattyChat *item;
-  GListModel *model;
 
   g_return_val_if_fail (CHATTY_IS_MANAGER (self), NULL);
   g_return_val_if_fail (CHATTY_IS_CHAT (chat), NULL);
 
-  model = G_LIST_MODEL (self->chat_list);
-
-  if (chatty_utils_get_item_position (model, chat, NULL))
+  if (chatty_indexed_store_find (self->chat_list, chat, NULL))
     item = chat;
   else
-    item = chatty_manager_find_chat (model, chat);
+    item = chatty_manager_find_chat (self->chat_list, chat);
 
-  if (!item) {
-      g_list_store_append (self->chat_list, chat);
-      chatty_chat_set_data (chat, NULL, self->history);
+  /* A new item is inserted sorted, so update only if it’s already there */
+  if (item) {
+    chatty_indexed_store_update_key (self->chat_list, item);
+    gtk_sort_list_model_item_changed (self->sorted_chat_list, item);
+  } else {
+    chatty_indexed_store_append (self->chat_list, chat);
+    chatty_chat_set_data (chat, NULL, self->history);
   }
 
-  gtk_sorter_changed (self->chat_sorter, GTK_SORTER_CHANGE_DIFFERENT);
-
   return item ? item : chat;
 }
 
@@ -2642,8 +3165,27 @@ chatty_manager_get_history (ChattyManager *self)
 {
   g_return_val_if_fail (CHATTY_IS_MANAGER (self), NULL);
 
-  if (!self->history)
+  if (!self->history) {
     self->history = chatty_history_new ();
+    chatty_receipts_set_history (chatty_receipts_get_default (), self->history);
+  }
 
   return self->history;
 }
+
+/**
+ * chatty_manager_get_eviction_manager:
+ * @self: A #ChattyManager
+ *
+ * Get the #ChattyEvictionManager that trims
+ * messages of inactive chats in @self.
+ *
+ * Returns: (transfer none): A #ChattyEvictionManager
+ */
+ChattyEvictionManager *
+chatty_manager_get_eviction_manager (ChattyManager *self)
+{
+  g_return_val_if_fail (CHATTY_IS_MANAGER (self), NULL);
+
+  return self->eviction;
+}
@@ -16,6 +16,7 @@
 #include "users/chatty-pp-account.h"
 #include "chatty-contact-provider.h"
 #include "chatty-history.h"
+#include "chatty-eviction-manager.h"
 #include "chatty-chat.h"
 
 G_BEGIN_DECLS
@@ -29,7 +30,13 @@ G_DECLARE_FINAL_TYPE (ChattyManager, chatty_manager, CHATTY, MANAGER, GObject)
 
 ChattyManager  *chatty_manager_get_default        (void);
 void            chatty_manager_purple_init        (ChattyManager *self);
-void            chatty_manager_purple             (ChattyManager *self);
+void            chatty_manager_load_async         (ChattyManager       *self,
+                                                   GAsyncReadyCallback  callback,
+                                                   gpointer             user_data);
+gboolean        chatty_manager_load_finish        (ChattyManager       *self,
+                                                   GAsyncResult        *result,
+                                                   GError             **error);
+gboolean        chatty_manager_is_loaded          (ChattyManager       *self);
 GListModel     *chatty_manager_get_accounts       (ChattyManager *self);
 GListModel     *chatty_manager_get_contact_list      (ChattyManager *self);
 GListModel     *chatty_manager_get_chat_list         (ChattyManager *self);
@@ -45,6 +52,10 @@ gboolean        chatty_manager_has_carbons_plugin     (ChattyManager   *self);
 gboolean        chatty_manager_has_file_upload_plugin (ChattyManager   *self);
 gboolean        chatty_manager_lurch_plugin_is_loaded (ChattyManager   *self);
 ChattyProtocol  chatty_manager_get_active_protocols   (ChattyManager   *self);
+double          chatty_manager_get_sync_progress      (ChattyManager   *self);
+void            chatty_manager_set_sync_progress      (ChattyManager   *self,
+                                                       guint            done,
+                                                       guint            total);
 ChattyEds      *chatty_manager_get_eds                (ChattyManager   *self);
 void            chatty_manager_update_node            (ChattyManager   *self,
                                                        PurpleBlistNode *node);
@@ -71,5 +82,6 @@ ChattyChat     *chatty_manager_add_chat               (ChattyManager      *self,
 gboolean        chatty_manager_set_uri                (ChattyManager      *self,
                                                        const char         *uri);
 ChattyHistory  *chatty_manager_get_history            (ChattyManager      *self);
+ChattyEvictionManager *chatty_manager_get_eviction_manager (ChattyManager *self);
 
 G_END_DECLS
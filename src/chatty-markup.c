@@ -0,0 +1,655 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-markup.c
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "chatty-markup"
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <string.h>
+
+#include "chatty-markup.h"
+
+/**
+ * SECTION: chatty-markup
+ * @title: chatty-markup
+ * @short_description: Convert message text to Pango markup
+ * @include: "chatty-markup.h"
+ *
+ * Messages may contain (X)HTML, entities, links and
+ * quoted lines.  The text is tokenized in a single pass
+ * over the message: HTML tags are stripped (and links
+ * in anchors are kept), entities are decoded, URLs and
+ * email addresses are linkified, and lines starting with
+ * ‘>’ are marked as quotes.
+ */
+
+#define QUOTE_COLOR 30000
+
+typedef struct {
+  GString       *out;
+  /* The decoded text of the current word */
+  GString       *token;
+  PangoAttrList *attrs;
+
+  /* Set when inside an <a> tag */
+  GString       *anchor_text;
+  char          *href;
+
+  /* Length of plain text emitted, used for attribute indices */
+  gsize          plain_len;
+  gsize          quote_start;
+  gboolean       in_quote;
+  gboolean       line_start;
+  gboolean       in_anchor;
+  /* Whether to create Pango markup or plain text */
+  gboolean       markup;
+} Renderer;
+
+static const struct {
+  const char *name;
+  const char *value;
+} entities[] = {
+  { "amp", "&" },
+  { "lt", "<" },
+  { "gt", ">" },
+  { "quot", "\"" },
+  { "apos", "'" },
+  { "nbsp", " " },
+  { "copy", "©" },
+  { "reg", "®" },
+};
+
+/* Links are searched in this order, with the href prefix to be used */
+static const struct {
+  const char *prefix;
+  const char *href_prefix;
+} link_prefixes[] = {
+  { "http://", NULL },
+  { "https://", NULL },
+  { "ftp://", NULL },
+  { "sftp://", NULL },
+  { "file://", NULL },
+  { "irc://", NULL },
+  { "ircs://", NULL },
+  { "mailto:", NULL },
+  { "xmpp:", NULL },
+  { "sip:", NULL },
+  { "www.", "http://" },
+  { "ftp.", "ftp://" },
+};
+
+static void
+append_escaped (GString    *str,
+                const char *text,
+                gsize       len)
+{
+  for (gsize i = 0; i < len; i++)
+    switch (text[i])
+      {
+      case '&':
+        g_string_append (str, "&amp;");
+        break;
+
+      case '<':
+        g_string_append (str, "&lt;");
+        break;
+
+      case '>':
+        g_string_append (str, "&gt;");
+        break;
+
+      case '"':
+        g_string_append (str, "&quot;");
+        break;
+
+      case '\'':
+        g_string_append (str, "&apos;");
+        break;
+
+      default:
+        g_string_append_c (str, text[i]);
+      }
+}
+
+/*
+ * Decode the entity at @text into @buffer, which should be
+ * at least 8 bytes long.  Returns the number of bytes of
+ * @text consumed, or 0 if @text doesn’t begin with a known
+ * entity.
+ */
+static gsize
+decode_entity (const char *text,
+               char       *buffer)
+{
+  const char *p;
+
+  g_assert (*text == '&');
+
+  if (text[1] == '#') {
+    gunichar c = 0;
+    gboolean hex;
+
+    hex = text[2] == 'x' || text[2] == 'X';
+    p = text + (hex ? 3 : 2);
+
+    for (guint i = 0; i < 8 && g_ascii_isxdigit (*p); i++, p++) {
+      if (hex)
+        c = c * 16 + g_ascii_xdigit_value (*p);
+      else if (g_ascii_isdigit (*p))
+        c = c * 10 + g_ascii_digit_value (*p);
+      else
+        return 0;
+    }
+
+    if (*p != ';' || c == 0 || !g_unichar_validate (c))
+      return 0;
+
+    buffer[g_unichar_to_utf8 (c, buffer)] = '\0';
+
+    return p - text + 1;
+  }
+
+  for (guint i = 0; i < G_N_ELEMENTS (entities); i++) {
+    gsize len;
+
+    len = strlen (entities[i].name);
+
+    if (strncmp (text + 1, entities[i].name, len) == 0 &&
+        text[len + 1] == ';') {
+      strcpy (buffer, entities[i].value);
+
+      return len + 2;
+    }
+  }
+
+  return 0;
+}
+
+static void
+renderer_end_quote (Renderer *r)
+{
+  PangoAttribute *attribute;
+
+  if (!r->in_quote)
+    return;
+
+  r->in_quote = FALSE;
+
+  if (!r->attrs)
+    r->attrs = pango_attr_list_new ();
+
+  /* Include the newline too */
+  attribute = pango_attr_foreground_new (QUOTE_COLOR, QUOTE_COLOR, QUOTE_COLOR);
+  attribute->start_index = r->quote_start;
+  attribute->end_index = r->plain_len + 1;
+  pango_attr_list_insert (r->attrs, attribute);
+}
+
+static void
+renderer_emit_char (Renderer *r,
+                    char      c)
+{
+  if (r->markup && r->line_start && c == '>') {
+    r->in_quote = TRUE;
+    r->quote_start = r->plain_len;
+  }
+
+  if (c == '\n')
+    renderer_end_quote (r);
+
+  r->line_start = c == '\n';
+
+  if (r->markup)
+    append_escaped (r->out, &c, 1);
+  else
+    g_string_append_c (r->out, c);
+
+  r->plain_len++;
+}
+
+static gsize
+url_get_length (const char *text,
+                gsize       len,
+                gsize       prefix_len)
+{
+  gsize end = 0;
+
+  while (end < len && !strchr ("<>\"", text[end]))
+    end++;
+
+  /* Don’t include trailing punctuations, unless it’s a balanced parenthesis */
+  while (end > prefix_len) {
+    char c = text[end - 1];
+
+    if (strchr (".,;:!?'", c)) {
+      end--;
+    } else if (c == ')') {
+      int depth = 0;
+
+      for (gsize i = 0; i < end; i++)
+        if (text[i] == '(')
+          depth++;
+        else if (text[i] == ')')
+          depth--;
+
+      if (depth >= 0)
+        break;
+
+      end--;
+    } else {
+      break;
+    }
+  }
+
+  return end > prefix_len ? end : 0;
+}
+
+static gsize
+email_get_length (const char *text,
+                  gsize       len)
+{
+  guint n_dots = 0;
+  gsize i = 0, domain;
+
+  while (i < len && (g_ascii_isalnum (text[i]) || strchr ("._%+-", text[i])))
+    i++;
+
+  if (i == 0 || i >= len || text[i] != '@')
+    return 0;
+
+  domain = ++i;
+
+  while (i < len && (g_ascii_isalnum (text[i]) || text[i] == '-' || text[i] == '.')) {
+    if (text[i] == '.')
+      n_dots++;
+    i++;
+  }
+
+  while (i > domain && (text[i - 1] == '.' || text[i - 1] == '-')) {
+    if (text[i - 1] == '.')
+      n_dots--;
+    i--;
+  }
+
+  if (i == domain || n_dots == 0)
+    return 0;
+
+  return i;
+}
+
+static gsize
+find_link (const char  *text,
+           gsize        len,
+           gboolean     try_email,
+           const char **href_prefix)
+{
+  for (guint i = 0; i < G_N_ELEMENTS (link_prefixes); i++) {
+    gsize prefix_len;
+
+    prefix_len = strlen (link_prefixes[i].prefix);
+
+    if (len > prefix_len &&
+        g_ascii_strncasecmp (text, link_prefixes[i].prefix, prefix_len) == 0) {
+      *href_prefix = link_prefixes[i].href_prefix;
+
+      return url_get_length (text, len, prefix_len);
+    }
+  }
+
+  *href_prefix = "mailto:";
+
+  if (!try_email)
+    return 0;
+
+  return email_get_length (text, len);
+}
+
+static void
+renderer_emit_link (Renderer   *r,
+                    const char *text,
+                    gsize       len,
+                    const char *href_prefix)
+{
+  g_string_append (r->out, "<a href=\"");
+  if (href_prefix)
+    g_string_append (r->out, href_prefix);
+  append_escaped (r->out, text, len);
+  g_string_append (r->out, "\">");
+  append_escaped (r->out, text, len);
+  g_string_append (r->out, "</a>");
+
+  r->plain_len += len;
+  r->line_start = FALSE;
+}
+
+static void
+renderer_flush_token (Renderer *r)
+{
+  const char *token;
+  gboolean has_at;
+  gsize i = 0;
+
+  token = r->token->str;
+  has_at = r->markup && memchr (token, '@', r->token->len);
+
+  while (i < r->token->len) {
+    const char *href_prefix;
+    gsize link_len = 0;
+
+    if (r->markup && (i == 0 || !g_ascii_isalnum (token[i - 1])))
+      link_len = find_link (token + i, r->token->len - i, has_at, &href_prefix);
+
+    if (link_len) {
+      renderer_emit_link (r, token + i, link_len, href_prefix);
+      i += link_len;
+    } else {
+      renderer_emit_char (r, token[i]);
+      i++;
+    }
+  }
+
+  g_string_truncate (r->token, 0);
+}
+
+/* Feed decoded text to the renderer */
+static void
+renderer_feed (Renderer   *r,
+               const char *text,
+               gsize       len)
+{
+  if (r->in_anchor)
+    g_string_append_len (r->anchor_text, text, len);
+
+  for (gsize i = 0; i < len; i++) {
+    char c = text[i];
+
+    if (c == ' ' || c == '\t' || c == '\n') {
+      renderer_flush_token (r);
+      renderer_emit_char (r, c);
+    } else {
+      g_string_append_c (r->token, c);
+    }
+  }
+}
+
+static void
+renderer_start_anchor (Renderer   *r,
+                       const char *attrs,
+                       const char *end)
+{
+  const char *p;
+
+  r->in_anchor = TRUE;
+  g_string_truncate (r->anchor_text, 0);
+  g_clear_pointer (&r->href, g_free);
+
+  for (p = attrs; p + 4 < end; p++) {
+    if (g_ascii_isspace (p[-1]) && g_ascii_strncasecmp (p, "href", 4) == 0)
+      break;
+  }
+
+  if (p + 4 >= end)
+    return;
+
+  p += 4;
+  while (p < end && g_ascii_isspace (*p))
+    p++;
+
+  if (p < end && *p == '=') {
+    g_autoptr(GString) href = NULL;
+    const char *value_end;
+    char quote = 0;
+
+    p++;
+    while (p < end && g_ascii_isspace (*p))
+      p++;
+
+    if (p < end && (*p == '"' || *p == '\''))
+      quote = *p++;
+
+    for (value_end = p; value_end < end; value_end++)
+      if (quote ? *value_end == quote : g_ascii_isspace (*value_end))
+        break;
+
+    href = g_string_sized_new (value_end - p);
+
+    while (p < value_end) {
+      char buffer[8];
+      gsize len = 0;
+
+      if (*p == '&')
+        len = decode_entity (p, buffer);
+
+      if (len) {
+        g_string_append (href, buffer);
+        p += len;
+      } else {
+        g_string_append_c (href, *p++);
+      }
+    }
+
+    r->href = g_string_free (g_steal_pointer (&href), FALSE);
+  }
+}
+
+static void
+renderer_end_anchor (Renderer *r)
+{
+  if (!r->in_anchor)
+    return;
+
+  r->in_anchor = FALSE;
+
+  /* Show the link too if the text doesn’t say it */
+  if (r->href && *r->href &&
+      g_strcmp0 (r->href, r->anchor_text->str) != 0) {
+    renderer_feed (r, " (", 2);
+    renderer_feed (r, r->href, strlen (r->href));
+    renderer_feed (r, ")", 1);
+  }
+
+  g_clear_pointer (&r->href, g_free);
+}
+
+static gboolean
+tag_name_is (const char *name,
+             gsize       len,
+             const char *tag)
+{
+  return strlen (tag) == len && g_ascii_strncasecmp (name, tag, len) == 0;
+}
+
+/*
+ * Handle the tag at @text, and return the position after
+ * the tag, or %NULL if @text isn’t a tag, in which case
+ * ‘<’ should be handled as text.
+ */
+static const char *
+renderer_parse_tag (Renderer   *r,
+                    const char *text)
+{
+  const char *name, *end;
+  gboolean closing;
+  gsize len = 0;
+
+  g_assert (*text == '<');
+
+  if (g_str_has_prefix (text, "<!--")) {
+    end = strstr (text + 4, "-->");
+
+    return end ? end + 3 : text + strlen (text);
+  }
+
+  name = text + 1;
+  closing = *name == '/';
+
+  if (closing)
+    name++;
+
+  if (!g_ascii_isalpha (*name))
+    return NULL;
+
+  end = strchr (name, '>');
+
+  if (!end)
+    return NULL;
+
+  while (g_ascii_isalnum (name[len]))
+    len++;
+
+  if (tag_name_is (name, len, "br") ||
+      tag_name_is (name, len, "hr")) {
+    renderer_feed (r, "\n", 1);
+  } else if (tag_name_is (name, len, "a")) {
+    if (closing)
+      renderer_end_anchor (r);
+    else
+      renderer_start_anchor (r, name + len, end);
+  } else if (!closing &&
+             (tag_name_is (name, len, "script") ||
+              tag_name_is (name, len, "style"))) {
+    const char *p = end;
+
+    /* Skip the content */
+    while ((p = strstr (p, "</"))) {
+      if (g_ascii_strncasecmp (p + 2, name, len) == 0)
+        break;
+
+      p += 2;
+    }
+
+    if (!p || !(p = strchr (p, '>')))
+      return text + strlen (text);
+
+    end = p;
+  } else if (closing &&
+             (tag_name_is (name, len, "p") ||
+              tag_name_is (name, len, "div") ||
+              tag_name_is (name, len, "li") ||
+              tag_name_is (name, len, "tr"))) {
+    /* End of block, start a new line if not already */
+    if (r->token->len || !r->line_start)
+      renderer_feed (r, "\n", 1);
+  }
+
+  return end + 1;
+}
+
+static char *
+markup_render (const char     *text,
+               gboolean        markup,
+               PangoAttrList **quote_attrs)
+{
+  Renderer r = { 0 };
+  const char *p;
+  gsize len;
+
+  len = strlen (text);
+  /* Links and escaped characters need some more space */
+  r.out = g_string_sized_new (markup ? len + len / 4 + 16 : len + 1);
+  r.token = g_string_sized_new (64);
+  r.anchor_text = g_string_new (NULL);
+  r.markup = markup;
+  r.line_start = TRUE;
+
+  for (p = text; *p;) {
+    if (*p == '<') {
+      const char *end;
+
+      end = renderer_parse_tag (&r, p);
+
+      if (end) {
+        p = end;
+        continue;
+      }
+    } else if (*p == '&') {
+      char buffer[8];
+      gsize consumed;
+
+      consumed = decode_entity (p, buffer);
+
+      if (consumed) {
+        renderer_feed (&r, buffer, strlen (buffer));
+        p += consumed;
+        continue;
+      }
+    } else if (*p == '\r') {
+      p++;
+      continue;
+    }
+
+    renderer_feed (&r, p, 1);
+    p++;
+  }
+
+  renderer_flush_token (&r);
+  renderer_end_quote (&r);
+
+  g_string_free (r.token, TRUE);
+  g_string_free (r.anchor_text, TRUE);
+  g_free (r.href);
+
+  if (quote_attrs)
+    *quote_attrs = r.attrs;
+  else if (r.attrs)
+    pango_attr_list_unref (r.attrs);
+
+  return g_string_free (r.out, FALSE);
+}
+
+/**
+ * chatty_markup_render:
+ * @text: A message text, which may contain HTML
+ * @quote_attrs: (out) (optional) (transfer full): return
+ * location for the quote attributes
+ *
+ * Convert @text to Pango markup, with links and
+ * email addresses as anchors.  The attributes for the quoted
+ * lines are set in @quote_attrs, with indices relative
+ * to the text of the markup.  @quote_attrs is set to
+ * %NULL if there are no quotes.
+ *
+ * Returns: (transfer full): The Pango markup for @text.
+ * Free with g_free().
+ */
+char *
+chatty_markup_render (const char     *text,
+                      PangoAttrList **quote_attrs)
+{
+  if (quote_attrs)
+    *quote_attrs = NULL;
+
+  if (!text)
+    return g_strdup ("");
+
+  return markup_render (text, TRUE, quote_attrs);
+}
+
+/**
+ * chatty_markup_strip:
+ * @text: A message text, which may contain HTML
+ *
+ * Get the plain text of @text, with HTML tags stripped
+ * and entities decoded.
+ *
+ * Returns: (transfer full): The plain text.
+ * Free with g_free().
+ */
+char *
+chatty_markup_strip (const char *text)
+{
+  if (!text)
+    return g_strdup ("");
+
+  return markup_render (text, FALSE, NULL);
+}
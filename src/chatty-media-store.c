@@ -0,0 +1,446 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-media-store.c
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "chatty-media-store"
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <glib/gstdio.h>
+
+#include "chatty-media-store.h"
+
+/**
+ * SECTION: chatty-media-store
+ * @title: ChattyMediaStore
+ * @short_description: Content addressed store for media files
+ *
+ * Downloaded and sent files are saved once, named by the SHA-256
+ * hash of their content, as “media/<first 2 characters>/<hash>”
+ * within the chatty cache directory.  So the same file shared in
+ * many chats, or with many accounts, is saved only once, and files
+ * with the same name from different servers don't overwrite each
+ * other.
+ *
+ * The paths returned are relative to the cache directory, as saved
+ * in the history.  The history keeps a count of references for each
+ * file, and removes the files no longer used during maintenance.
+ *
+ * The URL a file was downloaded from is linked to the file in
+ * “media/url”, so that it isn't downloaded again.
+ */
+
+#define HASH_LENGTH 64
+
+struct _ChattyMediaWriter
+{
+  GOutputStream *stream;
+  GChecksum     *checksum;
+  /* The partial file, until complete */
+  char          *tmp_path;
+  char          *url;
+};
+
+static gboolean
+media_store_is_hash (const char *str)
+{
+  if (!str || strlen (str) != HASH_LENGTH)
+    return FALSE;
+
+  for (guint i = 0; i < HASH_LENGTH; i++)
+    if (!g_ascii_isxdigit (str[i]) || g_ascii_isupper (str[i]))
+      return FALSE;
+
+  return TRUE;
+}
+
+static char *
+media_store_get_root (void)
+{
+  return g_build_filename (g_get_user_cache_dir (), "chatty", NULL);
+}
+
+static char *
+media_store_get_url_link (const char *url)
+{
+  g_autofree char *dir = NULL;
+  g_autofree char *hash = NULL;
+
+  dir = chatty_media_store_get_dir ();
+  hash = g_compute_checksum_for_string (G_CHECKSUM_SHA256, url, -1);
+
+  return g_build_filename (dir, "url", hash, NULL);
+}
+
+static void
+media_store_link_url (const char *url,
+                      const char *hash)
+{
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *link_path = NULL;
+  g_autofree char *dir = NULL;
+  g_autofree char *target = NULL;
+
+  link_path = media_store_get_url_link (url);
+  dir = g_path_get_dirname (link_path);
+  g_mkdir_with_parents (dir, S_IRWXU);
+
+  /* A relative link, so that the cache can be moved */
+  target = g_strdup_printf ("../%.2s/%s", hash, hash);
+  file = g_file_new_for_path (link_path);
+  g_remove (link_path);
+
+  if (!g_file_make_symbolic_link (file, target, NULL, &error))
+    g_warning ("Failed to link url to %s: %s", hash, error->message);
+}
+
+static GOutputStream *
+media_store_create_tmp (char         **path,
+                        GCancellable  *cancellable,
+                        GError       **error)
+{
+  g_autoptr(GFile) file = NULL;
+  g_autofree char *store_dir = NULL;
+  g_autofree char *dir = NULL;
+  g_autofree char *name = NULL;
+  GFileOutputStream *stream;
+
+  /* Within the store, so that the file can be renamed to it */
+  store_dir = chatty_media_store_get_dir ();
+  dir = g_build_filename (store_dir, "tmp", NULL);
+  g_mkdir_with_parents (dir, S_IRWXU);
+
+  name = g_strdup_printf ("%08x%08x", g_random_int (), g_random_int ());
+  file = g_file_new_build_filename (dir, name, NULL);
+  stream = g_file_create (file, G_FILE_CREATE_PRIVATE, cancellable, error);
+
+  if (stream)
+    *path = g_file_get_path (file);
+
+  return G_OUTPUT_STREAM (stream);
+}
+
+/* Move @tmp_path to the store, and get the relative path */
+static char *
+media_store_commit (const char  *tmp_path,
+                    const char  *hash,
+                    const char  *url,
+                    GError     **error)
+{
+  g_autofree char *root = NULL;
+  g_autofree char *path = NULL;
+  g_autofree char *dir = NULL;
+  char *relative_path;
+
+  root = media_store_get_root ();
+  relative_path = g_strdup_printf (CHATTY_MEDIA_STORE_DIR "/%.2s/%s", hash, hash);
+  path = g_build_filename (root, relative_path, NULL);
+  dir = g_path_get_dirname (path);
+  g_mkdir_with_parents (dir, S_IRWXU);
+
+  if (g_file_test (path, G_FILE_TEST_IS_REGULAR)) {
+    g_debug ("%s is already in store", hash);
+    g_remove (tmp_path);
+    /* So that it isn't removed as unused before a reference is saved */
+    g_utime (path, NULL);
+  } else if (g_rename (tmp_path, path) != 0) {
+    int saved_errno = errno;
+
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                 "Failed to save %s: %s", hash, g_strerror (saved_errno));
+    g_remove (tmp_path);
+    g_free (relative_path);
+
+    return NULL;
+  }
+
+  if (url && *url)
+    media_store_link_url (url, hash);
+
+  return relative_path;
+}
+
+/**
+ * chatty_media_writer_new:
+ * @url: (nullable): The URL the content is from
+ * @cancellable: (nullable): A #GCancellable
+ * @error: A location for a #GError, or %NULL
+ *
+ * Create a new writer to save a file in the store as
+ * its content is received.
+ *
+ * Returns: (transfer full): A #ChattyMediaWriter, or
+ * %NULL with @error set.
+ */
+ChattyMediaWriter *
+chatty_media_writer_new (const char    *url,
+                         GCancellable  *cancellable,
+                         GError       **error)
+{
+  ChattyMediaWriter *self;
+
+  g_return_val_if_fail (!error || !*error, NULL);
+
+  self = g_new0 (ChattyMediaWriter, 1);
+  self->stream = media_store_create_tmp (&self->tmp_path, cancellable, error);
+
+  if (!self->stream) {
+    chatty_media_writer_free (self);
+    return NULL;
+  }
+
+  self->checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  self->url = g_strdup (url);
+
+  return self;
+}
+
+/**
+ * chatty_media_writer_write:
+ * @self: A #ChattyMediaWriter
+ * @buffer: The content to write
+ * @count: The length of @buffer in bytes
+ * @cancellable: (nullable): A #GCancellable
+ * @error: A location for a #GError, or %NULL
+ *
+ * Write @buffer to the file being saved.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ * with @error set.
+ */
+gboolean
+chatty_media_writer_write (ChattyMediaWriter  *self,
+                           const void         *buffer,
+                           gsize               count,
+                           GCancellable       *cancellable,
+                           GError            **error)
+{
+  g_return_val_if_fail (self, FALSE);
+  g_return_val_if_fail (self->stream, FALSE);
+
+  if (!count)
+    return TRUE;
+
+  if (!g_output_stream_write_all (self->stream, buffer, count, NULL, cancellable, error))
+    return FALSE;
+
+  g_checksum_update (self->checksum, buffer, count);
+
+  return TRUE;
+}
+
+/**
+ * chatty_media_writer_finish:
+ * @self: A #ChattyMediaWriter
+ * @cancellable: (nullable): A #GCancellable
+ * @error: A location for a #GError, or %NULL
+ *
+ * Complete saving the file.  If a file with the same
+ * content is already in the store, the new one is
+ * discarded.
+ *
+ * Returns: (transfer full): The path of the file relative
+ * to the cache directory, or %NULL with @error set.
+ */
+char *
+chatty_media_writer_finish (ChattyMediaWriter  *self,
+                            GCancellable       *cancellable,
+                            GError            **error)
+{
+  char *path;
+
+  g_return_val_if_fail (self, NULL);
+  g_return_val_if_fail (self->stream, NULL);
+
+  if (!g_output_stream_close (self->stream, cancellable, error))
+    return NULL;
+
+  g_clear_object (&self->stream);
+  path = media_store_commit (self->tmp_path, g_checksum_get_string (self->checksum),
+                             self->url, error);
+  g_clear_pointer (&self->tmp_path, g_free);
+
+  return path;
+}
+
+void
+chatty_media_writer_free (ChattyMediaWriter *self)
+{
+  if (!self)
+    return;
+
+  /* Discard incomplete files */
+  if (self->stream)
+    g_output_stream_close (self->stream, NULL, NULL);
+
+  if (self->tmp_path)
+    g_remove (self->tmp_path);
+
+  g_clear_object (&self->stream);
+  g_clear_pointer (&self->checksum, g_checksum_free);
+  g_free (self->tmp_path);
+  g_free (self->url);
+  g_free (self);
+}
+
+/**
+ * chatty_media_store_add_file:
+ * @file_name: The path of a local file
+ * @url: (nullable): The URL of the file, if any
+ * @error: A location for a #GError, or %NULL
+ *
+ * Add a copy of the file @file_name to the store.  The
+ * file is hashed as it's copied, so that later changes
+ * to @file_name don't change the content in the store.
+ *
+ * Returns: (transfer full): The path of the file relative
+ * to the cache directory, or %NULL with @error set.
+ */
+char *
+chatty_media_store_add_file (const char  *file_name,
+                             const char  *url,
+                             GError     **error)
+{
+  g_autoptr(GFileInputStream) stream = NULL;
+  g_autoptr(GOutputStream) tmp_stream = NULL;
+  g_autoptr(GChecksum) checksum = NULL;
+  g_autoptr(GFile) file = NULL;
+  g_autofree char *tmp_path = NULL;
+  g_autofree guchar *buffer = NULL;
+  gssize n_read;
+
+  g_return_val_if_fail (file_name && *file_name, NULL);
+  g_return_val_if_fail (!error || !*error, NULL);
+
+  file = g_file_new_for_path (file_name);
+  stream = g_file_read (file, NULL, error);
+
+  if (!stream)
+    return NULL;
+
+  tmp_stream = media_store_create_tmp (&tmp_path, NULL, error);
+
+  if (!tmp_stream)
+    return NULL;
+
+  /* The hash is of the content copied, even if the file changes meanwhile */
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  buffer = g_malloc (64 * 1024);
+
+  while ((n_read = g_input_stream_read (G_INPUT_STREAM (stream), buffer,
+                                        64 * 1024, NULL, error)) > 0) {
+    g_checksum_update (checksum, buffer, n_read);
+
+    if (!g_output_stream_write_all (tmp_stream, buffer, n_read, NULL, NULL, error)) {
+      n_read = -1;
+      break;
+    }
+  }
+
+  if (n_read < 0 || !g_output_stream_close (tmp_stream, NULL, error)) {
+    g_remove (tmp_path);
+    return NULL;
+  }
+
+  return media_store_commit (tmp_path, g_checksum_get_string (checksum), url, error);
+}
+
+/**
+ * chatty_media_store_lookup_url:
+ * @url: A URL
+ *
+ * Find a file previously saved from @url, if it's
+ * still in the store.
+ *
+ * Returns: (transfer full) (nullable): The path of the
+ * file relative to the cache directory, or %NULL.
+ */
+char *
+chatty_media_store_lookup_url (const char *url)
+{
+  g_autofree char *link_path = NULL;
+  g_autofree char *target = NULL;
+  g_autofree char *hash = NULL;
+  g_autofree char *root = NULL;
+  g_autofree char *path = NULL;
+  char *relative_path;
+
+  if (!url || !*url)
+    return NULL;
+
+  link_path = media_store_get_url_link (url);
+  target = g_file_read_link (link_path, NULL);
+
+  if (!target)
+    return NULL;
+
+  hash = g_path_get_basename (target);
+
+  if (!media_store_is_hash (hash))
+    return NULL;
+
+  root = media_store_get_root ();
+  relative_path = g_strdup_printf (CHATTY_MEDIA_STORE_DIR "/%.2s/%s", hash, hash);
+  path = g_build_filename (root, relative_path, NULL);
+
+  /* The file may have been removed as unused */
+  if (!g_file_test (path, G_FILE_TEST_IS_REGULAR)) {
+    g_remove (link_path);
+    g_free (relative_path);
+
+    return NULL;
+  }
+
+  return relative_path;
+}
+
+/**
+ * chatty_media_store_is_blob:
+ * @path: (nullable): A path relative to the cache directory
+ *
+ * Get if @path is a file in the store.  Such files may
+ * be shared, and so shouldn't be removed directly.
+ *
+ * Returns: %TRUE if @path is in the store.
+ */
+gboolean
+chatty_media_store_is_blob (const char *path)
+{
+  const char *hash;
+
+  if (!path || !g_str_has_prefix (path, CHATTY_MEDIA_STORE_DIR "/"))
+    return FALSE;
+
+  if (strlen (path) != CHATTY_MEDIA_STORE_HASH_START - 1 + HASH_LENGTH)
+    return FALSE;
+
+  hash = path + CHATTY_MEDIA_STORE_HASH_START - 1;
+
+  return media_store_is_hash (hash) &&
+    path[CHATTY_MEDIA_STORE_HASH_START - 2] == '/' &&
+    strncmp (path + strlen (CHATTY_MEDIA_STORE_DIR "/"), hash, 2) == 0;
+}
+
+/**
+ * chatty_media_store_get_dir:
+ *
+ * Returns: (transfer full): The absolute path of the store
+ */
+char *
+chatty_media_store_get_dir (void)
+{
+  return g_build_filename (g_get_user_cache_dir (), "chatty",
+                           CHATTY_MEDIA_STORE_DIR, NULL);
+}
@@ -0,0 +1,49 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-media-store.h
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* The store within the chatty cache directory */
+#define CHATTY_MEDIA_STORE_DIR "media"
+/* Paths of files in the store, relative to the cache directory */
+#define CHATTY_MEDIA_STORE_GLOB CHATTY_MEDIA_STORE_DIR "/??/*"
+/* The 1 based index of the SHA-256 hash in the relative path */
+#define CHATTY_MEDIA_STORE_HASH_START 10
+
+typedef struct _ChattyMediaWriter ChattyMediaWriter;
+
+ChattyMediaWriter *chatty_media_writer_new      (const char         *url,
+                                                 GCancellable       *cancellable,
+                                                 GError            **error);
+gboolean           chatty_media_writer_write    (ChattyMediaWriter  *self,
+                                                 const void         *buffer,
+                                                 gsize               count,
+                                                 GCancellable       *cancellable,
+                                                 GError            **error);
+char              *chatty_media_writer_finish   (ChattyMediaWriter  *self,
+                                                 GCancellable       *cancellable,
+                                                 GError            **error);
+void               chatty_media_writer_free     (ChattyMediaWriter  *self);
+
+char              *chatty_media_store_add_file  (const char         *file_name,
+                                                 const char         *url,
+                                                 GError            **error);
+char              *chatty_media_store_lookup_url (const char        *url);
+gboolean           chatty_media_store_is_blob   (const char         *path);
+char              *chatty_media_store_get_dir   (void);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ChattyMediaWriter, chatty_media_writer_free)
+
+G_END_DECLS
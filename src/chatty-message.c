@@ -15,9 +15,12 @@
 # include "config.h"
 #endif
 
+#include <string.h>
+
 #include "matrix/chatty-ma-buddy.h"
 #include "users/chatty-contact.h"
 #include "users/chatty-pp-buddy.h"
+#include "chatty-markup.h"
 #include "chatty-message.h"
 #include "chatty-utils.h"
 
@@ -38,6 +41,10 @@ struct _ChattyMessage
   char            *uid;
   char            *id;
 
+  /* Rendered lazily from @message */
+  char            *markup;
+  PangoAttrList   *markup_attrs;
+
   ChattyFileInfo  *preview;
   GList           *files;
 
@@ -71,6 +78,8 @@ chatty_message_finalize (GObject *object)
   g_free (self->uid);
   g_free (self->user_name);
   g_free (self->id);
+  g_free (self->markup);
+  g_clear_pointer (&self->markup_attrs, pango_attr_list_unref);
 
   if (self->files)
     g_list_free_full (self->files, (GDestroyNotify)chatty_file_info_free);
@@ -294,6 +303,35 @@ chatty_message_get_text (ChattyMessage *self)
   return self->message;
 }
 
+/**
+ * chatty_message_get_markup:
+ * @self: A #ChattyMessage
+ * @quote_attrs: (out) (optional) (transfer none): return
+ * location for the quote attributes
+ *
+ * Get the message text as Pango markup, see
+ * chatty_markup_render().  The markup is created
+ * on first use and cached as long as @self is alive,
+ * as the message text never changes.
+ *
+ * Returns: (transfer none): The Pango markup for
+ * the message text.
+ */
+const char *
+chatty_message_get_markup (ChattyMessage  *self,
+                           PangoAttrList **quote_attrs)
+{
+  g_return_val_if_fail (CHATTY_IS_MESSAGE (self), "");
+
+  if (!self->markup)
+    self->markup = chatty_markup_render (self->message, &self->markup_attrs);
+
+  if (quote_attrs)
+    *quote_attrs = self->markup_attrs;
+
+  return self->markup;
+}
+
 void
 chatty_message_set_user (ChattyMessage *self,
                          ChattyItem    *sender)
@@ -431,3 +469,48 @@ chatty_message_emit_updated (ChattyMessage *self)
 
   g_signal_emit (self, signals[UPDATED], 0);
 }
+
+static gsize
+message_file_get_size (ChattyFileInfo *file)
+{
+  if (!file)
+    return 0;
+
+  return sizeof (ChattyFileInfo) +
+    (file->file_name ? strlen (file->file_name) + 1 : 0) +
+    (file->url ? strlen (file->url) + 1 : 0) +
+    (file->path ? strlen (file->path) + 1 : 0) +
+    (file->mime_type ? strlen (file->mime_type) + 1 : 0);
+}
+
+/**
+ * chatty_message_get_memory_size:
+ * @self: A #ChattyMessage
+ *
+ * Get an estimate of the memory used by @self,
+ * including the strings and file details it owns.
+ * The sender and other shared objects are not
+ * counted.
+ *
+ * Returns: The size in bytes
+ */
+gsize
+chatty_message_get_memory_size (ChattyMessage *self)
+{
+  gsize size;
+
+  g_return_val_if_fail (CHATTY_IS_MESSAGE (self), 0);
+
+  size = sizeof (ChattyMessage);
+  size += self->message ? strlen (self->message) + 1 : 0;
+  size += self->user_name ? strlen (self->user_name) + 1 : 0;
+  size += self->uid ? strlen (self->uid) + 1 : 0;
+  size += self->id ? strlen (self->id) + 1 : 0;
+  size += self->markup ? strlen (self->markup) + 1 : 0;
+  size += message_file_get_size (self->preview);
+
+  for (GList *node = self->files; node; node = node->next)
+    size += sizeof (GList) + message_file_get_size (node->data);
+
+  return size;
+}
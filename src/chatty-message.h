@@ -12,6 +12,7 @@
 #pragma once
 
 #include <glib-object.h>
+#include <pango/pango.h>
 
 #include "users/chatty-item.h"
 #include "chatty-enums.h"
@@ -53,6 +54,8 @@ guint               chatty_message_get_sms_id      (ChattyMessage      *self);
 void                chatty_message_set_sms_id      (ChattyMessage      *self,
                                                     guint               id);
 const char         *chatty_message_get_text        (ChattyMessage      *self);
+const char         *chatty_message_get_markup      (ChattyMessage      *self,
+                                                    PangoAttrList     **quote_attrs);
 void                chatty_message_set_user        (ChattyMessage      *self,
                                                     ChattyItem         *sender);
 ChattyItem         *chatty_message_get_user        (ChattyMessage      *self);
@@ -68,5 +71,6 @@ void                chatty_message_set_status      (ChattyMessage      *self,
 ChattyMsgType       chatty_message_get_msg_type    (ChattyMessage      *self);
 ChattyMsgDirection  chatty_message_get_msg_direction (ChattyMessage    *self);
 void                chatty_message_emit_updated    (ChattyMessage      *self);
+gsize               chatty_message_get_memory_size (ChattyMessage      *self);
 
 G_END_DECLS
@@ -0,0 +1,385 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-notification-queue.c
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "chatty-notification-queue"
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "chatty-notification-queue.h"
+
+/**
+ * SECTION: chatty-notification-queue
+ * @title: ChattyNotificationQueue
+ * @short_description: Coalesce new message notifications
+ * @include: "chatty-notification-queue.h"
+ *
+ * New messages are collected per chat for #ChattyNotificationQueue:delay
+ * milliseconds, after which #ChattyNotificationQueue::show-summary is
+ * emitted once for every chat with the last message and the number of
+ * messages received in the window.  #ChattyNotificationQueue::feedback
+ * is emitted on the first message of a burst and at most once every
+ * #ChattyNotificationQueue:feedback-interval milliseconds.
+ *
+ * This way a burst of messages results in a single notification per
+ * chat and a single feedback event.
+ */
+
+#define DEFAULT_DELAY             300  /* milliseconds */
+#define DEFAULT_FEEDBACK_INTERVAL 3000 /* milliseconds */
+
+struct _ChattyNotificationQueue
+{
+  GObject     parent_instance;
+
+  /* ChattyChat → Batch */
+  GHashTable *batches;
+  /* Batches in the order of their first message */
+  GQueue      order;
+
+  gint64      last_feedback;
+  guint       delay;
+  guint       feedback_interval;
+  guint       timeout_id;
+};
+
+typedef struct {
+  ChattyChat    *chat;
+  ChattyMessage *message;
+  char          *name;
+  guint          n_messages;
+} Batch;
+
+G_DEFINE_TYPE (ChattyNotificationQueue, chatty_notification_queue, G_TYPE_OBJECT)
+
+enum {
+  PROP_0,
+  PROP_DELAY,
+  PROP_FEEDBACK_INTERVAL,
+  N_PROPS
+};
+
+enum {
+  SHOW_SUMMARY,
+  FEEDBACK,
+  N_SIGNALS
+};
+
+static GParamSpec *properties[N_PROPS];
+static guint signals[N_SIGNALS];
+
+static void
+batch_free (Batch *batch)
+{
+  g_clear_object (&batch->chat);
+  g_clear_object (&batch->message);
+  g_free (batch->name);
+  g_free (batch);
+}
+
+static gboolean
+notification_queue_timeout_cb (gpointer user_data)
+{
+  ChattyNotificationQueue *self = user_data;
+
+  g_assert (CHATTY_IS_NOTIFICATION_QUEUE (self));
+
+  self->timeout_id = 0;
+  chatty_notification_queue_flush (self);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+chatty_notification_queue_get_property (GObject    *object,
+                                        guint       prop_id,
+                                        GValue     *value,
+                                        GParamSpec *pspec)
+{
+  ChattyNotificationQueue *self = (ChattyNotificationQueue *)object;
+
+  switch (prop_id)
+    {
+    case PROP_DELAY:
+      g_value_set_uint (value, self->delay);
+      break;
+
+    case PROP_FEEDBACK_INTERVAL:
+      g_value_set_uint (value, self->feedback_interval);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
+}
+
+static void
+chatty_notification_queue_set_property (GObject      *object,
+                                        guint         prop_id,
+                                        const GValue *value,
+                                        GParamSpec   *pspec)
+{
+  ChattyNotificationQueue *self = (ChattyNotificationQueue *)object;
+
+  switch (prop_id)
+    {
+    case PROP_DELAY:
+      chatty_notification_queue_set_delay (self, g_value_get_uint (value));
+      break;
+
+    case PROP_FEEDBACK_INTERVAL:
+      chatty_notification_queue_set_feedback_interval (self, g_value_get_uint (value));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
+}
+
+static void
+chatty_notification_queue_finalize (GObject *object)
+{
+  ChattyNotificationQueue *self = (ChattyNotificationQueue *)object;
+
+  g_clear_handle_id (&self->timeout_id, g_source_remove);
+  g_hash_table_unref (self->batches);
+  g_queue_foreach (&self->order, (GFunc)batch_free, NULL);
+  g_queue_clear (&self->order);
+
+  G_OBJECT_CLASS (chatty_notification_queue_parent_class)->finalize (object);
+}
+
+static void
+chatty_notification_queue_class_init (ChattyNotificationQueueClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->get_property = chatty_notification_queue_get_property;
+  object_class->set_property = chatty_notification_queue_set_property;
+  object_class->finalize = chatty_notification_queue_finalize;
+
+  properties[PROP_DELAY] =
+    g_param_spec_uint ("delay",
+                       "Delay",
+                       "Time in milliseconds to collect messages",
+                       0, G_MAXUINT, DEFAULT_DELAY,
+                       G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS);
+
+  properties[PROP_FEEDBACK_INTERVAL] =
+    g_param_spec_uint ("feedback-interval",
+                       "Feedback Interval",
+                       "Minimum time in milliseconds between feedbacks",
+                       0, G_MAXUINT, DEFAULT_FEEDBACK_INTERVAL,
+                       G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class, N_PROPS, properties);
+
+  /**
+   * ChattyNotificationQueue::show-summary:
+   * @self: A #ChattyNotificationQueue
+   * @chat: The #ChattyChat
+   * @message: The last #ChattyMessage received in @chat
+   * @n_messages: The number of messages received
+   * @name: (nullable): The sender name of @message
+   *
+   * Emitted once for every chat with new messages
+   * when the delay is over.
+   */
+  signals [SHOW_SUMMARY] =
+    g_signal_new ("show-summary",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0, NULL, NULL, NULL,
+                  G_TYPE_NONE, 4, CHATTY_TYPE_CHAT, CHATTY_TYPE_MESSAGE,
+                  G_TYPE_UINT, G_TYPE_STRING);
+
+  /**
+   * ChattyNotificationQueue::feedback:
+   * @self: A #ChattyNotificationQueue
+   *
+   * Emitted when the user should be alerted of new
+   * messages, eg: with a sound or vibration.
+   */
+  signals [FEEDBACK] =
+    g_signal_new ("feedback",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0, NULL, NULL, NULL,
+                  G_TYPE_NONE, 0);
+}
+
+static void
+chatty_notification_queue_init (ChattyNotificationQueue *self)
+{
+  self->batches = g_hash_table_new (g_direct_hash, g_direct_equal);
+  self->delay = DEFAULT_DELAY;
+  self->feedback_interval = DEFAULT_FEEDBACK_INTERVAL;
+}
+
+/**
+ * chatty_notification_queue_get_default:
+ *
+ * Get the default notification queue
+ *
+ * Returns: (transfer none): A #ChattyNotificationQueue.
+ */
+ChattyNotificationQueue *
+chatty_notification_queue_get_default (void)
+{
+  static ChattyNotificationQueue *self;
+
+  if (!self) {
+    self = chatty_notification_queue_new ();
+    g_object_add_weak_pointer (G_OBJECT (self), (gpointer *)&self);
+  }
+
+  return self;
+}
+
+ChattyNotificationQueue *
+chatty_notification_queue_new (void)
+{
+  return g_object_new (CHATTY_TYPE_NOTIFICATION_QUEUE, NULL);
+}
+
+/**
+ * chatty_notification_queue_set_delay:
+ * @self: A #ChattyNotificationQueue
+ * @delay: The delay in milliseconds
+ *
+ * Set the time to collect messages before
+ * #ChattyNotificationQueue::show-summary is
+ * emitted.  The change applies to the next
+ * batch of messages.
+ */
+void
+chatty_notification_queue_set_delay (ChattyNotificationQueue *self,
+                                     guint                    delay)
+{
+  g_return_if_fail (CHATTY_IS_NOTIFICATION_QUEUE (self));
+
+  if (self->delay == delay)
+    return;
+
+  self->delay = delay;
+  g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_DELAY]);
+}
+
+/**
+ * chatty_notification_queue_set_feedback_interval:
+ * @self: A #ChattyNotificationQueue
+ * @interval: The interval in milliseconds
+ *
+ * Set the minimum time between two
+ * #ChattyNotificationQueue::feedback emissions.
+ */
+void
+chatty_notification_queue_set_feedback_interval (ChattyNotificationQueue *self,
+                                                 guint                    interval)
+{
+  g_return_if_fail (CHATTY_IS_NOTIFICATION_QUEUE (self));
+
+  if (self->feedback_interval == interval)
+    return;
+
+  self->feedback_interval = interval;
+  g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_FEEDBACK_INTERVAL]);
+}
+
+/**
+ * chatty_notification_queue_add:
+ * @self: A #ChattyNotificationQueue
+ * @chat: A #ChattyChat
+ * @message: The new #ChattyMessage in @chat
+ * @name: (nullable): The sender name of @message
+ *
+ * Queue @message to be notified.  If @chat already
+ * has pending messages, @message replaces the last
+ * one and the message count is incremented.
+ */
+void
+chatty_notification_queue_add (ChattyNotificationQueue *self,
+                               ChattyChat              *chat,
+                               ChattyMessage           *message,
+                               const char              *name)
+{
+  Batch *batch;
+  gint64 now;
+
+  g_return_if_fail (CHATTY_IS_NOTIFICATION_QUEUE (self));
+  g_return_if_fail (CHATTY_IS_CHAT (chat));
+  g_return_if_fail (CHATTY_IS_MESSAGE (message));
+
+  batch = g_hash_table_lookup (self->batches, chat);
+
+  if (!batch) {
+    batch = g_new0 (Batch, 1);
+    batch->chat = g_object_ref (chat);
+    g_hash_table_insert (self->batches, chat, batch);
+    g_queue_push_tail (&self->order, batch);
+  }
+
+  g_set_object (&batch->message, message);
+  g_free (batch->name);
+  batch->name = g_strdup (name);
+  batch->n_messages++;
+
+  /* The window starts with the first message, so that a
+   * continuous stream of messages isn't delayed forever */
+  if (!self->timeout_id)
+    self->timeout_id = g_timeout_add (self->delay, notification_queue_timeout_cb, self);
+
+  now = g_get_monotonic_time ();
+
+  if (!self->last_feedback ||
+      now - self->last_feedback >= (gint64)self->feedback_interval * 1000) {
+    self->last_feedback = now;
+    g_signal_emit (self, signals[FEEDBACK], 0);
+  }
+}
+
+/**
+ * chatty_notification_queue_flush:
+ * @self: A #ChattyNotificationQueue
+ *
+ * Emit #ChattyNotificationQueue::show-summary for all
+ * pending chats now, without waiting for the delay.
+ */
+void
+chatty_notification_queue_flush (ChattyNotificationQueue *self)
+{
+  g_autoptr(ChattyNotificationQueue) object = NULL;
+  GQueue batches;
+  Batch *batch;
+
+  g_return_if_fail (CHATTY_IS_NOTIFICATION_QUEUE (self));
+
+  g_clear_handle_id (&self->timeout_id, g_source_remove);
+
+  /* Steal the batches, so that messages added from signal
+   * handlers are queued for the next window */
+  batches = self->order;
+  g_queue_init (&self->order);
+  g_hash_table_remove_all (self->batches);
+
+  object = g_object_ref (self);
+
+  while ((batch = g_queue_pop_head (&batches))) {
+    g_debug ("%u new message(s) in %s", batch->n_messages,
+             chatty_chat_get_chat_name (batch->chat));
+    g_signal_emit (self, signals[SHOW_SUMMARY], 0, batch->chat,
+                   batch->message, batch->n_messages, batch->name);
+    batch_free (batch);
+  }
+}
@@ -0,0 +1,37 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-notification-queue.h
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+#include "chatty-chat.h"
+#include "chatty-message.h"
+
+G_BEGIN_DECLS
+
+#define CHATTY_TYPE_NOTIFICATION_QUEUE (chatty_notification_queue_get_type ())
+
+G_DECLARE_FINAL_TYPE (ChattyNotificationQueue, chatty_notification_queue, CHATTY, NOTIFICATION_QUEUE, GObject)
+
+ChattyNotificationQueue *chatty_notification_queue_get_default           (void);
+ChattyNotificationQueue *chatty_notification_queue_new                   (void);
+void                     chatty_notification_queue_set_delay             (ChattyNotificationQueue *self,
+                                                                          guint                    delay);
+void                     chatty_notification_queue_set_feedback_interval (ChattyNotificationQueue *self,
+                                                                          guint                    interval);
+void                     chatty_notification_queue_add                   (ChattyNotificationQueue *self,
+                                                                          ChattyChat              *chat,
+                                                                          ChattyMessage           *message,
+                                                                          const char              *name);
+void                     chatty_notification_queue_flush                 (ChattyNotificationQueue *self);
+
+G_END_DECLS
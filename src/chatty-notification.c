@@ -11,131 +11,178 @@
 
 #define G_LOG_DOMAIN "chatty-notification"
 
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
 #define LIBFEEDBACK_USE_UNSTABLE_API
 #include <libfeedback.h>
 #include <gtk/gtk.h>
 #include <glib/gi18n.h>
 
+#include "chatty-settings.h"
+#include "chatty-avatar-cache.h"
+#include "chatty-notification-queue.h"
 #include "chatty-notification.h"
 
 
-#define NOTIFICATION_TIMEOUT 300 /* milliseconds */
-
 struct _ChattyNotification
 {
   GObject         parent_instance;
 
-  GNotification  *notification;
-  ChattyChat     *chat; /* unowned */
-  int             timeout_id;
+  /* Chats queued, but not yet shown, unowned */
+  GHashTable     *pending;
 };
 
 G_DEFINE_TYPE (ChattyNotification, chatty_notification, G_TYPE_OBJECT)
 
-enum {
-  OPEN_CHAT,
-  N_SIGNALS
-};
+static void
+weak_ref_free (GWeakRef *ref)
+{
+  g_weak_ref_clear (ref);
+  g_free (ref);
+}
 
-static guint signals[N_SIGNALS];
+/* Chat name → GWeakRef of shown chats.  Shared by all notifications,
+ * as there is a single ‘app.open-chat’ action for all of them. */
+static GHashTable *
+notification_get_chats (void)
+{
+  static GHashTable *chats;
 
-static void   notification_open_chat   (GSimpleAction *action,
-                                        GVariant      *parameter,
-                                        gpointer       user_data);
+  if (!chats)
+    chats = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                   (GDestroyNotify)weak_ref_free);
 
-static const GActionEntry actions[] = {
-  { "open-chat", notification_open_chat },
-};
+  return chats;
+}
 
 static void
-notification_open_chat (GSimpleAction *action,
-                        GVariant      *parameter,
-                        gpointer       user_data)
+feedback_triggered_cb (GObject      *object,
+		       GAsyncResult *result,
+                       gpointer      user_data)
 {
-  ChattyNotification *self = user_data;
+  LfbEvent *event = (LfbEvent *)object;
+  g_autoptr (GError) error = NULL;
 
-  g_assert (CHATTY_IS_NOTIFICATION (user_data));
+  g_assert (LFB_IS_EVENT (event));
 
-  if (self->chat)
-    g_signal_emit (self, signals[OPEN_CHAT], 0, self->chat);
+  if (!lfb_event_trigger_feedback_finish (event, result, &error)) {
+    g_warning ("Failed to trigger feedback for %s",
+	       lfb_event_get_event (event));
+  }
 }
 
-static gboolean
-show_notification (gpointer user_data)
+static void
+notification_queue_feedback_cb (ChattyNotificationQueue *queue)
 {
-  ChattyNotification *self = user_data;
-  GApplication *app;
+  g_autoptr(LfbEvent) event = NULL;
 
-  g_assert (CHATTY_IS_NOTIFICATION (self));
+  event = lfb_event_new ("message-new-instant");
+  lfb_event_trigger_feedback_async (event, NULL,
+                                    feedback_triggered_cb,
+                                    NULL);
+}
 
-  self->timeout_id = 0;
-  app = g_application_get_default ();
+/* All notifications share the same queue, so that a burst of
+ * messages in different chats triggers a single feedback */
+static ChattyNotificationQueue *
+notification_get_queue (void)
+{
+  static ChattyNotificationQueue *queue;
+  ChattySettings *settings;
 
-  if (app)
-    g_application_send_notification (app, "x-chatty.im.received",
-                                     self->notification);
+  if (queue)
+    return queue;
 
-  return G_SOURCE_REMOVE;
+  queue = chatty_notification_queue_get_default ();
+  g_object_add_weak_pointer (G_OBJECT (queue), (gpointer *)&queue);
+  settings = chatty_settings_get_default ();
+
+  g_object_bind_property (settings, "notification-delay",
+                          queue, "delay", G_BINDING_SYNC_CREATE);
+  g_object_bind_property (settings, "feedback-interval",
+                          queue, "feedback-interval", G_BINDING_SYNC_CREATE);
+  g_signal_connect (queue, "feedback",
+                    G_CALLBACK (notification_queue_feedback_cb), NULL);
+
+  return queue;
 }
 
-static GdkPixbuf *
-chatty_manager_round_pixbuf (GdkPixbuf *pixbuf)
+static void
+notification_show_summary_cb (ChattyNotification      *self,
+                              ChattyChat              *chat,
+                              ChattyMessage           *message,
+                              guint                    n_messages,
+                              const char              *name,
+                              ChattyNotificationQueue *queue)
 {
+  g_autofree char *title = NULL;
+  g_autofree char *body = NULL;
+  g_autofree char *id = NULL;
   g_autoptr(GdkPixbuf) image = NULL;
-  cairo_surface_t *surface;
-  GdkPixbuf *round;
-  cairo_t *cr;
-  int width, height, size;
+  g_autoptr(GNotification) notification = NULL;
+  const char *chat_name;
+  GApplication *app;
+  GdkPixbuf *avatar;
+  ChattyItem *item;
+  GWeakRef *chat_ref;
 
-  if (!pixbuf)
-    return NULL;
+  g_assert (CHATTY_IS_NOTIFICATION (self));
+  g_assert (CHATTY_IS_CHAT (chat));
+  g_assert (CHATTY_IS_MESSAGE (message));
 
-  g_assert (GDK_IS_PIXBUF (pixbuf));
+  /* Not queued by us */
+  if (!g_hash_table_remove (self->pending, chat))
+    return;
 
-  width  = gdk_pixbuf_get_width (pixbuf);
-  height = gdk_pixbuf_get_height (pixbuf);
-  size   = MIN (width, height);
-  image  = gdk_pixbuf_new (GDK_COLORSPACE_RGB, TRUE, 8, size, size);
+  chat_name = chatty_chat_get_chat_name (chat);
 
-  gdk_pixbuf_scale (pixbuf, image, 0, 0,
-                    size, size,
-                    0, 0,
-                    (double)size / width,
-                    (double)size / height,
-                    GDK_INTERP_BILINEAR);
+  if (!chat_name)
+    chat_name = "";
 
-  surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, size, size);
-  cr = cairo_create (surface);
-  gdk_cairo_set_source_pixbuf (cr, image, 0, 0);
+  chat_ref = g_new0 (GWeakRef, 1);
+  g_weak_ref_init (chat_ref, chat);
+  g_hash_table_insert (notification_get_chats (), g_strdup (chat_name), chat_ref);
 
-  cairo_arc (cr, size / 2.0, size / 2.0, size / 2.0, 0, 2 * G_PI);
-  cairo_clip (cr);
-  cairo_paint (cr);
+  if (name)
+    title = g_strdup_printf (_("New message from %s"), name);
+  else
+    title = g_strdup (_("Message Received"));
 
-  round = gdk_pixbuf_get_from_surface (surface, 0, 0, size, size);
+  if (n_messages > 1)
+    body = g_strdup_printf (g_dngettext (GETTEXT_PACKAGE, "%u new message",
+                                         "%u new messages", n_messages),
+                            n_messages);
+  else
+    body = g_strdup (chatty_message_get_text (message));
 
-  cairo_surface_destroy (surface);
-  cairo_destroy (cr);
+  item = chatty_message_get_user (message);
 
-  return round;
-}
+  if (!item)
+    item = CHATTY_ITEM (chat);
 
-static void
-feedback_triggered_cb (GObject      *object,
-		       GAsyncResult *result,
-                       gpointer      user_data)
-{
-  g_autoptr (ChattyNotification) self = user_data;
-  LfbEvent *event = (LfbEvent *)object;
-  g_autoptr (GError) error = NULL;
+  avatar = chatty_item_get_avatar (item);
+  image = chatty_avatar_cache_get_round (chatty_avatar_cache_get_default (), avatar);
 
-  g_assert (LFB_IS_EVENT (event));
-  g_assert (CHATTY_IS_NOTIFICATION (self));
+  notification = g_notification_new ("chatty");
+  g_notification_set_default_action (notification, "app.show-window");
+  g_notification_add_button_with_target (notification, _("Open Message"),
+                                         "app.open-chat", "s", chat_name);
 
-  if (!lfb_event_trigger_feedback_finish (event, result, &error)) {
-    g_warning ("Failed to trigger feedback for %s",
-	       lfb_event_get_event (event));
-  }
+  if (image)
+    g_notification_set_icon (notification, G_ICON (image));
+
+  g_notification_set_body (notification, body);
+  g_notification_set_title (notification, title);
+  g_notification_set_priority (notification, G_NOTIFICATION_PRIORITY_HIGH);
+
+  /* One notification per chat, replaced on new messages */
+  id = g_strdup_printf ("x-chatty.im.received.%s", chat_name);
+  app = g_application_get_default ();
+
+  if (app)
+    g_application_send_notification (app, id, notification);
 }
 
 static void
@@ -143,8 +190,7 @@ chatty_notification_finalize (GObject *object)
 {
   ChattyNotification *self = (ChattyNotification *)object;
 
-  g_clear_handle_id (&self->timeout_id, g_source_remove);
-  g_clear_object (&self->notification);
+  g_hash_table_unref (self->pending);
 
   G_OBJECT_CLASS (chatty_notification_parent_class)->finalize (object);
 }
@@ -155,36 +201,15 @@ chatty_notification_class_init (ChattyNotificationClass *klass)
   GObjectClass *object_class = G_OBJECT_CLASS (klass);
 
   object_class->finalize = chatty_notification_finalize;
-
-  /**
-   * ChattyNotification::open-chat:
-   * @self: A #ChattyNotification
-   * @chat: A #ChattyChat
-   *
-   * Emit when requested to open @chat.
-   */
-  signals [OPEN_CHAT] =
-    g_signal_new ("open-chat",
-                  G_TYPE_FROM_CLASS (klass),
-                  G_SIGNAL_RUN_LAST,
-                  0, NULL, NULL, NULL,
-                  G_TYPE_NONE, 1, CHATTY_TYPE_CHAT);
 }
 
 static void
 chatty_notification_init (ChattyNotification *self)
 {
-  GApplication *app;
-
-  self->notification = g_notification_new ("chatty");
-  g_notification_set_default_action (self->notification, "app.show-window");
-  g_notification_add_button (self->notification, _("Open Message"), "app.open-chat");
-
-  app = g_application_get_default ();
-
-  if (app)
-    g_action_map_add_action_entries (G_ACTION_MAP (app), actions,
-                                     G_N_ELEMENTS (actions), self);
+  self->pending = g_hash_table_new (g_direct_hash, g_direct_equal);
+  g_signal_connect_object (notification_get_queue (), "show-summary",
+                           G_CALLBACK (notification_show_summary_cb),
+                           self, G_CONNECT_SWAPPED);
 }
 
 ChattyNotification *
@@ -194,52 +219,53 @@ chatty_notification_new (void)
                        NULL);
 }
 
+/**
+ * chatty_notification_show_message:
+ * @self: A #ChattyNotification
+ * @chat: A #ChattyChat
+ * @message: The new #ChattyMessage in @chat
+ * @name: (nullable): The sender name of @message
+ *
+ * Show a notification for @message.  Messages received
+ * within a short time are coalesced into a single
+ * notification per chat, see #ChattyNotificationQueue.
+ */
 void
 chatty_notification_show_message (ChattyNotification *self,
                                   ChattyChat         *chat,
                                   ChattyMessage      *message,
                                   const char         *name)
 {
-  g_autofree char *title = NULL;
-  g_autoptr(GdkPixbuf) image = NULL;
-  g_autoptr(LfbEvent) event = NULL;
-  GdkPixbuf *avatar;
-  ChattyItem *item;
-
   g_return_if_fail (CHATTY_IS_NOTIFICATION (self));
   g_return_if_fail (CHATTY_IS_CHAT (chat));
   g_return_if_fail (CHATTY_IS_MESSAGE (message));
 
-  g_set_weak_pointer (&self->chat, chat);
-
-  if (name)
-    title = g_strdup_printf (_("New message from %s"), name);
-  else
-    title = g_strdup (_("Message Received"));
-
-  item = chatty_message_get_user (message);
-
-  if (!item)
-    item = CHATTY_ITEM (chat);
+  g_hash_table_add (self->pending, chat);
+  chatty_notification_queue_add (notification_get_queue (), chat, message, name);
+}
 
-  avatar = chatty_item_get_avatar (item);
-  image = chatty_manager_round_pixbuf (avatar);
+/**
+ * chatty_notification_lookup_chat:
+ * @chat_name: The target of an ‘app.open-chat’ action
+ *
+ * Find the chat with @chat_name for which a notification
+ * was shown, if it still exists.  The ‘app.open-chat’
+ * action is owned by #ChattyManager, which uses this to
+ * find the chat to open.
+ *
+ * Returns: (transfer full) (nullable): A #ChattyChat
+ */
+ChattyChat *
+chatty_notification_lookup_chat (const char *chat_name)
+{
+  GWeakRef *chat_ref;
 
-  if (image)
-    g_notification_set_icon (self->notification, G_ICON (image));
+  g_return_val_if_fail (chat_name, NULL);
 
-  g_notification_set_body (self->notification, chatty_message_get_text (message));
-  g_notification_set_title (self->notification, title);
-  g_notification_set_priority (self->notification, G_NOTIFICATION_PRIORITY_HIGH);
+  chat_ref = g_hash_table_lookup (notification_get_chats (), chat_name);
 
-  /* Delay the notification a bit so that we can squash multiple notifications
-   * if we get them too fast */
-  g_clear_handle_id (&self->timeout_id, g_source_remove);
-  self->timeout_id = g_timeout_add (NOTIFICATION_TIMEOUT,
-                                    show_notification, self);
+  if (chat_ref)
+    return g_weak_ref_get (chat_ref);
 
-  event = lfb_event_new ("message-new-instant");
-  lfb_event_trigger_feedback_async (event, NULL,
-                                    feedback_triggered_cb,
-                                    g_object_ref (self));
+  return NULL;
 }
@@ -28,5 +28,6 @@ void                chatty_notification_show_message (ChattyNotification *self,
                                                       ChattyChat         *chat,
                                                       ChattyMessage      *message,
                                                       const char         *name);
+ChattyChat         *chatty_notification_lookup_chat  (const char         *chat_name);
 
 G_END_DECLS
@@ -15,6 +15,12 @@
 # include "config.h"
 #endif
 
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include <phonenumbers/phonenumberutil.h>
 
 #include "chatty-phone-utils.h"
@@ -22,22 +28,183 @@
 using i18n::phonenumbers::PhoneNumber;
 using i18n::phonenumbers::PhoneNumberUtil;
 
+/* Maximum number of parse results kept in cache */
+#define PARSE_CACHE_SIZE 4096
+
+struct ParseResult
+{
+  bool parsed = false;
+  bool valid = false;
+  ChattyPhoneType type = CHATTY_PHONE_TYPE_UNKNOWN;
+  PhoneNumber number;
+  std::string e164;
+  std::string national;
+};
+
+typedef std::shared_ptr<const ParseResult> ParseResultPtr;
+
+/*
+ * A bounded LRU cache of parse results keyed by the
+ * region and number.  Parsing is done without the lock
+ * held, so the same number may be parsed more than once
+ * if requested from different threads at the same time.
+ */
+class ParseCache
+{
+public:
+  ParseResultPtr lookup (const std::string &key)
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    auto it = map.find (key);
+
+    if (it == map.end ()) {
+      misses++;
+      return nullptr;
+    }
+
+    /* Move to front, as it's the most recently used */
+    lru.splice (lru.begin (), lru, it->second);
+    hits++;
+
+    return it->second->second;
+  }
+
+  void insert (const std::string &key,
+               ParseResultPtr     result)
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    auto it = map.find (key);
+
+    if (it != map.end ()) {
+      lru.splice (lru.begin (), lru, it->second);
+      return;
+    }
+
+    lru.emplace_front (key, result);
+    map[key] = lru.begin ();
+
+    if (lru.size () > PARSE_CACHE_SIZE) {
+      map.erase (lru.back ().first);
+      lru.pop_back ();
+    }
+  }
+
+  void clear ()
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+
+    map.clear ();
+    lru.clear ();
+    hits = misses = 0;
+  }
+
+  void get_stats (guint *out_hits,
+                  guint *out_misses)
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+
+    if (out_hits)
+      *out_hits = hits;
+    if (out_misses)
+      *out_misses = misses;
+  }
+
+private:
+  typedef std::list<std::pair<std::string, ParseResultPtr>> LruList;
+
+  std::mutex mutex;
+  LruList lru;
+  std::unordered_map<std::string, LruList::iterator> map;
+  guint hits = 0;
+  guint misses = 0;
+};
+
+static ParseCache *
+get_parse_cache (void)
+{
+  static ParseCache cache;
+
+  return &cache;
+}
+
+static ChattyPhoneType
+phone_type_from_number_type (PhoneNumberUtil::PhoneNumberType type)
+{
+  switch (type)
+    {
+    case PhoneNumberUtil::FIXED_LINE:
+      return CHATTY_PHONE_TYPE_FIXED_LINE;
+    case PhoneNumberUtil::MOBILE:
+      return CHATTY_PHONE_TYPE_MOBILE;
+    case PhoneNumberUtil::FIXED_LINE_OR_MOBILE:
+      return CHATTY_PHONE_TYPE_FIXED_LINE_OR_MOBILE;
+    case PhoneNumberUtil::TOLL_FREE:
+      return CHATTY_PHONE_TYPE_TOLL_FREE;
+    case PhoneNumberUtil::PREMIUM_RATE:
+      return CHATTY_PHONE_TYPE_PREMIUM_RATE;
+    case PhoneNumberUtil::SHARED_COST:
+      return CHATTY_PHONE_TYPE_SHARED_COST;
+    case PhoneNumberUtil::VOIP:
+      return CHATTY_PHONE_TYPE_VOIP;
+    case PhoneNumberUtil::PERSONAL_NUMBER:
+      return CHATTY_PHONE_TYPE_PERSONAL_NUMBER;
+    case PhoneNumberUtil::PAGER:
+      return CHATTY_PHONE_TYPE_PAGER;
+    case PhoneNumberUtil::UAN:
+      return CHATTY_PHONE_TYPE_UAN;
+    case PhoneNumberUtil::VOICEMAIL:
+      return CHATTY_PHONE_TYPE_VOICEMAIL;
+    case PhoneNumberUtil::UNKNOWN:
+    default:
+      return CHATTY_PHONE_TYPE_UNKNOWN;
+    }
+}
+
+/* @country_code should be a valid ISO 3166-1 two letter code or "ZZ" */
+static ParseResultPtr
+phone_utils_parse (const char *number,
+                   const char *country_code)
+{
+  PhoneNumberUtil *util = PhoneNumberUtil::GetInstance ();
+  ParseCache *cache = get_parse_cache ();
+  std::shared_ptr<ParseResult> result;
+  ParseResultPtr cached;
+  std::string key;
+
+  key.reserve (strlen (number) + 3);
+  key.append (country_code, 2);
+  key.push_back (':');
+  key.append (number);
+
+  cached = cache->lookup (key);
+
+  if (cached)
+    return cached;
+
+  result = std::make_shared<ParseResult> ();
+
+  if (util->Parse (number, country_code, &result->number) == PhoneNumberUtil::NO_PARSING_ERROR) {
+    result->parsed = true;
+    result->valid = util->IsValidNumber (result->number);
+    result->type = phone_type_from_number_type (util->GetNumberType (result->number));
+    util->Format (result->number, PhoneNumberUtil::E164, &result->e164);
+    util->GetNationalSignificantNumber (result->number, &result->national);
+  }
+
+  cache->insert (key, result);
+
+  return result;
+}
 
 gboolean
 chatty_phone_utils_is_valid (const char *number,
                              const char *country_code)
 {
-  PhoneNumberUtil *util = PhoneNumberUtil::GetInstance ();
-  PhoneNumber phone_number;
-
   if (!number || !*number ||
       !country_code || strlen (country_code) != 2)
     return FALSE;
 
-  if (util->Parse (number, country_code, &phone_number) == PhoneNumberUtil::NO_PARSING_ERROR)
-    return util->IsValidNumber (phone_number);
-
-  return FALSE;
+  return phone_utils_parse (number, country_code)->valid;
 }
 
 gboolean
@@ -45,10 +212,159 @@ chatty_phone_utils_is_possible (const char *number,
                                 const char *country_code)
 {
   PhoneNumberUtil *util = PhoneNumberUtil::GetInstance ();
+  ParseResultPtr result;
 
   if (!number || !*number ||
       !country_code || strlen (country_code) != 2)
     return FALSE;
 
-  return util->IsPossibleNumberForString (number, country_code);
+  result = phone_utils_parse (number, country_code);
+
+  if (!result->parsed)
+    return FALSE;
+
+  return util->IsPossibleNumber (result->number);
+}
+
+/**
+ * chatty_phone_utils_get_e164:
+ * @number: A phone number
+ * @country_code: (nullable): ISO 3166-1 two letter country code
+ * @national_number: (out) (optional): return location for
+ * the national significant number
+ *
+ * Parse @number in the region of @country_code and get it
+ * in E.164 format.  If @number has the country prefix,
+ * @country_code can be %NULL.
+ *
+ * Returns: (transfer full) (nullable): The number in
+ * E.164 format or %NULL if @number can't be parsed.
+ * Free with g_free().
+ */
+char *
+chatty_phone_utils_get_e164 (const char  *number,
+                             const char  *country_code,
+                             char       **national_number)
+{
+  ParseResultPtr result;
+
+  if (national_number)
+    *national_number = NULL;
+
+  if (!number || !*number)
+    return NULL;
+
+  /* Unknown region, only numbers with country prefix can be parsed */
+  if (!country_code || strlen (country_code) != 2)
+    country_code = "ZZ";
+
+  result = phone_utils_parse (number, country_code);
+
+  if (!result->parsed)
+    return NULL;
+
+  if (national_number)
+    *national_number = g_strdup (result->national.c_str ());
+
+  return g_strdup (result->e164.c_str ());
+}
+
+/**
+ * chatty_phone_utils_normalize:
+ * @number: A phone number
+ * @country_code: (nullable): ISO 3166-1 two letter country code
+ * @type: (out) (optional): return location for the number type
+ *
+ * Get @number in E.164 format.  Unlike chatty_phone_utils_get_e164(),
+ * %NULL is returned if @number is not a valid number for the region.
+ * Parse results are cached, so repeated calls with the same number
+ * are cheap.
+ *
+ * Returns: (transfer full) (nullable): The number in E.164
+ * format or %NULL if @number is invalid. Free with g_free().
+ */
+char *
+chatty_phone_utils_normalize (const char      *number,
+                              const char      *country_code,
+                              ChattyPhoneType *type)
+{
+  ParseResultPtr result;
+
+  if (type)
+    *type = CHATTY_PHONE_TYPE_UNKNOWN;
+
+  if (!number || !*number)
+    return NULL;
+
+  if (!country_code || strlen (country_code) != 2)
+    country_code = "ZZ";
+
+  result = phone_utils_parse (number, country_code);
+
+  if (!result->valid)
+    return NULL;
+
+  if (type)
+    *type = result->type;
+
+  return g_strdup (result->e164.c_str ());
+}
+
+/**
+ * chatty_phone_utils_normalize_batch:
+ * @numbers: (array length=n_numbers): An array of phone numbers
+ * @n_numbers: The length of @numbers
+ * @country_code: (nullable): ISO 3166-1 two letter country code
+ * @types: (out) (optional) (array length=n_numbers): return
+ * location for the number types
+ *
+ * Normalize all @numbers, same as calling chatty_phone_utils_normalize()
+ * for each number.  @types should be large enough to hold @n_numbers
+ * items.
+ *
+ * Returns: (transfer full): A #GPtrArray of size @n_numbers with the
+ * numbers in E.164 format, or %NULL for invalid numbers.
+ */
+GPtrArray *
+chatty_phone_utils_normalize_batch (const char * const *numbers,
+                                    gsize               n_numbers,
+                                    const char         *country_code,
+                                    ChattyPhoneType    *types)
+{
+  GPtrArray *normalized;
+
+  g_return_val_if_fail (numbers || n_numbers == 0, NULL);
+
+  normalized = g_ptr_array_new_full (n_numbers, g_free);
+
+  if (!country_code || strlen (country_code) != 2)
+    country_code = "ZZ";
+
+  for (gsize i = 0; i < n_numbers; i++)
+    g_ptr_array_add (normalized,
+                     chatty_phone_utils_normalize (numbers[i], country_code,
+                                                   types ? &types[i] : NULL));
+
+  return normalized;
+}
+
+/**
+ * chatty_phone_utils_get_cache_stats:
+ * @hits: (out) (optional): return location for cache hits
+ * @misses: (out) (optional): return location for cache misses
+ *
+ * Get the hit and miss count of the parse cache
+ * since the last chatty_phone_utils_clear_cache().
+ */
+void
+chatty_phone_utils_get_cache_stats (guint *hits,
+                                    guint *misses)
+{
+  get_parse_cache ()->get_stats (hits, misses);
+}
+
+void
+chatty_phone_utils_clear_cache (void)
+{
+  get_parse_cache ()->clear ();
 }
@@ -13,11 +13,26 @@
 
 #include <glib.h>
 
+#include "chatty-enums.h"
+
 G_BEGIN_DECLS
 
 gboolean     chatty_phone_utils_is_valid      (const char *number,
                                                const char *country_code);
 gboolean     chatty_phone_utils_is_possible   (const char *number,
                                                const char *country_code);
+char        *chatty_phone_utils_get_e164      (const char *number,
+                                               const char *country_code,
+                                               char      **national_number);
+char        *chatty_phone_utils_normalize     (const char      *number,
+                                               const char      *country_code,
+                                               ChattyPhoneType *type);
+GPtrArray   *chatty_phone_utils_normalize_batch (const char * const *numbers,
+                                                 gsize               n_numbers,
+                                                 const char         *country_code,
+                                                 ChattyPhoneType    *types);
+void         chatty_phone_utils_get_cache_stats (guint *hits,
+                                                 guint *misses);
+void         chatty_phone_utils_clear_cache     (void);
 G_END_DECLS
 
@@ -19,6 +19,7 @@
 
 #include "contrib/gtk.h"
 #include "chatty-history.h"
+#include "chatty-indexed-store.h"
 #include "chatty-settings.h"
 #include "chatty-utils.h"
 #include "users/chatty-pp-buddy.h"
@@ -59,9 +60,9 @@ struct _ChattyPpChat
 
   PurpleChat         *pp_chat;
   PurpleConversation *conv;
-  GListStore         *chat_users;
+  ChattyIndexedStore *chat_users;
   GtkSortListModel   *sorted_chat_users;
-  GListStore         *message_store;
+  ChattyIndexedStore *message_store;
   GListStore         *fp_list;
 
   char               *last_message;
@@ -373,24 +374,22 @@ chat_find_user (ChattyPpChat *self,
                 const char   *user,
                 guint        *index)
 {
-  guint n_items;
-
   g_assert (CHATTY_IS_PP_CHAT (self));
 
-  n_items = g_list_model_get_n_items (G_LIST_MODEL (self->chat_users));
-  for (guint i = 0; i < n_items; i++) {
-    g_autoptr(ChattyPpBuddy) buddy = NULL;
-
-    buddy = g_list_model_get_item (G_LIST_MODEL (self->chat_users), i);
-    if (chatty_pp_buddy_get_id (buddy) == user) {
-      if (index)
-        *index = i;
+  /* Users are indexed by their id pointer, not the string */
+  return chatty_indexed_store_lookup (self->chat_users, user, index);
+}
 
-      return buddy;
-    }
-  }
+static gpointer
+chat_user_get_key (gpointer item)
+{
+  return (gpointer)chatty_pp_buddy_get_id (item);
+}
 
-  return NULL;
+static gpointer
+chat_message_get_key (gpointer item)
+{
+  return g_strdup (chatty_message_get_id (item));
 }
 
 static void
@@ -415,7 +414,7 @@ pp_chat_load_db_messages_cb (GObject      *object,
 
   if (messages && messages->len &&
       chatty_pp_chat_get_auto_join (self)) {
-    g_list_store_splice (self->message_store, 0, 0, messages->pdata, messages->len);
+    chatty_indexed_store_splice (self->message_store, 0, 0, messages->pdata, messages->len);
     g_signal_emit_by_name (self, "changed", 0);
   } else if (error && !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
    g_warning ("Error fetching messages: %s,", error->message);
@@ -574,6 +573,45 @@ chatty_pp_chat_is_loading_history (ChattyChat *chat)
   return self->history_is_loading;
 }
 
+static guint
+chatty_pp_chat_trim_messages (ChattyChat *chat,
+                              guint       n_keep)
+{
+  ChattyPpChat *self = (ChattyPpChat *)chat;
+  GListModel *model;
+  guint n_items, n_remove = 0;
+
+  g_assert (CHATTY_IS_PP_CHAT (self));
+
+  /* Past messages are loaded back only if auto joined */
+  if (self->history_is_loading ||
+      !chatty_pp_chat_get_auto_join (self))
+    return 0;
+
+  model = G_LIST_MODEL (self->message_store);
+  n_items = g_list_model_get_n_items (model);
+
+  if (n_items <= n_keep)
+    return 0;
+
+  for (; n_remove < n_items - n_keep; n_remove++) {
+    g_autoptr(ChattyMessage) message = NULL;
+    ChattyMsgStatus status;
+
+    message = g_list_model_get_item (model, n_remove);
+    status = chatty_message_get_status (message);
+
+    if (status == CHATTY_STATUS_SENDING ||
+        status == CHATTY_STATUS_SENDING_FAILED)
+      break;
+  }
+
+  if (n_remove)
+    chatty_indexed_store_splice (self->message_store, 0, n_remove, NULL, 0);
+
+  return n_remove;
+}
+
 static GListModel *
 chatty_pp_chat_get_messages (ChattyChat *chat)
 {
@@ -996,8 +1034,8 @@ chatty_pp_chat_finalize (GObject *object)
       g_object_set_data (node->ui_data, "chat", NULL);
   }
 
-  g_list_store_remove_all (self->chat_users);
-  g_list_store_remove_all (self->message_store);
+  chatty_indexed_store_remove_all (self->chat_users);
+  chatty_indexed_store_remove_all (self->message_store);
   g_list_store_remove_all (self->fp_list);
   g_object_unref (self->fp_list);
   g_object_unref (self->message_store);
@@ -1031,6 +1069,7 @@ chatty_pp_chat_class_init (ChattyPpChatClass *klass)
   chat_class->get_account = chatty_pp_chat_get_account;
   chat_class->load_past_messages = chatty_pp_chat_real_past_messages;
   chat_class->is_loading_history = chatty_pp_chat_is_loading_history;
+  chat_class->trim_messages = chatty_pp_chat_trim_messages;
   chat_class->get_messages = chatty_pp_chat_get_messages;
   chat_class->get_users = chatty_pp_chat_get_users;
   chat_class->get_topic = chatty_pp_chat_get_topic;
@@ -1053,10 +1092,12 @@ chatty_pp_chat_init (ChattyPpChat *self)
   g_autoptr(GtkSorter) sorter = NULL;
 
   sorter = gtk_custom_sorter_new ((GCompareDataFunc)sort_chat_buddy, NULL, NULL);
-  self->chat_users = g_list_store_new (CHATTY_TYPE_PP_BUDDY);
+  self->chat_users = chatty_indexed_store_new_full (CHATTY_TYPE_PP_BUDDY, chat_user_get_key,
+                                                    NULL, NULL, NULL);
   self->sorted_chat_users = gtk_sort_list_model_new (G_LIST_MODEL (self->chat_users), sorter);
 
-  self->message_store = g_list_store_new (CHATTY_TYPE_MESSAGE);
+  self->message_store = chatty_indexed_store_new_full (CHATTY_TYPE_MESSAGE, chat_message_get_key,
+                                                       g_str_hash, g_str_equal, g_free);
   self->fp_list = g_list_store_new (HDY_TYPE_VALUE_OBJECT);
   self->encrypt = CHATTY_ENCRYPTION_UNSUPPORTED;
 }
@@ -1389,36 +1430,31 @@ ChattyMessage *
 chatty_pp_chat_find_message_with_id (ChattyPpChat *self,
                                      const char   *id)
 {
-  guint n_items;
-
   g_return_val_if_fail (CHATTY_IS_PP_CHAT (self), NULL);
   g_return_val_if_fail (id, NULL);
 
-  n_items = g_list_model_get_n_items (G_LIST_MODEL (self->message_store));
-
-  if (n_items == 0)
-    return NULL;
-
-  /* Search from end, the item is more likely to be at the end */
-  for (guint i = n_items; i > 0; i--) {
-    g_autoptr(ChattyMessage) message = NULL;
-    const char *message_id;
-
-    message = g_list_model_get_item (G_LIST_MODEL (self->message_store), i - 1);
-    message_id = chatty_message_get_id (message);
-
-    /*
-     * Once we have a message with no id, all preceding items shall likely
-     * have loaded from database, and thus no id, so don’t bother searching.
-     */
-    if (!message_id)
-      break;
+  return chatty_indexed_store_lookup (self->message_store, id, NULL);
+}
 
-    if (g_str_equal (id, message_id))
-      return message;
-  }
+/**
+ * chatty_pp_chat_set_message_id:
+ * @self: A #ChattyPpChat
+ * @message: A #ChattyMessage in @self
+ * @id: The new id of @message
+ *
+ * Set the id of @message, so that it can be
+ * found with chatty_pp_chat_find_message_with_id().
+ */
+void
+chatty_pp_chat_set_message_id (ChattyPpChat  *self,
+                               ChattyMessage *message,
+                               const char    *id)
+{
+  g_return_if_fail (CHATTY_IS_PP_CHAT (self));
+  g_return_if_fail (CHATTY_IS_MESSAGE (message));
 
-  return NULL;
+  chatty_message_set_id (message, id);
+  chatty_indexed_store_update_key (self->message_store, message);
 }
 
 void
@@ -1428,7 +1464,7 @@ chatty_pp_chat_append_message (ChattyPpChat  *self,
   g_return_if_fail (CHATTY_IS_PP_CHAT (self));
   g_return_if_fail (CHATTY_IS_MESSAGE (message));
 
-  g_list_store_append (self->message_store, message);
+  chatty_indexed_store_append (self->message_store, message);
   g_signal_emit_by_name (self, "changed", 0);
 }
 
@@ -1439,7 +1475,7 @@ chatty_pp_chat_prepend_message (ChattyPpChat  *self,
   g_return_if_fail (CHATTY_IS_PP_CHAT (self));
   g_return_if_fail (CHATTY_IS_MESSAGE (message));
 
-  g_list_store_insert (self->message_store, 0, message);
+  chatty_indexed_store_insert (self->message_store, 0, message);
   g_signal_emit_by_name (self, "changed", 0);
 }
 
@@ -1454,7 +1490,7 @@ chatty_pp_chat_prepend_messages (ChattyPpChat *self,
 
   g_return_if_fail (CHATTY_IS_MESSAGE (messages->pdata[0]));
 
-  g_list_store_splice (self->message_store, 0, 0, messages->pdata, messages->len);
+  chatty_indexed_store_splice (self->message_store, 0, 0, messages->pdata, messages->len);
   g_signal_emit_by_name (self, "changed", 0);
 }
 
@@ -1486,8 +1522,8 @@ chatty_pp_chat_add_users (ChattyPpChat *self,
     g_ptr_array_add (users_array, buddy);
   }
 
-  g_list_store_splice (self->chat_users, 0, 0,
-                       users_array->pdata, users_array->len);
+  chatty_indexed_store_splice (self->chat_users, 0, 0,
+                               users_array->pdata, users_array->len);
 
   g_ptr_array_free (users_array, TRUE);
 }
@@ -1523,7 +1559,7 @@ chatty_pp_chat_remove_user (ChattyPpChat *self,
     buddy = chat_find_user (self, cb->name, &index);
 
   if (buddy)
-    g_list_store_remove (self->chat_users, index);
+    chatty_indexed_store_remove (self->chat_users, index);
 }
 
 ChattyPpBuddy *
@@ -51,6 +51,9 @@ gboolean            chatty_pp_chat_match_purple_conv      (ChattyPpChat       *s
                                                            PurpleConversation *conv);
 ChattyMessage      *chatty_pp_chat_find_message_with_id   (ChattyPpChat       *self,
                                                            const char         *id);
+void                chatty_pp_chat_set_message_id         (ChattyPpChat       *self,
+                                                           ChattyMessage      *message,
+                                                           const char         *id);
 void                chatty_pp_chat_append_message         (ChattyPpChat       *self,
                                                            ChattyMessage      *message);
 void                chatty_pp_chat_prepend_message        (ChattyPpChat       *self,
@@ -0,0 +1,539 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-receipts.c
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "chatty-receipts"
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "chatty-receipts.h"
+
+/**
+ * SECTION: chatty-receipts
+ * @title: ChattyReceipts
+ * @short_description: Track delivery and read receipts of sent messages
+ * @include: "chatty-receipts.h"
+ *
+ * Sent messages are tracked by the id the protocol uses
+ * to refer them in receipts (the stanza id for XMPP and
+ * the event id for Matrix).  When a receipt arrives the
+ * status of the exact message is updated, and the status
+ * changes are saved to history in batches.
+ *
+ * Protocols that send read receipts for the last message
+ * read, which may not be ours (eg: Matrix), can mark every
+ * message up to a time as read with
+ * chatty_receipts_set_read_until().
+ *
+ * A message is no longer tracked once a receipt for it
+ * is handled.  A receipt that arrives before its message
+ * is set with chatty_receipts_set_message() is kept, and
+ * applied once the message is set.  Receipts are also
+ * tracked per chat, so that they can be dropped when the
+ * chat is gone.
+ */
+
+/* Peers may never send receipts, don't grow forever */
+#define MAX_RECEIPTS_PER_CHAT 128
+#define SAVE_TIMEOUT          1000 /* milliseconds */
+
+struct _ChattyReceipts
+{
+  GObject        parent_instance;
+
+  ChattyHistory *history;
+  /* id → Receipt */
+  GHashTable    *receipts;
+  /* ChattyChat → ChatReceipts */
+  GHashTable    *chats;
+  /* Messages with status to be saved, and their chats */
+  GPtrArray     *save_queue;
+  GPtrArray     *save_chats;
+  guint          save_id;
+};
+
+typedef struct {
+  ChattyReceipts *self;
+  ChattyChat     *chat;
+  /* Oldest first */
+  GQueue          receipts;
+} ChatReceipts;
+
+typedef struct {
+  char          *id;
+  ChattyMessage *message;
+  ChatReceipts  *chat;
+  /* The status received before @message is set */
+  ChattyMsgStatus status;
+  GList          link;
+} Receipt;
+
+G_DEFINE_TYPE (ChattyReceipts, chatty_receipts, G_TYPE_OBJECT)
+
+static void
+receipt_free (Receipt *receipt)
+{
+  g_clear_object (&receipt->message);
+  g_free (receipt->id);
+  g_free (receipt);
+}
+
+static void
+receipts_remove (ChattyReceipts *self,
+                 Receipt        *receipt)
+{
+  g_queue_unlink (&receipt->chat->receipts, &receipt->link);
+  /* frees @receipt */
+  g_hash_table_remove (self->receipts, receipt->id);
+}
+
+static void
+chat_receipts_free (ChatReceipts *chat_receipts)
+{
+  while (chat_receipts->receipts.head)
+    receipts_remove (chat_receipts->self, chat_receipts->receipts.head->data);
+
+  g_free (chat_receipts);
+}
+
+static void
+receipts_chat_finalized_cb (gpointer  user_data,
+                            GObject  *where_the_object_was)
+{
+  ChattyReceipts *self = user_data;
+
+  g_assert (CHATTY_IS_RECEIPTS (self));
+
+  g_hash_table_remove (self->chats, where_the_object_was);
+}
+
+static void
+receipts_save_cb (GObject      *object,
+                  GAsyncResult *result,
+                  gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (!chatty_history_update_status_finish (CHATTY_HISTORY (object), result, &error))
+    g_warning ("Error saving message status: %s", error->message);
+}
+
+static gboolean
+receipts_save_timeout_cb (gpointer user_data)
+{
+  ChattyReceipts *self = user_data;
+
+  g_assert (CHATTY_IS_RECEIPTS (self));
+
+  self->save_id = 0;
+  chatty_receipts_save (self);
+
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Returns %FALSE if @receipt has no message yet, in which
+ * case @status is kept until the message is set.
+ */
+static gboolean
+receipts_set_status (ChattyReceipts  *self,
+                     Receipt         *receipt,
+                     ChattyMsgStatus  status)
+{
+  ChattyMsgStatus old_status;
+
+  if (!receipt->message) {
+    if (receipt->status != CHATTY_STATUS_READ)
+      receipt->status = status;
+
+    return FALSE;
+  }
+
+  old_status = chatty_message_get_status (receipt->message);
+
+  if (old_status == status || old_status == CHATTY_STATUS_READ)
+    return TRUE;
+
+  chatty_message_set_status (receipt->message, status, 0);
+
+  if (!self->history)
+    return TRUE;
+
+  g_ptr_array_add (self->save_queue, g_object_ref (receipt->message));
+  g_ptr_array_add (self->save_chats, g_object_ref (receipt->chat->chat));
+
+  if (!self->save_id)
+    self->save_id = g_timeout_add (SAVE_TIMEOUT, receipts_save_timeout_cb, self);
+
+  return TRUE;
+}
+
+static void
+chatty_receipts_finalize (GObject *object)
+{
+  ChattyReceipts *self = (ChattyReceipts *)object;
+  GHashTableIter iter;
+  gpointer chat;
+
+  chatty_receipts_save (self);
+
+  g_hash_table_iter_init (&iter, self->chats);
+  while (g_hash_table_iter_next (&iter, &chat, NULL))
+    g_object_weak_unref (chat, receipts_chat_finalized_cb, self);
+
+  g_hash_table_unref (self->chats);
+  g_hash_table_unref (self->receipts);
+  g_ptr_array_unref (self->save_queue);
+  g_ptr_array_unref (self->save_chats);
+  g_clear_object (&self->history);
+
+  G_OBJECT_CLASS (chatty_receipts_parent_class)->finalize (object);
+}
+
+static void
+chatty_receipts_class_init (ChattyReceiptsClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = chatty_receipts_finalize;
+}
+
+static void
+chatty_receipts_init (ChattyReceipts *self)
+{
+  self->receipts = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          NULL, (GDestroyNotify)receipt_free);
+  self->chats = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                       (GDestroyNotify)chat_receipts_free);
+  self->save_queue = g_ptr_array_new_with_free_func (g_object_unref);
+  self->save_chats = g_ptr_array_new_with_free_func (g_object_unref);
+}
+
+/**
+ * chatty_receipts_get_default:
+ *
+ * Get the default receipt tracker
+ *
+ * Returns: (transfer none): A #ChattyReceipts.
+ */
+ChattyReceipts *
+chatty_receipts_get_default (void)
+{
+  static ChattyReceipts *self;
+
+  if (!self) {
+    self = chatty_receipts_new ();
+    g_object_add_weak_pointer (G_OBJECT (self), (gpointer *)&self);
+  }
+
+  return self;
+}
+
+ChattyReceipts *
+chatty_receipts_new (void)
+{
+  return g_object_new (CHATTY_TYPE_RECEIPTS, NULL);
+}
+
+/**
+ * chatty_receipts_set_history:
+ * @self: A #ChattyReceipts
+ * @history: (nullable): A #ChattyHistory
+ *
+ * Set the history to save message status changes to.
+ */
+void
+chatty_receipts_set_history (ChattyReceipts *self,
+                             ChattyHistory  *history)
+{
+  g_return_if_fail (CHATTY_IS_RECEIPTS (self));
+  g_return_if_fail (!history || CHATTY_IS_HISTORY (history));
+
+  if (self->history == history)
+    return;
+
+  chatty_receipts_save (self);
+  g_set_object (&self->history, history);
+}
+
+/**
+ * chatty_receipts_add:
+ * @self: A #ChattyReceipts
+ * @chat: The #ChattyChat @message belongs to
+ * @id: The id receipts for @message will refer
+ * @message: (nullable): A sent #ChattyMessage
+ *
+ * Track receipts for @message.  If the message is
+ * not yet created when sending (eg: XMPP stanzas
+ * are sent before the message is written to the
+ * chat), @message can be %NULL, and be set later
+ * with chatty_receipts_set_message().
+ */
+void
+chatty_receipts_add (ChattyReceipts *self,
+                     ChattyChat     *chat,
+                     const char     *id,
+                     ChattyMessage  *message)
+{
+  ChatReceipts *chat_receipts;
+  Receipt *receipt;
+
+  g_return_if_fail (CHATTY_IS_RECEIPTS (self));
+  g_return_if_fail (CHATTY_IS_CHAT (chat));
+  g_return_if_fail (!message || CHATTY_IS_MESSAGE (message));
+
+  if (!id || !*id || g_hash_table_contains (self->receipts, id))
+    return;
+
+  chat_receipts = g_hash_table_lookup (self->chats, chat);
+
+  if (!chat_receipts) {
+    chat_receipts = g_new0 (ChatReceipts, 1);
+    chat_receipts->self = self;
+    chat_receipts->chat = chat;
+    g_object_weak_ref (G_OBJECT (chat), receipts_chat_finalized_cb, self);
+    g_hash_table_insert (self->chats, chat, chat_receipts);
+  }
+
+  if (chat_receipts->receipts.length >= MAX_RECEIPTS_PER_CHAT)
+    receipts_remove (self, chat_receipts->receipts.head->data);
+
+  receipt = g_new0 (Receipt, 1);
+  receipt->id = g_strdup (id);
+  receipt->chat = chat_receipts;
+  receipt->link.data = receipt;
+  g_set_object (&receipt->message, message);
+
+  g_queue_push_tail_link (&chat_receipts->receipts, &receipt->link);
+  g_hash_table_insert (self->receipts, receipt->id, receipt);
+}
+
+/**
+ * chatty_receipts_set_message:
+ * @self: A #ChattyReceipts
+ * @chat: A #ChattyChat
+ * @message: A sent #ChattyMessage
+ *
+ * Set @message as the message of the oldest receipt
+ * in @chat added without a message, if any.  If the
+ * receipt has already arrived, the status of @message
+ * is updated now.
+ *
+ * Returns: %TRUE if @message is tracked.  %FALSE otherwise.
+ */
+gboolean
+chatty_receipts_set_message (ChattyReceipts *self,
+                             ChattyChat     *chat,
+                             ChattyMessage  *message)
+{
+  ChatReceipts *chat_receipts;
+
+  g_return_val_if_fail (CHATTY_IS_RECEIPTS (self), FALSE);
+  g_return_val_if_fail (CHATTY_IS_CHAT (chat), FALSE);
+  g_return_val_if_fail (CHATTY_IS_MESSAGE (message), FALSE);
+
+  chat_receipts = g_hash_table_lookup (self->chats, chat);
+
+  if (!chat_receipts)
+    return FALSE;
+
+  for (GList *node = chat_receipts->receipts.head; node; node = node->next) {
+    Receipt *receipt = node->data;
+
+    if (!receipt->message) {
+      receipt->message = g_object_ref (message);
+
+      if (receipt->status) {
+        receipts_set_status (self, receipt, receipt->status);
+        receipts_remove (self, receipt);
+      }
+
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+/**
+ * chatty_receipts_set_delivered:
+ * @self: A #ChattyReceipts
+ * @id: The id of the message
+ *
+ * Mark the message with @id as delivered.
+ *
+ * Returns: %TRUE if a message with @id was tracked.
+ * %FALSE otherwise.
+ */
+gboolean
+chatty_receipts_set_delivered (ChattyReceipts *self,
+                               const char     *id)
+{
+  Receipt *receipt;
+
+  g_return_val_if_fail (CHATTY_IS_RECEIPTS (self), FALSE);
+
+  if (!id)
+    return FALSE;
+
+  receipt = g_hash_table_lookup (self->receipts, id);
+
+  if (!receipt)
+    return FALSE;
+
+  if (receipts_set_status (self, receipt, CHATTY_STATUS_DELIVERED))
+    receipts_remove (self, receipt);
+
+  return TRUE;
+}
+
+/**
+ * chatty_receipts_set_read:
+ * @self: A #ChattyReceipts
+ * @id: The id of the message
+ *
+ * Mark the message with @id and all the messages sent
+ * before it in the same chat as read.
+ *
+ * Returns: %TRUE if a message with @id was tracked.
+ * %FALSE otherwise.
+ */
+gboolean
+chatty_receipts_set_read (ChattyReceipts *self,
+                          const char     *id)
+{
+  Receipt *receipt;
+  GList *node;
+
+  g_return_val_if_fail (CHATTY_IS_RECEIPTS (self), FALSE);
+
+  if (!id)
+    return FALSE;
+
+  receipt = g_hash_table_lookup (self->receipts, id);
+
+  if (!receipt)
+    return FALSE;
+
+  node = receipt->chat->receipts.head;
+
+  while (node) {
+    Receipt *item = node->data;
+    gboolean last = item == receipt;
+
+    node = node->next;
+
+    if (receipts_set_status (self, item, CHATTY_STATUS_READ))
+      receipts_remove (self, item);
+
+    if (last)
+      break;
+  }
+
+  return TRUE;
+}
+
+/**
+ * chatty_receipts_set_read_until:
+ * @self: A #ChattyReceipts
+ * @chat: A #ChattyChat
+ * @time: A unix timestamp in seconds
+ *
+ * Mark all the messages in @chat sent at or before @time
+ * as read.  Receipts added without a message are kept.
+ *
+ * Returns: %TRUE if any message was marked as read.
+ * %FALSE otherwise.
+ */
+gboolean
+chatty_receipts_set_read_until (ChattyReceipts *self,
+                                ChattyChat     *chat,
+                                gint64          time)
+{
+  ChatReceipts *chat_receipts;
+  GList *node;
+  gboolean changed = FALSE;
+
+  g_return_val_if_fail (CHATTY_IS_RECEIPTS (self), FALSE);
+  g_return_val_if_fail (CHATTY_IS_CHAT (chat), FALSE);
+
+  chat_receipts = g_hash_table_lookup (self->chats, chat);
+
+  if (!chat_receipts)
+    return FALSE;
+
+  node = chat_receipts->receipts.head;
+
+  while (node) {
+    Receipt *receipt = node->data;
+
+    node = node->next;
+
+    if (!receipt->message ||
+        chatty_message_get_time (receipt->message) > time)
+      continue;
+
+    receipts_set_status (self, receipt, CHATTY_STATUS_READ);
+    receipts_remove (self, receipt);
+    changed = TRUE;
+  }
+
+  return changed;
+}
+
+/**
+ * chatty_receipts_remove_chat:
+ * @self: A #ChattyReceipts
+ * @chat: A #ChattyChat
+ *
+ * Stop tracking receipts of messages in @chat.
+ */
+void
+chatty_receipts_remove_chat (ChattyReceipts *self,
+                             ChattyChat     *chat)
+{
+  g_return_if_fail (CHATTY_IS_RECEIPTS (self));
+  g_return_if_fail (CHATTY_IS_CHAT (chat));
+
+  if (g_hash_table_remove (self->chats, chat))
+    g_object_weak_unref (G_OBJECT (chat), receipts_chat_finalized_cb, self);
+}
+
+/**
+ * chatty_receipts_save:
+ * @self: A #ChattyReceipts
+ *
+ * Save pending status changes to history now,
+ * without waiting for the next batch.
+ */
+void
+chatty_receipts_save (ChattyReceipts *self)
+{
+  g_autoptr(GPtrArray) messages = NULL;
+  g_autoptr(GPtrArray) chats = NULL;
+
+  g_return_if_fail (CHATTY_IS_RECEIPTS (self));
+
+  g_clear_handle_id (&self->save_id, g_source_remove);
+
+  if (!self->history || !self->save_queue->len)
+    return;
+
+  messages = g_steal_pointer (&self->save_queue);
+  chats = g_steal_pointer (&self->save_chats);
+  self->save_queue = g_ptr_array_new_with_free_func (g_object_unref);
+  self->save_chats = g_ptr_array_new_with_free_func (g_object_unref);
+
+  g_debug ("Saving status of %u message(s)", messages->len);
+  chatty_history_update_status_async (self->history, chats, messages,
+                                      receipts_save_cb, NULL);
+}
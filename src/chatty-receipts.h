@@ -0,0 +1,48 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-receipts.h
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+#include "chatty-chat.h"
+#include "chatty-message.h"
+#include "chatty-history.h"
+
+G_BEGIN_DECLS
+
+#define CHATTY_TYPE_RECEIPTS (chatty_receipts_get_type ())
+
+G_DECLARE_FINAL_TYPE (ChattyReceipts, chatty_receipts, CHATTY, RECEIPTS, GObject)
+
+ChattyReceipts *chatty_receipts_get_default   (void);
+ChattyReceipts *chatty_receipts_new           (void);
+void            chatty_receipts_set_history   (ChattyReceipts *self,
+                                               ChattyHistory  *history);
+void            chatty_receipts_add           (ChattyReceipts *self,
+                                               ChattyChat     *chat,
+                                               const char     *id,
+                                               ChattyMessage  *message);
+gboolean        chatty_receipts_set_message   (ChattyReceipts *self,
+                                               ChattyChat     *chat,
+                                               ChattyMessage  *message);
+gboolean        chatty_receipts_set_delivered (ChattyReceipts *self,
+                                               const char     *id);
+gboolean        chatty_receipts_set_read      (ChattyReceipts *self,
+                                               const char     *id);
+gboolean        chatty_receipts_set_read_until (ChattyReceipts *self,
+                                                ChattyChat     *chat,
+                                                gint64          time);
+void            chatty_receipts_remove_chat   (ChattyReceipts *self,
+                                               ChattyChat     *chat);
+void            chatty_receipts_save          (ChattyReceipts *self);
+
+G_END_DECLS
@@ -61,6 +61,12 @@ enum {
   PROP_CONVERT_EMOTICONS,
   PROP_RETURN_SENDS_MESSAGE,
   PROP_MAM_ENABLED,
+  PROP_NOTIFICATION_DELAY,
+  PROP_FEEDBACK_INTERVAL,
+  PROP_INACTIVE_CHAT_MESSAGES,
+  PROP_MESSAGE_MEMORY_BUDGET,
+  PROP_HISTORY_MAX_DAYS,
+  PROP_HISTORY_MAX_MESSAGES,
   N_PROPS
 };
 
@@ -112,6 +118,30 @@ chatty_settings_get_property (GObject    *object,
       g_value_set_boolean (value, chatty_settings_get_return_sends_message (self));
       break;
 
+    case PROP_NOTIFICATION_DELAY:
+      g_value_set_uint (value, chatty_settings_get_notification_delay (self));
+      break;
+
+    case PROP_FEEDBACK_INTERVAL:
+      g_value_set_uint (value, chatty_settings_get_feedback_interval (self));
+      break;
+
+    case PROP_INACTIVE_CHAT_MESSAGES:
+      g_value_set_uint (value, chatty_settings_get_inactive_chat_messages (self));
+      break;
+
+    case PROP_MESSAGE_MEMORY_BUDGET:
+      g_value_set_uint (value, chatty_settings_get_message_memory_budget (self));
+      break;
+
+    case PROP_HISTORY_MAX_DAYS:
+      g_value_set_uint (value, chatty_settings_get_history_max_days (self));
+      break;
+
+    case PROP_HISTORY_MAX_MESSAGES:
+      g_value_set_uint (value, chatty_settings_get_history_max_messages (self));
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -174,6 +204,36 @@ chatty_settings_set_property (GObject      *object,
                               g_value_get_boolean (value));
       break;
 
+    case PROP_NOTIFICATION_DELAY:
+      g_settings_set_uint (self->settings, "notification-delay",
+                           g_value_get_uint (value));
+      break;
+
+    case PROP_FEEDBACK_INTERVAL:
+      g_settings_set_uint (self->settings, "feedback-interval",
+                           g_value_get_uint (value));
+      break;
+
+    case PROP_INACTIVE_CHAT_MESSAGES:
+      g_settings_set_uint (self->settings, "inactive-chat-messages",
+                           g_value_get_uint (value));
+      break;
+
+    case PROP_MESSAGE_MEMORY_BUDGET:
+      g_settings_set_uint (self->settings, "message-memory-budget",
+                           g_value_get_uint (value));
+      break;
+
+    case PROP_HISTORY_MAX_DAYS:
+      g_settings_set_uint (self->settings, "history-max-days",
+                           g_value_get_uint (value));
+      break;
+
+    case PROP_HISTORY_MAX_MESSAGES:
+      g_settings_set_uint (self->settings, "history-max-messages",
+                           g_value_get_uint (value));
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -201,6 +261,18 @@ chatty_settings_constructed (GObject *object)
                    self, "indicate-unknown-contacts", G_SETTINGS_BIND_DEFAULT);
   g_settings_bind (self->settings, "return-sends-message",
                    self, "return-sends-message", G_SETTINGS_BIND_DEFAULT);
+  g_settings_bind (self->settings, "notification-delay",
+                   self, "notification-delay", G_SETTINGS_BIND_DEFAULT);
+  g_settings_bind (self->settings, "feedback-interval",
+                   self, "feedback-interval", G_SETTINGS_BIND_DEFAULT);
+  g_settings_bind (self->settings, "inactive-chat-messages",
+                   self, "inactive-chat-messages", G_SETTINGS_BIND_DEFAULT);
+  g_settings_bind (self->settings, "message-memory-budget",
+                   self, "message-memory-budget", G_SETTINGS_BIND_DEFAULT);
+  g_settings_bind (self->settings, "history-max-days",
+                   self, "history-max-days", G_SETTINGS_BIND_DEFAULT);
+  g_settings_bind (self->settings, "history-max-messages",
+                   self, "history-max-messages", G_SETTINGS_BIND_DEFAULT);
   self->country_code = g_settings_get_string (self->settings, "country-code");
 }
 
@@ -289,6 +361,48 @@ chatty_settings_class_init (ChattySettingsClass *klass)
                             FALSE,
                             G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
 
+    properties[PROP_NOTIFICATION_DELAY] =
+      g_param_spec_uint ("notification-delay",
+                         "Notification Delay",
+                         "Time in milliseconds to collect messages for a notification",
+                         0, 10000, 300,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+    properties[PROP_FEEDBACK_INTERVAL] =
+      g_param_spec_uint ("feedback-interval",
+                         "Feedback Interval",
+                         "Minimum time in milliseconds between message feedbacks",
+                         0, 60000, 3000,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+    properties[PROP_INACTIVE_CHAT_MESSAGES] =
+      g_param_spec_uint ("inactive-chat-messages",
+                         "Inactive Chat Messages",
+                         "Number of messages kept in memory for inactive chats",
+                         1, 10000, 50,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+    properties[PROP_MESSAGE_MEMORY_BUDGET] =
+      g_param_spec_uint ("message-memory-budget",
+                         "Message Memory Budget",
+                         "Memory in MiB loaded messages may use",
+                         1, 4096, 32,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+    properties[PROP_HISTORY_MAX_DAYS] =
+      g_param_spec_uint ("history-max-days",
+                         "History Max Days",
+                         "Days of messages kept in history, 0 for all",
+                         0, 36500, 0,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+    properties[PROP_HISTORY_MAX_MESSAGES] =
+      g_param_spec_uint ("history-max-messages",
+                         "History Max Messages",
+                         "Messages kept in history for each chat, 0 for all",
+                         0, 10000000, 0,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
     g_object_class_install_properties (object_class, N_PROPS, properties);
 }
 
@@ -440,6 +554,110 @@ chatty_settings_get_return_sends_message (ChattySettings *self)
   return g_settings_get_boolean (self->settings, "return-sends-message");
 }
 
+/**
+ * chatty_settings_get_notification_delay:
+ * @self: A #ChattySettings
+ *
+ * Get the time to wait for more messages before a
+ * notification is shown, so that a burst of messages
+ * results in a single notification per chat.
+ *
+ * Returns: The delay in milliseconds
+ */
+guint
+chatty_settings_get_notification_delay (ChattySettings *self)
+{
+  g_return_val_if_fail (CHATTY_IS_SETTINGS (self), 0);
+
+  return g_settings_get_uint (self->settings, "notification-delay");
+}
+
+/**
+ * chatty_settings_get_feedback_interval:
+ * @self: A #ChattySettings
+ *
+ * Get the minimum time between two feedback events
+ * (sound, vibration, etc.) for new messages.
+ *
+ * Returns: The interval in milliseconds
+ */
+guint
+chatty_settings_get_feedback_interval (ChattySettings *self)
+{
+  g_return_val_if_fail (CHATTY_IS_SETTINGS (self), 0);
+
+  return g_settings_get_uint (self->settings, "feedback-interval");
+}
+
+/**
+ * chatty_settings_get_inactive_chat_messages:
+ * @self: A #ChattySettings
+ *
+ * Get the number of latest messages to keep in
+ * memory for chats that are not shown, when the
+ * memory is low.
+ *
+ * Returns: The number of messages
+ */
+guint
+chatty_settings_get_inactive_chat_messages (ChattySettings *self)
+{
+  g_return_val_if_fail (CHATTY_IS_SETTINGS (self), 0);
+
+  return g_settings_get_uint (self->settings, "inactive-chat-messages");
+}
+
+/**
+ * chatty_settings_get_message_memory_budget:
+ * @self: A #ChattySettings
+ *
+ * Get the memory the loaded messages of all chats
+ * may use before inactive chats are trimmed.
+ *
+ * Returns: The budget in MiB
+ */
+guint
+chatty_settings_get_message_memory_budget (ChattySettings *self)
+{
+  g_return_val_if_fail (CHATTY_IS_SETTINGS (self), 0);
+
+  return g_settings_get_uint (self->settings, "message-memory-budget");
+}
+
+/**
+ * chatty_settings_get_history_max_days:
+ * @self: A #ChattySettings
+ *
+ * Get the number of days messages are kept in
+ * history before they are deleted.
+ *
+ * Returns: The number of days, or 0 to keep all
+ */
+guint
+chatty_settings_get_history_max_days (ChattySettings *self)
+{
+  g_return_val_if_fail (CHATTY_IS_SETTINGS (self), 0);
+
+  return g_settings_get_uint (self->settings, "history-max-days");
+}
+
+/**
+ * chatty_settings_get_history_max_messages:
+ * @self: A #ChattySettings
+ *
+ * Get the number of latest messages kept in
+ * history for each chat.
+ *
+ * Returns: The number of messages, or 0 to keep all
+ */
+guint
+chatty_settings_get_history_max_messages (ChattySettings *self)
+{
+  g_return_val_if_fail (CHATTY_IS_SETTINGS (self), 0);
+
+  return g_settings_get_uint (self->settings, "history-max-messages");
+}
+
 /**
  * chatty_settings_get_window_maximized:
  * @self: A #ChattySettings
@@ -41,6 +41,12 @@ gboolean        chatty_settings_get_indicate_unknown_contacts (ChattySettings *s
 gboolean        chatty_settings_get_convert_emoticons        (ChattySettings *self);
 gboolean        chatty_settings_get_return_sends_message     (ChattySettings *self);
 gboolean        chatty_settings_get_mam_enabled              (ChattySettings *self);
+guint           chatty_settings_get_notification_delay       (ChattySettings *self);
+guint           chatty_settings_get_feedback_interval        (ChattySettings *self);
+guint           chatty_settings_get_inactive_chat_messages   (ChattySettings *self);
+guint           chatty_settings_get_message_memory_budget    (ChattySettings *self);
+guint           chatty_settings_get_history_max_days         (ChattySettings *self);
+guint           chatty_settings_get_history_max_messages     (ChattySettings *self);
 gboolean        chatty_settings_get_window_maximized         (ChattySettings *self);
 void            chatty_settings_set_window_maximized         (ChattySettings *self,
                                                               gboolean        maximized);
@@ -25,6 +25,8 @@ struct _ChattyTextItem
   GtkWidget     *content_label;
 
   ChattyMessage *message;
+  /* Owned by message */
+  const char    *markup;
   ChattyProtocol protocol;
   gboolean       is_im;
 };
@@ -32,86 +34,24 @@ struct _ChattyTextItem
 G_DEFINE_TYPE (ChattyTextItem, chatty_text_item, GTK_TYPE_BIN)
 
 
-static gchar *
-chatty_msg_list_escape_message (ChattyTextItem *self,
-                                const char       *message)
-{
-  g_autofree char *nl_2_br = NULL;
-  g_autofree char *striped = NULL;
-  g_autofree char *escaped = NULL;
-  g_autofree char *linkified = NULL;
-  char *result;
-
-  nl_2_br = purple_strdup_withhtml (message);
-  striped = purple_markup_strip_html (nl_2_br);
-  escaped = purple_markup_escape_text (striped, -1);
-  linkified = purple_markup_linkify (escaped);
-  // convert all tags to lowercase for GtkLabel markup parser
-  purple_markup_html_to_xhtml (linkified, &result, NULL);
-
-  return result;
-}
-
-static void
-text_item_update_quotes (ChattyTextItem *self)
-{
-  const char *text, *end;
-  char *quote;
-
-  text = gtk_label_get_text (GTK_LABEL (self->content_label));
-  end = text;
-
-  if (!gtk_label_get_attributes (GTK_LABEL (self->content_label))) {
-    PangoAttrList *list;
-
-    list = pango_attr_list_new ();
-    gtk_label_set_attributes (GTK_LABEL (self->content_label), list);
-    pango_attr_list_unref (list);
-
-  }
-
-  if (!text || !*text)
-    return;
-
-  do {
-    quote = strchr (end, '>');
-
-    if (quote &&
-        (quote == text ||
-         *(quote - 1) == '\n')) {
-      PangoAttrList *list;
-      PangoAttribute *attribute;
-
-      list = gtk_label_get_attributes (GTK_LABEL (self->content_label));
-      end = strchr (quote, '\n');
-
-      if (!end)
-        end = quote + strlen (quote);
-
-      attribute = pango_attr_foreground_new (30000, 30000, 30000);
-      attribute->start_index = quote - text;
-      attribute->end_index = end - text + 1;
-      pango_attr_list_insert (list, attribute);
-    } else if (quote && *quote) {
-      /* Move forward one character if '>' happend midst a line */
-      end = end + 1;
-    }
-  } while (quote && *quote);
-}
-
 static void
 text_item_update_message (ChattyTextItem *self)
 {
-  g_autofree char *message = NULL;
+  PangoAttrList *quote_attrs;
+  const char *markup;
 
   g_assert (CHATTY_IS_TEXT_ITEM (self));
   g_assert (self->message);
 
-  message = chatty_msg_list_escape_message (self, chatty_message_get_text (self->message));
+  markup = chatty_message_get_markup (self->message, &quote_attrs);
 
-  gtk_label_set_markup (GTK_LABEL (self->content_label), message);
+  /* The markup is cached in the message, nothing to do if already set */
+  if (markup == self->markup)
+    return;
 
-  text_item_update_quotes (self);
+  self->markup = markup;
+  gtk_label_set_markup (GTK_LABEL (self->content_label), markup);
+  gtk_label_set_attributes (GTK_LABEL (self->content_label), quote_attrs);
 }
 
 static void
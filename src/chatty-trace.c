@@ -0,0 +1,384 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-trace.c
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "chatty-trace"
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <unistd.h>
+#ifdef __linux__
+# include <sys/prctl.h>
+#endif
+#include <gio/gio.h>
+
+#include "chatty-trace.h"
+
+/**
+ * SECTION: chatty-trace
+ * @title: chatty-trace
+ * @short_description: Span based tracing
+ *
+ * Spans and counters are recorded with monotonic timestamps
+ * in a ring buffer per thread, so that recording an event
+ * never takes a lock.  Only the latest %TRACE_BUFFER_SIZE
+ * events of each thread are kept.  The events can be exported
+ * in the Chrome trace event format, which can be loaded in
+ * chrome://tracing or https://ui.perfetto.dev.
+ *
+ * Names and categories are not copied, and so they should be
+ * static strings.
+ *
+ * Tracing is disabled unless chatty_trace_init() is called.
+ */
+
+/* Events kept per thread, should be a power of 2 */
+#define TRACE_BUFFER_SIZE 8192
+
+typedef struct {
+  const char *category;
+  const char *name;
+  gint64      time;
+  /* duration for complete and async events, value for counters */
+  gint64      value;
+  /* Identifies async events, which may overlap */
+  gsize       id;
+  char        phase;
+} TraceEvent;
+
+typedef struct {
+  TraceEvent events[TRACE_BUFFER_SIZE];
+  /* Number of events ever added, written only by the owner thread */
+  int        head;
+  int        tid;
+  char       thread_name[17];
+} TraceBuffer;
+
+static int trace_enabled;
+static int trace_n_threads;
+/* Buffers are never freed, so that events of threads
+ * that exited can be exported too */
+static GMutex trace_lock;
+static GPtrArray *trace_buffers;
+static GPrivate trace_buffer_key;
+
+static TraceBuffer *
+trace_get_buffer (void)
+{
+  TraceBuffer *buffer;
+
+  buffer = g_private_get (&trace_buffer_key);
+
+  if (G_LIKELY (buffer))
+    return buffer;
+
+  buffer = g_new0 (TraceBuffer, 1);
+  buffer->tid = g_atomic_int_add (&trace_n_threads, 1) + 1;
+#ifdef __linux__
+  prctl (PR_GET_NAME, buffer->thread_name, 0, 0, 0);
+#endif
+  if (!*buffer->thread_name)
+    g_snprintf (buffer->thread_name, sizeof (buffer->thread_name), "thread-%d", buffer->tid);
+
+  g_mutex_lock (&trace_lock);
+  if (!trace_buffers)
+    trace_buffers = g_ptr_array_new ();
+  g_ptr_array_add (trace_buffers, buffer);
+  g_mutex_unlock (&trace_lock);
+
+  g_private_set (&trace_buffer_key, buffer);
+
+  return buffer;
+}
+
+static void
+trace_add_event (char        phase,
+                 const char *category,
+                 const char *name,
+                 gint64      time,
+                 gint64      value,
+                 gsize       id)
+{
+  TraceBuffer *buffer;
+  TraceEvent *event;
+  guint head;
+
+  buffer = trace_get_buffer ();
+  head = (guint)buffer->head;
+  event = &buffer->events[head % TRACE_BUFFER_SIZE];
+
+  event->category = category;
+  event->name = name;
+  event->time = time;
+  event->value = value;
+  event->id = id;
+  event->phase = phase;
+
+  /* Publish the event only after it's written completely */
+  g_atomic_int_set (&buffer->head, (int)(head + 1));
+}
+
+static void
+trace_append_string (GString    *str,
+                     const char *value)
+{
+  g_string_append_c (str, '"');
+
+  for (const char *c = value ? value : ""; *c; c++) {
+    if (*c == '"' || *c == '\\')
+      g_string_append_printf (str, "\\%c", *c);
+    else if ((guchar)*c < 0x20)
+      g_string_append_printf (str, "\\u%04x", *c);
+    else
+      g_string_append_c (str, *c);
+  }
+
+  g_string_append_c (str, '"');
+}
+
+static void
+trace_append_async (GString    *str,
+                    TraceEvent *event,
+                    char        phase,
+                    gint64      time,
+                    int         pid,
+                    int         tid)
+{
+  g_string_append_printf (str, "{\"ph\":\"%c\",\"pid\":%d,\"tid\":%d,\"ts\":%" G_GINT64_FORMAT ","
+                          "\"id\":\"0x%" G_GSIZE_MODIFIER "x\",\"cat\":",
+                          phase, pid, tid, time, event->id);
+  trace_append_string (str, event->category ? event->category : "chatty");
+  g_string_append (str, ",\"name\":");
+  trace_append_string (str, event->name);
+  g_string_append (str, "},\n");
+}
+
+static void
+trace_append_buffer (GString     *str,
+                     TraceBuffer *buffer,
+                     int          pid)
+{
+  g_autofree TraceEvent *events = NULL;
+  guint head, start, n_events, skip = 0;
+
+  head = (guint)g_atomic_int_get (&buffer->head);
+  start = head > TRACE_BUFFER_SIZE ? head - TRACE_BUFFER_SIZE : 0;
+  n_events = head - start;
+  events = g_new (TraceEvent, n_events);
+
+  for (guint i = 0; i < n_events; i++)
+    events[i] = buffer->events[(start + i) % TRACE_BUFFER_SIZE];
+
+  /* Skip the events that may have been overwritten while copying,
+   * including the one being written right now */
+  head = (guint)g_atomic_int_get (&buffer->head);
+  if (head + 1 > start + TRACE_BUFFER_SIZE)
+    skip = MIN (head + 1 - TRACE_BUFFER_SIZE - start, n_events);
+
+  g_string_append_printf (str, "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,"
+                          "\"args\":{\"name\":", pid, buffer->tid);
+  trace_append_string (str, buffer->thread_name);
+  g_string_append (str, "}},\n");
+
+  for (guint i = skip; i < n_events; i++) {
+    TraceEvent *event = &events[i];
+
+    /* Async events are saved as a single event, split them */
+    if (event->phase == 'A') {
+      trace_append_async (str, event, 'b', event->time, pid, buffer->tid);
+      trace_append_async (str, event, 'e', event->time + event->value, pid, buffer->tid);
+      continue;
+    }
+
+    g_string_append_printf (str, "{\"ph\":\"%c\",\"pid\":%d,\"tid\":%d,\"ts\":%" G_GINT64_FORMAT ",",
+                            event->phase, pid, buffer->tid, event->time);
+    if (event->category) {
+      g_string_append (str, "\"cat\":");
+      trace_append_string (str, event->category);
+      g_string_append_c (str, ',');
+    }
+
+    g_string_append (str, "\"name\":");
+    trace_append_string (str, event->name);
+
+    if (event->phase == 'X')
+      g_string_append_printf (str, ",\"dur\":%" G_GINT64_FORMAT, event->value);
+    else if (event->phase == 'C')
+      g_string_append_printf (str, ",\"args\":{\"value\":%" G_GINT64_FORMAT "}", event->value);
+
+    g_string_append (str, "},\n");
+  }
+}
+
+/**
+ * chatty_trace_init:
+ *
+ * Enable tracing.  Events are recorded only
+ * after this is called.
+ */
+void
+chatty_trace_init (void)
+{
+  g_atomic_int_set (&trace_enabled, TRUE);
+}
+
+gboolean
+chatty_trace_is_enabled (void)
+{
+  return g_atomic_int_get (&trace_enabled);
+}
+
+/**
+ * chatty_trace_begin:
+ * @category: (nullable): The category of the span
+ * @name: The name of the span
+ *
+ * Start a span in the current thread, which should be
+ * ended with chatty_trace_end() in the same thread.
+ * Spans can be nested.
+ */
+void
+chatty_trace_begin (const char *category,
+                    const char *name)
+{
+  if (!chatty_trace_is_enabled ())
+    return;
+
+  trace_add_event ('B', category, name, g_get_monotonic_time (), 0, 0);
+}
+
+void
+chatty_trace_end (const char *category,
+                  const char *name)
+{
+  if (!chatty_trace_is_enabled ())
+    return;
+
+  trace_add_event ('E', category, name, g_get_monotonic_time (), 0, 0);
+}
+
+/**
+ * chatty_trace_complete:
+ * @category: (nullable): The category of the span
+ * @name: The name of the span
+ * @start_time: The monotonic time the span started
+ * @end_time: The monotonic time the span ended
+ *
+ * Add a span that is already complete.  Useful for
+ * operations that don't end in the same scope, eg:
+ * HTTP requests.
+ */
+void
+chatty_trace_complete (const char *category,
+                       const char *name,
+                       gint64      start_time,
+                       gint64      end_time)
+{
+  if (!chatty_trace_is_enabled () || !start_time)
+    return;
+
+  trace_add_event ('X', category, name, start_time, end_time - start_time, 0);
+}
+
+/**
+ * chatty_trace_async:
+ * @category: (nullable): The category of the span
+ * @name: The name of the span
+ * @id: An id unique among the spans that may overlap
+ * @start_time: The monotonic time the span started
+ * @end_time: The monotonic time the span ended
+ *
+ * Same as chatty_trace_complete(), but for spans that
+ * may overlap with others in the same thread, eg: HTTP
+ * requests running in parallel.  Such spans are shown
+ * in a track of their own.
+ */
+void
+chatty_trace_async (const char *category,
+                    const char *name,
+                    gsize       id,
+                    gint64      start_time,
+                    gint64      end_time)
+{
+  if (!chatty_trace_is_enabled () || !start_time)
+    return;
+
+  trace_add_event ('A', category, name, start_time, end_time - start_time, id);
+}
+
+/**
+ * chatty_trace_counter:
+ * @name: The name of the counter
+ * @value: The current value
+ *
+ * Record the current value of the counter @name,
+ * eg: the number of items in a queue.
+ */
+void
+chatty_trace_counter (const char *name,
+                      gint64      value)
+{
+  if (!chatty_trace_is_enabled ())
+    return;
+
+  trace_add_event ('C', NULL, name, g_get_monotonic_time (), value, 0);
+}
+
+void
+chatty_trace_span_end (ChattyTraceSpan *span)
+{
+  chatty_trace_complete (span->category, span->name,
+                         span->start_time, g_get_monotonic_time ());
+}
+
+/**
+ * chatty_trace_export:
+ * @file_name: The file to save the trace to
+ * @error: A location for a #GError, or %NULL
+ *
+ * Save the events recorded so far in every thread to
+ * @file_name, in Chrome trace event JSON format.
+ *
+ * Returns: %TRUE if the trace was saved, %FALSE
+ * otherwise with @error set.
+ */
+gboolean
+chatty_trace_export (const char  *file_name,
+                     GError     **error)
+{
+  g_autoptr(GString) str = NULL;
+  int pid;
+
+  g_return_val_if_fail (file_name && *file_name, FALSE);
+  g_return_val_if_fail (!error || !*error, FALSE);
+
+  if (!chatty_trace_is_enabled ()) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_INITIALIZED,
+                 "Tracing is not enabled");
+    return FALSE;
+  }
+
+  pid = getpid ();
+  str = g_string_new ("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+  g_mutex_lock (&trace_lock);
+  for (guint i = 0; trace_buffers && i < trace_buffers->len; i++)
+    trace_append_buffer (str, trace_buffers->pdata[i], pid);
+  g_mutex_unlock (&trace_lock);
+
+  /* Remove the separator after the last event */
+  if (g_str_has_suffix (str->str, ",\n"))
+    g_string_truncate (str, str->len - 2);
+  g_string_append (str, "\n]}\n");
+
+  return g_file_set_contents (file_name, str->str, str->len, error);
+}
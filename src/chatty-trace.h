@@ -0,0 +1,55 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-trace.h
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct {
+  const char *category;
+  const char *name;
+  gint64      start_time;
+} ChattyTraceSpan;
+
+/*
+ * Trace the time spent until the end of the current scope.
+ * @_name should be a static string, eg: G_STRFUNC.
+ */
+#define CHATTY_TRACE_SPAN(_name)                                        \
+  g_auto(ChattyTraceSpan) G_GNUC_UNUSED G_PASTE (_chatty_span_, __LINE__) = \
+    { G_LOG_DOMAIN, _name, chatty_trace_is_enabled () ? g_get_monotonic_time () : 0 }
+
+void     chatty_trace_init       (void);
+gboolean chatty_trace_is_enabled (void);
+void     chatty_trace_begin      (const char      *category,
+                                  const char      *name);
+void     chatty_trace_end        (const char      *category,
+                                  const char      *name);
+void     chatty_trace_complete   (const char      *category,
+                                  const char      *name,
+                                  gint64           start_time,
+                                  gint64           end_time);
+void     chatty_trace_async      (const char      *category,
+                                  const char      *name,
+                                  gsize            id,
+                                  gint64           start_time,
+                                  gint64           end_time);
+void     chatty_trace_counter    (const char      *name,
+                                  gint64           value);
+void     chatty_trace_span_end   (ChattyTraceSpan *span);
+gboolean chatty_trace_export     (const char      *file_name,
+                                  GError         **error);
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (ChattyTraceSpan, chatty_trace_span_end)
+
+G_END_DECLS
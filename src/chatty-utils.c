@@ -9,6 +9,7 @@
 #include <glib.h>
 #include <glib/gi18n.h>
 #include "chatty-manager.h"
+#include "chatty-indexed-store.h"
 #include "chatty-settings.h"
 #include "chatty-phone-utils.h"
 #include "chatty-utils.h"
@@ -266,7 +267,75 @@ chatty_utils_jabber_id_strip (const char *name)
   return stripped;
 }
 
+/**
+ * chatty_utils_get_search_key:
+ * @str: (nullable): A UTF-8 string
+ *
+ * Get a case folded and normalized version of
+ * @str that can be used for case insensitive
+ * substring search.  Both the needle and the
+ * haystack should be converted to search keys
+ * before comparison.
+ *
+ * Returns: (transfer full): A new string. Free
+ * with g_free().
+ */
+char *
+chatty_utils_get_search_key (const char *str)
+{
+  g_autofree char *folded = NULL;
+  char *key;
+
+  if (!str)
+    str = "";
+
+  folded = g_utf8_casefold (str, -1);
+  key = g_utf8_normalize (folded, -1, G_NORMALIZE_ALL);
+
+  /* Invalid UTF-8 */
+  if (!key)
+    key = g_steal_pointer (&folded);
+
+  return key;
+}
+
+/**
+ * chatty_utils_search_key_contains:
+ * @str: (nullable): The string to search in
+ * @needle: (nullable): A search key
+ *
+ * Check if @needle, created with chatty_utils_get_search_key(),
+ * is a substring of @str, after folding @str the same way.
+ *
+ * Returns: %TRUE if @str contains @needle, %FALSE otherwise.
+ */
+gboolean
+chatty_utils_search_key_contains (const char *str,
+                                  const char *needle)
+{
+  g_autofree char *key = NULL;
+
+  if (!str || !needle)
+    return FALSE;
+
+  key = chatty_utils_get_search_key (str);
+
+  return strstr (key, needle) != NULL;
+}
+
 
+/**
+ * chatty_utils_get_item_position:
+ * @list: a #GListModel
+ * @item: A #GObject derived object
+ * @position: (out) (optional): The position of @item
+ *
+ * Find the position of @item in @list.  If @list is a
+ * #ChattyIndexedStore, the index is used, otherwise
+ * every item is checked.
+ *
+ * Returns: %TRUE if found. %FALSE otherwise.
+ */
 gboolean
 chatty_utils_get_item_position (GListModel *list,
                                 gpointer    item,
@@ -277,6 +346,9 @@ chatty_utils_get_item_position (GListModel *list,
   g_return_val_if_fail (G_IS_LIST_MODEL (list), FALSE);
   g_return_val_if_fail (item != NULL, FALSE);
 
+  if (CHATTY_IS_INDEXED_STORE (list))
+    return chatty_indexed_store_find (CHATTY_INDEXED_STORE (list), item, position);
+
   n_items = g_list_model_get_n_items (list);
 
   for (guint i = 0; i < n_items; i++)
@@ -302,7 +374,9 @@ chatty_utils_get_item_position (GListModel *list,
  * @store: a #GListStore
  * @item: A #GObject derived object
  *
- * Remove first found @item from @store.
+ * Remove first found @item from @store.  Use
+ * chatty_indexed_store_remove_item() for a
+ * #ChattyIndexedStore.
  *
  * Returns: %TRUE if found and removed. %FALSE otherwise.
  */
@@ -310,30 +384,17 @@ gboolean
 chatty_utils_remove_list_item (GListStore *store,
                                gpointer    item)
 {
-  GListModel *model;
-  guint n_items;
+  guint position;
 
   g_return_val_if_fail (G_IS_LIST_STORE (store), FALSE);
   g_return_val_if_fail (item, FALSE);
 
-  model = G_LIST_MODEL (store);
-  n_items = g_list_model_get_n_items (model);
-
-  for (guint i = 0; i < n_items; i++)
-    {
-      g_autoptr(GObject) object = NULL;
-
-      object = g_list_model_get_item (model, i);
-
-      if (object == item)
-        {
-          g_list_store_remove (store, i);
+  if (!chatty_utils_get_item_position (G_LIST_MODEL (store), item, &position))
+    return FALSE;
 
-          return TRUE;
-        }
-    }
+  g_list_store_remove (store, position);
 
-  return FALSE;
+  return TRUE;
 }
 
 char *
@@ -35,6 +35,9 @@ struct _ChattyFileInfo {
 };
 
 char *chatty_utils_jabber_id_strip (const char *name);
+char *chatty_utils_get_search_key   (const char *str);
+gboolean chatty_utils_search_key_contains (const char *str,
+                                           const char *needle);
 char *chatty_utils_check_phonenumber (const char *phone_number,
                                       const char *country);
 ChattyProtocol chatty_utils_username_is_valid  (const char     *name,
@@ -59,10 +59,12 @@ struct _ChattyWindow
   GtkWidget *search_button;
   GtkWidget *chats_search_bar;
   GtkWidget *chats_search_entry;
+  GtkWidget *sync_progress_bar;
 
   GtkWidget *header_chat_list_new_msg_popover;
 
   GtkWidget *menu_add_contact_button;
+  GtkWidget *menu_preferences_button;
   GtkWidget *menu_new_message_button;
   GtkWidget *menu_new_group_message_button;
   GtkWidget *header_add_chat_button;
@@ -75,6 +77,10 @@ struct _ChattyWindow
   ChattyItem    *selected_item;
   ChattyManager *manager;
 
+  /* Messages of the chat open in chat_view */
+  GListModel    *chat_messages;
+  guint          mark_read_id;
+
   char          *chat_needle;
   GtkFilter     *chat_filter;
   GtkFilterListModel *filter_model;
@@ -186,6 +192,11 @@ window_chat_name_matches (ChattyItem   *item,
   g_assert (CHATTY_IS_CHAT (item));
   g_assert (CHATTY_IS_WINDOW (self));
 
+  /* Matching the needle is the cheapest test, and rules out most items while searching */
+  if (self->chat_needle && *self->chat_needle &&
+      !chatty_item_matches (item, self->chat_needle, CHATTY_PROTOCOL_ANY, TRUE))
+    return FALSE;
+
   protocols = chatty_manager_get_active_protocols (self->manager);
   protocol = chatty_item_get_protocols (item);
 
@@ -219,12 +230,7 @@ window_chat_name_matches (ChattyItem   *item,
       return FALSE;
   }
 
-
-  if (!self->chat_needle || !*self->chat_needle)
-    return TRUE;
-
-  return chatty_item_matches (item, self->chat_needle,
-                              CHATTY_PROTOCOL_ANY, TRUE);
+  return TRUE;
 }
 
 
@@ -299,12 +305,29 @@ static void
 window_search_changed_cb (ChattyWindow *self,
                           GtkEntry     *entry)
 {
+  g_autofree char *old_needle = NULL;
+  GtkFilterChange change;
+
   g_assert (CHATTY_IS_WINDOW (self));
 
-  g_free (self->chat_needle);
-  self->chat_needle = g_strdup (gtk_entry_get_text (entry));
+  old_needle = self->chat_needle;
+  self->chat_needle = chatty_utils_get_search_key (gtk_entry_get_text (entry));
 
-  gtk_filter_changed (self->chat_filter, GTK_FILTER_CHANGE_DIFFERENT);
+  if (!old_needle)
+    old_needle = g_strdup ("");
+
+  if (g_str_equal (self->chat_needle, old_needle))
+    return;
+
+  /* Typing more characters can only hide items, and deleting can only show */
+  if (g_str_has_prefix (self->chat_needle, old_needle))
+    change = GTK_FILTER_CHANGE_MORE_STRICT;
+  else if (g_str_has_prefix (old_needle, self->chat_needle))
+    change = GTK_FILTER_CHANGE_LESS_STRICT;
+  else
+    change = GTK_FILTER_CHANGE_DIFFERENT;
+
+  gtk_filter_changed (self->chat_filter, change);
 }
 
 static void
@@ -634,6 +657,22 @@ window_active_protocols_changed_cb (ChattyWindow *self)
   window_chat_changed_cb (self);
 }
 
+static void
+window_sync_progress_changed_cb (ChattyWindow *self)
+{
+  ChattyHistory *history;
+  double progress;
+
+  g_assert (CHATTY_IS_WINDOW (self));
+
+  history = chatty_manager_get_history (self->manager);
+  /* Migrating old history is shown the same as syncing archives */
+  progress = MIN (chatty_manager_get_sync_progress (self->manager),
+                  chatty_history_get_migration_progress (history));
+  gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (self->sync_progress_bar), progress);
+  gtk_widget_set_visible (self->sync_progress_bar, progress < 1.0);
+}
+
 static void
 window_chat_deleted_cb (ChattyWindow *self,
                         ChattyChat   *chat)
@@ -648,6 +687,20 @@ window_chat_deleted_cb (ChattyWindow *self,
   chatty_chat_view_set_chat (CHATTY_CHAT_VIEW (self->chat_view), NULL);
 }
 
+static void
+chatty_window_map (GtkWidget *widget)
+{
+  ChattyWindow *self = (ChattyWindow *)widget;
+  ChattyEvictionManager *eviction;
+
+  GTK_WIDGET_CLASS (chatty_window_parent_class)->map (widget);
+
+  /* The chat shown again shouldn't be trimmed */
+  eviction = chatty_manager_get_eviction_manager (self->manager);
+  chatty_eviction_manager_set_active_chat (eviction,
+                                           chatty_chat_view_get_chat (CHATTY_CHAT_VIEW (self->chat_view)));
+}
+
 static void
 chatty_window_unmap (GtkWidget *widget)
 {
@@ -656,6 +709,11 @@ chatty_window_unmap (GtkWidget *widget)
   GdkRectangle  geometry;
   gboolean      is_maximized;
 
+  /* No chat is shown when hidden, so every chat may be trimmed */
+  if (self->manager)
+    chatty_eviction_manager_set_active_chat (chatty_manager_get_eviction_manager (self->manager),
+                                             NULL);
+
   is_maximized = gtk_window_is_maximized (window);
 
   chatty_settings_set_window_maximized (self->settings, is_maximized);
@@ -721,6 +779,8 @@ chatty_window_dispose (GObject *object)
 {
   ChattyWindow *self = (ChattyWindow *)object;
 
+  g_clear_handle_id (&self->mark_read_id, g_source_remove);
+  g_clear_object (&self->chat_messages);
   g_clear_object (&self->filter_model);
   g_clear_object (&self->chat_filter);
   g_clear_object (&self->manager);
@@ -740,6 +800,7 @@ chatty_window_class_init (ChattyWindowClass *klass)
   object_class->finalize     = chatty_window_finalize;
   object_class->dispose      = chatty_window_dispose;
 
+  widget_class->map = chatty_window_map;
   widget_class->unmap = chatty_window_unmap;
 
   gtk_widget_class_set_template_from_resource (widget_class,
@@ -749,6 +810,7 @@ chatty_window_class_init (ChattyWindowClass *klass)
   gtk_widget_class_bind_template_child (widget_class, ChattyWindow, sub_header_label);
   gtk_widget_class_bind_template_child (widget_class, ChattyWindow, sub_header_icon);
   gtk_widget_class_bind_template_child (widget_class, ChattyWindow, menu_add_contact_button);
+  gtk_widget_class_bind_template_child (widget_class, ChattyWindow, menu_preferences_button);
   gtk_widget_class_bind_template_child (widget_class, ChattyWindow, menu_new_message_button);
   gtk_widget_class_bind_template_child (widget_class, ChattyWindow, menu_new_group_message_button);
   gtk_widget_class_bind_template_child (widget_class, ChattyWindow, header_add_chat_button);
@@ -759,6 +821,7 @@ chatty_window_class_init (ChattyWindowClass *klass)
   gtk_widget_class_bind_template_child (widget_class, ChattyWindow, search_button);
   gtk_widget_class_bind_template_child (widget_class, ChattyWindow, chats_search_bar);
   gtk_widget_class_bind_template_child (widget_class, ChattyWindow, chats_search_entry);
+  gtk_widget_class_bind_template_child (widget_class, ChattyWindow, sync_progress_bar);
 
   gtk_widget_class_bind_template_child (widget_class, ChattyWindow, content_box);
   gtk_widget_class_bind_template_child (widget_class, ChattyWindow, header_box);
@@ -800,6 +863,18 @@ chatty_window_init (ChattyWindow *self)
   g_signal_connect_object (self->manager, "chat-deleted",
                            G_CALLBACK (window_chat_deleted_cb), self,
                            G_CONNECT_SWAPPED);
+  /* Accounts are managed by libpurple, which is loaded after the window is shown */
+  g_object_bind_property (self->manager, "loaded",
+                          self->menu_preferences_button, "sensitive",
+                          G_BINDING_SYNC_CREATE);
+  g_signal_connect_object (self->manager, "notify::sync-progress",
+                           G_CALLBACK (window_sync_progress_changed_cb), self,
+                           G_CONNECT_SWAPPED);
+  g_signal_connect_object (chatty_manager_get_history (self->manager),
+                           "notify::migration-progress",
+                           G_CALLBACK (window_sync_progress_changed_cb), self,
+                           G_CONNECT_SWAPPED);
+  window_sync_progress_changed_cb (self);
 }
 
 
@@ -857,10 +932,61 @@ chatty_window_get_active_chat (ChattyWindow *self)
   return NULL;
 }
 
+static void
+window_mark_chat_read (ChattyWindow *self)
+{
+  ChattyChat *chat;
+
+  g_assert (CHATTY_IS_WINDOW (self));
+
+  chat = chatty_window_get_active_chat (self);
+
+  if (!chat)
+    return;
+
+  chatty_chat_set_unread_count (chat, 0);
+  /* So that the unread count is right when loaded from history */
+  chatty_history_set_chat_read_async (chatty_manager_get_history (self->manager),
+                                      chat, NULL, NULL);
+}
+
+static gboolean
+window_mark_chat_read_cb (gpointer user_data)
+{
+  ChattyWindow *self = user_data;
+
+  g_assert (CHATTY_IS_WINDOW (self));
+
+  self->mark_read_id = 0;
+  window_mark_chat_read (self);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+window_chat_messages_changed_cb (ChattyWindow *self,
+                                 guint         position,
+                                 guint         removed,
+                                 guint         added)
+{
+  g_assert (CHATTY_IS_WINDOW (self));
+
+  /*
+   * New messages are appended to the chat before they are saved
+   * to history, so mark the chat read from an idle, after the
+   * message is stored.  Otherwise, last_read_id would point to
+   * the message before and the new one would count as unread.
+   */
+  if (added && !self->mark_read_id)
+    self->mark_read_id = g_idle_add (window_mark_chat_read_cb, self);
+}
+
 void
 chatty_window_open_chat (ChattyWindow *self,
                          ChattyChat   *chat)
 {
+  ChattyEvictionManager *eviction;
+
   g_return_if_fail (CHATTY_IS_WINDOW (self));
   g_return_if_fail (CHATTY_IS_CHAT (chat));
   g_debug ("opening item of type: %s, protocol: %d",
@@ -868,12 +994,23 @@ chatty_window_open_chat (ChattyWindow *self,
            chatty_item_get_protocols (CHATTY_ITEM (chat)));
 
   chatty_chat_view_set_chat (CHATTY_CHAT_VIEW (self->chat_view), chat);
+  eviction = chatty_manager_get_eviction_manager (self->manager);
+  chatty_eviction_manager_set_active_chat (eviction, chat);
+  chatty_eviction_manager_check_budget (eviction);
   window_set_item (self, CHATTY_ITEM (chat));
   window_chat_changed_cb (self);
 
   gtk_widget_set_visible (self->delete_button, CHATTY_IS_PP_CHAT (chat));
   hdy_leaflet_set_visible_child (HDY_LEAFLET (self->content_box), self->chat_view);
 
-  if (chatty_window_get_active_chat (self))
-    chatty_chat_set_unread_count (chat, 0);
+  if (self->chat_messages)
+    g_signal_handlers_disconnect_by_func (self->chat_messages,
+                                          window_chat_messages_changed_cb,
+                                          self);
+  g_set_object (&self->chat_messages, chatty_chat_get_messages (chat));
+  g_signal_connect_object (self->chat_messages, "items-changed",
+                           G_CALLBACK (window_chat_messages_changed_cb), self,
+                           G_CONNECT_SWAPPED);
+
+  window_mark_chat_read (self);
 }
@@ -511,10 +511,12 @@ gtk_filter_list_model_find_filtered (GtkFilterListModel *self,
 }
 
 static void
-gtk_filter_list_model_refilter (GtkFilterListModel *self);
+gtk_filter_list_model_refilter (GtkFilterListModel *self,
+                                GtkFilterChange     change);
 
 static void
-gtk_filter_list_model_update_strictness_and_refilter (GtkFilterListModel *self)
+gtk_filter_list_model_update_strictness_and_refilter (GtkFilterListModel *self,
+                                                      GtkFilterChange     change)
 {
   GtkFilterMatch new_strictness;
 
@@ -604,7 +606,7 @@ gtk_filter_list_model_update_strictness_and_refilter (GtkFilterListModel *self)
           break;
         default:
         case GTK_FILTER_MATCH_SOME:
-          gtk_filter_list_model_refilter (self);
+          gtk_filter_list_model_refilter (self, change);
           break;
         }
     }
@@ -615,7 +617,7 @@ gtk_filter_list_model_filter_changed_cb (GtkFilter          *filter,
                                          GtkFilterChange     change,
                                          GtkFilterListModel *self)
 {
-  gtk_filter_list_model_update_strictness_and_refilter (self);
+  gtk_filter_list_model_update_strictness_and_refilter (self, change);
 }
 
 static void
@@ -768,7 +770,7 @@ gtk_filter_list_model_set_filter (GtkFilterListModel *self,
     }
   else
     {
-      gtk_filter_list_model_update_strictness_and_refilter (self);
+      gtk_filter_list_model_update_strictness_and_refilter (self, GTK_FILTER_CHANGE_DIFFERENT);
     }
 
   g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_FILTER]);
@@ -827,7 +829,7 @@ gtk_filter_list_model_set_model (GtkFilterListModel *self,
       if (removed == 0)
         {
           self->strictness = GTK_FILTER_MATCH_NONE;
-          gtk_filter_list_model_update_strictness_and_refilter (self);
+          gtk_filter_list_model_update_strictness_and_refilter (self, GTK_FILTER_CHANGE_DIFFERENT);
           added = 0;
         }
       else if (self->items)
@@ -863,8 +865,15 @@ gtk_filter_list_model_get_model (GtkFilterListModel *self)
   return self->model;
 }
 
+/*
+ * If the filter got @change of %GTK_FILTER_CHANGE_MORE_STRICT, items
+ * already hidden can't become visible, and if it's
+ * %GTK_FILTER_CHANGE_LESS_STRICT, visible items can't get hidden.
+ * So re-run the filter only on the items that may change.
+ */
 static void
-gtk_filter_list_model_refilter (GtkFilterListModel *self)
+gtk_filter_list_model_refilter (GtkFilterListModel *self,
+                                GtkFilterChange     change)
 {
   FilterNode *node;
   guint i, first_change, last_change;
@@ -884,7 +893,11 @@ gtk_filter_list_model_refilter (GtkFilterListModel *self)
        node != NULL;
        i++, node = gtk_rb_tree_node_get_next (node))
     {
-      visible = gtk_filter_list_model_run_filter (self, i);
+      if ((change == GTK_FILTER_CHANGE_MORE_STRICT && !node->visible) ||
+          (change == GTK_FILTER_CHANGE_LESS_STRICT && node->visible))
+        visible = node->visible;
+      else
+        visible = gtk_filter_list_model_run_filter (self, i);
       if (visible == node->visible)
         {
           if (visible)
@@ -438,7 +438,7 @@ void
 gtk_slice_list_model_set_offset (GtkSliceListModel *self,
                                  guint              offset)
 {
-  guint before, after;
+  guint before, after, size;
 
   g_return_if_fail (GTK_IS_SLICE_LIST_MODEL (self));
 
@@ -446,13 +446,47 @@ gtk_slice_list_model_set_offset (GtkSliceListModel *self,
     return;
 
   before = g_list_model_get_n_items (G_LIST_MODEL (self));
+  size = self->size;
+
+  /* If the old and new slices overlap, only emit changes at the
+   * edges so that the items still in the slice are kept.  The size
+   * is adjusted temporarily so that the model is consistent on
+   * each emission. */
+  if (before > 0 && offset > self->offset && offset - self->offset < before)
+    {
+      guint diff = offset - self->offset;
 
-  self->offset = offset;
+      self->offset = offset;
+      self->size = before - diff;
+      g_list_model_items_changed (G_LIST_MODEL (self), 0, diff, 0);
 
-  after = g_list_model_get_n_items (G_LIST_MODEL (self));
+      self->size = size;
+      after = g_list_model_get_n_items (G_LIST_MODEL (self));
+      if (after > before - diff)
+        g_list_model_items_changed (G_LIST_MODEL (self), before - diff, 0, after - (before - diff));
+    }
+  else if (before > 0 && offset < self->offset && self->offset - offset < size)
+    {
+      guint diff = self->offset - offset;
+
+      self->offset = offset;
+      self->size = before + diff;
+      g_list_model_items_changed (G_LIST_MODEL (self), 0, 0, diff);
 
-  if (before > 0 || after > 0)
-    g_list_model_items_changed (G_LIST_MODEL (self), 0, before, after);
+      self->size = size;
+      after = g_list_model_get_n_items (G_LIST_MODEL (self));
+      if (after < before + diff)
+        g_list_model_items_changed (G_LIST_MODEL (self), after, before + diff - after, 0);
+    }
+  else
+    {
+      self->offset = offset;
+
+      after = g_list_model_get_n_items (G_LIST_MODEL (self));
+
+      if (before > 0 || after > 0)
+        g_list_model_items_changed (G_LIST_MODEL (self), 0, before, after);
+    }
 
   g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_OFFSET]);
 }
@@ -60,6 +60,7 @@ struct _GtkSortListModel
 
   GSequence *sorted; /* NULL if known unsorted */
   GSequence *unsorted; /* NULL if known unsorted */
+  GHashTable *entries; /* item => first GtkSortListEntry, NULL if known unsorted */
 };
 
 struct _GtkSortListModelClass
@@ -72,6 +73,7 @@ struct _GtkSortListEntry
   GSequenceIter *sorted_iter;
   GSequenceIter *unsorted_iter;
   gpointer item; /* holds ref */
+  GtkSortListEntry *next; /* next entry of the same item, if added more than once */
 };
 
 static GParamSpec *properties[NUM_PROPERTIES] = { NULL, };
@@ -139,6 +141,43 @@ gtk_sort_list_model_model_init (GListModelInterface *iface)
 G_DEFINE_TYPE_WITH_CODE (GtkSortListModel, gtk_sort_list_model, G_TYPE_OBJECT,
                          G_IMPLEMENT_INTERFACE (G_TYPE_LIST_MODEL, gtk_sort_list_model_model_init))
 
+static void
+gtk_sort_list_model_index_entry (GtkSortListModel *self,
+                                 GtkSortListEntry *entry)
+{
+  entry->next = g_hash_table_lookup (self->entries, entry->item);
+  g_hash_table_insert (self->entries, entry->item, entry);
+}
+
+static void
+gtk_sort_list_model_unindex_entry (GtkSortListModel *self,
+                                   GtkSortListEntry *entry)
+{
+  GtkSortListEntry *first, *prev;
+
+  first = g_hash_table_lookup (self->entries, entry->item);
+
+  if (first == entry)
+    {
+      /* Keep the other copies of the same item, if any */
+      if (entry->next)
+        g_hash_table_insert (self->entries, entry->item, entry->next);
+      else
+        g_hash_table_remove (self->entries, entry->item);
+
+      return;
+    }
+
+  for (prev = first; prev != NULL; prev = prev->next)
+    {
+      if (prev->next == entry)
+        {
+          prev->next = entry->next;
+          break;
+        }
+    }
+}
+
 static void
 gtk_sort_list_model_remove_items (GtkSortListModel *self,
                                   guint             position,
@@ -164,6 +203,7 @@ gtk_sort_list_model_remove_items (GtkSortListModel *self,
       start = MIN (start, pos);
       end = MIN (end, length_before - i - 1 - pos);
 
+      gtk_sort_list_model_unindex_entry (self, entry);
       g_sequence_remove (entry->unsorted_iter);
       g_sequence_remove (entry->sorted_iter);
 
@@ -209,6 +249,7 @@ gtk_sort_list_model_add_items (GtkSortListModel *self,
       GtkSortListEntry *entry = g_slice_new0 (GtkSortListEntry);
 
       entry->item = g_list_model_get_item (self->model, position + i);
+      gtk_sort_list_model_index_entry (self, entry);
       entry->unsorted_iter = g_sequence_insert_before (unsorted_end, entry);
       entry->sorted_iter = g_sequence_insert_sorted (self->sorted, entry, _sort_func, self->sorter);
       if (unmodified_start != NULL || unmodified_end != NULL)
@@ -326,6 +367,7 @@ gtk_sort_list_model_clear_model (GtkSortListModel *self)
 
   g_signal_handlers_disconnect_by_func (self->model, gtk_sort_list_model_items_changed_cb, self);
   g_clear_object (&self->model);
+  g_clear_pointer (&self->entries, g_hash_table_unref);
   g_clear_pointer (&self->sorted, g_sequence_free);
   g_clear_pointer (&self->unsorted, g_sequence_free);
 }
@@ -459,6 +501,7 @@ gtk_sort_list_model_create_sequences (GtkSortListModel *self)
 
   self->sorted = g_sequence_new (gtk_sort_list_entry_free);
   self->unsorted = g_sequence_new (NULL);
+  self->entries = g_hash_table_new (NULL, NULL);
 
   gtk_sort_list_model_add_items (self, 0, g_list_model_get_n_items (self->model), NULL, NULL);
 }
@@ -566,6 +609,7 @@ gtk_sort_list_model_set_sorter (GtkSortListModel *self,
       g_signal_connect (sorter, "changed", G_CALLBACK (gtk_sort_list_model_sorter_changed_cb), self);
     }
 
+  g_clear_pointer (&self->entries, g_hash_table_unref);
   g_clear_pointer (&self->unsorted, g_sequence_free);
   g_clear_pointer (&self->sorted, g_sequence_free);
   
@@ -593,3 +637,47 @@ gtk_sort_list_model_get_sorter (GtkSortListModel *self)
 
   return self->sorter;
 }
+
+/**
+ * gtk_sort_list_model_item_changed:
+ * @self: a #GtkSortListModel
+ * @item: an item in @self
+ *
+ * Informs @self that the sort key of @item has changed, so that
+ * only @item is moved to its new position instead of resorting
+ * the whole model as gtk_sorter_changed() would do.
+ *
+ * The rest of the items are assumed to be already sorted.
+ *
+ * #GListModel::items-changed is emitted only for the range between
+ * the old and the new position of @item, and not at all if the
+ * position of @item didn't change.  If @item was added more than
+ * once, every copy of it is moved.
+ */
+void
+gtk_sort_list_model_item_changed (GtkSortListModel *self,
+                                  gpointer          item)
+{
+  GtkSortListEntry *entry;
+  guint old_pos, new_pos, start, n_items;
+
+  g_return_if_fail (GTK_IS_SORT_LIST_MODEL (self));
+  g_return_if_fail (G_IS_OBJECT (item));
+
+  if (self->sorted == NULL)
+    return;
+
+  for (entry = g_hash_table_lookup (self->entries, item); entry != NULL; entry = entry->next)
+    {
+      old_pos = g_sequence_iter_get_position (entry->sorted_iter);
+      g_sequence_sort_changed (entry->sorted_iter, _sort_func, self->sorter);
+      new_pos = g_sequence_iter_get_position (entry->sorted_iter);
+
+      if (old_pos == new_pos)
+        continue;
+
+      start = MIN (old_pos, new_pos);
+      n_items = MAX (old_pos, new_pos) - start + 1;
+      g_list_model_items_changed (G_LIST_MODEL (self), start, n_items, n_items);
+    }
+}
@@ -238,7 +238,7 @@ contact_search_entry_changed_cb (ChattyNewChatDialog *self,
     str = "";
 
   old_needle = self->search_str;
-  self->search_str = g_utf8_casefold (str, -1);
+  self->search_str = chatty_utils_get_search_key (str);
 
   if (!old_needle)
     old_needle = g_strdup ("");
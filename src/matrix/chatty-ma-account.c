@@ -126,10 +126,14 @@ matrix_parse_device_data (ChattyMaAccount *self,
     type = matrix_utils_json_object_get_string (object, "type");
 
     CHATTY_TRACE_MSG ("parsing to-device event, type: %s", type);
+    chatty_trace_counter ("decrypt-queue", length - i);
 
     if (g_strcmp0 (type, "m.room.encrypted") == 0)
       matrix_enc_handle_room_encrypted (self->matrix_enc, object);
   }
+
+  if (length)
+    chatty_trace_counter ("decrypt-queue", 0);
 }
 
 static void
@@ -779,6 +783,8 @@ chatty_ma_account_leave_chat_async (ChattyAccount       *account,
                      GINT_TO_POINTER (chatty_item_get_state (CHATTY_ITEM (chat))));
   chatty_item_set_state (CHATTY_ITEM (chat), CHATTY_ITEM_HIDDEN);
   chatty_history_update_chat (self->history_db, chat);
+  matrix_api_cancel_room_requests (self->matrix_api,
+                                   chatty_chat_get_chat_name (chat));
   matrix_api_leave_chat_async (self->matrix_api,
                                chatty_chat_get_chat_name (chat),
                                ma_account_leave_chat_cb,
@@ -15,6 +15,7 @@
 #include <string.h>
 #include <glib/gi18n.h>
 
+#include "chatty-utils.h"
 #include "matrix-utils.h"
 #include "chatty-ma-buddy.h"
 
@@ -24,6 +25,8 @@ struct _ChattyMaBuddy
 
   char           *matrix_id;
   char           *name;
+  /* @matrix_id as created with chatty_utils_get_search_key() */
+  char           *search_id;
   GList          *devices;
 
   MatrixApi      *matrix_api;
@@ -77,7 +80,11 @@ chatty_ma_buddy_matches (ChattyItem     *item,
   if (!needle || !self->matrix_id)
     return FALSE;
 
-  return strcasestr (needle, self->matrix_id) != NULL;
+  /* @matrix_id never changes, so fold it only once */
+  if (!self->search_id)
+    self->search_id = chatty_utils_get_search_key (self->matrix_id);
+
+  return strstr (self->search_id, needle) != NULL;
 }
 
 static const char *
@@ -129,6 +136,7 @@ chatty_ma_buddy_dispose (GObject *object)
 
   g_clear_pointer (&self->matrix_id, g_free);
   g_clear_pointer (&self->name, g_free);
+  g_clear_pointer (&self->search_id, g_free);
 
   G_OBJECT_CLASS (chatty_ma_buddy_parent_class)->dispose (object);
 }
@@ -18,8 +18,11 @@
 #include <glib/gi18n.h>
 
 #include "contrib/gtk.h"
+#include "chatty-avatar-cache.h"
 #include "chatty-history.h"
+#include "chatty-indexed-store.h"
 #include "chatty-notification.h"
+#include "chatty-receipts.h"
 #include "chatty-utils.h"
 #include "matrix-api.h"
 #include "matrix-db.h"
@@ -56,7 +59,7 @@ struct _ChattyMaChat
   GCancellable        *avatar_cancellable;
   ChattyMaBuddy       *self_buddy;
   GListStore          *buddy_list;
-  GListStore          *message_list;
+  ChattyIndexedStore  *message_list;
   GtkSortListModel    *sorted_message_list;
   ChattyNotification  *notification;
 
@@ -126,6 +129,13 @@ sort_message (gconstpointer a,
   return time_a - time_b;
 }
 
+/* Messages we sent are indexed by their transaction id */
+static gpointer
+message_get_transaction_id (gpointer item)
+{
+  return g_strdup (g_object_get_data (item, "event-id"));
+}
+
 static void
 chatty_mat_chat_update_name (ChattyMaChat *self)
 {
@@ -232,12 +242,12 @@ ma_chat_get_avatar_pixbuf_cb (GObject      *object,
                               gpointer      user_data)
 {
   g_autoptr(ChattyMaChat) self = user_data;
-  GdkPixbuf *pixbuf;
+  g_autoptr(GdkPixbuf) pixbuf = NULL;
   g_autoptr(GError) error = NULL;
 
   g_assert (CHATTY_IS_MA_CHAT (self));
 
-  pixbuf = matrix_utils_get_pixbuf_finish (result, &error);
+  pixbuf = chatty_avatar_cache_load_finish (CHATTY_AVATAR_CACHE (object), result, &error);
 
   if (error && !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
     g_warning ("Error loading avatar file: %s", error->message);
@@ -400,8 +410,8 @@ handle_m_room_avatar (ChattyMaChat *self,
   g_clear_object (&self->avatar_cancellable);
   self->avatar_cancellable = g_cancellable_new ();
 
-  matrix_api_get_file_async (self->matrix_api, NULL, self->avatar_file,
-                             NULL, NULL,
+  matrix_api_get_file_async (self->matrix_api, self->room_id, NULL,
+                             self->avatar_file, NULL, NULL,
                              chat_got_room_avatar_cb,
                              g_object_ref (self));
 }
@@ -594,35 +604,21 @@ matrix_add_message_from_data (ChattyMaChat  *self,
   if (direction == CHATTY_DIRECTION_OUT && uuid) {
     JsonObject *data_unsigned;
     const char *transaction_id;
-    guint n_items = 0, limit;
+    ChattyMessage *msg;
 
     if (root)
       data_unsigned = matrix_utils_json_object_get_object (root, "unsigned");
     else
       data_unsigned = matrix_utils_json_object_get_object (object, "unsigned");
     transaction_id = matrix_utils_json_object_get_string (data_unsigned, "transaction_id");
+    msg = chatty_indexed_store_lookup (self->message_list, transaction_id, NULL);
 
-    if (transaction_id)
-      n_items = g_list_model_get_n_items (G_LIST_MODEL (self->message_list));
-
-    if (n_items > 50)
-      limit = n_items - 50;
-    else
-      limit = 0;
-
-    /* Note: i, limit and n_items are unsigned */
-    for (guint i = n_items - 1; i + 1 > limit; i--) {
-      g_autoptr(ChattyMessage) msg = NULL;
-      const char *event_id;
-
-      msg = g_list_model_get_item (G_LIST_MODEL (self->message_list), i);
-      event_id = g_object_get_data (G_OBJECT (msg), "event-id");
-
-      if (event_id && g_str_equal (event_id, transaction_id)) {
-        chatty_message_set_uid (msg, uuid);
-        chatty_history_add_message (self->history_db, CHATTY_CHAT (self), msg);
-        return;
-      }
+    if (msg) {
+      chatty_message_set_uid (msg, uuid);
+      chatty_receipts_add (chatty_receipts_get_default (),
+                           CHATTY_CHAT (self), uuid, msg);
+      chatty_history_add_message (self->history_db, CHATTY_CHAT (self), msg);
+      return;
     }
   }
 
@@ -633,7 +629,11 @@ matrix_add_message_from_data (ChattyMaChat  *self,
   if (msg_type != CHATTY_MESSAGE_TEXT)
     chat_handle_m_media (self, message, content, type, encrypted);
 
-  g_list_store_append (self->message_list, message);
+  if (direction == CHATTY_DIRECTION_OUT && uuid)
+    chatty_receipts_add (chatty_receipts_get_default (),
+                         CHATTY_CHAT (self), uuid, message);
+
+  chatty_indexed_store_append (self->message_list, message);
   chatty_history_add_message (self->history_db, CHATTY_CHAT (self), message);
 }
 
@@ -737,9 +737,93 @@ matrix_send_message_from_queue (ChattyMaChat *self)
                                  self->room_id, message,
                                  ma_chat_send_message_cb,
                                  g_object_ref (self));
+  /* A new transaction id is set on every try */
+  chatty_indexed_store_update_key (self->message_list, message);
   CHATTY_EXIT;
 }
 
+/*
+ * The content of m.receipt is of the form:
+ * { "$event_id": { "m.read": { "@user:example.com": { "ts": 1234 } } } }
+ */
+/* Returns the time of the loaded message with @event_id, or 0 */
+static gint64
+ma_chat_get_event_time (ChattyMaChat *self,
+                        const char   *event_id)
+{
+  guint n_items;
+
+  n_items = g_list_model_get_n_items (G_LIST_MODEL (self->message_list));
+
+  /* Receipts are mostly for recent messages, start from the end */
+  for (guint i = n_items; i > 0; i--) {
+    g_autoptr(ChattyMessage) message = NULL;
+
+    message = g_list_model_get_item (G_LIST_MODEL (self->message_list), i - 1);
+
+    if (g_strcmp0 (chatty_message_get_uid (message), event_id) == 0)
+      return chatty_message_get_time (message);
+  }
+
+  return 0;
+}
+
+static void
+ma_chat_handle_receipt (ChattyMaChat *self,
+                        JsonObject   *content)
+{
+  g_autoptr(GList) event_ids = NULL;
+  const char *username;
+
+  g_assert (CHATTY_IS_MA_CHAT (self));
+  g_assert (content);
+
+  username = matrix_api_get_username (self->matrix_api);
+  event_ids = json_object_get_members (content);
+
+  for (GList *node = event_ids; node; node = node->next) {
+    g_autoptr(GList) users = NULL;
+    JsonObject *object;
+
+    object = matrix_utils_json_object_get_object (content, node->data);
+    object = matrix_utils_json_object_get_object (object, "m.read");
+
+    if (!object)
+      continue;
+
+    users = json_object_get_members (object);
+
+    /* Our own read receipts don't change the status of sent messages */
+    for (GList *user = users; user; user = user->next) {
+      ChattyReceipts *receipts;
+      gint64 time;
+
+      if (g_strcmp0 (user->data, username) == 0)
+        continue;
+
+      receipts = chatty_receipts_get_default ();
+
+      if (chatty_receipts_set_read (receipts, node->data))
+        break;
+
+      /* The receipt is usually for a message from the other user,
+       * mark all our messages up to that message as read */
+      time = ma_chat_get_event_time (self, node->data);
+
+      if (!time) {
+        JsonObject *receipt;
+
+        receipt = matrix_utils_json_object_get_object (object, user->data);
+        time = matrix_utils_json_object_get_int (receipt, "ts") / 1000;
+      }
+
+      if (time)
+        chatty_receipts_set_read_until (receipts, CHATTY_CHAT (self), time);
+      break;
+    }
+  }
+}
+
 static void
 ma_chat_handle_ephemeral (ChattyMaChat *self,
                           JsonObject   *root)
@@ -802,6 +886,8 @@ ma_chat_handle_ephemeral (ChattyMaChat *self,
             g_object_notify (G_OBJECT (self), "buddy-typing");
           }
         }
+      } else if (g_strcmp0 (type, "m.receipt") == 0 && object) {
+        ma_chat_handle_receipt (self, object);
       }
     }
   }
@@ -1237,7 +1323,7 @@ ma_chat_load_db_messages_cb (GObject      *object,
   CHATTY_TRACE_MSG ("Messages loaded from db: %u", !messages ? 0 : messages->len);
 
   if (messages && messages->len) {
-    g_list_store_splice (self->message_list, 0, 0, messages->pdata, messages->len);
+    chatty_indexed_store_splice (self->message_list, 0, 0, messages->pdata, messages->len);
     g_signal_emit_by_name (self, "changed", 0);
     g_task_return_boolean (task, TRUE);
   } else if (!messages && self->prev_batch) {
@@ -1332,6 +1418,81 @@ chatty_ma_chat_is_loading_history (ChattyChat *chat)
   return self->history_is_loading;
 }
 
+static int
+ma_chat_compare_position (gconstpointer a,
+                          gconstpointer b)
+{
+  guint pos_a = *(const guint *)a;
+  guint pos_b = *(const guint *)b;
+
+  return pos_a < pos_b ? -1 : pos_a > pos_b;
+}
+
+static guint
+chatty_ma_chat_trim_messages (ChattyChat *chat,
+                              guint       n_keep)
+{
+  ChattyMaChat *self = (ChattyMaChat *)chat;
+  g_autoptr(GArray) positions = NULL;
+  GListModel *model;
+  guint n_items, end;
+
+  g_assert (CHATTY_IS_MA_CHAT (self));
+
+  if (self->history_is_loading)
+    return 0;
+
+  model = G_LIST_MODEL (self->sorted_message_list);
+  n_items = g_list_model_get_n_items (model);
+
+  if (n_items <= n_keep)
+    return 0;
+
+  positions = g_array_sized_new (FALSE, FALSE, sizeof (guint), n_items - n_keep);
+
+  /* Find the oldest messages from the sorted list, and their positions in the store */
+  for (guint i = 0; i < n_items - n_keep; i++) {
+    g_autoptr(ChattyMessage) message = NULL;
+    ChattyMsgStatus status;
+    guint position;
+
+    message = g_list_model_get_item (model, i);
+    status = chatty_message_get_status (message);
+
+    if (status == CHATTY_STATUS_SENDING ||
+        status == CHATTY_STATUS_SENDING_FAILED)
+      break;
+
+    if (chatty_indexed_store_find (self->message_list, message, &position))
+      g_array_append_val (positions, position);
+  }
+
+  g_array_sort (positions, ma_chat_compare_position);
+
+  /*
+   * The store is mostly in time order, so the messages are usually
+   * a single range.  Remove each contiguous range with one splice,
+   * starting from the last, so that the other positions stay valid.
+   */
+  end = positions->len;
+  while (end > 0) {
+    guint start = end - 1;
+
+    while (start > 0 &&
+           g_array_index (positions, guint, start - 1) + 1 == g_array_index (positions, guint, start))
+      start--;
+
+    chatty_indexed_store_splice (self->message_list,
+                                 g_array_index (positions, guint, start),
+                                 end - start, NULL, 0);
+    end = start;
+  }
+
+  CHATTY_TRACE_MSG ("Trimmed %u messages from %s", positions->len, self->room_id);
+
+  return positions->len;
+}
+
 static GListModel *
 chatty_ma_chat_get_messages (ChattyChat *chat)
 {
@@ -1500,7 +1661,7 @@ chatty_ma_chat_send_message_async (ChattyChat          *chat,
   chatty_message_set_user (message, CHATTY_ITEM (self->self_buddy));
   chatty_message_set_status (message, CHATTY_STATUS_SENDING, 0);
 
-  g_list_store_append (self->message_list, message);
+  chatty_indexed_store_append (self->message_list, message);
   g_queue_push_tail (self->message_queue, g_object_ref (message));
 
   if (chatty_chat_get_encryption (chat) != CHATTY_ENCRYPTION_ENABLED ||
@@ -1526,7 +1687,8 @@ chatty_ma_chat_get_files_async (ChattyChat          *chat,
   g_assert (CHATTY_IS_MESSAGE (message));
 
   files = chatty_message_get_files (message);
-  matrix_api_get_file_async (self->matrix_api, message, files->data, NULL, NULL,
+  matrix_api_get_file_async (self->matrix_api, self->room_id, message,
+                             files->data, NULL, NULL,
                              ma_chat_download_cb, self);
 }
 
@@ -1637,9 +1799,10 @@ chatty_ma_chat_get_avatar (ChattyItem *item)
   self->avatar_is_loading = TRUE;
   path = g_build_filename (g_get_user_cache_dir (), "chatty",
                            self->avatar_file->path, NULL);
-  matrix_utils_get_pixbuf_async (path, self->avatar_cancellable,
-                                 ma_chat_get_avatar_pixbuf_cb,
-                                 g_object_ref (self));
+  chatty_avatar_cache_load_file_async (chatty_avatar_cache_get_default (), path,
+                                       CHATTY_AVATAR_CACHE_SIZE, self->avatar_cancellable,
+                                       ma_chat_get_avatar_pixbuf_cb,
+                                       g_object_ref (self));
 
   return NULL;
 }
@@ -1678,7 +1841,7 @@ chatty_ma_chat_finalize (GObject *object)
     g_cancellable_cancel (self->avatar_cancellable);
   g_clear_object (&self->avatar_cancellable);
 
-  g_list_store_remove_all (self->message_list);
+  chatty_indexed_store_remove_all (self->message_list);
   g_clear_object (&self->message_list);
   g_clear_object (&self->matrix_api);
   g_clear_object (&self->matrix_enc);
@@ -1717,6 +1880,7 @@ chatty_ma_chat_class_init (ChattyMaChatClass *klass)
   chat_class->get_username = chatty_ma_chat_get_username;
   chat_class->load_past_messages = chatty_ma_chat_real_past_messages;
   chat_class->is_loading_history = chatty_ma_chat_is_loading_history;
+  chat_class->trim_messages = chatty_ma_chat_trim_messages;
   chat_class->get_messages = chatty_ma_chat_get_messages;
   chat_class->get_account  = chatty_ma_chat_get_account;
   chat_class->get_encryption = chatty_ma_chat_get_encryption;
@@ -1754,7 +1918,8 @@ chatty_ma_chat_init (ChattyMaChat *self)
 
   sorter = gtk_custom_sorter_new (sort_message, NULL, NULL);
 
-  self->message_list = g_list_store_new (CHATTY_TYPE_MESSAGE);
+  self->message_list = chatty_indexed_store_new_full (CHATTY_TYPE_MESSAGE, message_get_transaction_id,
+                                                      g_str_hash, g_str_equal, g_free);
   self->sorted_message_list = gtk_sort_list_model_new (G_LIST_MODEL (self->message_list), sorter);
   self->buddy_list = g_list_store_new (CHATTY_TYPE_MA_BUDDY);
   self->message_queue = g_queue_new ();
@@ -1896,8 +2061,8 @@ chatty_ma_chat_add_messages (ChattyMaChat *self,
   g_return_if_fail (CHATTY_IS_MA_CHAT (self));
 
   if (messages && messages->len)
-    g_list_store_splice (self->message_list, 0, 0,
-                         messages->pdata, messages->len);
+    chatty_indexed_store_splice (self->message_list, 0, 0,
+                                 messages->pdata, messages->len);
 }
 
 /**
@@ -23,6 +23,7 @@
 #include <sys/random.h>
 
 #include "chatty-chat.h"
+#include "chatty-media-store.h"
 #include "chatty-ma-buddy.h"
 #include "matrix-enums.h"
 #include "matrix-utils.h"
@@ -45,6 +46,114 @@
 #define TYPING_TIMEOUT      10000 /* milliseconds */
 #define KEY_TIMEOUT         10000 /* milliseconds */
 
+/*
+ * Every HTTP request (except the ones done via matrix-utils)
+ * goes through a small scheduler so that a burst of one kind
+ * of traffic (say, media downloads or room state fetches) can't
+ * starve interactive requests like sending a message.
+ */
+typedef enum {
+  REQUEST_CLASS_SEND,     /* Interactive sends */
+  REQUEST_CLASS_RECEIPT,  /* Receipts and typing notifications */
+  REQUEST_CLASS_SYNC,
+  REQUEST_CLASS_STATE,    /* Room state, members, keys and backfill */
+  REQUEST_CLASS_MEDIA,
+  N_REQUEST_CLASSES
+} RequestClass;
+
+typedef enum {
+  ENDPOINT_LOGIN,
+  ENDPOINT_JOINED_ROOMS,
+  ENDPOINT_SYNC,
+  ENDPOINT_KEYS_UPLOAD,
+  ENDPOINT_KEYS_QUERY,
+  ENDPOINT_KEYS_CLAIM,
+  ENDPOINT_SEND,
+  ENDPOINT_SEND_TO_DEVICE,
+  ENDPOINT_LEAVE,
+  ENDPOINT_TYPING,
+  ENDPOINT_READ_MARKERS,
+  ENDPOINT_ROOM_STATE,
+  ENDPOINT_MEMBERS,
+  ENDPOINT_MESSAGES,
+  ENDPOINT_MEDIA,
+  N_ENDPOINTS
+} RequestEndpoint;
+
+static const struct {
+  const char *name;
+  guint       max_active;
+  int         priority;
+} request_classes[N_REQUEST_CLASSES] = {
+  [REQUEST_CLASS_SEND]    = { "send",    2, SOUP_MESSAGE_PRIORITY_HIGH },
+  [REQUEST_CLASS_RECEIPT] = { "receipt", 1, SOUP_MESSAGE_PRIORITY_NORMAL },
+  [REQUEST_CLASS_SYNC]    = { "sync",    1, SOUP_MESSAGE_PRIORITY_VERY_HIGH },
+  [REQUEST_CLASS_STATE]   = { "state",   1, SOUP_MESSAGE_PRIORITY_LOW },
+  /* Downloads keep the slot till the file is saved, so allow a few */
+  [REQUEST_CLASS_MEDIA]   = { "media",   3, SOUP_MESSAGE_PRIORITY_VERY_LOW },
+};
+
+/* @rate is the number of requests allowed per second (0 for no limit),
+ * and @burst is the maximum number of requests that can be sent at once */
+static const struct {
+  RequestClass klass;
+  double       rate;
+  double       burst;
+} request_endpoints[N_ENDPOINTS] = {
+  [ENDPOINT_LOGIN]          = { REQUEST_CLASS_SYNC,    0.0,  1.0 },
+  [ENDPOINT_JOINED_ROOMS]   = { REQUEST_CLASS_SYNC,    0.0,  1.0 },
+  [ENDPOINT_SYNC]           = { REQUEST_CLASS_SYNC,    0.0,  1.0 },
+  [ENDPOINT_KEYS_UPLOAD]    = { REQUEST_CLASS_STATE,   0.0,  1.0 },
+  [ENDPOINT_KEYS_QUERY]     = { REQUEST_CLASS_SEND,    0.0,  1.0 },
+  [ENDPOINT_KEYS_CLAIM]     = { REQUEST_CLASS_SEND,    0.0,  1.0 },
+  [ENDPOINT_SEND]           = { REQUEST_CLASS_SEND,    5.0, 10.0 },
+  [ENDPOINT_SEND_TO_DEVICE] = { REQUEST_CLASS_SEND,    5.0, 10.0 },
+  [ENDPOINT_LEAVE]          = { REQUEST_CLASS_SEND,    0.0,  1.0 },
+  [ENDPOINT_TYPING]         = { REQUEST_CLASS_RECEIPT, 1.0,  2.0 },
+  [ENDPOINT_READ_MARKERS]   = { REQUEST_CLASS_RECEIPT, 2.0,  4.0 },
+  [ENDPOINT_ROOM_STATE]     = { REQUEST_CLASS_STATE,   0.0,  1.0 },
+  [ENDPOINT_MEMBERS]        = { REQUEST_CLASS_STATE,   0.0,  1.0 },
+  [ENDPOINT_MESSAGES]       = { REQUEST_CLASS_STATE,   0.0,  1.0 },
+  [ENDPOINT_MEDIA]          = { REQUEST_CLASS_MEDIA,   0.0,  1.0 },
+};
+
+typedef struct _ApiRequest ApiRequest;
+
+struct _ApiRequest
+{
+  MatrixApi          *self;
+  /* Owned only until the request is dispatched */
+  GTask              *task;
+  SoupMessage        *message;
+  GCancellable       *cancellable;
+  /* The caller's cancellable, chained into @cancellable */
+  GCancellable       *caller_cancellable;
+  gulong              caller_cancel_id;
+  char               *room_id;
+  GAsyncReadyCallback send_cb;
+  RequestEndpoint     endpoint;
+  gint64              queue_time;  /* monotonic time, µs */
+  gint64              start_time;
+  gboolean            done;
+};
+
+typedef struct {
+  double  tokens;
+  gint64  last_update;
+  /* Set from ‘retry_after_ms’ of M_LIMIT_EXCEEDED errors */
+  gint64  blocked_until;
+} RequestBucket;
+
+typedef struct {
+  GQueue   queue;
+  guint    n_active;
+  guint    max_depth;
+  guint64  n_done;
+  gint64   total_wait;     /* µs */
+  gint64   total_latency;  /* µs */
+  gint64   max_latency;    /* µs */
+} RequestStats;
+
 struct _MatrixApi
 {
   GObject         parent_instance;
@@ -80,6 +189,12 @@ struct _MatrixApi
   gboolean        room_list_loaded;
 
   guint           resync_id;
+
+  RequestStats    requests[N_REQUEST_CLASSES];
+  RequestBucket   buckets[N_ENDPOINTS];
+  /* Dispatched requests that aren’t complete yet */
+  GPtrArray      *active_requests;
+  guint           dispatch_id;
 };
 
 G_DEFINE_TYPE (MatrixApi, matrix_api, G_TYPE_OBJECT)
@@ -91,6 +206,7 @@ static void matrix_start_sync        (MatrixApi *self);
 static void matrix_take_red_pill     (MatrixApi *self);
 static gboolean handle_common_errors (MatrixApi *self,
                                       GError    *error);
+static void api_request_done         (ApiRequest *request);
 
 static void
 api_set_string_value (char       **strp,
@@ -104,6 +220,315 @@ api_set_string_value (char       **strp,
   }
 }
 
+static void
+api_request_free (ApiRequest *request)
+{
+  if (request->start_time && !request->done)
+    api_request_done (request);
+
+  if (request->caller_cancel_id)
+    g_cancellable_disconnect (request->caller_cancellable, request->caller_cancel_id);
+
+  g_clear_object (&request->task);
+  g_clear_object (&request->message);
+  g_clear_object (&request->cancellable);
+  g_clear_object (&request->caller_cancellable);
+  g_free (request->room_id);
+  g_free (request);
+}
+
+/*
+ * Refill the token bucket of @endpoint and return the
+ * time (in µs) to wait before a request can be sent to
+ * @endpoint, 0 if the request can be sent right now.
+ */
+static gint64
+api_bucket_get_wait (MatrixApi       *self,
+                     RequestEndpoint  endpoint,
+                     gint64           now)
+{
+  RequestBucket *bucket;
+  double rate, burst;
+
+  bucket = &self->buckets[endpoint];
+  rate = request_endpoints[endpoint].rate;
+  burst = request_endpoints[endpoint].burst;
+
+  if (bucket->blocked_until > now)
+    return bucket->blocked_until - now;
+
+  if (rate <= 0.0)
+    return 0;
+
+  bucket->tokens += (now - bucket->last_update) * rate / G_USEC_PER_SEC;
+  bucket->tokens = MIN (bucket->tokens, burst);
+  bucket->last_update = now;
+
+  if (bucket->tokens >= 1.0)
+    return 0;
+
+  return (1.0 - bucket->tokens) * G_USEC_PER_SEC / rate + 1;
+}
+
+static void
+api_request_dispatch (MatrixApi  *self,
+                      ApiRequest *request,
+                      gint64      now)
+{
+  RequestStats *stats;
+  GTask *task;
+
+  g_assert (MATRIX_IS_API (self));
+  g_assert (request->task);
+
+  stats = &self->requests[request_endpoints[request->endpoint].klass];
+  stats->n_active++;
+  stats->total_wait += now - request->queue_time;
+  request->start_time = now;
+
+  if (request_endpoints[request->endpoint].rate > 0.0)
+    self->buckets[request->endpoint].tokens -= 1.0;
+
+  g_ptr_array_add (self->active_requests, request);
+  chatty_trace_counter ("http-in-flight", self->active_requests->len);
+
+  /* From now on, @request lives as long as the task */
+  task = g_steal_pointer (&request->task);
+  g_object_set_data_full (G_OBJECT (task), "request", request,
+                          (GDestroyNotify)api_request_free);
+  soup_session_send_async (self->soup_session, request->message, request->cancellable,
+                           request->send_cb, task);
+}
+
+static gboolean api_dispatch_timeout_cb (gpointer user_data);
+
+static void
+api_dispatch_requests (MatrixApi *self)
+{
+  gint64 now, wait = G_MAXINT64;
+
+  g_assert (MATRIX_IS_API (self));
+
+  g_clear_handle_id (&self->dispatch_id, g_source_remove);
+  now = g_get_monotonic_time ();
+
+  /* Classes are ordered by priority */
+  for (guint i = 0; i < N_REQUEST_CLASSES; i++) {
+    RequestStats *stats = &self->requests[i];
+    GList *node = stats->queue.head;
+
+    while (node) {
+      ApiRequest *request = node->data;
+      GList *next = node->next;
+      gint64 delay;
+
+      /* Drop requests cancelled by their caller while still in queue */
+      if (g_cancellable_is_cancelled (request->cancellable)) {
+        g_queue_delete_link (&stats->queue, node);
+        g_task_return_new_error (request->task, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                                 "Request cancelled");
+        api_request_free (request);
+        node = next;
+        continue;
+      }
+
+      if (stats->n_active >= request_classes[i].max_active) {
+        node = next;
+        continue;
+      }
+
+      delay = api_bucket_get_wait (self, request->endpoint, now);
+
+      if (delay == 0) {
+        g_queue_delete_link (&stats->queue, node);
+        api_request_dispatch (self, request, now);
+      } else {
+        wait = MIN (wait, delay);
+      }
+
+      node = next;
+    }
+  }
+
+  if (wait != G_MAXINT64)
+    self->dispatch_id = g_timeout_add (MAX (wait / 1000, 1),
+                                       api_dispatch_timeout_cb, self);
+}
+
+static gboolean
+api_dispatch_timeout_cb (gpointer user_data)
+{
+  MatrixApi *self = user_data;
+
+  g_assert (MATRIX_IS_API (self));
+
+  self->dispatch_id = 0;
+  api_dispatch_requests (self);
+
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Mark @request as complete, so that the slot used
+ * by it can be used by the next request in queue.
+ */
+static void
+api_request_done (ApiRequest *request)
+{
+  MatrixApi *self;
+  RequestStats *stats;
+  RequestClass klass;
+  gint64 latency;
+
+  if (!request || request->done)
+    return;
+
+  self = request->self;
+  g_assert (MATRIX_IS_API (self));
+  g_assert (request->start_time);
+
+  request->done = TRUE;
+  klass = request_endpoints[request->endpoint].klass;
+  stats = &self->requests[klass];
+  latency = g_get_monotonic_time () - request->start_time;
+
+  stats->n_active--;
+  stats->n_done++;
+  stats->total_latency += latency;
+  stats->max_latency = MAX (stats->max_latency, latency);
+  g_ptr_array_remove_fast (self->active_requests, request);
+
+  /* Time spent waiting in queue, and then in flight */
+  chatty_trace_async (G_LOG_DOMAIN, "queued", GPOINTER_TO_SIZE (request),
+                      request->queue_time, request->start_time);
+  chatty_trace_async (G_LOG_DOMAIN, request_classes[klass].name, GPOINTER_TO_SIZE (request),
+                      request->start_time, request->start_time + latency);
+  chatty_trace_counter ("http-in-flight", self->active_requests->len);
+
+  if (klass != REQUEST_CLASS_SYNC)
+    CHATTY_TRACE_MSG ("%s request done, latency: %" G_GINT64_FORMAT " ms, queued: %u",
+                      request_classes[klass].name, latency / 1000,
+                      stats->queue.length);
+
+  api_dispatch_requests (self);
+}
+
+static void
+api_caller_cancelled_cb (GCancellable *cancellable,
+                         ApiRequest   *request)
+{
+  MatrixApi *self = request->self;
+
+  g_assert (MATRIX_IS_API (self));
+
+  g_cancellable_cancel (request->cancellable);
+
+  /*
+   * A request still in queue is dropped on the next dispatch.
+   * @request can't be freed here, as that would disconnect
+   * this handler from within itself.
+   */
+  if (!request->start_time) {
+    g_clear_handle_id (&self->dispatch_id, g_source_remove);
+    self->dispatch_id = g_idle_add (api_dispatch_timeout_cb, self);
+  }
+}
+
+/*
+ * @cancellable is the caller's cancellable, if any.  Cancelling
+ * it cancels the request, whether in queue or in flight.
+ */
+static void
+api_queue_request (MatrixApi           *self,
+                   GTask               *task,
+                   SoupMessage         *message,
+                   RequestEndpoint      endpoint,
+                   const char          *room_id,
+                   GCancellable        *cancellable,
+                   GAsyncReadyCallback  send_cb)
+{
+  RequestStats *stats;
+  ApiRequest *request;
+  RequestClass klass;
+
+  g_assert (MATRIX_IS_API (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (SOUP_IS_MESSAGE (message));
+  g_assert (endpoint < N_ENDPOINTS);
+
+  klass = request_endpoints[endpoint].klass;
+  soup_message_set_priority (message, request_classes[klass].priority);
+
+  request = g_new0 (ApiRequest, 1);
+  request->self = self;
+  request->task = task;
+  request->message = g_object_ref (message);
+  request->cancellable = g_cancellable_new ();
+  request->room_id = g_strdup (room_id);
+  request->send_cb = send_cb;
+  request->endpoint = endpoint;
+  request->queue_time = g_get_monotonic_time ();
+
+  stats = &self->requests[klass];
+  g_queue_push_tail (&stats->queue, request);
+  stats->max_depth = MAX (stats->max_depth, stats->queue.length);
+
+  /* This may run the handler right away if already cancelled */
+  if (cancellable) {
+    request->caller_cancellable = g_object_ref (cancellable);
+    request->caller_cancel_id = g_cancellable_connect (cancellable,
+                                                       G_CALLBACK (api_caller_cancelled_cb),
+                                                       request, NULL);
+  }
+
+  api_dispatch_requests (self);
+}
+
+/*
+ * Cancel all requests related to @room_id, or every
+ * request if @room_id is %NULL.
+ */
+static void
+api_cancel_requests (MatrixApi  *self,
+                     const char *room_id)
+{
+  g_autoptr(GPtrArray) cancellables = NULL;
+
+  g_assert (MATRIX_IS_API (self));
+
+  for (guint i = 0; i < N_REQUEST_CLASSES; i++) {
+    GQueue *queue = &self->requests[i].queue;
+    GList *node = queue->head;
+
+    while (node) {
+      ApiRequest *request = node->data;
+      GList *next = node->next;
+
+      if (!room_id || g_strcmp0 (request->room_id, room_id) == 0) {
+        g_queue_delete_link (queue, node);
+        g_task_return_new_error (request->task, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                                 "Request cancelled");
+        api_request_free (request);
+      }
+
+      node = next;
+    }
+  }
+
+  /* Cancelling may complete the request, which shall modify the array */
+  cancellables = g_ptr_array_new_with_free_func (g_object_unref);
+
+  for (guint i = 0; i < self->active_requests->len; i++) {
+    ApiRequest *request = self->active_requests->pdata[i];
+
+    if (!room_id || g_strcmp0 (request->room_id, room_id) == 0)
+      g_ptr_array_add (cancellables, g_object_ref (request->cancellable));
+  }
+
+  for (guint i = 0; i < cancellables->len; i++)
+    g_cancellable_cancel (cancellables->pdata[i]);
+}
+
 static void
 api_get_version_cb (GObject      *obj,
                     GAsyncResult *result,
@@ -241,27 +666,30 @@ api_download_stream_cb (GObject      *obj,
 {
   g_autoptr(GTask) task = user_data;
   GCancellable *cancellable;
-  GOutputStream *out_stream = NULL;
+  ChattyMediaWriter *writer;
+  ApiRequest *request;
   GError *error = NULL;
   char *buffer, *secret;
-  gsize n_written;
   gssize n_read;
 
   g_assert (G_IS_TASK (task));
 
   n_read = g_input_stream_read_finish (G_INPUT_STREAM (obj), result, &error);
+  request = g_object_get_data (user_data, "request");
+  g_assert (request);
 
   if (error) {
+    api_request_done (request);
     g_task_return_error (task, error);
 
     return;
   }
 
-  cancellable = g_task_get_cancellable (task);
+  cancellable = request->cancellable;
   buffer = g_task_get_task_data (task);
   secret = g_object_get_data (user_data, "secret");
-  out_stream = g_object_get_data (user_data, "out-stream");
-  g_assert (out_stream);
+  writer = g_object_get_data (user_data, "writer");
+  g_assert (writer);
 
   if (secret) {
     gcry_cipher_hd_t cipher_hd;
@@ -274,24 +702,30 @@ api_download_stream_cb (GObject      *obj,
     if (!err)
       buffer = secret;
   }
-  g_output_stream_write_all (out_stream, buffer, n_read, &n_written, NULL, NULL);
-  if (n_read == 0 || n_read == -1) {
-    g_output_stream_close (out_stream, cancellable, NULL);
+  if (n_read > 0 &&
+      !chatty_media_writer_write (writer, buffer, n_read, cancellable, &error)) {
+    api_request_done (request);
+    g_task_return_error (task, error);
 
+    return;
+  }
+
+  if (n_read == 0 || n_read == -1) {
     if (n_read == 0) {
-      g_autoptr(GFile) parent = NULL;
-      GFile *out_file;
       ChattyFileInfo *file;
 
       file = g_object_get_data (user_data, "file");
-      out_file = g_object_get_data (user_data, "out-file");
-
-      /* We don't use absolute directory so that the path is user agnostic */
-      parent = g_file_new_build_filename (g_get_user_cache_dir (), "chatty", NULL);
-      file->path = g_file_get_relative_path (parent, out_file);
+      /* The path is relative to the cache, so that it's user agnostic */
+      g_free (file->path);
+      file->path = chatty_media_writer_finish (writer, cancellable, &error);
     }
 
-    g_task_return_boolean (task, n_read == 0);
+    api_request_done (request);
+
+    if (error)
+      g_task_return_error (task, error);
+    else
+      g_task_return_boolean (task, n_read == 0);
 
     return;
   }
@@ -311,6 +745,7 @@ api_get_file_stream_cb  (GObject      *obj,
   ChattyMessage *message;
   ChattyFileInfo *file;
   GInputStream *stream;
+  ApiRequest *request;
   GError *error = NULL;
   char *buffer = NULL;
   MatrixApi *self;
@@ -322,32 +757,21 @@ api_get_file_stream_cb  (GObject      *obj,
   stream = soup_session_send_finish (SOUP_SESSION (obj), result, &error);
   file = g_object_get_data (user_data, "file");
   message = g_object_get_data (user_data, "message");
-  cancellable = g_task_get_cancellable (task);
+  request = g_object_get_data (user_data, "request");
+  cancellable = request->cancellable;
 
   if (!error) {
-    GFileOutputStream *out_stream;
-    GFile *out_file;
-    gboolean is_thumbnail = FALSE;
-    char *name, *file_name;
-
-    if (message &&
-        chatty_message_get_preview (message) == file)
-      is_thumbnail = TRUE;
-
-    name = g_path_get_basename (file->url);
-    file_name = g_strdup (name);
-
-    /* If @message is NULL, @file is an avatar image */
-    out_file = g_file_new_build_filename (g_get_user_cache_dir (), "chatty", "matrix",
-                                          message ? "files" : "avatars",
-                                          is_thumbnail ? "thumbnail" : "", file_name,
-                                          NULL);
-    out_stream = g_file_append_to (out_file, 0, cancellable, &error);
-    g_object_set_data_full (user_data, "out-file", out_file, g_object_unref);
-    g_object_set_data_full (user_data, "out-stream", out_stream, g_object_unref);
+    ChattyMediaWriter *writer;
+
+    /* Files, thumbnails and avatars are all saved in the media store,
+     * so that the same content is saved only once for every account */
+    writer = chatty_media_writer_new (file->url, cancellable, &error);
+    g_object_set_data_full (user_data, "writer", writer,
+                            (GDestroyNotify)chatty_media_writer_free);
   }
 
   if (error) {
+    api_request_done (request);
     g_task_return_error (task, error);
     CHATTY_EXIT;
   }
@@ -826,20 +1250,37 @@ api_load_from_stream_cb (JsonParser   *parser,
     if (g_error_matches (error, MATRIX_ERROR, M_LIMIT_EXCEEDED) &&
         root &&
         JSON_NODE_HOLDS_OBJECT (root)) {
+      ApiRequest *request;
       JsonObject *obj;
       guint retry;
 
       obj = json_node_get_object (root);
       retry = matrix_utils_json_object_get_int (obj, "retry_after_ms");
       g_object_set_data (G_OBJECT (task), "retry-after", GINT_TO_POINTER (retry));
+
+      /* Hold back further requests to the same endpoint */
+      request = g_object_get_data (G_OBJECT (task), "request");
+      if (request) {
+        RequestBucket *bucket;
+
+        bucket = &self->buckets[request->endpoint];
+        bucket->blocked_until = MAX (bucket->blocked_until,
+                                     g_get_monotonic_time () + retry * (gint64)1000);
+        CHATTY_TRACE_MSG ("Rate limited, endpoint: %d, retry after: %u ms",
+                          request->endpoint, retry);
+      }
     } else {
       CHATTY_TRACE_MSG ("Error loading from stream: %s", error->message);
     }
 
+    /* Done only now, so that the next request honors ‘retry_after_ms’ */
+    api_request_done (g_object_get_data (G_OBJECT (task), "request"));
     g_task_return_error (task, error);
     return;
   }
 
+  api_request_done (g_object_get_data (G_OBJECT (task), "request"));
+
   if (JSON_NODE_HOLDS_OBJECT (root))
     g_task_return_pointer (task, json_node_dup_object (root),
                            (GDestroyNotify)json_object_unref);
@@ -859,25 +1300,26 @@ session_send_cb (SoupSession  *session,
   g_autoptr(GTask) task = user_data;
   g_autoptr(GInputStream) stream = NULL;
   g_autoptr(JsonParser) parser = NULL;
-  MatrixApi *self;
+  ApiRequest *request;
   GError *error = NULL;
 
   g_assert (SOUP_IS_SESSION (session));
   g_assert (G_IS_TASK (task));
 
-  self = g_task_get_source_object (task);
-  g_assert (MATRIX_IS_API (self));
+  request = g_object_get_data (G_OBJECT (task), "request");
+  g_assert (request);
 
   stream = soup_session_send_finish (session, result, &error);
 
   if (error) {
     CHATTY_TRACE_MSG ("Error session send: %s", error->message);
+    api_request_done (request);
     g_task_return_error (task, error);
     return;
   }
 
   parser = json_parser_new ();
-  json_parser_load_from_stream_async (parser, stream, self->cancellable,
+  json_parser_load_from_stream_async (parser, stream, request->cancellable,
                                       (GAsyncReadyCallback)api_load_from_stream_cb,
                                       g_steal_pointer (&task));
 }
@@ -889,12 +1331,14 @@ queue_data (MatrixApi           *self,
             const char          *uri_path,
             const char          *method, /* interned */
             GHashTable          *query,
+            RequestEndpoint      endpoint,
+            const char          *room_id,
             GAsyncReadyCallback  callback,
             gpointer             user_data)
 {
-  g_autoptr(GTask) task = NULL;
   g_autoptr(SoupURI) uri = NULL;
   SoupMessage *message;
+  GTask *task;
 
   g_assert (MATRIX_IS_API (self));
   g_assert (uri_path && *uri_path);
@@ -919,9 +1363,6 @@ queue_data (MatrixApi           *self,
   message = soup_message_new_from_uri (method, uri);
   soup_message_headers_append (message->request_headers, "Accept-Encoding", "gzip");
 
-  if (callback == matrix_take_red_pill_cb)
-    soup_message_set_priority (message, SOUP_MESSAGE_PRIORITY_VERY_HIGH);
-
   if (data && size == -1)
     size = strlen (data);
 
@@ -929,10 +1370,9 @@ queue_data (MatrixApi           *self,
     soup_message_set_request (message, "application/json", SOUP_MEMORY_TAKE, data, size);
 
   task = g_task_new (self, self->cancellable, callback, user_data);
-  g_task_set_task_data (task, g_object_ref (message), g_object_unref);
-  soup_session_send_async (self->soup_session, message, self->cancellable,
-                           (GAsyncReadyCallback)session_send_cb,
-                           g_steal_pointer (&task));
+  g_task_set_task_data (task, message, g_object_unref);
+  api_queue_request (self, task, message, endpoint, room_id, NULL,
+                     (GAsyncReadyCallback)session_send_cb);
 }
 
 static void
@@ -941,6 +1381,8 @@ queue_json_object (MatrixApi           *self,
                    const char          *uri_path,
                    const char          *method, /* interned */
                    GHashTable          *query,
+                   RequestEndpoint      endpoint,
+                   const char          *room_id,
                    GAsyncReadyCallback  callback,
                    gpointer             user_data)
 {
@@ -951,7 +1393,8 @@ queue_json_object (MatrixApi           *self,
   g_return_if_fail (self->homeserver && *self->homeserver);
 
   body = matrix_utils_json_object_to_string (object, FALSE);
-  queue_data (self, body, -1, uri_path, method, query, callback, user_data);
+  queue_data (self, body, -1, uri_path, method, query,
+              endpoint, room_id, callback, user_data);
 }
 
 static void
@@ -996,7 +1439,8 @@ matrix_login (MatrixApi *self)
   json_object_set_object_member (object, "identifier", child);
 
   queue_json_object (self, object, "/_matrix/client/r0/login",
-                     SOUP_METHOD_POST, NULL, matrix_login_cb, NULL);
+                     SOUP_METHOD_POST, NULL, ENDPOINT_LOGIN, NULL,
+                     matrix_login_cb, NULL);
 }
 
 static void
@@ -1010,7 +1454,8 @@ matrix_upload_key (MatrixApi *self)
   key = g_steal_pointer (&self->key);
 
   queue_data (self, key, strlen (key), "/_matrix/client/r0/keys/upload",
-              SOUP_METHOD_POST, NULL, matrix_upload_key_cb, NULL);
+              SOUP_METHOD_POST, NULL, ENDPOINT_KEYS_UPLOAD, NULL,
+              matrix_upload_key_cb, NULL);
 }
 
 static void
@@ -1049,7 +1494,8 @@ matrix_get_joined_rooms (MatrixApi *self)
   g_assert (!self->room_list_loaded);
 
   queue_data (self, NULL, 0, "/_matrix/client/r0/joined_rooms",
-              SOUP_METHOD_GET, NULL, get_joined_rooms_cb, NULL);
+              SOUP_METHOD_GET, NULL, ENDPOINT_JOINED_ROOMS, NULL,
+              get_joined_rooms_cb, NULL);
 }
 
 static void
@@ -1107,7 +1553,8 @@ matrix_take_red_pill (MatrixApi *self)
     g_hash_table_insert (query, g_strdup ("full_state"), g_strdup ("true"));
 
   queue_data (self, NULL, 0, "/_matrix/client/r0/sync",
-              SOUP_METHOD_GET, query, matrix_take_red_pill_cb, NULL);
+              SOUP_METHOD_GET, query, ENDPOINT_SYNC, NULL,
+              matrix_take_red_pill_cb, NULL);
 }
 
 static void
@@ -1120,6 +1567,7 @@ matrix_api_finalize (GObject *object)
   g_clear_object (&self->cancellable);
 
   g_clear_handle_id (&self->resync_id, g_source_remove);
+  g_clear_handle_id (&self->dispatch_id, g_source_remove);
   soup_session_abort (self->soup_session);
   g_object_unref (self->soup_session);
 
@@ -1128,6 +1576,7 @@ matrix_api_finalize (GObject *object)
   g_free (self->device_id);
   matrix_utils_free_buffer (self->password);
   matrix_utils_free_buffer (self->access_token);
+  g_ptr_array_free (self->active_requests, TRUE);
 
   G_OBJECT_CLASS (matrix_api_parent_class)->finalize (object);
 }
@@ -1148,6 +1597,13 @@ matrix_api_init (MatrixApi *self)
                                      "max-conns-per-host", MAX_CONNECTIONS,
                                      NULL);
   self->cancellable = g_cancellable_new ();
+  self->active_requests = g_ptr_array_new ();
+
+  for (guint i = 0; i < N_REQUEST_CLASSES; i++)
+    g_queue_init (&self->requests[i].queue);
+
+  for (guint i = 0; i < N_ENDPOINTS; i++)
+    self->buckets[i].tokens = request_endpoints[i].burst;
 }
 
 /**
@@ -1437,6 +1893,7 @@ matrix_api_stop_sync (MatrixApi *self)
   g_return_if_fail (MATRIX_IS_API (self));
 
   g_cancellable_cancel (self->cancellable);
+  api_cancel_requests (self, NULL);
   self->is_sync = FALSE;
   self->sync_failed = FALSE;
 
@@ -1446,6 +1903,67 @@ matrix_api_stop_sync (MatrixApi *self)
   self->cancellable = g_cancellable_new ();
 }
 
+/**
+ * matrix_api_cancel_room_requests:
+ * @self: A #MatrixApi
+ * @room_id: A valid matrix room id
+ *
+ * Cancel every pending and in progress request
+ * done for @room_id.  This should be called when
+ * the room is closed.  Cancelled requests complete
+ * with %G_IO_ERROR_CANCELLED.
+ */
+void
+matrix_api_cancel_room_requests (MatrixApi  *self,
+                                 const char *room_id)
+{
+  g_return_if_fail (MATRIX_IS_API (self));
+  g_return_if_fail (room_id && *room_id);
+
+  CHATTY_TRACE_MSG ("Cancelling requests for room %s", room_id);
+  api_cancel_requests (self, room_id);
+}
+
+/**
+ * matrix_api_get_request_stats:
+ * @self: A #MatrixApi
+ *
+ * Get the queue depth and latency details of
+ * requests done by @self, grouped by the kind
+ * of request.  Useful for debugging.
+ *
+ * Returns: (transfer full): A human readable string.
+ */
+char *
+matrix_api_get_request_stats (MatrixApi *self)
+{
+  GString *str;
+
+  g_return_val_if_fail (MATRIX_IS_API (self), NULL);
+
+  str = g_string_new (NULL);
+
+  for (guint i = 0; i < N_REQUEST_CLASSES; i++) {
+    RequestStats *stats = &self->requests[i];
+    gint64 avg_wait = 0, avg_latency = 0;
+
+    if (stats->n_done) {
+      avg_wait = stats->total_wait / stats->n_done;
+      avg_latency = stats->total_latency / stats->n_done;
+    }
+
+    g_string_append_printf (str, "%s: queued: %u (max: %u), active: %u, done: %"
+                            G_GUINT64_FORMAT ", wait: %" G_GINT64_FORMAT " ms, latency: %"
+                            G_GINT64_FORMAT " ms (max: %" G_GINT64_FORMAT " ms)\n",
+                            request_classes[i].name, stats->queue.length,
+                            stats->max_depth, stats->n_active, stats->n_done,
+                            avg_wait / 1000, avg_latency / 1000,
+                            stats->max_latency / 1000);
+  }
+
+  return g_string_free (str, FALSE);
+}
+
 void
 matrix_api_set_upload_key (MatrixApi *self,
                            char      *key)
@@ -1481,7 +1999,8 @@ matrix_api_set_typing (MatrixApi  *self,
                      room_id, "/typing/", self->username, NULL);
 
   queue_json_object (self, object, uri, SOUP_METHOD_PUT,
-                     NULL, matrix_send_typing_cb, NULL);
+                     NULL, ENDPOINT_TYPING, room_id,
+                     matrix_send_typing_cb, NULL);
 }
 
 void
@@ -1500,7 +2019,8 @@ matrix_api_get_room_state_async (MatrixApi           *self,
 
   uri = g_strconcat ("/_matrix/client/r0/rooms/", room_id, "/state", NULL);
   queue_data (self, NULL, 0, uri, SOUP_METHOD_GET,
-              NULL, matrix_get_room_state_cb, task);
+              NULL, ENDPOINT_ROOM_STATE, room_id,
+              matrix_get_room_state_cb, task);
 }
 
 JsonArray *
@@ -1539,7 +2059,8 @@ matrix_api_get_members_async (MatrixApi           *self,
   /* https://matrix.org/docs/spec/client_server/r0.6.1#get-matrix-client-r0-rooms-roomid-members */
   uri = g_strconcat ("/_matrix/client/r0/rooms/", room_id, "/members", NULL);
   queue_data (self, NULL, 0, uri, SOUP_METHOD_GET,
-              query, matrix_get_members_cb, g_steal_pointer (&task));
+              query, ENDPOINT_MEMBERS, room_id,
+              matrix_get_members_cb, g_steal_pointer (&task));
 }
 
 JsonObject *
@@ -1585,7 +2106,8 @@ matrix_api_load_prev_batch_async (MatrixApi           *self,
   /* https://matrix.org/docs/spec/client_server/r0.6.1#get-matrix-client-r0-rooms-roomid-messages */
   uri = g_strconcat ("/_matrix/client/r0/rooms/", room_id, "/messages", NULL);
   queue_data (self, NULL, 0, uri, SOUP_METHOD_GET,
-              query, matrix_get_messages_cb, task);
+              query, ENDPOINT_MESSAGES, room_id,
+              matrix_get_messages_cb, task);
 }
 
 JsonObject *
@@ -1656,7 +2178,8 @@ matrix_api_query_keys_async (MatrixApi           *self,
   task = g_task_new (self, self->cancellable, callback, user_data);
 
   queue_json_object (self, object, "/_matrix/client/r0/keys/query",
-                     SOUP_METHOD_POST, NULL, matrix_keys_query_cb, task);
+                     SOUP_METHOD_POST, NULL, ENDPOINT_KEYS_QUERY, NULL,
+                     matrix_keys_query_cb, task);
 }
 
 JsonObject *
@@ -1719,7 +2242,8 @@ matrix_api_claim_keys_async (MatrixApi           *self,
   task = g_task_new (self, self->cancellable, callback, user_data);
 
   queue_json_object (self, object, "/_matrix/client/r0/keys/claim",
-                     SOUP_METHOD_POST, NULL, matrix_keys_claim_cb, task);
+                     SOUP_METHOD_POST, NULL, ENDPOINT_KEYS_CLAIM, NULL,
+                     matrix_keys_claim_cb, task);
 }
 
 JsonObject *
@@ -1736,6 +2260,7 @@ matrix_api_claim_keys_finish (MatrixApi     *self,
 
 void
 matrix_api_get_file_async (MatrixApi             *self,
+                           const char            *room_id,
                            ChattyMessage         *message,
                            ChattyFileInfo        *file,
                            GCancellable          *cancellable,
@@ -1744,10 +2269,12 @@ matrix_api_get_file_async (MatrixApi             *self,
                            gpointer               user_data)
 {
   g_autoptr(SoupMessage) msg = NULL;
+  char *path;
   GTask *task;
 
   g_return_if_fail (MATRIX_IS_API (self));
   g_return_if_fail (!message || CHATTY_IS_MESSAGE (message));
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
 
   CHATTY_TRACE_MSG ("Downloading file");
 
@@ -1766,14 +2293,26 @@ matrix_api_get_file_async (MatrixApi             *self,
     return;
   }
 
+  /* The file may have been downloaded already, possibly with another account */
+  path = chatty_media_store_lookup_url (file->url);
+
+  if (path) {
+    g_debug ("File already in media store, not downloading");
+    g_free (file->path);
+    file->path = path;
+    g_task_return_boolean (task, TRUE);
+    g_object_unref (task);
+
+    return;
+  }
+
   file->status = CHATTY_FILE_DOWNLOADING;
   if (message)
     chatty_message_emit_updated (message);
 
   msg = soup_message_new (SOUP_METHOD_GET, file->url);
-  soup_session_send_async (self->soup_session, msg, self->cancellable,
-                           (GAsyncReadyCallback)api_get_file_stream_cb,
-                           g_steal_pointer (&task));
+  api_queue_request (self, task, msg, ENDPOINT_MEDIA, room_id, cancellable,
+                     (GAsyncReadyCallback)api_get_file_stream_cb);
 }
 
 gboolean
@@ -1827,7 +2366,8 @@ api_send_message_encrypted (MatrixApi     *self,
   uri = g_strdup_printf ("/_matrix/client/r0/rooms/%s/send/m.room.encrypted/%s", room_id, id);
 
   queue_json_object (self, root, uri, SOUP_METHOD_PUT,
-                     NULL, api_send_message_cb, g_object_ref (task));
+                     NULL, ENDPOINT_SEND, room_id,
+                     api_send_message_cb, g_object_ref (task));
   json_object_unref (root);
 }
 
@@ -1858,7 +2398,8 @@ api_send_message (MatrixApi     *self,
   /* https://matrix.org/docs/spec/client_server/r0.6.1#put-matrix-client-r0-rooms-roomid-send-eventtype-txnid */
   uri = g_strdup_printf ("/_matrix/client/r0/rooms/%s/send/m.room.message/%s", room_id, id);
   queue_json_object (self, content, uri, SOUP_METHOD_PUT,
-                     NULL, api_send_message_cb, g_object_ref (task));
+                     NULL, ENDPOINT_SEND, room_id,
+                     api_send_message_cb, g_object_ref (task));
 }
 
 void
@@ -1924,7 +2465,8 @@ matrix_api_set_read_marker_async (MatrixApi           *self,
 
   uri = g_strdup_printf ("/_matrix/client/r0/rooms/%s/read_markers", room_id);
   queue_json_object (self, root, uri, SOUP_METHOD_POST,
-                     NULL, api_set_read_marker_cb, task);
+                     NULL, ENDPOINT_READ_MARKERS, room_id,
+                     api_set_read_marker_cb, task);
 }
 
 gboolean
@@ -1968,7 +2510,8 @@ matrix_api_upload_group_keys_async (MatrixApi           *self,
                          g_get_real_time () / G_TIME_SPAN_MILLISECOND,
                          self->event_id);
   queue_json_object (self, root, uri, SOUP_METHOD_PUT,
-                     NULL, api_upload_group_keys_cb, task);
+                     NULL, ENDPOINT_SEND_TO_DEVICE, room_id,
+                     api_upload_group_keys_cb, task);
   CHATTY_EXIT;
 }
 
@@ -2029,7 +2572,8 @@ matrix_api_leave_chat_async (MatrixApi           *self,
   g_task_set_task_data (task, g_strdup (room_id), g_free);
   uri = g_strdup_printf ("/_matrix/client/r0/rooms/%s/leave", room_id);
   queue_data (self, NULL, 0, uri, SOUP_METHOD_POST,
-              NULL, api_leave_room_cb, task);
+              NULL, ENDPOINT_LEAVE, NULL,
+              api_leave_room_cb, task);
 }
 
 gboolean
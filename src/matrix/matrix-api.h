@@ -58,6 +58,9 @@ void          matrix_api_set_sync_callback       (MatrixApi      *self,
                                                   gpointer        object);
 void          matrix_api_start_sync              (MatrixApi      *self);
 void          matrix_api_stop_sync               (MatrixApi      *self);
+void          matrix_api_cancel_room_requests    (MatrixApi      *self,
+                                                  const char     *room_id);
+char         *matrix_api_get_request_stats       (MatrixApi      *self);
 void          matrix_api_set_upload_key          (MatrixApi      *self,
                                                   char           *key);
 void          matrix_api_set_typing              (MatrixApi      *self,
@@ -102,6 +105,7 @@ JsonObject   *matrix_api_claim_keys_finish       (MatrixApi      *self,
                                                   GAsyncResult   *result,
                                                   GError        **error);
 void           matrix_api_get_file_async         (MatrixApi      *self,
+                                                  const char     *room_id,
                                                   ChattyMessage  *message,
                                                   ChattyFileInfo *file,
                                                   GCancellable   *cancellable,
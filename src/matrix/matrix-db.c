@@ -22,6 +22,7 @@
 #include <sqlite3.h>
 
 #include "chatty-utils.h"
+#include "chatty-db-backup.h"
 #include "matrix-enc.h"
 #include "matrix-db.h"
 
@@ -32,6 +33,10 @@ struct _MatrixDb
   GAsyncQueue *queue;
   GThread     *worker_thread;
   sqlite3     *db;
+
+  /* Backup in progress and its task, accessed only in worker_thread */
+  ChattyDbBackup *backup;
+  GTask          *backup_task;
 };
 
 /*
@@ -217,6 +222,12 @@ matrix_close_db (MatrixDb *self,
   g_assert (g_thread_self () == self->worker_thread);
   g_assert (self->db);
 
+  if (self->backup_task)
+    g_task_return_new_error (self->backup_task, G_IO_ERROR, G_IO_ERROR_CLOSED,
+                             "Database closed before backup completed");
+  g_clear_pointer (&self->backup, chatty_db_backup_free);
+  g_clear_object (&self->backup_task);
+
   db = self->db;
   self->db = NULL;
   status = sqlite3_close (db);
@@ -716,6 +727,69 @@ history_get_olm_sessions (MatrixDb *self,
   g_task_return_pointer (task, sessions, (GDestroyNotify)g_ptr_array_unref);
 }
 
+static void
+matrix_backup_db (MatrixDb *self,
+                  GTask    *task)
+{
+  ChattyDbBackup *backup;
+  GError *error = NULL;
+  guint n_keep;
+  gboolean compress;
+
+  g_assert (MATRIX_IS_DB (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (g_thread_self () == self->worker_thread);
+
+  if (!self->db) {
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_INITIALIZED,
+                             "Database not opened");
+    return;
+  }
+
+  if (self->backup) {
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_PENDING,
+                             "A backup is already in progress");
+    return;
+  }
+
+  n_keep = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (task), "n-keep"));
+  compress = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (task), "compress"));
+  backup = chatty_db_backup_new (self->db, n_keep, compress, &error);
+
+  if (!backup) {
+    g_task_return_error (task, error);
+    return;
+  }
+
+  /* The pages are copied by the worker when there is nothing else to do */
+  self->backup = backup;
+  self->backup_task = g_object_ref (task);
+}
+
+static void
+matrix_backup_step (MatrixDb *self)
+{
+  GError *error = NULL;
+
+  g_assert (MATRIX_IS_DB (self));
+  g_assert (g_thread_self () == self->worker_thread);
+  g_assert (self->backup);
+
+  if (chatty_db_backup_step (self->backup, CHATTY_DB_BACKUP_STEP_PAGES, &error) &&
+      !chatty_db_backup_is_done (self->backup))
+    return;
+
+  if (error)
+    g_task_return_error (self->backup_task, error);
+  else
+    g_task_return_pointer (self->backup_task,
+                           g_strdup (chatty_db_backup_get_path (self->backup)),
+                           g_free);
+
+  g_clear_pointer (&self->backup, chatty_db_backup_free);
+  g_clear_object (&self->backup_task);
+}
+
 static gpointer
 matrix_db_worker (gpointer user_data)
 {
@@ -724,10 +798,20 @@ matrix_db_worker (gpointer user_data)
 
   g_assert (MATRIX_IS_DB (self));
 
-  while ((task = g_async_queue_pop (self->queue))) {
+  while (TRUE) {
     MatrixDbCallback callback;
 
-    g_assert (task);
+    /* Backups are copied only when there is nothing else to do */
+    if (self->backup)
+      task = g_async_queue_try_pop (self->queue);
+    else
+      task = g_async_queue_pop (self->queue);
+
+    if (!task) {
+      matrix_backup_step (self);
+      continue;
+    }
+
     callback = g_task_get_task_data (task);
     callback (self, task);
     g_object_unref (task);
@@ -894,6 +978,65 @@ matrix_db_close_async (MatrixDb            *self,
   g_async_queue_push (self->queue, task);
 }
 
+/**
+ * matrix_db_backup_async:
+ * @self: a #MatrixDb
+ * @n_keep: The number of backups to keep, 0 to keep all
+ * @compress: Whether to compress the backup
+ * @callback: a #GAsyncReadyCallback, or %NULL
+ * @user_data: closure data for @callback
+ *
+ * Create a backup of the open database next to it,
+ * copied in steps when the database is idle.  See
+ * chatty_history_backup_async().
+ *
+ * Complete with matrix_db_backup_finish() to get
+ * the result.
+ */
+void
+matrix_db_backup_async (MatrixDb            *self,
+                        guint                n_keep,
+                        gboolean             compress,
+                        GAsyncReadyCallback  callback,
+                        gpointer             user_data)
+{
+  GTask *task;
+
+  g_return_if_fail (MATRIX_IS_DB (self));
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, matrix_db_backup_async);
+  g_task_set_task_data (task, matrix_backup_db, NULL);
+  g_object_set_data (G_OBJECT (task), "n-keep", GUINT_TO_POINTER (n_keep));
+  g_object_set_data (G_OBJECT (task), "compress", GINT_TO_POINTER (!!compress));
+
+  g_async_queue_push (self->queue, task);
+}
+
+/**
+ * matrix_db_backup_finish:
+ * @self: a #MatrixDb
+ * @result: a #GAsyncResult provided to callback
+ * @error: a location for a #GError or %NULL
+ *
+ * Completes a backup started with
+ * matrix_db_backup_async().
+ *
+ * Returns: (transfer full): The path of the backup
+ * created, or %NULL on error with @error set.
+ */
+char *
+matrix_db_backup_finish (MatrixDb      *self,
+                         GAsyncResult  *result,
+                         GError       **error)
+{
+  g_return_val_if_fail (MATRIX_IS_DB (self), NULL);
+  g_return_val_if_fail (G_IS_TASK (result), NULL);
+  g_return_val_if_fail (!error || !*error, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
 /**
  * matrix_db_open_finish:
  * @self: a #MatrixDb
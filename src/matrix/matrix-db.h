@@ -56,6 +56,14 @@ void           matrix_db_close_async                   (MatrixDb        *self,
 gboolean       matrix_db_close_finish                  (MatrixDb        *self,
                                                         GAsyncResult    *result,
                                                         GError         **error);
+void           matrix_db_backup_async                  (MatrixDb        *self,
+                                                        guint            n_keep,
+                                                        gboolean         compress,
+                                                        GAsyncReadyCallback callback,
+                                                        gpointer        user_data);
+char          *matrix_db_backup_finish                 (MatrixDb        *self,
+                                                        GAsyncResult    *result,
+                                                        GError         **error);
 void           matrix_db_save_account_async            (MatrixDb        *db,
                                                         ChattyAccount   *account,
                                                         gboolean         enabled,
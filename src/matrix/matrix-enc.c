@@ -901,6 +901,7 @@ matrix_enc_handle_room_encrypted (MatrixEnc  *self,
   OlmSession *session;
   size_t error, length;
   int type;
+  CHATTY_TRACE_SPAN (G_STRFUNC);
 
   g_return_if_fail (MATRIX_IS_ENC (self));
   g_return_if_fail (object);
@@ -1015,6 +1016,7 @@ matrix_enc_handle_join_room_encrypted (MatrixEnc  *self,
   g_autofree char *plaintext = NULL;
   char *body;
   size_t length;
+  CHATTY_TRACE_SPAN (G_STRFUNC);
 
   g_return_val_if_fail (MATRIX_IS_ENC (self), NULL);
   g_return_val_if_fail (object, NULL);
@@ -58,9 +58,3 @@ void          matrix_utils_get_homeserver_async     (const char    *username,
                                                      gpointer       user_data);
 char         *matrix_utils_get_homeserver_finish    (GAsyncResult  *result,
                                                      GError       **error);
-void          matrix_utils_get_pixbuf_async         (const char    *file,
-                                                     GCancellable  *cancellable,
-                                                     GAsyncReadyCallback callback,
-                                                     gpointer       user_data);
-GdkPixbuf    *matrix_utils_get_pixbuf_finish        (GAsyncResult  *result,
-                                                     GError       **error);
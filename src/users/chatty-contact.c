@@ -43,6 +43,8 @@ struct _ChattyContact
 
   char       *name;
   char       *value;
+  /* @value as created with chatty_utils_get_search_key() */
+  char       *search_value;
   GdkPixbuf *avatar;
 };
 
@@ -92,7 +94,10 @@ chatty_contact_matches (ChattyItem     *item,
         match == E_PHONE_NUMBER_MATCH_NATIONAL)
       return TRUE;
 
-    if (g_str_equal (value, needle))
+    if (!self->search_value)
+      self->search_value = chatty_utils_get_search_key (value);
+
+    if (g_str_equal (self->search_value, needle))
       return TRUE;
   }
 
@@ -194,6 +199,7 @@ chatty_contact_dispose (GObject *object)
   g_clear_pointer (&self->attribute, e_vcard_attribute_free);
   g_clear_pointer (&self->name, g_free);
   g_clear_pointer (&self->value, g_free);
+  g_clear_pointer (&self->search_value, g_free);
 
   G_OBJECT_CLASS (chatty_contact_parent_class)->dispose (object);
 }
@@ -293,6 +299,7 @@ chatty_contact_set_value (ChattyContact *self,
 
   g_free (self->value);
   self->value = g_strdup (value);
+  g_clear_pointer (&self->search_value, g_free);
 }
 
 /**
@@ -27,6 +27,10 @@
 typedef struct
 {
   ChattyProtocol protocols;
+
+  /* The name @search_key was created from */
+  char          *search_name;
+  char          *search_key;
 } ChattyItemPrivate;
 
 G_DEFINE_ABSTRACT_TYPE_WITH_PRIVATE (ChattyItem, chatty_item, G_TYPE_OBJECT)
@@ -63,13 +67,9 @@ chatty_item_real_matches (ChattyItem     *self,
                           ChattyProtocol  protocols,
                           gboolean        match_name)
 {
-  const char *name;
-
   g_assert (CHATTY_IS_ITEM (self));
 
-  name = chatty_item_get_name (self);
-
-  return strcasestr (name, needle) != NULL;
+  return strstr (chatty_item_get_search_key (self), needle) != NULL;
 }
 
 static const char *
@@ -227,6 +227,18 @@ chatty_item_set_property (GObject      *object,
     }
 }
 
+static void
+chatty_item_finalize (GObject *object)
+{
+  ChattyItem *self = (ChattyItem *)object;
+  ChattyItemPrivate *priv = chatty_item_get_instance_private (self);
+
+  g_free (priv->search_name);
+  g_free (priv->search_key);
+
+  G_OBJECT_CLASS (chatty_item_parent_class)->finalize (object);
+}
+
 static void
 chatty_item_class_init (ChattyItemClass *klass)
 {
@@ -234,6 +246,7 @@ chatty_item_class_init (ChattyItemClass *klass)
 
   object_class->get_property = chatty_item_get_property;
   object_class->set_property = chatty_item_set_property;
+  object_class->finalize = chatty_item_finalize;
 
   klass->get_protocols = chatty_item_real_get_protocols;
   klass->matches  = chatty_item_real_matches;
@@ -349,6 +362,10 @@ chatty_item_is_sms (ChattyItem *self)
  * See if @needle matches @self (partially or fully).
  * If @match_name is %TRUE, first matches the name of @self.
  *
+ * @needle should be created with chatty_utils_get_search_key()
+ * so that it can be matched against the precomputed search
+ * key of @self.
+ *
  * Returns: %TRUE if @needle and @self has some match.
  * %FALSE otherwise.
  */
@@ -426,6 +443,40 @@ chatty_item_get_name (ChattyItem *self)
   return CHATTY_ITEM_GET_CLASS (self)->get_name (self);
 }
 
+/**
+ * chatty_item_get_search_key:
+ * @self: a #ChattyItem
+ *
+ * Get the case folded and normalized name of @self,
+ * as created with chatty_utils_get_search_key().
+ * The key is cached and is recreated only when the
+ * name of @self changes.
+ *
+ * Returns: (transfer none): the search key of Item.
+ */
+const char *
+chatty_item_get_search_key (ChattyItem *self)
+{
+  ChattyItemPrivate *priv = chatty_item_get_instance_private (self);
+  const char *name;
+
+  g_return_val_if_fail (CHATTY_IS_ITEM (self), "");
+
+  name = chatty_item_get_name (self);
+
+  if (!name)
+    name = "";
+
+  if (!priv->search_key || g_strcmp0 (name, priv->search_name) != 0) {
+    g_free (priv->search_name);
+    g_free (priv->search_key);
+    priv->search_name = g_strdup (name);
+    priv->search_key = chatty_utils_get_search_key (name);
+  }
+
+  return priv->search_key;
+}
+
 /**
  * chatty_item_set_name:
  * @self: a #ChattyItem
@@ -64,6 +64,7 @@ gboolean         chatty_item_matches             (ChattyItem           *self,
 int              chatty_item_compare              (ChattyItem          *a,
                                                    ChattyItem          *b);
 const char      *chatty_item_get_name            (ChattyItem           *self);
+const char      *chatty_item_get_search_key      (ChattyItem           *self);
 void             chatty_item_set_name            (ChattyItem           *self,
                                                   const char           *name);
 ChattyItemState  chatty_item_get_state           (ChattyItem           *self);
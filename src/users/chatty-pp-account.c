@@ -18,11 +18,14 @@
 #include <handy.h>
 #include <purple.h>
 
+#include "chatty-avatar-cache.h"
+#include "chatty-indexed-store.h"
 #include "chatty-settings.h"
 #include "chatty-account.h"
 #include "chatty-window.h"
 #include "chatty-pp-chat.h"
 #include "chatty-pp-account.h"
+#include "chatty-log.h"
 
 /**
  * SECTION: chatty-pp-account
@@ -42,13 +45,14 @@ struct _ChattyPpAccount
 
   gchar          *username;
   gchar          *server_url;
-  GListStore     *buddy_list;
+  ChattyIndexedStore *buddy_list;
   HdyValueObject *device_fp;
   GListStore     *fp_list;
 
   PurpleAccount  *pp_account;
   PurpleStoredImage *pp_avatar;
   GdkPixbuf         *avatar;
+  GCancellable      *avatar_cancellable;
   guint           connect_id;
   ChattyProtocol  protocol;
   gboolean        has_encryption;
@@ -242,6 +246,13 @@ chatty_pp_account_set_username (ChattyAccount *account,
   purple_account_set_username (self->pp_account, username);
 }
 
+/* Buddies are indexed by their #PurpleBuddy */
+static gpointer
+pp_account_buddy_get_key (gpointer item)
+{
+  return chatty_pp_buddy_get_buddy (item);
+}
+
 static GListModel *
 chatty_pp_account_get_buddies (ChattyAccount *account)
 {
@@ -606,35 +617,34 @@ chatty_pp_account_set_name (ChattyItem *item,
   purple_account_set_alias (self->pp_account, name);
 }
 
-static GdkPixbuf *
-chatty_icon_from_data (const guchar *buf,
-                       gsize         size)
+static void
+pp_account_avatar_loaded_cb (GObject      *object,
+                             GAsyncResult *result,
+                             gpointer      user_data)
 {
-  g_autoptr(GdkPixbufLoader) loader = NULL;
+  g_autoptr(ChattyPpAccount) self = user_data;
+  g_autoptr(GdkPixbuf) pixbuf = NULL;
   g_autoptr(GError) error = NULL;
-  GdkPixbuf *pixbuf = NULL;
 
-  loader = gdk_pixbuf_loader_new ();
-  gdk_pixbuf_loader_write (loader, buf, size, &error);
+  g_assert (CHATTY_IS_PP_ACCOUNT (self));
 
-  if (!error)
-    gdk_pixbuf_loader_close (loader, &error);
+  pixbuf = chatty_avatar_cache_load_finish (CHATTY_AVATAR_CACHE (object), result, &error);
 
-  if (error)
-    g_warning ("Error: %s: %s", __func__, error->message);
-  else
-    pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    return;
 
-  if (!pixbuf)
-    g_warning ("%s: pixbuf creation failed", __func__);
+  if (error)
+    CHATTY_TRACE_MSG ("Error loading avatar: %s", error->message);
 
-  return g_object_ref (pixbuf);
+  g_set_object (&self->avatar, pixbuf);
+  g_signal_emit_by_name (self, "avatar-changed");
 }
 
 static GdkPixbuf *
 chatty_pp_account_get_avatar (ChattyItem *item)
 {
   ChattyPpAccount *self = (ChattyPpAccount *)item;
+  g_autoptr(GBytes) bytes = NULL;
   PurpleStoredImage *img;
 
   g_assert (CHATTY_IS_PP_ACCOUNT (self));
@@ -644,16 +654,27 @@ chatty_pp_account_get_avatar (ChattyItem *item)
   if (img == NULL)
     return NULL;
 
-  if (img == self->pp_avatar && self->avatar)
+  /* The avatar is either loaded or being loaded */
+  if (img == self->pp_avatar) {
+    purple_imgstore_unref (img);
     return self->avatar;
+  }
 
-  purple_imgstore_unref (self->pp_avatar);
-  g_clear_object (&self->avatar);
+  if (self->pp_avatar)
+    purple_imgstore_unref (self->pp_avatar);
   self->pp_avatar = img;
+  bytes = g_bytes_new (purple_imgstore_get_data (img),
+                       purple_imgstore_get_size (img));
+
+  g_cancellable_cancel (self->avatar_cancellable);
+  g_clear_object (&self->avatar_cancellable);
+  self->avatar_cancellable = g_cancellable_new ();
+
+  /* Return the old avatar until the new one is decoded */
+  chatty_avatar_cache_load_async (chatty_avatar_cache_get_default (), bytes,
+                                  CHATTY_AVATAR_CACHE_SIZE, self->avatar_cancellable,
+                                  pp_account_avatar_loaded_cb, g_object_ref (self));
 
-  if (img != NULL)
-    self->avatar = chatty_icon_from_data (purple_imgstore_get_data (img),
-                                          purple_imgstore_get_size (img));
   return self->avatar;
 }
 
@@ -764,6 +785,7 @@ chatty_pp_account_finalize (GObject *object)
   g_clear_object (&self->fp_list);
   g_clear_object (&self->device_fp);
   g_clear_object (&self->buddy_list);
+  g_clear_object (&self->avatar_cancellable);
   g_clear_object (&self->avatar);
   g_free (self->username);
   g_free (self->server_url);
@@ -837,7 +859,8 @@ chatty_pp_account_class_init (ChattyPpAccountClass *klass)
 static void
 chatty_pp_account_init (ChattyPpAccount *self)
 {
-  self->buddy_list = g_list_store_new (CHATTY_TYPE_PP_BUDDY);
+  self->buddy_list = chatty_indexed_store_new_full (CHATTY_TYPE_PP_BUDDY, pp_account_buddy_get_key,
+                                                    NULL, NULL, NULL);
   self->fp_list = g_list_store_new (HDY_TYPE_VALUE_OBJECT);
 }
 
@@ -20,11 +20,15 @@
 #include <purple.h>
 #include <glib/gi18n.h>
 
+#include "chatty-avatar-cache.h"
+#include "chatty-indexed-store.h"
 #include "chatty-settings.h"
+#include "chatty-utils.h"
 #include "chatty-account.h"
 #include "chatty-pp-account.h"
 #include "chatty-window.h"
 #include "chatty-pp-buddy.h"
+#include "chatty-log.h"
 
 /**
  * SECTION: chatty-pp-buddy
@@ -39,6 +43,9 @@ struct _ChattyPpBuddy
 
   char              *username;
   char              *name;
+  /* The id @search_id was created from */
+  char              *search_id_src;
+  char              *search_id;
   PurpleAccount     *pp_account;
   PurpleBuddy       *pp_buddy;
   ChattyContact     *contact;
@@ -49,6 +56,7 @@ struct _ChattyPpBuddy
   gpointer          *avatar_data; /* purple icon data */
   PurpleStoredImage *pp_avatar;
   GdkPixbuf         *avatar;
+  GCancellable      *avatar_cancellable;
   ChattyProtocol     protocol;
 };
 
@@ -88,32 +96,6 @@ chatty_pp_buddy_update_protocol (ChattyPpBuddy *self)
 }
 
 
-static GdkPixbuf *
-chatty_icon_from_data (const guchar *buf,
-                       gsize         size)
-{
-  g_autoptr(GdkPixbufLoader) loader = NULL;
-  g_autoptr(GError) error = NULL;
-  GdkPixbuf *pixbuf = NULL;
-
-  loader = gdk_pixbuf_loader_new ();
-  gdk_pixbuf_loader_write (loader, buf, size, &error);
-
-  if (!error)
-    gdk_pixbuf_loader_close (loader, &error);
-
-  if (error)
-    g_warning ("Error: %s: %s", __func__, error->message);
-  else
-    pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
-
-  if (!pixbuf)
-    g_warning ("%s: pixbuf creation failed", __func__);
-
-  return g_object_ref (pixbuf);
-}
-
-
 /* copied and modified from chatty_blist_add_buddy */
 static void
 chatty_add_new_buddy (ChattyPpBuddy *self)
@@ -179,7 +161,19 @@ chatty_pp_buddy_matches (ChattyItem     *item,
   else
     return FALSE;
 
-  return strcasestr (item_id, needle) != NULL;
+  if (!needle || !item_id)
+    return FALSE;
+
+  /* @needle is a search key, so fold @item_id the same way.
+   * The buddy may be renamed, so refold when @item_id changes */
+  if (!self->search_id || g_strcmp0 (item_id, self->search_id_src) != 0) {
+    g_free (self->search_id_src);
+    g_free (self->search_id);
+    self->search_id_src = g_strdup (item_id);
+    self->search_id = chatty_utils_get_search_key (item_id);
+  }
+
+  return strstr (self->search_id, needle) != NULL;
 }
 
 static const char *
@@ -236,10 +230,34 @@ chatty_pp_buddy_set_name (ChattyItem *item,
 }
 
 
+static void
+pp_buddy_avatar_loaded_cb (GObject      *object,
+                           GAsyncResult *result,
+                           gpointer      user_data)
+{
+  g_autoptr(ChattyPpBuddy) self = user_data;
+  g_autoptr(GdkPixbuf) pixbuf = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_assert (CHATTY_IS_PP_BUDDY (self));
+
+  pixbuf = chatty_avatar_cache_load_finish (CHATTY_AVATAR_CACHE (object), result, &error);
+
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    return;
+
+  if (error)
+    CHATTY_TRACE_MSG ("Error loading avatar: %s", error->message);
+
+  g_set_object (&self->avatar, pixbuf);
+  g_signal_emit_by_name (self, "avatar-changed");
+}
+
 static gboolean
 load_icon (gpointer user_data)
 {
   ChattyPpBuddy *self = user_data;
+  g_autoptr(GBytes) bytes = NULL;
   PurpleContact *contact;
   PurpleBuddy *buddy = NULL;
   PurpleStoredImage *img = NULL;
@@ -304,10 +322,17 @@ load_icon (gpointer user_data)
   if (data == self->avatar_data)
     return G_SOURCE_REMOVE;
 
-  g_clear_object (&self->avatar);
   self->avatar_data = (gpointer)data;
-  self->avatar = chatty_icon_from_data (data, len);
-  g_signal_emit_by_name (self, "avatar-changed");
+  bytes = g_bytes_new (data, len);
+
+  g_cancellable_cancel (self->avatar_cancellable);
+  g_clear_object (&self->avatar_cancellable);
+  self->avatar_cancellable = g_cancellable_new ();
+
+  /* The avatar is updated once decoded */
+  chatty_avatar_cache_load_async (chatty_avatar_cache_get_default (), bytes,
+                                  CHATTY_AVATAR_CACHE_SIZE, self->avatar_cancellable,
+                                  pp_buddy_avatar_loaded_cb, g_object_ref (self));
 
   return G_SOURCE_REMOVE;
 }
@@ -392,7 +417,7 @@ chatty_pp_buddy_constructed (GObject *object)
 
   account = self->pp_buddy->account->ui_data;
   model = chatty_account_get_buddies (account);
-  g_list_store_append (G_LIST_STORE (model), self);
+  chatty_indexed_store_append (CHATTY_INDEXED_STORE (model), self);
 
   if (!has_pp_buddy)
     chatty_add_new_buddy (self);
@@ -403,9 +428,13 @@ chatty_pp_buddy_dispose (GObject *object)
 {
   ChattyPpBuddy *self = (ChattyPpBuddy *)object;
 
+  g_cancellable_cancel (self->avatar_cancellable);
+  g_clear_object (&self->avatar_cancellable);
   g_clear_object (&self->avatar);
   g_clear_pointer (&self->username, g_free);
   g_clear_pointer (&self->name, g_free);
+  g_clear_pointer (&self->search_id_src, g_free);
+  g_clear_pointer (&self->search_id, g_free);
 
   G_OBJECT_CLASS (chatty_pp_buddy_parent_class)->dispose (object);
 }
@@ -21,34 +21,23 @@
 #include "xeps.h"
 #include "chatty-xep-0184.h"
 #include "chatty-settings.h"
-
-
-static GHashTable *ht_bubble_node = NULL;
-
-
-static gboolean
-cb_ht_bubble_node_check_items (gpointer key,
-                               gpointer value,
-                               gpointer user_data)
-{
-  return ((GtkWidget*)value == user_data) ? TRUE : FALSE;
-}
+#include "chatty-receipts.h"
 
 
 /**
  * cb_chatty_xep_deleting_conversation:
  * @conv: a PurpleConversation
  *
- * Clear the hash-table when a conversation
- * was deleted
+ * Stop tracking receipts of the
+ * conversation when it's deleted
  *
  */
 static void
 cb_chatty_xep_deleting_conversation (PurpleConversation *conv)
 {
-  g_hash_table_foreach_remove (ht_bubble_node,
-                               cb_ht_bubble_node_check_items,
-                               conv->ui_data);
+  if (conv->ui_data)
+    chatty_receipts_remove_chat (chatty_receipts_get_default (),
+                                 conv->ui_data);
 
   g_debug ("conversation closed");
 }
@@ -58,39 +47,18 @@ cb_chatty_xep_deleting_conversation (PurpleConversation *conv)
  * chatty_xeps_display_received:
  * @node_id: a const char
  *
- * Search hash-table based on node_id
- * and add a check-mark to the corresponding
- * msg-bubble footer
+ * Mark the message sent with node_id
+ * as delivered
  *
  */
 static void
 chatty_xeps_display_received (const char* node_id)
 {
-  ChattyChat *chat;
-
   if (node_id == NULL) {
     return;
   }
 
-  chat = g_hash_table_lookup (ht_bubble_node, node_id);
-
-  if (chat != NULL) {
-    GListModel *message_list;
-    g_autoptr(ChattyMessage) message = NULL;
-    guint n_items;
-
-    message_list = chatty_chat_get_messages (chat);
-    n_items = g_list_model_get_n_items (message_list);
-    message = g_list_model_get_item (message_list, n_items - 1);
-
-    if (message)
-      chatty_message_set_status (message, CHATTY_STATUS_DELIVERED, time (NULL));
-    else if (n_items)
-      g_warn_if_reached ();
-
-    g_hash_table_remove (ht_bubble_node, node_id);
-  }
-
+  chatty_receipts_set_delivered (chatty_receipts_get_default (), node_id);
 }
 
 
@@ -99,9 +67,10 @@ chatty_xeps_display_received (const char* node_id)
  * @node_to: a const char
  * @node_id: a const char
  *
- * Add nodes to a hash-table which
- * will be looked up for adding
- * receipt notifications to sent messages
+ * Track receipts for node_id.  The
+ * stanza is sent before the message is
+ * written to the chat, the message is
+ * set when written, see chatty-manager.c
  *
  */
 static void
@@ -126,11 +95,10 @@ chatty_xeps_add_sent (PurpleConnection *gc,
     return;
   }
 
-  g_hash_table_insert (ht_bubble_node, strdup (node_id), conv->ui_data);
+  chatty_receipts_add (chatty_receipts_get_default (),
+                       conv->ui_data, node_id, NULL);
 
-  g_debug ("attached key: %s, table size %i \n",
-           node_id,
-           g_hash_table_size (ht_bubble_node));
+  g_debug ("attached key: %s", node_id);
 }
 
 
@@ -252,12 +220,12 @@ cb_chatty_xeps_xmlnode_send (PurpleConnection  *gc,
 /**
  * chatty_0184_close:
  *
- * Unref node hashtable
+ * Save pending receipts
  */
 void
 chatty_0184_close (void)
 {
-  g_hash_table_destroy (ht_bubble_node);
+  chatty_receipts_save (chatty_receipts_get_default ());
 }
 
 
@@ -288,11 +256,6 @@ chatty_0184_init (void)
     g_debug ("xmpp receipt feature not added");
   }
 
-  ht_bubble_node  = g_hash_table_new_full (g_str_hash,
-                                           g_str_equal,
-                                           g_free,
-                                           NULL);
-
   purple_signal_connect (jabber,
                          "jabber-receiving-xmlnode",
                          &handle,
@@ -21,6 +21,7 @@
 #include "chatty-pp-chat.h"
 #include "chatty-manager.h"
 #include "chatty-settings.h"
+#include "chatty-application.h"
 
 #define NS_FWDv0 "urn:xmpp:forward:0"
 #define NS_SIDv0 "urn:xmpp:sid:0"
@@ -28,6 +29,14 @@
 #define NS_DATA "jabber:x:data"
 #define NS_RSM "http://jabber.org/protocol/rsm"
 
+/* Messages may be stored with a time earlier than the query start
+ * (eg: sent messages saved with local time), so consider a day more
+ * when looking for already stored messages */
+#define MAM_DEDUP_SLACK (24 * 60 * 60)
+
+/* Maximum number of archives queried at the same time per account */
+#define MAM_MAX_QUERIES 4
+
 typedef struct {
   PurpleConversation *conv;
   PurpleConvMessage p;
@@ -45,12 +54,30 @@ typedef struct {
   char       *start;
   char         *end;
   int           max;
+  /* start as UNIX time */
+  gint64        start_ts;
+  /* uids of messages stored since start, used to drop duplicates */
+  GHashTable   *known;
+  /* Messages of the current page, to be saved together */
+  GPtrArray    *chats;
+  GPtrArray    *messages;
+  /* Time of the last message received */
+  time_t        last_ts;
+  /* Higher is queried first */
+  gint64        priority;
+  /* after is the stored position, and no page is received yet */
+  gboolean      resumed;
 } MAMQuery;
 
 /* FIXME: What if purple becomes multithreaded 8-O */
 typedef struct {
   GHashTable *qs;
-  time_t   last_ts;
+  /* Queries waiting to be sent, by priority */
+  GQueue   pending;
+  guint    n_running;
+  /* Archives synced since the last sync completed */
+  guint    n_done;
+  guint    n_total;
   MamMsg  *cur_msg;
   char    *cur_oid;
   char    *ns;
@@ -58,6 +85,29 @@ typedef struct {
 
 static GHashTable *ht_mam_ctx = NULL;
 
+typedef struct {
+  char *user;
+  char *qid;
+} MamLookup;
+
+/* The position of a query, saved once its page is in history */
+typedef struct {
+  PurpleAccount *pa;
+  char          *to;
+  char          *after;
+  time_t         last_ts;
+} MamPosition;
+
+static void
+mam_position_free (MamPosition *position)
+{
+  g_free (position->to);
+  g_free (position->after);
+  g_free (position);
+}
+
+static void chatty_mam_update_progress (void);
+
 /**
  * mamq_free:
  *
@@ -75,6 +125,9 @@ mamq_free(void *ptr)
   g_free(mamq->before);
   g_free(mamq->start);
   g_free(mamq->end);
+  g_clear_pointer(&mamq->known, g_hash_table_unref);
+  g_clear_pointer(&mamq->chats, g_ptr_array_unref);
+  g_clear_pointer(&mamq->messages, g_ptr_array_unref);
   g_free(mamq);
 }
 
@@ -112,6 +165,7 @@ mamc_free(void *ptr)
   g_free(mamc->ns);
   g_free(mamc->cur_oid);
   mamm_free(mamc->cur_msg);
+  g_queue_clear(&mamc->pending);
   g_hash_table_destroy(mamc->qs);
   g_free(mamc);
 }
@@ -179,6 +233,8 @@ chatty_mam_ctx_del(PurpleAccount *pa)
   g_return_if_fail(pa != NULL);
   g_debug("Cleaning context for %s", purple_account_get_username(pa));
   g_hash_table_remove(ht_mam_ctx, purple_account_get_username(pa));
+  // Pending queries of the account are gone
+  chatty_mam_update_progress();
 }
 
 /**
@@ -276,6 +332,308 @@ chatty_mam_query_prefs(PurpleConnection *pc, const char *to)
 }
 
 static void chatty_mam_query_archive (MAMQuery *mamq);
+static void cb_mam_known_ids (GObject *object, GAsyncResult *result, gpointer user_data);
+
+/**
+ * chatty_mam_update_progress:
+ *
+ * Report the progress of archive sync of all accounts
+ */
+static void
+chatty_mam_update_progress (void)
+{
+  GHashTableIter iter;
+  gpointer value;
+  guint done = 0, total = 0;
+
+  g_hash_table_iter_init (&iter, ht_mam_ctx);
+  while (g_hash_table_iter_next (&iter, NULL, &value)) {
+    MamCtx *mamc = value;
+
+    done += mamc->n_done;
+    total += mamc->n_total;
+  }
+
+  chatty_manager_set_sync_progress (chatty_manager_get_default (), done, total);
+}
+
+/**
+ * chatty_mam_start_query:
+ * @mamq: MAMQuery containing full query context
+ *
+ * Fetch the ids of messages already stored in the query
+ * window, and request the archive once done.
+ */
+static void
+chatty_mam_start_query (MAMQuery *mamq)
+{
+  PurpleAccount *pa = purple_connection_get_account(mamq->js->gc);
+  ChattyManager *manager = chatty_manager_get_default ();
+  MamLookup *lookup;
+
+  g_debug ("Querying %s by %s from %s after %s",
+           mamq->to ? mamq->to : "own archive", mamq->id, mamq->start, mamq->after);
+
+  lookup = g_new0(MamLookup, 1);
+  lookup->user = g_strdup(purple_account_get_username(pa));
+  lookup->qid = g_strdup(mamq->id);
+  chatty_history_get_uids_async (chatty_manager_get_history (manager),
+                                 lookup->user, mamq->to,
+                                 mamq->start_ts - MAM_DEDUP_SLACK,
+                                 cb_mam_known_ids, lookup);
+}
+
+/**
+ * chatty_mam_run_queries:
+ * @mamc: MamCtx of the account
+ *
+ * Start pending queries in the order of priority,
+ * without running more than MAM_MAX_QUERIES at once.
+ */
+static void
+chatty_mam_run_queries (MamCtx *mamc)
+{
+  while(mamc->n_running < MAM_MAX_QUERIES && mamc->pending.length) {
+    MAMQuery *mamq = g_queue_pop_head(&mamc->pending);
+
+    mamc->n_running++;
+    chatty_mam_start_query(mamq);
+  }
+
+  chatty_mam_update_progress();
+
+  // Start counting again on the next sync
+  if(mamc->n_done == mamc->n_total)
+    mamc->n_done = mamc->n_total = 0;
+}
+
+static int
+mamq_compare_priority (gconstpointer a,
+                       gconstpointer b,
+                       gpointer      user_data)
+{
+  const MAMQuery *mamq_a = a, *mamq_b = b;
+
+  if(mamq_a->priority == mamq_b->priority)
+    return 0;
+
+  return mamq_a->priority > mamq_b->priority ? -1 : 1;
+}
+
+/**
+ * chatty_mam_get_priority:
+ * @pa: PurpleAccount of the query
+ * @room: (nullable): the MUC jid, %NULL for own archive
+ * @last_ts: time of the last message known
+ *
+ * The own archive is synced first, then the chat the user
+ * has open, then the rest by recent activity.
+ */
+static gint64
+chatty_mam_get_priority (PurpleAccount *pa,
+                         const char    *room,
+                         time_t         last_ts)
+{
+  PurpleConversation *conv;
+  ChattyChat *chat = NULL;
+
+  if(room == NULL)
+    return G_MAXINT64;
+
+  conv = purple_find_conversation_with_account(PURPLE_CONV_TYPE_CHAT, room, pa);
+  if(conv)
+    chat = conv->ui_data;
+
+  if(chat && chat == chatty_application_get_active_chat (CHATTY_APPLICATION_DEFAULT ()))
+    return G_MAXINT64 - 1;
+
+  if(chat && chatty_chat_get_last_msg_time(chat) > last_ts)
+    return chatty_chat_get_last_msg_time(chat);
+
+  return last_ts;
+}
+
+/**
+ * chatty_mam_schedule:
+ * @mamc: MamCtx of the account
+ * @mamq: MAMQuery to run
+ *
+ * Queue @mamq to be run when a query slot is free
+ */
+static void
+chatty_mam_schedule (MamCtx   *mamc,
+                     MAMQuery *mamq)
+{
+  g_queue_insert_sorted(&mamc->pending, mamq, mamq_compare_priority, NULL);
+  mamc->n_total++;
+  chatty_mam_run_queries(mamc);
+}
+
+/**
+ * chatty_mam_save_position:
+ * @position: MamPosition of the query
+ *
+ * Store the id and time of the last message synced, so
+ * that the next sync resumes from there.  The position of
+ * own archive is stored in the account and that of rooms
+ * in the room's blist node.
+ */
+static void
+chatty_mam_save_position (MamPosition *position)
+{
+  PurpleAccount *pa = position->pa;
+
+  if(position->to) {
+    PurpleChat *chat = purple_blist_find_chat(pa, position->to);
+
+    if(chat == NULL)
+      return;
+    if(position->last_ts > 0)
+      purple_blist_node_set_int(PURPLE_BLIST_NODE(chat), "mam_last_ts", position->last_ts);
+    if(position->after)
+      purple_blist_node_set_string(PURPLE_BLIST_NODE(chat), "mam_last_id", position->after);
+  } else {
+    if(position->last_ts > 0)
+      purple_account_set_int(pa, "mam_last_ts", position->last_ts);
+    if(position->after)
+      purple_account_set_string(pa, "mam_last_id", position->after);
+  }
+}
+
+static void
+cb_mam_page_saved (GObject      *object,
+                   GAsyncResult *result,
+                   gpointer      user_data)
+{
+  MamPosition *position = user_data;
+  g_autoptr(GError) error = NULL;
+
+  if (!chatty_history_add_messages_finish (CHATTY_HISTORY (object), result, &error))
+    g_warning ("Error saving MAM page: %s", error->message);
+  /* The account may have been removed while saving */
+  else if (position && g_list_find (purple_accounts_get_all (), position->pa))
+    chatty_mam_save_position (position);
+
+  g_clear_pointer (&position, mam_position_free);
+}
+
+/**
+ * chatty_mam_save_page:
+ * @pa: PurpleAccount of the query
+ * @mamq: MAMQuery containing full query context
+ * @save_position: Whether to save the position of @mamq
+ *
+ * Save the messages received in the current page
+ * to history in a single transaction.  This doesn't
+ * block, so that the next page can be handled while
+ * the messages are being saved.
+ *
+ * If @save_position is %TRUE, the position of @mamq
+ * is saved only after the page is in history, so that
+ * a crash in between doesn't skip the page on the next
+ * sync.
+ */
+static void
+chatty_mam_save_page (PurpleAccount *pa,
+                      MAMQuery      *mamq,
+                      gboolean       save_position)
+{
+  ChattyManager *manager = chatty_manager_get_default ();
+  MamPosition *position = NULL;
+
+  if (save_position) {
+    position = g_new0 (MamPosition, 1);
+    position->pa = pa;
+    position->to = g_strdup (mamq->to);
+    position->after = g_strdup (mamq->after);
+    position->last_ts = mamq->last_ts;
+  }
+
+  if (mamq->messages == NULL || mamq->messages->len == 0) {
+    if (!position)
+      return;
+
+    /* Still go through history, so that the position is saved
+     * after the pages queued before are saved */
+    g_clear_pointer(&mamq->chats, g_ptr_array_unref);
+    g_clear_pointer(&mamq->messages, g_ptr_array_unref);
+    mamq->chats = g_ptr_array_new ();
+    mamq->messages = g_ptr_array_new ();
+  }
+
+  g_debug ("Saving %u MAM messages for query %s", mamq->messages->len, mamq->id);
+  chatty_history_add_messages_async (chatty_manager_get_history (manager),
+                                     mamq->chats, mamq->messages,
+                                     cb_mam_page_saved, position);
+  g_clear_pointer(&mamq->chats, g_ptr_array_unref);
+  g_clear_pointer(&mamq->messages, g_ptr_array_unref);
+}
+
+/**
+ * chatty_mam_add_to_page:
+ * @mamq: MAMQuery containing full query context
+ * @chat: the ChattyChat @message belongs to
+ * @message: the ChattyMessage received
+ *
+ * Queue @message to be saved with the current page
+ */
+static void
+chatty_mam_add_to_page (MAMQuery      *mamq,
+                        ChattyChat    *chat,
+                        ChattyMessage *message)
+{
+  if(mamq->messages == NULL) {
+    mamq->chats = g_ptr_array_new_with_free_func (g_object_unref);
+    mamq->messages = g_ptr_array_new_with_free_func (g_object_unref);
+  }
+
+  g_ptr_array_add (mamq->chats, g_object_ref (chat));
+  g_ptr_array_add (mamq->messages, g_object_ref (message));
+
+  // The same message may appear again in a later page
+  if(mamq->known)
+    g_hash_table_add (mamq->known, g_strdup (chatty_message_get_uid (message)));
+}
+
+/**
+ * chatty_mam_is_stored:
+ * @mamq: (nullable): MAMQuery the message is a result of
+ * @uid: the stanza-id or origin-id of the message
+ * @room: (nullable): the MUC the message belongs to
+ * @user: the account username
+ *
+ * Check if the message @uid is already stored.  For MAM
+ * results the ids prefetched for the query are used,
+ * otherwise (or if prefetching failed) history is checked.
+ */
+static gboolean
+chatty_mam_is_stored (MAMQuery   *mamq,
+                      const char *uid,
+                      const char *room,
+                      const char *user)
+{
+  ChattyManager *manager = chatty_manager_get_default ();
+  int dts;
+
+  if(uid == NULL)
+    return FALSE;
+
+  if(mamq && mamq->known)
+    return g_hash_table_contains (mamq->known, uid);
+
+  if(room)
+    dts = chatty_history_get_chat_timestamp (chatty_manager_get_history (manager),
+                                             uid, room);
+  else
+    dts = chatty_history_get_im_timestamp (chatty_manager_get_history (manager),
+                                           uid, user);
+  if(dts < INT_MAX) {
+    g_debug ("Message id %s for acc %s is already stored on %d", uid, user, dts);
+    return TRUE;
+  }
+
+  return FALSE;
+}
 
 /**
  * cb_mam_query_result:
@@ -295,34 +653,46 @@ cb_mam_query_result(JabberStream *js, const char *from,
                     xmlnode *res, gpointer data)
 {
   xmlnode *fin = xmlnode_get_child_with_namespace(res, "fin", NS_MAMv2);
+  xmlnode *error = res ? xmlnode_get_child(res, "error") : NULL;
   PurpleAccount *pa = purple_connection_get_account(js->gc);
   MamCtx *mamc = chatty_mam_ctx_get(pa);
   MAMQuery *mamq = (MAMQuery*) data;
 
   if(type == JABBER_IQ_RESULT && fin != NULL) {
     const char *complete = xmlnode_get_attrib(fin, "complete");
+    xmlnode *set = xmlnode_get_child_with_namespace(fin, "set", NS_RSM);
+    xmlnode *last = set ? xmlnode_get_child(set, "last") : NULL;
+
+    mamq->resumed = FALSE;
+    if(last) {
+      g_free(mamq->after);
+      mamq->after = xmlnode_get_data(last);
+    }
     if(g_strcmp0(complete, "true")) {
       // not last page, need to continue
-      xmlnode *set = xmlnode_get_child_with_namespace(fin, "set", NS_RSM);
-      if(set) {
-        xmlnode *last = xmlnode_get_child(set, "last");
-        if(last) {
-          g_free(mamq->after);
-          mamq->after = xmlnode_get_data(last);
-          chatty_mam_query_archive(mamq);
-          return;
-        }
+      if(last) {
+        // Request the next page first, and save the
+        // current one while waiting for the response
+        chatty_mam_query_archive(mamq);
+        chatty_mam_save_page(pa, mamq, TRUE);
+        return;
       }
       fin = NULL; // Flag error state
     } else {
-      g_debug("This is the last of them, standing down at %ld", mamc->last_ts);
-      // Save ts but not for muc
-      if(mamc->last_ts > 0 && mamq->to == NULL)
-        purple_account_set_int(pa, "mam_last_ts", mamc->last_ts);
+      g_debug("This is the last of them, standing down at %ld", mamq->last_ts);
+      // The position is saved once the page is in history
+      chatty_mam_save_page(pa, mamq, TRUE);
     }
+  } else if(mamq->resumed && error &&
+            xmlnode_get_child(error, "item-not-found")) {
+    // The stored position is no longer in the archive, query by time
+    g_debug("Position %s expired for MAM Query %s", mamq->after, mamq->id);
+    mamq->resumed = FALSE;
+    g_clear_pointer(&mamq->after, g_free);
+    chatty_mam_query_archive(mamq);
+    return;
   } else {
       fin = NULL; // Flag error state
-      // FIXME: restart if it's just item-not-found
   }
   if(fin == NULL) {
     // Report error and give up
@@ -330,9 +700,14 @@ cb_mam_query_result(JabberStream *js, const char *from,
     char *xml = xmlnode_to_str(res, &strl);
     g_debug("Error for MAM Query: %s", xml);
     g_free(xml);
+    // What we already got is still valid
+    chatty_mam_save_page(pa, mamq, FALSE);
   }
-  // No follow up, clean up the context
+  // No follow up, clean up the context and run the next query
   g_hash_table_remove(mamc->qs, mamq->id);
+  mamc->n_running--;
+  mamc->n_done++;
+  chatty_mam_run_queries(mamc);
 }
 
 /**
@@ -443,6 +818,74 @@ chatty_mam_is_enabled(PurpleAccount *pa, const char *room)
   return TRUE;
 }
 
+/**
+ * cb_mam_known_ids:
+ *
+ * The callback for the stored message ids prefetched for
+ * the query window, which then requests the archive.
+ * If the ids can't be fetched, every result is checked
+ * against history instead.
+ */
+static void
+cb_mam_known_ids (GObject      *object,
+                  GAsyncResult *result,
+                  gpointer      user_data)
+{
+  MamLookup *lookup = user_data;
+  g_autoptr(GError) error = NULL;
+  GHashTable *known;
+  MamCtx *mamc = NULL;
+  MAMQuery *mamq = NULL;
+
+  known = chatty_history_get_uids_finish (CHATTY_HISTORY (object), result, &error);
+  if(error)
+    g_warning ("Error getting stored message ids: %s", error->message);
+
+  // The account may have gone offline meanwhile
+  if(ht_mam_ctx)
+    mamc = g_hash_table_lookup(ht_mam_ctx, lookup->user);
+  if(mamc)
+    mamq = g_hash_table_lookup(mamc->qs, lookup->qid);
+
+  if(mamq) {
+    mamq->known = known;
+    g_debug ("%u messages stored since %s for query %s",
+             known ? g_hash_table_size (known) : 0, mamq->start, mamq->id);
+    chatty_mam_query_archive(mamq);
+  } else if(known) {
+    g_hash_table_unref(known);
+  }
+
+  g_free(lookup->user);
+  g_free(lookup->qid);
+  g_free(lookup);
+}
+
+/**
+ * chatty_mam_find_query:
+ * @mamc: MamCtx of the account
+ * @room: (nullable): the MUC jid, %NULL for own archive
+ *
+ * Find the query currently syncing the archive of @room
+ */
+static MAMQuery *
+chatty_mam_find_query (MamCtx     *mamc,
+                       const char *room)
+{
+  GHashTableIter iter;
+  gpointer value;
+
+  g_hash_table_iter_init (&iter, mamc->qs);
+  while (g_hash_table_iter_next (&iter, NULL, &value)) {
+    MAMQuery *mamq = value;
+
+    if(g_strcmp0(mamq->to, room) == 0)
+      return mamq;
+  }
+
+  return NULL;
+}
+
 /**
  * cb_chatty_mam_bare_info:
  * @pc: PurpleConnection on which bare was discovered
@@ -473,40 +916,56 @@ cb_chatty_mam_bare_info(PurpleConnection *pc,
     if(!chatty_mam_is_enabled(pa, bare))
       return; // ok, if you say so
 
+    // Already syncing this archive
+    if(chatty_mam_find_query(mamc, g_strcmp0(bare, purple_account_get_username(pa)) ? bare : NULL)) {
+      g_free(qid);
+      return;
+    }
+
     mamq = g_new0(MAMQuery, 1);
     mamq->js = js;
     mamq->id = g_strdup(qid);
     if(g_strcmp0(bare, purple_account_get_username(pa))) {
-      ChattyManager *manager = chatty_manager_get_default ();
-      time_t ts;
+      PurpleChat *chat = purple_blist_find_chat(pa, bare);
 
-      ts = chatty_history_get_last_message_time (chatty_manager_get_history (manager),
-                                                 purple_account_get_username(pa), bare);
+      // Resume from the last stop point on the room
+      if(chat) {
+        mamq->last_ts = purple_blist_node_get_int(PURPLE_BLIST_NODE(chat), "mam_last_ts");
+        mamq->after = g_strdup(purple_blist_node_get_string(PURPLE_BLIST_NODE(chat),
+                                                            "mam_last_id"));
+      }
       // For MUC we're getting all messages so last history ts is ok
-      if(ts>0)
-        dt = g_date_time_new_from_unix_utc(ts);
+      if(mamq->last_ts <= 0) {
+        ChattyManager *manager = chatty_manager_get_default ();
+
+        mamq->last_ts = chatty_history_get_last_message_time (chatty_manager_get_history (manager),
+                                                              purple_account_get_username(pa), bare);
+      }
       // This becomes indication of the foreign archive, eg MUC
       mamq->to = g_strdup(bare);
-    } else
+    } else {
       // Get last stop point on the account
-      mamc->last_ts = purple_account_get_int(pa, "mam_last_ts", 0);
+      mamq->last_ts = purple_account_get_int(pa, "mam_last_ts", 0);
+      mamq->after = g_strdup(purple_account_get_string(pa, "mam_last_id", NULL));
+    }
+    mamq->resumed = mamq->after != NULL;
     g_hash_table_insert(mamc->qs, qid, mamq);
-    if(dt == NULL) {
-      if(mamc->last_ts > 0 && mamq->to == NULL) {
-        dt = g_date_time_new_from_unix_utc(mamc->last_ts);
-      } else {
-        // last week should be good enough for the start
-        GDateTime *now = g_date_time_new_now_utc();
-        dt = g_date_time_add_days(now, -7);
-        g_date_time_unref(now);
-      }
+    if(mamq->last_ts > 0) {
+      dt = g_date_time_new_from_unix_utc(mamq->last_ts);
+    } else {
+      // last week should be good enough for the start
+      GDateTime *now = g_date_time_new_now_utc();
+      dt = g_date_time_add_days(now, -7);
+      g_date_time_unref(now);
     }
     mamq->start = g_date_time_format(dt,"%FT%TZ");
+    mamq->start_ts = g_date_time_to_unix(dt);
     g_date_time_unref(dt);
-    g_debug ("Server supports MAM %s on %s; Querying by %s from %s after %s",
+    mamq->priority = chatty_mam_get_priority(pa, mamq->to, mamq->last_ts);
+    g_debug ("Server supports MAM %s on %s; Scheduling %s from %s after %s",
                                     var, bare, qid, mamq->start, mamq->after);
     // Request MAM backlog
-    chatty_mam_query_archive(mamq);
+    chatty_mam_schedule(mamc, mamq);
     // Also - request preferences and correct them if required
     chatty_mam_query_prefs(pc, mamq->to);
   }
@@ -664,8 +1123,6 @@ cb_chatty_mam_msg_received (PurpleConnection *pc,
   user = purple_account_get_username (pa);
 
   if(node_result != NULL || node_sid != NULL) {
-    ChattyManager *manager = chatty_manager_get_default ();
-    int dts;
     const char *msg_type;
     if(node_result != NULL) {
       xmlnode    *node_fwd;
@@ -711,17 +1168,10 @@ cb_chatty_mam_msg_received (PurpleConnection *pc,
     // check history and drop the dup
     msg_type = xmlnode_get_attrib(message, "type");
 
-    if(from && msg_type && g_strcmp0(msg_type, "groupchat") == 0) {
-      dts = chatty_history_get_chat_timestamp (chatty_manager_get_history (manager),
-                                               stanza_id, from);
-    } else {
-      dts = chatty_history_get_im_timestamp (chatty_manager_get_history (manager),
-                                             stanza_id, user);
-    }
-    if(dts < INT_MAX) {
-      g_debug ("Message id %s for acc %s is already stored on %d", stanza_id, user, dts);
+    if(chatty_mam_is_stored (mamq, stanza_id,
+                             from && g_strcmp0(msg_type, "groupchat") == 0 ? from : NULL,
+                             user))
       return TRUE; // note - true means stop processing
-    }
     // Swap from/to for outgoing messages
     peer = xmlnode_get_attrib (message, "from");
     if(peer) {
@@ -746,13 +1196,8 @@ cb_chatty_mam_msg_received (PurpleConnection *pc,
       xmlnode *node_oid = xmlnode_get_child_with_namespace (message, "origin-id", NS_SIDv0);
       if(node_oid) {
         const char *uuid = xmlnode_get_attrib (node_oid, "id");
-        if(uuid) {
-          dts = chatty_history_get_im_timestamp (chatty_manager_get_history (manager), uuid, user);
-          if(dts < INT_MAX) {
-            g_debug ("Message id %s for acc %s is already stored on %d", uuid, user, dts);
-            return TRUE; // note - true means stop processing
-          }
-        }
+        if(chatty_mam_is_stored (mamq, uuid, NULL, user))
+          return TRUE; // note - true means stop processing
       }
     }
   } else {
@@ -811,7 +1256,9 @@ cb_chatty_mam_msg_received (PurpleConnection *pc,
                                          chatty_utils_direction_from_flag (pcm->flags), 0);
     }
 
-    if (conv)
+    if (conv && conv->ui_data && mamq)
+      chatty_mam_add_to_page (mamq, conv->ui_data, chat_message);
+    else if (conv)
       chatty_history_add_message (chatty_manager_get_history (manager),
                                   conv->ui_data, chat_message);
     else
@@ -819,9 +1266,9 @@ cb_chatty_mam_msg_received (PurpleConnection *pc,
                   who ? who: pcm->who, pcm->what);
 
   }
-  // Update last timestamp for account's archive
-  if(mamq != NULL && mamq->to == NULL)
-    mamc->last_ts = mamc->cur_msg->p.when;
+  // Update last timestamp for the archive
+  if(mamq != NULL && mamc->cur_msg->p.when > 0)
+    mamq->last_ts = mamc->cur_msg->p.when;
 
   // Clear resubmission state
   if(peer == mamc->cur_msg->p.who)
@@ -889,7 +1336,7 @@ cb_chatty_mam_disconnect(PurpleConnection *pc, gpointer ptr)
 void
 chatty_0313_close (void)
 {
-  g_hash_table_destroy (ht_mam_ctx);
+  g_clear_pointer (&ht_mam_ctx, g_hash_table_destroy);
 }
 
 
@@ -0,0 +1,169 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* avatar-cache.c
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "chatty-avatar-cache.h"
+
+static GBytes *
+create_image (int     width,
+              int     height,
+              guint32 color)
+{
+  g_autoptr(GdkPixbuf) pixbuf = NULL;
+  g_autoptr(GError) error = NULL;
+  char *buffer;
+  gsize size;
+
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+  gdk_pixbuf_fill (pixbuf, color);
+  gdk_pixbuf_save_to_buffer (pixbuf, &buffer, &size, "png", &error, NULL);
+  g_assert_no_error (error);
+
+  return g_bytes_new_take (buffer, size);
+}
+
+static void
+load_cb (GObject      *object,
+         GAsyncResult *result,
+         gpointer      user_data)
+{
+  GdkPixbuf **pixbuf = user_data;
+  g_autoptr(GError) error = NULL;
+
+  *pixbuf = chatty_avatar_cache_load_finish (CHATTY_AVATAR_CACHE (object), result, &error);
+  g_assert_no_error (error);
+  g_assert_true (GDK_IS_PIXBUF (*pixbuf));
+}
+
+static GdkPixbuf *
+load_avatar (ChattyAvatarCache *cache,
+             GBytes            *data,
+             int                size)
+{
+  GdkPixbuf *pixbuf = NULL;
+
+  chatty_avatar_cache_load_async (cache, data, size, NULL, load_cb, &pixbuf);
+
+  while (!pixbuf)
+    g_main_context_iteration (NULL, TRUE);
+
+  return pixbuf;
+}
+
+static void
+test_avatar_cache_load (void)
+{
+  ChattyAvatarCache *cache;
+  g_autoptr(GdkPixbuf) avatar = NULL;
+  g_autoptr(GdkPixbuf) other = NULL;
+  g_autoptr(GdkPixbuf) round = NULL;
+  g_autoptr(GdkPixbuf) round2 = NULL;
+  g_autoptr(GBytes) data = NULL;
+  g_autoptr(GBytes) copy = NULL;
+  g_autofree char *path = NULL;
+  guint hits, misses, old_hits;
+
+  cache = chatty_avatar_cache_get_default ();
+  data = create_image (400, 200, 0x3584e4ff);
+  g_assert_null (chatty_avatar_cache_lookup (cache, data, 96));
+
+  /* Scaled down at load, preserving the aspect ratio */
+  avatar = load_avatar (cache, data, 96);
+  g_assert_cmpint (gdk_pixbuf_get_width (avatar), ==, 96);
+  g_assert_cmpint (gdk_pixbuf_get_height (avatar), ==, 48);
+
+  /* The same content should hit the cache, even if it's a different buffer */
+  chatty_avatar_cache_get_stats (cache, &old_hits, NULL);
+  copy = g_bytes_new (g_bytes_get_data (data, NULL), g_bytes_get_size (data));
+  other = load_avatar (cache, copy, 96);
+  g_assert_true (other == avatar);
+  chatty_avatar_cache_get_stats (cache, &hits, &misses);
+  g_assert_cmpint (hits, ==, old_hits + 1);
+  g_clear_object (&other);
+
+  /* But not with a different size */
+  other = load_avatar (cache, data, 0);
+  g_assert_true (other != avatar);
+  g_assert_cmpint (gdk_pixbuf_get_width (other), ==, 400);
+  g_clear_object (&other);
+
+  /* Files are keyed by content too */
+  path = g_build_filename (g_get_tmp_dir (), "chatty-test-avatar.png", NULL);
+  g_file_set_contents (path, g_bytes_get_data (data, NULL), g_bytes_get_size (data), NULL);
+  chatty_avatar_cache_load_file_async (cache, path, 96, NULL, load_cb, &other);
+  while (!other)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_true (other == avatar);
+  g_remove (path);
+
+  /* The circular variant is square and created only once */
+  round = chatty_avatar_cache_get_round (cache, avatar);
+  g_assert_cmpint (gdk_pixbuf_get_width (round), ==, 48);
+  g_assert_cmpint (gdk_pixbuf_get_height (round), ==, 48);
+  round2 = chatty_avatar_cache_get_round (cache, avatar);
+  g_assert_true (round == round2);
+  g_assert_null (chatty_avatar_cache_get_round (cache, NULL));
+}
+
+static void
+test_avatar_cache_budget (void)
+{
+  ChattyAvatarCache *cache;
+  g_autoptr(GBytes) first = NULL;
+  g_autoptr(GBytes) second = NULL;
+  GdkPixbuf *avatar;
+  gsize size;
+
+  cache = chatty_avatar_cache_get_default ();
+  chatty_avatar_cache_set_budget (cache, 0);
+  g_assert_cmpint (chatty_avatar_cache_get_used (cache), ==, 0);
+
+  first = create_image (64, 64, 0xff0000ff);
+  second = create_image (64, 64, 0x00ff00ff);
+
+  avatar = load_avatar (cache, first, 64);
+  size = gdk_pixbuf_get_byte_length (avatar);
+  g_object_unref (avatar);
+
+  /* Room for a single avatar */
+  chatty_avatar_cache_set_budget (cache, size);
+  avatar = load_avatar (cache, first, 64);
+  g_object_unref (avatar);
+  avatar = load_avatar (cache, second, 64);
+  g_object_unref (avatar);
+
+  g_assert_cmpint (chatty_avatar_cache_get_used (cache), ==, size);
+  avatar = chatty_avatar_cache_lookup (cache, first, 64);
+  g_assert_null (avatar);
+  avatar = chatty_avatar_cache_lookup (cache, second, 64);
+  g_assert_nonnull (avatar);
+  g_object_unref (avatar);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/avatar-cache/load", test_avatar_cache_load);
+  g_test_add_func ("/avatar-cache/budget", test_avatar_cache_budget);
+
+  return g_test_run ();
+}
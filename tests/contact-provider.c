@@ -0,0 +1,201 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* contact-provider.c
+ *
+ * Copyright 2020 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <glib.h>
+#include <libebook/libebook.h>
+
+#include "chatty-settings.h"
+#include "chatty-contact-provider-private.h"
+
+#define N_CONTACTS 10000
+#define N_THREADS  2000
+
+static EContact *
+create_contact (guint       id,
+                const char *number)
+{
+  g_autofree char *vcard = NULL;
+  g_autofree char *uid = NULL;
+
+  uid = g_strdup_printf ("contact-%u", id);
+  vcard = g_strdup_printf ("BEGIN:VCARD\n"
+                           "VERSION:3.0\n"
+                           "FN:Contact %u\n"
+                           "TEL;TYPE=CELL:%s\n"
+                           "END:VCARD", id, number);
+
+  return e_contact_new_from_vcard_with_uid (vcard, uid);
+}
+
+static void
+assert_contact (ChattyEds  *eds,
+                const char *number,
+                guint       id)
+{
+  g_autofree char *name = NULL;
+  ChattyContact *contact;
+
+  contact = chatty_eds_find_by_number (eds, number);
+  g_assert_nonnull (contact);
+
+  name = g_strdup_printf ("Contact %u", id);
+  g_assert_cmpstr (chatty_item_get_name (CHATTY_ITEM (contact)), ==, name);
+}
+
+static void
+test_contact_provider_find_by_number (void)
+{
+  g_autoptr(ChattyEds) eds = NULL;
+  g_autoptr(GTimer) timer = NULL;
+  GSList *contacts = NULL, *uids;
+  EContact *contact;
+  double elapsed;
+
+  chatty_settings_set_country_iso_code (chatty_settings_get_default (), "IN");
+  eds = chatty_eds_new (CHATTY_PROTOCOL_SMS);
+
+  /* Every fifth number is saved without the country prefix */
+  for (guint i = 0; i < N_CONTACTS; i++) {
+    g_autofree char *number = NULL;
+
+    if (i % 5 == 0)
+      number = g_strdup_printf ("98470 %05u", i);
+    else
+      number = g_strdup_printf ("+91 98470-%05u", i);
+
+    contacts = g_slist_prepend (contacts, create_contact (i, number));
+  }
+
+  /* Alphanumeric sender ids are matched as is */
+  contacts = g_slist_prepend (contacts, create_contact (N_CONTACTS, "BT-ALERT"));
+
+  timer = g_timer_new ();
+  chatty_eds_add_contacts (eds, contacts);
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_slist_free_full (contacts, g_object_unref);
+  g_test_message ("Indexed %u contacts in %.2f ms", N_CONTACTS, elapsed * 1000);
+
+  g_timer_start (timer);
+
+  for (guint i = 0; i < N_THREADS; i++) {
+    g_autofree char *number = NULL;
+    guint id;
+
+    id = g_random_int_range (0, N_CONTACTS);
+
+    if (i % 2)
+      number = g_strdup_printf ("+919847%06u", id);
+    else
+      number = g_strdup_printf ("98470%05u", id);
+
+    assert_contact (eds, number, id);
+  }
+
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_test_minimized_result (elapsed * 1000 / N_THREADS,
+                           "Matched %u SMS threads with %u contacts: %.4f ms/thread",
+                           N_THREADS, N_CONTACTS, elapsed * 1000 / N_THREADS);
+
+  assert_contact (eds, "BT-ALERT", N_CONTACTS);
+  g_assert_null (chatty_eds_find_by_number (eds, "+919847100000"));
+  g_assert_null (chatty_eds_find_by_number (eds, "+19847000001"));
+  g_assert_null (chatty_eds_find_by_number (eds, "BT-OTHER"));
+
+  /* Removed contacts should be removed from the index */
+  uids = g_slist_prepend (NULL, (gpointer)"contact-1");
+  chatty_eds_remove_contacts (eds, uids);
+  g_assert_null (chatty_eds_find_by_number (eds, "+919847000001"));
+
+  /* And modified ones should be re-indexed */
+  uids = g_slist_prepend (uids, (gpointer)"contact-2");
+  chatty_eds_remove_contacts (eds, uids);
+  g_slist_free (uids);
+
+  contact = create_contact (2, "+91 98471 00002");
+  contacts = g_slist_prepend (NULL, contact);
+  chatty_eds_add_contacts (eds, contacts);
+  g_slist_free_full (contacts, g_object_unref);
+  g_assert_null (chatty_eds_find_by_number (eds, "+919847000002"));
+  assert_contact (eds, "+919847100002", 2);
+}
+
+static void
+test_contact_provider_shared_number (void)
+{
+  g_autoptr(ChattyEds) eds = NULL;
+  GSList *contacts = NULL, *uids;
+
+  chatty_settings_set_country_iso_code (chatty_settings_get_default (), "IN");
+  eds = chatty_eds_new (CHATTY_PROTOCOL_SMS);
+
+  /* Two contacts with the same number, one without the country prefix */
+  contacts = g_slist_append (contacts, create_contact (1, "+91 98470 00001"));
+  contacts = g_slist_append (contacts, create_contact (2, "98470 00001"));
+  contacts = g_slist_append (contacts, create_contact (3, "98470 00001"));
+  chatty_eds_add_contacts (eds, contacts);
+  g_slist_free_full (contacts, g_object_unref);
+
+  assert_contact (eds, "+919847000001", 1);
+
+  /* Removing one should still find the other */
+  uids = g_slist_prepend (NULL, (gpointer)"contact-1");
+  chatty_eds_remove_contacts (eds, uids);
+  g_slist_free (uids);
+  assert_contact (eds, "+919847000001", 2);
+  assert_contact (eds, "9847000001", 2);
+
+  uids = g_slist_prepend (NULL, (gpointer)"contact-2");
+  chatty_eds_remove_contacts (eds, uids);
+  g_slist_free (uids);
+  assert_contact (eds, "+919847000001", 3);
+
+  uids = g_slist_prepend (NULL, (gpointer)"contact-3");
+  chatty_eds_remove_contacts (eds, uids);
+  g_slist_free (uids);
+  g_assert_null (chatty_eds_find_by_number (eds, "+919847000001"));
+}
+
+static void
+test_contact_provider_call_only (void)
+{
+  g_autoptr(ChattyEds) eds = NULL;
+  GSList *contacts;
+
+  chatty_settings_set_country_iso_code (chatty_settings_get_default (), "IN");
+  eds = chatty_eds_new (CHATTY_PROTOCOL_CALL);
+
+  /* Contacts loaded for calls aren't matched, as before */
+  contacts = g_slist_prepend (NULL, create_contact (1, "+91 98470 00001"));
+  chatty_eds_add_contacts (eds, contacts);
+  g_slist_free_full (contacts, g_object_unref);
+  g_assert_null (chatty_eds_find_by_number (eds, "+919847000001"));
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_setenv ("GSETTINGS_BACKEND", "memory", TRUE);
+
+  g_test_add_func ("/contact-provider/find-by-number", test_contact_provider_find_by_number);
+  g_test_add_func ("/contact-provider/shared-number", test_contact_provider_shared_number);
+  g_test_add_func ("/contact-provider/call-only", test_contact_provider_call_only);
+
+  return g_test_run ();
+}
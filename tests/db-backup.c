@@ -0,0 +1,383 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* db-backup.c
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <string.h>
+#include <glib/gstdio.h>
+#include <sqlite3.h>
+
+#include "chatty-db-backup.h"
+
+static void
+db_exec (sqlite3    *db,
+         const char *sql)
+{
+  int status;
+
+  status = sqlite3_exec (db, sql, NULL, NULL, NULL);
+  g_assert_cmpint (status, ==, SQLITE_OK);
+}
+
+static int
+db_count_rows (const char *db_path)
+{
+  sqlite3_stmt *stmt;
+  sqlite3 *db;
+  int count;
+
+  g_assert_cmpint (sqlite3_open (db_path, &db), ==, SQLITE_OK);
+  g_assert_cmpint (sqlite3_prepare_v2 (db, "SELECT COUNT(*) FROM messages;",
+                                       -1, &stmt, NULL), ==, SQLITE_OK);
+  g_assert_cmpint (sqlite3_step (stmt), ==, SQLITE_ROW);
+  count = sqlite3_column_int (stmt, 0);
+  sqlite3_finalize (stmt);
+  sqlite3_close (db);
+
+  return count;
+}
+
+/* Create a database with enough rows to have many pages */
+static sqlite3 *
+db_new (const char *db_path)
+{
+  sqlite3 *db;
+
+  g_remove (db_path);
+  g_assert_cmpint (sqlite3_open (db_path, &db), ==, SQLITE_OK);
+  db_exec (db,
+           "CREATE TABLE messages (id INTEGER PRIMARY KEY, body TEXT);"
+           "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 500) "
+           "INSERT INTO messages(body) SELECT printf('%.500c', 'x') FROM n;");
+
+  return db;
+}
+
+static void
+remove_dir (const char *dir_path)
+{
+  g_autoptr(GDir) dir = NULL;
+  const char *name;
+
+  dir = g_dir_open (dir_path, 0, NULL);
+  g_assert_nonnull (dir);
+
+  while ((name = g_dir_read_name (dir))) {
+    g_autofree char *path = g_build_filename (dir_path, name, NULL);
+
+    g_remove (path);
+  }
+
+  g_rmdir (dir_path);
+}
+
+static void
+test_db_backup_step (void)
+{
+  g_autoptr(ChattyDbBackup) backup = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *dir = NULL;
+  g_autofree char *db_path = NULL;
+  g_autofree char *part_path = NULL;
+  double progress = 0.0;
+  sqlite3 *db;
+  guint n_steps = 0;
+
+  dir = g_dir_make_tmp ("chatty-backup-XXXXXX", &error);
+  g_assert_no_error (error);
+  db_path = g_build_filename (dir, "test.db", NULL);
+  db = db_new (db_path);
+
+  backup = chatty_db_backup_new (db, 0, FALSE, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (backup);
+  g_assert_true (g_str_has_prefix (chatty_db_backup_get_path (backup), db_path));
+  g_assert_false (chatty_db_backup_is_done (backup));
+  g_assert_cmpfloat (chatty_db_backup_get_progress (backup), ==, 0.0);
+
+  while (!chatty_db_backup_is_done (backup)) {
+    g_assert_true (chatty_db_backup_step (backup, 1, &error));
+    g_assert_no_error (error);
+    n_steps++;
+
+    g_assert_cmpfloat (chatty_db_backup_get_progress (backup), >=, progress);
+    progress = chatty_db_backup_get_progress (backup);
+
+    /* Changes done in between should be in the backup */
+    if (n_steps == 2)
+      db_exec (db, "DELETE FROM messages WHERE id > 400;");
+  }
+
+  g_assert_cmpint (n_steps, >, 2);
+  g_assert_cmpfloat (chatty_db_backup_get_progress (backup), ==, 1.0);
+  g_assert_true (g_file_test (chatty_db_backup_get_path (backup), G_FILE_TEST_IS_REGULAR));
+  part_path = g_strconcat (chatty_db_backup_get_path (backup), ".part", NULL);
+  g_assert_false (g_file_test (part_path, G_FILE_TEST_EXISTS));
+  g_assert_cmpint (db_count_rows (chatty_db_backup_get_path (backup)), ==, 400);
+
+  sqlite3_close (db);
+  remove_dir (dir);
+}
+
+static void
+test_db_backup_rotate (void)
+{
+  g_autoptr(ChattyDbBackup) backup = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *dir = NULL;
+  g_autofree char *db_path = NULL;
+  const char *old_files[] = {"test.db.100", "test.db.200", "test.db.300.zst"};
+  const char *other_files[] = {"test.db.abc", "other.db.50", "test.db.part"};
+  sqlite3 *db;
+
+  dir = g_dir_make_tmp ("chatty-backup-XXXXXX", &error);
+  g_assert_no_error (error);
+  db_path = g_build_filename (dir, "test.db", NULL);
+  db = db_new (db_path);
+
+  for (guint i = 0; i < G_N_ELEMENTS (old_files); i++) {
+    g_autofree char *path = g_build_filename (dir, old_files[i], NULL);
+
+    g_file_set_contents (path, "", 0, &error);
+    g_assert_no_error (error);
+  }
+
+  for (guint i = 0; i < G_N_ELEMENTS (other_files); i++) {
+    g_autofree char *path = g_build_filename (dir, other_files[i], NULL);
+
+    g_file_set_contents (path, "", 0, &error);
+    g_assert_no_error (error);
+  }
+
+  backup = chatty_db_backup_new (db, 2, FALSE, &error);
+  g_assert_no_error (error);
+  g_assert_true (chatty_db_backup_step (backup, -1, &error));
+  g_assert_no_error (error);
+  g_assert_true (chatty_db_backup_is_done (backup));
+
+  /* Only the new backup and the newest old one should be kept */
+  g_assert_true (g_file_test (chatty_db_backup_get_path (backup), G_FILE_TEST_EXISTS));
+
+  for (guint i = 0; i < G_N_ELEMENTS (old_files); i++) {
+    g_autofree char *path = g_build_filename (dir, old_files[i], NULL);
+
+    g_assert_cmpint (g_file_test (path, G_FILE_TEST_EXISTS), ==, i == 2);
+  }
+
+  for (guint i = 0; i < G_N_ELEMENTS (other_files); i++) {
+    g_autofree char *path = g_build_filename (dir, other_files[i], NULL);
+
+    g_assert_true (g_file_test (path, G_FILE_TEST_EXISTS));
+  }
+
+  sqlite3_close (db);
+  remove_dir (dir);
+}
+
+static void
+test_db_backup_restore_compress (gboolean compress)
+{
+  g_autoptr(ChattyDbBackup) backup = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *dir = NULL;
+  g_autofree char *db_path = NULL;
+  g_autofree char *bad_path = NULL;
+  sqlite3 *db;
+
+  dir = g_dir_make_tmp ("chatty-backup-XXXXXX", &error);
+  g_assert_no_error (error);
+  db_path = g_build_filename (dir, "test.db", NULL);
+  db = db_new (db_path);
+
+  backup = chatty_db_backup_new (db, 0, compress, &error);
+  g_assert_no_error (error);
+
+  while (!chatty_db_backup_is_done (backup)) {
+    g_assert_true (chatty_db_backup_step (backup, CHATTY_DB_BACKUP_STEP_PAGES, &error));
+    g_assert_no_error (error);
+  }
+
+#ifdef HAVE_ZSTD
+  g_assert_cmpint (g_str_has_suffix (chatty_db_backup_get_path (backup), ".zst"), ==, compress);
+#else
+  g_assert_false (g_str_has_suffix (chatty_db_backup_get_path (backup), ".zst"));
+#endif
+
+  db_exec (db, "DELETE FROM messages;");
+  sqlite3_close (db);
+  g_assert_cmpint (db_count_rows (db_path), ==, 0);
+
+  g_assert_true (chatty_db_backup_restore (chatty_db_backup_get_path (backup), db_path, &error));
+  g_assert_no_error (error);
+  g_assert_cmpint (db_count_rows (db_path), ==, 500);
+
+  /* Invalid backups should not replace the database */
+  bad_path = g_build_filename (dir, compress ? "test.db.1.zst" : "test.db.1", NULL);
+  g_file_set_contents (bad_path, "not a database", -1, &error);
+  g_assert_no_error (error);
+  g_assert_false (chatty_db_backup_restore (bad_path, db_path, &error));
+  g_assert_nonnull (error);
+  g_clear_error (&error);
+
+  g_file_set_contents (bad_path, "", 0, &error);
+  g_assert_no_error (error);
+  g_assert_false (chatty_db_backup_restore (bad_path, db_path, &error));
+  g_assert_nonnull (error);
+  g_clear_error (&error);
+
+  g_assert_cmpint (db_count_rows (db_path), ==, 500);
+
+  remove_dir (dir);
+}
+
+static void
+test_db_backup_restore (void)
+{
+  test_db_backup_restore_compress (FALSE);
+}
+
+static void
+test_db_backup_compress (void)
+{
+  test_db_backup_restore_compress (TRUE);
+}
+
+static void
+test_db_backup_compress_step (void)
+{
+#ifdef HAVE_ZSTD
+  g_autoptr(ChattyDbBackup) backup = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *dir = NULL;
+  g_autofree char *db_path = NULL;
+  g_autofree char *part_path = NULL;
+  const char *path;
+  double progress = 0.0;
+  sqlite3 *db;
+  guint n_compress_steps = 0;
+
+  dir = g_dir_make_tmp ("chatty-backup-XXXXXX", &error);
+  g_assert_no_error (error);
+  db_path = g_build_filename (dir, "test.db", NULL);
+  db = db_new (db_path);
+
+  backup = chatty_db_backup_new (db, 0, TRUE, &error);
+  g_assert_no_error (error);
+  path = chatty_db_backup_get_path (backup);
+  part_path = g_strdup_printf ("%.*s.part", (int)(strlen (path) - strlen (".zst")), path);
+
+  while (!chatty_db_backup_is_done (backup)) {
+    g_assert_true (chatty_db_backup_step (backup, 1, &error));
+    g_assert_no_error (error);
+
+    g_assert_cmpfloat (chatty_db_backup_get_progress (backup), >=, progress);
+    progress = chatty_db_backup_get_progress (backup);
+
+    /* The copy is complete, and is being compressed */
+    if (progress > 0.5 && progress < 1.0) {
+      g_assert_true (g_file_test (part_path, G_FILE_TEST_EXISTS));
+      n_compress_steps++;
+    }
+  }
+
+  /* The database is bigger than what is compressed in a step */
+  g_assert_cmpint (n_compress_steps, >, 0);
+  g_assert_cmpfloat (chatty_db_backup_get_progress (backup), ==, 1.0);
+  g_assert_false (g_file_test (part_path, G_FILE_TEST_EXISTS));
+  sqlite3_close (db);
+
+  g_assert_true (chatty_db_backup_restore (chatty_db_backup_get_path (backup), db_path, &error));
+  g_assert_no_error (error);
+  g_assert_cmpint (db_count_rows (db_path), ==, 500);
+
+  remove_dir (dir);
+#else
+  g_test_skip ("Not compiled with zstd");
+#endif
+}
+
+static void
+test_db_backup_last_time (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree char *dir = NULL;
+  g_autofree char *db_path = NULL;
+  g_autofree char *path = NULL;
+  gint64 now;
+
+  dir = g_dir_make_tmp ("chatty-backup-XXXXXX", &error);
+  g_assert_no_error (error);
+  db_path = g_build_filename (dir, "test.db", NULL);
+  g_assert_cmpint (chatty_db_backup_get_last_time (db_path), ==, 0);
+
+  /* Only backups of the database count */
+  now = g_get_real_time () / G_USEC_PER_SEC;
+  path = g_build_filename (dir, "other.db.1617190000", NULL);
+  g_file_set_contents (path, "", 0, &error);
+  g_assert_no_error (error);
+  g_clear_pointer (&path, g_free);
+  path = g_build_filename (dir, "test.db.1617190000.part", NULL);
+  g_file_set_contents (path, "", 0, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (chatty_db_backup_get_last_time (db_path), ==, 0);
+  g_clear_pointer (&path, g_free);
+
+  path = g_build_filename (dir, "test.db.1617190000.zst", NULL);
+  g_file_set_contents (path, "", 0, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (chatty_db_backup_get_last_time (db_path), >=, now);
+
+  remove_dir (dir);
+}
+
+static void
+test_db_backup_db_name (void)
+{
+  g_autofree char *name = NULL;
+
+  name = chatty_db_backup_get_db_name ("/home/user/.purple/chatty/db/chatty-history.db.1617190000");
+  g_assert_cmpstr (name, ==, "chatty-history.db");
+  g_clear_pointer (&name, g_free);
+
+  name = chatty_db_backup_get_db_name ("matrix.db.1617190000.zst");
+  g_assert_cmpstr (name, ==, "matrix.db");
+  g_clear_pointer (&name, g_free);
+
+  g_assert_null (chatty_db_backup_get_db_name ("matrix.db"));
+  g_assert_null (chatty_db_backup_get_db_name ("matrix.db.zst"));
+  g_assert_null (chatty_db_backup_get_db_name ("matrix.db.123.part"));
+  g_assert_null (chatty_db_backup_get_db_name ("/tmp/.123"));
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/db-backup/step", test_db_backup_step);
+  g_test_add_func ("/db-backup/rotate", test_db_backup_rotate);
+  g_test_add_func ("/db-backup/restore", test_db_backup_restore);
+  g_test_add_func ("/db-backup/compress", test_db_backup_compress);
+  g_test_add_func ("/db-backup/compress_step", test_db_backup_compress_step);
+  g_test_add_func ("/db-backup/db_name", test_db_backup_db_name);
+  g_test_add_func ("/db-backup/last_time", test_db_backup_last_time);
+
+  return g_test_run ();
+}
@@ -0,0 +1,414 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* eviction-manager.c
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+#include <string.h>
+
+#include "purple-init.h"
+#include "matrix/chatty-ma-account.h"
+#include "matrix/chatty-ma-chat.h"
+#include "chatty-pp-chat.h"
+#include "chatty-history.h"
+#include "chatty-eviction-manager.h"
+
+#define TEST_TYPE_CHAT (test_chat_get_type ())
+G_DECLARE_FINAL_TYPE (TestChat, test_chat, TEST, CHAT, ChattyChat)
+
+struct _TestChat
+{
+  ChattyChat  parent_instance;
+
+  GListStore *messages;
+  char       *name;
+};
+
+G_DEFINE_TYPE (TestChat, test_chat, CHATTY_TYPE_CHAT)
+
+static const char *
+test_chat_get_chat_name (ChattyChat *chat)
+{
+  return TEST_CHAT (chat)->name;
+}
+
+static GListModel *
+test_chat_get_messages (ChattyChat *chat)
+{
+  return G_LIST_MODEL (TEST_CHAT (chat)->messages);
+}
+
+static guint
+test_chat_trim_messages (ChattyChat *chat,
+                         guint       n_keep)
+{
+  TestChat *self = TEST_CHAT (chat);
+  guint n_items;
+
+  n_items = g_list_model_get_n_items (G_LIST_MODEL (self->messages));
+
+  if (n_items <= n_keep)
+    return 0;
+
+  g_list_store_splice (self->messages, 0, n_items - n_keep, NULL, 0);
+
+  return n_items - n_keep;
+}
+
+static void
+test_chat_finalize (GObject *object)
+{
+  TestChat *self = TEST_CHAT (object);
+
+  g_object_unref (self->messages);
+  g_free (self->name);
+
+  G_OBJECT_CLASS (test_chat_parent_class)->finalize (object);
+}
+
+static void
+test_chat_class_init (TestChatClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  ChattyChatClass *chat_class = CHATTY_CHAT_CLASS (klass);
+
+  object_class->finalize = test_chat_finalize;
+
+  chat_class->get_chat_name = test_chat_get_chat_name;
+  chat_class->get_messages = test_chat_get_messages;
+  chat_class->trim_messages = test_chat_trim_messages;
+}
+
+static void
+test_chat_init (TestChat *self)
+{
+  self->messages = g_list_store_new (CHATTY_TYPE_MESSAGE);
+}
+
+static TestChat *
+test_chat_new (const char *name,
+               guint       n_messages)
+{
+  TestChat *self;
+
+  self = g_object_new (TEST_TYPE_CHAT, NULL);
+  self->name = g_strdup (name);
+
+  for (guint i = 0; i < n_messages; i++) {
+    g_autoptr(ChattyMessage) message = NULL;
+    g_autofree char *text = NULL;
+
+    text = g_strdup_printf ("Message %u of %s", i, name);
+    message = chatty_message_new (NULL, text, NULL, 0, CHATTY_MESSAGE_TEXT,
+                                  CHATTY_DIRECTION_IN, CHATTY_STATUS_RECIEVED);
+    g_list_store_append (self->messages, message);
+  }
+
+  return self;
+}
+
+static guint
+chat_get_n_messages (gpointer chat)
+{
+  return g_list_model_get_n_items (chatty_chat_get_messages (chat));
+}
+
+static GListStore *
+chat_list_new (void)
+{
+  GListStore *chat_list;
+
+  chat_list = g_list_store_new (CHATTY_TYPE_CHAT);
+
+  for (guint i = 0; i < 4; i++) {
+    g_autoptr(TestChat) chat = NULL;
+    g_autofree char *name = NULL;
+
+    name = g_strdup_printf ("chat-%u", i);
+    chat = test_chat_new (name, 100);
+    g_list_store_append (chat_list, chat);
+  }
+
+  return chat_list;
+}
+
+static void
+test_eviction_manager_trim (void)
+{
+  g_autoptr(ChattyEvictionManager) eviction = NULL;
+  g_autoptr(GListStore) chat_list = NULL;
+  g_autoptr(ChattyChat) active = NULL;
+  g_autofree char *info = NULL;
+  gsize size;
+
+  chat_list = chat_list_new ();
+  eviction = chatty_eviction_manager_new (G_LIST_MODEL (chat_list));
+  active = g_list_model_get_item (G_LIST_MODEL (chat_list), 1);
+  chatty_eviction_manager_set_active_chat (eviction, active);
+
+  size = chatty_eviction_manager_get_memory_size (eviction);
+  g_assert_cmpint (size, >, 400 * sizeof (ChattyMessage *));
+
+  /* The active chat should never be trimmed */
+  g_assert_cmpint (chatty_eviction_manager_trim (eviction, 10), ==, 3 * 90);
+  g_assert_cmpint (chatty_eviction_manager_get_memory_size (eviction), <, size);
+
+  for (guint i = 0; i < 4; i++) {
+    g_autoptr(ChattyChat) chat = g_list_model_get_item (G_LIST_MODEL (chat_list), i);
+
+    g_assert_cmpint (chat_get_n_messages (chat), ==, chat == active ? 100 : 10);
+  }
+
+  g_assert_cmpint (chatty_eviction_manager_trim (eviction, 10), ==, 0);
+
+  info = chatty_eviction_manager_get_debug_info (eviction);
+  g_assert_nonnull (strstr (info, "chat-1 (active): 100 messages"));
+  g_assert_nonnull (strstr (info, "chat-3: 10 messages"));
+}
+
+static void
+test_eviction_manager_budget (void)
+{
+  g_autoptr(ChattyEvictionManager) eviction = NULL;
+  g_autoptr(GListStore) chat_list = NULL;
+  g_autoptr(TestChat) big_chat = NULL;
+  g_autoptr(ChattyChat) first = NULL;
+  g_autoptr(ChattyChat) last = NULL;
+
+  chat_list = chat_list_new ();
+  eviction = chatty_eviction_manager_new (G_LIST_MODEL (chat_list));
+  chatty_eviction_manager_set_inactive_messages (eviction, 20);
+  chatty_eviction_manager_set_memory_budget (eviction, 1);
+
+  /* Within the budget */
+  g_assert_cmpint (chatty_eviction_manager_check_budget (eviction), ==, 0);
+
+  /* Go over the budget with a single chat at the end */
+  big_chat = test_chat_new ("big-chat", 20000);
+  g_list_store_append (chat_list, big_chat);
+  g_assert_cmpint (chatty_eviction_manager_get_memory_size (eviction), >, 1024 * 1024);
+
+  g_assert_cmpint (chatty_eviction_manager_check_budget (eviction), ==, 20000 - 20);
+  g_assert_cmpint (chatty_eviction_manager_get_memory_size (eviction), <=, 1024 * 1024);
+  g_assert_cmpint (chat_get_n_messages (big_chat), ==, 20);
+
+  first = g_list_model_get_item (G_LIST_MODEL (chat_list), 0);
+  last = g_list_model_get_item (G_LIST_MODEL (chat_list), 3);
+  g_assert_cmpint (chat_get_n_messages (first), ==, 100);
+  g_assert_cmpint (chat_get_n_messages (last), ==, 100);
+}
+
+#if GLIB_CHECK_VERSION (2, 64, 0)
+static void
+test_eviction_manager_low_memory (void)
+{
+  g_autoptr(ChattyEvictionManager) eviction = NULL;
+  g_autoptr(GMemoryMonitor) monitor = NULL;
+  g_autoptr(GListStore) chat_list = NULL;
+  g_autoptr(ChattyChat) chat = NULL;
+
+  chat_list = chat_list_new ();
+  eviction = chatty_eviction_manager_new (G_LIST_MODEL (chat_list));
+  chatty_eviction_manager_set_inactive_messages (eviction, 40);
+  chat = g_list_model_get_item (G_LIST_MODEL (chat_list), 0);
+
+  monitor = g_memory_monitor_dup_default ();
+
+  g_signal_emit_by_name (monitor, "low-memory-warning", G_MEMORY_MONITOR_WARNING_LEVEL_LOW);
+  g_assert_cmpint (chat_get_n_messages (chat), ==, 40);
+
+  g_signal_emit_by_name (monitor, "low-memory-warning", G_MEMORY_MONITOR_WARNING_LEVEL_CRITICAL);
+  g_assert_cmpint (chat_get_n_messages (chat), ==, 10);
+}
+#endif
+
+static ChattyHistory *
+history_new (void)
+{
+  ChattyHistory *history;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-eviction.db", NULL));
+
+  history = chatty_history_new ();
+  chatty_history_open (history, g_test_get_dir (G_TEST_BUILT), "test-eviction.db");
+  g_assert_true (chatty_history_is_open (history));
+
+  return history;
+}
+
+static ChattyMessage *
+history_message_new (ChattyHistory *history,
+                     ChattyChat    *chat,
+                     guint          i)
+{
+  g_autoptr(ChattyContact) contact = NULL;
+  g_autofree char *uid = NULL;
+  g_autofree char *text = NULL;
+  ChattyMessage *message;
+
+  contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
+  chatty_contact_set_name (contact, chatty_chat_get_chat_name (chat));
+  chatty_contact_set_value (contact, chatty_chat_get_chat_name (chat));
+
+  uid = g_strdup_printf ("uid-%u", i);
+  text = g_strdup_printf ("Message %u", i);
+  message = chatty_message_new (CHATTY_ITEM (contact), text, uid, 1000 + i,
+                                CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_IN,
+                                CHATTY_STATUS_RECIEVED);
+  g_assert_true (chatty_history_add_message (history, chat, message));
+
+  return message;
+}
+
+/* Check that @chat has the messages from @first to the last one, in order */
+static void
+chat_assert_messages (ChattyChat *chat,
+                      guint       first,
+                      guint       last)
+{
+  GListModel *model;
+
+  model = chatty_chat_get_messages (chat);
+  g_assert_cmpint (g_list_model_get_n_items (model), ==, last - first + 1);
+
+  for (guint i = first; i <= last; i++) {
+    g_autoptr(ChattyMessage) message = NULL;
+    g_autofree char *text = NULL;
+
+    message = g_list_model_get_item (model, i - first);
+    text = g_strdup_printf ("Message %u", i);
+    g_assert_cmpstr (chatty_message_get_text (message), ==, text);
+  }
+}
+
+static void
+chat_load_past_messages (ChattyChat *chat,
+                         int         count)
+{
+  chatty_chat_load_past_messages (chat, count);
+
+  while (chatty_chat_is_loading_history (chat))
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+test_eviction_manager_pp_chat (void)
+{
+  g_autoptr(ChattyHistory) history = NULL;
+  g_autoptr(ChattyPpChat) chat = NULL;
+  PurpleAccount *pp_account;
+  PurpleBuddy *pp_buddy;
+
+  history = history_new ();
+  pp_account = purple_account_new ("alice@example.com", "prpl-jabber");
+  pp_buddy = purple_buddy_new (pp_account, "bob@example.com", NULL);
+  chat = chatty_pp_chat_new_im_chat (pp_account, pp_buddy, FALSE);
+  chatty_chat_set_data (CHATTY_CHAT (chat), NULL, history);
+
+  for (guint i = 0; i < 100; i++) {
+    g_autoptr(ChattyMessage) message = NULL;
+
+    message = history_message_new (history, CHATTY_CHAT (chat), i);
+    chatty_pp_chat_append_message (chat, message);
+  }
+
+  /* Chats not auto joined can't load the messages back */
+  g_assert_cmpint (chatty_chat_trim_messages (CHATTY_CHAT (chat), 10), ==, 0);
+  purple_blist_node_set_bool ((PurpleBlistNode *)pp_buddy, "chatty-autojoin", TRUE);
+
+  g_assert_cmpint (chatty_chat_trim_messages (CHATTY_CHAT (chat), 10), ==, 90);
+  chat_assert_messages (CHATTY_CHAT (chat), 90, 99);
+
+  /* The trimmed messages should be loaded back in order */
+  chat_load_past_messages (CHATTY_CHAT (chat), 30);
+  chat_assert_messages (CHATTY_CHAT (chat), 60, 99);
+  chat_load_past_messages (CHATTY_CHAT (chat), 100);
+  chat_assert_messages (CHATTY_CHAT (chat), 0, 99);
+
+  chatty_history_close (history);
+  g_clear_object (&chat);
+  purple_buddy_destroy (pp_buddy);
+  purple_account_destroy (pp_account);
+}
+
+static void
+test_eviction_manager_ma_chat (void)
+{
+  g_autoptr(ChattyHistory) history = NULL;
+  g_autoptr(ChattyMaAccount) account = NULL;
+  g_autoptr(ChattyMaChat) chat = NULL;
+  g_autoptr(GPtrArray) even = NULL;
+  g_autoptr(GPtrArray) odd = NULL;
+
+  history = history_new ();
+  account = chatty_ma_account_new ("@alice:example.com", NULL);
+  chat = chatty_ma_chat_new ("!room:example.com", "Room", NULL);
+  chatty_ma_account_add_chat (account, CHATTY_CHAT (chat));
+  chatty_ma_chat_set_history_db (chat, history);
+
+  even = g_ptr_array_new_with_free_func (g_object_unref);
+  odd = g_ptr_array_new_with_free_func (g_object_unref);
+
+  for (guint i = 0; i < 100; i++)
+    g_ptr_array_add (i % 2 ? odd : even,
+                     history_message_new (history, CHATTY_CHAT (chat), i));
+
+  /*
+   * Messages are shown sorted by time, but the oldest ones
+   * are in two separate ranges of the underlying store.
+   */
+  chatty_ma_chat_add_messages (chat, even);
+  chatty_ma_chat_add_messages (chat, odd);
+  chat_assert_messages (CHATTY_CHAT (chat), 0, 99);
+
+  g_assert_cmpint (chatty_chat_trim_messages (CHATTY_CHAT (chat), 10), ==, 90);
+  chat_assert_messages (CHATTY_CHAT (chat), 90, 99);
+  g_assert_cmpint (chatty_chat_trim_messages (CHATTY_CHAT (chat), 10), ==, 0);
+
+  /* The trimmed messages should be loaded back in order */
+  chat_load_past_messages (CHATTY_CHAT (chat), 30);
+  chat_assert_messages (CHATTY_CHAT (chat), 60, 99);
+  chat_load_past_messages (CHATTY_CHAT (chat), 100);
+  chat_assert_messages (CHATTY_CHAT (chat), 0, 99);
+
+  chatty_history_close (history);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  int ret;
+
+  g_test_init (&argc, &argv, NULL);
+  g_setenv ("GSETTINGS_BACKEND", "memory", TRUE);
+
+  test_purple_init ();
+
+  g_test_add_func ("/eviction-manager/trim", test_eviction_manager_trim);
+  g_test_add_func ("/eviction-manager/budget", test_eviction_manager_budget);
+#if GLIB_CHECK_VERSION (2, 64, 0)
+  g_test_add_func ("/eviction-manager/low-memory", test_eviction_manager_low_memory);
+#endif
+  g_test_add_func ("/eviction-manager/pp-chat", test_eviction_manager_pp_chat);
+  g_test_add_func ("/eviction-manager/ma-chat", test_eviction_manager_ma_chat);
+
+  ret = g_test_run ();
+
+  purple_core_quit ();
+
+  return ret;
+}
@@ -0,0 +1,244 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* filter-list-model.c
+ *
+ * Copyright 2020 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <glib.h>
+#include <string.h>
+
+#include "contrib/gtk.h"
+#include "users/chatty-contact.h"
+#include "chatty-utils.h"
+
+#define N_CONTACTS 5000
+
+typedef struct {
+  char  *needle;
+  guint  n_checked;
+} FilterData;
+
+static gboolean
+filter_item_matches (gpointer    item,
+                     FilterData *data)
+{
+  data->n_checked++;
+
+  return chatty_item_matches (item, data->needle, CHATTY_PROTOCOL_ANY, TRUE);
+}
+
+static void
+filter_set_needle (GtkFilter  *filter,
+                   FilterData *data,
+                   const char *needle)
+{
+  g_autofree char *old_needle = NULL;
+  GtkFilterChange change;
+
+  old_needle = data->needle;
+  data->needle = chatty_utils_get_search_key (needle);
+
+  if (g_str_has_prefix (data->needle, old_needle))
+    change = GTK_FILTER_CHANGE_MORE_STRICT;
+  else if (g_str_has_prefix (old_needle, data->needle))
+    change = GTK_FILTER_CHANGE_LESS_STRICT;
+  else
+    change = GTK_FILTER_CHANGE_DIFFERENT;
+
+  data->n_checked = 0;
+  gtk_filter_changed (filter, change);
+}
+
+static GListStore *
+create_store (guint    n_items,
+              gboolean random)
+{
+  GListStore *store;
+
+  store = g_list_store_new (CHATTY_TYPE_CONTACT);
+
+  for (guint i = 0; i < n_items; i++) {
+    g_autoptr(ChattyContact) contact = NULL;
+    g_autofree char *name = NULL;
+
+    if (random)
+      name = g_strdup_printf ("Contact %u", g_random_int_range (0, 100000));
+    else
+      name = g_strdup_printf ("Contact %u", i);
+
+    contact = g_object_new (CHATTY_TYPE_CONTACT,
+                            "protocols", CHATTY_PROTOCOL_XMPP,
+                            NULL);
+    chatty_contact_set_name (contact, name);
+    g_list_store_append (store, contact);
+  }
+
+  return store;
+}
+
+static void
+test_item_search_key (void)
+{
+  g_autoptr(ChattyContact) contact = NULL;
+  g_autofree char *needle = NULL;
+  ChattyItem *item;
+
+  contact = g_object_new (CHATTY_TYPE_CONTACT,
+                          "protocols", CHATTY_PROTOCOL_XMPP,
+                          NULL);
+  item = CHATTY_ITEM (contact);
+  chatty_contact_set_name (contact, "Éric ALICE");
+
+  needle = chatty_utils_get_search_key ("alice");
+  g_assert_true (chatty_item_matches (item, needle, CHATTY_PROTOCOL_ANY, TRUE));
+  g_free (needle);
+
+  /* Precomposed and decomposed forms should match */
+  needle = chatty_utils_get_search_key ("E\xcc\x81ric");
+  g_assert_true (chatty_item_matches (item, needle, CHATTY_PROTOCOL_ANY, TRUE));
+  g_free (needle);
+
+  needle = chatty_utils_get_search_key ("éRIC");
+  g_assert_true (chatty_item_matches (item, needle, CHATTY_PROTOCOL_ANY, TRUE));
+  g_assert_false (chatty_item_matches (item, needle, CHATTY_PROTOCOL_SMS, TRUE));
+
+  /* The key should be updated when the name changes */
+  chatty_contact_set_name (contact, "Bob");
+  g_assert_false (chatty_item_matches (item, needle, CHATTY_PROTOCOL_ANY, TRUE));
+  g_free (needle);
+
+  needle = chatty_utils_get_search_key ("BOB");
+  g_assert_cmpstr (chatty_item_get_search_key (item), ==, needle);
+  g_assert_true (chatty_item_matches (item, needle, CHATTY_PROTOCOL_ANY, TRUE));
+
+  /* Other strings matched against a search key are folded the same way */
+  g_free (needle);
+  needle = chatty_utils_get_search_key ("E\xcc\x81ric");
+  g_assert_true (chatty_utils_search_key_contains ("@ÉRIC:example.org", needle));
+  g_assert_true (chatty_utils_search_key_contains ("@e\xcc\x81ric:example.org", needle));
+  g_assert_false (chatty_utils_search_key_contains ("@eric:example.org", needle));
+  g_assert_false (chatty_utils_search_key_contains (NULL, needle));
+}
+
+static void
+test_filter_list_model_strictness (void)
+{
+  g_autoptr(GtkFilterListModel) filter_model = NULL;
+  g_autoptr(GtkFilter) filter = NULL;
+  g_autoptr(GListStore) store = NULL;
+  FilterData data = { g_strdup (""), 0 };
+  GListModel *model;
+
+  store = create_store (100, FALSE);
+  filter = gtk_custom_filter_new ((GtkCustomFilterFunc)filter_item_matches, &data, NULL);
+  filter_model = gtk_filter_list_model_new (G_LIST_MODEL (store), filter);
+  model = G_LIST_MODEL (filter_model);
+  g_assert_cmpint (g_list_model_get_n_items (model), ==, 100);
+
+  /* “Contact 1” and “Contact 10” to “Contact 19” */
+  filter_set_needle (filter, &data, "Contact 1");
+  g_assert_cmpint (g_list_model_get_n_items (model), ==, 11);
+  g_assert_cmpint (data.n_checked, ==, 100);
+
+  /* Only the visible items should be checked again */
+  filter_set_needle (filter, &data, "contact 12");
+  g_assert_cmpint (g_list_model_get_n_items (model), ==, 1);
+  g_assert_cmpint (data.n_checked, ==, 11);
+
+  /* Only the hidden items should be checked again */
+  filter_set_needle (filter, &data, "contact 1");
+  g_assert_cmpint (g_list_model_get_n_items (model), ==, 11);
+  g_assert_cmpint (data.n_checked, ==, 99);
+
+  filter_set_needle (filter, &data, "contact 2");
+  g_assert_cmpint (g_list_model_get_n_items (model), ==, 11);
+  g_assert_cmpint (data.n_checked, ==, 100);
+
+  filter_set_needle (filter, &data, "");
+  g_assert_cmpint (g_list_model_get_n_items (model), ==, 100);
+  g_assert_cmpint (data.n_checked, ==, 89);
+
+  g_free (data.needle);
+}
+
+/*
+ * Type a needle char by char and delete it back with
+ * N_CONTACTS contacts, and compare a full refilter per
+ * keystroke with refiltering only the items that may change.
+ */
+static void
+test_filter_list_model_benchmark (void)
+{
+  g_autoptr(GtkFilterListModel) filter_model = NULL;
+  g_autoptr(GtkFilter) filter = NULL;
+  g_autoptr(GListStore) store = NULL;
+  g_autoptr(GTimer) timer = NULL;
+  FilterData data = { g_strdup (""), 0 };
+  const char *needle = "Contact 4321";
+  guint n_keys, len;
+  double elapsed;
+
+  if (!g_test_perf ())
+    return;
+
+  len = strlen (needle);
+  n_keys = len * 2;
+  store = create_store (N_CONTACTS, TRUE);
+  filter = gtk_custom_filter_new ((GtkCustomFilterFunc)filter_item_matches, &data, NULL);
+  filter_model = gtk_filter_list_model_new (G_LIST_MODEL (store), filter);
+  timer = g_timer_new ();
+
+  for (guint i = 1; i <= n_keys; i++) {
+    g_autofree char *text = NULL;
+
+    text = g_strndup (needle, i <= len ? i : n_keys - i);
+    g_free (data.needle);
+    data.needle = chatty_utils_get_search_key (text);
+    gtk_filter_changed (filter, GTK_FILTER_CHANGE_DIFFERENT);
+  }
+
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_test_message ("Full refilter: %u contacts: %.4f ms/keystroke",
+                  N_CONTACTS, elapsed * 1000 / n_keys);
+
+  g_timer_start (timer);
+
+  for (guint i = 1; i <= n_keys; i++) {
+    g_autofree char *text = NULL;
+
+    text = g_strndup (needle, i <= len ? i : n_keys - i);
+    filter_set_needle (filter, &data, text);
+  }
+
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_test_minimized_result (elapsed * 1000 / n_keys,
+                           "Incremental: %u contacts: %.4f ms/keystroke",
+                           N_CONTACTS, elapsed * 1000 / n_keys);
+  g_assert_cmpint (g_list_model_get_n_items (G_LIST_MODEL (filter_model)), ==, N_CONTACTS);
+
+  g_free (data.needle);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/item/search-key", test_item_search_key);
+  g_test_add_func ("/filter-list-model/strictness", test_filter_list_model_strictness);
+  g_test_add_func ("/filter-list-model/benchmark", test_filter_list_model_benchmark);
+
+  return g_test_run ();
+}
@@ -0,0 +1,120 @@
+BEGIN TRANSACTION;
+PRAGMA user_version = 4;
+PRAGMA foreign_keys = ON;
+CREATE TABLE mime_type (
+  id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,
+  name TEXT NOT NULL UNIQUE
+);
+CREATE TABLE files (
+  id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,
+  name TEXT,
+  url TEXT NOT NULL UNIQUE,
+  path TEXT,
+  mime_type_id INTEGER REFERENCES mime_type(id),
+  status INT,
+  size INTEGER
+);
+CREATE TABLE audio (
+  id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,
+  file_id INTEGER NOT NULL UNIQUE,
+  duration INTEGER,
+  FOREIGN KEY(file_id) REFERENCES files(id)
+);
+CREATE TABLE image (
+  id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,
+  file_id INTEGER NOT NULL UNIQUE,
+  width INTEGER,
+  height INTEGER,
+  FOREIGN KEY(file_id) REFERENCES files(id)
+);
+CREATE TABLE video (
+  id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,
+  file_id INTEGER NOT NULL UNIQUE,
+  width INTEGER,
+  height INTEGER,
+  duration INTEGER,
+  FOREIGN KEY(file_id) REFERENCES files(id)
+);
+CREATE TABLE users (
+  id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,
+  username TEXT NOT NULL,
+  alias TEXT,
+  avatar_id INTEGER REFERENCES files(id),
+  type INTEGER NOT NULL,
+  UNIQUE (username, type)
+);
+INSERT INTO users VALUES(1,'SMS',NULL,NULL,1);
+INSERT INTO users VALUES(2,'MMS',NULL,NULL,1);
+CREATE TABLE accounts (
+  id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,
+  user_id INTEGER NOT NULL REFERENCES users(id),
+  password TEXT,
+  enabled INTEGER DEFAULT 0,
+  protocol INTEGER NOT NULL,
+  UNIQUE (user_id, protocol)
+);
+INSERT INTO accounts VALUES(1,1,NULL,0,1);
+INSERT INTO accounts VALUES(2,2,NULL,0,2);
+CREATE TABLE threads (
+  id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,
+  name TEXT NOT NULL,
+  alias TEXT,
+  avatar_id INTEGER REFERENCES files(id),
+  account_id INTEGER NOT NULL REFERENCES accounts(id) ON DELETE CASCADE,
+  type INTEGER NOT NULL,
+  encrypted INTEGER DEFAULT 0,
+  UNIQUE (name, account_id, type)
+);
+CREATE TABLE thread_members (
+  id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,
+  thread_id INTEGER NOT NULL REFERENCES threads(id) ON DELETE CASCADE,
+  user_id INTEGER NOT NULL REFERENCES users(id),
+  UNIQUE (thread_id, user_id)
+);
+CREATE TABLE messages (
+  id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,
+  uid TEXT NOT NULL,
+  thread_id INTEGER NOT NULL REFERENCES threads(id) ON DELETE CASCADE,
+  sender_id INTEGER REFERENCES users(id),
+  user_alias TEXT,
+  body TEXT NOT NULL,
+  body_type INTEGER NOT NULL,
+  direction INTEGER NOT NULL,
+  time INTEGER NOT NULL,
+  status INTEGER,
+  encrypted INTEGER DEFAULT 0,
+  preview_id INTEGER REFERENCES files(id),
+  UNIQUE (uid, thread_id, body, time)
+);
+ALTER TABLE threads ADD COLUMN last_read_id INTEGER REFERENCES messages(id);
+ALTER TABLE threads ADD COLUMN visibility INT NOT NULL DEFAULT 0;
+
+CREATE INDEX messages_uid_idx ON messages(uid);
+CREATE INDEX messages_thread_time_idx ON messages(thread_id, time);
+CREATE TABLE media_refs (
+  sha256 TEXT NOT NULL PRIMARY KEY,
+  ref_count INTEGER NOT NULL DEFAULT 0
+);
+CREATE TRIGGER files_media_insert AFTER INSERT ON files
+  WHEN NEW.path GLOB 'media/??/*'
+  BEGIN
+    INSERT OR IGNORE INTO media_refs(sha256) VALUES(substr(NEW.path,10));
+    UPDATE media_refs SET ref_count=ref_count+1 WHERE sha256=substr(NEW.path,10);
+  END;
+CREATE TRIGGER files_media_update AFTER UPDATE OF path ON files
+  WHEN OLD.path IS NOT NEW.path
+  BEGIN
+    UPDATE media_refs SET ref_count=ref_count-1
+      WHERE OLD.path GLOB 'media/??/*' AND sha256=substr(OLD.path,10);
+    INSERT OR IGNORE INTO media_refs(sha256)
+      SELECT substr(NEW.path,10) WHERE NEW.path GLOB 'media/??/*';
+    UPDATE media_refs SET ref_count=ref_count+1
+      WHERE NEW.path GLOB 'media/??/*' AND sha256=substr(NEW.path,10);
+  END;
+CREATE TRIGGER files_media_delete AFTER DELETE ON files
+  WHEN OLD.path GLOB 'media/??/*'
+  BEGIN
+    UPDATE media_refs SET ref_count=ref_count-1 WHERE sha256=substr(OLD.path,10);
+  END;
+
+COMMIT;
@@ -19,6 +19,7 @@
 
 #include <glib/gstdio.h>
 #include <sqlite3.h>
+#include <utime.h>
 
 #include "matrix/chatty-ma-account.h"
 #include "matrix/chatty-ma-chat.h"
@@ -26,7 +27,8 @@
 #include "purple-init.h"
 #include "chatty-settings.h"
 #include "chatty-utils.h"
-#include "chatty-history.h"
+#include "chatty-media-store.h"
+#include "chatty-history-private.h"
 
 typedef struct Message {
   ChattyChat *chat;
@@ -103,6 +105,23 @@ finish_bool_cb (GObject      *object,
   g_task_return_boolean (task, status);
 }
 
+static void
+finish_int_cb (GObject      *object,
+               GAsyncResult *result,
+               gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+  GTask *task = user_data;
+  gssize value;
+
+  g_assert_true (G_IS_TASK (task));
+
+  value = g_task_propagate_int (G_TASK (result), &error);
+  g_assert_no_error (error);
+
+  g_task_return_int (task, value);
+}
+
 static int
 history_db_get_int (sqlite3    *db,
                     const char *statement)
@@ -683,6 +702,186 @@ test_history_chat (void)
   chatty_history_close (history);
 }
 
+/*
+ * Load the chat list of an account with N_THREADS rooms
+ * of a few messages each.  This used to take one query
+ * for every room.
+ */
+static void
+test_history_chat_list (void)
+{
+  g_autoptr(ChattyHistory) history = NULL;
+  g_autoptr(ChattyMaAccount) ma_account = NULL;
+  g_autoptr(ChattyContact) contact = NULL;
+  g_autoptr(GPtrArray) chats = NULL;
+  g_autoptr(GPtrArray) messages = NULL;
+  g_autoptr(GTimer) timer = NULL;
+  GPtrArray *chat_list;
+  GTask *task;
+  guint n_threads;
+  int when;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL));
+
+  history = chatty_history_new ();
+  chatty_history_open (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
+  g_assert_true (chatty_history_is_open (history));
+
+  ma_account = chatty_ma_account_new ("@alice:example.com", NULL);
+  contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
+  chatty_contact_set_name (contact, "@bob:example.com");
+  chatty_contact_set_value (contact, "@bob:example.com");
+
+  n_threads = g_test_perf () ? 1000 : 20;
+  chats = g_ptr_array_new_with_free_func (g_object_unref);
+  messages = g_ptr_array_new_with_free_func (g_object_unref);
+  when = time (NULL);
+
+  for (guint i = 0; i < n_threads; i++) {
+    g_autofree char *room_id = g_strdup_printf ("!room%u:example.com", i);
+    g_autofree char *name = g_strdup_printf ("Room %u", i);
+    ChattyMaChat *chat;
+
+    chat = chatty_ma_chat_new (room_id, name, NULL);
+    chatty_ma_account_add_chat (ma_account, CHATTY_CHAT (chat));
+
+    for (guint j = 0; j < 5; j++) {
+      g_autofree char *uid = g_strdup_printf ("uid-%u-%u", i, j);
+      g_autofree char *text = g_strdup_printf ("Message %u in %u", j, i);
+
+      g_ptr_array_add (chats, g_object_ref (chat));
+      g_ptr_array_add (messages,
+                       chatty_message_new (CHATTY_ITEM (contact), text, uid, when + j,
+                                           CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_IN, 0));
+    }
+
+    g_object_unref (chat);
+  }
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_add_messages_async (history, chats, messages, finish_bool_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+  g_clear_object (&task);
+
+  timer = g_timer_new ();
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_get_chats_async (history, CHATTY_ACCOUNT (ma_account),
+                                  finish_pointer_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  chat_list = g_task_propagate_pointer (task, NULL);
+  g_clear_object (&task);
+
+  if (g_test_perf ())
+    g_test_minimized_result (g_timer_elapsed (timer, NULL) * 1000,
+                             "Loaded %u chats: %.2f ms", n_threads,
+                             g_timer_elapsed (timer, NULL) * 1000);
+
+  g_assert_nonnull (chat_list);
+  g_assert_cmpint (chat_list->len, ==, n_threads);
+
+  /* Every chat has only its last message loaded */
+  for (guint i = 0; i < chat_list->len; i++) {
+    g_autoptr(ChattyMessage) message = NULL;
+    GListModel *model;
+
+    model = chatty_chat_get_messages (chat_list->pdata[i]);
+    g_assert_cmpint (g_list_model_get_n_items (model), ==, 1);
+
+    message = g_list_model_get_item (model, 0);
+    g_assert_true (g_str_has_prefix (chatty_message_get_text (message), "Message 4 in "));
+    g_assert_cmpint (chatty_message_get_time (message), ==, when + 4);
+    /* Chats never read have no unread count */
+    g_assert_cmpint (chatty_chat_get_unread_count (chat_list->pdata[i]), ==, 0);
+  }
+
+  g_ptr_array_unref (chat_list);
+
+  /* Messages received after the chat is read are unread */
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_set_chat_read_async (history, chats->pdata[0], finish_bool_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+  g_clear_object (&task);
+
+  for (guint j = 5; j < 8; j++) {
+    g_autoptr(ChattyMessage) message = NULL;
+    g_autofree char *uid = g_strdup_printf ("uid-0-%u", j);
+
+    message = chatty_message_new (CHATTY_ITEM (contact), "Unread", uid, when + j,
+                                  CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_IN, 0);
+    g_assert_true (chatty_history_add_message (history, chats->pdata[0], message));
+  }
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_get_chats_async (history, CHATTY_ACCOUNT (ma_account),
+                                  finish_pointer_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  chat_list = g_task_propagate_pointer (task, NULL);
+  g_clear_object (&task);
+  g_assert_nonnull (chat_list);
+
+  for (guint i = 0; i < chat_list->len; i++) {
+    const char *name;
+
+    name = chatty_chat_get_chat_name (chat_list->pdata[i]);
+
+    if (g_str_equal (name, "!room0:example.com"))
+      g_assert_cmpint (chatty_chat_get_unread_count (chat_list->pdata[i]), ==, 3);
+    else
+      g_assert_cmpint (chatty_chat_get_unread_count (chat_list->pdata[i]), ==, 0);
+  }
+
+  g_ptr_array_unref (chat_list);
+
+  /* Last messages of existing chats, as done for purple chats */
+  {
+    g_autoptr(GHashTable) last_messages = NULL;
+    g_autoptr(GPtrArray) existing = NULL;
+    g_autoptr(ChattyChat) unknown = NULL;
+    ChattyMessage *message;
+    GPtrArray *chat_messages;
+
+    unknown = chatty_chat_new ("@alice:example.com", "!unknown:example.com", FALSE);
+    existing = g_ptr_array_new ();
+    g_ptr_array_add (existing, chats->pdata[0]);
+    g_ptr_array_add (existing, unknown);
+
+    task = g_task_new (NULL, NULL, NULL, NULL);
+    chatty_history_get_last_messages_async (history, CHATTY_ACCOUNT (ma_account), existing,
+                                            finish_pointer_cb, task);
+
+    while (!g_task_get_completed (task))
+      g_main_context_iteration (NULL, TRUE);
+
+    last_messages = g_task_propagate_pointer (task, NULL);
+    g_clear_object (&task);
+    g_assert_nonnull (last_messages);
+    g_assert_cmpint (g_hash_table_size (last_messages), ==, 1);
+
+    chat_messages = g_hash_table_lookup (last_messages, chats->pdata[0]);
+    g_assert_nonnull (chat_messages);
+    g_assert_cmpint (chat_messages->len, ==, 1);
+    message = chat_messages->pdata[0];
+    g_assert_cmpstr (chatty_message_get_text (message), ==, "Unread");
+    g_assert_cmpint (chatty_message_get_time (message), ==, when + 7);
+  }
+
+  chatty_history_close (history);
+}
+
 static void
 test_history_message (void)
 {
@@ -737,6 +936,210 @@ test_history_message (void)
   chatty_history_close (history);
 }
 
+static void
+test_history_bulk_messages (void)
+{
+  g_autoptr(ChattyHistory) history = NULL;
+  g_autoptr(ChattyChat) chat = NULL;
+  g_autoptr(ChattyChat) room = NULL;
+  g_autoptr(GPtrArray) chats = NULL;
+  g_autoptr(GPtrArray) messages = NULL;
+  GHashTable *uids;
+  GPtrArray *msg_array;
+  GTask *task;
+  const char *account;
+  int when;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL));
+
+  history = chatty_history_new ();
+  chatty_history_open (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
+  g_assert_true (chatty_history_is_open (history));
+
+  account = "test-account@example.com";
+  chat = chatty_chat_new (account, "buddy@example.org", TRUE);
+  room = chatty_chat_new (account, "room@example.org", FALSE);
+  g_object_set (G_OBJECT (chat), "protocols", CHATTY_PROTOCOL_XMPP, NULL);
+  g_object_set (G_OBJECT (room), "protocols", CHATTY_PROTOCOL_XMPP, NULL);
+
+  chats = g_ptr_array_new_with_free_func (g_object_unref);
+  messages = g_ptr_array_new_with_free_func (g_object_unref);
+  when = time (NULL);
+
+  for (int i = 0; i < 200; i++) {
+    g_autoptr(ChattyContact) contact = NULL;
+    g_autofree char *uid = NULL;
+    g_autofree char *text = NULL;
+    ChattyChat *item;
+
+    item = i % 2 ? room : chat;
+    uid = g_strdup_printf ("uid-%d", i);
+    text = g_strdup_printf ("Message %d", i);
+    contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
+    chatty_contact_set_name (contact, "buddy@example.org");
+    chatty_contact_set_value (contact, "buddy@example.org");
+
+    g_ptr_array_add (chats, g_object_ref (item));
+    /* The first 10 messages are older than the others */
+    g_ptr_array_add (messages,
+                     chatty_message_new (CHATTY_ITEM (contact), text, uid,
+                                         i < 10 ? when - 3600 : when,
+                                         CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_IN, 0));
+  }
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_add_messages_async (history, chats, messages, finish_bool_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+  g_clear_object (&task);
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_get_messages_async (history, chat, NULL, 500, finish_pointer_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  msg_array = g_task_propagate_pointer (task, NULL);
+  g_assert_nonnull (msg_array);
+  g_assert_cmpint (msg_array->len, ==, 100);
+  g_ptr_array_unref (msg_array);
+  g_clear_object (&task);
+
+  /* All messages of the account */
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_get_uids_async (history, account, NULL, 0, finish_pointer_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  uids = g_task_propagate_pointer (task, NULL);
+  g_assert_nonnull (uids);
+  g_assert_cmpint (g_hash_table_size (uids), ==, 200);
+  g_assert_true (g_hash_table_contains (uids, "uid-0"));
+  g_assert_true (g_hash_table_contains (uids, "uid-199"));
+  g_hash_table_unref (uids);
+  g_clear_object (&task);
+
+  /* Messages in room since @when */
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_get_uids_async (history, account, "room@example.org", when,
+                                 finish_pointer_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  uids = g_task_propagate_pointer (task, NULL);
+  g_assert_nonnull (uids);
+  g_assert_cmpint (g_hash_table_size (uids), ==, 95);
+  g_assert_false (g_hash_table_contains (uids, "uid-1"));
+  g_assert_false (g_hash_table_contains (uids, "uid-10"));
+  g_assert_true (g_hash_table_contains (uids, "uid-11"));
+  g_hash_table_unref (uids);
+  g_clear_object (&task);
+
+  /* Unknown account */
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_get_uids_async (history, "unknown@example.com", NULL, 0,
+                                 finish_pointer_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  uids = g_task_propagate_pointer (task, NULL);
+  g_assert_nonnull (uids);
+  g_assert_cmpint (g_hash_table_size (uids), ==, 0);
+  g_hash_table_unref (uids);
+  g_clear_object (&task);
+
+  chatty_history_close (history);
+}
+
+static void
+test_history_last_message_times (void)
+{
+  g_autoptr(ChattyHistory) history = NULL;
+  g_autoptr(ChattyContact) contact = NULL;
+  g_autoptr(ChattyMessage) message = NULL;
+  g_autoptr(GPtrArray) chats = NULL;
+  GTask *task;
+  const char *account;
+  int when;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL));
+
+  history = chatty_history_new ();
+  chatty_history_open (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
+  g_assert_true (chatty_history_is_open (history));
+
+  account = "test-account@example.com";
+  chats = g_ptr_array_new_with_free_func (g_object_unref);
+  contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
+  chatty_contact_set_name (contact, "buddy@example.org");
+  chatty_contact_set_value (contact, "buddy@example.org");
+  when = time (NULL) - 3600;
+
+  for (int i = 0; i < 50; i++) {
+    g_autofree char *name = g_strdup_printf ("room-%d@example.org", i);
+    ChattyChat *chat;
+
+    chat = chatty_chat_new (account, name, FALSE);
+    g_object_set (G_OBJECT (chat), "protocols", CHATTY_PROTOCOL_XMPP, NULL);
+    g_ptr_array_add (chats, chat);
+
+    for (int j = 0; j <= i % 3; j++) {
+      g_clear_object (&message);
+      message = chatty_message_new (CHATTY_ITEM (contact), "Message", NULL, when + i + j,
+                                    CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_IN, 0);
+      g_assert_true (chatty_history_add_message (history, chat, message));
+    }
+  }
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_load_last_message_times_async (history, account, finish_bool_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+  g_clear_object (&task);
+
+  for (int i = 0; i < 50; i++) {
+    g_autofree char *name = g_strdup_printf ("room-%d@example.org", i);
+
+    g_assert_cmpint (chatty_history_get_last_message_time (history, account, name),
+                     ==, when + i + i % 3);
+  }
+
+  g_assert_cmpint (chatty_history_get_last_message_time (history, account, "unknown@example.org"),
+                   ==, 0);
+  g_assert_cmpint (chatty_history_get_last_message_time (history, "unknown@example.com",
+                                                         "room-0@example.org"), ==, 0);
+
+  /* New messages update the times, older ones don't */
+  g_clear_object (&message);
+  message = chatty_message_new (CHATTY_ITEM (contact), "Message", NULL, when + 100,
+                                CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_IN, 0);
+  g_assert_true (chatty_history_add_message (history, chats->pdata[1], message));
+  g_clear_object (&message);
+  message = chatty_message_new (CHATTY_ITEM (contact), "Message", NULL, when - 100,
+                                CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_IN, 0);
+  g_assert_true (chatty_history_add_message (history, chats->pdata[2], message));
+
+  g_assert_cmpint (chatty_history_get_last_message_time (history, account, "room-1@example.org"),
+                   ==, when + 100);
+  g_assert_cmpint (chatty_history_get_last_message_time (history, account, "room-2@example.org"),
+                   ==, when + 4);
+
+  chatty_history_delete_chat (history, chats->pdata[1]);
+  g_assert_cmpint (chatty_history_get_last_message_time (history, account, "room-1@example.org"),
+                   ==, 0);
+
+  chatty_history_close (history);
+}
+
 static void
 test_history_raw_message (void)
 {
@@ -1040,8 +1443,64 @@ export_sql_file (const char  *sql_path,
   g_assert_cmpint (status, ==, SQLITE_OK);
 }
 
+static gboolean
+db_has_table (const char *file_name,
+              const char *table)
+{
+  sqlite3_stmt *stmt;
+  sqlite3 *db;
+  gboolean found;
+  int status;
+
+  status = sqlite3_open (file_name, &db);
+  g_assert_cmpint (status, ==, SQLITE_OK);
+
+  sqlite3_prepare_v2 (db, "SELECT name FROM sqlite_master WHERE type='table' AND name=?;",
+                      -1, &stmt, NULL);
+  sqlite3_bind_text (stmt, 1, table, -1, SQLITE_TRANSIENT);
+  found = sqlite3_step (stmt) == SQLITE_ROW;
+  sqlite3_finalize (stmt);
+  sqlite3_close (db);
+
+  return found;
+}
+
+/*
+ * Close @history before any old row is migrated.  The close is
+ * queued right after the open, and queued tasks are run before
+ * migrating the next chunk, so this is deterministic.
+ */
 static void
-test_history_migration_db (void)
+history_open_and_close (guint       chunk_rows,
+                        const char *file_name)
+{
+  g_autoptr(ChattyHistory) history = NULL;
+  GTask *task;
+
+  history = chatty_history_new ();
+  chatty_history_set_migration_chunk_rows (history, chunk_rows);
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_open_async (history, g_strdup (g_test_get_dir (G_TEST_BUILT)),
+                             file_name, NULL, NULL);
+  chatty_history_close_async (history, finish_bool_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+  g_object_unref (task);
+}
+
+/*
+ * Migrate every database in history-db, and compare them with
+ * the expected v4 database.  @chunk_rows, if non-zero, is the
+ * number of old rows migrated at once.  If @interrupt is %TRUE,
+ * the migration is stopped and resumed a few times.
+ */
+static void
+history_migrate_dbs (guint    chunk_rows,
+                     gboolean interrupt)
 {
   g_autoptr(GDir) dir = NULL;
   g_autofree char *path = NULL;
@@ -1060,7 +1519,7 @@ test_history_migration_db (void)
     sqlite3 *db = NULL;
     int status;
 
-    if (g_str_has_suffix (name, "v3.db"))
+    if (g_str_has_suffix (name, "v4.db"))
       continue;
 
     g_assert_true (g_str_has_suffix (name, "sql"));
@@ -1078,14 +1537,55 @@ test_history_migration_db (void)
     sqlite3_close (db);
 
     /* Export migrated version sql file */
-    expected_file = g_strdelimit (g_strdup (name), "012", '3');
+    expected_file = g_strdelimit (g_strdup (name), "0123", '4');
     export_sql_file (path, expected_file, &db);
 
     /* Open history with old db, which will result in db migration */
     input_file = g_strdup (name);
     strcpy (input_file + strlen (input_file) - strlen ("sql"), "db");
+
+    if (interrupt) {
+      g_autofree char *file_name = NULL;
+
+      history_open_and_close (chunk_rows, input_file);
+
+      /* Old history is migrated in chunks after the progress is saved */
+      file_name = g_test_build_filename (G_TEST_BUILT, input_file, NULL);
+      if (strstr (name, "-v0"))
+        g_assert_true (db_has_table (file_name, "migration_progress"));
+
+      /* The newest messages are migrated first */
+      if (g_str_equal (name, "xmpp-im-v0.sql")) {
+        sqlite3 *partial_db;
+
+        status = sqlite3_open (file_name, &partial_db);
+        g_assert_cmpint (status, ==, SQLITE_OK);
+
+        if (history_db_get_int (partial_db, "SELECT COUNT(*) FROM messages;") > 0)
+          g_assert_cmpint (history_db_get_int (partial_db,
+                                               "SELECT COUNT(*) FROM messages WHERE uid=("
+                                               "SELECT uid FROM chatty_im ORDER BY id DESC LIMIT 1);"),
+                           ==, 1);
+        sqlite3_close (partial_db);
+      }
+
+      /* Close again, likely after a few chunks are migrated */
+      history = chatty_history_new ();
+      chatty_history_set_migration_chunk_rows (history, chunk_rows);
+      chatty_history_open (history, g_test_get_dir (G_TEST_BUILT), input_file);
+      chatty_history_close (history);
+      g_clear_object (&history);
+    }
+
     history = chatty_history_new ();
+    if (chunk_rows)
+      chatty_history_set_migration_chunk_rows (history, chunk_rows);
     chatty_history_open (history, g_test_get_dir (G_TEST_BUILT), input_file);
+
+    /* Messages from version 0 are migrated after the database is open */
+    while (chatty_history_get_migration_progress (history) < 1.0)
+      g_main_context_iteration (NULL, TRUE);
+
     chatty_history_close (history);
     g_free (input_file);
 
@@ -1101,19 +1601,663 @@ test_history_migration_db (void)
   }
 }
 
+static void
+test_history_migration_db (void)
+{
+  history_migrate_dbs (0, FALSE);
+}
+
+/* The test databases have a few rows, migrate them in several chunks */
+static void
+test_history_migration_chunks (void)
+{
+  history_migrate_dbs (2, FALSE);
+}
+
+static void
+test_history_migration_resume (void)
+{
+  history_migrate_dbs (1, TRUE);
+}
+
+static void
+history_maintain (ChattyHistory *history)
+{
+  GTask *task;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_maintain_async (history, finish_bool_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+  g_object_unref (task);
+}
+
+/* Average time in milliseconds to load the latest messages of @chat */
+static double
+history_get_load_time (ChattyHistory *history,
+                       ChattyChat    *chat)
+{
+  g_autoptr(GTimer) timer = NULL;
+
+  timer = g_timer_new ();
+
+  for (guint i = 0; i < 20; i++) {
+    GPtrArray *messages;
+    GTask *task;
+
+    task = g_task_new (NULL, NULL, NULL, NULL);
+    chatty_history_get_messages_async (history, chat, NULL, MESSAGE_LIMIT,
+                                       finish_pointer_cb, task);
+
+    while (!g_task_get_completed (task))
+      g_main_context_iteration (NULL, TRUE);
+
+    messages = g_task_propagate_pointer (task, NULL);
+    g_assert_nonnull (messages);
+    g_assert_cmpint (messages->len, ==, MESSAGE_LIMIT);
+    g_ptr_array_unref (messages);
+    g_object_unref (task);
+  }
+
+  return g_timer_elapsed (timer, NULL) * 1000 / 20;
+}
+
+static goffset
+history_get_file_size (const char *file_name)
+{
+  GStatBuf stat_buf;
+
+  g_assert_cmpint (g_stat (file_name, &stat_buf), ==, 0);
+
+  return stat_buf.st_size;
+}
+
+static char *
+history_create_cache_file (const char *dir_name,
+                           const char *name)
+{
+  g_autofree char *dir = NULL;
+  char *path;
+
+  dir = g_build_filename (g_get_user_cache_dir (), "chatty", dir_name, NULL);
+  g_mkdir_with_parents (dir, S_IRWXU);
+  path = g_build_filename (dir, name, NULL);
+  g_assert_true (g_file_set_contents (path, "data", -1, NULL));
+
+  return path;
+}
+
+/*
+ * Open a new test history with a message in each of @chat and
+ * @room, @message in @chat if set, and @n_rows synthetic messages
+ * alternating between them, @step seconds apart going back from
+ * now.  @db is set to a connection to the database.
+ */
+static ChattyHistory *
+history_new_with_messages (ChattyChat    *chat,
+                           ChattyChat    *room,
+                           ChattyMessage *message,
+                           guint          n_rows,
+                           guint          step,
+                           sqlite3      **db)
+{
+  ChattyHistory *history;
+  g_autoptr(GPtrArray) chats = NULL;
+  g_autoptr(GPtrArray) messages = NULL;
+  g_autofree char *sql = NULL;
+  const char *file_name;
+  GTask *task;
+  int chat_id, room_id, when, status;
+
+  file_name = g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL);
+  g_remove (file_name);
+
+  history = chatty_history_new ();
+  chatty_history_open (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
+  g_assert_true (chatty_history_is_open (history));
+
+  /* Add a message to each chat so that the threads are created */
+  chats = g_ptr_array_new_with_free_func (g_object_unref);
+  messages = g_ptr_array_new_with_free_func (g_object_unref);
+  when = time (NULL);
+
+  for (guint i = 0; i < 2; i++) {
+    g_ptr_array_add (chats, g_object_ref (i ? room : chat));
+    g_ptr_array_add (messages,
+                     chatty_message_new (NULL, "Latest message", i ? "uid-room" : "uid-chat",
+                                         when, CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_OUT, 0));
+  }
+
+  if (message) {
+    g_ptr_array_add (chats, g_object_ref (chat));
+    g_ptr_array_add (messages, g_object_ref (message));
+  }
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_add_messages_async (history, chats, messages, finish_bool_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+  g_object_unref (task);
+
+  status = sqlite3_open (file_name, db);
+  g_assert_cmpint (status, ==, SQLITE_OK);
+
+  chat_id = history_db_get_int (*db, "SELECT id FROM threads WHERE name='buddy@example.org';");
+  room_id = history_db_get_int (*db, "SELECT id FROM threads WHERE name='room@example.org';");
+
+  sql = g_strdup_printf ("INSERT INTO messages(uid,thread_id,body,body_type,direction,time) "
+                         "WITH RECURSIVE seq(x) AS "
+                         "(SELECT 1 UNION ALL SELECT x+1 FROM seq WHERE x<%u) "
+                         "SELECT 'synthetic-'||x, CASE WHEN x%%2 THEN %d ELSE %d END,"
+                         "'Synthetic message '||x, 1, 1, %d-x*%u FROM seq;",
+                         n_rows, chat_id, room_id, when, step);
+  status = sqlite3_exec (*db, sql, NULL, NULL, NULL);
+  g_assert_cmpint (status, ==, SQLITE_OK);
+
+  return history;
+}
+
+static void
+test_history_maintenance (void)
+{
+  g_autoptr(ChattyHistory) history = NULL;
+  g_autoptr(ChattyChat) chat = NULL;
+  g_autoptr(ChattyChat) room = NULL;
+  g_autofree char *orphan_file = NULL;
+  g_autofree char *old_file = NULL;
+  g_autofree char *used_file = NULL;
+  g_autofree char *sql = NULL;
+  const char *file_name;
+  goffset size_before, size_after;
+  double time_before, time_after;
+  sqlite3 *db;
+  guint n_rows;
+  int status;
+
+  chat = chatty_chat_new ("test-account@example.com", "buddy@example.org", TRUE);
+  room = chatty_chat_new ("test-account@example.com", "room@example.org", FALSE);
+  g_object_set (G_OBJECT (chat), "protocols", CHATTY_PROTOCOL_XMPP, NULL);
+  g_object_set (G_OBJECT (room), "protocols", CHATTY_PROTOCOL_XMPP, NULL);
+
+  /* Synthetic messages spread over the last year in both the chats */
+  n_rows = g_test_perf () ? 2000000 : 20000;
+  history = history_new_with_messages (chat, room, NULL, n_rows,
+                                       365 * 24 * 60 * 60 / n_rows, &db);
+  file_name = g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL);
+  g_assert_cmpint (history_db_get_int (db, "PRAGMA auto_vacuum;"), ==, 2);
+
+  /* A file used by the latest message, one by the oldest, and one not used */
+  used_file = history_create_cache_file ("maintenance-test", "used.png");
+  old_file = history_create_cache_file ("maintenance-test", "old.png");
+  orphan_file = history_create_cache_file ("maintenance-test", "orphan.png");
+  sql = g_strdup_printf ("INSERT INTO files(url,path) VALUES"
+                         "('https://example.org/used','maintenance-test/used.png'),"
+                         "('https://example.org/old','maintenance-test/old.png'),"
+                         "('https://example.org/orphan','maintenance-test/orphan.png');"
+                         "UPDATE messages SET preview_id=(SELECT id FROM files WHERE path LIKE '%%used.png') "
+                         "WHERE uid='synthetic-1';"
+                         "UPDATE messages SET preview_id=(SELECT id FROM files WHERE path LIKE '%%old.png') "
+                         "WHERE uid='synthetic-%u';", n_rows);
+  status = sqlite3_exec (db, sql, NULL, NULL, NULL);
+  g_assert_cmpint (status, ==, SQLITE_OK);
+
+  size_before = history_get_file_size (file_name);
+  time_before = history_get_load_time (history, chat);
+
+  /* Keep a month of messages in XMPP chats, but only 100 messages in room */
+  chatty_history_set_retention (history, CHATTY_PROTOCOL_XMPP, 30, 0);
+  chatty_history_set_chat_retention (history, room, 0, 100);
+  history_maintain (history);
+
+  g_assert_cmpint (history_db_get_int (db, "SELECT count(*) FROM messages WHERE thread_id IN "
+                                       "(SELECT id FROM threads WHERE name='room@example.org');"),
+                   ==, 100);
+  g_assert_cmpint (history_db_get_int (db, "SELECT count(*) FROM messages WHERE thread_id IN "
+                                       "(SELECT id FROM threads WHERE name='buddy@example.org') "
+                                       "AND time<strftime('%s','now')-30*24*60*60;"),
+                   ==, 0);
+  g_assert_cmpint (history_db_get_int (db, "SELECT count(*) FROM messages WHERE thread_id IN "
+                                       "(SELECT id FROM threads WHERE name='buddy@example.org');"),
+                   >, 100);
+
+  /* Files no longer used are removed with their cached copy */
+  g_assert_cmpint (history_db_get_int (db, "SELECT count(*) FROM files;"), ==, 1);
+  g_assert_true (g_file_test (used_file, G_FILE_TEST_IS_REGULAR));
+  g_assert_false (g_file_test (old_file, G_FILE_TEST_EXISTS));
+  g_assert_false (g_file_test (orphan_file, G_FILE_TEST_EXISTS));
+
+  /* The free pages are returned, and the tables are analyzed */
+  g_assert_cmpint (history_db_get_int (db, "PRAGMA freelist_count;"), ==, 0);
+  g_assert_cmpint (history_db_get_int (db, "SELECT count(*) FROM sqlite_stat1;"), >, 0);
+
+  size_after = history_get_file_size (file_name);
+  time_after = history_get_load_time (history, chat);
+  g_assert_cmpint (size_after, <, size_before);
+
+  g_test_message ("%u rows: %" G_GOFFSET_FORMAT " bytes, %.3f ms/load before maintenance",
+                  n_rows, size_before, time_before);
+  g_test_minimized_result (size_after, "%u rows: %" G_GOFFSET_FORMAT " bytes after maintenance",
+                           n_rows, size_after);
+  g_test_minimized_result (time_after, "%u rows: %.3f ms/load after maintenance",
+                           n_rows, time_after);
+
+  /* Nothing more to clean up */
+  history_maintain (history);
+  g_assert_cmpint (history_db_get_int (db, "SELECT count(*) FROM files;"), ==, 1);
+
+  g_remove (used_file);
+  sqlite3_close (db);
+  chatty_history_close (history);
+}
+
+/*
+ * Databases created before incremental vacuum was used are
+ * converted in maintenance, not when opened, but only if much
+ * space can be reclaimed.
+ */
+static void
+test_history_vacuum_convert (void)
+{
+  const char *file_name;
+  sqlite3 *db;
+  int status;
+
+  file_name = g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL);
+  g_remove (file_name);
+
+  for (guint i = 0; i < 2; i++) {
+    g_autoptr(ChattyHistory) history = NULL;
+    gboolean many_free = i == 1;
+
+    history = chatty_history_new ();
+    chatty_history_open (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
+    g_assert_true (chatty_history_is_open (history));
+    chatty_history_close (history);
+    g_clear_object (&history);
+
+    status = sqlite3_open (file_name, &db);
+    g_assert_cmpint (status, ==, SQLITE_OK);
+    status = sqlite3_exec (db,
+                           "PRAGMA auto_vacuum = NONE; VACUUM;"
+                           "CREATE TABLE IF NOT EXISTS test_pages(data TEXT);"
+                           "INSERT INTO test_pages "
+                           "WITH RECURSIVE seq(x) AS "
+                           "(SELECT 1 UNION ALL SELECT x+1 FROM seq WHERE x<2000) "
+                           "SELECT printf('%.500c', 'x') FROM seq;",
+                           NULL, NULL, NULL);
+    g_assert_cmpint (status, ==, SQLITE_OK);
+
+    if (many_free)
+      status = sqlite3_exec (db, "DELETE FROM test_pages;", NULL, NULL, NULL);
+    else
+      status = sqlite3_exec (db, "DELETE FROM test_pages WHERE rowid<=20;", NULL, NULL, NULL);
+    g_assert_cmpint (status, ==, SQLITE_OK);
+
+    g_assert_cmpint (history_db_get_int (db, "PRAGMA auto_vacuum;"), ==, 0);
+    g_assert_cmpint (history_db_get_int (db, "PRAGMA freelist_count;"), >, 0);
+    sqlite3_close (db);
+
+    history = chatty_history_new ();
+    chatty_history_open (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
+    g_assert_true (chatty_history_is_open (history));
+
+    /* Opening shouldn't block on rewriting the file */
+    status = sqlite3_open (file_name, &db);
+    g_assert_cmpint (status, ==, SQLITE_OK);
+    g_assert_cmpint (history_db_get_int (db, "PRAGMA auto_vacuum;"), ==, 0);
+    sqlite3_close (db);
+
+    history_maintain (history);
+    chatty_history_close (history);
+
+    status = sqlite3_open (file_name, &db);
+    g_assert_cmpint (status, ==, SQLITE_OK);
+
+    if (many_free) {
+      g_assert_cmpint (history_db_get_int (db, "PRAGMA auto_vacuum;"), ==, 2);
+      g_assert_cmpint (history_db_get_int (db, "PRAGMA freelist_count;"), ==, 0);
+    } else {
+      g_assert_cmpint (history_db_get_int (db, "PRAGMA auto_vacuum;"), ==, 0);
+      g_assert_cmpint (history_db_get_int (db, "PRAGMA freelist_count;"), >, 0);
+    }
+
+    sqlite3_close (db);
+    g_remove (file_name);
+  }
+}
+
+/* Add a file with @contents to media store, made old enough to be removed */
+static char *
+history_create_media_file (const char *contents,
+                           const char *url)
+{
+  g_autofree char *file_name = NULL;
+  g_autofree char *path = NULL;
+  struct utimbuf times;
+  char *blob_path;
+
+  file_name = history_create_cache_file ("media-test", "upload.png");
+  g_assert_true (g_file_set_contents (file_name, contents, -1, NULL));
+  blob_path = chatty_media_store_add_file (file_name, url, NULL);
+  g_assert_true (chatty_media_store_is_blob (blob_path));
+  g_remove (file_name);
+
+  path = g_build_filename (g_get_user_cache_dir (), "chatty", blob_path, NULL);
+  times.actime = times.modtime = time (NULL) - 2 * 24 * 60 * 60;
+  g_assert_cmpint (g_utime (path, &times), ==, 0);
+
+  return blob_path;
+}
+
+static void
+test_history_media (void)
+{
+  g_autoptr(ChattyHistory) history = NULL;
+  g_autoptr(ChattyChat) chat = NULL;
+  g_autoptr(GPtrArray) chats = NULL;
+  g_autoptr(GPtrArray) messages = NULL;
+  g_autofree char *used_blob = NULL;
+  g_autofree char *unused_blob = NULL;
+  g_autofree char *used_file = NULL;
+  g_autofree char *unused_file = NULL;
+  g_autofree char *path = NULL;
+  g_autofree char *sql = NULL;
+  const char *file_name;
+  sqlite3 *db;
+  GTask *task;
+  int status;
+
+  file_name = g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL);
+  g_remove (file_name);
+
+  history = chatty_history_new ();
+  chatty_history_open (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
+  g_assert_true (chatty_history_is_open (history));
+
+  chat = chatty_chat_new ("test-account@example.com", "buddy@example.org", TRUE);
+  chats = g_ptr_array_new_with_free_func (g_object_unref);
+  messages = g_ptr_array_new_with_free_func (g_object_unref);
+  g_ptr_array_add (chats, g_object_ref (chat));
+  g_ptr_array_add (messages,
+                   chatty_message_new (NULL, "Image", "uid-image", time (NULL),
+                                       CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_OUT, 0));
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_add_messages_async (history, chats, messages, finish_bool_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (g_task_propagate_boolean (task, NULL));
+  g_clear_object (&task);
+
+  /* The same content is saved only once */
+  used_blob = history_create_media_file ("used media", "https://example.org/used");
+  path = history_create_media_file ("used media", "https://example.com/used");
+  g_assert_cmpstr (path, ==, used_blob);
+  unused_blob = history_create_media_file ("unused media", "https://example.org/unused");
+  g_clear_pointer (&path, g_free);
+  path = chatty_media_store_lookup_url ("https://example.com/used");
+  g_assert_cmpstr (path, ==, used_blob);
+
+  status = sqlite3_open (file_name, &db);
+  g_assert_cmpint (status, ==, SQLITE_OK);
+
+  /* Two files share the same content, used by the message and the chat */
+  sql = g_strdup_printf ("INSERT INTO files(url,path) VALUES"
+                         "('https://example.org/used','%s'),"
+                         "('https://example.com/used','%s'),"
+                         "('https://example.org/unused','%s');"
+                         "UPDATE messages SET preview_id=(SELECT id FROM files WHERE "
+                         "url='https://example.org/used') WHERE uid='uid-image';"
+                         "UPDATE threads SET avatar_id=(SELECT id FROM files WHERE "
+                         "url='https://example.com/used');",
+                         used_blob, used_blob, unused_blob);
+  status = sqlite3_exec (db, sql, NULL, NULL, NULL);
+  g_assert_cmpint (status, ==, SQLITE_OK);
+
+  g_clear_pointer (&sql, g_free);
+  sql = g_strdup_printf ("SELECT ref_count FROM media_refs WHERE sha256='%s';",
+                         used_blob + CHATTY_MEDIA_STORE_HASH_START - 1);
+  g_assert_cmpint (history_db_get_int (db, sql), ==, 2);
+
+  /* Removing the unused file reference should remove it from the store */
+  history_maintain (history);
+
+  used_file = g_build_filename (g_get_user_cache_dir (), "chatty", used_blob, NULL);
+  unused_file = g_build_filename (g_get_user_cache_dir (), "chatty", unused_blob, NULL);
+  g_assert_true (g_file_test (used_file, G_FILE_TEST_IS_REGULAR));
+  g_assert_false (g_file_test (unused_file, G_FILE_TEST_EXISTS));
+  g_assert_cmpint (history_db_get_int (db, sql), ==, 2);
+  g_assert_cmpint (history_db_get_int (db, "SELECT count(*) FROM media_refs;"), ==, 1);
+  g_assert_null (chatty_media_store_lookup_url ("https://example.org/unused"));
+
+  /* A file is kept until its last reference is removed */
+  status = sqlite3_exec (db, "UPDATE messages SET preview_id=NULL;", NULL, NULL, NULL);
+  g_assert_cmpint (status, ==, SQLITE_OK);
+  history_maintain (history);
+  g_assert_cmpint (history_db_get_int (db, sql), ==, 1);
+  g_assert_true (g_file_test (used_file, G_FILE_TEST_IS_REGULAR));
+
+  status = sqlite3_exec (db, "UPDATE threads SET avatar_id=NULL;", NULL, NULL, NULL);
+  g_assert_cmpint (status, ==, SQLITE_OK);
+  history_maintain (history);
+  g_assert_false (g_file_test (used_file, G_FILE_TEST_EXISTS));
+  g_assert_cmpint (history_db_get_int (db, "SELECT count(*) FROM media_refs;"), ==, 0);
+
+  sqlite3_close (db);
+  chatty_history_close (history);
+}
+
+/* References to files saved before version 4 are counted when migrated */
+static void
+test_history_media_refs_migration (void)
+{
+  g_autofree char *path = NULL;
+  g_autofree char *file_name = NULL;
+  sqlite3 *db = NULL;
+  int status;
+
+  path = g_test_build_filename (G_TEST_DIST, "history-db", NULL);
+  export_sql_file (path, "xmpp-im-v3.sql", &db);
+  status = sqlite3_exec (db,
+                         "INSERT INTO files(url,path) VALUES"
+                         "('https://example.org/a','" CHATTY_MEDIA_STORE_DIR "/ab/abcd'),"
+                         "('https://example.com/a','" CHATTY_MEDIA_STORE_DIR "/ab/abcd'),"
+                         "('https://example.org/b','other/file.png');",
+                         NULL, NULL, NULL);
+  g_assert_cmpint (status, ==, SQLITE_OK);
+  sqlite3_close (db);
+
+  history_open_and_close (0, "xmpp-im-v3.db");
+
+  file_name = g_test_build_filename (G_TEST_BUILT, "xmpp-im-v3.db", NULL);
+  status = sqlite3_open (file_name, &db);
+  g_assert_cmpint (status, ==, SQLITE_OK);
+  g_assert_cmpint (history_db_get_int (db, "PRAGMA user_version;"), ==, 4);
+  g_assert_cmpint (history_db_get_int (db, "SELECT count(*) FROM media_refs;"), ==, 1);
+  g_assert_cmpint (history_db_get_int (db, "SELECT ref_count FROM media_refs "
+                                       "WHERE sha256='abcd';"), ==, 2);
+
+  /* And kept up to date after */
+  status = sqlite3_exec (db, "DELETE FROM files WHERE url='https://example.org/a';",
+                         NULL, NULL, NULL);
+  g_assert_cmpint (status, ==, SQLITE_OK);
+  g_assert_cmpint (history_db_get_int (db, "SELECT ref_count FROM media_refs "
+                                       "WHERE sha256='abcd';"), ==, 1);
+  sqlite3_close (db);
+  g_remove (file_name);
+}
+
+/* Export or import history with @dir, and get the number of messages */
+static gint64
+history_transfer (ChattyHistory *history,
+                  const char    *dir,
+                  gboolean       import)
+{
+  GTask *task;
+  gint64 n_messages;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+
+  if (import)
+    chatty_history_import_async (history, dir, NULL, finish_int_cb, task);
+  else
+    chatty_history_export_async (history, dir, NULL, finish_int_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  n_messages = g_task_propagate_int (task, NULL);
+  g_object_unref (task);
+
+  return n_messages;
+}
+
+static void
+test_history_export_import (void)
+{
+  g_autoptr(ChattyHistory) history = NULL;
+  g_autoptr(ChattyChat) chat = NULL;
+  g_autoptr(ChattyChat) room = NULL;
+  g_autoptr(ChattyMessage) message = NULL;
+  g_autoptr(GTimer) timer = NULL;
+  g_autofree char *cache_file = NULL;
+  g_autofree char *export_dir = NULL;
+  g_autofree char *exported_file = NULL;
+  g_autofree char *attachment = NULL;
+  g_autofree char *contents = NULL;
+  g_autofree char *hash = NULL;
+  g_autofree char *blob_path = NULL;
+  g_autofree char *blob_file = NULL;
+  g_autofree char *sql = NULL;
+  g_auto(GStrv) lines = NULL;
+  ChattyFileInfo *file;
+  const char *file_name;
+  double elapsed;
+  sqlite3 *db;
+  guint n_rows;
+  int status;
+
+  chat = chatty_chat_new ("test-account@example.com", "buddy@example.org", TRUE);
+  room = chatty_chat_new ("test-account@example.com", "room@example.org", FALSE);
+  g_object_set (G_OBJECT (chat), "protocols", CHATTY_PROTOCOL_XMPP, NULL);
+  g_object_set (G_OBJECT (room), "protocols", CHATTY_PROTOCOL_XMPP, NULL);
+
+  /* A text message in each chat, and an image with a cached file */
+  cache_file = history_create_cache_file ("export-test", "image.png");
+  file = g_new0 (ChattyFileInfo, 1);
+  file->file_name = g_strdup ("image.png");
+  file->url = g_strdup ("https://example.org/image.png");
+  file->path = g_strdup ("export-test/image.png");
+  file->mime_type = g_strdup ("image/png");
+  file->status = CHATTY_FILE_DOWNLOADED;
+  file->width = 640;
+  file->height = 480;
+  file->size = 4;
+  message = chatty_message_new (NULL, NULL, "uid-image", time (NULL), CHATTY_MESSAGE_IMAGE,
+                                CHATTY_DIRECTION_OUT, 0);
+  chatty_message_set_files (message, g_list_append (NULL, file));
+
+  n_rows = g_test_perf () ? 500000 : 20000;
+  history = history_new_with_messages (chat, room, message, n_rows, 1, &db);
+  file_name = g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL);
+  sqlite3_close (db);
+
+  export_dir = g_build_filename (g_test_get_dir (G_TEST_BUILT), "history-export", NULL);
+  exported_file = g_build_filename (export_dir, "messages.jsonl", NULL);
+  attachment = g_build_filename (export_dir, "attachments", "export-test", "image.png", NULL);
+
+  timer = g_timer_new ();
+  g_assert_cmpint (history_transfer (history, export_dir, FALSE), ==, n_rows + 3);
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_test_maximized_result (n_rows / elapsed, "%u rows: %.0f messages/s exported",
+                           n_rows, n_rows / elapsed);
+
+  /* A line for each message, and the cached file is copied */
+  g_assert_true (g_file_get_contents (exported_file, &contents, NULL, NULL));
+  lines = g_strsplit (contents, "\n", -1);
+  g_assert_cmpint (g_strv_length (lines), ==, n_rows + 4);
+  g_assert_cmpstr (lines[n_rows + 3], ==, "");
+  g_assert_true (g_file_test (attachment, G_FILE_TEST_IS_REGULAR));
+
+  /* Import to an empty history, with the cached file missing */
+  chatty_history_close (history);
+  g_clear_object (&history);
+  g_remove (file_name);
+  g_remove (cache_file);
+
+  history = chatty_history_new ();
+  chatty_history_open (history, g_test_get_dir (G_TEST_BUILT), "test-history.db");
+
+  g_timer_start (timer);
+  g_assert_cmpint (history_transfer (history, export_dir, TRUE), ==, n_rows + 3);
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_test_maximized_result (n_rows / elapsed, "%u rows: %.0f messages/s imported",
+                           n_rows, n_rows / elapsed);
+
+  status = sqlite3_open (file_name, &db);
+  g_assert_cmpint (status, ==, SQLITE_OK);
+  g_assert_cmpint (history_db_get_int (db, "SELECT count(*) FROM messages;"), ==, n_rows + 3);
+  g_assert_cmpint (history_db_get_int (db, "SELECT count(*) FROM threads;"), ==, 2);
+
+  /* The attachment is imported to the media store */
+  hash = g_compute_checksum_for_string (G_CHECKSUM_SHA256, "data", -1);
+  blob_path = g_strdup_printf (CHATTY_MEDIA_STORE_DIR "/%.2s/%s", hash, hash);
+  sql = g_strdup_printf ("SELECT width FROM image INNER JOIN files "
+                         "ON files.id=image.file_id "
+                         "WHERE files.path='%s';", blob_path);
+  g_assert_cmpint (history_db_get_int (db, sql), ==, 640);
+  g_clear_pointer (&sql, g_free);
+  sql = g_strdup_printf ("SELECT ref_count FROM media_refs WHERE sha256='%s';", hash);
+  g_assert_cmpint (history_db_get_int (db, sql), ==, 1);
+  blob_file = g_build_filename (g_get_user_cache_dir (), "chatty", blob_path, NULL);
+  g_assert_true (g_file_test (blob_file, G_FILE_TEST_IS_REGULAR));
+  g_assert_false (g_file_test (cache_file, G_FILE_TEST_EXISTS));
+
+  /* Importing again shouldn't duplicate messages */
+  g_assert_cmpint (history_transfer (history, export_dir, TRUE), ==, 0);
+  g_assert_cmpint (history_db_get_int (db, "SELECT count(*) FROM messages;"), ==, n_rows + 3);
+  g_assert_cmpint (history_get_load_time (history, chat), >, 0);
+
+  sqlite3_close (db);
+  chatty_history_close (history);
+
+  g_remove (blob_file);
+  g_remove (attachment);
+  g_remove (exported_file);
+}
+
 int
 main (int   argc,
       char *argv[])
 {
-  g_test_init (&argc, &argv, NULL);
+  /* Cached files are created and removed in maintenance and export tests */
+  g_test_init (&argc, &argv, G_TEST_OPTION_ISOLATE_DIRS, NULL);
   g_setenv ("GSETTINGS_BACKEND", "memory", TRUE);
 
   g_test_add_func ("/history/new", test_history_new);
   g_test_add_func ("/history/chat", test_history_chat);
+  g_test_add_func ("/history/chat_list", test_history_chat_list);
   g_test_add_func ("/history/message", test_history_message);
+  g_test_add_func ("/history/bulk_messages", test_history_bulk_messages);
+  g_test_add_func ("/history/last_message_times", test_history_last_message_times);
   g_test_add_func ("/history/raw_message", test_history_raw_message);
   g_test_add_func ("/history/db", test_history_db);
   g_test_add_func ("/history/db_migration", test_history_migration_db);
+  g_test_add_func ("/history/db_migration_chunks", test_history_migration_chunks);
+  g_test_add_func ("/history/db_migration_resume", test_history_migration_resume);
+  g_test_add_func ("/history/maintenance", test_history_maintenance);
+  g_test_add_func ("/history/vacuum_convert", test_history_vacuum_convert);
+  g_test_add_func ("/history/media", test_history_media);
+  g_test_add_func ("/history/media_refs_migration", test_history_media_refs_migration);
+  g_test_add_func ("/history/export_import", test_history_export_import);
 
   return g_test_run ();
 }
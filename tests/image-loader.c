@@ -0,0 +1,204 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* image-loader.c
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gdk/gdk.h>
+
+#include "chatty-image-loader.h"
+
+typedef struct {
+  cairo_surface_t *surface;
+  GError          *error;
+  guint           *n_pending;
+} LoadData;
+
+static char *
+create_image (const char *name,
+              int         width,
+              int         height)
+{
+  g_autoptr(GdkPixbuf) pixbuf = NULL;
+  g_autoptr(GError) error = NULL;
+  char *path;
+
+  path = g_build_filename (g_get_tmp_dir (), name, NULL);
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+  gdk_pixbuf_fill (pixbuf, 0x3584e4ff);
+  gdk_pixbuf_save (pixbuf, path, "png", &error, NULL);
+  g_assert_no_error (error);
+
+  return path;
+}
+
+static void
+load_cb (GObject      *object,
+         GAsyncResult *result,
+         gpointer      user_data)
+{
+  LoadData *data = user_data;
+
+  data->surface = chatty_image_loader_load_finish (CHATTY_IMAGE_LOADER (object),
+                                                   result, &data->error);
+  (*data->n_pending)--;
+}
+
+static void
+wait_for_loads (guint *n_pending)
+{
+  while (*n_pending > 0)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+load_data_clear (LoadData *data)
+{
+  g_clear_pointer (&data->surface, cairo_surface_destroy);
+  g_clear_error (&data->error);
+}
+
+static void
+test_image_loader_load (void)
+{
+  ChattyImageLoader *loader;
+  g_autofree char *path = NULL;
+  LoadData data[5] = { 0 };
+  guint n_pending = 0;
+
+  loader = chatty_image_loader_get_default ();
+  path = create_image ("chatty-test-load.png", 1200, 900);
+
+  /* Concurrent requests for the same image should share the decode */
+  for (guint i = 0; i < G_N_ELEMENTS (data); i++) {
+    data[i].n_pending = &n_pending;
+    n_pending++;
+    chatty_image_loader_load_async (loader, path, 240, 2, NULL, load_cb, &data[i]);
+  }
+
+  wait_for_loads (&n_pending);
+
+  for (guint i = 0; i < G_N_ELEMENTS (data); i++) {
+    g_assert_no_error (data[i].error);
+    g_assert_nonnull (data[i].surface);
+    g_assert_true (data[i].surface == data[0].surface);
+  }
+
+  /* Decoded at the requested size */
+  g_assert_cmpint (cairo_image_surface_get_width (data[0].surface), ==, 480);
+  g_assert_cmpint (cairo_image_surface_get_height (data[0].surface), ==, 360);
+  g_assert_true (chatty_image_loader_lookup (loader, path, 240, 2) == data[0].surface);
+  g_assert_null (chatty_image_loader_lookup (loader, path, 240, 1));
+
+  for (guint i = 0; i < G_N_ELEMENTS (data); i++)
+    load_data_clear (&data[i]);
+
+  /* Missing files should fail */
+  g_remove (path);
+  g_free (path);
+  path = g_build_filename (g_get_tmp_dir (), "chatty-test-missing.png", NULL);
+  n_pending = 1;
+  chatty_image_loader_load_async (loader, path, 240, 1, NULL, load_cb, &data[0]);
+  wait_for_loads (&n_pending);
+  g_assert_error (data[0].error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_assert_null (data[0].surface);
+  load_data_clear (&data[0]);
+}
+
+static void
+test_image_loader_cancel (void)
+{
+  g_autoptr(GCancellable) cancellable = NULL;
+  ChattyImageLoader *loader;
+  g_autofree char *path = NULL;
+  LoadData data[2] = { 0 };
+  guint n_pending = 2;
+
+  loader = chatty_image_loader_get_default ();
+  path = create_image ("chatty-test-cancel.png", 800, 600);
+  cancellable = g_cancellable_new ();
+
+  data[0].n_pending = data[1].n_pending = &n_pending;
+  chatty_image_loader_load_async (loader, path, 200, 1, cancellable, load_cb, &data[0]);
+  chatty_image_loader_load_async (loader, path, 200, 1, NULL, load_cb, &data[1]);
+  g_cancellable_cancel (cancellable);
+  wait_for_loads (&n_pending);
+
+  /* Cancelling one request shouldn’t affect the other */
+  g_assert_error (data[0].error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_no_error (data[1].error);
+  g_assert_nonnull (data[1].surface);
+  load_data_clear (&data[0]);
+  load_data_clear (&data[1]);
+
+  /* Already cancelled */
+  n_pending = 1;
+  chatty_image_loader_load_async (loader, path, 100, 1, cancellable, load_cb, &data[0]);
+  wait_for_loads (&n_pending);
+  g_assert_error (data[0].error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_null (chatty_image_loader_lookup (loader, path, 100, 1));
+  load_data_clear (&data[0]);
+
+  g_remove (path);
+}
+
+static void
+test_image_loader_cache_size (void)
+{
+  ChattyImageLoader *loader;
+  g_autofree char *path = NULL;
+  LoadData data = { 0 };
+  guint n_pending;
+
+  loader = chatty_image_loader_get_default ();
+  path = create_image ("chatty-test-cache.png", 400, 400);
+  data.n_pending = &n_pending;
+
+  chatty_image_loader_set_cache_size (loader, 0);
+  g_assert_cmpint (chatty_image_loader_get_cache_used (loader), ==, 0);
+
+  /* Enough for two of the images below, with 4 bytes per pixel */
+  chatty_image_loader_set_cache_size (loader, 90000);
+
+  for (int width = 99; width <= 101; width++) {
+    n_pending = 1;
+    chatty_image_loader_load_async (loader, path, width, 1, NULL, load_cb, &data);
+    wait_for_loads (&n_pending);
+    g_assert_no_error (data.error);
+    load_data_clear (&data);
+  }
+
+  /* The least recently used one should be dropped */
+  g_assert_null (chatty_image_loader_lookup (loader, path, 99, 1));
+  g_assert_nonnull (chatty_image_loader_lookup (loader, path, 100, 1));
+  g_assert_nonnull (chatty_image_loader_lookup (loader, path, 101, 1));
+  g_assert_cmpint (chatty_image_loader_get_cache_used (loader), ==, (100 * 100 + 101 * 101) * 4);
+
+  g_remove (path);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/image-loader/load", test_image_loader_load);
+  g_test_add_func ("/image-loader/cancel", test_image_loader_cancel);
+  g_test_add_func ("/image-loader/cache-size", test_image_loader_cache_size);
+
+  return g_test_run ();
+}
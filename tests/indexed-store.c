@@ -0,0 +1,333 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* indexed-store.c
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <gio/gio.h>
+
+#include "chatty-indexed-store.h"
+#include "chatty-utils.h"
+
+#define N_ITEMS   20000
+#define N_LOOKUPS 5000
+
+static gpointer
+item_get_key (gpointer item)
+{
+  return g_strdup (g_object_get_data (item, "id"));
+}
+
+static GObject *
+item_new (guint id)
+{
+  GObject *item;
+
+  item = g_object_new (G_TYPE_OBJECT, NULL);
+  g_object_set_data_full (item, "id", g_strdup_printf ("id-%u", id), g_free);
+
+  return item;
+}
+
+static ChattyIndexedStore *
+store_new (void)
+{
+  return chatty_indexed_store_new_full (G_TYPE_OBJECT, item_get_key,
+                                        g_str_hash, g_str_equal, g_free);
+}
+
+static void
+items_changed_cb (GListModel *model,
+                  guint       position,
+                  guint       removed,
+                  guint       added,
+                  GListStore *mirror)
+{
+  g_autofree gpointer *additions = NULL;
+
+  additions = g_new (gpointer, added);
+
+  for (guint i = 0; i < added; i++)
+    additions[i] = g_list_model_get_item (model, position + i);
+
+  g_list_store_splice (mirror, position, removed, additions, added);
+
+  for (guint i = 0; i < added; i++)
+    g_object_unref (additions[i]);
+}
+
+/* Check that @store and its index matches @mirror */
+static void
+assert_store_matches (ChattyIndexedStore *store,
+                      GListStore         *mirror)
+{
+  guint n_items;
+
+  n_items = g_list_model_get_n_items (G_LIST_MODEL (mirror));
+  g_assert_cmpint (g_list_model_get_n_items (G_LIST_MODEL (store)), ==, n_items);
+
+  for (guint i = 0; i < n_items; i++) {
+    g_autoptr(GObject) item = NULL;
+    g_autoptr(GObject) expected = NULL;
+    guint position = G_MAXUINT;
+
+    item = g_list_model_get_item (G_LIST_MODEL (store), i);
+    expected = g_list_model_get_item (G_LIST_MODEL (mirror), i);
+    g_assert_true (item == expected);
+
+    g_assert_true (chatty_indexed_store_find (store, item, &position));
+    g_assert_cmpint (position, ==, i);
+    g_assert_true (chatty_utils_get_item_position (G_LIST_MODEL (store), item, &position));
+    g_assert_cmpint (position, ==, i);
+
+    g_assert_true (chatty_indexed_store_lookup (store, g_object_get_data (item, "id"), &position) == item);
+    g_assert_cmpint (position, ==, i);
+  }
+
+  g_assert_null (g_list_model_get_item (G_LIST_MODEL (store), n_items));
+}
+
+static void
+test_indexed_store_random (void)
+{
+  g_autoptr(ChattyIndexedStore) store = NULL;
+  g_autoptr(GListStore) mirror = NULL;
+  guint id = 0;
+
+  store = store_new ();
+  mirror = g_list_store_new (G_TYPE_OBJECT);
+  g_signal_connect (store, "items-changed", G_CALLBACK (items_changed_cb), mirror);
+
+  for (guint i = 0; i < 2000; i++) {
+    g_autoptr(GObject) item = NULL;
+    guint n_items, position;
+
+    n_items = g_list_model_get_n_items (G_LIST_MODEL (store));
+    position = g_random_int_range (0, n_items + 1);
+
+    switch (g_random_int_range (0, 6)) {
+    case 0:
+      item = item_new (id++);
+      chatty_indexed_store_append (store, item);
+      break;
+
+    case 1:
+      item = item_new (id++);
+      chatty_indexed_store_insert (store, position, item);
+      break;
+
+    case 2:
+      {
+        GObject *additions[3];
+        guint n_removals;
+
+        n_removals = g_random_int_range (0, MIN (n_items - position, 3) + 1);
+
+        for (guint j = 0; j < G_N_ELEMENTS (additions); j++)
+          additions[j] = item_new (id++);
+
+        chatty_indexed_store_splice (store, position, n_removals,
+                                     (gpointer *)additions, G_N_ELEMENTS (additions));
+
+        for (guint j = 0; j < G_N_ELEMENTS (additions); j++)
+          g_object_unref (additions[j]);
+      }
+      break;
+
+    case 3:
+      if (position < n_items)
+        chatty_indexed_store_remove (store, position);
+      break;
+
+    case 4:
+      if (position < n_items) {
+        item = g_list_model_get_item (G_LIST_MODEL (store), position);
+        g_assert_true (chatty_indexed_store_remove_item (store, item));
+        g_assert_false (chatty_indexed_store_find (store, item, NULL));
+      }
+      break;
+
+    case 5:
+      /* Access in order, so that the cached item is used */
+      for (guint j = 0; j < n_items; j++) {
+        g_autoptr(GObject) object = NULL;
+
+        object = g_list_model_get_item (G_LIST_MODEL (store), j);
+        g_assert_nonnull (object);
+      }
+      break;
+
+    default:
+      g_assert_not_reached ();
+    }
+
+    if (i % 100 == 0)
+      assert_store_matches (store, mirror);
+  }
+
+  assert_store_matches (store, mirror);
+
+  chatty_indexed_store_remove_all (store);
+  assert_store_matches (store, mirror);
+  g_assert_null (chatty_indexed_store_lookup (store, "id-1", NULL));
+}
+
+static void
+test_indexed_store_key (void)
+{
+  g_autoptr(ChattyIndexedStore) store = NULL;
+  g_autoptr(GObject) item = NULL;
+  g_autoptr(GObject) other = NULL;
+  g_autoptr(GObject) no_key = NULL;
+  guint position;
+
+  store = store_new ();
+  item = item_new (1);
+  other = item_new (2);
+  no_key = g_object_new (G_TYPE_OBJECT, NULL);
+
+  chatty_indexed_store_append (store, no_key);
+  chatty_indexed_store_append (store, item);
+  chatty_indexed_store_append (store, other);
+  g_assert_true (chatty_indexed_store_find (store, no_key, &position));
+  g_assert_cmpint (position, ==, 0);
+  g_assert_true (chatty_indexed_store_lookup (store, "id-1", &position) == item);
+  g_assert_cmpint (position, ==, 1);
+
+  /* Items can be added only once */
+  g_test_expect_message ("chatty-indexed-store", G_LOG_LEVEL_CRITICAL, "*g_hash_table_contains*");
+  chatty_indexed_store_append (store, item);
+  g_test_assert_expected_messages ();
+  g_assert_cmpint (g_list_model_get_n_items (G_LIST_MODEL (store)), ==, 3);
+
+  /* The old key should no longer be found once updated */
+  g_object_set_data_full (item, "id", g_strdup ("new-id"), g_free);
+  g_assert_true (chatty_indexed_store_lookup (store, "id-1", NULL) == item);
+  chatty_indexed_store_update_key (store, item);
+  g_assert_null (chatty_indexed_store_lookup (store, "id-1", NULL));
+  g_assert_true (chatty_indexed_store_lookup (store, "new-id", &position) == item);
+  g_assert_cmpint (position, ==, 1);
+
+  g_object_set_data_full (no_key, "id", g_strdup ("no-key"), g_free);
+  chatty_indexed_store_update_key (store, no_key);
+  g_assert_true (chatty_indexed_store_lookup (store, "no-key", NULL) == no_key);
+
+  /* The latest item wins if keys are the same */
+  g_object_set_data_full (other, "id", g_strdup ("new-id"), g_free);
+  chatty_indexed_store_update_key (store, other);
+  g_assert_true (chatty_indexed_store_lookup (store, "new-id", NULL) == other);
+
+  /* Removing the older item shouldn’t remove the newer one from index */
+  g_assert_true (chatty_indexed_store_remove_item (store, item));
+  g_assert_false (chatty_indexed_store_remove_item (store, item));
+  g_assert_true (chatty_indexed_store_lookup (store, "new-id", &position) == other);
+  g_assert_cmpint (position, ==, 1);
+
+  g_assert_true (chatty_indexed_store_remove_item (store, other));
+  g_assert_null (chatty_indexed_store_lookup (store, "new-id", NULL));
+
+  /* Removing the newer item should re-point the key to the older one */
+  chatty_indexed_store_append (store, item);
+  chatty_indexed_store_append (store, other);
+  g_assert_true (chatty_indexed_store_lookup (store, "new-id", NULL) == other);
+  g_assert_true (chatty_indexed_store_remove_item (store, other));
+  g_assert_true (chatty_indexed_store_lookup (store, "new-id", &position) == item);
+  g_assert_cmpint (position, ==, 1);
+
+  /* The index uses the key of @item, which is freed when @item is removed */
+  chatty_indexed_store_append (store, other);
+  g_assert_true (chatty_indexed_store_remove_item (store, item));
+  g_assert_true (chatty_indexed_store_lookup (store, "new-id", NULL) == other);
+  g_assert_true (chatty_indexed_store_remove_item (store, other));
+  g_assert_null (chatty_indexed_store_lookup (store, "new-id", NULL));
+}
+
+static void
+test_indexed_store_benchmark (void)
+{
+  g_autoptr(ChattyIndexedStore) store = NULL;
+  g_autoptr(GListStore) list_store = NULL;
+  g_autoptr(GTimer) timer = NULL;
+  double elapsed;
+
+  if (!g_test_perf ())
+    return;
+
+  store = store_new ();
+  list_store = g_list_store_new (G_TYPE_OBJECT);
+
+  for (guint i = 0; i < N_ITEMS; i++) {
+    g_autoptr(GObject) item = item_new (i);
+
+    chatty_indexed_store_append (store, item);
+    g_list_store_append (list_store, item);
+  }
+
+  timer = g_timer_new ();
+
+  for (guint i = 0; i < N_LOOKUPS; i++) {
+    g_autoptr(GObject) item = NULL;
+    guint position;
+
+    item = g_list_model_get_item (G_LIST_MODEL (list_store), g_random_int_range (0, N_ITEMS));
+    g_assert_true (chatty_utils_get_item_position (G_LIST_MODEL (list_store), item, &position));
+  }
+
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_test_message ("GListStore: %u items: %.4f ms/lookup",
+                  N_ITEMS, elapsed * 1000 / N_LOOKUPS);
+
+  g_timer_start (timer);
+
+  for (guint i = 0; i < N_LOOKUPS; i++) {
+    g_autofree char *id = NULL;
+    GObject *item;
+    guint position;
+
+    id = g_strdup_printf ("id-%d", g_random_int_range (0, N_ITEMS));
+    item = chatty_indexed_store_lookup (store, id, NULL);
+    g_assert_true (chatty_utils_get_item_position (G_LIST_MODEL (store), item, &position));
+  }
+
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_test_minimized_result (elapsed * 1000 / N_LOOKUPS,
+                           "ChattyIndexedStore: %u items: %.4f ms/lookup",
+                           N_ITEMS, elapsed * 1000 / N_LOOKUPS);
+
+  g_timer_start (timer);
+
+  for (guint i = 0; i < N_LOOKUPS; i++) {
+    g_autoptr(GObject) item = item_new (N_ITEMS + i);
+
+    chatty_indexed_store_insert (store, g_random_int_range (0, N_ITEMS), item);
+  }
+
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_test_minimized_result (elapsed * 1000 / N_LOOKUPS,
+                           "ChattyIndexedStore: %u items: %.4f ms/insert",
+                           N_ITEMS, elapsed * 1000 / N_LOOKUPS);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/indexed-store/random", test_indexed_store_random);
+  g_test_add_func ("/indexed-store/key", test_indexed_store_key);
+  g_test_add_func ("/indexed-store/benchmark", test_indexed_store_benchmark);
+
+  return g_test_run ();
+}
@@ -0,0 +1,133 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* log.c
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#define G_LOG_DOMAIN "chatty-test-log"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chatty-log.h"
+
+#define N_THREADS 4
+#define N_LINES   200
+
+static gpointer
+log_thread (gpointer user_data)
+{
+  for (guint i = 0; i < N_LINES; i++)
+    g_message ("thread %u: line %u", GPOINTER_TO_UINT (user_data), i);
+
+  return NULL;
+}
+
+static void
+test_log_writer (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree char *path = NULL;
+  g_autofree char *contents = NULL;
+  g_auto(GStrv) lines = NULL;
+  GThread *threads[N_THREADS];
+  guint next_line[N_THREADS] = { 0 };
+  int fd, saved_fd;
+
+  /* Show messages, so that they go through the writer thread */
+  chatty_log_increase_verbosity ();
+
+  /* Messages are written to stdout, redirect it to a file */
+  fd = g_file_open_tmp ("chatty-log-XXXXXX", &path, &error);
+  g_assert_no_error (error);
+  fflush (stdout);
+  saved_fd = dup (STDOUT_FILENO);
+  g_assert_cmpint (dup2 (fd, STDOUT_FILENO), ==, STDOUT_FILENO);
+
+  for (guint i = 0; i < N_THREADS; i++)
+    threads[i] = g_thread_new ("log-test", log_thread, GUINT_TO_POINTER (i));
+
+  for (guint i = 0; i < N_THREADS; i++)
+    g_thread_join (threads[i]);
+
+  chatty_log_flush ();
+  fflush (stdout);
+  dup2 (saved_fd, STDOUT_FILENO);
+  close (saved_fd);
+  close (fd);
+
+  g_file_get_contents (path, &contents, NULL, &error);
+  g_assert_no_error (error);
+  g_unlink (path);
+
+  /* Every line should be written once, in the order logged by the thread */
+  lines = g_strsplit (contents, "\n", -1);
+
+  for (guint i = 0; lines[i]; i++) {
+    const char *line;
+    guint thread, n;
+
+    line = strstr (lines[i], "thread ");
+    if (!line)
+      continue;
+
+    g_assert_cmpint (sscanf (line, "thread %u: line %u", &thread, &n), ==, 2);
+    g_assert_cmpuint (thread, <, N_THREADS);
+    g_assert_cmpuint (n, ==, next_line[thread]);
+    next_line[thread]++;
+  }
+
+  for (guint i = 0; i < N_THREADS; i++)
+    g_assert_cmpuint (next_line[i], ==, N_LINES);
+}
+
+static void
+test_log_recent (void)
+{
+  g_autofree char *recent = NULL;
+
+  /* Infos, debug and trace messages are not shown at this verbosity... */
+  g_assert_cmpint (chatty_log_get_verbosity (), ==, 0);
+
+  for (guint i = 0; i < 2000; i++)
+    g_info ("recent line %u end", i);
+  g_debug ("hidden debug line");
+  CHATTY_TRACE_MSG ("hidden trace line");
+
+  /* ...but the latest ones should be kept */
+  recent = chatty_log_get_recent ();
+  g_assert_nonnull (strstr (recent, "recent line 1999 end"));
+  g_assert_nonnull (strstr (recent, G_LOG_DOMAIN));
+  g_assert_null (strstr (recent, "recent line 0 end"));
+  g_assert_nonnull (strstr (recent, "hidden debug line"));
+  g_assert_nonnull (strstr (recent, "hidden trace line"));
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  chatty_log_init ();
+
+  /* Before the writer test, which increases the verbosity */
+  g_test_add_func ("/log/recent", test_log_recent);
+  g_test_add_func ("/log/writer", test_log_writer);
+
+  return g_test_run ();
+}
@@ -0,0 +1,188 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* markup.c
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <glib.h>
+#include <purple.h>
+
+#include "chatty-markup.h"
+
+#define N_ROUNDS 2000
+
+/* Messages as received from various protocols */
+static const char *corpus[] = {
+  "Hi",
+  "ok 👍",
+  "Are you coming today?",
+  "See https://source.puri.sm/Librem5/chatty/-/issues/420 for details.",
+  "> Did you get the keys?\nYes, they are on the table",
+  "> > nested\n> quote\nreply with www.example.org",
+  "Tom &amp; Jerry &lt;3",
+  "<b>bold</b> and <i>italic</i> &quot;text&quot;",
+  "Line one<br>Line two<br/>Line three",
+  "<a href=\"https://matrix.org\">Matrix</a> is at https://matrix.org",
+  "Mail me at alice@example.com, or ping bob@jabber.org.",
+  "<body xmlns='http://www.w3.org/1999/xhtml'><p>Hello <strong>there</strong></p></body>",
+  "Your verification code is 123456. Don't share it with anyone.",
+  "Dear customer, your bill of Rs. 499 is due on 12/03. Pay at http://pay.example.com/?id=42&ref=sms",
+  "lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt "
+  "ut labore et dolore magna aliqua. Ut enim ad minim veniam, quis nostrud exercitation ullamco "
+  "laboris nisi ut aliquip ex ea commodo consequat.\n\nDuis aute irure dolor in reprehenderit in "
+  "voluptate velit esse cillum dolore eu fugiat nulla pariatur.",
+  "x = a < b && b > c",
+};
+
+static char *
+old_render (const char *message)
+{
+  g_autofree char *nl_2_br = NULL;
+  g_autofree char *striped = NULL;
+  g_autofree char *escaped = NULL;
+  g_autofree char *linkified = NULL;
+  char *result;
+
+  nl_2_br = purple_strdup_withhtml (message);
+  striped = purple_markup_strip_html (nl_2_br);
+  escaped = purple_markup_escape_text (striped, -1);
+  linkified = purple_markup_linkify (escaped);
+  purple_markup_html_to_xhtml (linkified, &result, NULL);
+
+  return result;
+}
+
+static void
+assert_markup (const char *text,
+               const char *expected)
+{
+  g_autofree char *markup = NULL;
+
+  markup = chatty_markup_render (text, NULL);
+  g_assert_cmpstr (markup, ==, expected);
+  g_assert_true (pango_parse_markup (markup, -1, 0, NULL, NULL, NULL, NULL));
+}
+
+static void
+test_markup_render (void)
+{
+  assert_markup ("", "");
+  assert_markup ("Hello", "Hello");
+  assert_markup ("a < b & \"c\"", "a &lt; b &amp; &quot;c&quot;");
+  assert_markup ("Tom &amp; Jerry &lt;3 &#233;&#x1F600;", "Tom &amp; Jerry &lt;3 é😀");
+  assert_markup ("<b>Hi</b><br>there\r\n", "Hi\nthere\n");
+  assert_markup ("<p>one</p><p>two</p>", "one\ntwo\n");
+  assert_markup ("a<script>alert(1)</script>b<!-- comment -->c", "abc");
+  assert_markup ("https://example.com",
+                 "<a href=\"https://example.com\">https://example.com</a>");
+  assert_markup ("(see www.example.com/a_(b)).",
+                 "(see <a href=\"http://www.example.com/a_(b)\">www.example.com/a_(b)</a>).");
+  assert_markup ("http://x.org/?a=1&amp;b=2",
+                 "<a href=\"http://x.org/?a=1&amp;b=2\">http://x.org/?a=1&amp;b=2</a>");
+  assert_markup ("alice@example.com.",
+                 "<a href=\"mailto:alice@example.com\">alice@example.com</a>.");
+  assert_markup ("@alice:matrix.org", "@alice:matrix.org");
+  assert_markup ("<a href=\"https://gnome.org\">GNOME</a>",
+                 "GNOME (<a href=\"https://gnome.org\">https://gnome.org</a>)");
+  assert_markup ("<a href='https://gnome.org'>https://gnome.org</a>",
+                 "<a href=\"https://gnome.org\">https://gnome.org</a>");
+}
+
+static void
+test_markup_quotes (void)
+{
+  g_autoptr(PangoAttrList) attrs = NULL;
+  g_autofree char *markup = NULL;
+  GSList *list;
+
+  markup = chatty_markup_render ("no > quote", &attrs);
+  g_assert_null (attrs);
+  g_free (markup);
+
+  markup = chatty_markup_render ("&gt; one\nreply\n<b>&gt;</b> two", &attrs);
+  g_assert_cmpstr (markup, ==, "&gt; one\nreply\n&gt; two");
+  g_assert_nonnull (attrs);
+
+  list = pango_attr_list_get_attributes (attrs);
+  g_assert_cmpint (g_slist_length (list), ==, 2);
+  g_assert_cmpint (((PangoAttribute *)list->data)->start_index, ==, 0);
+  g_assert_cmpint (((PangoAttribute *)list->data)->end_index, ==, 6);
+  g_assert_cmpint (((PangoAttribute *)list->next->data)->start_index, ==, 12);
+  g_assert_cmpint (((PangoAttribute *)list->next->data)->end_index, ==, 18);
+  g_slist_free_full (list, (GDestroyNotify)pango_attribute_destroy);
+}
+
+static void
+test_markup_strip (void)
+{
+  g_autofree char *text = NULL;
+
+  text = chatty_markup_strip ("<b>Tom</b> &amp; <a href=\"https://x.org\">Jerry</a><br>&lt;3");
+  g_assert_cmpstr (text, ==, "Tom & Jerry (https://x.org)\n<3");
+}
+
+static void
+test_markup_benchmark (void)
+{
+  g_autoptr(GTimer) timer = NULL;
+  double old_elapsed, elapsed;
+  guint n_messages;
+
+  if (!g_test_perf ())
+    return;
+
+  n_messages = N_ROUNDS * G_N_ELEMENTS (corpus);
+  timer = g_timer_new ();
+
+  for (guint i = 0; i < N_ROUNDS; i++)
+    for (guint j = 0; j < G_N_ELEMENTS (corpus); j++) {
+      g_autofree char *markup = NULL;
+
+      markup = old_render (corpus[j]);
+    }
+
+  old_elapsed = g_timer_elapsed (timer, NULL);
+  g_test_message ("Old pipeline: %u messages: %.4f ms/message",
+                  n_messages, old_elapsed * 1000 / n_messages);
+
+  g_timer_start (timer);
+
+  for (guint i = 0; i < N_ROUNDS; i++)
+    for (guint j = 0; j < G_N_ELEMENTS (corpus); j++) {
+      g_autoptr(PangoAttrList) attrs = NULL;
+      g_autofree char *markup = NULL;
+
+      markup = chatty_markup_render (corpus[j], &attrs);
+    }
+
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_test_minimized_result (elapsed * 1000 / n_messages,
+                           "Single pass: %u messages: %.4f ms/message (%.1fx faster)",
+                           n_messages, elapsed * 1000 / n_messages,
+                           old_elapsed / elapsed);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/markup/render", test_markup_render);
+  g_test_add_func ("/markup/quotes", test_markup_quotes);
+  g_test_add_func ("/markup/strip", test_markup_strip);
+  g_test_add_func ("/markup/benchmark", test_markup_benchmark);
+
+  return g_test_run ();
+}
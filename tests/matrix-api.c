@@ -9,7 +9,27 @@
  * SPDX-License-Identifier: GPL-3.0-or-later
  */
 
+#include <libsoup/soup.h>
+#include <string.h>
+
 #include "matrix/matrix-api.h"
+#include "chatty-message.h"
+#include "chatty-utils.h"
+
+#define LIMIT_EXCEEDED "{\"errcode\": \"M_LIMIT_EXCEEDED\", "  \
+  "\"error\": \"Too many requests\", \"retry_after_ms\": 600}"
+
+typedef struct {
+  SoupServer *server;
+  char       *uri;
+  /* Arrival time of every request */
+  GArray     *times;
+  GPtrArray  *paused;
+  gboolean    pause;
+  /* The number of requests to fail with M_LIMIT_EXCEEDED */
+  guint       n_limited;
+  guint       n_completed;
+} TestServer;
 
 static void
 test_matrix_api_new (void)
@@ -59,13 +79,301 @@ test_matrix_api_new (void)
   g_object_unref (api);
 }
 
+static void
+test_matrix_api_requests (void)
+{
+  g_autoptr(MatrixApi) api = NULL;
+  g_autofree char *stats = NULL;
+
+  api = matrix_api_new ("@alice:example.org");
+  stats = matrix_api_get_request_stats (api);
+  g_assert_nonnull (strstr (stats, "send: queued: 0 (max: 0), active: 0, done: 0"));
+  g_assert_nonnull (strstr (stats, "sync: queued: 0"));
+  g_assert_nonnull (strstr (stats, "media: queued: 0"));
+
+  /* Cancelling without any request shouldn't do anything */
+  matrix_api_cancel_room_requests (api, "!abcd:example.org");
+  matrix_api_stop_sync (api);
+}
+
+static void
+server_handler_cb (SoupServer        *server,
+                   SoupMessage       *msg,
+                   const char        *path,
+                   GHashTable        *query,
+                   SoupClientContext *client,
+                   gpointer           user_data)
+{
+  TestServer *test = user_data;
+  gint64 now;
+
+  now = g_get_monotonic_time ();
+  g_array_append_val (test->times, now);
+
+  if (test->n_limited) {
+    test->n_limited--;
+    soup_message_set_status (msg, 429);
+    soup_message_set_response (msg, "application/json", SOUP_MEMORY_STATIC,
+                               LIMIT_EXCEEDED, strlen (LIMIT_EXCEEDED));
+    return;
+  }
+
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+
+  /* Room state is an array */
+  if (g_str_has_suffix (path, "/state"))
+    soup_message_set_response (msg, "application/json", SOUP_MEMORY_STATIC, "[]", 2);
+  else
+    soup_message_set_response (msg, "application/json", SOUP_MEMORY_STATIC, "{}", 2);
+
+  if (test->pause) {
+    soup_server_pause_message (server, msg);
+    g_ptr_array_add (test->paused, g_object_ref (msg));
+  }
+}
+
+static TestServer *
+test_server_new (void)
+{
+  g_autoptr(GError) error = NULL;
+  TestServer *test;
+  GSList *uris;
+
+  test = g_new0 (TestServer, 1);
+  test->times = g_array_new (FALSE, FALSE, sizeof (gint64));
+  test->paused = g_ptr_array_new_with_free_func (g_object_unref);
+  test->server = soup_server_new (NULL, NULL);
+  soup_server_add_handler (test->server, NULL, server_handler_cb, test, NULL);
+  soup_server_listen_local (test->server, 0, SOUP_SERVER_LISTEN_IPV4_ONLY, &error);
+  g_assert_no_error (error);
+
+  uris = soup_server_get_uris (test->server);
+  g_assert_nonnull (uris);
+  test->uri = soup_uri_to_string (uris->data, FALSE);
+  g_slist_free_full (uris, (GDestroyNotify)soup_uri_free);
+
+  return test;
+}
+
+static void
+test_server_free (TestServer *test)
+{
+  soup_server_disconnect (test->server);
+  g_clear_object (&test->server);
+  g_ptr_array_unref (test->paused);
+  g_array_unref (test->times);
+  g_free (test->uri);
+  g_free (test);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (TestServer, test_server_free)
+
+static void
+request_completed_cb (GObject      *object,
+                      GAsyncResult *result,
+                      gpointer      user_data)
+{
+  TestServer *test = user_data;
+
+  test->n_completed++;
+}
+
+static void
+test_server_wait (TestServer *test,
+                  guint       n_requests)
+{
+  while (test->times->len < n_requests)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+test_server_wait_completed (TestServer *test,
+                            guint       n_completed)
+{
+  while (test->n_completed < n_completed)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static gboolean
+flush_timeout_cb (gpointer user_data)
+{
+  gboolean *done = user_data;
+
+  *done = TRUE;
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Let pending requests reach the server, if they are to be sent */
+static void
+test_server_flush (void)
+{
+  gboolean done = FALSE;
+
+  g_timeout_add (200, flush_timeout_cb, &done);
+
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static MatrixApi *
+test_api_new (TestServer *test)
+{
+  MatrixApi *api;
+
+  api = matrix_api_new ("@alice:example.org");
+  matrix_api_set_homeserver (api, test->uri);
+  g_assert_cmpstr (matrix_api_get_homeserver (api), !=, NULL);
+
+  return api;
+}
+
+static void
+test_matrix_api_class_limit (void)
+{
+  g_autoptr(TestServer) test = NULL;
+  g_autoptr(MatrixApi) api = NULL;
+  g_autofree char *stats = NULL;
+
+  test = test_server_new ();
+  api = test_api_new (test);
+  test->pause = TRUE;
+
+  /* Only one room state request is done at a time */
+  for (guint i = 0; i < 3; i++)
+    matrix_api_get_room_state_async (api, "!room:example.org",
+                                     request_completed_cb, test);
+
+  test_server_wait (test, 1);
+  test_server_flush ();
+  g_assert_cmpint (test->times->len, ==, 1);
+  stats = matrix_api_get_request_stats (api);
+  g_assert_nonnull (strstr (stats, "state: queued: 2 (max: 2), active: 1, done: 0"));
+
+  /* The next request is sent once the first one completes */
+  soup_server_unpause_message (test->server, test->paused->pdata[0]);
+  test_server_wait_completed (test, 1);
+  test_server_wait (test, 2);
+  test_server_flush ();
+  g_assert_cmpint (test->times->len, ==, 2);
+  g_clear_pointer (&stats, g_free);
+  stats = matrix_api_get_request_stats (api);
+  g_assert_nonnull (strstr (stats, "state: queued: 1 (max: 2), active: 1, done: 1"));
+
+  /* Cancelling the room cancels both queued and active requests */
+  matrix_api_cancel_room_requests (api, "!room:example.org");
+  test_server_wait_completed (test, 3);
+  g_clear_pointer (&stats, g_free);
+  stats = matrix_api_get_request_stats (api);
+  g_assert_nonnull (strstr (stats, "state: queued: 0 (max: 2), active: 0"));
+}
+
+static void
+test_matrix_api_media_limit (void)
+{
+  g_autoptr(TestServer) test = NULL;
+  g_autoptr(MatrixApi) api = NULL;
+  g_autoptr(GPtrArray) files = NULL;
+  g_autofree char *stats = NULL;
+
+  test = test_server_new ();
+  api = test_api_new (test);
+  test->pause = TRUE;
+  files = g_ptr_array_new_with_free_func ((GDestroyNotify)chatty_file_info_free);
+
+  /* A few downloads are done at a time, not one after another */
+  for (guint i = 0; i < 5; i++) {
+    ChattyFileInfo *file;
+
+    file = g_new0 (ChattyFileInfo, 1);
+    file->url = g_strdup_printf ("%s/media/%u", test->uri, i);
+    g_ptr_array_add (files, file);
+    matrix_api_get_file_async (api, "!room:example.org", NULL, file, NULL, NULL,
+                               request_completed_cb, test);
+  }
+
+  test_server_wait (test, 3);
+  test_server_flush ();
+  g_assert_cmpint (test->times->len, ==, 3);
+  stats = matrix_api_get_request_stats (api);
+  g_assert_nonnull (strstr (stats, "media: queued: 2 (max: 2), active: 3, done: 0"));
+
+  /* Downloads are cancelled with the room */
+  matrix_api_cancel_room_requests (api, "!room:example.org");
+  test_server_wait_completed (test, 5);
+  g_clear_pointer (&stats, g_free);
+  stats = matrix_api_get_request_stats (api);
+  g_assert_nonnull (strstr (stats, "media: queued: 0 (max: 2), active: 0"));
+}
+
+static void
+test_matrix_api_rate_limit (void)
+{
+  g_autoptr(TestServer) test = NULL;
+  g_autoptr(MatrixApi) api = NULL;
+  g_autoptr(ChattyMessage) message = NULL;
+  gint64 elapsed;
+
+  test = test_server_new ();
+  api = test_api_new (test);
+  message = chatty_message_new (NULL, "Hello", "$event:example.org", time (NULL),
+                                CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_IN, 0);
+
+  /* Read markers allow a burst of 4, and 2 more requests every second */
+  for (guint i = 0; i < 6; i++)
+    matrix_api_set_read_marker_async (api, "!room:example.org", message,
+                                      request_completed_cb, test);
+
+  test_server_wait_completed (test, 6);
+  g_assert_cmpint (test->times->len, ==, 6);
+
+  elapsed = g_array_index (test->times, gint64, 3) - g_array_index (test->times, gint64, 0);
+  g_assert_cmpint (elapsed, <, 400 * 1000);
+  elapsed = g_array_index (test->times, gint64, 4) - g_array_index (test->times, gint64, 0);
+  g_assert_cmpint (elapsed, >=, 300 * 1000);
+  elapsed = g_array_index (test->times, gint64, 5) - g_array_index (test->times, gint64, 0);
+  g_assert_cmpint (elapsed, >=, 800 * 1000);
+}
+
+static void
+test_matrix_api_retry_after (void)
+{
+  g_autoptr(TestServer) test = NULL;
+  g_autoptr(MatrixApi) api = NULL;
+  g_autoptr(ChattyMessage) message = NULL;
+  gint64 elapsed;
+
+  test = test_server_new ();
+  api = test_api_new (test);
+  message = chatty_message_new (NULL, "Hello", "$event:example.org", time (NULL),
+                                CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_IN, 0);
+
+  /* The endpoint is held back for ‘retry_after_ms’ once rate limited */
+  test->n_limited = 1;
+
+  for (guint i = 0; i < 2; i++)
+    matrix_api_set_read_marker_async (api, "!room:example.org", message,
+                                      request_completed_cb, test);
+
+  test_server_wait_completed (test, 2);
+  g_assert_cmpint (test->times->len, ==, 2);
+
+  elapsed = g_array_index (test->times, gint64, 1) - g_array_index (test->times, gint64, 0);
+  g_assert_cmpint (elapsed, >=, 600 * 1000);
+}
+
 int
 main (int   argc,
       char *argv[])
 {
-  g_test_init (&argc, &argv, NULL);
+  g_test_init (&argc, &argv, G_TEST_OPTION_ISOLATE_DIRS, NULL);
 
   g_test_add_func ("/matrix/api/new", test_matrix_api_new);
+  g_test_add_func ("/matrix/api/requests", test_matrix_api_requests);
+  g_test_add_func ("/matrix/api/class_limit", test_matrix_api_class_limit);
+  g_test_add_func ("/matrix/api/media_limit", test_matrix_api_media_limit);
+  g_test_add_func ("/matrix/api/rate_limit", test_matrix_api_rate_limit);
+  g_test_add_func ("/matrix/api/retry_after", test_matrix_api_retry_after);
 
   return g_test_run ();
 }
@@ -0,0 +1,218 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* media-store.c
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+#include <string.h>
+
+#include "chatty-media-store.h"
+
+/* Save @contents in @n_chunks as if it's downloaded from @url */
+static char *
+media_store_write (const char *contents,
+                   guint       n_chunks,
+                   const char *url)
+{
+  g_autoptr(ChattyMediaWriter) writer = NULL;
+  g_autoptr(GError) error = NULL;
+  gsize length, chunk_size;
+  char *path;
+
+  writer = chatty_media_writer_new (url, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (writer);
+
+  length = strlen (contents);
+  chunk_size = length / n_chunks + 1;
+
+  for (gsize i = 0; i < length; i += chunk_size) {
+    chatty_media_writer_write (writer, contents + i, MIN (chunk_size, length - i),
+                               NULL, &error);
+    g_assert_no_error (error);
+  }
+
+  path = chatty_media_writer_finish (writer, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (path);
+
+  return path;
+}
+
+static char *
+media_store_get_file (const char *path)
+{
+  return g_build_filename (g_get_user_cache_dir (), "chatty", path, NULL);
+}
+
+static void
+test_media_store_writer (void)
+{
+  g_autofree char *path = NULL;
+  g_autofree char *other_path = NULL;
+  g_autofree char *file_name = NULL;
+  g_autofree char *contents = NULL;
+  g_autofree char *hash = NULL;
+  g_autofree char *expected = NULL;
+  g_autoptr(GDir) dir = NULL;
+  g_autofree char *tmp_dir = NULL;
+  g_autofree char *store_dir = NULL;
+
+  hash = g_compute_checksum_for_string (G_CHECKSUM_SHA256, "media content", -1);
+  expected = g_strdup_printf (CHATTY_MEDIA_STORE_DIR "/%.2s/%s", hash, hash);
+
+  path = media_store_write ("media content", 4, "mxc://example.org/file");
+  g_assert_cmpstr (path, ==, expected);
+  g_assert_true (chatty_media_store_is_blob (path));
+
+  file_name = media_store_get_file (path);
+  g_assert_true (g_file_get_contents (file_name, &contents, NULL, NULL));
+  g_assert_cmpstr (contents, ==, "media content");
+
+  /* The same content from a different URL is saved once */
+  other_path = media_store_write ("media content", 1, "mxc://example.com/copy");
+  g_assert_cmpstr (other_path, ==, path);
+
+  g_clear_pointer (&other_path, g_free);
+  other_path = chatty_media_store_lookup_url ("mxc://example.org/file");
+  g_assert_cmpstr (other_path, ==, path);
+  g_clear_pointer (&other_path, g_free);
+  other_path = chatty_media_store_lookup_url ("mxc://example.com/copy");
+  g_assert_cmpstr (other_path, ==, path);
+  g_assert_null (chatty_media_store_lookup_url ("mxc://example.org/unknown"));
+
+  /* No partial files should be left */
+  store_dir = chatty_media_store_get_dir ();
+  tmp_dir = g_build_filename (store_dir, "tmp", NULL);
+  dir = g_dir_open (tmp_dir, 0, NULL);
+  g_assert_nonnull (dir);
+  g_assert_null (g_dir_read_name (dir));
+
+  /* Removed files shouldn't be found from the URL */
+  g_assert_cmpint (g_remove (file_name), ==, 0);
+  g_assert_null (chatty_media_store_lookup_url ("mxc://example.org/file"));
+}
+
+static void
+test_media_store_discard (void)
+{
+  g_autoptr(ChattyMediaWriter) writer = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GDir) dir = NULL;
+  g_autofree char *store_dir = NULL;
+  g_autofree char *tmp_dir = NULL;
+
+  /* Incomplete files are removed */
+  writer = chatty_media_writer_new ("mxc://example.org/partial", NULL, &error);
+  g_assert_no_error (error);
+  chatty_media_writer_write (writer, "partial", 7, NULL, &error);
+  g_assert_no_error (error);
+  g_clear_pointer (&writer, chatty_media_writer_free);
+
+  store_dir = chatty_media_store_get_dir ();
+  tmp_dir = g_build_filename (store_dir, "tmp", NULL);
+  dir = g_dir_open (tmp_dir, 0, NULL);
+  g_assert_nonnull (dir);
+  g_assert_null (g_dir_read_name (dir));
+  g_assert_null (chatty_media_store_lookup_url ("mxc://example.org/partial"));
+}
+
+static void
+test_media_store_add_file (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree char *file_name = NULL;
+  g_autofree char *blob_file = NULL;
+  g_autofree char *path = NULL;
+  g_autofree char *other_path = NULL;
+  g_autofree char *contents = NULL;
+  GStatBuf stat_buf;
+  FILE *stream;
+
+  file_name = g_build_filename (g_get_user_cache_dir (), "chatty-media-test.png", NULL);
+  g_assert_true (g_file_set_contents (file_name, "local file", -1, NULL));
+
+  path = chatty_media_store_add_file (file_name, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (chatty_media_store_is_blob (path));
+
+  blob_file = media_store_get_file (path);
+  g_assert_true (g_file_test (blob_file, G_FILE_TEST_IS_REGULAR));
+  g_assert_true (g_file_test (file_name, G_FILE_TEST_IS_REGULAR));
+
+  /* The file is copied, so that changing it doesn't change the store */
+  g_assert_cmpint (g_stat (blob_file, &stat_buf), ==, 0);
+  g_assert_cmpint (stat_buf.st_nlink, ==, 1);
+  stream = g_fopen (file_name, "w");
+  g_assert_nonnull (stream);
+  fputs ("changed file", stream);
+  fclose (stream);
+  g_assert_true (g_file_get_contents (blob_file, &contents, NULL, NULL));
+  g_assert_cmpstr (contents, ==, "local file");
+  g_assert_true (g_file_set_contents (file_name, "local file", -1, NULL));
+
+  /* The same file added again shares the same path */
+  other_path = chatty_media_store_add_file (file_name, "https://example.org/local", &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (other_path, ==, path);
+
+  g_clear_pointer (&other_path, g_free);
+  other_path = chatty_media_store_lookup_url ("https://example.org/local");
+  g_assert_cmpstr (other_path, ==, path);
+
+  g_remove (file_name);
+  g_remove (blob_file);
+}
+
+static void
+test_media_store_is_blob (void)
+{
+  g_autofree char *hash = NULL;
+  g_autofree char *path = NULL;
+
+  hash = g_compute_checksum_for_string (G_CHECKSUM_SHA256, "test", -1);
+  path = g_strdup_printf (CHATTY_MEDIA_STORE_DIR "/%.2s/%s", hash, hash);
+  g_assert_true (chatty_media_store_is_blob (path));
+
+  g_assert_false (chatty_media_store_is_blob (NULL));
+  g_assert_false (chatty_media_store_is_blob (""));
+  g_assert_false (chatty_media_store_is_blob (hash));
+  g_assert_false (chatty_media_store_is_blob ("matrix/files/image.png"));
+  g_assert_false (chatty_media_store_is_blob (CHATTY_MEDIA_STORE_DIR "/tmp/0123456789abcdef"));
+
+  /* The directory should match the hash */
+  g_clear_pointer (&path, g_free);
+  path = g_strdup_printf (CHATTY_MEDIA_STORE_DIR "/00/%s", hash);
+  g_assert_false (chatty_media_store_is_blob (path));
+
+  g_clear_pointer (&path, g_free);
+  path = g_strdup_printf (CHATTY_MEDIA_STORE_DIR "/%.2s/%s/..", hash, hash);
+  g_assert_false (chatty_media_store_is_blob (path));
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, G_TEST_OPTION_ISOLATE_DIRS, NULL);
+
+  g_test_add_func ("/media-store/writer", test_media_store_writer);
+  g_test_add_func ("/media-store/discard", test_media_store_discard);
+  g_test_add_func ("/media-store/add_file", test_media_store_add_file);
+  g_test_add_func ("/media-store/is_blob", test_media_store_is_blob);
+
+  return g_test_run ();
+}
@@ -0,0 +1,223 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* notification-queue.c
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <glib.h>
+
+#include "chatty-notification-queue.h"
+
+typedef struct {
+  GPtrArray *chats;
+  GPtrArray *messages;
+  GArray    *counts;
+  guint      n_feedbacks;
+} Summary;
+
+static void
+show_summary_cb (ChattyNotificationQueue *queue,
+                 ChattyChat              *chat,
+                 ChattyMessage           *message,
+                 guint                    n_messages,
+                 const char              *name,
+                 Summary                 *summary)
+{
+  g_assert_true (CHATTY_IS_NOTIFICATION_QUEUE (queue));
+  g_assert_true (CHATTY_IS_CHAT (chat));
+  g_assert_true (CHATTY_IS_MESSAGE (message));
+  g_assert_cmpstr (name, ==, chatty_chat_get_chat_name (chat));
+
+  g_ptr_array_add (summary->chats, chat);
+  g_ptr_array_add (summary->messages, g_object_ref (message));
+  g_array_append_val (summary->counts, n_messages);
+}
+
+static void
+feedback_cb (ChattyNotificationQueue *queue,
+             Summary                 *summary)
+{
+  summary->n_feedbacks++;
+}
+
+static ChattyNotificationQueue *
+create_queue (Summary *summary,
+              guint    delay,
+              guint    feedback_interval)
+{
+  ChattyNotificationQueue *queue;
+
+  queue = chatty_notification_queue_new ();
+  chatty_notification_queue_set_delay (queue, delay);
+  chatty_notification_queue_set_feedback_interval (queue, feedback_interval);
+
+  summary->chats = g_ptr_array_new ();
+  summary->messages = g_ptr_array_new_with_free_func (g_object_unref);
+  summary->counts = g_array_new (FALSE, FALSE, sizeof (guint));
+  summary->n_feedbacks = 0;
+
+  g_signal_connect (queue, "show-summary", G_CALLBACK (show_summary_cb), summary);
+  g_signal_connect (queue, "feedback", G_CALLBACK (feedback_cb), summary);
+
+  return queue;
+}
+
+static void
+summary_reset (Summary *summary)
+{
+  g_ptr_array_set_size (summary->chats, 0);
+  g_ptr_array_set_size (summary->messages, 0);
+  g_array_set_size (summary->counts, 0);
+}
+
+static void
+summary_clear (Summary *summary)
+{
+  g_clear_pointer (&summary->chats, g_ptr_array_unref);
+  g_clear_pointer (&summary->messages, g_ptr_array_unref);
+  g_clear_pointer (&summary->counts, g_array_unref);
+}
+
+/* Add @n_messages to @chat, returns the last message added,
+ * which is kept alive by @queue until the summary is shown */
+static ChattyMessage *
+add_burst (ChattyNotificationQueue *queue,
+           ChattyChat              *chat,
+           guint                    n_messages)
+{
+  ChattyMessage *message = NULL;
+
+  for (guint i = 0; i < n_messages; i++) {
+    g_autofree char *text = g_strdup_printf ("Message %u", i);
+
+    message = chatty_message_new (NULL, text, NULL, time (NULL),
+                                  CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_IN, 0);
+    chatty_notification_queue_add (queue, chat, message,
+                                   chatty_chat_get_chat_name (chat));
+    g_object_unref (message);
+  }
+
+  return message;
+}
+
+static void
+wait_for_summaries (Summary *summary,
+                    guint    n_summaries)
+{
+  while (summary->chats->len < n_summaries)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+test_notification_queue_burst (void)
+{
+  g_autoptr(ChattyNotificationQueue) queue = NULL;
+  g_autoptr(ChattyChat) group = NULL;
+  g_autoptr(ChattyChat) buddy = NULL;
+  g_autoptr(ChattyChat) other = NULL;
+  ChattyMessage *last[2];
+  Summary summary;
+
+  queue = create_queue (&summary, 50, G_MAXUINT);
+  group = chatty_chat_new ("alice@example.com", "group@example.com", FALSE);
+  buddy = chatty_chat_new ("alice@example.com", "bob@example.com", TRUE);
+  other = chatty_chat_new ("alice@example.com", "carol@example.com", TRUE);
+
+  /* Interleaved bursts in different chats */
+  add_burst (queue, group, 150);
+  last[0] = add_burst (queue, buddy, 3);
+  add_burst (queue, group, 50);
+  last[1] = add_burst (queue, other, 1);
+
+  /* Nothing is shown until the delay is over, but feedback
+   * is given right away, once */
+  g_assert_cmpint (summary.chats->len, ==, 0);
+  g_assert_cmpint (summary.n_feedbacks, ==, 1);
+
+  wait_for_summaries (&summary, 3);
+
+  /* One summary per chat, in the order of the first message */
+  g_assert_cmpint (summary.chats->len, ==, 3);
+  g_assert_true (summary.chats->pdata[0] == group);
+  g_assert_true (summary.chats->pdata[1] == buddy);
+  g_assert_true (summary.chats->pdata[2] == other);
+  g_assert_true (summary.messages->pdata[1] == last[0]);
+  g_assert_true (summary.messages->pdata[2] == last[1]);
+  g_assert_cmpstr (chatty_message_get_text (summary.messages->pdata[0]), ==, "Message 49");
+  g_assert_cmpint (g_array_index (summary.counts, guint, 0), ==, 200);
+  g_assert_cmpint (g_array_index (summary.counts, guint, 1), ==, 3);
+  g_assert_cmpint (g_array_index (summary.counts, guint, 2), ==, 1);
+  g_assert_cmpint (summary.n_feedbacks, ==, 1);
+
+  /* A new burst within the feedback interval isn't felt again */
+  summary_reset (&summary);
+  add_burst (queue, buddy, 20);
+  wait_for_summaries (&summary, 1);
+  g_assert_cmpint (summary.chats->len, ==, 1);
+  g_assert_cmpint (g_array_index (summary.counts, guint, 0), ==, 20);
+  g_assert_cmpint (summary.n_feedbacks, ==, 1);
+
+  summary_clear (&summary);
+}
+
+static void
+test_notification_queue_rate_limit (void)
+{
+  g_autoptr(ChattyNotificationQueue) queue = NULL;
+  g_autoptr(ChattyChat) chat = NULL;
+  Summary summary;
+
+  /* No feedback interval, every message is felt */
+  queue = create_queue (&summary, 10, 0);
+  chat = chatty_chat_new ("alice@example.com", "bob@example.com", TRUE);
+  add_burst (queue, chat, 5);
+  g_assert_cmpint (summary.n_feedbacks, ==, 5);
+  wait_for_summaries (&summary, 1);
+  g_assert_cmpint (g_array_index (summary.counts, guint, 0), ==, 5);
+
+  /* Feedback is given again once the interval is over */
+  summary_reset (&summary);
+  summary.n_feedbacks = 0;
+  chatty_notification_queue_set_feedback_interval (queue, 20);
+  add_burst (queue, chat, 10);
+  g_assert_cmpint (summary.n_feedbacks, ==, 1);
+  g_usleep (30 * G_TIME_SPAN_MILLISECOND);
+  add_burst (queue, chat, 10);
+  g_assert_cmpint (summary.n_feedbacks, ==, 2);
+
+  /* Flushing shows pending messages right away */
+  chatty_notification_queue_flush (queue);
+  g_assert_cmpint (summary.chats->len, ==, 1);
+  g_assert_cmpint (g_array_index (summary.counts, guint, 0), ==, 20);
+
+  /* And nothing more is shown later */
+  g_usleep (20 * G_TIME_SPAN_MILLISECOND);
+  while (g_main_context_iteration (NULL, FALSE))
+    ;
+  g_assert_cmpint (summary.chats->len, ==, 1);
+
+  summary_clear (&summary);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/notification-queue/burst", test_notification_queue_burst);
+  g_test_add_func ("/notification-queue/rate-limit", test_notification_queue_rate_limit);
+
+  return g_test_run ();
+}
@@ -0,0 +1,364 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* receipts.c
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <glib/gstdio.h>
+
+#include "users/chatty-contact.h"
+#include "chatty-receipts.h"
+
+static ChattyMessage *
+new_sent_message (ChattyChat *chat,
+                  const char *uid)
+{
+  g_autoptr(ChattyContact) contact = NULL;
+
+  contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
+  chatty_contact_set_name (contact, chatty_chat_get_chat_name (chat));
+  chatty_contact_set_value (contact, chatty_chat_get_chat_name (chat));
+
+  return chatty_message_new (CHATTY_ITEM (contact), "Hello", uid, time (NULL),
+                             CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_OUT,
+                             CHATTY_STATUS_SENT);
+}
+
+static void
+finish_pointer_cb (GObject      *object,
+                   GAsyncResult *result,
+                   gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+  GTask *task = user_data;
+  gpointer data;
+
+  g_assert_true (G_IS_TASK (task));
+
+  data = g_task_propagate_pointer (G_TASK (result), &error);
+  g_assert_no_error (error);
+
+  g_task_return_pointer (task, data, NULL);
+}
+
+static void
+test_receipts_status (void)
+{
+  g_autoptr(ChattyReceipts) receipts = NULL;
+  g_autoptr(ChattyChat) chat = NULL;
+  g_autoptr(GPtrArray) messages = NULL;
+
+  receipts = chatty_receipts_new ();
+  chat = chatty_chat_new ("alice@example.com", "bob@example.com", TRUE);
+  messages = g_ptr_array_new_with_free_func (g_object_unref);
+
+  for (guint i = 0; i < 4; i++) {
+    g_autofree char *id = g_strdup_printf ("id-%u", i);
+    ChattyMessage *message;
+
+    message = new_sent_message (chat, id);
+    g_ptr_array_add (messages, message);
+    chatty_receipts_add (receipts, chat, id, message);
+  }
+
+  g_assert_false (chatty_receipts_set_delivered (receipts, "id-unknown"));
+  g_assert_false (chatty_receipts_set_read (receipts, "id-unknown"));
+
+  /* Only the exact message is delivered */
+  g_assert_true (chatty_receipts_set_delivered (receipts, "id-1"));
+  g_assert_cmpint (chatty_message_get_status (messages->pdata[0]), ==, CHATTY_STATUS_SENT);
+  g_assert_cmpint (chatty_message_get_status (messages->pdata[1]), ==, CHATTY_STATUS_DELIVERED);
+  g_assert_cmpint (chatty_message_get_status (messages->pdata[2]), ==, CHATTY_STATUS_SENT);
+
+  /* Handled receipts are no longer tracked */
+  g_assert_false (chatty_receipts_set_delivered (receipts, "id-1"));
+
+  /* Read is cumulative */
+  g_assert_true (chatty_receipts_set_read (receipts, "id-2"));
+  g_assert_cmpint (chatty_message_get_status (messages->pdata[0]), ==, CHATTY_STATUS_READ);
+  g_assert_cmpint (chatty_message_get_status (messages->pdata[1]), ==, CHATTY_STATUS_DELIVERED);
+  g_assert_cmpint (chatty_message_get_status (messages->pdata[2]), ==, CHATTY_STATUS_READ);
+  g_assert_cmpint (chatty_message_get_status (messages->pdata[3]), ==, CHATTY_STATUS_SENT);
+  g_assert_false (chatty_receipts_set_delivered (receipts, "id-0"));
+
+  g_assert_true (chatty_receipts_set_delivered (receipts, "id-3"));
+  g_assert_cmpint (chatty_message_get_status (messages->pdata[3]), ==, CHATTY_STATUS_DELIVERED);
+}
+
+static void
+test_receipts_read_until (void)
+{
+  g_autoptr(ChattyReceipts) receipts = NULL;
+  g_autoptr(ChattyChat) chat = NULL;
+  g_autoptr(ChattyChat) other = NULL;
+  g_autoptr(ChattyContact) contact = NULL;
+  g_autoptr(GPtrArray) messages = NULL;
+  g_autoptr(ChattyMessage) other_message = NULL;
+
+  receipts = chatty_receipts_new ();
+  chat = chatty_chat_new ("alice@example.com", "bob@example.com", TRUE);
+  other = chatty_chat_new ("alice@example.com", "carol@example.com", TRUE);
+  contact = g_object_new (CHATTY_TYPE_CONTACT, NULL);
+  messages = g_ptr_array_new_with_free_func (g_object_unref);
+
+  g_assert_false (chatty_receipts_set_read_until (receipts, chat, 1000));
+
+  for (guint i = 0; i < 4; i++) {
+    g_autofree char *id = g_strdup_printf ("id-%u", i);
+    ChattyMessage *message;
+
+    message = chatty_message_new (CHATTY_ITEM (contact), "Hello", id, 100 * (i + 1),
+                                  CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_OUT,
+                                  CHATTY_STATUS_SENT);
+    g_ptr_array_add (messages, message);
+    chatty_receipts_add (receipts, chat, id, message);
+  }
+
+  other_message = chatty_message_new (CHATTY_ITEM (contact), "Hello", "other-0", 100,
+                                      CHATTY_MESSAGE_TEXT, CHATTY_DIRECTION_OUT,
+                                      CHATTY_STATUS_SENT);
+  chatty_receipts_add (receipts, other, "other-0", other_message);
+  /* A receipt without a message yet is kept */
+  chatty_receipts_add (receipts, chat, "id-pending", NULL);
+
+  g_assert_false (chatty_receipts_set_read_until (receipts, chat, 50));
+
+  /* A receipt for a later message marks everything before as read */
+  g_assert_true (chatty_receipts_set_read_until (receipts, chat, 250));
+  g_assert_cmpint (chatty_message_get_status (messages->pdata[0]), ==, CHATTY_STATUS_READ);
+  g_assert_cmpint (chatty_message_get_status (messages->pdata[1]), ==, CHATTY_STATUS_READ);
+  g_assert_cmpint (chatty_message_get_status (messages->pdata[2]), ==, CHATTY_STATUS_SENT);
+  g_assert_cmpint (chatty_message_get_status (messages->pdata[3]), ==, CHATTY_STATUS_SENT);
+  g_assert_cmpint (chatty_message_get_status (other_message), ==, CHATTY_STATUS_SENT);
+  g_assert_false (chatty_receipts_set_read (receipts, "id-1"));
+
+  g_assert_true (chatty_receipts_set_read_until (receipts, chat, 400));
+  g_assert_cmpint (chatty_message_get_status (messages->pdata[2]), ==, CHATTY_STATUS_READ);
+  g_assert_cmpint (chatty_message_get_status (messages->pdata[3]), ==, CHATTY_STATUS_READ);
+  g_assert_false (chatty_receipts_set_read_until (receipts, chat, 400));
+
+  g_assert_true (chatty_receipts_set_delivered (receipts, "id-pending"));
+  g_assert_true (chatty_receipts_set_read (receipts, "other-0"));
+}
+
+static void
+test_receipts_message (void)
+{
+  g_autoptr(ChattyReceipts) receipts = NULL;
+  g_autoptr(ChattyChat) chat = NULL;
+  g_autoptr(ChattyChat) other = NULL;
+  g_autoptr(ChattyMessage) first = NULL;
+  g_autoptr(ChattyMessage) second = NULL;
+
+  receipts = chatty_receipts_new ();
+  chat = chatty_chat_new ("alice@example.com", "bob@example.com", TRUE);
+  other = chatty_chat_new ("alice@example.com", "carol@example.com", TRUE);
+  first = new_sent_message (chat, NULL);
+  second = new_sent_message (chat, NULL);
+
+  /* Ids are tracked before the messages are created */
+  chatty_receipts_add (receipts, chat, "stanza-1", NULL);
+  chatty_receipts_add (receipts, chat, "stanza-2", NULL);
+
+  g_assert_false (chatty_receipts_set_message (receipts, other, first));
+  g_assert_true (chatty_receipts_set_message (receipts, chat, first));
+  g_assert_true (chatty_receipts_set_message (receipts, chat, second));
+  g_assert_false (chatty_receipts_set_message (receipts, chat, second));
+
+  g_assert_true (chatty_receipts_set_delivered (receipts, "stanza-2"));
+  g_assert_cmpint (chatty_message_get_status (first), ==, CHATTY_STATUS_SENT);
+  g_assert_cmpint (chatty_message_get_status (second), ==, CHATTY_STATUS_DELIVERED);
+
+  g_assert_true (chatty_receipts_set_delivered (receipts, "stanza-1"));
+  g_assert_cmpint (chatty_message_get_status (first), ==, CHATTY_STATUS_DELIVERED);
+}
+
+static void
+test_receipts_early (void)
+{
+  g_autoptr(ChattyReceipts) receipts = NULL;
+  g_autoptr(ChattyChat) chat = NULL;
+  g_autoptr(ChattyMessage) first = NULL;
+  g_autoptr(ChattyMessage) second = NULL;
+  g_autoptr(ChattyMessage) third = NULL;
+
+  receipts = chatty_receipts_new ();
+  chat = chatty_chat_new ("alice@example.com", "bob@example.com", TRUE);
+  first = new_sent_message (chat, NULL);
+  second = new_sent_message (chat, NULL);
+  third = new_sent_message (chat, NULL);
+
+  chatty_receipts_add (receipts, chat, "stanza-1", NULL);
+  chatty_receipts_add (receipts, chat, "stanza-2", NULL);
+  chatty_receipts_add (receipts, chat, "stanza-3", NULL);
+
+  /* Receipts may arrive before the messages are written */
+  g_assert_true (chatty_receipts_set_delivered (receipts, "stanza-2"));
+  g_assert_true (chatty_receipts_set_read (receipts, "stanza-1"));
+  /* Kept until the message is set */
+  g_assert_true (chatty_receipts_set_delivered (receipts, "stanza-1"));
+
+  g_assert_true (chatty_receipts_set_message (receipts, chat, first));
+  g_assert_cmpint (chatty_message_get_status (first), ==, CHATTY_STATUS_READ);
+  g_assert_true (chatty_receipts_set_message (receipts, chat, second));
+  g_assert_cmpint (chatty_message_get_status (second), ==, CHATTY_STATUS_DELIVERED);
+
+  /* Handled once the message is set */
+  g_assert_false (chatty_receipts_set_delivered (receipts, "stanza-1"));
+  g_assert_false (chatty_receipts_set_delivered (receipts, "stanza-2"));
+
+  /* No receipt yet, so the status doesn't change */
+  g_assert_true (chatty_receipts_set_message (receipts, chat, third));
+  g_assert_cmpint (chatty_message_get_status (third), ==, CHATTY_STATUS_SENT);
+  g_assert_true (chatty_receipts_set_delivered (receipts, "stanza-3"));
+  g_assert_cmpint (chatty_message_get_status (third), ==, CHATTY_STATUS_DELIVERED);
+}
+
+static void
+test_receipts_chat (void)
+{
+  g_autoptr(ChattyReceipts) receipts = NULL;
+  g_autoptr(ChattyMessage) message = NULL;
+  ChattyChat *chat;
+
+  receipts = chatty_receipts_new ();
+  chat = chatty_chat_new ("alice@example.com", "bob@example.com", TRUE);
+  message = new_sent_message (chat, "id-0");
+
+  chatty_receipts_add (receipts, chat, "id-0", message);
+  chatty_receipts_remove_chat (receipts, chat);
+  g_assert_false (chatty_receipts_set_delivered (receipts, "id-0"));
+
+  /* Receipts are dropped when the chat is gone */
+  chatty_receipts_add (receipts, chat, "id-0", message);
+  g_object_unref (chat);
+  g_assert_false (chatty_receipts_set_read (receipts, "id-0"));
+  g_assert_cmpint (chatty_message_get_status (message), ==, CHATTY_STATUS_SENT);
+
+  /* Old receipts are dropped if the peer never answers */
+  chat = chatty_chat_new ("alice@example.com", "bob@example.com", TRUE);
+  for (guint i = 0; i < 1000; i++) {
+    g_autofree char *id = g_strdup_printf ("id-%u", i);
+
+    chatty_receipts_add (receipts, chat, id, message);
+  }
+
+  g_assert_false (chatty_receipts_set_delivered (receipts, "id-0"));
+  g_assert_true (chatty_receipts_set_delivered (receipts, "id-999"));
+  g_object_unref (chat);
+}
+
+static void
+test_receipts_history (void)
+{
+  g_autoptr(ChattyReceipts) receipts = NULL;
+  g_autoptr(ChattyHistory) history = NULL;
+  g_autoptr(ChattyChat) chat = NULL;
+  g_autoptr(ChattyChat) other = NULL;
+  g_autoptr(ChattyMessage) other_message = NULL;
+  g_autoptr(GPtrArray) messages = NULL;
+  GPtrArray *saved;
+  GTask *task;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-receipts.db", NULL));
+
+  history = chatty_history_new ();
+  chatty_history_open (history, g_test_get_dir (G_TEST_BUILT), "test-receipts.db");
+  g_assert_true (chatty_history_is_open (history));
+
+  receipts = chatty_receipts_new ();
+  chatty_receipts_set_history (receipts, history);
+  chat = chatty_chat_new ("alice@example.com", "bob@example.com", TRUE);
+  g_object_set (G_OBJECT (chat), "protocols", CHATTY_PROTOCOL_XMPP, NULL);
+  messages = g_ptr_array_new_with_free_func (g_object_unref);
+
+  for (guint i = 0; i < 3; i++) {
+    g_autofree char *id = g_strdup_printf ("id-%u", i);
+    ChattyMessage *message;
+
+    message = new_sent_message (chat, id);
+    g_ptr_array_add (messages, message);
+    g_assert_true (chatty_history_add_message (history, chat, message));
+    chatty_receipts_add (receipts, chat, id, message);
+  }
+
+  /* A message with the same uid in a different chat */
+  other = chatty_chat_new ("alice@example.com", "carol@example.com", TRUE);
+  g_object_set (G_OBJECT (other), "protocols", CHATTY_PROTOCOL_XMPP, NULL);
+  other_message = new_sent_message (other, "id-2");
+  g_assert_true (chatty_history_add_message (history, other, other_message));
+
+  chatty_receipts_set_delivered (receipts, "id-2");
+  chatty_receipts_set_read (receipts, "id-1");
+  chatty_receipts_save (receipts);
+
+  /* The history worker handles tasks in order, so
+   * the status is saved before messages are loaded */
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_get_messages_async (history, chat, NULL, -1, finish_pointer_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  saved = g_task_propagate_pointer (task, NULL);
+  g_clear_object (&task);
+  g_assert_nonnull (saved);
+  g_assert_cmpint (saved->len, ==, 3);
+
+  for (guint i = 0; i < saved->len; i++) {
+    ChattyMessage *message = saved->pdata[i];
+
+    g_assert_cmpstr (chatty_message_get_uid (message), ==,
+                     chatty_message_get_uid (messages->pdata[i]));
+    g_assert_cmpint (chatty_message_get_status (message), ==,
+                     chatty_message_get_status (messages->pdata[i]));
+  }
+
+  g_assert_cmpint (chatty_message_get_status (saved->pdata[0]), ==, CHATTY_STATUS_READ);
+  g_assert_cmpint (chatty_message_get_status (saved->pdata[1]), ==, CHATTY_STATUS_READ);
+  g_assert_cmpint (chatty_message_get_status (saved->pdata[2]), ==, CHATTY_STATUS_DELIVERED);
+  g_ptr_array_unref (saved);
+
+  /* Only the message in the chat of the receipt is updated */
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_get_messages_async (history, other, NULL, -1, finish_pointer_cb, task);
+
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  saved = g_task_propagate_pointer (task, NULL);
+  g_clear_object (&task);
+  g_assert_nonnull (saved);
+  g_assert_cmpint (saved->len, ==, 1);
+  g_assert_cmpint (chatty_message_get_status (saved->pdata[0]), ==, CHATTY_STATUS_SENT);
+  g_ptr_array_unref (saved);
+
+  chatty_history_close (history);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/receipts/status", test_receipts_status);
+  g_test_add_func ("/receipts/read-until", test_receipts_read_until);
+  g_test_add_func ("/receipts/message", test_receipts_message);
+  g_test_add_func ("/receipts/early", test_receipts_early);
+  g_test_add_func ("/receipts/chat", test_receipts_chat);
+  g_test_add_func ("/receipts/history", test_receipts_history);
+
+  return g_test_run ();
+}
@@ -134,6 +134,56 @@ test_settings_first_start (void)
   g_object_unref (settings);
 }
 
+static void
+test_settings_notification (void)
+{
+  ChattySettings *settings;
+  g_autoptr(GSettings) gsettings = NULL;
+
+  gsettings = g_settings_new ("sm.puri.Chatty");
+  g_settings_reset (gsettings, "notification-delay");
+  g_settings_reset (gsettings, "feedback-interval");
+
+  settings = chatty_settings_get_default ();
+  g_assert_cmpint (chatty_settings_get_notification_delay (settings), ==, 300);
+  g_assert_cmpint (chatty_settings_get_feedback_interval (settings), ==, 3000);
+
+  g_object_set (settings,
+                "notification-delay", 1000,
+                "feedback-interval", 0,
+                NULL);
+  g_assert_cmpint (chatty_settings_get_notification_delay (settings), ==, 1000);
+  g_assert_cmpint (chatty_settings_get_feedback_interval (settings), ==, 0);
+  g_assert_cmpint (g_settings_get_uint (gsettings, "notification-delay"), ==, 1000);
+  g_object_unref (settings);
+}
+
+static void
+test_settings_history_retention (void)
+{
+  ChattySettings *settings;
+  g_autoptr(GSettings) gsettings = NULL;
+
+  gsettings = g_settings_new ("sm.puri.Chatty");
+  g_settings_reset (gsettings, "history-max-days");
+  g_settings_reset (gsettings, "history-max-messages");
+
+  /* All history is kept by default */
+  settings = chatty_settings_get_default ();
+  g_assert_cmpint (chatty_settings_get_history_max_days (settings), ==, 0);
+  g_assert_cmpint (chatty_settings_get_history_max_messages (settings), ==, 0);
+
+  g_object_set (settings,
+                "history-max-days", 365,
+                "history-max-messages", 5000,
+                NULL);
+  g_assert_cmpint (chatty_settings_get_history_max_days (settings), ==, 365);
+  g_assert_cmpint (chatty_settings_get_history_max_messages (settings), ==, 5000);
+  g_assert_cmpint (g_settings_get_uint (gsettings, "history-max-days"), ==, 365);
+  g_assert_cmpint (g_settings_get_uint (gsettings, "history-max-messages"), ==, 5000);
+  g_object_unref (settings);
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -144,6 +194,8 @@ main (int   argc,
 
   g_test_add_func ("/settings/first_start", test_settings_first_start);
   g_test_add_func ("/settings/all_bool", test_settings_all_bool);
+  g_test_add_func ("/settings/notification", test_settings_notification);
+  g_test_add_func ("/settings/history_retention", test_settings_history_retention);
 
   return g_test_run ();
 }
@@ -0,0 +1,135 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* slice-list-model.c
+ *
+ * Copyright 2020 Purism SPC
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <glib.h>
+
+#include "contrib/gtk.h"
+
+typedef struct {
+  GString *changes;
+  guint    n_items;
+} Changes;
+
+static void
+items_changed_cb (GListModel *model,
+                  guint       position,
+                  guint       removed,
+                  guint       added,
+                  Changes    *changes)
+{
+  /* The model should be consistent on every emission */
+  g_assert_cmpint (position + removed, <=, changes->n_items);
+  changes->n_items = changes->n_items - removed + added;
+  g_assert_cmpint (g_list_model_get_n_items (model), ==, changes->n_items);
+
+  g_string_append_printf (changes->changes, "%u-%u+%u ", position, removed, added);
+}
+
+static GListStore *
+create_store (guint n_items)
+{
+  GListStore *store;
+
+  store = g_list_store_new (G_TYPE_OBJECT);
+
+  for (guint i = 0; i < n_items; i++) {
+    g_autoptr(GObject) item = NULL;
+
+    item = g_object_new (G_TYPE_OBJECT, NULL);
+    g_object_set_data (item, "index", GUINT_TO_POINTER (i));
+    g_list_store_append (store, item);
+  }
+
+  return store;
+}
+
+static void
+assert_slice (GListModel *model,
+              guint       offset,
+              guint       n_items)
+{
+  g_assert_cmpint (g_list_model_get_n_items (model), ==, n_items);
+
+  for (guint i = 0; i < n_items; i++) {
+    g_autoptr(GObject) item = NULL;
+
+    item = g_list_model_get_item (model, i);
+    g_assert_cmpint (GPOINTER_TO_UINT (g_object_get_data (item, "index")), ==, offset + i);
+  }
+}
+
+static void
+set_offset (GtkSliceListModel *slice,
+            Changes           *changes,
+            guint              offset,
+            const char        *expected)
+{
+  g_string_truncate (changes->changes, 0);
+  gtk_slice_list_model_set_offset (slice, offset);
+  g_assert_cmpstr (changes->changes->str, ==, expected);
+}
+
+static void
+test_slice_list_model_offset (void)
+{
+  g_autoptr(GListStore) store = NULL;
+  g_autoptr(GtkSliceListModel) slice = NULL;
+  Changes changes;
+
+  store = create_store (100);
+  slice = gtk_slice_list_model_new (G_LIST_MODEL (store), 50, 20);
+  changes.changes = g_string_new (NULL);
+  changes.n_items = 20;
+  g_signal_connect (slice, "items-changed",
+                    G_CALLBACK (items_changed_cb), &changes);
+  assert_slice (G_LIST_MODEL (slice), 50, 20);
+
+  /* Overlapping slices only change at the edges */
+  set_offset (slice, &changes, 60, "0-10+0 10-0+10 ");
+  assert_slice (G_LIST_MODEL (slice), 60, 20);
+
+  set_offset (slice, &changes, 50, "0-0+10 20-10+0 ");
+  assert_slice (G_LIST_MODEL (slice), 50, 20);
+
+  /* Disjoint slices replace every item */
+  set_offset (slice, &changes, 80, "0-20+20 ");
+  assert_slice (G_LIST_MODEL (slice), 80, 20);
+
+  /* Slices cut at the end of the model */
+  set_offset (slice, &changes, 85, "0-5+0 ");
+  assert_slice (G_LIST_MODEL (slice), 85, 15);
+
+  set_offset (slice, &changes, 75, "0-0+10 20-5+0 ");
+  assert_slice (G_LIST_MODEL (slice), 75, 20);
+
+  set_offset (slice, &changes, 75, "");
+  set_offset (slice, &changes, 200, "0-20+0 ");
+  assert_slice (G_LIST_MODEL (slice), 200, 0);
+
+  set_offset (slice, &changes, 0, "0-0+20 ");
+  assert_slice (G_LIST_MODEL (slice), 0, 20);
+
+  g_string_free (changes.changes, TRUE);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/slice-list-model/offset", test_slice_list_model_offset);
+
+  return g_test_run ();
+}
@@ -0,0 +1,274 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* sort-list-model.c
+ *
+ * Copyright 2020 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <glib.h>
+
+#include "contrib/gtk.h"
+
+#define N_CHATS       2000
+#define MSG_PER_SEC   50
+#define STREAM_SECS   20
+
+static int
+sort_by_time (gconstpointer a,
+              gconstpointer b,
+              gpointer      user_data)
+{
+  gint64 a_time, b_time;
+
+  a_time = *(gint64 *)g_object_get_data ((GObject *)a, "time");
+  b_time = *(gint64 *)g_object_get_data ((GObject *)b, "time");
+
+  /* Latest first */
+  if (a_time > b_time)
+    return -1;
+
+  return a_time < b_time;
+}
+
+static void
+items_changed_cb (GListModel *model,
+                  guint       position,
+                  guint       removed,
+                  guint       added,
+                  guint      *n_changed)
+{
+  *n_changed += MAX (removed, added);
+}
+
+static GListStore *
+create_store (guint n_items)
+{
+  GListStore *store;
+
+  store = g_list_store_new (G_TYPE_OBJECT);
+
+  for (guint i = 0; i < n_items; i++) {
+    g_autoptr(GObject) item = NULL;
+    gint64 *time;
+
+    item = g_object_new (G_TYPE_OBJECT, NULL);
+    time = g_new (gint64, 1);
+    *time = g_random_int_range (0, 100000);
+    g_object_set_data_full (item, "time", time, g_free);
+    g_list_store_append (store, item);
+  }
+
+  return store;
+}
+
+static void
+set_item_time (GListModel *model,
+               guint       position,
+               gint64      time)
+{
+  g_autoptr(GObject) item = NULL;
+
+  item = g_list_model_get_item (model, position);
+  *(gint64 *)g_object_get_data (item, "time") = time;
+}
+
+static void
+assert_sorted (GListModel *model)
+{
+  gint64 last_time = G_MAXINT64;
+  guint n_items;
+
+  n_items = g_list_model_get_n_items (model);
+
+  for (guint i = 0; i < n_items; i++) {
+    g_autoptr(GObject) item = NULL;
+    gint64 time;
+
+    item = g_list_model_get_item (model, i);
+    time = *(gint64 *)g_object_get_data (item, "time");
+    g_assert_cmpint (time, <=, last_time);
+    last_time = time;
+  }
+}
+
+static void
+test_sort_list_model_item_changed (void)
+{
+  g_autoptr(GtkSortListModel) sort_model = NULL;
+  g_autoptr(GtkSorter) sorter = NULL;
+  g_autoptr(GListStore) store = NULL;
+  g_autoptr(GObject) item = NULL;
+  g_autoptr(GObject) first = NULL;
+  guint n_changed = 0;
+
+  store = create_store (100);
+  sorter = gtk_custom_sorter_new (sort_by_time, NULL, NULL);
+  sort_model = gtk_sort_list_model_new (G_LIST_MODEL (store), sorter);
+  g_signal_connect (sort_model, "items-changed", G_CALLBACK (items_changed_cb), &n_changed);
+  assert_sorted (G_LIST_MODEL (sort_model));
+
+  /* Move the last item to the top */
+  item = g_list_model_get_item (G_LIST_MODEL (sort_model), 99);
+  *(gint64 *)g_object_get_data (item, "time") = 200000;
+  gtk_sort_list_model_item_changed (sort_model, item);
+  first = g_list_model_get_item (G_LIST_MODEL (sort_model), 0);
+  g_assert_true (first == item);
+  g_assert_cmpint (n_changed, ==, 100);
+  assert_sorted (G_LIST_MODEL (sort_model));
+
+  /* Nothing should change if the position is the same */
+  n_changed = 0;
+  *(gint64 *)g_object_get_data (item, "time") = 200001;
+  gtk_sort_list_model_item_changed (sort_model, item);
+  g_assert_cmpint (n_changed, ==, 0);
+
+  /* Move an item just by one position */
+  g_clear_object (&item);
+  item = g_list_model_get_item (G_LIST_MODEL (sort_model), 2);
+  *(gint64 *)g_object_get_data (item, "time") = 200000 - 1;
+  gtk_sort_list_model_item_changed (sort_model, item);
+  g_assert_cmpint (n_changed, ==, 2);
+  assert_sorted (G_LIST_MODEL (sort_model));
+
+  /* Items added and removed later should be tracked too */
+  n_changed = 0;
+  g_list_store_remove (store, 0);
+  g_clear_object (&item);
+  item = g_list_model_get_item (G_LIST_MODEL (store), 0);
+  *(gint64 *)g_object_get_data (item, "time") = 300000;
+  gtk_sort_list_model_item_changed (sort_model, item);
+  g_clear_object (&first);
+  first = g_list_model_get_item (G_LIST_MODEL (sort_model), 0);
+  g_assert_true (first == item);
+  assert_sorted (G_LIST_MODEL (sort_model));
+
+  /* Unknown items should be ignored */
+  g_clear_object (&item);
+  item = g_object_new (G_TYPE_OBJECT, NULL);
+  n_changed = 0;
+  gtk_sort_list_model_item_changed (sort_model, item);
+  g_assert_cmpint (n_changed, ==, 0);
+}
+
+static void
+test_sort_list_model_duplicate_item (void)
+{
+  g_autoptr(GtkSortListModel) sort_model = NULL;
+  g_autoptr(GtkSorter) sorter = NULL;
+  g_autoptr(GListStore) store = NULL;
+  g_autoptr(GObject) item = NULL;
+  g_autoptr(GObject) first = NULL;
+  guint n_changed = 0;
+
+  store = create_store (10);
+  sorter = gtk_custom_sorter_new (sort_by_time, NULL, NULL);
+  sort_model = gtk_sort_list_model_new (G_LIST_MODEL (store), sorter);
+
+  /* Add the same item twice */
+  item = g_list_model_get_item (G_LIST_MODEL (store), 5);
+  g_list_store_append (store, item);
+  g_signal_connect (sort_model, "items-changed", G_CALLBACK (items_changed_cb), &n_changed);
+
+  /* Removing one copy should still keep the other one tracked */
+  g_list_store_remove (store, 10);
+  n_changed = 0;
+  *(gint64 *)g_object_get_data (item, "time") = 200000;
+  gtk_sort_list_model_item_changed (sort_model, item);
+  first = g_list_model_get_item (G_LIST_MODEL (sort_model), 0);
+  g_assert_true (first == item);
+  g_assert_cmpint (n_changed, >, 0);
+  assert_sorted (G_LIST_MODEL (sort_model));
+
+  /* Same, but removing the copy added first */
+  g_list_store_insert (store, 0, item);
+  g_list_store_remove (store, 6);
+  *(gint64 *)g_object_get_data (item, "time") = -1;
+  gtk_sort_list_model_item_changed (sort_model, item);
+  assert_sorted (G_LIST_MODEL (sort_model));
+
+  /* Both copies are moved when the item changes */
+  g_list_store_append (store, item);
+  *(gint64 *)g_object_get_data (item, "time") = 300000;
+  gtk_sort_list_model_item_changed (sort_model, item);
+  assert_sorted (G_LIST_MODEL (sort_model));
+  g_clear_object (&first);
+  first = g_list_model_get_item (G_LIST_MODEL (sort_model), 1);
+  g_assert_true (first == item);
+}
+
+/*
+ * Simulate an incoming stream of MSG_PER_SEC messages per second
+ * to random chats for STREAM_SECS seconds with N_CHATS chats, and
+ * compare a full resort per message with moving just the chat.
+ */
+static void
+test_sort_list_model_benchmark (void)
+{
+  g_autoptr(GtkSortListModel) sort_model = NULL;
+  g_autoptr(GtkSorter) sorter = NULL;
+  g_autoptr(GListStore) store = NULL;
+  g_autoptr(GTimer) timer = NULL;
+  guint n_changed = 0, n_messages;
+  gint64 time = 200000;
+  double elapsed;
+
+  if (!g_test_perf ())
+    return;
+
+  n_messages = MSG_PER_SEC * STREAM_SECS;
+  store = create_store (N_CHATS);
+  sorter = gtk_custom_sorter_new (sort_by_time, NULL, NULL);
+  sort_model = gtk_sort_list_model_new (G_LIST_MODEL (store), sorter);
+  g_signal_connect (sort_model, "items-changed", G_CALLBACK (items_changed_cb), &n_changed);
+  timer = g_timer_new ();
+
+  for (guint i = 0; i < n_messages; i++) {
+    set_item_time (G_LIST_MODEL (store), g_random_int_range (0, N_CHATS), time++);
+    gtk_sorter_changed (sorter, GTK_SORTER_CHANGE_DIFFERENT);
+  }
+
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_test_message ("Full resort: %u messages, %u chats: %.2f ms/message, %u rows changed",
+                  n_messages, N_CHATS, elapsed * 1000 / n_messages, n_changed);
+  assert_sorted (G_LIST_MODEL (sort_model));
+
+  n_changed = 0;
+  g_timer_start (timer);
+
+  for (guint i = 0; i < n_messages; i++) {
+    g_autoptr(GObject) item = NULL;
+
+    item = g_list_model_get_item (G_LIST_MODEL (store), g_random_int_range (0, N_CHATS));
+    *(gint64 *)g_object_get_data (item, "time") = time++;
+    gtk_sort_list_model_item_changed (sort_model, item);
+  }
+
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_test_minimized_result (elapsed * 1000 / n_messages,
+                           "Incremental: %u messages, %u chats: %.4f ms/message, %u rows changed",
+                           n_messages, N_CHATS, elapsed * 1000 / n_messages, n_changed);
+  assert_sorted (G_LIST_MODEL (sort_model));
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/sort-list-model/item-changed", test_sort_list_model_item_changed);
+  g_test_add_func ("/sort-list-model/duplicate-item", test_sort_list_model_duplicate_item);
+  g_test_add_func ("/sort-list-model/benchmark", test_sort_list_model_benchmark);
+
+  return g_test_run ();
+}
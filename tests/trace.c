@@ -0,0 +1,185 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* trace.c
+ *
+ * Copyright 2021 Purism SPC
+ *
+ * Author(s):
+ *   Mohammed Sadiq <sadiq@sadiqpk.org>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#define G_LOG_DOMAIN "chatty-test-trace"
+
+#include <glib/gstdio.h>
+#include <json-glib/json-glib.h>
+
+#include "chatty-trace.h"
+
+static JsonArray *
+trace_load_events (void)
+{
+  g_autoptr(JsonParser) parser = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *file_name = NULL;
+  JsonObject *root;
+
+  file_name = g_build_filename (g_get_tmp_dir (), "chatty-test-trace.json", NULL);
+  chatty_trace_export (file_name, &error);
+  g_assert_no_error (error);
+
+  parser = json_parser_new ();
+  json_parser_load_from_file (parser, file_name, &error);
+  g_assert_no_error (error);
+  g_remove (file_name);
+
+  root = json_node_get_object (json_parser_get_root (parser));
+  g_assert_nonnull (root);
+
+  return json_array_ref (json_object_get_array_member (root, "traceEvents"));
+}
+
+/* Find the last event with @phase and @name */
+static JsonObject *
+trace_find_event (JsonArray  *events,
+                  const char *phase,
+                  const char *name)
+{
+  for (guint i = json_array_get_length (events); i > 0; i--) {
+    JsonObject *event = json_array_get_object_element (events, i - 1);
+
+    if (g_strcmp0 (json_object_get_string_member (event, "ph"), phase) == 0 &&
+        g_strcmp0 (json_object_get_string_member (event, "name"), name) == 0)
+      return event;
+  }
+
+  return NULL;
+}
+
+static void
+trace_nested_span (void)
+{
+  CHATTY_TRACE_SPAN ("inner");
+
+  g_usleep (1000);
+}
+
+static void
+test_trace_span (void)
+{
+  g_autoptr(JsonArray) events = NULL;
+  JsonObject *outer, *inner, *event;
+
+  {
+    CHATTY_TRACE_SPAN ("outer");
+
+    chatty_trace_begin (G_LOG_DOMAIN, "begin-end");
+    trace_nested_span ();
+    chatty_trace_end (G_LOG_DOMAIN, "begin-end");
+  }
+
+  chatty_trace_counter ("queue", 42);
+  chatty_trace_async (G_LOG_DOMAIN, "request", 7, 100, 300);
+
+  events = trace_load_events ();
+
+  outer = trace_find_event (events, "X", "outer");
+  inner = trace_find_event (events, "X", "inner");
+  g_assert_nonnull (outer);
+  g_assert_nonnull (inner);
+  g_assert_cmpstr (json_object_get_string_member (outer, "cat"), ==, G_LOG_DOMAIN);
+  g_assert_cmpint (json_object_get_int_member (inner, "dur"), >=, 1000);
+  g_assert_cmpint (json_object_get_int_member (outer, "tid"), ==,
+                   json_object_get_int_member (inner, "tid"));
+
+  /* The inner span should be within the outer one */
+  g_assert_cmpint (json_object_get_int_member (inner, "ts"), >=,
+                   json_object_get_int_member (outer, "ts"));
+  g_assert_cmpint (json_object_get_int_member (inner, "ts") +
+                   json_object_get_int_member (inner, "dur"), <=,
+                   json_object_get_int_member (outer, "ts") +
+                   json_object_get_int_member (outer, "dur"));
+
+  g_assert_nonnull (trace_find_event (events, "B", "begin-end"));
+  g_assert_nonnull (trace_find_event (events, "E", "begin-end"));
+
+  event = trace_find_event (events, "C", "queue");
+  g_assert_nonnull (event);
+  g_assert_cmpint (json_object_get_int_member (json_object_get_object_member (event, "args"),
+                                               "value"), ==, 42);
+
+  event = trace_find_event (events, "b", "request");
+  g_assert_nonnull (event);
+  g_assert_cmpint (json_object_get_int_member (event, "ts"), ==, 100);
+  event = trace_find_event (events, "e", "request");
+  g_assert_nonnull (event);
+  g_assert_cmpint (json_object_get_int_member (event, "ts"), ==, 300);
+}
+
+static gpointer
+trace_thread (gpointer user_data)
+{
+  /* More events than a buffer can keep */
+  for (guint i = 0; i < 20000; i++)
+    chatty_trace_counter ("thread-counter", i);
+
+  return NULL;
+}
+
+static void
+test_trace_thread (void)
+{
+  g_autoptr(JsonArray) events = NULL;
+  JsonObject *event;
+  GThread *thread;
+  guint n_events = 0;
+  gint64 tid = -1;
+
+  thread = g_thread_new ("trace-test", trace_thread, NULL);
+  g_thread_join (thread);
+
+  events = trace_load_events ();
+  event = trace_find_event (events, "C", "thread-counter");
+  g_assert_nonnull (event);
+  g_assert_cmpint (json_object_get_int_member (json_object_get_object_member (event, "args"),
+                                               "value"), ==, 19999);
+  tid = json_object_get_int_member (event, "tid");
+
+  for (guint i = 0; i < json_array_get_length (events); i++) {
+    event = json_array_get_object_element (events, i);
+
+    if (json_object_get_int_member (event, "tid") == tid &&
+        g_strcmp0 (json_object_get_string_member (event, "ph"), "C") == 0)
+      n_events++;
+
+    /* Thread names are saved as metadata */
+    if (json_object_get_int_member (event, "tid") == tid &&
+        g_strcmp0 (json_object_get_string_member (event, "ph"), "M") == 0)
+      g_assert_cmpstr (json_object_get_string_member (json_object_get_object_member (event, "args"),
+                                                      "name"), ==, "trace-test");
+  }
+
+  /* Only the latest events are kept */
+  g_assert_cmpint (n_events, >, 0);
+  g_assert_cmpint (n_events, <, 20000);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  chatty_trace_init ();
+
+  g_test_add_func ("/trace/span", test_trace_span);
+  g_test_add_func ("/trace/thread", test_trace_thread);
+
+  return g_test_run ();
+}
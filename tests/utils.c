@@ -98,6 +98,112 @@ test_phone_utils_check_phone (void)
   }
 }
 
+static void
+test_phone_utils_normalize (void)
+{
+  g_autoptr(GPtrArray) batch = NULL;
+  const char *numbers[G_N_ELEMENTS (valid)];
+  ChattyPhoneType types[G_N_ELEMENTS (valid)];
+  ChattyPhoneType type;
+  guint hits, misses, n_hits, n_misses;
+  char *normalized;
+
+  chatty_phone_utils_clear_cache ();
+
+  for (guint i = 0; i < G_N_ELEMENTS (valid); i++) {
+    normalized = chatty_phone_utils_normalize (valid[i][0], valid[i][1], &type);
+    g_assert_nonnull (normalized);
+    g_assert_true (g_str_has_prefix (normalized, "+"));
+    g_assert_cmpint (type, !=, CHATTY_PHONE_TYPE_UNKNOWN);
+    g_free (normalized);
+  }
+
+  for (guint i = 0; i < G_N_ELEMENTS (invalid); i++) {
+    normalized = chatty_phone_utils_normalize (invalid[i][0], invalid[i][1], &type);
+    g_assert_null (normalized);
+    g_assert_cmpint (type, ==, CHATTY_PHONE_TYPE_UNKNOWN);
+  }
+
+  normalized = chatty_phone_utils_normalize ("9633 123 456", "IN", NULL);
+  g_assert_cmpstr (normalized, ==, "+919633123456");
+  g_free (normalized);
+
+  normalized = chatty_phone_utils_normalize ("+91 9633 123 456", NULL, NULL);
+  g_assert_cmpstr (normalized, ==, "+919633123456");
+  g_free (normalized);
+
+  g_assert_null (chatty_phone_utils_normalize ("9633 123 456", NULL, NULL));
+  g_assert_null (chatty_phone_utils_normalize (NULL, "IN", NULL));
+
+  /* Same numbers should be served from cache */
+  chatty_phone_utils_get_cache_stats (&hits, &misses);
+  g_assert_true (chatty_phone_utils_is_valid ("9633 123 456", "IN"));
+  g_assert_true (chatty_phone_utils_is_possible ("9633 123 456", "IN"));
+  chatty_phone_utils_get_cache_stats (&n_hits, &n_misses);
+  g_assert_cmpint (n_hits, ==, hits + 2);
+  g_assert_cmpint (n_misses, ==, misses);
+
+  for (guint i = 0; i < G_N_ELEMENTS (valid); i++)
+    numbers[i] = valid[i][0];
+
+  batch = chatty_phone_utils_normalize_batch (numbers, G_N_ELEMENTS (numbers), "IN", types);
+  g_assert_cmpint (batch->len, ==, G_N_ELEMENTS (numbers));
+
+  for (guint i = 0; i < batch->len; i++) {
+    g_autofree char *expected = NULL;
+
+    expected = chatty_phone_utils_normalize (numbers[i], "IN", &type);
+    g_assert_cmpstr (batch->pdata[i], ==, expected);
+    g_assert_cmpint (types[i], ==, type);
+  }
+}
+
+/*
+ * Normalize an address book of 50k numbers, and then
+ * the numbers of a few chats repeatedly, as done when
+ * matching incoming messages to contacts.
+ */
+static void
+test_phone_utils_normalize_benchmark (void)
+{
+  g_autoptr(GPtrArray) numbers = NULL;
+  g_autoptr(GPtrArray) normalized = NULL;
+  g_autoptr(GTimer) timer = NULL;
+  guint n_numbers = 50000, hits, misses;
+  double elapsed;
+
+  if (!g_test_perf ())
+    return;
+
+  numbers = g_ptr_array_new_full (n_numbers, g_free);
+
+  for (guint i = 0; i < n_numbers; i++)
+    g_ptr_array_add (numbers, g_strdup_printf ("+91 96%08u", g_random_int_range (0, 100000000)));
+
+  chatty_phone_utils_clear_cache ();
+  timer = g_timer_new ();
+  normalized = chatty_phone_utils_normalize_batch ((const char * const *)numbers->pdata,
+                                                   n_numbers, "IN", NULL);
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_test_minimized_result (elapsed * 1000,
+                           "Normalized %u numbers: %.2f ms, %.4f ms/number",
+                           n_numbers, elapsed * 1000, elapsed * 1000 / n_numbers);
+
+  chatty_phone_utils_clear_cache ();
+  g_timer_start (timer);
+
+  for (guint i = 0; i < n_numbers; i++) {
+    g_autofree char *number = NULL;
+
+    number = chatty_phone_utils_normalize (numbers->pdata[i % 1000], "IN", NULL);
+  }
+
+  elapsed = g_timer_elapsed (timer, NULL);
+  chatty_phone_utils_get_cache_stats (&hits, &misses);
+  g_test_minimized_result (elapsed * 1000,
+                           "Normalized 1000 numbers %u times: %.2f ms, %u hits, %u misses",
+                           n_numbers / 1000, elapsed * 1000, hits, misses);
+}
 
 static void
 test_utils_username_valid (void)
@@ -189,6 +295,8 @@ main (int   argc,
 
   g_test_add_func ("/phone-utils/valid", test_phone_utils_valid);
   g_test_add_func ("/utils/check-phone", test_phone_utils_check_phone);
+  g_test_add_func ("/phone-utils/normalize", test_phone_utils_normalize);
+  g_test_add_func ("/phone-utils/normalize-benchmark", test_phone_utils_normalize_benchmark);
   g_test_add_func ("/utils/username_valid", test_utils_username_valid);
   g_test_add_func ("/utils/groupname_valid", test_utils_groupname_valid);
 